@@ -2,10 +2,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include "16x50.h"
+#include "console.h"
+#include "chardev.h"
+#include "trace.h"
 
-/* UART: very mimimal for the moment */
+/*
+ *	16550A UART. With FCR bit 0 clear it behaves as a 16450 with single
+ *	byte holding registers. With the FIFOs on the receiver interrupts
+ *	at the FCR trigger level, or with a character timeout once the line
+ *	has been quiet for four character times with data below the
+ *	trigger, and the transmitter takes 16 bytes per THRE interrupt.
+ *
+ *	Each uart16x50_event() is one character time. A board that does
+ *	not pace the calls at the baud rate leaves the UART unthrottled, so
+ *	the receive FIFO is topped up from the host whenever the guest
+ *	looks and the timeout is one event.
+ */
+
+#define FIFO_SIZE	16
 
 struct uart16x50 {
     uint8_t ier;
@@ -23,9 +40,21 @@ struct uart16x50 {
 #define RXDA	1
 #define TEMT	2
 #define MODEM	8
+#define RXTO	16		/* Internal: character timeout */
     uint8_t irqline;
+    uint8_t rxfifo[FIFO_SIZE];
+    uint8_t rxhead;
+    uint8_t rxcount;
+    uint8_t rxquiet;		/* Character times since RX was last touched */
+    uint8_t txfifo[FIFO_SIZE];
+    uint8_t txhead;
+    uint8_t txcount;
+    uint8_t thre;		/* THRE interrupt outstanding */
     int trace;
     int input;
+    struct chardev *dev;
+    int unthrottled;
+    unsigned long long bytes;	/* Moved either way, for the metrics */
 };
 
 void uart16x50_reset(struct uart16x50 *uptr)
@@ -33,67 +62,145 @@ void uart16x50_reset(struct uart16x50 *uptr)
     uptr->dlab = 0;
 }
 
-/* Compute the interrupt indicator register from what is pending */
-static void uart16x50_recalc_iir(struct uart16x50 *uptr)
+static unsigned int uart16x50_depth(struct uart16x50 *uptr)
+{
+    return (uptr->fcr & 0x01) ? FIFO_SIZE : 1;
+}
+
+static unsigned int uart16x50_trigger(struct uart16x50 *uptr)
 {
+    static const uint8_t level[4] = { 1, 4, 8, 14 };
+
+    if (!(uptr->fcr & 0x01))
+        return 1;
+    return level[uptr->fcr >> 6];
+}
+
+/* Work out the pending sources and the IIR from the current state */
+static void uart16x50_irq_update(struct uart16x50 *uptr)
+{
+    uint8_t irq = 0;
+    uint8_t mask;
+
+    if (uptr->rxcount >= uart16x50_trigger(uptr))
+        irq |= RXDA;
+    else if (uptr->rxcount && (uptr->fcr & 0x01) &&
+             uptr->rxquiet >= (uptr->unthrottled ? 1 : 4))
+        irq |= RXTO;
+    if (uptr->thre)
+        irq |= TEMT;
+    if (uptr->msr & 0x0F)
+        irq |= MODEM;
+    /* Timeout is enabled along with receive data */
+    mask = uptr->ier;
+    if (mask & RXDA)
+        mask |= RXTO;
+    uptr->irq = irq & mask;
+
     if (uptr->irq & RXDA)
         uptr->iir = 0x04;
+    else if (uptr->irq & RXTO)
+        uptr->iir = 0x0C;
     else if (uptr->irq & TEMT)
         uptr->iir = 0x02;
     else if (uptr->irq & MODEM)
         uptr->iir = 0x00;
-    else {
+    else
         uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
+    if (uptr->fcr & 0x01)
+        uptr->iir |= 0xC0;
     uptr->irqline = uptr->irq;
 }
 
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart16x50_interrupt(struct uart16x50 *uptr, uint8_t n)
+/* Host side status. With RTS off input is left with the sender */
+static unsigned int uart16x50_chario(struct uart16x50 *uptr)
 {
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
+    unsigned int r;
+
+    if (uptr->dev == NULL)
+        return check_chario();
+    r = chardev_status(uptr->dev);
+    if (!(uptr->mcr & 2))
+        r &= ~1;
+    return r;
+}
+
+/* Take one byte from the host if it has one and there is room */
+static int uart16x50_rx(struct uart16x50 *uptr)
+{
+    uint8_t c;
+
+    if (!uptr->input || uptr->rxcount == uart16x50_depth(uptr))
+        return 0;
+    if (!(uart16x50_chario(uptr) & 1))
+        return 0;
+    c = uptr->dev ? chardev_getc(uptr->dev) : next_char();
+    uptr->rxfifo[(uptr->rxhead + uptr->rxcount++) % FIFO_SIZE] = c;
+    uptr->rxquiet = 0;
+    uptr->bytes++;
+    return 1;
+}
+
+/* Hand what the host has room for over and note when we run dry */
+static void uart16x50_tx(struct uart16x50 *uptr)
+{
+    if (uptr->txcount == 0)
         return;
-    uptr->irq |= n;
-    uart16x50_recalc_iir(uptr);
+    while (uptr->txcount && (uart16x50_chario(uptr) & 2)) {
+        uint8_t c = uptr->txfifo[uptr->txhead];
+        uptr->txhead = (uptr->txhead + 1) % FIFO_SIZE;
+        uptr->txcount--;
+        if (uptr->dev)
+            chardev_putc(uptr->dev, c);
+        else
+            console_putc(c);
+        uptr->bytes++;
+    }
+    if (uptr->txcount == 0)
+        uptr->thre = 1;
 }
 
-static void uart16x50_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
+/* Follow CTS, DSR and DCD from the host device */
+static void uart16x50_modem(struct uart16x50 *uptr)
 {
-    if (!(uptr->irq & n))
+    uint8_t lines = 0;
+    uint8_t delta;
+
+    if (chardev_cts(uptr->dev))
+        lines |= 0x10;
+    if (chardev_connected(uptr->dev))
+        lines |= 0xA0;
+    delta = (uptr->msr ^ lines) & 0xB0;
+    if (delta == 0)
         return;
-    uptr->irq &= ~n;
-    uart16x50_recalc_iir(uptr);
+    if (delta & 0x10)
+        uptr->msr |= 0x01;
+    if (delta & 0x20)
+        uptr->msr |= 0x02;
+    if (delta & 0x80)
+        uptr->msr |= 0x08;
+    uptr->msr = (uptr->msr & 0x4F) | lines;
 }
 
 void uart16x50_event(struct uart16x50 *uptr)
 {
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-    if ((r & 1) && uptr->input)
-        uptr->lsr |= 0x01;	/* RX not empty */
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart16x50_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart16x50_interrupt(uptr, TEMT);
+    uart16x50_tx(uptr);
+    if (uptr->unthrottled) {
+        if (!uart16x50_rx(uptr) && uptr->rxquiet < 255)
+            uptr->rxquiet++;
+        while (uart16x50_rx(uptr));
+    } else if (!uart16x50_rx(uptr) && uptr->rxquiet < 255)
+        uptr->rxquiet++;
+    if (uptr->dev)
+        uart16x50_modem(uptr);
+    uart16x50_irq_update(uptr);
 }
 
 static void show_settings(struct uart16x50 *uptr)
 {
     uint32_t baud;
 
-    if (uptr->trace == 0)
+    if (TRACE_ON(uptr->trace) == 0)
         return;
 
     baud = uptr->ls + (uptr->ms << 8);
@@ -148,9 +255,12 @@ void uart16x50_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
     switch(addr) {
     case 0:	/* If dlab = 0, then write else LS*/
         if (uptr->dlab == 0) {
-            write(1, &val, 1);
-            uart16x50_clear_interrupt(uptr, TEMT);
-            uart16x50_interrupt(uptr, TEMT);
+            /* A full FIFO loses the byte as on the real part */
+            if (uptr->txcount < uart16x50_depth(uptr)) {
+                uptr->txfifo[(uptr->txhead + uptr->txcount++) % FIFO_SIZE] = val;
+                uptr->thre = 0;
+                uart16x50_tx(uptr);
+            }
         } else {
             uptr->ls = val;
             show_settings(uptr);
@@ -161,11 +271,26 @@ void uart16x50_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
             uptr->ms= val;
             show_settings(uptr);
         }
-        else
-            uptr->ier = val;
+        else {
+            /* Enabling THRE with the transmitter empty interrupts */
+            if ((val & ~uptr->ier & TEMT) && uptr->txcount == 0)
+                uptr->thre = 1;
+            uptr->ier = val & 0x0F;
+        }
         break;
     case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
+        /* Switching the FIFOs on or off empties them */
+        if ((val ^ uptr->fcr) & 0x01)
+            val |= 0x06;
+        if (val & 0x02) {
+            uptr->rxcount = 0;
+            uptr->rxquiet = 0;
+        }
+        if (val & 0x04 && uptr->txcount) {
+            uptr->txcount = 0;
+            uptr->thre = 1;
+        }
+        uptr->fcr = val & 0xC9;
         break;
     case 3:	/* LCR */
         uptr->lcr = val;
@@ -184,6 +309,7 @@ void uart16x50_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
         uptr->scratch = val;
         break;
     }
+    uart16x50_irq_update(uptr);
 }
 
 uint8_t uart16x50_read(struct uart16x50 *uptr, uint8_t addr)
@@ -194,10 +320,19 @@ uint8_t uart16x50_read(struct uart16x50 *uptr, uint8_t addr)
     case 0:
         /* receive buffer */
         if (uptr->dlab == 0) {
-            uart16x50_clear_interrupt(uptr, RXDA);
-            if (uptr->input)
-                return next_char();
-            return 0xFF;
+            if (uptr->unthrottled && uptr->rxcount == 0)
+                uart16x50_rx(uptr);
+            if (uptr->rxcount == 0)
+                return 0xFF;
+            r = uptr->rxfifo[uptr->rxhead];
+            uptr->rxhead = (uptr->rxhead + 1) % FIFO_SIZE;
+            uptr->rxcount--;
+            uptr->rxquiet = 0;
+            /* Unthrottled the next byte is there straight away */
+            if (uptr->unthrottled)
+                uart16x50_rx(uptr);
+            uart16x50_irq_update(uptr);
+            return r;
         } else
             return uptr->ls;
         break;
@@ -208,8 +343,13 @@ uint8_t uart16x50_read(struct uart16x50 *uptr, uint8_t addr)
         else
             return uptr->ms;
     case 2:
-        /* IIR */
-        return uptr->iir;
+        /* IIR. Reading it with THRE as the cause clears that */
+        r = uptr->iir;
+        if ((r & 0x0F) == 0x02) {
+            uptr->thre = 0;
+            uart16x50_irq_update(uptr);
+        }
+        return r;
     case 3:
         /* LCR */
         return uptr->lcr;
@@ -218,22 +358,22 @@ uint8_t uart16x50_read(struct uart16x50 *uptr, uint8_t addr)
         return uptr->mcr;
     case 5:
         /* lsr */
-        r = check_chario();
-        uptr->lsr = 0;
-        if (r & 1)
-             uptr->lsr |= 0x01;	/* Data ready */
-        if (r & 2)
-             uptr->lsr |= 0x60;	/* TX empty | holding empty */
-        /* Reading the LSR causes these bits to clear */
-        r = uptr->lsr;
-        uptr->lsr &= 0xF0;
+        if (uptr->unthrottled && uptr->rxcount == 0 &&
+            uart16x50_rx(uptr))
+            uart16x50_irq_update(uptr);
+        uart16x50_tx(uptr);
+        r = 0;
+        if (uptr->rxcount)
+            r |= 0x01;	/* Data ready */
+        if (uptr->txcount == 0)
+            r |= 0x60;	/* TX empty | holding empty */
         return r;
     case 6:
         /* msr */
         r = uptr->msr;
         /* Reading clears the delta bits */
         uptr->msr &= 0xF0;
-        uart16x50_clear_interrupt(uptr, MODEM);
+        uart16x50_irq_update(uptr);
         return r;
     case 7:
         return uptr->scratch;
@@ -246,7 +386,7 @@ void uart16x50_dsr_timer(struct uart16x50 *uart16x50)
 {
     uart16x50->msr ^= 0x20;	/* DSR toggles */
     uart16x50->msr |= 0x02;	/* DSR delta */
-    uart16x50_interrupt(uart16x50, MODEM);
+    uart16x50_irq_update(uart16x50);
 }
 
 void uart16x50_set_input(struct uart16x50 *uart16x50, int port)
@@ -254,6 +394,38 @@ void uart16x50_set_input(struct uart16x50 *uart16x50, int port)
 	uart16x50->input = port;
 }
 
+/* One character at the current format in clocks of the 1.8432MHz
+   crystal. Boards that pace uart16x50_event() at this rate get the
+   programmed baud rate */
+unsigned int uart16x50_char_clocks(struct uart16x50 *uptr)
+{
+    unsigned int divisor = uptr->ls + (uptr->ms << 8);
+    unsigned int bits = 1 + (uptr->lcr & 3) + 5 + 1;
+
+    /* Not programmed yet, so run at 115200 rather than 1.7 baud */
+    if (divisor == 0)
+        divisor = 1;
+    if (uptr->lcr & 0x08)
+        bits++;
+    if (uptr->lcr & 0x04)
+        bits++;
+    return 16 * divisor * bits;
+}
+
+/* Feed input as fast as the guest reads it rather than at the baud rate.
+   This is the default */
+void uart16x50_unthrottle(struct uart16x50 *uart16x50, int onoff)
+{
+    uart16x50->unthrottled = onoff;
+}
+
+/* Use a host device in place of check_chario() and the console */
+void uart16x50_attach(struct uart16x50 *uart16x50, struct chardev *dev)
+{
+	uart16x50->dev = dev;
+	uart16x50->input = 1;
+}
+
 void uart16x50_trace(struct uart16x50 *uart16x50, int onoff)
 {	
 	uart16x50->trace = onoff;
@@ -264,6 +436,12 @@ uint8_t uart16x50_irq_pending(struct uart16x50 *d)
 	return !!d->irqline;
 }
 
+/* Bytes received and sent, for the metrics */
+unsigned long long uart16x50_bytes(struct uart16x50 *d)
+{
+	return d->bytes;
+}
+
 struct uart16x50 *uart16x50_create(void)
 {
 	struct uart16x50 *d = malloc(sizeof(struct uart16x50));
@@ -272,6 +450,7 @@ struct uart16x50 *uart16x50_create(void)
 		exit(1);
 	}
 	memset(d, 0, sizeof(*d));
+	d->unthrottled = 1;
 	uart16x50_reset(d);
 	return d;
 }
@@ -281,3 +460,19 @@ void uart16x50_free(struct uart16x50 *d)
 	free(d);
 }
 
+/* Snapshot support. With buf NULL just report the size needed */
+size_t uart16x50_save(struct uart16x50 *d, void *buf)
+{
+	size_t len = offsetof(struct uart16x50, trace);
+	if (buf)
+		memcpy(buf, d, len);
+	return len;
+}
+
+int uart16x50_load(struct uart16x50 *d, const void *buf, size_t len)
+{
+	if (len != offsetof(struct uart16x50, trace))
+		return -1;
+	memcpy(d, buf, len);
+	return 0;
+}
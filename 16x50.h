@@ -1,4 +1,5 @@
 struct uart16x50;
+struct chardev;
 
 extern struct uart16x50 *uart16x50_create(void);
 extern void uart16x50_free(struct uart16x50 *uart16x50);
@@ -9,7 +10,13 @@ extern void uart16x50_event(struct uart16x50 *uart16x50);
 extern void uart16x50_reset(struct uart16x50 *uart16x50);
 extern uint8_t uart16x50_irq_pending(struct uart16x50 *uart16x50);
 extern void uart16x50_set_input(struct uart16x50 *uart16x50, int port);
+extern void uart16x50_attach(struct uart16x50 *uart16x50, struct chardev *dev);
+extern unsigned int uart16x50_char_clocks(struct uart16x50 *uart16x50);
+extern void uart16x50_unthrottle(struct uart16x50 *uart16x50, int onoff);
 extern void uart16x50_dsr_timer(struct uart16x50 *uart16x50);
+extern unsigned long long uart16x50_bytes(struct uart16x50 *uart16x50);
+extern size_t uart16x50_save(struct uart16x50 *uart16x50, void *buf);
+extern int uart16x50_load(struct uart16x50 *uart16x50, const void *buf, size_t len);
 
 /* Caller proviced */
 extern unsigned int next_char(void);
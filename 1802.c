@@ -122,24 +122,38 @@ static void cp1802_write16(struct cp1802 *cpu, uint16_t a, uint16_t d)
    a special instruction for some IRQ style stacking/saving */
 
 /*
- *	Process the 1804/5/6 counter. Simulates one machine cycle
+ *	Process the 1804/5/6 counter
  */
 
-static void counter_decrement(struct cp1802 *cpu)
+/* Count n events, working out any zero counts directly */
+static void counter_decrement_n(struct cp1802 *cpu, unsigned int n)
 {
-    if (cpu->ct_stop)
+    unsigned int left, period;
+
+    if (cpu->ct_stop || n == 0)
         return;
-    cpu->ct_val--;
-    if (cpu->ct_val)
+    left = cpu->ct_val ? cpu->ct_val : 256;
+    if (n < left) {
+        cpu->ct_val -= n;
         return;
-    /* Do zero count processing */
-    cpu->ct_val = cpu->ct_count;
+    }
+    /* Do zero count processing for each time round */
+    n -= left;
+    period = cpu->ct_count ? cpu->ct_count : 256;
+    cpu->ct_val = cpu->ct_count - n % period;
     cpu->ct_int = 1;
-    if (cpu->ct_etq)
+    if (cpu->ct_etq && !((n / period) & 1))
         cpu->q ^= 1;
 }
 
-static void counter_cycle(struct cp1802 *cpu)
+static void counter_decrement(struct cp1802 *cpu)
+{
+    counter_decrement_n(cpu, 1);
+}
+
+/* Run the counter for n machine cycles. The EF lines only change between
+   instructions so one sample covers them all */
+static void counter_cycle(struct cp1802 *cpu, unsigned int n)
 {
     uint8_t d;
     if (cpu->ct_stop)
@@ -148,8 +162,10 @@ static void counter_cycle(struct cp1802 *cpu)
     case 0:	/* Not set */
         break;
     case 1:	/* SPM */
-        if (cp1802_ef(cpu) & (1 << cpu->ct_ef))
+        if (cp1802_ef(cpu) & (1 << cpu->ct_ef)) {
             cpu->ct_stop = 1;
+            return;
+        }
         break;
     case 2:	/* SCM */
         d = cp1802_ef(cpu);
@@ -160,15 +176,14 @@ static void counter_cycle(struct cp1802 *cpu)
         }
         /* High to low - so we count */
         break;
-    case 3:	/* STM */
-        cpu->ct_step++;
-        if (cpu->ct_step != 32)
-            return;
+    case 3:	/* STM: divide by 32 prescaler */
+        n += cpu->ct_step;
+        cpu->ct_step = n % 32;
+        n /= 32;
+        break;
     }
-    if (cpu->ct_stop)
-        return;
-    /* Do a counter event */
-    counter_decrement(cpu);
+    /* Do the counter events */
+    counter_decrement_n(cpu, n);
 }
 
 static void execute_1805(struct cp1802 *cpu)
@@ -365,7 +380,7 @@ static void execute_1804(struct cp1802 *cpu)
             cpu->ct_etq = 0;
             break;
         case 1:	/* DTC */
-            counter_cycle(cpu);
+            counter_cycle(cpu, 1);
             break;
         case 2:	/* SPM2 */
         case 3:	/* SCM2 */
@@ -747,15 +762,21 @@ int cp1802_run(struct cp1802 *cpu)
         interrupt(cpu);
     execute_op(cpu);
     /* Simulate the counter on the 1804/5/6 */
-    if (cpu->type >= 1804) {
-        elapsed = cpu->mcycles - elapsed;
-        while(elapsed--) {
-            counter_cycle(cpu);
-        }
-    }
+    if (cpu->type >= 1804)
+        counter_cycle(cpu, cpu->mcycles - elapsed);
     return cpu->mcycles;
 }
 
+/* Run instructions until at least cycles machine cycles have gone by */
+unsigned int cp1802_run_cycles(struct cp1802 *cpu, unsigned int cycles)
+{
+    unsigned int start = cpu->mcycles;
+
+    while (cpu->mcycles - start < cycles)
+        cp1802_run(cpu);
+    return cpu->mcycles - start;
+}
+
 void cp1802_reset(struct cp1802 *cpu)
 {
     memset(cpu, 0, sizeof(*cpu));
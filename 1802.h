@@ -53,5 +53,6 @@ extern void cp1802_init(struct cp1802 *, int type);
 extern void cp1802_reset(struct cp1802 *);
 extern void cp1802_interrupt(struct cp1802 *, int);
 extern int cp1802_run(struct cp1802 *);
+extern unsigned int cp1802_run_cycles(struct cp1802 *, unsigned int);
 extern void cp1802_dma_in_cycle(struct cp1802 *);
 extern void cp1802_dma_out_cycle(struct cp1802 *);
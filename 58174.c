@@ -4,10 +4,15 @@
 #include <string.h>
 #include <time.h>
 #include "system.h"
+#include "vclock.h"
 #include "58174.h"
 
 /*
  *	MM58174 RTC. Nybble wide interface
+ *
+ *	The time digits are rebuilt from the host clock once a second off
+ *	the 100Hz tick, so a read is just a table lookup. Setting the time
+ *	moves an offset from host time.
  */
 
 struct mm58174 {
@@ -17,8 +22,89 @@ struct mm58174 {
 	unsigned int trace;
 
 	unsigned int count;
+	unsigned int hz;		/* Ticks until the next refresh */
+	time_t latched;			/* Host second digit[] is for */
+	int64_t offset;			/* Guest set time less host time */
+	uint8_t digit[16];		/* Register values for reads 0-14 */
 };
 
+static void rtc_digits(struct mm58174 *rtc, time_t t)
+{
+	time_t g = t + rtc->offset;
+	struct tm *tm = gmtime(&g);
+	uint8_t *d = rtc->digit;
+
+	rtc->latched = t;
+	memset(d, 0xFF, sizeof(rtc->digit));
+	if (tm == NULL)
+		return;
+	d[1] = 0;	/* Actually 10ths */
+	d[2] = tm->tm_sec % 10;
+	d[3] = tm->tm_sec / 10;
+	d[4] = tm->tm_min % 10;
+	d[5] = tm->tm_min / 10;
+	d[6] = tm->tm_hour % 10;
+	d[7] = tm->tm_hour / 10;
+	d[8] = tm->tm_mday % 10;
+	d[9] = tm->tm_mday / 10;
+	d[10] = tm->tm_wday + 1;
+	d[11] = (tm->tm_mon + 1) % 10;
+	d[12] = (tm->tm_mon + 1) / 10;
+	/* 0 test port and 13 no year capability stay 0xFF */
+	d[14] = 0;
+}
+
+/* Set a time digit. mktime() on both sides gives the move in seconds,
+   which is all that matters even though these are UTC fields */
+static void rtc_settime(struct mm58174 *rtc, uint8_t reg, uint8_t val)
+{
+	time_t g = rtc->latched + rtc->offset;
+	struct tm *tp = gmtime(&g);
+	struct tm tm, old;
+	int mon, *f;
+
+	if (tp == NULL)
+		return;
+	tm = *tp;
+	old = *tp;
+	mon = tm.tm_mon + 1;
+	switch(reg) {
+	case 2:
+	case 3:
+		f = &tm.tm_sec;
+		break;
+	case 4:
+	case 5:
+		f = &tm.tm_min;
+		break;
+	case 6:
+	case 7:
+		f = &tm.tm_hour;
+		break;
+	case 8:
+	case 9:
+		f = &tm.tm_mday;
+		break;
+	case 11:
+	case 12:
+		f = &mon;
+		break;
+	default:
+		/* The day of the week follows from the date */
+		return;
+	}
+	/* Even registers are units, except the month where 11 is */
+	if ((reg & 1) == (reg >= 11))
+		*f = *f / 10 * 10 + (val & 0x0F);
+	else
+		*f = (val & 0x0F) * 10 + *f % 10;
+	tm.tm_mon = mon - 1;
+	tm.tm_isdst = 0;
+	old.tm_isdst = 0;
+	rtc->offset += (int64_t)(mktime(&tm) - mktime(&old));
+	rtc_digits(rtc, rtc->latched);
+}
+
 static void rtc_reload(struct mm58174 *rtc)
 {
 	/* Not clear what undocumented cases do */
@@ -37,61 +123,22 @@ static void rtc_reload(struct mm58174 *rtc)
 
 uint8_t mm58174_read(struct mm58174 *rtc, uint8_t reg)
 {
-	time_t t;
-	struct tm *tm;
-
-	t = time(NULL);
-	tm = gmtime(&t);
-	if (tm == NULL)
-		return 0xFF;
-		
-	switch(reg) {
-	case 0:
-		return 0xFF;	/* Test port */
-	case 1:
-		return 0;	/* Actually 10ths */
-	case 2:
-		return tm->tm_sec % 10;
-	case 3:
-		return tm->tm_sec / 10;
-	case 4:
-		return tm->tm_min % 10;
-	case 5:
-		return tm->tm_min / 10;
-	case 6:
-		return tm->tm_hour % 10;
-	case 7:
-		return tm->tm_hour / 10;
-	case 8:
-		return tm->tm_mday % 10;
-	case 9:
-		return tm->tm_mday / 10;
-	case 10:
-		return tm->tm_wday + 1;
-	case 11:
-		return (tm->tm_mon + 1) % 10;
-	case 12:
-		return (tm->tm_mon + 1) / 10;
-	case 13:	/* No year capability */
-		return 0xFF;
-	case 14:
-		return 0;
-	case 15:
+	if (reg == 15) {
 		/* Really you need to read it 3 times ?? */
 		rtc->irqpending = 0;
 		if (rtc->interrupt & 8)
 			rtc_reload(rtc);
 		return rtc->interrupt;
 	}
-	return 0xFF;
+	return rtc->digit[reg & 0x0F];
 }
-	
 
 void mm58174_write(struct mm58174 *rtc, uint8_t reg, uint8_t val)
 {
-	/* We don't support time setting */
-	if (reg < 15)
+	if (reg < 15) {
+		rtc_settime(rtc, reg, val);
 		return;
+	}
 	if (reg == 15) {
 		rtc->interrupt = val & 15;
 		rtc->irqpending = 0;
@@ -102,6 +149,7 @@ void mm58174_write(struct mm58174 *rtc, uint8_t reg, uint8_t val)
 void mm58174_reset(struct mm58174 *rtc)
 {
 	memset(rtc, 0, sizeof(struct mm58174));
+	rtc_digits(rtc, vclock_time());
 }
 
 struct mm58174 *mm58174_create(void)
@@ -133,6 +181,13 @@ unsigned int mm58174_irqpending(struct mm58174 *rtc)
 /* Call at 100Hz */
 void mm58174_tick(struct mm58174 *rtc)
 {
+	if (rtc->hz == 0) {
+		time_t t = vclock_time();
+		if (t != rtc->latched)
+			rtc_digits(rtc, t);
+		rtc->hz = 100;
+	}
+	rtc->hz--;
 	if ((rtc->interrupt & 7) == 0)
 		return;
 	if (rtc->count) {
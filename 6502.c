@@ -22,801 +22,803 @@
 
 #define _6502_PRIVATE
 #include "6502.h"
+#include "cputrace.h"
+#include "coverage.h"
+#include "trace.h"
 
 
-//6502 CPU registers
-uint16_t pc;
-uint8_t sp, a, x, y, status;
+/* The helpers below are small and each is used from many cases of the
+   opcode switch, too many for gcc to inline them by itself */
+#ifdef __GNUC__
+#define OPINLINE static inline __attribute__((always_inline))
+#else
+#define OPINLINE static inline
+#endif
+
+/*
+ *	Flag lookups. nz_table gives Z and N for a result. The ADC and SBC
+ *	tables are indexed by carry and then A and the operand, and hold the
+ *	result in the low byte and N V Z C in the high byte. Decimal mode
+ *	follows the NMOS part: Z comes from the binary sum and N and V from
+ *	the sum before the high digit is adjusted. Binary SBC uses the binary
+ *	ADC table with the operand inverted.
+ */
+static uint8_t nz_table[256];
+static uint16_t adc_table[2][2][0x10000];	/* [decimal][carry] */
+static uint16_t sbc_table[2][0x10000];		/* Decimal only */
+
+#define ARITH_FLAGS	(FLAG_CARRY | FLAG_ZERO | FLAG_OVERFLOW | FLAG_SIGN)
+
+#define nzcalc(n) \
+	cpu->status = (cpu->status & ~(FLAG_ZERO | FLAG_SIGN)) | nz_table[(n) & 0xFF]
+
+#ifdef NES_CPU
+#define DECIMAL		0
+#else
+#define DECIMAL		((cpu->status & FLAG_DECIMAL) >> 3)
+#endif
+
+static uint16_t arith_entry(unsigned int r, unsigned int flags)
+{
+	return (r & 0xFF) | ((flags | nz_table[r & 0xFF]) << 8);
+}
+
+static void build_tables(void)
+{
+	unsigned int n, c, m;
+
+	for (n = 0; n < 256; n++)
+		nz_table[n] = (n ? 0 : FLAG_ZERO) | (n & FLAG_SIGN);
 
-//helper variables
-uint64_t instructions = 0;	//keep track of total instructions executed
-uint64_t clockticks6502 = 0, clockgoal6502 = 0;
-uint16_t oldpc, ea, reladdr, value, result;
-uint8_t opcode, oldstatus;
+	for (c = 0; c < 2; c++) {
+		for (n = 0; n < 0x10000; n++) {
+			unsigned int ra = n >> 8;
+			unsigned int rv = n & 0xFF;
+			unsigned int r = ra + rv + c;
+			unsigned int v = (r ^ ra) & (r ^ rv) & 0x80 ? FLAG_OVERFLOW : 0;
+
+			adc_table[0][c][n] = arith_entry(r, v | (r >> 8));
+		}
+	}
+	for (c = 0; c < 2; c++) {
+		for (n = 0; n < 0x10000; n++) {
+			unsigned int ra = n >> 8;
+			unsigned int rv = n & 0xFF;
+			unsigned int r = ra + rv + c;
+			int lo, hi;
+
+			/* Decimal add */
+			lo = (ra & 0x0F) + (rv & 0x0F) + c;
+			if (lo > 0x09)
+				lo = ((lo + 0x06) & 0x0F) + 0x10;
+			hi = (ra & 0xF0) + (rv & 0xF0) + lo;
+			m = (hi & FLAG_SIGN) | (nz_table[r & 0xFF] & FLAG_ZERO);
+			if ((hi ^ ra) & (hi ^ rv) & 0x80)
+				m |= FLAG_OVERFLOW;
+			if (hi >= 0xA0)
+				hi += 0x60;
+			if (hi >= 0x100)
+				m |= FLAG_CARRY;
+			adc_table[1][c][n] = (hi & 0xFF) | (m << 8);
+
+			/* Decimal subtract: flags as for binary */
+			m = adc_table[0][c][(ra << 8) | (rv ^ 0xFF)] & 0xFF00;
+			lo = (ra & 0x0F) - (rv & 0x0F) + c - 1;
+			if (lo < 0)
+				lo = ((lo - 0x06) & 0x0F) - 0x10;
+			hi = (ra & 0xF0) - (rv & 0xF0) + lo;
+			if (hi < 0)
+				hi -= 0x60;
+			sbc_table[c][n] = (hi & 0xFF) | m;
+		}
+	}
+}
 
 //a few general functions used by various other functions
-static void push16(uint16_t pushval)
+static void push16(struct m6502 *cpu, uint16_t pushval)
 {
-	write6502(BASE_STACK + sp, (pushval >> 8) & 0xFF);
-	write6502(BASE_STACK + ((sp - 1) & 0xFF), pushval & 0xFF);
-	sp -= 2;
+	write6502(cpu, BASE_STACK + cpu->sp, (pushval >> 8) & 0xFF);
+	write6502(cpu, BASE_STACK + ((cpu->sp - 1) & 0xFF), pushval & 0xFF);
+	cpu->sp -= 2;
 }
 
-static void push8(uint8_t pushval)
+static void push8(struct m6502 *cpu, uint8_t pushval)
 {
-	write6502(BASE_STACK + sp--, pushval);
+	write6502(cpu, BASE_STACK + cpu->sp--, pushval);
 }
 
-static uint16_t pull16(void)
+static uint16_t pull16(struct m6502 *cpu)
 {
 	uint16_t temp16;
-	temp16 = read6502(BASE_STACK + ((sp + 1) & 0xFF)) | ((uint16_t) read6502(BASE_STACK + ((sp + 2) & 0xFF)) << 8);
-	sp += 2;
+	temp16 = read6502(cpu, BASE_STACK + ((cpu->sp + 1) & 0xFF)) | ((uint16_t) read6502(cpu, BASE_STACK + ((cpu->sp + 2) & 0xFF)) << 8);
+	cpu->sp += 2;
 	return (temp16);
 }
 
-static uint8_t pull8(void)
+static uint8_t pull8(struct m6502 *cpu)
 {
-	return (read6502(BASE_STACK + ++sp));
+	return (read6502(cpu, BASE_STACK + ++cpu->sp));
 }
 
-void reset6502(void)
+void reset6502(struct m6502 *cpu)
 {
-	pc = (uint16_t) read6502(0xFFFC) | ((uint16_t) read6502(0xFFFD) << 8);
-	a = 0;
-	x = 0;
-	y = 0;
-	sp = 0xFF;
-	status |= FLAG_CONSTANT;
+	cpu->pc = (uint16_t) read6502(cpu, 0xFFFC) | ((uint16_t) read6502(cpu, 0xFFFD) << 8);
+	cpu->a = 0;
+	cpu->x = 0;
+	cpu->y = 0;
+	cpu->sp = 0xFF;
+	cpu->status |= FLAG_CONSTANT;
 }
 
 
-static void (*addrtable[256]) (void);
-static void (*optable[256]) (void);
-uint8_t penaltyop, penaltyaddr;
 
 //addressing mode functions, calculates effective addresses
-static void imp(void)
+OPINLINE void imp(struct m6502 *cpu)
 {				//implied
 }
 
-static void acc(void)
+OPINLINE void acc(struct m6502 *cpu)
 {				//accumulator
+	cpu->useaccum = 1;
 }
 
-static void imm(void)
+OPINLINE void imm(struct m6502 *cpu)
 {				//immediate
-	ea = pc++;
+	cpu->ea = cpu->pc++;
 }
 
-static void zp(void)
+OPINLINE void zp(struct m6502 *cpu)
 {				//zero-page
-	ea = (uint16_t) read6502((uint16_t) pc++);
+	cpu->ea = (uint16_t) read6502(cpu, (uint16_t) cpu->pc++);
 }
 
-static void zpx(void)
+OPINLINE void zpx(struct m6502 *cpu)
 {				//zero-page,X
-	ea = ((uint16_t) read6502((uint16_t) pc++) + (uint16_t) x) & 0xFF;	//zero-page wraparound
+	cpu->ea = ((uint16_t) read6502(cpu, (uint16_t) cpu->pc++) + (uint16_t) cpu->x) & 0xFF;	//zero-page wraparound
 }
 
-static void zpy(void)
+OPINLINE void zpy(struct m6502 *cpu)
 {				//zero-page,Y
-	ea = ((uint16_t) read6502((uint16_t) pc++) + (uint16_t) y) & 0xFF;	//zero-page wraparound
+	cpu->ea = ((uint16_t) read6502(cpu, (uint16_t) cpu->pc++) + (uint16_t) cpu->y) & 0xFF;	//zero-page wraparound
 }
 
-static void rel(void)
+OPINLINE void rel(struct m6502 *cpu)
 {				//relative for branch ops (8-bit immediate value, sign-extended)
-	reladdr = (uint16_t) read6502(pc++);
-	if (reladdr & 0x80)
-		reladdr |= 0xFF00;
+	cpu->reladdr = (uint16_t) read6502(cpu, cpu->pc++);
+	if (cpu->reladdr & 0x80)
+		cpu->reladdr |= 0xFF00;
 }
 
-static void abso(void)
+OPINLINE void abso(struct m6502 *cpu)
 {				//absolute
-	ea = (uint16_t) read6502(pc) | ((uint16_t) read6502(pc + 1) << 8);
-	pc += 2;
+	cpu->ea = (uint16_t) read6502(cpu, cpu->pc) | ((uint16_t) read6502(cpu, cpu->pc + 1) << 8);
+	cpu->pc += 2;
 }
 
-static void absx(void)
+OPINLINE void absx(struct m6502 *cpu)
 {				//absolute,X
 	uint16_t startpage;
-	ea = ((uint16_t) read6502(pc) | ((uint16_t) read6502(pc + 1) << 8));
-	startpage = ea & 0xFF00;
-	ea += (uint16_t) x;
+	cpu->ea = ((uint16_t) read6502(cpu, cpu->pc) | ((uint16_t) read6502(cpu, cpu->pc + 1) << 8));
+	startpage = cpu->ea & 0xFF00;
+	cpu->ea += (uint16_t) cpu->x;
 
-	if (startpage != (ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
-		penaltyaddr = 1;
+	if (startpage != (cpu->ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
+		cpu->penaltyaddr = 1;
 	}
 
-	pc += 2;
+	cpu->pc += 2;
 }
 
-static void absy(void)
+OPINLINE void absy(struct m6502 *cpu)
 {				//absolute,Y
 	uint16_t startpage;
-	ea = ((uint16_t) read6502(pc) | ((uint16_t) read6502(pc + 1) << 8));
-	startpage = ea & 0xFF00;
-	ea += (uint16_t) y;
+	cpu->ea = ((uint16_t) read6502(cpu, cpu->pc) | ((uint16_t) read6502(cpu, cpu->pc + 1) << 8));
+	startpage = cpu->ea & 0xFF00;
+	cpu->ea += (uint16_t) cpu->y;
 
-	if (startpage != (ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
-		penaltyaddr = 1;
+	if (startpage != (cpu->ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
+		cpu->penaltyaddr = 1;
 	}
 
-	pc += 2;
+	cpu->pc += 2;
 }
 
-static void ind(void)
+OPINLINE void ind(struct m6502 *cpu)
 {				//indirect
 	uint16_t eahelp, eahelp2;
-	eahelp = (uint16_t) read6502(pc) | (uint16_t) ((uint16_t) read6502(pc + 1) << 8);
+	eahelp = (uint16_t) read6502(cpu, cpu->pc) | (uint16_t) ((uint16_t) read6502(cpu, cpu->pc + 1) << 8);
 	eahelp2 = (eahelp & 0xFF00) | ((eahelp + 1) & 0x00FF);	//replicate 6502 page-boundary wraparound bug
-	ea = (uint16_t) read6502(eahelp) | ((uint16_t) read6502(eahelp2) << 8);
-	pc += 2;
+	cpu->ea = (uint16_t) read6502(cpu, eahelp) | ((uint16_t) read6502(cpu, eahelp2) << 8);
+	cpu->pc += 2;
 }
 
-static void indx(void)
+OPINLINE void indx(struct m6502 *cpu)
 {				// (indirect,X)
 	uint16_t eahelp;
-	eahelp = (uint16_t) (((uint16_t) read6502(pc++) + (uint16_t) x) & 0xFF);	//zero-page wraparound for table pointer
-	ea = (uint16_t) read6502(eahelp & 0x00FF) | ((uint16_t) read6502((eahelp + 1) & 0x00FF) << 8);
+	eahelp = (uint16_t) (((uint16_t) read6502(cpu, cpu->pc++) + (uint16_t) cpu->x) & 0xFF);	//zero-page wraparound for table pointer
+	cpu->ea = (uint16_t) read6502(cpu, eahelp & 0x00FF) | ((uint16_t) read6502(cpu, (eahelp + 1) & 0x00FF) << 8);
 }
 
-static void indy(void)
+OPINLINE void indy(struct m6502 *cpu)
 {				// (indirect),Y
 	uint16_t eahelp, eahelp2, startpage;
-	eahelp = (uint16_t) read6502(pc++);
+	eahelp = (uint16_t) read6502(cpu, cpu->pc++);
 	eahelp2 = (eahelp & 0xFF00) | ((eahelp + 1) & 0x00FF);	//zero-page wraparound
-	ea = (uint16_t) read6502(eahelp) | ((uint16_t) read6502(eahelp2) << 8);
-	startpage = ea & 0xFF00;
-	ea += (uint16_t) y;
+	cpu->ea = (uint16_t) read6502(cpu, eahelp) | ((uint16_t) read6502(cpu, eahelp2) << 8);
+	startpage = cpu->ea & 0xFF00;
+	cpu->ea += (uint16_t) cpu->y;
 
-	if (startpage != (ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
-		penaltyaddr = 1;
+	if (startpage != (cpu->ea & 0xFF00)) {	//one cycle penlty for page-crossing on some opcodes
+		cpu->penaltyaddr = 1;
 	}
 }
 
-static uint16_t getvalue(void)
+OPINLINE uint16_t getvalue(struct m6502 *cpu)
 {
-	if (addrtable[opcode] == acc)
-		return ((uint16_t) a);
+	if (cpu->useaccum)
+		return ((uint16_t) cpu->a);
 	else
-		return ((uint16_t) read6502(ea));
+		return ((uint16_t) read6502(cpu, cpu->ea));
 }
 
 #if 0
-static uint16_t getvalue16(void)
+static uint16_t getvalue16(struct m6502 *cpu)
 {
-	return ((uint16_t) read6502(ea) | ((uint16_t) read6502(ea + 1) << 8));
+	return ((uint16_t) read6502(cpu, cpu->ea) | ((uint16_t) read6502(cpu, cpu->ea + 1) << 8));
 }
 #endif
 
-static void putvalue(uint16_t saveval)
+OPINLINE void putvalue(struct m6502 *cpu, uint16_t saveval)
 {
-	if (addrtable[opcode] == acc)
-		a = (uint8_t) (saveval & 0x00FF);
+	if (cpu->useaccum)
+		cpu->a = (uint8_t) (saveval & 0x00FF);
 	else
-		write6502(ea, (saveval & 0x00FF));
+		write6502(cpu, cpu->ea, (saveval & 0x00FF));
 }
 
 
 //instruction handler functions
-static void adc(void)
+OPINLINE void adc(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a + value + (uint16_t) (status & FLAG_CARRY);
-
-	carrycalc(result);
-	zerocalc(result);
-	overflowcalc(result, a, value);
-	signcalc(result);
+	uint16_t r;
 
-#ifndef NES_CPU
-	if (status & FLAG_DECIMAL) {
-		clearcarry();
-
-		if ((a & 0x0F) > 0x09) {
-			a += 0x06;
-		}
-		if ((a & 0xF0) > 0x90) {
-			a += 0x60;
-			setcarry();
-		}
-
-		clockticks6502++;
-	}
-#endif
-
-	saveaccum(result);
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	r = adc_table[DECIMAL][cpu->status & FLAG_CARRY][(cpu->a << 8) | cpu->value];
+	cpu->status = (cpu->status & ~ARITH_FLAGS) | (r >> 8);
+	cpu->clockticks += DECIMAL;
+	saveaccum(r);
 }
 
-static void and(void)
+OPINLINE void and(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a & value;
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = (uint16_t) cpu->a & cpu->value;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(cpu->result);
 
-	saveaccum(result);
+	saveaccum(cpu->result);
 }
 
-static void asl(void)
+OPINLINE void asl(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = value << 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = cpu->value << 1;
 
-	carrycalc(result);
-	zerocalc(result);
-	signcalc(result);
+	carrycalc(cpu->result);
+	nzcalc(cpu->result);
 
-	putvalue(result);
+	putvalue(cpu, cpu->result);
 }
 
-static void bcc(void)
+OPINLINE void bcc(struct m6502 *cpu)
 {
-	if ((status & FLAG_CARRY) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_CARRY) == 0) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void bcs(void)
+OPINLINE void bcs(struct m6502 *cpu)
 {
-	if ((status & FLAG_CARRY) == FLAG_CARRY) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_CARRY) == FLAG_CARRY) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void beq(void)
+OPINLINE void beq(struct m6502 *cpu)
 {
-	if ((status & FLAG_ZERO) == FLAG_ZERO) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_ZERO) == FLAG_ZERO) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void bit(void)
+OPINLINE void bit(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = (uint16_t) a & value;
+	cpu->value = getvalue(cpu);
+	cpu->result = (uint16_t) cpu->a & cpu->value;
 
-	zerocalc(result);
-	status = (status & 0x3F) | (uint8_t) (value & 0xC0);
+	zerocalc(cpu->result);
+	cpu->status = (cpu->status & 0x3F) | (uint8_t) (cpu->value & 0xC0);
 }
 
-static void bmi(void)
+OPINLINE void bmi(struct m6502 *cpu)
 {
-	if ((status & FLAG_SIGN) == FLAG_SIGN) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_SIGN) == FLAG_SIGN) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void bne(void)
+OPINLINE void bne(struct m6502 *cpu)
 {
-	if ((status & FLAG_ZERO) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_ZERO) == 0) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void bpl(void)
+OPINLINE void bpl(struct m6502 *cpu)
 {
-	if ((status & FLAG_SIGN) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_SIGN) == 0) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void brk(void)
+OPINLINE void brk(struct m6502 *cpu)
 {
-	pc++;
-	push16(pc);		//push next instruction address onto stack
-	push8(status | FLAG_BREAK);	//push CPU status OR'd with break flag to stack
+	cpu->pc++;
+	push16(cpu, cpu->pc);		//push next instruction address onto stack
+	push8(cpu, cpu->status | FLAG_BREAK);	//push CPU status OR'd with break flag to stack
 	setinterrupt();		//set interrupt flag
-	pc = (uint16_t) read6502(0xFFFE) | ((uint16_t) read6502(0xFFFF) << 8);
+	cpu->pc = (uint16_t) read6502(cpu, 0xFFFE) | ((uint16_t) read6502(cpu, 0xFFFF) << 8);
 }
 
-static void bvc(void)
+OPINLINE void bvc(struct m6502 *cpu)
 {
-	if ((status & FLAG_OVERFLOW) == 0) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_OVERFLOW) == 0) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void bvs(void)
+OPINLINE void bvs(struct m6502 *cpu)
 {
-	if ((status & FLAG_OVERFLOW) == FLAG_OVERFLOW) {
-		oldpc = pc;
-		pc += reladdr;
-		if ((oldpc & 0xFF00) != (pc & 0xFF00))
-			clockticks6502 += 2;	//check if jump crossed a page boundary
+	if ((cpu->status & FLAG_OVERFLOW) == FLAG_OVERFLOW) {
+		cpu->oldpc = cpu->pc;
+		cpu->pc += cpu->reladdr;
+		if ((cpu->oldpc & 0xFF00) != (cpu->pc & 0xFF00))
+			cpu->clockticks += 2;	//check if jump crossed a page boundary
 		else
-			clockticks6502++;
+			cpu->clockticks++;
 	}
 }
 
-static void clc(void)
+OPINLINE void clc(struct m6502 *cpu)
 {
 	clearcarry();
 }
 
-static void cld(void)
+OPINLINE void cld(struct m6502 *cpu)
 {
 	cleardecimal();
 }
 
-static void cli(void)
+OPINLINE void cli(struct m6502 *cpu)
 {
 	clearinterrupt();
 }
 
-static void clv(void)
+OPINLINE void clv(struct m6502 *cpu)
 {
 	clearoverflow();
 }
 
-static void cmp(void)
+OPINLINE void cmp(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a - value;
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = (uint16_t) cpu->a - cpu->value;
 
-	if (a >= (uint8_t) (value & 0x00FF))
-		setcarry();
-	else
-		clearcarry();
-	if (a == (uint8_t) (value & 0x00FF))
-		setzero();
-	else
-		clearzero();
-	signcalc(result);
+	cpu->status = (cpu->status & ~(FLAG_CARRY | FLAG_ZERO | FLAG_SIGN)) |
+		nz_table[cpu->result & 0xFF] | (cpu->a >= (uint8_t)cpu->value);
 }
 
-static void cpx(void)
+OPINLINE void cpx(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = (uint16_t) x - value;
+	cpu->value = getvalue(cpu);
+	cpu->result = (uint16_t) cpu->x - cpu->value;
 
-	if (x >= (uint8_t) (value & 0x00FF))
-		setcarry();
-	else
-		clearcarry();
-	if (x == (uint8_t) (value & 0x00FF))
-		setzero();
-	else
-		clearzero();
-	signcalc(result);
+	cpu->status = (cpu->status & ~(FLAG_CARRY | FLAG_ZERO | FLAG_SIGN)) |
+		nz_table[cpu->result & 0xFF] | (cpu->x >= (uint8_t)cpu->value);
 }
 
-static void cpy(void)
+OPINLINE void cpy(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = (uint16_t) y - value;
+	cpu->value = getvalue(cpu);
+	cpu->result = (uint16_t) cpu->y - cpu->value;
 
-	if (y >= (uint8_t) (value & 0x00FF))
-		setcarry();
-	else
-		clearcarry();
-	if (y == (uint8_t) (value & 0x00FF))
-		setzero();
-	else
-		clearzero();
-	signcalc(result);
+	cpu->status = (cpu->status & ~(FLAG_CARRY | FLAG_ZERO | FLAG_SIGN)) |
+		nz_table[cpu->result & 0xFF] | (cpu->y >= (uint8_t)cpu->value);
 }
 
-static void dec(void)
+OPINLINE void dec(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = value - 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = cpu->value - 1;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(cpu->result);
 
-	putvalue(result);
+	putvalue(cpu, cpu->result);
 }
 
-static void dex(void)
+OPINLINE void dex(struct m6502 *cpu)
 {
-	x--;
+	cpu->x--;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(cpu->x);
 }
 
-static void dey(void)
+OPINLINE void dey(struct m6502 *cpu)
 {
-	y--;
+	cpu->y--;
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(cpu->y);
 }
 
-static void eor(void)
+OPINLINE void eor(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a ^ value;
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = (uint16_t) cpu->a ^ cpu->value;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(cpu->result);
 
-	saveaccum(result);
+	saveaccum(cpu->result);
 }
 
-static void inc(void)
+OPINLINE void inc(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = value + 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = cpu->value + 1;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(cpu->result);
 
-	putvalue(result);
+	putvalue(cpu, cpu->result);
 }
 
-static void inx(void)
+OPINLINE void inx(struct m6502 *cpu)
 {
-	x++;
+	cpu->x++;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(cpu->x);
 }
 
-static void iny(void)
+OPINLINE void iny(struct m6502 *cpu)
 {
-	y++;
+	cpu->y++;
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(cpu->y);
 }
 
-static void jmp(void)
+OPINLINE void jmp(struct m6502 *cpu)
 {
-	pc = ea;
+	cpu->pc = cpu->ea;
 }
 
-static void jsr(void)
+OPINLINE void jsr(struct m6502 *cpu)
 {
-	push16(pc - 1);
-	pc = ea;
+	push16(cpu, cpu->pc - 1);
+	cpu->pc = cpu->ea;
 }
 
-static void lda(void)
+OPINLINE void lda(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	a = (uint8_t) (value & 0x00FF);
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	cpu->a = (uint8_t) (cpu->value & 0x00FF);
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(cpu->a);
 }
 
-static void ldx(void)
+OPINLINE void ldx(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	x = (uint8_t) (value & 0x00FF);
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	cpu->x = (uint8_t) (cpu->value & 0x00FF);
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(cpu->x);
 }
 
-static void ldy(void)
+OPINLINE void ldy(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	y = (uint8_t) (value & 0x00FF);
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	cpu->y = (uint8_t) (cpu->value & 0x00FF);
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(cpu->y);
 }
 
-static void lsr(void)
+OPINLINE void lsr(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = value >> 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = cpu->value >> 1;
 
-	if (value & 1)
+	if (cpu->value & 1)
 		setcarry();
 	else
 		clearcarry();
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(cpu->result);
 
-	putvalue(result);
+	putvalue(cpu, cpu->result);
 }
 
-static void nop(void)
+OPINLINE void nop(struct m6502 *cpu)
 {
-	switch (opcode) {
+	switch (cpu->opcode) {
 	case 0x1C:
 	case 0x3C:
 	case 0x5C:
 	case 0x7C:
 	case 0xDC:
 	case 0xFC:
-		penaltyop = 1;
+		cpu->penaltyop = 1;
 		break;
 	}
 }
 
-static void ora(void)
+OPINLINE void ora(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue();
-	result = (uint16_t) a | value;
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	cpu->result = (uint16_t) cpu->a | cpu->value;
 
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(cpu->result);
 
-	saveaccum(result);
+	saveaccum(cpu->result);
 }
 
-static void pha(void)
+OPINLINE void pha(struct m6502 *cpu)
 {
-	push8(a);
+	push8(cpu, cpu->a);
 }
 
-static void php(void)
+OPINLINE void php(struct m6502 *cpu)
 {
-	push8(status | FLAG_BREAK);
+	push8(cpu, cpu->status | FLAG_BREAK);
 }
 
-static void pla(void)
+OPINLINE void pla(struct m6502 *cpu)
 {
-	a = pull8();
+	cpu->a = pull8(cpu);
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(cpu->a);
 }
 
-static void plp(void)
+OPINLINE void plp(struct m6502 *cpu)
 {
-	status = pull8() | FLAG_CONSTANT;
+	cpu->status = pull8(cpu) | FLAG_CONSTANT;
 }
 
-static void rol(void)
+OPINLINE void rol(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = (value << 1) | (status & FLAG_CARRY);
+	cpu->value = getvalue(cpu);
+	cpu->result = (cpu->value << 1) | (cpu->status & FLAG_CARRY);
 
-	carrycalc(result);
-	zerocalc(result);
-	signcalc(result);
+	carrycalc(cpu->result);
+	nzcalc(cpu->result);
 
-	putvalue(result);
+	putvalue(cpu, cpu->result);
 }
 
-static void ror(void)
+OPINLINE void ror(struct m6502 *cpu)
 {
-	value = getvalue();
-	result = (value >> 1) | ((status & FLAG_CARRY) << 7);
+	cpu->value = getvalue(cpu);
+	cpu->result = (cpu->value >> 1) | ((cpu->status & FLAG_CARRY) << 7);
 
-	if (value & 1)
+	if (cpu->value & 1)
 		setcarry();
 	else
 		clearcarry();
-	zerocalc(result);
-	signcalc(result);
+	nzcalc(cpu->result);
 
-	putvalue(result);
+	putvalue(cpu, cpu->result);
 }
 
-static void rti(void)
+OPINLINE void rti(struct m6502 *cpu)
 {
-	status = pull8();
-	value = pull16();
-	pc = value;
+	cpu->status = pull8(cpu);
+	cpu->value = pull16(cpu);
+	cpu->pc = cpu->value;
 }
 
-static void rts(void)
+OPINLINE void rts(struct m6502 *cpu)
 {
-	value = pull16();
-	pc = value + 1;
+	cpu->value = pull16(cpu);
+	cpu->pc = cpu->value + 1;
 }
 
-static void sbc(void)
+OPINLINE void sbc(struct m6502 *cpu)
 {
-	penaltyop = 1;
-	value = getvalue() ^ 0x00FF;
-	result = (uint16_t) a + value + (uint16_t) (status & FLAG_CARRY);
-
-	carrycalc(result);
-	zerocalc(result);
-	overflowcalc(result, a, value);
-	signcalc(result);
-
-#ifndef NES_CPU
-	if (status & FLAG_DECIMAL) {
-		clearcarry();
-
-		a -= 0x66;
-		if ((a & 0x0F) > 0x09) {
-			a += 0x06;
-		}
-		if ((a & 0xF0) > 0x90) {
-			a += 0x60;
-			setcarry();
-		}
+	uint16_t r;
 
-		clockticks6502++;
-	}
-#endif
-
-	saveaccum(result);
+	cpu->penaltyop = 1;
+	cpu->value = getvalue(cpu);
+	/* Binary subtract is an add of the complement */
+	if (DECIMAL)
+		r = sbc_table[cpu->status & FLAG_CARRY][(cpu->a << 8) | cpu->value];
+	else
+		r = adc_table[0][cpu->status & FLAG_CARRY][(cpu->a << 8) | (cpu->value ^ 0xFF)];
+	cpu->status = (cpu->status & ~ARITH_FLAGS) | (r >> 8);
+	cpu->clockticks += DECIMAL;
+	saveaccum(r);
 }
 
-static void sec(void)
+OPINLINE void sec(struct m6502 *cpu)
 {
 	setcarry();
 }
 
-static void sed(void)
+OPINLINE void sed(struct m6502 *cpu)
 {
 	setdecimal();
 }
 
-static void sei(void)
+OPINLINE void sei(struct m6502 *cpu)
 {
 	setinterrupt();
 }
 
-static void sta(void)
+OPINLINE void sta(struct m6502 *cpu)
 {
-	putvalue(a);
+	putvalue(cpu, cpu->a);
 }
 
-static void stx(void)
+OPINLINE void stx(struct m6502 *cpu)
 {
-	putvalue(x);
+	putvalue(cpu, cpu->x);
 }
 
-static void sty(void)
+OPINLINE void sty(struct m6502 *cpu)
 {
-	putvalue(y);
+	putvalue(cpu, cpu->y);
 }
 
-static void tax(void)
+OPINLINE void tax(struct m6502 *cpu)
 {
-	x = a;
+	cpu->x = cpu->a;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(cpu->x);
 }
 
-static void tay(void)
+OPINLINE void tay(struct m6502 *cpu)
 {
-	y = a;
+	cpu->y = cpu->a;
 
-	zerocalc(y);
-	signcalc(y);
+	nzcalc(cpu->y);
 }
 
-static void tsx(void)
+OPINLINE void tsx(struct m6502 *cpu)
 {
-	x = sp;
+	cpu->x = cpu->sp;
 
-	zerocalc(x);
-	signcalc(x);
+	nzcalc(cpu->x);
 }
 
-static void txa(void)
+OPINLINE void txa(struct m6502 *cpu)
 {
-	a = x;
+	cpu->a = cpu->x;
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(cpu->a);
 }
 
-static void txs(void)
+OPINLINE void txs(struct m6502 *cpu)
 {
-	sp = x;
+	cpu->sp = cpu->x;
 }
 
-static void tya(void)
+OPINLINE void tya(struct m6502 *cpu)
 {
-	a = y;
+	cpu->a = cpu->y;
 
-	zerocalc(a);
-	signcalc(a);
+	nzcalc(cpu->a);
 }
 
 //undocumented instructions
 #ifdef UNDOCUMENTED
-static void lax(void)
+OPINLINE void lax(struct m6502 *cpu)
 {
-	lda();
-	ldx();
+	lda(cpu);
+	ldx(cpu);
 }
 
-static void sax(void)
+OPINLINE void sax(struct m6502 *cpu)
 {
-	sta();
-	stx();
-	putvalue(a & x);
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	sta(cpu);
+	stx(cpu);
+	putvalue(cpu, cpu->a & cpu->x);
+	if (cpu->penaltyop && cpu->penaltyaddr)
+		cpu->clockticks--;
 }
 
-static void dcp(void)
+OPINLINE void dcp(struct m6502 *cpu)
 {
-	dec();
-	cmp();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	dec(cpu);
+	cmp(cpu);
+	if (cpu->penaltyop && cpu->penaltyaddr)
+		cpu->clockticks--;
 }
 
-static void isb(void)
+OPINLINE void isb(struct m6502 *cpu)
 {
-	inc();
-	sbc();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	inc(cpu);
+	sbc(cpu);
+	if (cpu->penaltyop && cpu->penaltyaddr)
+		cpu->clockticks--;
 }
 
-static void slo(void)
+OPINLINE void slo(struct m6502 *cpu)
 {
-	asl();
-	ora();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	asl(cpu);
+	ora(cpu);
+	if (cpu->penaltyop && cpu->penaltyaddr)
+		cpu->clockticks--;
 }
 
-static void rla(void)
+OPINLINE void rla(struct m6502 *cpu)
 {
-	rol();
-	and();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	rol(cpu);
+	and(cpu);
+	if (cpu->penaltyop && cpu->penaltyaddr)
+		cpu->clockticks--;
 }
 
-static void sre(void)
+OPINLINE void sre(struct m6502 *cpu)
 {
-	lsr();
-	eor();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	lsr(cpu);
+	eor(cpu);
+	if (cpu->penaltyop && cpu->penaltyaddr)
+		cpu->clockticks--;
 }
 
-static void rra(void)
+OPINLINE void rra(struct m6502 *cpu)
 {
-	ror();
-	adc();
-	if (penaltyop && penaltyaddr)
-		clockticks6502--;
+	ror(cpu);
+	adc(cpu);
+	if (cpu->penaltyop && cpu->penaltyaddr)
+		cpu->clockticks--;
 }
 #else
 #define lax nop
@@ -830,165 +832,433 @@ static void rra(void)
 #endif
 
 
-static void (*addrtable[256]) (void) = {
-/*        |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |  9  |  A  |  B  |  C  |  D  |  E  |  F  |     */
-/* 0 */    imp,  indx, imp,  indx, zp,   zp,   zp,   zp,   imp,  imm,  acc,  imm,  abso, abso, abso, abso, /* 0 */
-/* 1 */    rel,  indy, imp,  indy, zpx,  zpx,  zpx,  zpx,  imp,  absy, imp,  absy, absx, absx, absx, absx,/* 1 */
-/* 2 */    abso, indx, imp,  indx, zp,   zp,   zp,   zp,   imp,  imm,  acc,  imm,  abso, abso, abso, abso,/* 2 */
-/* 3 */    rel,  indy, imp,  indy, zpx,  zpx,  zpx,  zpx,  imp,  absy, imp,  absy, absx, absx, absx, absx,/* 3 */
-/* 4 */    imp,  indx, imp,  indx, zp,   zp,   zp,   zp,   imp,  imm,  acc,  imm,  abso, abso, abso, abso,/* 4 */
-/* 5 */    rel,  indy, imp,  indy, zpx,  zpx,  zpx,  zpx,  imp,  absy, imp,  absy, absx, absx, absx, absx,/* 5 */
-/* 6 */    imp,  indx, imp,  indx, zp,   zp,   zp,   zp,   imp,  imm,  acc,  imm,  ind,  abso, abso, abso,/* 6 */
-/* 7 */    rel,  indy, imp,  indy, zpx,  zpx,  zpx,  zpx,  imp,  absy, imp,  absy, absx, absx, absx, absx,/* 7 */
-/* 8 */    imm,  indx, imm,  indx, zp,   zp,   zp,   zp,   imp,  imm,  imp,  imm,  abso, abso, abso, abso, /* 8 */
-/* 9 */    rel,  indy, imp,  indy, zpx,  zpx,  zpy,  zpy,  imp,  absy, imp,  absy, absx, absx, absy, absy, /* 9 */
-/* A */    imm,  indx, imm,  indx, zp,   zp,   zp,   zp,   imp,  imm,  imp,  imm,  abso, abso, abso, abso, /* A */
-/* B */    rel,  indy, imp,  indy, zpx,  zpx,  zpy,  zpy,  imp,  absy, imp,  absy, absx, absx, absy, absy, /* B */
-/* C */    imm,  indx, imm,  indx, zp,   zp,   zp,   zp,   imp,  imm,  imp,  imm,  abso, abso, abso, abso, /* C */
-/* D */    rel,  indy, imp,  indy, zpx,  zpx,  zpx,  zpx,  imp,  absy, imp,  absy, absx, absx, absx, absx, /* D */
-/* E */    imm,  indx, imm,  indx, zp,   zp,   zp,   zp,   imp,  imm,  imp,  imm,  abso, abso, abso, abso, /* E */
-/* F */    rel,  indy, imp,  indy, zpx,  zpx,  zpx, zpx,   imp,  absy, imp,  absy, absx, absx, absx, absx /* F */
-};
-
-static void (*optable[256]) (void) = {
-	brk, ora, nop, slo, nop, ora, asl, slo, php, ora, asl, nop, nop, ora, asl, slo, /* 0 */
-	bpl, ora, nop, slo, nop, ora, asl, slo, clc, ora, nop, slo, nop, ora, asl, slo,
-	jsr, and, nop, rla, bit, and, rol, rla, plp, and, rol, nop, bit, and, rol, rla,
-	bmi, and, nop, rla, nop, and, rol, rla, sec, and, nop, rla, nop, and, rol, rla,
-	rti, eor, nop, sre, nop, eor, lsr, sre, pha, eor, lsr, nop, jmp, eor, lsr, sre,
-	bvc, eor, nop, sre, nop, eor, lsr, sre, cli, eor, nop, sre, nop, eor, lsr, sre,
-	rts, adc, nop, rra, nop, adc, ror, rra, pla, adc, ror, nop, jmp, adc, ror, rra,
-	bvs, adc, nop, rra, nop, adc, ror, rra, sei, adc, nop, rra, nop, adc, ror, rra,
-	nop, sta, nop, sax, sty, sta, stx, sax, dey, nop, txa, nop, sty, sta, stx, sax,
-	bcc, sta, nop, nop, sty, sta, stx, sax, tya, sta, txs, nop, nop, sta, nop, nop,
-	ldy, lda, ldx, lax, ldy, lda, ldx, lax, tay, lda, tax, nop, ldy, lda, ldx, lax,
-	bcs, lda, nop, lax, ldy, lda, ldx, lax, clv, lda, tsx, lax, ldy, lda, ldx, lax,
-	cpy, cmp, nop, dcp, cpy, cmp, dec, dcp, iny, cmp, dex, nop, cpy, cmp, dec, dcp,
-	bne, cmp, nop, dcp, nop, cmp, dec, dcp, cld, cmp, nop, dcp, nop, cmp, dec, dcp,
-	cpx, sbc, nop, isb, cpx, sbc, inc, isb, inx, sbc, nop, sbc, cpx, sbc, inc, isb,
-	beq, sbc, nop, isb, nop, sbc, inc, isb, sed, sbc, nop, isb, nop, sbc, inc, isb
-};
-
-static const uint32_t ticktable[256] = {
-	7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
-	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
-	6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
-	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
-	6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
-	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
-	6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
-	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
-	2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
-	2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
-	2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
-	2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
-	2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
-	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
-	2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
-	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7
-};
-
-
-void nmi6502(void)
-{
-	push16(pc);
-	push8(status);
-	status |= FLAG_INTERRUPT;
-	pc = (uint16_t) read6502(0xFFFA) | ((uint16_t) read6502(0xFFFB) << 8);
-}
-
-void irq6502(void)
-{
-	if ((status & FLAG_INTERRUPT) == FLAG_INTERRUPT)
-		return;		//abort if interrupts are inhibited
-	push16(pc);
-	push8(status);
-	status |= FLAG_INTERRUPT;
-	pc = (uint16_t) read6502(0xFFFE) | ((uint16_t) read6502(0xFFFF) << 8);
+/*
+ *	One case per opcode: addressing mode, operation and base cycle count.
+ *	The helpers are all OPINLINE so each case is straight line code.
+ */
+#define OP(n, mode, op, ticks) \
+	case n: \
+		mode(cpu); \
+		op(cpu); \
+		cpu->clockticks += ticks; \
+		break;
+
+OPINLINE void execute6502(struct m6502 *cpu)
+{
+	switch (cpu->opcode) {
+	/* 0 */
+	OP(0x00, imp, brk, 7)
+	OP(0x01, indx, ora, 6)
+	OP(0x02, imp, nop, 2)
+	OP(0x03, indx, slo, 8)
+	OP(0x04, zp, nop, 3)
+	OP(0x05, zp, ora, 3)
+	OP(0x06, zp, asl, 5)
+	OP(0x07, zp, slo, 5)
+	OP(0x08, imp, php, 3)
+	OP(0x09, imm, ora, 2)
+	OP(0x0A, acc, asl, 2)
+	OP(0x0B, imm, nop, 2)
+	OP(0x0C, abso, nop, 4)
+	OP(0x0D, abso, ora, 4)
+	OP(0x0E, abso, asl, 6)
+	OP(0x0F, abso, slo, 6)
+	/* 1 */
+	OP(0x10, rel, bpl, 2)
+	OP(0x11, indy, ora, 5)
+	OP(0x12, imp, nop, 2)
+	OP(0x13, indy, slo, 8)
+	OP(0x14, zpx, nop, 4)
+	OP(0x15, zpx, ora, 4)
+	OP(0x16, zpx, asl, 6)
+	OP(0x17, zpx, slo, 6)
+	OP(0x18, imp, clc, 2)
+	OP(0x19, absy, ora, 4)
+	OP(0x1A, imp, nop, 2)
+	OP(0x1B, absy, slo, 7)
+	OP(0x1C, absx, nop, 4)
+	OP(0x1D, absx, ora, 4)
+	OP(0x1E, absx, asl, 7)
+	OP(0x1F, absx, slo, 7)
+	/* 2 */
+	OP(0x20, abso, jsr, 6)
+	OP(0x21, indx, and, 6)
+	OP(0x22, imp, nop, 2)
+	OP(0x23, indx, rla, 8)
+	OP(0x24, zp, bit, 3)
+	OP(0x25, zp, and, 3)
+	OP(0x26, zp, rol, 5)
+	OP(0x27, zp, rla, 5)
+	OP(0x28, imp, plp, 4)
+	OP(0x29, imm, and, 2)
+	OP(0x2A, acc, rol, 2)
+	OP(0x2B, imm, nop, 2)
+	OP(0x2C, abso, bit, 4)
+	OP(0x2D, abso, and, 4)
+	OP(0x2E, abso, rol, 6)
+	OP(0x2F, abso, rla, 6)
+	/* 3 */
+	OP(0x30, rel, bmi, 2)
+	OP(0x31, indy, and, 5)
+	OP(0x32, imp, nop, 2)
+	OP(0x33, indy, rla, 8)
+	OP(0x34, zpx, nop, 4)
+	OP(0x35, zpx, and, 4)
+	OP(0x36, zpx, rol, 6)
+	OP(0x37, zpx, rla, 6)
+	OP(0x38, imp, sec, 2)
+	OP(0x39, absy, and, 4)
+	OP(0x3A, imp, nop, 2)
+	OP(0x3B, absy, rla, 7)
+	OP(0x3C, absx, nop, 4)
+	OP(0x3D, absx, and, 4)
+	OP(0x3E, absx, rol, 7)
+	OP(0x3F, absx, rla, 7)
+	/* 4 */
+	OP(0x40, imp, rti, 6)
+	OP(0x41, indx, eor, 6)
+	OP(0x42, imp, nop, 2)
+	OP(0x43, indx, sre, 8)
+	OP(0x44, zp, nop, 3)
+	OP(0x45, zp, eor, 3)
+	OP(0x46, zp, lsr, 5)
+	OP(0x47, zp, sre, 5)
+	OP(0x48, imp, pha, 3)
+	OP(0x49, imm, eor, 2)
+	OP(0x4A, acc, lsr, 2)
+	OP(0x4B, imm, nop, 2)
+	OP(0x4C, abso, jmp, 3)
+	OP(0x4D, abso, eor, 4)
+	OP(0x4E, abso, lsr, 6)
+	OP(0x4F, abso, sre, 6)
+	/* 5 */
+	OP(0x50, rel, bvc, 2)
+	OP(0x51, indy, eor, 5)
+	OP(0x52, imp, nop, 2)
+	OP(0x53, indy, sre, 8)
+	OP(0x54, zpx, nop, 4)
+	OP(0x55, zpx, eor, 4)
+	OP(0x56, zpx, lsr, 6)
+	OP(0x57, zpx, sre, 6)
+	OP(0x58, imp, cli, 2)
+	OP(0x59, absy, eor, 4)
+	OP(0x5A, imp, nop, 2)
+	OP(0x5B, absy, sre, 7)
+	OP(0x5C, absx, nop, 4)
+	OP(0x5D, absx, eor, 4)
+	OP(0x5E, absx, lsr, 7)
+	OP(0x5F, absx, sre, 7)
+	/* 6 */
+	OP(0x60, imp, rts, 6)
+	OP(0x61, indx, adc, 6)
+	OP(0x62, imp, nop, 2)
+	OP(0x63, indx, rra, 8)
+	OP(0x64, zp, nop, 3)
+	OP(0x65, zp, adc, 3)
+	OP(0x66, zp, ror, 5)
+	OP(0x67, zp, rra, 5)
+	OP(0x68, imp, pla, 4)
+	OP(0x69, imm, adc, 2)
+	OP(0x6A, acc, ror, 2)
+	OP(0x6B, imm, nop, 2)
+	OP(0x6C, ind, jmp, 5)
+	OP(0x6D, abso, adc, 4)
+	OP(0x6E, abso, ror, 6)
+	OP(0x6F, abso, rra, 6)
+	/* 7 */
+	OP(0x70, rel, bvs, 2)
+	OP(0x71, indy, adc, 5)
+	OP(0x72, imp, nop, 2)
+	OP(0x73, indy, rra, 8)
+	OP(0x74, zpx, nop, 4)
+	OP(0x75, zpx, adc, 4)
+	OP(0x76, zpx, ror, 6)
+	OP(0x77, zpx, rra, 6)
+	OP(0x78, imp, sei, 2)
+	OP(0x79, absy, adc, 4)
+	OP(0x7A, imp, nop, 2)
+	OP(0x7B, absy, rra, 7)
+	OP(0x7C, absx, nop, 4)
+	OP(0x7D, absx, adc, 4)
+	OP(0x7E, absx, ror, 7)
+	OP(0x7F, absx, rra, 7)
+	/* 8 */
+	OP(0x80, imm, nop, 2)
+	OP(0x81, indx, sta, 6)
+	OP(0x82, imm, nop, 2)
+	OP(0x83, indx, sax, 6)
+	OP(0x84, zp, sty, 3)
+	OP(0x85, zp, sta, 3)
+	OP(0x86, zp, stx, 3)
+	OP(0x87, zp, sax, 3)
+	OP(0x88, imp, dey, 2)
+	OP(0x89, imm, nop, 2)
+	OP(0x8A, imp, txa, 2)
+	OP(0x8B, imm, nop, 2)
+	OP(0x8C, abso, sty, 4)
+	OP(0x8D, abso, sta, 4)
+	OP(0x8E, abso, stx, 4)
+	OP(0x8F, abso, sax, 4)
+	/* 9 */
+	OP(0x90, rel, bcc, 2)
+	OP(0x91, indy, sta, 6)
+	OP(0x92, imp, nop, 2)
+	OP(0x93, indy, nop, 6)
+	OP(0x94, zpx, sty, 4)
+	OP(0x95, zpx, sta, 4)
+	OP(0x96, zpy, stx, 4)
+	OP(0x97, zpy, sax, 4)
+	OP(0x98, imp, tya, 2)
+	OP(0x99, absy, sta, 5)
+	OP(0x9A, imp, txs, 2)
+	OP(0x9B, absy, nop, 5)
+	OP(0x9C, absx, nop, 5)
+	OP(0x9D, absx, sta, 5)
+	OP(0x9E, absy, nop, 5)
+	OP(0x9F, absy, nop, 5)
+	/* A */
+	OP(0xA0, imm, ldy, 2)
+	OP(0xA1, indx, lda, 6)
+	OP(0xA2, imm, ldx, 2)
+	OP(0xA3, indx, lax, 6)
+	OP(0xA4, zp, ldy, 3)
+	OP(0xA5, zp, lda, 3)
+	OP(0xA6, zp, ldx, 3)
+	OP(0xA7, zp, lax, 3)
+	OP(0xA8, imp, tay, 2)
+	OP(0xA9, imm, lda, 2)
+	OP(0xAA, imp, tax, 2)
+	OP(0xAB, imm, nop, 2)
+	OP(0xAC, abso, ldy, 4)
+	OP(0xAD, abso, lda, 4)
+	OP(0xAE, abso, ldx, 4)
+	OP(0xAF, abso, lax, 4)
+	/* B */
+	OP(0xB0, rel, bcs, 2)
+	OP(0xB1, indy, lda, 5)
+	OP(0xB2, imp, nop, 2)
+	OP(0xB3, indy, lax, 5)
+	OP(0xB4, zpx, ldy, 4)
+	OP(0xB5, zpx, lda, 4)
+	OP(0xB6, zpy, ldx, 4)
+	OP(0xB7, zpy, lax, 4)
+	OP(0xB8, imp, clv, 2)
+	OP(0xB9, absy, lda, 4)
+	OP(0xBA, imp, tsx, 2)
+	OP(0xBB, absy, lax, 4)
+	OP(0xBC, absx, ldy, 4)
+	OP(0xBD, absx, lda, 4)
+	OP(0xBE, absy, ldx, 4)
+	OP(0xBF, absy, lax, 4)
+	/* C */
+	OP(0xC0, imm, cpy, 2)
+	OP(0xC1, indx, cmp, 6)
+	OP(0xC2, imm, nop, 2)
+	OP(0xC3, indx, dcp, 8)
+	OP(0xC4, zp, cpy, 3)
+	OP(0xC5, zp, cmp, 3)
+	OP(0xC6, zp, dec, 5)
+	OP(0xC7, zp, dcp, 5)
+	OP(0xC8, imp, iny, 2)
+	OP(0xC9, imm, cmp, 2)
+	OP(0xCA, imp, dex, 2)
+	OP(0xCB, imm, nop, 2)
+	OP(0xCC, abso, cpy, 4)
+	OP(0xCD, abso, cmp, 4)
+	OP(0xCE, abso, dec, 6)
+	OP(0xCF, abso, dcp, 6)
+	/* D */
+	OP(0xD0, rel, bne, 2)
+	OP(0xD1, indy, cmp, 5)
+	OP(0xD2, imp, nop, 2)
+	OP(0xD3, indy, dcp, 8)
+	OP(0xD4, zpx, nop, 4)
+	OP(0xD5, zpx, cmp, 4)
+	OP(0xD6, zpx, dec, 6)
+	OP(0xD7, zpx, dcp, 6)
+	OP(0xD8, imp, cld, 2)
+	OP(0xD9, absy, cmp, 4)
+	OP(0xDA, imp, nop, 2)
+	OP(0xDB, absy, dcp, 7)
+	OP(0xDC, absx, nop, 4)
+	OP(0xDD, absx, cmp, 4)
+	OP(0xDE, absx, dec, 7)
+	OP(0xDF, absx, dcp, 7)
+	/* E */
+	OP(0xE0, imm, cpx, 2)
+	OP(0xE1, indx, sbc, 6)
+	OP(0xE2, imm, nop, 2)
+	OP(0xE3, indx, isb, 8)
+	OP(0xE4, zp, cpx, 3)
+	OP(0xE5, zp, sbc, 3)
+	OP(0xE6, zp, inc, 5)
+	OP(0xE7, zp, isb, 5)
+	OP(0xE8, imp, inx, 2)
+	OP(0xE9, imm, sbc, 2)
+	OP(0xEA, imp, nop, 2)
+	OP(0xEB, imm, sbc, 2)
+	OP(0xEC, abso, cpx, 4)
+	OP(0xED, abso, sbc, 4)
+	OP(0xEE, abso, inc, 6)
+	OP(0xEF, abso, isb, 6)
+	/* F */
+	OP(0xF0, rel, beq, 2)
+	OP(0xF1, indy, sbc, 5)
+	OP(0xF2, imp, nop, 2)
+	OP(0xF3, indy, isb, 8)
+	OP(0xF4, zpx, nop, 4)
+	OP(0xF5, zpx, sbc, 4)
+	OP(0xF6, zpx, inc, 6)
+	OP(0xF7, zpx, isb, 6)
+	OP(0xF8, imp, sed, 2)
+	OP(0xF9, absy, sbc, 4)
+	OP(0xFA, imp, nop, 2)
+	OP(0xFB, absy, isb, 7)
+	OP(0xFC, absx, nop, 4)
+	OP(0xFD, absx, sbc, 4)
+	OP(0xFE, absx, inc, 7)
+	OP(0xFF, absx, isb, 7)
+	}
 }
 
-static void (*loopexternal) (void);
+#undef OP
+
 
-int log_6502 = 0;
 
-uint64_t exec6502(uint64_t tickcount)
+void nmi6502(struct m6502 *cpu)
 {
-	uint64_t startticks;
-	clockgoal6502 += tickcount;
-
-	startticks = clockticks6502;
-	while (clockticks6502 < clockgoal6502) {
-		opcode = read6502(pc++);
-		status |= FLAG_CONSTANT;
-		if (log_6502) {
-			uint8_t c[3];
-			char *dis;
-			c[0] = opcode;
-			c[1] = read6502_debug(pc);
-			c[2] = read6502_debug(pc + 1);
-			dis = dis6502(pc - 1, c);
-			fprintf(stderr, "%02X %02X %02X %02X %02X | %04X %s\n",
-				a, x, y, sp, status, pc - 1, dis);
-		}
-		penaltyop = 0;
-		penaltyaddr = 0;
+	push16(cpu, cpu->pc);
+	push8(cpu, cpu->status);
+	cpu->status |= FLAG_INTERRUPT;
+	cpu->pc = (uint16_t) read6502(cpu, 0xFFFA) | ((uint16_t) read6502(cpu, 0xFFFB) << 8);
+}
 
-		(*addrtable[opcode]) ();
-		(*optable[opcode]) ();
-		clockticks6502 += ticktable[opcode];
-		if (penaltyop && penaltyaddr)
-			clockticks6502++;
+void irq6502(struct m6502 *cpu)
+{
+	if ((cpu->status & FLAG_INTERRUPT) == FLAG_INTERRUPT)
+		return;		//abort if interrupts are inhibited
+	push16(cpu, cpu->pc);
+	push8(cpu, cpu->status);
+	cpu->status |= FLAG_INTERRUPT;
+	cpu->pc = (uint16_t) read6502(cpu, 0xFFFE) | ((uint16_t) read6502(cpu, 0xFFFF) << 8);
+}
+
+
+/* Record an instruction in the trace ring and/or the debug log */
+static void trace_insn(struct m6502 *cpu)
+{
+	if (cpu->trace) {
+		struct cputrace_rec *r = cputrace_next(cpu->trace);
+		r->tstate = cpu->clockticks;
+		r->pc = cpu->pc - 1;
+		r->len = 3;
+		r->op[0] = cpu->opcode;
+		r->op[1] = read6502_debug(cpu, cpu->pc);
+		r->op[2] = read6502_debug(cpu, cpu->pc + 1);
+		r->reg[0] = cpu->a;
+		r->reg[1] = cpu->x;
+		r->reg[2] = cpu->y;
+		r->reg[3] = cpu->sp;
+		r->reg[4] = cpu->status;
+	}
+	if (TRACE_ON(cpu->log)) {
+		uint8_t c[3];
+		char *dis;
+		c[0] = cpu->opcode;
+		c[1] = read6502_debug(cpu, cpu->pc);
+		c[2] = read6502_debug(cpu, cpu->pc + 1);
+		dis = dis6502(cpu->pc - 1, c);
+		fprintf(stderr, "%02X %02X %02X %02X %02X | %04X %s\n",
+			cpu->a, cpu->x, cpu->y, cpu->sp, cpu->status, cpu->pc - 1, dis);
+	}
+}
 
-		instructions++;
+/* Inlined twice, once with each constant value of traced */
+OPINLINE void run6502(struct m6502 *cpu, int traced)
+{
+	while (cpu->clockticks < cpu->clockgoal) {
+		if (cpu->cover)
+			coverage_mark(cpu->cover, cpu->pc);
+		cpu->opcode = read6502(cpu, cpu->pc++);
+		cpu->status |= FLAG_CONSTANT;
+		if (traced)
+			trace_insn(cpu);
+		cpu->penaltyop = 0;
+		cpu->penaltyaddr = 0;
+		cpu->useaccum = 0;
 
-		if (loopexternal)
-			(*loopexternal) ();
+		execute6502(cpu);
+		if (cpu->penaltyop && cpu->penaltyaddr)
+			cpu->clockticks++;
+
+		cpu->instructions++;
+
+		if (cpu->loopexternal)
+			(*cpu->loopexternal) (cpu);
 	}
+}
+
+/*
+ *	The choice of loop is made per call, so tracing that is switched on
+ *	part way through takes effect from the next call.
+ */
+uint64_t exec6502(struct m6502 *cpu, uint64_t tickcount)
+{
+	uint64_t startticks;
+	cpu->clockgoal += tickcount;
+
+	startticks = cpu->clockticks;
+	if (cpu->trace || TRACE_ON(cpu->log))
+		run6502(cpu, 1);
+	else
+		run6502(cpu, 0);
 
-	return (clockticks6502 - startticks);
+	return (cpu->clockticks - startticks);
 }
 
-void step6502(void)
+void step6502(struct m6502 *cpu)
 {
-	opcode = read6502(pc++);
-	status |= FLAG_CONSTANT;
+	if (cpu->cover)
+		coverage_mark(cpu->cover, cpu->pc);
+	cpu->opcode = read6502(cpu, cpu->pc++);
+	cpu->status |= FLAG_CONSTANT;
 
-	penaltyop = 0;
-	penaltyaddr = 0;
+	cpu->penaltyop = 0;
+	cpu->penaltyaddr = 0;
+	cpu->useaccum = 0;
 
-	(*addrtable[opcode]) ();
-	(*optable[opcode]) ();
-	clockticks6502 += ticktable[opcode];
+	execute6502(cpu);
 	//if (penaltyop && penaltyaddr) clockticks6502++;
-	clockgoal6502 = clockticks6502;
+	cpu->clockgoal = cpu->clockticks;
 
-	instructions++;
+	cpu->instructions++;
 
-	if (loopexternal)
-		(*loopexternal) ();
+	if (cpu->loopexternal)
+		(*cpu->loopexternal) (cpu);
 }
 
-void hookexternal(void (*funcptr) (void))
+void hookexternal(struct m6502 *cpu, void (*funcptr) (struct m6502 *cpu))
 {
-	loopexternal = funcptr;
+	cpu->loopexternal = funcptr;
 }
 
-uint16_t getPC(void)
+uint16_t getPC(struct m6502 *cpu)
 {
-	return (pc);
+	return (cpu->pc);
 }
 
-uint64_t getclockticks(void)
+uint64_t getclockticks(struct m6502 *cpu)
 {
-	return (clockticks6502);
+	return (cpu->clockticks);
 }
 
-void waitstates(uint32_t n)
+void waitstates(struct m6502 *cpu, uint32_t n)
 {
-	clockticks6502 += n;
+	cpu->clockticks += n;
 }
 
 void init6502(void)
 {
+	build_tables();
 	disassembler_init();
 }
@@ -1,23 +1,40 @@
 #ifndef __6502_H__
 #define __6502_H__
 
+/* One 6502 and the state of the instruction it is running */
+struct m6502 {
+	uint16_t pc;
+	uint8_t sp, a, x, y, status;
+
+	uint64_t instructions;
+	uint64_t clockticks, clockgoal;
+	uint16_t oldpc, ea, reladdr, value, result;
+	uint8_t opcode;
+	uint8_t penaltyop, penaltyaddr, useaccum;
+
+	void (*loopexternal)(struct m6502 *cpu);
+	int log;
+	/* See cputrace.h */
+	struct cputrace *trace;
+	/* Coverage bitmap or NULL, see coverage.h */
+	uint8_t *cover;
+};
+
 extern void init6502(void);
-extern void reset6502(void);
-extern void nmi6502(void);
-extern void irq6502(void);
-extern uint64_t exec6502(uint64_t tickcount);
-extern void step6502(void);
-extern void hookexternal(void (*loopexternal)(void));
-extern uint16_t getPC(void);
-extern uint64_t getclockticks(void);
-extern void waitstates(uint32_t n);
+extern void reset6502(struct m6502 *cpu);
+extern void nmi6502(struct m6502 *cpu);
+extern void irq6502(struct m6502 *cpu);
+extern uint64_t exec6502(struct m6502 *cpu, uint64_t tickcount);
+extern void step6502(struct m6502 *cpu);
+extern void hookexternal(struct m6502 *cpu, void (*loopexternal)(struct m6502 *cpu));
+extern uint16_t getPC(struct m6502 *cpu);
+extern uint64_t getclockticks(struct m6502 *cpu);
+extern void waitstates(struct m6502 *cpu, uint32_t n);
 
 //externally supplied functions
-extern uint8_t read6502(uint16_t address);
-extern uint8_t read6502_debug(uint16_t address);
-extern void write6502(uint16_t address, uint8_t value);
-
-extern int log_6502;
+extern uint8_t read6502(struct m6502 *cpu, uint16_t address);
+extern uint8_t read6502_debug(struct m6502 *cpu, uint16_t address);
+extern void write6502(struct m6502 *cpu, uint16_t address, uint8_t value);
 
 #ifdef _6502_PRIVATE
 
@@ -25,9 +42,6 @@ extern void disassembler_init(void);
 extern char *dis6502(uint16_t addr, uint8_t *p);
 
 
-extern uint8_t sp, a, x, y, status;
-extern uint16_t pc;
-
 //6502 defines
 #define UNDOCUMENTED //when this is defined, undocumented opcodes are handled.
                      //otherwise, they're simply treated as NOPs.
@@ -48,24 +62,24 @@ extern uint16_t pc;
 
 #define BASE_STACK     0x100
 
-#define saveaccum(n) a = (uint8_t)((n) & 0x00FF)
+#define saveaccum(n) cpu->a = (uint8_t)((n) & 0x00FF)
 
 
 //flag modifier macros
-#define setcarry() status |= FLAG_CARRY
-#define clearcarry() status &= (~FLAG_CARRY)
-#define setzero() status |= FLAG_ZERO
-#define clearzero() status &= (~FLAG_ZERO)
-#define setinterrupt() status |= FLAG_INTERRUPT
-#define clearinterrupt() status &= (~FLAG_INTERRUPT)
-#define setdecimal() status |= FLAG_DECIMAL
-#define cleardecimal() status &= (~FLAG_DECIMAL)
-#define setbreak() status |= FLAG_BREAK
-#define clearbreak() status &= (~FLAG_BREAK)
-#define setoverflow() status |= FLAG_OVERFLOW
-#define clearoverflow() status &= (~FLAG_OVERFLOW)
-#define setsign() status |= FLAG_SIGN
-#define clearsign() status &= (~FLAG_SIGN)
+#define setcarry() cpu->status |= FLAG_CARRY
+#define clearcarry() cpu->status &= (~FLAG_CARRY)
+#define setzero() cpu->status |= FLAG_ZERO
+#define clearzero() cpu->status &= (~FLAG_ZERO)
+#define setinterrupt() cpu->status |= FLAG_INTERRUPT
+#define clearinterrupt() cpu->status &= (~FLAG_INTERRUPT)
+#define setdecimal() cpu->status |= FLAG_DECIMAL
+#define cleardecimal() cpu->status &= (~FLAG_DECIMAL)
+#define setbreak() cpu->status |= FLAG_BREAK
+#define clearbreak() cpu->status &= (~FLAG_BREAK)
+#define setoverflow() cpu->status |= FLAG_OVERFLOW
+#define clearoverflow() cpu->status &= (~FLAG_OVERFLOW)
+#define setsign() cpu->status |= FLAG_SIGN
+#define clearsign() cpu->status &= (~FLAG_SIGN)
 
 
 //flag calculation macros
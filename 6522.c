@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "6522.h"
+#include "trace.h"
 
 /*
  *	Minimal beginnings of 6522 VIA emulation
@@ -22,10 +23,17 @@ struct via6522 {
 	uint8_t irb;
 	uint8_t ddra;
 	uint8_t ddrb;
-	uint16_t t1;
+	/* The timers are kept as the clock on which they next pass zero
+	   and the counters worked out from that when read */
+	uint64_t clock;
+	uint64_t t1_zero;
+	uint64_t t2_zero;
 	uint16_t t1l;
-	uint16_t t2;
+	uint16_t t2;		/* Counter when counting PB6 pulses */
 	uint8_t t2l;
+	uint8_t t1_armed;	/* Next zero sets the flag */
+	uint8_t t2_armed;
+	uint8_t pb7;		/* T1 output on PB7 */
 	/* Pin states rather than registers */
 	uint8_t ca;
 	uint8_t cb;
@@ -42,7 +50,7 @@ static void via_recalc_irq(struct via6522 *via)
 		via->ifr &= 0x7F;
 	/* We interrupt if ier and ifr are set */
 	/* Note: the pin is inverted but we model irq state not the pin! */
-	if ((via->trace) && irq != via->irq)
+	if (TRACE_ON(via->trace) && irq != via->irq)
 		fprintf(stderr, "[VIA IRQ now %02X.]\n", irq);
 	via->irq = irq;
 }
@@ -53,47 +61,86 @@ static void via_recalc_all(struct via6522 *via)
 	via_recalc_irq(via);
 }
 
-/* Perform time related processing for the VIA */
+static uint16_t via_t1(struct via6522 *via)
+{
+	uint16_t r = via->t1_zero - 1 - via->clock;
+	/* The cycle of the free running reload reads as FFFF */
+	if ((via->acr & 0x40) && r == via->t1l + 1)
+		r = 0xFFFF;
+	return r;
+}
+
+static uint16_t via_t2(struct via6522 *via)
+{
+	if (via->acr & 0x20)
+		return via->t2;
+	return via->t2_zero - 1 - via->clock;
+}
+
+/*
+ *	Perform time related processing for the VIA. The front end runs
+ *	the CPU at most via_deadline() clocks at a time to see the timer
+ *	interrupts on the clock they happen.
+ */
 void via_tick(struct via6522 *via, unsigned int clocks)
 {
-	/* This isn't quite right but it's near enough for the moment */
-	if (via->t1) {
-		if (clocks >= via->t1) {
-			if (via->trace)
-				fprintf(stderr,"[VIA T1 expire.].\n");
-			via->ifr |= 0x40;
-			via_recalc_irq(via);
-			/* +1 or + 2 ?? */
-			if (via->acr & 0x40)
-				via->t1 = via->t1l + 1;
-			else
-				via->t1 = 0;
+	uint64_t n;
+
+	via->clock += clocks;
+
+	/* T1 passes zero N + 1 clocks after loading with N and when free
+	   running reloads on the clock after, so every N + 2 */
+	if (via->t1_armed && via->t1_zero <= via->clock) {
+		if (TRACE_ON(via->trace))
+			fprintf(stderr,"[VIA T1 expire.].\n");
+		via->ifr |= 0x40;
+		via_recalc_irq(via);
+		if (via->acr & 0x40) {
+			n = (via->clock - via->t1_zero) / (via->t1l + 2) + 1;
+			via->t1_zero += n * (via->t1l + 2);
+			via->pb7 ^= n & 1;
+		} else {
+			via->t1_armed = 0;
+			via->pb7 = 1;
 		}
-		else
-			via->t1 -= clocks;
+		if (via->acr & 0x80)
+			via_recalc_outputs(via);
 	}
 
-	if (via->t2 && !(via->acr & 0x20)) {
-		if (clocks >= via->t2) {
-			via->ifr |= 0x20;
-			via_recalc_irq(via);
-			via->t2 = 0;
-			if (via->trace)
-				fprintf(stderr,"[VIA T2 expire.].\n");
-		}
-		via->t2 -= clocks;
+	/* T2 is one shot. After the interrupt it keeps counting down */
+	if (via->t2_armed && !(via->acr & 0x20) && via->t2_zero <= via->clock) {
+		via->ifr |= 0x20;
+		via_recalc_irq(via);
+		via->t2_armed = 0;
+		if (TRACE_ON(via->trace))
+			fprintf(stderr,"[VIA T2 expire.].\n");
 	}
 }
 
+/* Clocks until the next timer interrupt, VIA_IDLE if none is due */
+unsigned int via_deadline(struct via6522 *via)
+{
+	uint64_t d = VIA_IDLE;
+
+	if (via->t1_armed && (via->ier & 0x40))
+		d = via->t1_zero - via->clock;
+	if (via->t2_armed && (via->ier & 0x20) && !(via->acr & 0x20) &&
+	    via->t2_zero - via->clock < d)
+		d = via->t2_zero - via->clock;
+	return d;
+}
+
 uint8_t via_read(struct via6522 *via, uint8_t addr)
 {
 	uint8_t r;
-	if (via->trace)
+	if (TRACE_ON(via->trace))
 		fprintf(stderr, "[VIA read %d: ", addr);
 	switch(addr) {
 		case 0:
 			r = via->irb & ~via->ddrb;
 			r |= via->orb & via->ddrb;
+			if (via->acr & 0x80)
+				r = (r & 0x7F) | (via->pb7 << 7);
 			via_handshake_b(via);
 			break;
 		case 1:
@@ -110,10 +157,10 @@ uint8_t via_read(struct via6522 *via, uint8_t addr)
 		case 4:
 			via->ifr &= ~0x40;	/* T1 timeout */
 			via_recalc_irq(via);
-			r = via->t1;
+			r = via_t1(via);
 			break;
 		case 5:
-			r = via->t1 >> 8;
+			r = via_t1(via) >> 8;
 			break;
 		case 6:
 			r = via->t1l;
@@ -124,10 +171,10 @@ uint8_t via_read(struct via6522 *via, uint8_t addr)
 		case 8:
 			via->ifr &= ~0x20;	/* T2 timeout */
 			via_recalc_irq(via);
-			r = via->t2;
+			r = via_t2(via);
 			break;
 		case 9:
-			r = via->t2 >> 8;
+			r = via_t2(via) >> 8;
 			break;
 		case 10:
 			r = via->sr;
@@ -149,14 +196,14 @@ uint8_t via_read(struct via6522 *via, uint8_t addr)
 			r =  via->ira;
 			break;
 	}
-	if (via->trace)
+	if (TRACE_ON(via->trace))
 		fprintf(stderr, "%02X.]\n", r);
 	return r;
 }
 
 void via_write(struct via6522 *via, uint8_t addr, uint8_t val)
 {
-	if (via->trace)
+	if (TRACE_ON(via->trace))
 		fprintf(stderr, "[VIA write %d: %02X.]\n ", addr, val);
 	switch(addr) {
 		case 0:
@@ -184,11 +231,15 @@ void via_write(struct via6522 *via, uint8_t addr, uint8_t val)
 		case 5:
 			via->t1l &= 0xFF;
 			via->t1l |= val << 8;
-			via->t1 = via->t1l;
+			via->t1_zero = via->clock + via->t1l + 1;
+			via->t1_armed = 1;
 			via->ifr &= ~0x40;	/* T1 timeout */
 			via_recalc_irq(via);
-			if (via->trace)
-				fprintf(stderr, "[VIA T1 begin %04X.]\n", via->t1);
+			via->pb7 = 0;
+			if (via->acr & 0x80)
+				via_recalc_outputs(via);
+			if (TRACE_ON(via->trace))
+				fprintf(stderr, "[VIA T1 begin %04X.]\n", via->t1l);
 			break;
 		case 7:
 			via->t1l &= 0xFF;
@@ -200,6 +251,8 @@ void via_write(struct via6522 *via, uint8_t addr, uint8_t val)
 		case 9:
 			via->t2 = val << 8;
 			via->t2 |= via->t2l;
+			via->t2_zero = via->clock + via->t2 + 1;
+			via->t2_armed = 1;
 			via->ifr &= ~0x20;	/* T2 timeout */
 			via_recalc_irq(via);
 			break;
@@ -207,7 +260,16 @@ void via_write(struct via6522 *via, uint8_t addr, uint8_t val)
 			via->sr = val;
 			break;
 		case 11:
+			/* Switching T2 between timing and counting keeps the
+			   count */
+			if ((val ^ via->acr) & 0x20) {
+				if (val & 0x20)
+					via->t2 = via_t2(via);
+				else
+					via->t2_zero = via->clock + via->t2 + 1;
+			}
 			via->acr = val;
+			via_recalc_outputs(via);
 			break;
 		case 12:
 			via->pcr = val;
@@ -255,6 +317,7 @@ struct via6522 *via_create(void)
         exit(1);
     }
     memset(v, 0, sizeof(struct via6522));
+    v->pb7 = 1;
     return v;
 }
 
@@ -280,10 +343,22 @@ uint8_t via_get_direction_b(struct via6522 *via)
 
 uint8_t via_get_port_b(struct via6522 *via)
 {
+    /* PB7 is driven by T1 when ACR bit 7 is set */
+    if (via->acr & 0x80)
+        return (via->orb & via->ddrb & 0x7F) | (via->pb7 << 7);
     return via->orb & via->ddrb;
 }
 
 void via_set_port_b(struct via6522 *via, uint8_t val)
 {
+    /* In pulse counting mode T2 counts falling edges on PB6 */
+    if ((via->acr & 0x20) && (via->irb & ~val & 0x40)) {
+        via->t2--;
+        if (via->t2 == 0 && via->t2_armed) {
+            via->ifr |= 0x20;
+            via_recalc_irq(via);
+            via->t2_armed = 0;
+        }
+    }
     via->irb = val;
 }
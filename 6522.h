@@ -4,7 +4,10 @@
 
 struct via6522;
 
+#define VIA_IDLE	(~0U)		/* No timer interrupt is due */
+
 extern void via_tick(struct via6522 *via, unsigned int cycles);
+extern unsigned int via_deadline(struct via6522 *via);
 extern void via_write(struct via6522 *via, uint8_t addr, uint8_t val);
 extern uint8_t via_read(struct via6522 *via, uint8_t addr);
 extern struct via6522 *via_create(void);
@@ -62,6 +62,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "6800.h"
+#include "trace.h"
 
 #define REG_D	((cpu->a << 8) | (cpu->b))
 #define CARRY	(cpu->p & P_C)
@@ -1584,7 +1585,7 @@ static int m6800_vector(struct m6800 *cpu, uint16_t vector)
     cpu->pc = m6800_do_read(cpu, vector) << 8;
     cpu->pc |= m6800_do_read(cpu, vector + 1);
     cpu->wait = 0;
-    if (cpu->debug)
+    if (TRACE_ON(cpu->debug))
         fprintf(stderr, "*** Vector %04X\n", vector);
     return clocks;
 }
@@ -1794,22 +1795,57 @@ static void m6800_hcf(struct m6800 *cpu)
     exit(1);
 }
 
-static int m6800_execute_one(struct m6800 *cpu)
+/*
+ *	Predecode cache. Each entry holds the opcode (with any 68HC11 prefix),
+ *	the raw operand bytes and the cycle count for the instruction at a pc.
+ *	Writes through the CPU drop any entry they overlap and a flush drops
+ *	everything, which the board must do when it changes the memory map.
+ */
+void m6800_decode_flush(struct m6800 *cpu)
 {
-    uint16_t fetch_pc = cpu->pc;
-    uint16_t opcode = m6800_do_read(cpu, cpu->pc);
-    uint8_t data8, tmp8;
-    uint16_t data16, tmp16;
-    uint8_t tmpc, tmp2;
-    uint8_t add;
-    int clocks = 0;
-    int table = 0;
+    if (++cpu->decode_gen == 0) {
+        memset(cpu->decode, 0, sizeof(cpu->decode));
+        cpu->decode_gen = 1;
+    }
+}
 
-    if (cpu->debug)
-        m6800_disassemble(cpu, cpu->pc);
+static void m6800_decode_write(struct m6800 *cpu, uint16_t addr)
+{
+    struct m6800_decode *d;
+    unsigned int i;
+
+    /* An instruction we cache is at most four bytes */
+    for (i = 0; i < 4; i++) {
+        d = &cpu->decode[(uint16_t)(addr - i) % M6800_DECODE];
+        if (d->pc == (uint16_t)(addr - i))
+            d->gen = 0;
+    }
+}
 
-    cpu->pc++;
+/* Fetching from the internal I/O has side effects so is never cached */
+static int m6800_decode_io(struct m6800 *cpu, uint16_t addr, uint16_t end)
+{
+    if (cpu->intio == INTIO_6803)
+        return addr < 0x20 || end < addr;
+#ifdef WITH_HC11
+    if (cpu->intio == INTIO_HC11)
+        return end >= cpu->io.iobase && addr <= cpu->io.ioend;
+#endif
+    return 0;
+}
+
+static int m6800_decode(struct m6800 *cpu, struct m6800_decode *d)
+{
+    uint16_t pc = cpu->pc;
+    uint16_t opcode;
+    int clocks = 0;
+    int table = 0;
+    int n = 0;
+    uint8_t tmp8;
 
+    /* Whatever was in the slot is being replaced */
+    d->gen = 0;
+    opcode = m6800_do_read(cpu, pc++);
 
     /* The 68HC11 has some prefixes so treat them as a single 16bit opcode
        where 00xx matches the other processors. Multiple prefixes will mean
@@ -1829,12 +1865,11 @@ static int m6800_execute_one(struct m6800 *cpu)
                 break;
             }
             opcode <<= 8;
-            opcode |= m6800_do_read(cpu, cpu->pc);
-            cpu->pc++;
+            opcode |= m6800_do_read(cpu, pc++);
             clocks++;
         }
     }
-    /* Fetch address/data for non immediate opcodes */
+    /* Operand bytes for non immediate opcodes */
     switch(opcode & 0xF0) {
         case 0x80:	/* Immediate 8/16bit */
         case 0xC0:	/* Immediate 8/16bit */
@@ -1842,37 +1877,28 @@ static int m6800_execute_one(struct m6800 *cpu)
             if (opcode != 0x8D && ((opcode & 0x0F) >= 0x0C || (opcode & 0x0F) == 3)) {
                 /* The apparent store immediates (and 68HC11 XGDX) break the
                    decode rule */
-                if ((opcode & 0xFF) != 0x8F && (opcode & 0xFF) != 0xCF) {
-                    data16 = m6800_do_read(cpu, cpu->pc++) << 8; 
-                    data16 |= m6800_do_read(cpu, cpu->pc++);
-                }
+                if ((opcode & 0xFF) != 0x8F && (opcode & 0xFF) != 0xCF)
+                    n = 2;
                 break;
             }
         case 0x20:	/* Branches */
         case 0x90:	/* Direct */
         case 0xD0:	/* Direct */
-            data8 = m6800_do_read(cpu, cpu->pc++);
-            break;
         case 0x60:	/* Indexed */
         case 0xA0:	/* Indexed */
         case 0xE0:	/* Indexed */
-            /* Save the first byte for the strange 6303 logic immediate ops */
-            data8 = m6800_do_read(cpu, cpu->pc++);
-            data16 = data8 + cpu->x;
-            /* 0x18: Use Y, index via Y
-               0x1A: Use Y, index via X
-               0xCD: Use X, index via Y - some exceptions */
-            if ((opcode & 0xFF00) == 0x1800 || (opcode & 0xFF00) == 0xCD00)
-                data16 = data8 + cpu->y;
+            n = 1;
             break;
         case 0x70:	/* Extended */
         case 0xB0:	/* Extended */
         case 0xF0:	/* Extended */
-            /* Ordering ? */
-            data16 = m6800_do_read(cpu, cpu->pc++) << 8; 
-            data16 |= m6800_do_read(cpu, cpu->pc++);
+            n = 2;
             break;
     }
+    if (n > 0)
+        d->op[0] = m6800_do_read(cpu, pc++);
+    if (n > 1)
+        d->op[1] = m6800_do_read(cpu, pc++);
     /* 68HC11 prefixed opcodes match the non prefix form plus the clock.
        We need per prefix tables adding because a 68HC11 doens't implement
        all prefixes of all forms */
@@ -1880,28 +1906,92 @@ static int m6800_execute_one(struct m6800 *cpu)
         tmp8 = clock_hc11[opcode & 0xFF][table];
     else
         tmp8 = clock_count[opcode][cpu->type];
-    clocks += tmp8;
+    d->opcode = opcode;
+    d->len = pc - cpu->pc;
+    d->clocks = clocks + tmp8;
     /* Not valid on this processor */
-    if (tmp8 == 0) {
-        /* The HC11 pushes the prefix address */
-        if (cpu->type == CPU_6303 || cpu->type == CPU_68HC11) {
-            /* TRAP pushes the faulting address */
-            fprintf(stderr, "illegal instruction %02X:%02X at %04X\n",
-                opcode, m6800_do_read(cpu, fetch_pc + 1), fetch_pc);
-            cpu->pc = fetch_pc;
-            if (cpu->type == CPU_6303)
-                m6800_vector(cpu, 0xFFEE);
-            else
-                m6800_vector(cpu, 0xFFF8);
-            return clocks;	/* Not correct */
-        } else {
-            /* An invalid instruction we don't yet model */
-            fprintf(stderr, "illegal instruction %02X at %04X\n",
-                opcode, fetch_pc);
-            return clocks;
+    if (tmp8 == 0)
+        return 0;
+    if (d->len <= 4 && !m6800_decode_io(cpu, cpu->pc, pc - 1)) {
+        d->pc = cpu->pc;
+        d->gen = cpu->decode_gen;
+    }
+    return 1;
+}
+
+static int m6800_execute_one(struct m6800 *cpu)
+{
+    uint16_t fetch_pc = cpu->pc;
+    struct m6800_decode *d = &cpu->decode[fetch_pc % M6800_DECODE];
+    uint16_t opcode;
+    uint8_t data8, tmp8;
+    uint16_t data16, tmp16;
+    uint8_t tmpc, tmp2;
+    uint8_t add;
+    int clocks;
+
+    if (TRACE_ON(cpu->debug))
+        m6800_disassemble(cpu, cpu->pc);
+
+    if (d->gen != cpu->decode_gen || d->pc != fetch_pc) {
+        if (m6800_decode(cpu, d) == 0) {
+            opcode = d->opcode;
+            clocks = d->clocks;
+            /* The HC11 pushes the prefix address */
+            if (cpu->type == CPU_6303 || cpu->type == CPU_68HC11) {
+                /* TRAP pushes the faulting address */
+                fprintf(stderr, "illegal instruction %02X:%02X at %04X\n",
+                    opcode, m6800_do_read(cpu, fetch_pc + 1), fetch_pc);
+                if (cpu->type == CPU_6303)
+                    m6800_vector(cpu, 0xFFEE);
+                else
+                    m6800_vector(cpu, 0xFFF8);
+                return clocks;	/* Not correct */
+            } else {
+                /* An invalid instruction we don't yet model */
+                fprintf(stderr, "illegal instruction %02X at %04X\n",
+                    opcode, fetch_pc);
+                cpu->pc += d->len;
+                return clocks;
+            }
         }
     }
-    
+    opcode = d->opcode;
+    clocks = d->clocks;
+    cpu->pc += d->len;
+
+    /* Fetch address/data for non immediate opcodes */
+    switch(opcode & 0xF0) {
+        case 0x80:	/* Immediate 8/16bit */
+        case 0xC0:	/* Immediate 8/16bit */
+            if (opcode != 0x8D && ((opcode & 0x0F) >= 0x0C || (opcode & 0x0F) == 3)) {
+                data16 = (d->op[0] << 8) | d->op[1];
+                break;
+            }
+        case 0x20:	/* Branches */
+        case 0x90:	/* Direct */
+        case 0xD0:	/* Direct */
+            data8 = d->op[0];
+            break;
+        case 0x60:	/* Indexed */
+        case 0xA0:	/* Indexed */
+        case 0xE0:	/* Indexed */
+            /* Save the first byte for the strange 6303 logic immediate ops */
+            data8 = d->op[0];
+            data16 = data8 + cpu->x;
+            /* 0x18: Use Y, index via Y
+               0x1A: Use Y, index via X
+               0xCD: Use X, index via Y - some exceptions */
+            if ((opcode & 0xFF00) == 0x1800 || (opcode & 0xFF00) == 0xCD00)
+                data16 = data8 + cpu->y;
+            break;
+        case 0x70:	/* Extended */
+        case 0xB0:	/* Extended */
+        case 0xF0:	/* Extended */
+            data16 = (d->op[0] << 8) | d->op[1];
+            break;
+    }
+
     switch(opcode) {
     case 0x01:	/* NOP */
         /* No flags */
@@ -3437,6 +3527,46 @@ static int m68hc11_pre_execute(struct m6800 *cpu)
 }
 #endif
 
+static uint16_t m6800_counter(struct m6800 *cpu)
+{
+    return cpu->clocks - cpu->counter_base;
+}
+
+/* Work out when the counter next overflows and next matches the output
+   compare. Only the 6803 style parts have the timer */
+static void m6800_timer_arm(struct m6800 *cpu)
+{
+    uint16_t counter = m6800_counter(cpu);
+
+    if (cpu->intio != INTIO_6803) {
+        cpu->timer_due = UINT64_MAX;
+        return;
+    }
+    cpu->tof_due = cpu->clocks + 0x10000 - counter;
+    /* A match is seen by the instruction the counter hits it in */
+    cpu->ocf_due = cpu->clocks + (uint16_t)(cpu->ocr - counter) + 1;
+    cpu->timer_due = cpu->tof_due;
+    if (cpu->ocf_due < cpu->timer_due)
+        cpu->timer_due = cpu->ocf_due;
+}
+
+/* The clock passed one or both of the timer deadlines */
+static void m6800_timer(struct m6800 *cpu)
+{
+    if (cpu->clocks >= cpu->ocf_due && cpu->oc_hold == 0) {
+        cpu->tcsr |= TCSR_OCF;	/* OCF */
+        if (cpu->tcsr & TCSR_EOCI)
+            m6800_raise_interrupt(cpu, IRQ_OCF);
+        cpu->tcsr ^= TCSR_OLVL;
+    }
+    if (cpu->clocks >= cpu->tof_due) {
+        cpu->tcsr |= TCSR_TOF;	/* TOF */
+        if (cpu->tcsr & TCSR_ETOI)
+            m6800_raise_interrupt(cpu, IRQ_TOF);
+    }
+    m6800_timer_arm(cpu);
+}
+
 void m6800_clear_interrupt(struct m6800 *cpu, int irq)
 {
     cpu->irq &= ~irq;
@@ -3453,34 +3583,22 @@ void m6800_raise_interrupt(struct m6800 *cpu, int irq)
  */
 int m6800_execute(struct m6800 *cpu)
 {
-    int cycles;
-    uint32_t n;
+    int cycles = 0;
     /* Interrupts ? */
-    cycles = m6800_pre_execute(cpu);
+    if (cpu->irq)
+        cycles = m6800_pre_execute(cpu);
     /* A cycle passes but we are waiting */
     if (cpu->wait)
         cycles = 1;
     else
         cycles += m6800_execute_one(cpu);
 
-    /* FIXME: skip the unneeded stuff on 6800/6808 */
-
-    /* See if we passed the output compare, and as we don't check every
-       cycle deal with wraps */
-    n = cpu->counter + cycles;
-    if (cpu->oc_hold == 0 && cpu->counter >= cpu->ocr && cpu->counter < n) {
-        cpu->tcsr |= TCSR_OCF;	/* OCF */
-        if (cpu->tcsr & TCSR_EOCI)
-            m6800_raise_interrupt(cpu, IRQ_OCF);
-        cpu->tcsr ^= TCSR_OLVL;
-    }
+    /* The timer only needs a look when the counter passes the output
+       compare or wraps */
+    cpu->clocks += cycles;
+    if (cpu->clocks >= cpu->timer_due)
+        m6800_timer(cpu);
     cpu->oc_hold = 0;
-    if (n > 0xFFFF) {
-        cpu->tcsr |= TCSR_TOF;	/* TOF */
-        if (cpu->tcsr & TCSR_ETOI)
-            m6800_raise_interrupt(cpu, IRQ_TOF);
-    }
-    cpu->counter = (uint16_t)n;
     return cycles;
 }
 
@@ -3488,10 +3606,11 @@ void m6800_reset(struct m6800 *cpu, int type, int io, int mode)
 {
     memset(cpu, 0, sizeof(*cpu));
 
+    cpu->decode_gen = 1;
     cpu->p = P_I;
     cpu->ramcr = RAMCR_RAME;	/* Internal RAM on FIXME check */
     cpu->tcsr = 0;
-    cpu->counter = 0;	/* Really this is E clocks after reset FIXME */
+    cpu->counter_base = 0;	/* Really this is E clocks after reset FIXME */
     cpu->rmcr = 0;
     cpu->trcsr = TRCSR_TDRE;
     cpu->mode = mode;
@@ -3503,6 +3622,7 @@ void m6800_reset(struct m6800 *cpu, int type, int io, int mode)
     cpu->iram_base = 0x80;	/* We don't yet emulate X/Y1 CPUs */
     cpu->pc = m6800_do_read(cpu, 0xFFFE) << 8;
     cpu->pc |= m6800_do_read(cpu, 0xFFFF);
+    m6800_timer_arm(cpu);
 }
 
 #ifdef WITH_HC11
@@ -3513,43 +3633,100 @@ void m6800_reset(struct m6800 *cpu, int type, int io, int mode)
  *	See Figure 10-1 in the M68HC11 RM
  */
 
-static int prescaler(struct prescaler *p)
+/* E clocks until the prescaler next wraps */
+static unsigned long prescaler_left(struct prescaler *p)
 {
-    if (p->count++ >= p->limit) {
-        p->count = 0;
+    if (p->count >= p->limit)
         return 1;
+    return p->limit - p->count + 1;
+}
+
+/* Run a prescaler for n clocks and return how many times it wrapped */
+static unsigned long prescaler(struct prescaler *p, unsigned long n)
+{
+    unsigned long left = prescaler_left(p);
+
+    if (n < left) {
+        p->count += n;
+        return 0;
     }
-    return 0;
+    n -= left;
+    p->count = n % (p->limit + 1);
+    return n / (p->limit + 1) + 1;
+}
+
+#define IRQ_HC11_TIMER	(IRQ_OC1 | IRQ_OC2 | IRQ_OC3 | IRQ_OC4 | IRQ_IC4OC5 | \
+                         IRQ_IC1 | IRQ_IC2 | IRQ_IC3 | IRQ_TOF | IRQ_RTI | \
+                         IRQ_PAOV | IRQ_PAI)
+
+/* The interrupts the timer flags and masks ask for */
+static uint32_t m68hc11_timer_irq(struct m6800 *cpu)
+{
+    /* TFLG1 bit 0 up, then TFLG2 bit 4 up */
+    static const uint32_t irq1[8] = {
+        IRQ_IC3, IRQ_IC2, IRQ_IC1, IRQ_IC4OC5, IRQ_OC4, IRQ_OC3, IRQ_OC2, IRQ_OC1
+    };
+    static const uint32_t irq2[4] = { IRQ_PAI, IRQ_PAOV, IRQ_RTI, IRQ_TOF };
+    uint8_t f1 = cpu->io.tflg1 & cpu->io.tmsk1;
+    uint8_t f2 = (cpu->io.tflg2 & cpu->io.tmsk2) >> 4;
+    uint32_t irq = 0;
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
+        if (f1 & (1 << i))
+            irq |= irq1[i];
+    for (i = 0; i < 4; i++)
+        if (f2 & (1 << i))
+            irq |= irq2[i];
+    return irq;
+}
+
+/* Ticks from tcnt until the counter reads val, 1 to 65536 */
+static unsigned long m68hc11_ticks_to(uint16_t tcnt, uint16_t val)
+{
+    return (uint16_t)(val - tcnt - 1) + 1UL;
 }
 
-static void m68hc11_e_clock(struct m6800 *cpu)
+/*
+ *	Model n 68HC11 E clocks
+ *
+ *	See Figure 10-1 in the M68HC11 RM
+ */
+static void m68hc11_timer_run(struct m6800 *cpu, unsigned long n)
 {
+    struct m68hc11 *io = &cpu->io;
+    const uint16_t *toc[5] = { &io->toc1, &io->toc2, &io->toc3, &io->toc4, &io->toc5 };
+    uint16_t tcnt = io->tcnt;
+    unsigned long e13, ticks;
+    unsigned int i;
+
     /* Our emulation timer for an SPI transfer. This counts down E clocks
        between the start and end of an SPI transfer (master emulated only) */
-    if (cpu->io.spi_ticks) {
-        if (!--cpu->io.spi_ticks) {
+    if (io->spi_ticks) {
+        if (n >= io->spi_ticks) {
+            io->spi_ticks = 0;
             /* An SPI transfer completed: we don't emulate any double
                buffering */
-            cpu->io.spdr_r = m68hc11_spi_done(cpu);
-            cpu->io.spsr |= SPSR_SPIF;
-            if (cpu->io.spcr & SPCR_SPIE)
+            io->spdr_r = m68hc11_spi_done(cpu);
+            io->spsr |= SPSR_SPIF;
+            if (io->spcr & SPCR_SPIE)
                 m6800_raise_interrupt(cpu, IRQ_SPI);
-        }
+        } else
+            io->spi_ticks -= n;
     }
 
     /* 64 cycle lock */
-    if (cpu->io.lock)
-        cpu->io.lock--;
+    io->lock = io->lock > n ? io->lock - n : 0;
 
     /* A 2^13 divider feeds into the RTI and COP */
-    if (prescaler(&cpu->io.e13)) {
+    e13 = prescaler(&io->e13, n);
+    if (e13) {
         /* 1 2 4 or 8 fom RTR[1:0] */
-        if (prescaler(&cpu->io.rti)) {
-            cpu->io.tflg2 |= TF2_RTIF;
-        }
+        if (prescaler(&io->rti, e13))
+            io->tflg2 |= TF2_RTIF;
         /* Always by 4 then by 1/4/16/64 ccording to CR[1:0] */
-        if (prescaler(&cpu->io.cop)) {
-            if (!(cpu->io.config_latch & CFG_NOCOP)) {
+        if (prescaler(&io->cop, e13)) {
+            if (!(io->config_latch & CFG_NOCOP)) {
                 /* We took a COP reset */
                 /* TODO */
             }
@@ -3557,77 +3734,82 @@ static void m68hc11_e_clock(struct m6800 *cpu)
     }
 
     /* The tcnt scaler affects all of the ic/oc side */
-    if (!prescaler(&cpu->io.pr_tcnt))
+    ticks = prescaler(&io->pr_tcnt, n);
+    if (ticks == 0)
         return;
     /* Free running counter */
-    cpu->io.tcnt++;
-    if (cpu->io.tcnt == 0)
-        cpu->io.tflg2 |= TF2_TOF;
-    /* Comparators. Set the relevant flags, we will compute their effects
-       later on */
-    if (cpu->io.tcnt == cpu->io.toc1)
-        cpu->io.tflg1 |= TF1_OC1F;
-    if (cpu->io.tcnt == cpu->io.toc2)
-        cpu->io.tflg1 |= TF1_OC2F;
-    if (cpu->io.tcnt == cpu->io.toc3)
-        cpu->io.tflg1 |= TF1_OC3F;
-    if (cpu->io.tcnt == cpu->io.toc4)
-        cpu->io.tflg1 |= TF1_OC4F;
-    if (cpu->io.tcnt == cpu->io.toc5)
-        cpu->io.tflg1 |= TF1_OC5F;
+    io->tcnt += ticks;
+    if (m68hc11_ticks_to(tcnt, 0) <= ticks)
+        io->tflg2 |= TF2_TOF;
+    /* Comparators. Set the flag for any value the counter passed */
+    for (i = 0; i < 5; i++)
+        if (m68hc11_ticks_to(tcnt, *toc[i]) <= ticks)
+            io->tflg1 |= TF1_OC1F >> i;
     /* We don't model input counts on IC1-IC3 but if we did it would go
        here */
 
     /* Turn compare flags into IRQ bits */
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x80)
-        m6800_raise_interrupt(cpu, IRQ_OC1);
-    else
-        m6800_clear_interrupt(cpu, IRQ_OC1);
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x40)
-        m6800_raise_interrupt(cpu, IRQ_OC2);
-    else
-        m6800_clear_interrupt(cpu, IRQ_OC2);
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x20)
-        m6800_raise_interrupt(cpu, IRQ_OC3);
-    else
-        m6800_clear_interrupt(cpu, IRQ_OC3);
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x10)
-        m6800_raise_interrupt(cpu, IRQ_OC4);
-    else
-        m6800_clear_interrupt(cpu, IRQ_OC4);
-    /* This one is special - its OC5 or IC4  */
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x08)
-        m6800_raise_interrupt(cpu, IRQ_IC4OC5);
-    else
-        m6800_clear_interrupt(cpu, IRQ_IC4OC5);
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x04)
-        m6800_raise_interrupt(cpu, IRQ_IC1);
-    else
-        m6800_clear_interrupt(cpu, IRQ_IC1);
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x02)
-        m6800_raise_interrupt(cpu, IRQ_IC2);
-    else
-        m6800_clear_interrupt(cpu, IRQ_IC2);
-    if ((cpu->io.tflg1 & cpu->io.tmsk1) & 0x01)
-        m6800_raise_interrupt(cpu, IRQ_IC3);
-    else
-        m6800_clear_interrupt(cpu, IRQ_IC3);
-    if ((cpu->io.tflg2 & cpu->io.tmsk2) & 0x80)
-        m6800_raise_interrupt(cpu, IRQ_TOF);
-    else
-        m6800_clear_interrupt(cpu, IRQ_TOF);
-    if ((cpu->io.tflg2 & cpu->io.tmsk2) & 0x40)
-        m6800_raise_interrupt(cpu, IRQ_RTI);
-    else
-        m6800_clear_interrupt(cpu, IRQ_RTI);
-    if ((cpu->io.tflg2 & cpu->io.tmsk2) & 0x20)
-        m6800_raise_interrupt(cpu, IRQ_PAOV);
-    else
-        m6800_clear_interrupt(cpu, IRQ_PAOV);
-    if ((cpu->io.tflg2 & cpu->io.tmsk2) & 0x10)
-        m6800_raise_interrupt(cpu, IRQ_PAI);
-    else
-        m6800_clear_interrupt(cpu, IRQ_PAI);
+    cpu->irq = (cpu->irq & ~IRQ_HC11_TIMER) | m68hc11_timer_irq(cpu);
+}
+
+/*
+ *	Work out the clock at which the timers next need to run. Flags
+ *	that are masked or already set only matter when the registers are
+ *	accessed, and that brings the timers up to date anyway.
+ */
+static void m68hc11_timer_arm(struct m6800 *cpu)
+{
+    struct m68hc11 *io = &cpu->io;
+    const uint16_t *toc[5] = { &io->toc1, &io->toc2, &io->toc3, &io->toc4, &io->toc5 };
+    uint64_t tick = prescaler_left(&io->pr_tcnt);
+    uint64_t due = UINT64_MAX;
+    uint64_t when;
+    unsigned long t = 0, k;
+    unsigned int i;
+
+    if (io->spi_ticks)
+        due = io->spi_ticks;
+
+    /* The interrupt lines only follow the flags on a counter tick */
+    if ((cpu->irq & IRQ_HC11_TIMER) != m68hc11_timer_irq(cpu)) {
+        if (tick < due)
+            due = tick;
+        io->timer_due = io->clocks + due;
+        return;
+    }
+
+    /* The first tick that sets a flag with its interrupt enabled */
+    if ((io->tmsk2 & ~io->tflg2) & TF2_TOF)
+        t = m68hc11_ticks_to(io->tcnt, 0);
+    for (i = 0; i < 5; i++) {
+        if (((io->tmsk1 & ~io->tflg1) & (TF1_OC1F >> i)) == 0)
+            continue;
+        k = m68hc11_ticks_to(io->tcnt, *toc[i]);
+        if (t == 0 || k < t)
+            t = k;
+    }
+    if (t) {
+        when = tick + (t - 1) * (io->pr_tcnt.limit + 1);
+        if (when < due)
+            due = when;
+    }
+
+    /* The RTI flag, its interrupt follows on the next tick */
+    if ((io->tmsk2 & ~io->tflg2) & TF2_RTIF) {
+        when = prescaler_left(&io->e13) +
+            (prescaler_left(&io->rti) - 1) * (io->e13.limit + 1);
+        if (when < due)
+            due = when;
+    }
+    io->timer_due = due == UINT64_MAX ? UINT64_MAX : io->clocks + due;
+}
+
+/* Bring the timers up to date with the clock */
+static void m68hc11_timer_sync(struct m6800 *cpu)
+{
+    m68hc11_timer_run(cpu, cpu->io.clocks - cpu->io.synced);
+    cpu->io.synced = cpu->io.clocks;
+    m68hc11_timer_arm(cpu);
 }
 
 
@@ -3638,10 +3820,11 @@ static void m68hc11_e_clock(struct m6800 *cpu)
  
 int m68hc11_execute(struct m6800 *cpu)
 {
-    int cycles, i;
+    int cycles = 0;
 
     /* Interrupts ? */
-    cycles = m68hc11_pre_execute(cpu);
+    if (cpu->irq)
+        cycles = m68hc11_pre_execute(cpu);
     /* A cycle passes but we are waiting */
     if (cpu->wait)
         cycles = 1;
@@ -3654,18 +3837,45 @@ int m68hc11_execute(struct m6800 *cpu)
         return cycles;
 
     /* Run the timers for these E cycles */
-    for (i = 0; i < cycles; i++)
-        m68hc11_e_clock(cpu);
-        
+    cpu->io.clocks += cycles;
+    if (cpu->io.clocks >= cpu->io.timer_due)
+        m68hc11_timer_sync(cpu);
     return cycles;
 }
 
+/*
+ *	Flag the pages that hold any internal space so that everything else
+ *	can go straight to the board in m6800_do_read and m6800_do_write.
+ *	A flagged page still goes through the full checks.
+ */
+static void m68hc11_page_mark(struct m6800 *cpu, unsigned int start, unsigned int end)
+{
+    unsigned int page;
+
+    for (page = start >> 8; page <= (end >> 8) && page < 256; page++)
+        cpu->io.page[page] = 1;
+}
+
+static void m68hc11_page_recalc(struct m6800 *cpu)
+{
+    memset(cpu->io.page, 0, sizeof(cpu->io.page));
+    m68hc11_page_mark(cpu, cpu->io.iobase, cpu->io.ioend);
+    m68hc11_page_mark(cpu, cpu->io.irambase, cpu->io.iramend);
+    if (cpu->io.config_latch & CFG_EEON)
+        m68hc11_page_mark(cpu, cpu->io.erombase, cpu->io.eromend);
+    if (cpu->io.hprio & HPRIO_RBOOT)
+        m68hc11_page_mark(cpu, 0xBF00, 0xBFFF);
+    if (cpu->io.config_latch & CFG_ROMON)
+        m68hc11_page_mark(cpu, cpu->io.rombase, 0xFFFF);
+}
+
 void m68hc11e_reset(struct m6800 *cpu, int type, uint8_t cfg, const uint8_t *rom, uint8_t *eerom)
 {
     memset(cpu, 0, sizeof(*cpu));
 
     cpu->type = CPU_68HC11;
     cpu->intio = INTIO_HC11;
+    cpu->decode_gen = 1;
 
     cpu->p = P_I | P_S | P_X;
     cpu->io.rom = rom;
@@ -3752,6 +3962,8 @@ void m68hc11e_reset(struct m6800 *cpu, int type, uint8_t cfg, const uint8_t *rom
 
     cpu->io.lock = 64;		/* Some stuff locks after 64 cycles */
 
+    m68hc11_page_recalc(cpu);
+    m68hc11_timer_arm(cpu);
     /* Must be last so the CPU config is correct for things like internal ROM */
     cpu->pc = m6800_do_read(cpu, 0xFFFE) << 8;
     cpu->pc |= m6800_do_read(cpu, 0xFFFF);
@@ -3764,6 +3976,7 @@ void m68hc11a_reset(struct m6800 *cpu, int type, uint8_t cfg, const uint8_t *rom
 
     cpu->type = CPU_68HC11;
     cpu->intio = INTIO_HC11;
+    cpu->decode_gen = 1;
 
     cpu->p = P_I | P_S | P_X;
 
@@ -3839,6 +4052,8 @@ void m68hc11a_reset(struct m6800 *cpu, int type, uint8_t cfg, const uint8_t *rom
 
     cpu->io.lock = 64;		/* Some stuff locks after 64 cycles */
 
+    m68hc11_page_recalc(cpu);
+    m68hc11_timer_arm(cpu);
     /* Must be last so the CPU config is correct for things like internal ROM */
     cpu->pc = m6800_do_read(cpu, 0xFFFE) << 8;
     cpu->pc |= m6800_do_read(cpu, 0xFFFF);
@@ -3941,9 +4156,9 @@ uint8_t m6800_read_io(struct m6800 *cpu, uint8_t addr)
                works by magic because we don't do per clock cycle emulation */
             cpu->tcsr &= ~(TCSR_TOF|TCSR_OCF);
             m6800_counter_ints(cpu);
-            return cpu->counter >> 8;
+            return m6800_counter(cpu) >> 8;
         case 0x0A:
-            return cpu->counter;
+            return m6800_counter(cpu);
         case 0x0B:	/* Output compare */
             return cpu->ocr >> 8;
         case 0x0C:
@@ -4025,7 +4240,8 @@ void m6800_write_io(struct m6800 *cpu, uint8_t addr, uint8_t val)
         /* FIXME: on 6303 a double store *only* writes the timer correctly,
             a single causes the FFF8 effect as on 6803 */
         case 0x09:	/* Timer - test function set to FFF8 */
-            cpu->counter = 0xFFF8;
+            cpu->counter_base = cpu->clocks - 0xFFF8;
+            m6800_timer_arm(cpu);
             break;
         case 0x0A:	/* Timer - no effect */
             break;
@@ -4035,11 +4251,13 @@ void m6800_write_io(struct m6800 *cpu, uint8_t addr, uint8_t val)
             cpu->tcsr &= ~0x40;	/* Clear OCF */
             /* Review : 1 insn or one clock ? */
             cpu->oc_hold = 1;
+            m6800_timer_arm(cpu);
             break;
         case 0x0C:	/* Output compare low */
             cpu->ocr &= 0xFF00;
             cpu->ocr |= val;
             cpu->tcsr &= ~0x40;	/* Clear OCF */
+            m6800_timer_arm(cpu);
             break;
         case 0x0D:	/* Input capture (not emulated) */
         case 0x0E:
@@ -4075,6 +4293,7 @@ void m6800_write_io(struct m6800 *cpu, uint8_t addr, uint8_t val)
         case 0x14:
             /* FIXME: we need to watch bit 6 */
             cpu->ramcr = val;
+            m6800_decode_flush(cpu);
             break;
     }
 }
@@ -4511,6 +4730,8 @@ static void m68hc11_write_io(struct m6800 *cpu, uint8_t addr, uint8_t val)
                 val |= cpu->io.hprio & HPRIO_MDA;
             }
             cpu->io.hprio = val;
+            m68hc11_page_recalc(cpu);
+            m6800_decode_flush(cpu);
             break;
         case 0x3D:
             if (!cpu->io.lock && !(cpu->io.hprio & HPRIO_SMOD))
@@ -4520,6 +4741,8 @@ static void m68hc11_write_io(struct m6800 *cpu, uint8_t addr, uint8_t val)
             cpu->io.ioend = cpu->io.iobase + 0x3F;
             cpu->io.irambase = (val & 0xF0U) << 8;
             cpu->io.iramend = cpu->io.irambase + cpu->io.iramsize - 1;
+            m68hc11_page_recalc(cpu);
+            m6800_decode_flush(cpu);
             break;
         case 0x3E:
             /* This is actually test1 if we ever care */
@@ -4532,6 +4755,8 @@ static void m68hc11_write_io(struct m6800 *cpu, uint8_t addr, uint8_t val)
                 cpu->io.config = val & 0x0F;
             if (cpu->io.hprio & 0x40) {
                 cpu->io.config_latch = cpu->io.config;
+                m68hc11_page_recalc(cpu);
+                m6800_decode_flush(cpu);
                 if (cpu->io.flags & CPUIO_HC811_CONFIG) {
                     cpu->io.erombase = 0x0800 + ((cpu->io.config & 0xF0) << 8);
                     cpu->io.eromend = 0x0FFF + ((cpu->io.config & 0xF0) << 8);
@@ -4566,8 +4791,12 @@ uint8_t m6800_do_read(struct m6800 *cpu, uint16_t addr)
         return m6800_read(cpu, addr);
 #ifdef WITH_HC11
     case INTIO_HC11:
-        if (addr >= cpu->io.iobase && addr <= cpu->io.ioend)
+        if (cpu->io.page[addr >> 8] == 0)
+            return m6800_read(cpu, addr);
+        if (addr >= cpu->io.iobase && addr <= cpu->io.ioend) {
+            m68hc11_timer_sync(cpu);
             return m68hc11_read_io(cpu, addr);
+        }
         if (addr >= cpu->io.irambase && addr <= cpu->io.iramend)
             return cpu->iram[addr];
         if (addr >= cpu->io.erombase && addr <= cpu->io.eromend &&
@@ -4584,6 +4813,7 @@ uint8_t m6800_do_read(struct m6800 *cpu, uint16_t addr)
 
 void m6800_do_write(struct m6800 *cpu, uint16_t addr, uint8_t val)
 {
+    m6800_decode_write(cpu, addr);
     switch (cpu->intio) {
     case INTIO_6802:
         if (addr < 128) {
@@ -4606,15 +4836,21 @@ void m6800_do_write(struct m6800 *cpu, uint16_t addr, uint8_t val)
         break;
 #ifdef WITH_HC11        
     case INTIO_HC11:
+        if (cpu->io.page[addr >> 8] == 0) {
+            m6800_write(cpu, addr, val);
+            break;
+        }
         /* No emulation of writable EEROM yet */
         if (addr >= cpu->io.rombase && (cpu->io.config_latch & CFG_ROMON))
             return;
         else if (addr >= cpu->io.erombase && addr <= cpu->io.eromend &&
             (cpu->io.config_latch & CFG_EEON))
             return;
-        if (addr >= cpu->io.iobase && addr <= cpu->io.ioend)
+        if (addr >= cpu->io.iobase && addr <= cpu->io.ioend) {
+            m68hc11_timer_sync(cpu);
             m68hc11_write_io(cpu, addr, val);
-        else if (addr >= cpu->io.irambase && addr <= cpu->io.iramend)
+            m68hc11_timer_arm(cpu);
+        } else if (addr >= cpu->io.irambase && addr <= cpu->io.iramend)
             cpu->iram[addr] = val;
         else if (addr >= 0xBF00 && addr <= 0xBFFF && (cpu->io.hprio & HPRIO_RBOOT))
             return;
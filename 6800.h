@@ -31,6 +31,7 @@ struct  m68hc11 {
     uint16_t erombase;
     uint16_t eromend;
     uint16_t rombase;
+    uint8_t page[256];		/* Page holds internal space */
 
     /* We don't model non expanded mode */
     uint8_t padr;
@@ -81,6 +82,12 @@ struct  m68hc11 {
 #define TF2_PAOVF		0x20
 #define TF2_PAIF		0x10
 
+    /* The timers only catch up with the clock when something looks at
+       them or they are due to raise an interrupt */
+    uint64_t clocks;		/* E clocks the timers have run */
+    uint64_t synced;		/* Clock they are up to date for */
+    uint64_t timer_due;
+
     /* Pulse accumulator */
     uint8_t pactl;
     uint8_t pacnt;
@@ -170,6 +177,21 @@ struct  m68hc11 {
 #define HC11_VEC_CME		0xFFFC
 #define HC11_VEC_RESET		0xFFFE
 
+/*
+ *	Predecoded instruction, see m6800_decode_flush
+ */
+
+#define M6800_DECODE	4096
+
+struct m6800_decode {
+    uint32_t gen;		/* Valid when it matches decode_gen */
+    uint16_t pc;
+    uint16_t opcode;
+    uint8_t len;
+    uint8_t clocks;
+    uint8_t op[2];
+};
+
 /*
  *	6800 processor state
  */
@@ -209,8 +231,13 @@ struct m6800 {
     uint8_t p1dr;
     uint8_t p2dr;
     uint8_t tcsr;
-    uint16_t counter;
     uint16_t ocr;
+    /* The free running counter is worked out from the clock */
+    uint64_t clocks;		/* E clocks since reset */
+    uint64_t counter_base;	/* Clock at which the counter was 0 */
+    uint64_t tof_due;
+    uint64_t ocf_due;
+    uint64_t timer_due;		/* Earliest of the two */
     uint8_t rmcr;
     uint8_t trcsr;
     uint8_t rdr;
@@ -219,6 +246,9 @@ struct m6800 {
 
     struct m68hc11 io;		/* Need to make this a nice union of CPU
                                    variants eventually */
+
+    uint32_t decode_gen;
+    struct m6800_decode decode[M6800_DECODE];
 };
 
 #define P_C		1
@@ -296,6 +326,7 @@ extern int m6800_execute(struct m6800 *cpu);
 extern int m68hc11_execute(struct m6800 *cpu);
 extern void m6800_clear_interrupt(struct m6800 *cpu, int irq);
 extern void m6800_raise_interrupt(struct m6800 *cpu, int irq);
+extern void m6800_decode_flush(struct m6800 *cpu);
 extern void m6800_rx_byte(struct m6800 *cpu, uint8_t byte);
 extern void m68hc11_rx_byte(struct m6800 *cpu, uint8_t byte);
 
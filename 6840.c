@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "6840.h"
+#include "trace.h"
 
 /*
  *	Motorola 6840 PTM
@@ -14,7 +15,8 @@ struct ptm_timer {
     uint16_t wlatch;
     uint8_t ctrl;
     int output;
-    int event;
+    int done;			/* Single shot has timed out */
+    unsigned int falls;		/* Output high to low edges not yet collected */
 };
 
 struct m6840 {
@@ -33,19 +35,6 @@ struct m6840 {
 static void m6840_calc_irq(struct m6840 *ptm)
 {
     int irq = 0;
-    /* Turn our internal events for overflow into status bits */
-    if (ptm->timer[1].event) {
-        ptm->timer[1].event = 0;
-        ptm->sr |= 1;
-    }
-    if (ptm->timer[2].event) {
-        ptm->timer[2].event = 0;
-        ptm->sr |= 2;
-    }
-    if (ptm->timer[3].event) {
-        ptm->timer[3].event = 0;
-        ptm->sr |= 4;
-    }
     /* Check status versus masks and set the SR IRQ bit accordingly */
     if ((ptm->sr & 1) && (ptm->timer[1].ctrl & 0x40))
         irq = 0x80;
@@ -63,7 +52,9 @@ int m6840_irq_pending(struct m6840 *ptm)
 }
 
 /*
- *	Model the O1/O2/O3 pins
+ *	Model the O1/O2/O3 pins. The counters are advanced in one go so
+ *	the pins are only worked out afterwards. Anything counting edges
+ *	on them uses m6840_falls().
  */
 static void m6840_calc_outputs(struct m6840 *ptm)
 {
@@ -81,119 +72,203 @@ static void m6840_calc_outputs(struct m6840 *ptm)
     }
 }
 
-/* Count a timer in 16 or 8x8 bit mode */
-static void m6840_timer_count(struct ptm_timer *p, int restart)
+static void m6840_set_output(struct ptm_timer *p, int output)
+{
+    if (p->output && !output && (p->ctrl & 0x80))
+        p->falls++;
+    p->output = output;
+}
+
+/* Only the continuous and single shot modes count */
+static int m6840_counting(struct ptm_timer *p)
+{
+    return !(p->ctrl & 0x08);
+}
+
+/* Clocks until the next time out */
+static uint32_t m6840_remaining(struct ptm_timer *p)
+{
+    unsigned int l = p->wlatch & 0xFF;
+    if (!(p->ctrl & 0x04))
+        return p->timer + 1;
+    return (p->timer & 0xFF) + (p->timer >> 8) * (l + 1) + 1;
+}
+
+/*
+ *	Count a timer on by n clocks in 16 or 8x8 bit mode and return the
+ *	number of time outs. The counter reloads from the latch on each
+ *	time out in both modes, single shot only changes the output.
+ */
+static uint32_t m6840_timer_count(struct ptm_timer *p, uint32_t n)
 {
+    unsigned int h = p->timer >> 8;
+    unsigned int l = p->timer & 0xFF;
+    unsigned int lh = p->wlatch >> 8;
+    unsigned int ll = p->wlatch & 0xFF;
+    uint32_t period;
+    uint32_t r;
+    uint32_t t = 0;
+
+    if (n == 0)
+        return 0;
     if (!(p->ctrl & 0x04)) {
-        /* The check occurs before the count down */
-        if (p->timer == 0) {
-            p->event = 1;
-            p->output ^= 1;
-            if (p->event && restart)
-                p->timer = p->wlatch;
+        if (n <= p->timer) {
+            p->timer -= n;
+            return 0;
+        }
+        n -= p->timer + 1;
+        period = p->wlatch + 1;
+        t = n / period + 1;
+        p->timer = p->wlatch - n % period;
+        /* Square wave, or one pulse for single shot */
+        if (p->ctrl & 0x20) {
+            if (!p->done)
+                p->output = 1;
+        } else {
+            if (p->output && (p->ctrl & 0x80))
+                p->falls += (t + 1) / 2;
+            else if (p->ctrl & 0x80)
+                p->falls += t / 2;
+            p->output ^= t & 1;
         }
-        p->timer--;
+        p->done = 1;
+        return t;
+    }
+    /* Dual 8bit. Get the low byte back in range of the latch first */
+    if (n <= l) {
+        p->timer -= n;
     } else {
-        if ((p->timer & 0xFF) != 0)
-            p->timer--;
-        else {
-            p->timer &= 0xFF00;
-            if (p->timer) {
-                p->timer -= 0x0100;
-                p->timer |= p->wlatch & 0xFF;
-            } else {
-                p->event = 1;
-                if (restart)
-                    p->timer = p->wlatch;
-            }
+        n -= l + 1;
+        if (h) {
+            h--;
+        } else {
+            t = 1;
+            h = lh;
         }
-        if ((p->timer & 0xFF00) == 0)
-            p->output = 1;
-        else
-            p->output = 0;
+        l = ll;
+        r = l + h * (ll + 1) + 1;
+        if (n >= r) {
+            n -= r;
+            period = (lh + 1) * (ll + 1);
+            t += n / period + 1;
+            r = period - n % period;
+        } else
+            r -= n;
+        p->timer = (((r - 1) / (ll + 1)) << 8) | ((r - 1) % (ll + 1));
+    }
+    /* The output is high for the last low byte count down of a cycle,
+       and for single shot only the first one */
+    if (t) {
+        if (p->ctrl & 0x80) {
+            if (p->ctrl & 0x20)
+                p->falls += !p->done;
+            else if (lh)
+                p->falls += t;
+        }
+        p->done = 1;
     }
-    if (p->event && restart)
-        p->timer = p->wlatch;
+    p->output = (p->timer & 0xFF00) == 0 && !((p->ctrl & 0x20) && p->done);
+    return t;
 }
 
 /*
- *	Handle a timer being clocked by something
+ *	Handle a timer being clocked n times by something
  */
-static void m6840_timer_clock(struct ptm_timer *p)
+static void m6840_timer_clock(struct m6840 *ptm, int i, uint32_t n)
 {
-    switch((p->ctrl >> 3) & 7) {
-        case 0:	/* Continuous */
-            m6840_timer_count(p, 1);
-            break;
-        case 1:	/* Frequency compare (not supported yet) */
-            break;
-        case 2:	/* Continuous - not reset by write to latches */
-            m6840_timer_count(p, 1);
-            break;
-        case 3:	/* Pulse width compare (not supported yet) */
-            break;
-        case 4:	/* One shot, reset by write to latches */
-            m6840_timer_count(p, 0);
-            break;
-        case 5:	/* Frequency comparison (not supported yet) */
-            break;
-        case 6:	/* One shot, reset by gate/reset only */
-            m6840_timer_count(p, 0);
-        case 7:	/* Pulse width compare (not supported yet) */
-            break;
-    }
-}
+    struct ptm_timer *p = &ptm->timer[i];
 
-/* Perform an event tick on a timer */
-static void m6840_event_tick(struct ptm_timer *p)
-{
-    /* Internal clock ? */
-    if (p->ctrl & 2)
+    if (!m6840_counting(p))	/* Compare modes (not supported yet) */
         return;
-    m6840_timer_clock(p);
+    if (m6840_timer_count(p, n))
+        ptm->sr |= 1 << (i - 1);
 }
 
-/* Perform internal tick on a timer */
-static void m6840_timer_tick(struct ptm_timer *p)
-{
-    /* External clock */
-    if (!(p->ctrl & 2))
-        return;
-    m6840_timer_clock(p);
-}
-
-/* Runs for every E clock */
+/* Runs for n E clocks */
 void m6840_tick(struct m6840 *ptm, int tstates)
 {
-    while(tstates--) {
-        m6840_timer_tick(&ptm->timer[1]);
-        m6840_timer_tick(&ptm->timer[2]);
-        m6840_timer_tick(&ptm->timer[3]);
+    int i;
+    for (i = 1; i <= 3; i++) {
+        /* Internal clock ? */
+        if (ptm->timer[i].ctrl & 2)
+            m6840_timer_clock(ptm, i, tstates);
     }
     m6840_calc_irq(ptm);
     m6840_calc_outputs(ptm);
 }
 
-/* External clock event */
-void m6840_external_clock(struct m6840 *ptm, int timer)
+/* n external clock events */
+void m6840_external_clocks(struct m6840 *ptm, int timer, unsigned int n)
 {
     /* Timer 3 has an external pre-scaler option */
     if (timer == 3 && (ptm->timer[3].ctrl & 0x01)) {
-        ptm->prescale++;
-        ptm->prescale &= 7;
-        if (ptm->prescale)
-            return;
+        n += ptm->prescale;
+        ptm->prescale = n & 7;
+        n >>= 3;
     }
-    m6840_event_tick(&ptm->timer[timer]);
+    if (n == 0 || (ptm->timer[timer].ctrl & 2))
+        return;
+    m6840_timer_clock(ptm, timer, n);
     m6840_calc_irq(ptm);
     m6840_calc_outputs(ptm);
 }
 
+void m6840_external_clock(struct m6840 *ptm, int timer)
+{
+    m6840_external_clocks(ptm, timer, 1);
+}
+
+/* Return and clear the count of high to low edges on an output */
+unsigned int m6840_falls(struct m6840 *ptm, int timer)
+{
+    unsigned int n = ptm->timer[timer].falls;
+    ptm->timer[timer].falls = 0;
+    return n;
+}
+
+/* Clocks until timer i next interrupts, M6840_IDLE if it can't */
+static unsigned int m6840_timer_deadline(struct m6840 *ptm, int i)
+{
+    struct ptm_timer *p = &ptm->timer[i];
+    if (!(p->ctrl & 0x40) || !m6840_counting(p))
+        return M6840_IDLE;
+    return m6840_remaining(p);
+}
+
+/* E clocks until an internally clocked timer next interrupts */
+unsigned int m6840_deadline(struct m6840 *ptm)
+{
+    unsigned int d = M6840_IDLE;
+    unsigned int n;
+    int i;
+    for (i = 1; i <= 3; i++) {
+        if (!(ptm->timer[i].ctrl & 2))
+            continue;
+        n = m6840_timer_deadline(ptm, i);
+        if (n < d)
+            d = n;
+    }
+    return d;
+}
+
+/* External clocks until an externally clocked timer next interrupts */
+unsigned int m6840_external_deadline(struct m6840 *ptm, int timer)
+{
+    unsigned int d;
+    if (ptm->timer[timer].ctrl & 2)
+        return M6840_IDLE;
+    d = m6840_timer_deadline(ptm, timer);
+    if (d != M6840_IDLE && timer == 3 && (ptm->timer[3].ctrl & 0x01))
+        d = 8 * d - ptm->prescale;
+    return d;
+}
+
 /* High to low transition on gate */    
 void m6840_external_gate(struct m6840 *ptm, int gate)
 {
     if (ptm->timer[gate].ctrl & 8) {
         ptm->timer[gate].timer = ptm->timer[gate].wlatch;
+        ptm->timer[gate].done = 0;
         /* IRQ clear ? */
     }
 }
@@ -204,7 +279,7 @@ static void m6840_soft_reset(struct m6840 *ptm)
     ptm->timer[1].timer = ptm->timer[0].wlatch;
     ptm->timer[2].timer = ptm->timer[0].wlatch;
     m6840_calc_irq(ptm);
-    if (ptm->trace)
+    if (TRACE_ON(ptm->trace))
         fprintf(stderr, "[PTM] Reset.\n");
 }
 
@@ -224,7 +299,7 @@ uint8_t m6840_read(struct m6840 *ptm, uint8_t addr)
     if (addr == 0)
         return 0xFF;		/* Probably tri-stated */
     if (addr == 1) {
-        if (ptm->trace)
+        if (TRACE_ON(ptm->trace))
             fprintf(stderr, "[PTM]: Read status register %02X\n", ptm->sr);
         return ptm->sr;
     }
@@ -235,7 +310,7 @@ uint8_t m6840_read(struct m6840 *ptm, uint8_t addr)
     ptm->lsb = p->timer;
     ptm->sr &= ~(1 << (addr - 1));	/* And clear the interrupt */
     m6840_calc_irq(ptm);
-    if (ptm->trace)
+    if (TRACE_ON(ptm->trace))
         fprintf(stderr, "[PTM] Read timer %d IRQ now %02X\n", addr, ptm->sr);
     return p->timer >> 8;
 }
@@ -252,11 +327,12 @@ void m6840_write(struct m6840 *ptm, uint8_t addr, uint8_t val)
             p = &ptm->timer[addr];
             p->wlatch = (ptm->msb << 8) | val;
             /* Writing the timer also clears the interrupt if CR3/4 are 0 */
-            if (ptm->trace)
+            if (TRACE_ON(ptm->trace))
                 fprintf(stderr, "[PTM] Timer %d set to %d\n", addr, p->wlatch);
             if ((p->ctrl & 0x18) == 0x00) {
                 p->timer = p->wlatch;
-                p->output = 0;
+                p->done = 0;
+                m6840_set_output(p, 0);
                 ptm->sr &= ~(1 << addr);
                 m6840_calc_irq(ptm);
                 m6840_calc_outputs(ptm);
@@ -271,7 +347,7 @@ void m6840_write(struct m6840 *ptm, uint8_t addr, uint8_t val)
             addr = 3;
     } else
         addr = 2;
-    if (ptm->trace)
+    if (TRACE_ON(ptm->trace))
         fprintf(stderr, "[PTM] Control %d set to %02X\n", addr, val);
     ptm->timer[addr].ctrl = val;
     /* Effects of control changes */
@@ -1,8 +1,14 @@
 struct m6840;
 
+#define M6840_IDLE	(~0U)		/* No timer interrupt due */
+
 extern int m6840_irq_pending(struct m6840 *ptm);
 extern void m6840_tick(struct m6840 *ptm, int tstates);
 extern void m6840_external_clock(struct m6840 *ptm, int timer);
+extern void m6840_external_clocks(struct m6840 *ptm, int timer, unsigned int n);
+extern unsigned int m6840_falls(struct m6840 *ptm, int timer);
+extern unsigned int m6840_deadline(struct m6840 *ptm);
+extern unsigned int m6840_external_deadline(struct m6840 *ptm, int timer);
 extern void m6840_external_gate(struct m6840 *ptm, int gate);
 extern void m6840_reset(struct m6840 *ptm);
 extern uint8_t m6840_read(struct m6840 *ptm, uint8_t addr);
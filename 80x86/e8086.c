@@ -77,6 +77,8 @@ void e86_init (e8086_t *c)
 
 	c->pq_size = 4;
 	c->pq_fill = 6;
+	c->pq = c->pq_buf;
+	c->pq_direct = 0;
 
 	c->irq = 0;
 
@@ -169,6 +171,18 @@ void e86_set_pq_size (e8086_t *c, unsigned size)
 	c->pq_cnt = 0;
 }
 
+/*
+ * In direct mode instructions are decoded straight out of ram and no
+ * prefetch queue is kept, so code that modifies bytes just ahead of
+ * itself sees the new values.
+ */
+void e86_set_pq_direct (e8086_t *c, int direct)
+{
+	c->pq_direct = direct;
+	c->pq = c->pq_buf;
+	c->pq_cnt = 0;
+}
+
 void e86_set_options (e8086_t *c, unsigned opt, int set)
 {
 	if (set) {
@@ -507,7 +521,9 @@ void e86_execute (e8086_t *c)
 
 		if (cnt > 0) {
 			c->ip = (c->ip + cnt) & 0xffff;
-			e86_pq_adjust (c, cnt);
+			if (c->pq_direct == 0) {
+				e86_pq_adjust (c, cnt);
+			}
 		}
 		else {
 			c->delay += 10;
@@ -139,7 +139,9 @@ typedef struct e8086_t {
 	unsigned         pq_size;
 	unsigned         pq_fill;
 	unsigned         pq_cnt;
-	unsigned char    pq[E86_PQ_MAX];
+	unsigned char    *pq;
+	unsigned char    pq_buf[E86_PQ_MAX];
+	int              pq_direct;
 
 	unsigned         prefix;
 
@@ -373,6 +375,7 @@ void e86_set_v20 (e8086_t *c);
  * @param size The emulated prefetch queue size
  *****************************************************************************/
 void e86_set_pq_size (e8086_t *c, unsigned size);
+void e86_set_pq_direct (e8086_t *c, int direct);
 
 /*!***************************************************************************
  * @short Set CPU options
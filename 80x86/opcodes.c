@@ -20,6 +20,8 @@
  *****************************************************************************/
 
 
+#include <string.h>
+
 #include "e8086.h"
 #include "internal.h"
 
@@ -2541,6 +2543,114 @@ unsigned op_a3 (e8086_t *c)
 	return (3);
 }
 
+/*
+ * Forward REP MOVS and STOS are done up to E86_REP_BLOCK iterations at
+ * a time when both strings lie in ram without wrapping. The clock is
+ * charged as if each iteration had been restarted, so the time taken
+ * is the same as doing them one by one. Returns the number of
+ * iterations done, 0 if the caller must do a single step instead.
+ */
+#define E86_REP_BLOCK 256
+
+static
+int e86_rep_range (e8086_t *c, unsigned short seg, unsigned short ofs,
+	unsigned long len, unsigned long *addr)
+{
+	*addr = e86_get_linear (seg, ofs) & c->addr_mask;
+
+	if ((ofs + len) > 0x10000) {
+		return (0);
+	}
+
+	if ((*addr + len) > c->ram_cnt || (*addr + len - 1) > c->addr_mask) {
+		return (0);
+	}
+
+	return (1);
+}
+
+static
+unsigned e86_rep_count (e8086_t *c)
+{
+	unsigned n;
+
+	if (c->ram == NULL || e86_get_df (c) || e86_get_tf (c)) {
+		return (0);
+	}
+
+	n = e86_get_cx (c);
+
+	return ((n > E86_REP_BLOCK) ? E86_REP_BLOCK : n);
+}
+
+static
+unsigned e86_rep_movs (e8086_t *c, unsigned size, unsigned short seg1, unsigned short seg2, unsigned clk)
+{
+	unsigned      n;
+	unsigned long i, len;
+	unsigned long src, dst;
+
+	n = e86_rep_count (c);
+	len = (unsigned long) n * size;
+
+	if (n < 2 || !e86_rep_range (c, seg1, e86_get_si (c), len, &src) ||
+	    !e86_rep_range (c, seg2, e86_get_di (c), len, &dst)) {
+		return (0);
+	}
+
+	if (dst > src && dst < (src + len)) {
+		/* Overlapping forward copy repeats the pattern */
+		if (size != 1) {
+			return (0);
+		}
+
+		for (i = 0; i < len; i++) {
+			c->ram[dst + i] = c->ram[src + i];
+		}
+	}
+	else {
+		memmove (c->ram + dst, c->ram + src, len);
+	}
+
+	e86_set_si (c, e86_get_si (c) + len);
+	e86_set_di (c, e86_get_di (c) + len);
+	e86_set_cx (c, e86_get_cx (c) - n);
+	e86_set_clk (c, (clk + 10) * (n - 1));
+
+	return (n);
+}
+
+static
+unsigned e86_rep_stos (e8086_t *c, unsigned size, unsigned clk)
+{
+	unsigned      n;
+	unsigned long i, len;
+	unsigned long dst;
+
+	n = e86_rep_count (c);
+	len = (unsigned long) n * size;
+
+	if (n < 2 || !e86_rep_range (c, e86_get_es (c), e86_get_di (c), len, &dst)) {
+		return (0);
+	}
+
+	if (size == 1) {
+		memset (c->ram + dst, e86_get_al (c), len);
+	}
+	else {
+		for (i = 0; i < len; i += 2) {
+			c->ram[dst + i] = e86_get_al (c);
+			c->ram[dst + i + 1] = e86_get_ah (c);
+		}
+	}
+
+	e86_set_di (c, e86_get_di (c) + len);
+	e86_set_cx (c, e86_get_cx (c) - n);
+	e86_set_clk (c, (clk + 10) * (n - 1));
+
+	return (n);
+}
+
 /* OP A4: MOVSB */
 static
 unsigned op_a4 (e8086_t *c)
@@ -2554,7 +2664,7 @@ unsigned op_a4 (e8086_t *c)
 	inc = e86_get_df (c) ? 0xffff : 0x0001;
 
 	if (c->prefix & (E86_PREFIX_REP | E86_PREFIX_REPN)) {
-		if (e86_get_cx (c) != 0) {
+		if (e86_get_cx (c) != 0 && e86_rep_movs (c, 1, seg1, seg2, 18) == 0) {
 			val = e86_get_mem8 (c, seg1, e86_get_si (c));
 			e86_set_mem8 (c, seg2, e86_get_di (c), val);
 
@@ -2600,7 +2710,7 @@ unsigned op_a5 (e8086_t *c)
 	inc = e86_get_df (c) ? 0xfffe : 0x0002;
 
 	if (c->prefix & (E86_PREFIX_REP | E86_PREFIX_REPN)) {
-		if (e86_get_cx (c) != 0) {
+		if (e86_get_cx (c) != 0 && e86_rep_movs (c, 2, seg1, seg2, 18) == 0) {
 			val = e86_get_mem16 (c, seg1, e86_get_si (c));
 			e86_set_mem16 (c, seg2, e86_get_di (c), val);
 
@@ -2782,7 +2892,7 @@ unsigned op_aa (e8086_t *c)
 	inc = e86_get_df (c) ? 0xffff : 0x0001;
 
 	if (c->prefix & (E86_PREFIX_REP | E86_PREFIX_REPN)) {
-		if (e86_get_cx (c) != 0) {
+		if (e86_get_cx (c) != 0 && e86_rep_stos (c, 1, 11) == 0) {
 			e86_set_mem8 (c, seg, e86_get_di (c), e86_get_al (c));
 
 			e86_set_di (c, e86_get_di (c) + inc);
@@ -2821,7 +2931,7 @@ unsigned op_ab (e8086_t *c)
 	inc = e86_get_df (c) ? 0xfffe : 0x0002;
 
 	if (c->prefix & (E86_PREFIX_REP | E86_PREFIX_REPN)) {
-		if (e86_get_cx (c) != 0) {
+		if (e86_get_cx (c) != 0 && e86_rep_stos (c, 2, 11) == 0) {
 			e86_set_mem16 (c, seg, e86_get_di (c), e86_get_ax (c));
 
 			e86_set_di (c, e86_get_di (c) + inc);
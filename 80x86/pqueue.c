@@ -35,6 +35,10 @@
  * The prefetch buffer is filled with pq_fill instead of pq_size bytes
  * so that there is always at least one entire instruction in the
  * prefetch buffer. Yes, this is ugly.
+ *
+ * In direct mode pq points at the instruction in ram whenever the
+ * next pq_fill bytes are there, and pq_buf is only used (and always
+ * refilled from scratch) for code outside ram or wrapping the segment.
  */
 
 
@@ -60,6 +64,18 @@ void e86_pq_fill (e8086_t *c)
 
 	cnt = c->pq_fill;
 
+	if (c->pq_direct) {
+		addr = e86_get_linear (seg, ofs) & c->addr_mask;
+
+		if (ofs <= (0xffff - cnt) && (addr + cnt) <= c->ram_cnt) {
+			c->pq = c->ram + addr;
+			return;
+		}
+
+		c->pq = c->pq_buf;
+		c->pq_cnt = 0;
+	}
+
 	if (ofs <= (0xffff - cnt)) {
 		/* all within one segment */
 
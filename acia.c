@@ -2,9 +2,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include "system.h"
 #include "acia.h"
+#include "console.h"
+#include "chardev.h"
+#include "trace.h"
 
 struct acia {
     uint8_t status;
@@ -14,6 +18,9 @@ struct acia {
     uint8_t inint;
     uint8_t inreset;
     uint8_t trace;
+    struct chardev *dev;	/* Not saved */
+    uint8_t unthrottled;
+    unsigned long long bytes;	/* Moved either way, for the metrics */
 };
 
 
@@ -27,13 +34,13 @@ static void acia_irq_compute(struct acia *acia)
 		acia->status |= 0x80;
 	/* Now see what should happen */
 	if (!(acia->config & 0x80) || !(acia->status & 0x80)) {
-		if (acia->inint && acia->trace)
+		if (acia->inint && TRACE_ON(acia->trace))
 			fprintf(stderr, "ACIA interrupt end.\n");
 		acia->inint = 0;
 		acia->status &= 0x7F;
 		return;
 	}
-	if (acia->inint == 0 && (acia->trace))
+	if (acia->inint == 0 && TRACE_ON(acia->trace))
 		fprintf(stderr, "ACIA interrupt.\n");
 	acia->inint = 1;
 	recalc_interrupts();
@@ -46,8 +53,12 @@ static void acia_receive(struct acia *acia)
 	/* Already a character waiting so set OVRN */
 	if (acia->status & 1)
 		acia->status |= 0x20;
-	acia->rxchar = next_char();
-	if (acia->trace)
+	if (acia->dev)
+		acia->rxchar = chardev_getc(acia->dev);
+	else
+		acia->rxchar = next_char();
+	acia->bytes++;
+	if (TRACE_ON(acia->trace))
 		fprintf(stderr, "ACIA rx.\n");
 	acia->status |= 0x01;	/* IRQ, and rx data full */
 }
@@ -55,7 +66,7 @@ static void acia_receive(struct acia *acia)
 static void acia_transmit(struct acia *acia)
 {
 	if (!(acia->status & 2)) {
-		if (acia->trace)
+		if (TRACE_ON(acia->trace))
 			fprintf(stderr, "ACIA tx is clear.\n");
 		acia->status |= 0x02;	/* IRQ, and tx data empty */
 	}
@@ -63,7 +74,19 @@ static void acia_transmit(struct acia *acia)
 
 void acia_timer(struct acia *acia)
 {
-	int s = check_chario();
+	int s;
+
+	if (acia->dev) {
+		s = chardev_status(acia->dev);
+		/* With RTS off leave the data with the sender */
+		if ((acia->config & 0x60) == 0x40)
+			s &= ~1;
+	} else {
+		s = check_chario();
+		/* Console input waits for the guest so a paste isn't lost */
+		if (acia->status & 1)
+			s &= ~1;
+	}
 	if ((s & 1) && acia->input)
 		acia_receive(acia);
 	if (s & 2)
@@ -74,18 +97,29 @@ void acia_timer(struct acia *acia)
 
 uint8_t acia_read(struct acia *acia, uint16_t addr)
 {
-	if (acia->trace)
+	uint8_t r;
+
+	if (TRACE_ON(acia->trace))
 		fprintf(stderr, "acia_read %d ", addr);
 	switch (addr) {
 	case 0:
 		if (acia->inreset) {
-			if (acia->trace)
+			if (TRACE_ON(acia->trace))
 				fprintf(stderr, "= 0 (reset).\n");
 			return 0;
 		}
 		/* Reading the ACIA status has no effect on the bits */
-		if (acia->trace)
+		if (TRACE_ON(acia->trace))
 			fprintf(stderr, "acia->status %d\n", acia->status);
+		if (acia->dev) {
+			/* Bit 2 is /DCD and bit 3 is /CTS */
+			r = acia->status & ~0x0C;
+			if (!chardev_connected(acia->dev))
+				r |= 0x04;
+			if (!chardev_cts(acia->dev))
+				r |= 0x08;
+			return r;
+		}
 		return acia->status;
 	case 1:
 		/* Reading the ACIA character clears the receive ready
@@ -93,9 +127,13 @@ uint8_t acia_read(struct acia *acia, uint16_t addr)
 		/* Clear receive ready and rx overrun */
 		acia->status &= ~0x21;
 		acia_irq_compute(acia);
-		if (acia->trace)
+		if (TRACE_ON(acia->trace))
 			fprintf(stderr, "acia_char %d\n", acia->rxchar);
-		return acia->rxchar;
+		r = acia->rxchar;
+		/* Unthrottled the next byte arrives as soon as there is room */
+		if (acia->unthrottled)
+			acia_timer(acia);
+		return r;
 	default:
 		fprintf(stderr, "acia: bad addr.\n");
 		exit(1);
@@ -104,7 +142,7 @@ uint8_t acia_read(struct acia *acia, uint16_t addr)
 
 void acia_write(struct acia *acia, uint16_t addr, uint8_t val)
 {
-	if (acia->trace)
+	if (TRACE_ON(acia->trace))
 		fprintf(stderr, "acia_write %d %d\n", addr, val);
 	switch (addr) {
 	case 0:
@@ -118,15 +156,21 @@ void acia_write(struct acia *acia, uint16_t addr, uint8_t val)
 			acia->inreset = 0;
 			acia->status = 2;
 		}
-		if (acia->trace)
+		if (TRACE_ON(acia->trace))
 			fprintf(stderr, "ACIA config %02X\n", val);
 		acia_irq_compute(acia);
 		return;
 	case 1:
-		write(1, &val, 1);
+		if (acia->dev)
+			chardev_putc(acia->dev, val);
+		else
+			console_putc(val);
+		acia->bytes++;
 		/* Clear TDRE - we now have a byte */
 		acia->status &= ~0x02;
 		acia_irq_compute(acia);
+		if (acia->unthrottled)
+			acia_timer(acia);
 		break;
 	}
 }
@@ -136,9 +180,43 @@ void acia_set_input(struct acia *acia, int onoff)
 	acia->input = onoff;
 }
 
+/* Use a host device in place of check_chario() and the console */
+void acia_attach(struct acia *acia, struct chardev *dev)
+{
+	acia->dev = dev;
+}
+
+/* One character at the current format in ACIA clocks. Boards that pace
+   acia_timer() at this rate get the programmed baud rate */
+unsigned int acia_char_clocks(struct acia *acia)
+{
+	/* Start, data, parity and stop bits for each word select */
+	static const uint8_t bits[8] = { 11, 11, 10, 10, 11, 10, 11, 11 };
+	static const uint8_t divide[4] = { 1, 16, 64, 64 };
+
+	return bits[(acia->config >> 2) & 7] * divide[acia->config & 3];
+}
+
+/* Feed input as fast as the guest reads it rather than at the baud rate */
+void acia_unthrottle(struct acia *acia, int onoff)
+{
+	acia->unthrottled = onoff;
+}
+
+unsigned long long acia_bytes(struct acia *acia)
+{
+	return acia->bytes;
+}
+
 void acia_reset(struct acia *acia)
 {
+    struct chardev *dev = acia->dev;
+    uint8_t unthrottled = acia->unthrottled;
+    unsigned long long bytes = acia->bytes;
     memset(acia, 0, sizeof(struct acia));
+    acia->dev = dev;
+    acia->unthrottled = unthrottled;
+    acia->bytes = bytes;
     acia->status = 2;
     acia_irq_compute(acia);
 }
@@ -150,7 +228,7 @@ uint8_t acia_irq_pending(struct acia *acia)
 
 struct acia *acia_create(void)
 {
-    struct acia *acia = malloc(sizeof(struct acia));
+    struct acia *acia = calloc(1, sizeof(struct acia));
     if (acia == NULL) {
         fprintf(stderr, "Out of memory.\n");
         exit(1);
@@ -168,3 +246,20 @@ void acia_trace(struct acia *acia, int onoff)
 {
     acia->trace = onoff;
 }
+
+/* Snapshot support. With buf NULL just report the size needed */
+size_t acia_save(struct acia *acia, void *buf)
+{
+	size_t len = offsetof(struct acia, trace);
+	if (buf)
+		memcpy(buf, acia, len);
+	return len;
+}
+
+int acia_load(struct acia *acia, const void *buf, size_t len)
+{
+	if (len != offsetof(struct acia, trace))
+		return -1;
+	memcpy(acia, buf, len);
+	return 0;
+}
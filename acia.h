@@ -1,4 +1,5 @@
 struct acia;
+struct chardev;
 
 extern struct acia *acia_create(void);
 extern void acia_free(struct acia *acia);
@@ -8,3 +9,9 @@ extern void acia_write(struct acia *acia, uint16_t addr, uint8_t val);
 extern void acia_timer(struct acia *acia);
 extern uint8_t acia_irq_pending(struct acia *acia);
 extern void acia_set_input(struct acia *acia, int onoff);
+extern void acia_attach(struct acia *acia, struct chardev *dev);
+extern unsigned int acia_char_clocks(struct acia *acia);
+extern void acia_unthrottle(struct acia *acia, int onoff);
+extern unsigned long long acia_bytes(struct acia *acia);
+extern size_t acia_save(struct acia *acia, void *buf);
+extern int acia_load(struct acia *acia, const void *buf, size_t len);
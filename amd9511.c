@@ -15,15 +15,24 @@
 struct amd9511 {
     void *context;
     unsigned int trace;
+    /* Busy timing, in CPU clocks */
+    uint64_t now;
+    uint64_t busy_until;
+    unsigned int cpu_clocks;
+    unsigned int apu_clocks;
 };
 
 
 uint8_t amd9511_read(struct amd9511 *am, uint8_t addr)
 {
+    uint8_t r;
     addr &= 1;
     if (addr == 0)
         return am_pop(am->context);
-    return am_status(am->context);
+    r = am_status(am->context);
+    if (am->now < am->busy_until)
+        r |= AM_BUSY;
+    return r;
 }
 
 void amd9511_write(struct amd9511 *am, uint8_t addr, uint8_t val)
@@ -31,8 +40,33 @@ void amd9511_write(struct amd9511 *am, uint8_t addr, uint8_t val)
     addr &= 1;
     if (addr == 0)
         am_push(am->context, val);
-    else
+    else {
         am_command(am->context, val);
+        /* The result is ready at once but the status shows busy for
+           as long as the real chip would take. A command issued while
+           busy starts when the previous one finishes */
+        if (am->apu_clocks) {
+            if (am->busy_until < am->now)
+                am->busy_until = am->now;
+            am->busy_until += (uint64_t)am_cycles(am->context) *
+                am->cpu_clocks / am->apu_clocks;
+        }
+    }
+}
+
+/* Set how many CPU clocks go by in apu_clocks APU clocks. Without it
+   the status never shows busy */
+void amd9511_set_clock(struct amd9511 *am, unsigned int cpu_clocks,
+                       unsigned int apu_clocks)
+{
+    am->cpu_clocks = cpu_clocks;
+    am->apu_clocks = apu_clocks;
+}
+
+/* Tell the chip the current time in CPU clocks before an access */
+void amd9511_time(struct amd9511 *am, uint64_t now)
+{
+    am->now = now;
 }
 
 struct amd9511 *amd9511_create(void)
@@ -43,6 +77,10 @@ struct amd9511 *amd9511_create(void)
         exit(1);
     }
     am->trace = 0;
+    am->now = 0;
+    am->busy_until = 0;
+    am->cpu_clocks = 0;
+    am->apu_clocks = 0;
     am->context = am_create(0,0 /* parameters are unused */);
     if (am->context == NULL) {
         fprintf(stderr, "Failed to create AMD9511 FPU context.\n");
@@ -61,6 +99,7 @@ void amd9511_free(struct amd9511 *am)
 void amd9511_reset(struct amd9511 *am)
 {
     am_reset(am->context);
+    am->busy_until = 0;
 }
 
 void amd9511_trace(struct amd9511 *am, unsigned int trace)
@@ -8,6 +8,9 @@ struct amd9511;
 uint8_t amd9511_read(struct amd9511 *am, uint8_t addr);
 void amd9511_write(struct amd9511 *am, uint8_t addr, uint8_t val);
 struct amd9511 *amd9511_create(void);
+void amd9511_set_clock(struct amd9511 *am, unsigned int cpu_clocks,
+                       unsigned int apu_clocks);
+void amd9511_time(struct amd9511 *am, uint64_t now);
 void amd9511_free(struct amd9511 *am);
 void amd9511_reset(struct amd9511 *am);
 void amd9511_trace(struct amd9511 *am, unsigned int trace);
@@ -5,6 +5,7 @@
 #include <SDL2/SDL.h>
 
 #include "asciikbd.h"
+#include "sdl2_texture.h"
 
 struct asciikbd {
     uint8_t key;
@@ -57,7 +58,7 @@ void asciikbd_event(struct asciikbd *kbd)
 {
 	SDL_Event ev;
 	const char *p;
-	while (SDL_PollEvent(&ev)) {
+	while (sdltex_poll_event(&ev)) {
 		switch(ev.type) {
 		case SDL_QUIT:
 		        exit(1);
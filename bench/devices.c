@@ -0,0 +1,580 @@
+/*
+ *	Device model microbenchmarks
+ *
+ *	Each test drives one device model straight through its register
+ *	interface with no CPU behind it and reports the host nanoseconds an
+ *	operation takes and the allocations made while timing. The board
+ *	callbacks the models want are stubbed out here.
+ *
+ *	devices [-n scale] [test...]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "ide.h"
+#include "sdcard.h"
+#include "system.h"
+#include "tms9918a.h"
+#include "w5100.h"
+#include "acia.h"
+#include "16x50.h"
+#include "chardev.h"
+#include "console.h"
+#include "6522.h"
+#include "6840.h"
+#include "sram_mmu8.h"
+
+/* Allocations made by the models, see the --wrap in the Makefile */
+static unsigned long allocs;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t n, size_t size);
+extern void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+	allocs++;
+	return __real_realloc(p, size);
+}
+
+/* Board side of the models */
+static volatile uint8_t sink;
+
+unsigned int check_chario(void)
+{
+	return 3;
+}
+
+unsigned int next_char(void)
+{
+	return 'A';
+}
+
+void console_putc(uint8_t c)
+{
+	sink = c;
+}
+
+void recalc_interrupts(void)
+{
+}
+
+struct chardev *chardev_create(const char *spec)
+{
+	return NULL;
+}
+
+void chardev_free(struct chardev *dev)
+{
+}
+
+unsigned int chardev_status(struct chardev *dev)
+{
+	return 3;
+}
+
+unsigned int chardev_getc(struct chardev *dev)
+{
+	return 'A';
+}
+
+void chardev_putc(struct chardev *dev, uint8_t c)
+{
+}
+
+int chardev_connected(struct chardev *dev)
+{
+	return 1;
+}
+
+int chardev_cts(struct chardev *dev)
+{
+	return 1;
+}
+
+void chardev_poll(void)
+{
+}
+
+unsigned int chardev_pollfds(struct pollfd *pfd)
+{
+	return 0;
+}
+
+void via_recalc_outputs(struct via6522 *via)
+{
+}
+
+void via_handshake_a(struct via6522 *via)
+{
+}
+
+void via_handshake_b(struct via6522 *via)
+{
+}
+
+void m6840_output_change(struct m6840 *ptm, uint8_t outputs)
+{
+}
+
+/*
+ *	Timing
+ */
+
+static unsigned long scale = 1;
+static char dir[] = "/tmp/devbench.XXXXXX";
+static char path[64];
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t t_start;
+static unsigned long a_start;
+
+static void start(void)
+{
+	a_start = allocs;
+	t_start = now();
+}
+
+static void report(const char *name, const char *unit, unsigned long ops)
+{
+	uint64_t t = now() - t_start;
+	unsigned long a = allocs - a_start;
+
+	printf("%-22s %12lu %-8s %10.2f %10lu\n", name, ops, unit,
+		(double)t / ops, a);
+}
+
+static int image(void)
+{
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/disk", dir);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+/*
+ *	The tests
+ */
+
+/* READ SECTORS for 256 at a time, the data port eight or sixteen bits wide */
+static void ide_stream(int wide)
+{
+	struct ide_controller *c = ide_allocate("cf");
+	unsigned long n = 0, i, runs = 64 * scale;
+	unsigned int lba = 0;
+	int fd = image();
+
+	if (ide_make_image(ACME_NEMESIS, fd, IDE_IMAGE_V1, 0) < 0 ||
+	    ide_attach(c, 0, fd) < 0) {
+		perror(path);
+		exit(1);
+	}
+	ide_reset_begin(c);
+	/* SET FEATURES for the eight bit data port a CF adapter uses */
+	if (!wide) {
+		ide_write8(c, ide_dev_head, 0xE0);
+		ide_write8(c, ide_feature_w, 0x01);
+		ide_write8(c, ide_command_w, 0xEF);
+	}
+	start();
+	while (runs--) {
+		ide_write8(c, ide_dev_head, 0xE0);
+		ide_write8(c, ide_lba_low, lba);
+		ide_write8(c, ide_lba_mid, lba >> 8);
+		ide_write8(c, ide_lba_hi, 0);
+		ide_write8(c, ide_sec_count, 0);
+		ide_write8(c, ide_command_w, 0x20);
+		if (wide) {
+			for (i = 0; i < 256 * 256; i++)
+				sink = ide_read16(c, ide_data);
+			n += 256 * 256;
+		} else {
+			for (i = 0; i < 256 * 512; i++)
+				sink = ide_read8(c, ide_data);
+			n += 256 * 512;
+		}
+		if (ide_read8(c, ide_status_r) & 0x01) {
+			fprintf(stderr, "ide: read failed.\n");
+			exit(1);
+		}
+		lba = (lba + 256) & 0x3FFF;
+	}
+	report(wide ? "ide_read16" : "ide_read8", wide ? "words" : "bytes", n);
+	ide_free(c);
+	unlink(path);
+}
+
+static void ide8(void)
+{
+	ide_stream(0);
+}
+
+static void ide16(void)
+{
+	ide_stream(1);
+}
+
+/* CMD17 single block reads over SPI a byte at a time */
+static void sd(void)
+{
+	struct sdcard *c = sd_create("sd0");
+	static const uint8_t zero[512];
+	unsigned long n, i, blocks = 4096 * scale;
+	uint32_t addr;
+	int fd = image();
+
+	for (i = 0; i < 1024; i++)
+		if (write(fd, zero, 512) != 512) {
+			perror(path);
+			exit(1);
+		}
+	sd_attach(c, fd);
+	sd_spi_lower_cs(c);
+	start();
+	for (n = 0; n < blocks; n++) {
+		addr = (n & 1023) * 512;
+		sd_spi_in(c, 0x51);
+		sd_spi_in(c, addr >> 24);
+		sd_spi_in(c, addr >> 16);
+		sd_spi_in(c, addr >> 8);
+		sd_spi_in(c, addr);
+		sd_spi_in(c, 0x01);
+		for (i = 0; i < 16 && sd_spi_in(c, 0xFF) == 0xFF; i++);
+		for (i = 0; i < 16 && sd_spi_in(c, 0xFF) != 0xFE; i++);
+		for (i = 0; i < 512; i++)
+			sink = sd_spi_in(c, 0xFF);
+	}
+	report("sd_spi_in", "blocks", blocks);
+	sd_free(c);
+	unlink(path);
+}
+
+static uint32_t ctab[16] = {
+	0xFF000000, 0xFF000000, 0xFF21C842, 0xFF5EDC78,
+	0xFF5455ED, 0xFF7D76FC, 0xFFD4524D, 0xFF42EBF5,
+	0xFFFC5554, 0xFFFF7978, 0xFFD4C154, 0xFFE6CE80,
+	0xFF21B03B, 0xFFC95BBA, 0xFFCCCCCC, 0xFFFFFFFF
+};
+
+/* Whole frames in each mode with a full set of sprites on the screen */
+static void tms_mode(const char *name, uint8_t r0, uint8_t r1)
+{
+	struct tms9918a *vdp = tms9918a_create();
+	static const uint8_t regs[8] = { 0, 0, 0x06, 0xFF, 0x03, 0x36, 0x07, 0xF1 };
+	unsigned long n, frames = 2000 * scale;
+	unsigned int i;
+	uint32_t r = 1;
+
+	tms9918a_set_colourmap(vdp, ctab);
+	for (i = 0; i < 8; i++) {
+		tms9918a_write(vdp, 1, i == 0 ? r0 : i == 1 ? r1 : regs[i]);
+		tms9918a_write(vdp, 1, 0x80 | i);
+	}
+	tms9918a_write(vdp, 1, 0x00);
+	tms9918a_write(vdp, 1, 0x40);
+	for (i = 0; i < 16384; i++) {
+		r = r * 1103515245 + 12345;
+		tms9918a_write(vdp, 0, r >> 16);
+	}
+	/* Sprite attributes at 0x1B00, none of them the 0xD0 end marker */
+	tms9918a_write(vdp, 1, 0x00);
+	tms9918a_write(vdp, 1, 0x5B);
+	for (i = 0; i < 32; i++) {
+		tms9918a_write(vdp, 0, i * 6);
+		tms9918a_write(vdp, 0, i * 8);
+		tms9918a_write(vdp, 0, i * 4);
+		tms9918a_write(vdp, 0, (i & 15) | 1);
+	}
+	start();
+	for (n = 0; n < frames; n++) {
+		/* A backdrop change makes each frame a full redraw */
+		tms9918a_write(vdp, 1, 0xF0 | (n & 1));
+		tms9918a_write(vdp, 1, 0x87);
+		tms9918a_rasterize(vdp);
+		/* And the 32bit picture a renderer would take */
+		tms9918a_get_raster(vdp);
+	}
+	report(name, "frames", frames);
+	tms9918a_free(vdp);
+}
+
+static void tms(void)
+{
+	tms_mode("tms9918a_text", 0x00, 0x50);
+	tms_mode("tms9918a_graphics1", 0x00, 0x42);
+	tms_mode("tms9918a_graphics2", 0x02, 0x42);
+	tms_mode("tms9918a_multicolour", 0x00, 0x4A);
+}
+
+/*
+ *	W5100 UDP between two of its own sockets on the loopback address.
+ *	Socket 0 on 127.0.0.1:6510 sends 64 byte datagrams to socket 1 on
+ *	6511 and each one is received and read out of the buffer.
+ */
+static void w5100_set(nic_w5100_t *w, uint16_t reg, const uint8_t *p, unsigned int len)
+{
+	while (len--)
+		nic_w5100_write(w, reg++, *p++);
+}
+
+static uint16_t w5100_get16(nic_w5100_t *w, uint16_t reg)
+{
+	return (nic_w5100_read(w, reg) << 8) | nic_w5100_read(w, reg + 1);
+}
+
+static void w5100_udp(nic_w5100_t *w, unsigned int s, unsigned int port)
+{
+	uint16_t base = 0x400 + 0x100 * s;
+	uint8_t p[2] = { port >> 8, port };
+
+	nic_w5100_write(w, base + 0x00, 0x02);	/* UDP */
+	nic_w5100_write(w, base + 0x01, 0x01);	/* OPEN */
+	/* Binds once both bytes of the port are in */
+	w5100_set(w, base + 0x04, p, 2);
+}
+
+static void w5100(void)
+{
+	nic_w5100_t *w = nic_w5100_alloc();
+	static const uint8_t ip[4] = { 127, 0, 0, 1 };
+	static const uint8_t dport[2] = { 6511 >> 8, 6511 & 0xFF };
+	unsigned long n, i, tries, packets = 20000 * scale;
+	uint16_t wr, rd, len;
+
+	nic_w5100_reset(w);
+	w5100_set(w, 0x00F, ip, 4);		/* SIPR */
+	w5100_udp(w, 0, 6510);
+	w5100_udp(w, 1, 6511);
+	w5100_set(w, 0x40C, ip, 4);		/* S0_DIPR */
+	w5100_set(w, 0x410, dport, 2);
+	start();
+	for (n = 0; n < packets; n++) {
+		wr = w5100_get16(w, 0x424);
+		for (i = 0; i < 64; i++)
+			nic_w5100_write(w, 0x4000 + ((wr + i) & 0x7FF), i);
+		wr += 64;
+		nic_w5100_write(w, 0x424, wr >> 8);
+		nic_w5100_write(w, 0x425, wr);
+		nic_w5100_write(w, 0x401, 0x20);	/* SEND */
+		for (tries = 0; w5100_get16(w, 0x526) == 0; tries++) {
+			if (tries == 1000) {
+				fprintf(stderr, "w5100: datagram lost.\n");
+				exit(1);
+			}
+			w5100_process(w);
+		}
+		/* Eight bytes of address, port and length ahead of the data */
+		rd = w5100_get16(w, 0x528);
+		len = (nic_w5100_read(w, 0x6800 + ((rd + 6) & 0x7FF)) << 8) |
+			nic_w5100_read(w, 0x6800 + ((rd + 7) & 0x7FF));
+		for (i = 0; i < len; i++)
+			sink = nic_w5100_read(w, 0x6800 + ((rd + 8 + i) & 0x7FF));
+		rd += 8 + len;
+		nic_w5100_write(w, 0x528, rd >> 8);
+		nic_w5100_write(w, 0x529, rd);
+		nic_w5100_write(w, 0x501, 0x40);	/* RECV */
+	}
+	report("w5100_udp", "packets", packets);
+	nic_w5100_free(w);
+}
+
+/* Transmit and receive a byte each way through the console stubs */
+static void acia(void)
+{
+	struct acia *a = acia_create();
+	unsigned long n, bytes = 2000000 * scale;
+
+	acia_write(a, 0, 0x03);
+	acia_write(a, 0, 0x16);
+	acia_set_input(a, 1);
+	start();
+	for (n = 0; n < bytes; n++) {
+		acia_timer(a);
+		if (acia_read(a, 0) & 0x02)
+			acia_write(a, 1, n);
+		if (acia_read(a, 0) & 0x01)
+			sink = acia_read(a, 1);
+	}
+	report("acia", "bytes", bytes);
+	acia_free(a);
+}
+
+static void uart(void)
+{
+	struct uart16x50 *u = uart16x50_create();
+	unsigned long n, bytes = 2000000 * scale;
+
+	uart16x50_reset(u);
+	uart16x50_write(u, 3, 0x03);	/* 8N1 */
+	uart16x50_write(u, 2, 0x07);	/* FIFOs on */
+	uart16x50_write(u, 4, 0x03);	/* DTR and RTS */
+	uart16x50_set_input(u, 1);
+	start();
+	for (n = 0; n < bytes; n++) {
+		uart16x50_event(u);
+		if (uart16x50_read(u, 5) & 0x20)
+			uart16x50_write(u, 0, n);
+		if (uart16x50_read(u, 5) & 0x01)
+			sink = uart16x50_read(u, 0);
+	}
+	report("16x50", "bytes", bytes);
+	uart16x50_free(u);
+}
+
+/* Timers free running with interrupts on, ticked four clocks at a time */
+static void via(void)
+{
+	struct via6522 *v = via_create();
+	unsigned long n, ticks = 10000000 * scale;
+
+	via_write(v, 11, 0x40);
+	via_write(v, 4, 0xFF);
+	via_write(v, 5, 0x00);
+	via_write(v, 14, 0xC0);
+	start();
+	for (n = 0; n < ticks; n++) {
+		via_tick(v, 4);
+		if (via_irq_pending(v))
+			sink = via_read(v, 4);
+	}
+	report("via_tick", "ticks", ticks);
+	via_free(v);
+}
+
+static void ptm(void)
+{
+	struct m6840 *p = m6840_create();
+	unsigned long n, ticks = 10000000 * scale;
+	unsigned int i;
+
+	m6840_reset(p);
+	for (i = 0; i < 3; i++) {
+		m6840_write(p, 2 + 2 * i, 0x00);
+		m6840_write(p, 3 + 2 * i, 0xFF);
+	}
+	m6840_write(p, 1, 0x42);	/* CR2, next is CR3 */
+	m6840_write(p, 0, 0x42);
+	m6840_write(p, 1, 0x43);	/* CR2, next is CR1 */
+	m6840_write(p, 0, 0x42);	/* Out of reset */
+	start();
+	for (n = 0; n < ticks; n++) {
+		m6840_tick(p, 4);
+		if (m6840_irq_pending(p))
+			sink = m6840_read(p, 1) + m6840_read(p, 2);
+	}
+	report("m6840_tick", "ticks", ticks);
+	m6840_free(p);
+}
+
+/* Walk the 512K through a full map, cold each pass and then from the cache */
+static void mmu(void)
+{
+	struct sram_mmu *m = sram_mmu_create();
+	unsigned long n, i, hits = 0, passes = 64 * scale;
+	unsigned int berr;
+	uint8_t *p;
+
+	sram_mmu_set_latch(m, 0x00);
+	for (i = 0; i < 64; i++) {
+		*sram_mmu_translate(m, i << 13, 1, 1, 0, &berr) = i;
+		*sram_mmu_translate(m, i << 13, 1, 1, 1, &berr) = i;
+	}
+	start();
+	for (n = 0; n < passes; n++) {
+		sram_mmu_set_latch(m, 0x80 | (n & 1));
+		sram_mmu_set_latch(m, 0x80);
+		for (i = 0; i < 0x80000; i += 64) {
+			p = sram_mmu_translate(m, i, i & 64, 1, 0, &berr);
+			hits += p != NULL;
+		}
+	}
+	report("sram_mmu_translate", "lookups", passes * (0x80000 / 64));
+	if (hits != passes * (0x80000 / 64))
+		fprintf(stderr, "sram_mmu: %lu lookups failed.\n",
+			passes * (0x80000 / 64) - hits);
+	sram_mmu_free(m);
+}
+
+struct test {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct test tests[] = {
+	{ "ide8", ide8 },
+	{ "ide16", ide16 },
+	{ "sd", sd },
+	{ "tms9918a", tms },
+	{ "w5100", w5100 },
+	{ "acia", acia },
+	{ "16x50", uart },
+	{ "via", via },
+	{ "m6840", ptm },
+	{ "mmu", mmu },
+	{ NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+	const struct test *t;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			scale = strtoul(optarg, NULL, 0);
+			if (scale == 0)
+				scale = 1;
+			break;
+		default:
+			fprintf(stderr, "%s: [-n scale] [test...]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		exit(1);
+	}
+	printf("%-22s %12s %-8s %10s %10s\n", "test", "ops", "", "ns/op", "allocs");
+	for (t = tests; t->name; t++) {
+		if (optind < argc) {
+			for (i = optind; i < argc; i++)
+				if (strcmp(argv[i], t->name) == 0)
+					break;
+			if (i == argc)
+				continue;
+		}
+		t->run();
+	}
+	rmdir(dir);
+	return 0;
+}
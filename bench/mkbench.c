@@ -0,0 +1,171 @@
+/*
+ *	Write out the ROM images for the built in benchmark workloads
+ *
+ *	Each one is a small hand assembled loop that ends with DI; HALT so
+ *	that a batch run with -H stops when it is done. The images are
+ *	padded to 8K as the loader wants at least that much.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROMSIZE	8192
+
+struct workload {
+	const char *name;
+	const uint8_t *code;
+	unsigned int len;
+};
+
+/* Register arithmetic: 32 x 65536 passes of a short ALU loop */
+static const uint8_t alu[] = {
+	0xF3,			/* di */
+	0x31, 0x00, 0x00,	/* ld sp,0 */
+	0x16, 0x20,		/* ld d,32 */
+	0x01, 0x00, 0x00,	/* 1: ld bc,0 */
+	0x85,			/* 2: add a,l */
+	0xAC,			/* xor h */
+	0x6F,			/* ld l,a */
+	0x24,			/* inc h */
+	0x0B,			/* dec bc */
+	0x78,			/* ld a,b */
+	0xB1,			/* or c */
+	0x20, 0xF7,		/* jr nz,2b */
+	0x15,			/* dec d */
+	0x20, 0xF1,		/* jr nz,1b */
+	0x76			/* halt */
+};
+
+/* Block moves: LDIR 12K of RAM around */
+static const uint8_t mem[] = {
+	0xF3,			/* di */
+	0x31, 0x00, 0x00,	/* ld sp,0 */
+	0x06, 0x80,		/* ld b,128 */
+	0xC5,			/* 1: push bc */
+	0x21, 0x00, 0x80,	/* ld hl,0x8000 */
+	0x11, 0x00, 0xC0,	/* ld de,0xC000 */
+	0x01, 0x00, 0x30,	/* ld bc,0x3000 */
+	0xED, 0xB0,		/* ldir */
+	0xC1,			/* pop bc */
+	0x10, 0xF1,		/* djnz 1b */
+	0x76			/* halt */
+};
+
+/* Console output: 4096 characters through the ACIA, polling for space */
+static const uint8_t con[] = {
+	0xF3,			/* di */
+	0x31, 0x00, 0x00,	/* ld sp,0 */
+	0x3E, 0x03,		/* ld a,3 */
+	0xD3, 0x80,		/* out (0x80),a	; master reset */
+	0x3E, 0x16,		/* ld a,0x16 */
+	0xD3, 0x80,		/* out (0x80),a	; 8N1 /64 */
+	0x16, 0x10,		/* ld d,16 */
+	0x1E, 0x00,		/* 1: ld e,0 */
+	0xDB, 0x80,		/* 2: in a,(0x80) */
+	0xE6, 0x02,		/* and 2 */
+	0x28, 0xFA,		/* jr z,2b */
+	0x7B,			/* ld a,e */
+	0xE6, 0x1F,		/* and 0x1F */
+	0xC6, 0x40,		/* add 0x40 */
+	0xD3, 0x81,		/* out (0x81),a */
+	0x1D,			/* dec e */
+	0x20, 0xF0,		/* jr nz,2b */
+	0x15,			/* dec d */
+	0x20, 0xEB,		/* jr nz,1b */
+	0x76			/* halt */
+};
+
+/* CF reads: 8192 sectors from the start of the disk with INIR */
+static const uint8_t ide[] = {
+	0xF3,			/* di */
+	0x31, 0x00, 0x00,	/* ld sp,0 */
+	0xDB, 0x17,		/* 1: in a,(0x17) */
+	0xE6, 0xC0,		/* and 0xC0 */
+	0xFE, 0x40,		/* cp 0x40	; ready, not busy */
+	0x20, 0xF8,		/* jr nz,1b */
+	0x3E, 0xE0,		/* ld a,0xE0 */
+	0xD3, 0x16,		/* out (0x16),a	; LBA, drive 0 */
+	0x16, 0x20,		/* ld d,32 */
+	0x1E, 0x00,		/* 2: ld e,0 */
+	0x7B,			/* 3: ld a,e */
+	0xD3, 0x13,		/* out (0x13),a */
+	0x7A,			/* ld a,d */
+	0xD3, 0x14,		/* out (0x14),a */
+	0x3E, 0x01,		/* ld a,1 */
+	0xD3, 0x12,		/* out (0x12),a */
+	0x3E, 0x20,		/* ld a,0x20 */
+	0xD3, 0x17,		/* out (0x17),a	; read sectors */
+	0xDB, 0x17,		/* 4: in a,(0x17) */
+	0xE6, 0x88,		/* and 0x88 */
+	0xFE, 0x08,		/* cp 0x08	; DRQ, not busy */
+	0x20, 0xF8,		/* jr nz,4b */
+	0x21, 0x00, 0x80,	/* ld hl,0x8000 */
+	0x01, 0x10, 0x00,	/* ld bc,0x0010 */
+	0xED, 0xB2,		/* inir */
+	0x1D,			/* dec e */
+	0x20, 0xDF,		/* jr nz,3b */
+	0x15,			/* dec d */
+	0x20, 0xDA,		/* jr nz,2b */
+	0x76			/* halt */
+};
+
+/* VDP writes: fill the 16K of TMS9918A memory 64 times with the
+   display on so each frame gets rendered */
+static const uint8_t tms[] = {
+	0xF3,			/* di */
+	0x31, 0x00, 0x00,	/* ld sp,0 */
+	0x3E, 0xC0,		/* ld a,0xC0 */
+	0xD3, 0x99,		/* out (0x99),a */
+	0x3E, 0x81,		/* ld a,0x81 */
+	0xD3, 0x99,		/* out (0x99),a	; R1: 16K, display on */
+	0x16, 0x40,		/* ld d,64 */
+	0xAF,			/* 1: xor a */
+	0xD3, 0x99,		/* out (0x99),a */
+	0x3E, 0x40,		/* ld a,0x40 */
+	0xD3, 0x99,		/* out (0x99),a	; write from 0 */
+	0x1E, 0x40,		/* ld e,64 */
+	0x21, 0x00, 0x00,	/* ld hl,0 */
+	0x01, 0x98, 0x00,	/* 2: ld bc,0x0098 */
+	0xED, 0xB3,		/* otir */
+	0x1D,			/* dec e */
+	0x20, 0xF8,		/* jr nz,2b */
+	0x15,			/* dec d */
+	0x20, 0xE9,		/* jr nz,1b */
+	0x76			/* halt */
+};
+
+static const struct workload workloads[] = {
+	{ "alu", alu, sizeof(alu) },
+	{ "mem", mem, sizeof(mem) },
+	{ "con", con, sizeof(con) },
+	{ "ide", ide, sizeof(ide) },
+	{ "tms", tms, sizeof(tms) },
+	{ NULL, }
+};
+
+int main(int argc, char *argv[])
+{
+	const struct workload *w;
+	static uint8_t rom[ROMSIZE];
+	char path[1024];
+	FILE *fp;
+
+	if (argc != 2) {
+		fprintf(stderr, "%s: directory\n", argv[0]);
+		exit(1);
+	}
+	for (w = workloads; w->name; w++) {
+		memset(rom, 0xFF, sizeof(rom));
+		memcpy(rom, w->code, w->len);
+		snprintf(path, sizeof(path), "%s/%s.rom", argv[1], w->name);
+		fp = fopen(path, "w");
+		if (fp == NULL || fwrite(rom, sizeof(rom), 1, fp) != 1 ||
+		    fclose(fp)) {
+			perror(path);
+			exit(1);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+#	Run the emulator benchmarks
+#
+#	Each workload is a batch run of rc2014 with no console input. The
+#	emulator prints its T-state and instruction counts when it exits and
+#	we turn those into emulated MHz and host nanoseconds per instruction.
+#	Syscalls per second need perf or strace and show as - without them.
+#
+#	Extra workloads such as ZEXDOC or a CP/M build can be listed in
+#	bench/workloads.local, one per line as
+#
+#		name	file	rc2014 options
+#
+#	The line is skipped if file (relative to bench/) is missing. The
+#	options come after the defaults so they can give their own -B
+#	script and an -E string to stop on.
+#
+#	A batch run is deterministic so the T-states each workload takes
+#	are checked against bench/tstates (bench/tstates.local for the
+#	extra ones). A core, dispatch or flag change that alters the
+#	count shows as CHANGED and the script fails. Run with RECORD=1 to
+#	write the counts out again after a change that is meant to.
+#
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+TOP=$(dirname "$BENCH")
+RC2014=${RC2014:-$TOP/rc2014}
+LIMIT=${LIMIT:-4000000000}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/rcbench.XXXXXX") || exit 1
+GOLDEN=$BENCH/tstates
+trap 'rm -rf "$WORK"' 0 1 2 15
+
+"$BENCH/mkbench" "$WORK" || exit 1
+"$TOP/makedisk" 3 "$WORK/cf.img" || exit 1
+: >"$WORK/empty"
+
+if command -v perf >/dev/null 2>&1 &&
+   perf stat -e raw_syscalls:sys_enter -x, true 2>/dev/null; then
+	TRACER=perf
+elif command -v strace >/dev/null 2>&1; then
+	TRACER=strace
+else
+	TRACER=
+fi
+
+# run name options...
+run() {
+	name=$1
+	shift
+	case $TRACER in
+	perf)
+		eval perf stat -e raw_syscalls:sys_enter -x, -o "$WORK/sys" \
+			"$RC2014" -B "$WORK/empty" -H -t $LIMIT -o /dev/null \
+			"$@" 2>"$WORK/err" </dev/null
+		sys=$(awk -F, '/raw_syscalls/ { print $1 }' "$WORK/sys");;
+	strace)
+		eval strace -f -c -o "$WORK/sys" \
+			"$RC2014" -B "$WORK/empty" -H -t $LIMIT -o /dev/null \
+			"$@" 2>"$WORK/err" </dev/null
+		sys=$(awk '$NF == "total" { print $4 }' "$WORK/sys");;
+	*)
+		eval "$RC2014" -B "$WORK/empty" -H -t $LIMIT -o /dev/null \
+			"$@" 2>"$WORK/err" </dev/null
+		sys=;;
+	esac
+	want=$(awk -v name="$name" '$1 == name { print $2 }' "$GOLDEN" 2>/dev/null)
+	awk -v name="$name" -v sys="$sys" -v want="$want" \
+	    -v record="${RECORD:+$WORK/record}" -v changed="$WORK/changed" '
+		/^\[batch:/ {
+			gsub(/[\[,]/, "")
+			t = $2; i = $4; s = $6
+			if (s <= 0)
+				s = 0.001
+			if (record != "") {
+				print name, t >>record
+				check = "recorded"
+			} else if (want == "")
+				check = "-"
+			else if (want == t)
+				check = "ok"
+			else {
+				check = "CHANGED"
+				print name, want, t >>changed
+			}
+			printf("%-12s %10.2f %10.2f %12s %8.3f %10s\n", name,
+				t / s / 1E6, s * 1E9 / (i ? i : 1),
+				sys == "" ? "-" : sprintf("%d", sys / s), s, check)
+			found = 1
+		}
+		END {
+			if (!found) {
+				printf("%-12s failed\n", name)
+				print name, "failed" >>changed
+			}
+		}' "$WORK/err"
+}
+
+# Move the recorded counts into place
+record() {
+	if [ -n "$RECORD" ] && [ -f "$WORK/record" ]; then
+		sort "$WORK/record" >"$GOLDEN" && rm -f "$WORK/record"
+	fi
+}
+
+printf "%-12s %10s %10s %12s %8s %10s\n" workload MHz ns/instr syscalls/s seconds T-states
+run alu -a -r "$WORK/alu.rom"
+run mem -a -r "$WORK/mem.rom"
+run console -a -r "$WORK/con.rom"
+run ide -a -r "$WORK/ide.rom" -i "$WORK/cf.img"
+run tms9918a -a -T -r "$WORK/tms.rom"
+record
+
+if [ -f "$BENCH/workloads.local" ]; then
+	cd "$BENCH" || exit 1
+	GOLDEN=$BENCH/tstates.local
+	grep -v '^#' workloads.local | while read -r name file opts; do
+		[ -n "$name" ] || continue
+		if [ -f "$file" ]; then
+			run "$name" "$opts"
+		else
+			printf "%-12s skipped, no %s\n" "$name" "$file"
+		fi
+	done
+	record
+fi
+
+if [ -s "$WORK/changed" ]; then
+	echo "T-state counts differ from the recorded ones:"
+	awk '{ printf("  %s: %s now %s\n", $1, $2, $3) }' "$WORK/changed"
+	exit 1
+fi
@@ -0,0 +1,363 @@
+/*
+ *	Shared disk block cache
+ *
+ *	Blocks are keyed on fd and block number, so any disk model that does
+ *	its I/O through here shares the one pool. Writes stay in the cache
+ *	until the block is evicted or flushed. Runs of missing blocks are
+ *	fetched with a single read so a long transfer is no worse than it
+ *	was uncached.
+ *
+ *	A write that fails on write back can't be reported to the guest any
+ *	more, so it is reported on stderr instead.
+ *
+ *	Disk models may do their reads from a helper thread, so every entry
+ *	point holds bc_lock. That also covers the cow_ calls made under it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "blkcache.h"
+#include "cow.h"
+
+#define BC_BLOCK	512
+#define BC_RUN		64	/* Most blocks fetched in one read */
+
+struct bc_entry {
+	int fd;
+	off_t blk;
+	unsigned int len;	/* Valid bytes, short at end of file */
+	int dirty;
+	struct bc_entry *prev;	/* LRU, most recent at the head */
+	struct bc_entry *next;
+	struct bc_entry *hnext;
+	uint8_t data[BC_BLOCK];
+};
+
+static struct bc_entry *entries;
+static unsigned int nentries;
+static struct bc_entry **hash;
+static unsigned int hashmask;
+static struct bc_entry *lru_head, *lru_tail;
+static struct blkcache_stats stats;
+static pthread_mutex_t bc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int bc_hash(int fd, off_t blk)
+{
+	return ((unsigned int)blk * 31 + fd) & hashmask;
+}
+
+static void bc_unlink(struct bc_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+}
+
+static void bc_use(struct bc_entry *e)
+{
+	if (e == lru_head)
+		return;
+	bc_unlink(e);
+	e->prev = NULL;
+	e->next = lru_head;
+	lru_head->prev = e;
+	lru_head = e;
+	if (lru_tail == NULL)
+		lru_tail = e;
+}
+
+static void bc_unhash(struct bc_entry *e)
+{
+	struct bc_entry **p = &hash[bc_hash(e->fd, e->blk)];
+	while (*p) {
+		if (*p == e) {
+			*p = e->hnext;
+			break;
+		}
+		p = &(*p)->hnext;
+	}
+	e->fd = -1;
+}
+
+static struct bc_entry *bc_find(int fd, off_t blk)
+{
+	struct bc_entry *e = hash[bc_hash(fd, blk)];
+	while (e) {
+		if (e->fd == fd && e->blk == blk)
+			return e;
+		e = e->hnext;
+	}
+	return NULL;
+}
+
+static int bc_writeback(struct bc_entry *e)
+{
+	if (!e->dirty)
+		return 0;
+	e->dirty = 0;
+	stats.writebacks++;
+	if (cow_pwrite(e->fd, e->data, e->len, e->blk * BC_BLOCK) != e->len) {
+		fprintf(stderr, "blkcache: write back of block %ld failed: %s\n",
+			(long)e->blk, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Take the least recently used entry for a new block */
+static struct bc_entry *bc_claim(int fd, off_t blk)
+{
+	struct bc_entry *e = lru_tail;
+	unsigned int h;
+
+	if (e->fd != -1) {
+		bc_writeback(e);
+		bc_unhash(e);
+	}
+	e->fd = fd;
+	e->blk = blk;
+	e->len = 0;
+	e->dirty = 0;
+	memset(e->data, 0, BC_BLOCK);
+	h = bc_hash(fd, blk);
+	e->hnext = hash[h];
+	hash[h] = e;
+	bc_use(e);
+	return e;
+}
+
+static void bc_exit(void)
+{
+	blkcache_flush(-1);
+}
+
+void blkcache_init(unsigned int blocks)
+{
+	unsigned int i;
+	unsigned int hsize = 1;
+
+	if (entries || blocks == 0)
+		return;
+	while (hsize < blocks * 2)
+		hsize <<= 1;
+	entries = calloc(blocks, sizeof(struct bc_entry));
+	hash = calloc(hsize, sizeof(struct bc_entry *));
+	if (entries == NULL || hash == NULL) {
+		fprintf(stderr, "blkcache: out of memory.\n");
+		exit(1);
+	}
+	nentries = blocks;
+	hashmask = hsize - 1;
+	for (i = 0; i < blocks; i++) {
+		entries[i].fd = -1;
+		entries[i].prev = i ? &entries[i - 1] : NULL;
+		entries[i].next = i < blocks - 1 ? &entries[i + 1] : NULL;
+	}
+	lru_head = entries;
+	lru_tail = entries + blocks - 1;
+	atexit(bc_exit);
+}
+
+/* Fetch a run of missing blocks starting at blk with one read */
+static int bc_fill(int fd, off_t blk, unsigned int n)
+{
+	static uint8_t buf[BC_RUN * BC_BLOCK];
+	ssize_t r;
+	unsigned int i;
+
+	stats.misses += n;
+	r = cow_pread(fd, buf, n * BC_BLOCK, blk * BC_BLOCK);
+	if (r == -1)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct bc_entry *e = bc_claim(fd, blk + i);
+		if (r > BC_BLOCK * i) {
+			e->len = r - BC_BLOCK * i;
+			if (e->len > BC_BLOCK)
+				e->len = BC_BLOCK;
+			memcpy(e->data, buf + BC_BLOCK * i, e->len);
+		}
+	}
+	return 0;
+}
+
+static struct bc_entry *bc_get(int fd, off_t blk, off_t last)
+{
+	struct bc_entry *e = bc_find(fd, blk);
+	unsigned int n = 1;
+
+	if (e) {
+		stats.hits++;
+		bc_use(e);
+		return e;
+	}
+	/* Gather the following misses too, but never so many we would
+	   evict the start of the run before using it */
+	while (blk + n <= last && n < BC_RUN && n < nentries &&
+		bc_find(fd, blk + n) == NULL)
+		n++;
+	if (bc_fill(fd, blk, n) == -1)
+		return NULL;
+	return bc_find(fd, blk);
+}
+
+static ssize_t bc_pread(int fd, void *buf, size_t len, off_t off)
+{
+	uint8_t *p = buf;
+	size_t done = 0;
+	off_t last = (off + len - 1) / BC_BLOCK;
+
+	if (entries == NULL)
+		return cow_pread(fd, buf, len, off);
+	while (done < len) {
+		off_t pos = off + done;
+		unsigned int boff = pos % BC_BLOCK;
+		size_t n = BC_BLOCK - boff;
+		struct bc_entry *e = bc_get(fd, pos / BC_BLOCK, last);
+
+		if (e == NULL)
+			return done ? done : -1;
+		if (n > len - done)
+			n = len - done;
+		/* Off the end of the file */
+		if (boff >= e->len)
+			break;
+		if (boff + n > e->len)
+			n = e->len - boff;
+		memcpy(p + done, e->data + boff, n);
+		done += n;
+		if (e->len < BC_BLOCK)
+			break;
+	}
+	return done;
+}
+
+static ssize_t bc_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	const uint8_t *p = buf;
+	size_t done = 0;
+
+	if (entries == NULL)
+		return cow_pwrite(fd, buf, len, off);
+	while (done < len) {
+		off_t pos = off + done;
+		off_t blk = pos / BC_BLOCK;
+		unsigned int boff = pos % BC_BLOCK;
+		size_t n = BC_BLOCK - boff;
+		struct bc_entry *e;
+
+		if (n > len - done)
+			n = len - done;
+		e = bc_find(fd, blk);
+		if (e) {
+			stats.hits++;
+			bc_use(e);
+		} else if (n == BC_BLOCK) {
+			/* Whole block, no need to read the old one */
+			stats.misses++;
+			e = bc_claim(fd, blk);
+		} else if ((e = bc_get(fd, blk, blk)) == NULL)
+			return done ? done : -1;
+		memcpy(e->data + boff, p + done, n);
+		if (boff + n > e->len)
+			e->len = boff + n;
+		e->dirty = 1;
+		done += n;
+	}
+	return done;
+}
+
+/* Write back everything dirty for an fd, or for all of them if fd is -1 */
+static int bc_flush(int fd)
+{
+	unsigned int i;
+	int r = 0;
+
+	for (i = 0; i < nentries; i++) {
+		struct bc_entry *e = entries + i;
+		if (e->fd != -1 && (fd == -1 || e->fd == fd))
+			if (bc_writeback(e) == -1)
+				r = -1;
+	}
+	return r;
+}
+
+/* Flush and forget an fd before closing it */
+static int bc_close(int fd)
+{
+	unsigned int i;
+
+	bc_flush(fd);
+	for (i = 0; i < nentries; i++) {
+		struct bc_entry *e = entries + i;
+		if (e->fd != fd)
+			continue;
+		/* Free entries go to the tail to be reused first */
+		bc_unhash(e);
+		bc_unlink(e);
+		e->next = NULL;
+		e->prev = lru_tail;
+		if (lru_tail)
+			lru_tail->next = e;
+		else
+			lru_head = e;
+		lru_tail = e;
+	}
+	return cow_close(fd);
+}
+
+ssize_t blkcache_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t r;
+
+	pthread_mutex_lock(&bc_lock);
+	r = bc_pread(fd, buf, len, off);
+	pthread_mutex_unlock(&bc_lock);
+	return r;
+}
+
+ssize_t blkcache_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t r;
+
+	pthread_mutex_lock(&bc_lock);
+	r = bc_pwrite(fd, buf, len, off);
+	pthread_mutex_unlock(&bc_lock);
+	return r;
+}
+
+int blkcache_flush(int fd)
+{
+	int r;
+
+	pthread_mutex_lock(&bc_lock);
+	r = bc_flush(fd);
+	pthread_mutex_unlock(&bc_lock);
+	return r;
+}
+
+int blkcache_close(int fd)
+{
+	int r;
+
+	pthread_mutex_lock(&bc_lock);
+	r = bc_close(fd);
+	pthread_mutex_unlock(&bc_lock);
+	return r;
+}
+
+void blkcache_stats(struct blkcache_stats *s)
+{
+	pthread_mutex_lock(&bc_lock);
+	*s = stats;
+	pthread_mutex_unlock(&bc_lock);
+}
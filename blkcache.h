@@ -0,0 +1,27 @@
+#ifndef __BLKCACHE_H
+#define __BLKCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ *	A write back LRU cache of 512 byte blocks shared by all the disk
+ *	models. Until blkcache_init() is called every call passes straight
+ *	through to the cow_ layer.
+ */
+
+struct blkcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long writebacks;
+};
+
+extern void blkcache_init(unsigned int blocks);
+extern ssize_t blkcache_pread(int fd, void *buf, size_t len, off_t off);
+extern ssize_t blkcache_pwrite(int fd, const void *buf, size_t len, off_t off);
+extern int blkcache_flush(int fd);
+extern int blkcache_close(int fd);
+extern void blkcache_stats(struct blkcache_stats *s);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ *	Host character devices for the serial models
+ *
+ *	All the devices are serviced together by chardev_poll() with one
+ *	zero timeout poll() and then a read and write on those that are
+ *	ready. The descriptors are non blocking so a slow or absent peer
+ *	never stalls the emulation. Input is only read while there is room
+ *	in the buffer, so when the guest stops taking bytes the host side
+ *	fills up and the sender is made to wait. Output while nobody is
+ *	connected is thrown away as it would be on an unplugged line.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "chardev.h"
+#include "console.h"
+
+#define CHARDEV_BUF	4096	/* Power of two */
+#define CHARDEV_MAX	CHARDEV_POLLFDS
+
+#define CD_STDIO	0
+#define CD_PTY		1
+#define CD_TCP		2
+#define CD_UNIX		3
+
+struct ring {
+	uint8_t buf[CHARDEV_BUF];
+	unsigned int head;	/* Free running, masked on use */
+	unsigned int tail;
+};
+
+struct chardev {
+	int type;
+	int listen;		/* Listening socket or -1 */
+	int fd;			/* Connection or pty master, or -1 */
+	int connected;
+	struct ring in;
+	struct ring out;
+	char *path;		/* Unix socket to remove at exit */
+};
+
+static struct chardev *devs[CHARDEV_MAX];
+static unsigned int ndevs;
+
+static unsigned int ring_len(struct ring *r)
+{
+	return r->head - r->tail;
+}
+
+static void chardev_nonblock(int fd)
+{
+	int f = fcntl(fd, F_GETFL);
+	if (f == -1 || fcntl(fd, F_SETFL, f | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+}
+
+static void chardev_listen(struct chardev *dev, int domain,
+			   struct sockaddr *sa, socklen_t len, const char *spec)
+{
+	int one = 1;
+
+	dev->listen = socket(domain, SOCK_STREAM, 0);
+	if (dev->listen == -1) {
+		perror("socket");
+		exit(1);
+	}
+	if (domain == AF_INET)
+		setsockopt(dev->listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(dev->listen, sa, len) == -1 || listen(dev->listen, 1) == -1) {
+		perror(spec);
+		exit(1);
+	}
+	chardev_nonblock(dev->listen);
+	fprintf(stderr, "[serial listening on %s]\n", spec);
+}
+
+static void chardev_pty(struct chardev *dev)
+{
+	struct termios t;
+	char *name;
+
+	dev->fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (dev->fd == -1 || grantpt(dev->fd) || unlockpt(dev->fd) ||
+	    (name = ptsname(dev->fd)) == NULL) {
+		perror("pty");
+		exit(1);
+	}
+	/* Raw so file transfers get through untouched */
+	if (tcgetattr(dev->fd, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(dev->fd, TCSANOW, &t);
+	}
+	chardev_nonblock(dev->fd);
+	/* We can't tell when the other end opens it so assume it has */
+	dev->connected = 1;
+	fprintf(stderr, "[serial on %s]\n", name);
+}
+
+static void chardev_tcp(struct chardev *dev, const char *spec)
+{
+	struct sockaddr_in sin;
+	const char *p = strrchr(spec, ':');
+	char addr[64];
+	char *end;
+	long port;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (p) {
+		if (p - spec >= (int)sizeof(addr)) {
+			fprintf(stderr, "tcp:%s: bad address.\n", spec);
+			exit(1);
+		}
+		memcpy(addr, spec, p - spec);
+		addr[p - spec] = 0;
+		if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+			fprintf(stderr, "tcp:%s: bad address.\n", spec);
+			exit(1);
+		}
+		p++;
+	} else
+		p = spec;
+	port = strtol(p, &end, 10);
+	if (*p == 0 || *end || port < 1 || port > 65535) {
+		fprintf(stderr, "tcp:%s: bad port.\n", spec);
+		exit(1);
+	}
+	sin.sin_port = htons(port);
+	chardev_listen(dev, AF_INET, (struct sockaddr *)&sin, sizeof(sin), spec);
+}
+
+static void chardev_unix(struct chardev *dev, const char *path)
+{
+	struct sockaddr_un sun;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long.\n", path);
+		exit(1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	chardev_listen(dev, AF_UNIX, (struct sockaddr *)&sun, sizeof(sun), path);
+	dev->path = strdup(path);
+}
+
+struct chardev *chardev_create(const char *spec)
+{
+	struct chardev *dev;
+
+	if (ndevs == CHARDEV_MAX) {
+		fprintf(stderr, "%s: too many serial devices.\n", spec);
+		exit(1);
+	}
+	dev = calloc(1, sizeof(struct chardev));
+	if (dev == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	dev->listen = -1;
+	dev->fd = -1;
+	if (strcmp(spec, "stdio") == 0) {
+		dev->type = CD_STDIO;
+		dev->connected = 1;
+	} else if (strcmp(spec, "pty") == 0) {
+		dev->type = CD_PTY;
+		chardev_pty(dev);
+	} else if (strncmp(spec, "tcp:", 4) == 0) {
+		dev->type = CD_TCP;
+		chardev_tcp(dev, spec + 4);
+	} else if (strncmp(spec, "unix:", 5) == 0) {
+		dev->type = CD_UNIX;
+		chardev_unix(dev, spec + 5);
+	} else {
+		fprintf(stderr, "%s: unknown serial device.\n", spec);
+		exit(1);
+	}
+	devs[ndevs++] = dev;
+	return dev;
+}
+
+void chardev_free(struct chardev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < ndevs; i++) {
+		if (devs[i] == dev) {
+			devs[i] = devs[--ndevs];
+			break;
+		}
+	}
+	if (dev->fd != -1)
+		close(dev->fd);
+	if (dev->listen != -1)
+		close(dev->listen);
+	if (dev->path) {
+		unlink(dev->path);
+		free(dev->path);
+	}
+	free(dev);
+}
+
+unsigned int chardev_status(struct chardev *dev)
+{
+	unsigned int r = 0;
+
+	if (dev->type == CD_STDIO)
+		return console_status();
+	if (ring_len(&dev->in))
+		r |= CHARDEV_READY;
+	if (ring_len(&dev->out) < CHARDEV_BUF)
+		r |= CHARDEV_ROOM;
+	return r;
+}
+
+unsigned int chardev_getc(struct chardev *dev)
+{
+	if (dev->type == CD_STDIO)
+		return console_getc();
+	if (ring_len(&dev->in) == 0)
+		return 0xFF;
+	return dev->in.buf[dev->in.tail++ & (CHARDEV_BUF - 1)];
+}
+
+void chardev_putc(struct chardev *dev, uint8_t c)
+{
+	if (dev->type == CD_STDIO) {
+		console_putc(c);
+		return;
+	}
+	/* Nobody listening, or the guest ignored the flow control */
+	if (!dev->connected || ring_len(&dev->out) == CHARDEV_BUF)
+		return;
+	dev->out.buf[dev->out.head++ & (CHARDEV_BUF - 1)] = c;
+}
+
+/* For DSR and DCD */
+int chardev_connected(struct chardev *dev)
+{
+	return dev->connected;
+}
+
+/* Clear to send while the output buffer is under half full */
+int chardev_cts(struct chardev *dev)
+{
+	if (dev->type == CD_STDIO)
+		return 1;
+	return dev->connected && ring_len(&dev->out) < CHARDEV_BUF / 2;
+}
+
+static void chardev_hangup(struct chardev *dev)
+{
+	/* A pty is not closed when the far side goes away */
+	if (dev->type == CD_PTY)
+		return;
+	close(dev->fd);
+	dev->fd = -1;
+	dev->connected = 0;
+	dev->out.tail = dev->out.head;
+}
+
+static void chardev_accept(struct chardev *dev)
+{
+	int one = 1;
+	int fd = accept(dev->listen, NULL, NULL);
+
+	if (fd == -1)
+		return;
+	chardev_nonblock(fd);
+	if (dev->type == CD_TCP)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	dev->fd = fd;
+	dev->connected = 1;
+	/* Anything left from the last connection belongs to nobody */
+	dev->in.tail = dev->in.head;
+}
+
+static void chardev_read(struct chardev *dev)
+{
+	struct ring *r = &dev->in;
+	unsigned int pos = r->head & (CHARDEV_BUF - 1);
+	unsigned int room = CHARDEV_BUF - ring_len(r);
+	ssize_t n;
+
+	if (room > CHARDEV_BUF - pos)
+		room = CHARDEV_BUF - pos;
+	n = read(dev->fd, r->buf + pos, room);
+	if (n > 0)
+		r->head += n;
+	else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+		chardev_hangup(dev);
+}
+
+static void chardev_write(struct chardev *dev)
+{
+	struct ring *r = &dev->out;
+	unsigned int pos = r->tail & (CHARDEV_BUF - 1);
+	unsigned int len = ring_len(r);
+	ssize_t n;
+
+	if (len > CHARDEV_BUF - pos)
+		len = CHARDEV_BUF - pos;
+	n = write(dev->fd, r->buf + pos, len);
+	if (n > 0)
+		r->tail += n;
+	else if (n < 0 && errno != EAGAIN && errno != EINTR)
+		chardev_hangup(dev);
+}
+
+/* What to wait on when the board is idle: input for a device that has
+   none buffered, or a connection. A pty is left out as it reports a hang
+   up for as long as nothing has it open. Returns how many are worth
+   waiting on */
+unsigned int chardev_pollfds(struct pollfd *pfd)
+{
+	struct chardev *dev;
+	unsigned int i;
+	unsigned int n = 0;
+
+	for (i = 0; i < CHARDEV_MAX; i++) {
+		pfd[i].fd = -1;
+		pfd[i].events = POLLIN;
+		if (i >= ndevs)
+			continue;
+		dev = devs[i];
+		if (dev->type == CD_PTY)
+			continue;
+		if (dev->fd != -1 && ring_len(&dev->in) == 0)
+			pfd[i].fd = dev->fd;
+		else if (dev->fd == -1)
+			pfd[i].fd = dev->listen;
+		if (pfd[i].fd != -1)
+			n++;
+	}
+	return n;
+}
+
+/* Move data for every device. Called from the console tick */
+void chardev_poll(void)
+{
+	struct pollfd pfd[CHARDEV_MAX];
+	struct chardev *map[CHARDEV_MAX];
+	struct chardev *dev;
+	unsigned int i;
+	unsigned int n = 0;
+
+	for (i = 0; i < ndevs; i++) {
+		dev = devs[i];
+		if (dev->fd != -1) {
+			pfd[n].fd = dev->fd;
+			pfd[n].events = 0;
+			if (ring_len(&dev->in) < CHARDEV_BUF)
+				pfd[n].events |= POLLIN;
+			if (ring_len(&dev->out))
+				pfd[n].events |= POLLOUT;
+		} else if (dev->listen != -1) {
+			pfd[n].fd = dev->listen;
+			pfd[n].events = POLLIN;
+		} else
+			continue;
+		map[n++] = dev;
+	}
+	if (n == 0 || poll(pfd, n, 0) <= 0)
+		return;
+	for (i = 0; i < n; i++) {
+		dev = map[i];
+		if (pfd[i].revents == 0)
+			continue;
+		if (dev->fd == -1) {
+			chardev_accept(dev);
+			continue;
+		}
+		/* A pty with no slave open reports a hang up */
+		if (dev->type == CD_PTY && (pfd[i].revents & POLLHUP))
+			continue;
+		if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+			chardev_read(dev);
+		if (dev->fd != -1 && (pfd[i].revents & POLLOUT))
+			chardev_write(dev);
+	}
+}
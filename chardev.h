@@ -0,0 +1,37 @@
+#ifndef __CHARDEV_H
+#define __CHARDEV_H
+
+#include <stdint.h>
+#include <poll.h>
+
+/*
+ *	Host side of a serial port. A UART model with no device attached
+ *	uses the console as before. Otherwise it can be given the console
+ *	("stdio"), a pty ("pty"), a TCP listener ("tcp:[addr:]port", on
+ *	the loopback address by default) or a unix socket listener
+ *	("unix:path"). Both directions are buffered and only moved by
+ *	chardev_poll() so asking for the status costs nothing. A model
+ *	stops taking input when its RTS is off and the data is left with
+ *	the host, which holds up the sender.
+ */
+
+struct chardev;
+
+/* Status bits as with check_chario() */
+#define CHARDEV_READY	1	/* A byte is waiting */
+#define CHARDEV_ROOM	2	/* A byte can be sent */
+
+/* Entries filled in by chardev_pollfds() */
+#define CHARDEV_POLLFDS	8
+
+extern struct chardev *chardev_create(const char *spec);
+extern void chardev_free(struct chardev *dev);
+extern unsigned int chardev_status(struct chardev *dev);
+extern unsigned int chardev_getc(struct chardev *dev);
+extern void chardev_putc(struct chardev *dev, uint8_t c);
+extern int chardev_connected(struct chardev *dev);
+extern int chardev_cts(struct chardev *dev);
+extern void chardev_poll(void);
+extern unsigned int chardev_pollfds(struct pollfd *pfd);
+
+#endif
@@ -0,0 +1,669 @@
+/*
+ *	Console hub for running many emulator instances
+ *
+ *	conhub [-l tcp:[addr:]port|unix:path] [-n count] [-b backlog] command [args]
+ *
+ *	Starts count copies of the command with {} in the arguments replaced
+ *	by the instance number. Each gets one end of a socket pair as its
+ *	stdin and stdout, so there is no tty to set up and the console reads
+ *	it without a select. One epoll loop serves every instance and every
+ *	operator connection, taking whatever is ready across them all in
+ *	each pass.
+ *
+ *	Operators all connect to the one listener and give an instance
+ *	number (or "l" for a list). They then see the last backlog bytes the
+ *	instance printed followed by its live output, and what they type goes
+ *	to its console. Any number can watch the same instance. Output is
+ *	always taken from an instance whether or not anyone is attached, and
+ *	a connection that can't keep up loses output rather than holding the
+ *	instance up. The hub exits once all the instances have.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define HUB_IO		65536	/* Largest single read */
+#define HUB_INBUF	4096	/* Typed input waiting on an instance */
+#define HUB_CLIENTBUF	65536	/* Output waiting on a slow connection */
+#define HUB_EVENTS	256
+
+#define K_LISTEN	0
+#define K_INST		1
+#define K_CLIENT	2
+
+/* Byte ring, size a power of two */
+struct ring {
+	uint8_t *buf;
+	unsigned int size;
+	unsigned int head;	/* Free running, masked on use */
+	unsigned int tail;
+};
+
+struct inst {
+	int kind;
+	unsigned int num;
+	pid_t pid;
+	int fd;			/* Our end of its console, or -1 */
+	int status;
+	struct ring backlog;	/* Recent output, oldest overwritten */
+	struct ring in;		/* Input it has not taken yet */
+	unsigned int events;
+};
+
+struct client {
+	int kind;
+	int fd;
+	struct inst *inst;	/* NULL until one is picked */
+	char line[16];
+	unsigned int linelen;
+	struct ring out;
+	unsigned int events;
+	struct client *next;
+};
+
+static const char *name;
+static int ep;
+static int listen_kind = K_LISTEN;
+static int listen_fd;
+static char *unix_path;
+static struct inst *inst;
+static unsigned int ninst;
+static unsigned int running;
+static struct client *clients;
+static volatile sig_atomic_t stop;
+static uint8_t iobuf[HUB_IO];
+
+static void usage(void)
+{
+	fprintf(stderr, "%s [-l tcp:[addr:]port|unix:path] [-n count] [-b backlog] command [args]\n", name);
+	exit(1);
+}
+
+static void *hub_alloc(size_t len)
+{
+	void *p = calloc(1, len);
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return p;
+}
+
+static void ring_init(struct ring *r, unsigned int size)
+{
+	r->buf = hub_alloc(size);
+	r->size = size;
+}
+
+static unsigned int ring_len(struct ring *r)
+{
+	return r->head - r->tail;
+}
+
+/* Add bytes, dropping the oldest if keep or the newest otherwise */
+static void ring_put(struct ring *r, const uint8_t *p, unsigned int len, int keep)
+{
+	unsigned int room = r->size - ring_len(r);
+	unsigned int pos, n;
+
+	if (len > room) {
+		if (!keep)
+			len = room;
+		else {
+			if (len > r->size) {
+				p += len - r->size;
+				len = r->size;
+			}
+			r->tail += len - room;
+		}
+	}
+	while (len) {
+		pos = r->head & (r->size - 1);
+		n = r->size - pos;
+		if (n > len)
+			n = len;
+		memcpy(r->buf + pos, p, n);
+		r->head += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* Write out what we can. Returns -1 if the far end has gone */
+static int ring_write(struct ring *r, int fd)
+{
+	unsigned int pos, len;
+	ssize_t n;
+
+	while ((len = ring_len(r)) != 0) {
+		pos = r->tail & (r->size - 1);
+		if (len > r->size - pos)
+			len = r->size - pos;
+		n = write(fd, r->buf + pos, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			return -1;
+		}
+		r->tail += n;
+	}
+	return 0;
+}
+
+static void hub_nonblock(int fd)
+{
+	int f = fcntl(fd, F_GETFL);
+	if (f == -1 || fcntl(fd, F_SETFL, f | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+}
+
+static void hub_watch(int fd, int op, unsigned int events, void *p)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = p;
+	if (epoll_ctl(ep, op, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+static void hub_listen(const char *spec)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	const char *p;
+	char addr[64];
+	char *end;
+	long port;
+	int one = 1;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		if (strlen(spec + 5) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "%s: socket path too long.\n", spec + 5);
+			exit(1);
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, spec + 5);
+		unlink(sun.sun_path);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+			perror(spec);
+			exit(1);
+		}
+		unix_path = strdup(sun.sun_path);
+	} else if (strncmp(spec, "tcp:", 4) == 0) {
+		spec += 4;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		p = strrchr(spec, ':');
+		if (p) {
+			if (p - spec >= (int)sizeof(addr)) {
+				fprintf(stderr, "tcp:%s: bad address.\n", spec);
+				exit(1);
+			}
+			memcpy(addr, spec, p - spec);
+			addr[p - spec] = 0;
+			if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+				fprintf(stderr, "tcp:%s: bad address.\n", spec);
+				exit(1);
+			}
+			p++;
+		} else
+			p = spec;
+		port = strtol(p, &end, 10);
+		if (*p == 0 || *end || port < 1 || port > 65535) {
+			fprintf(stderr, "tcp:%s: bad port.\n", spec);
+			exit(1);
+		}
+		sin.sin_port = htons(port);
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd == -1) {
+			perror("socket");
+			exit(1);
+		}
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+			perror(spec);
+			exit(1);
+		}
+	} else
+		usage();
+	if (listen(listen_fd, 64) == -1) {
+		perror("listen");
+		exit(1);
+	}
+	hub_nonblock(listen_fd);
+	hub_watch(listen_fd, EPOLL_CTL_ADD, EPOLLIN, &listen_kind);
+}
+
+/* Copy of the arguments with {} replaced by the instance number */
+static char **hub_args(char **argv, unsigned int num)
+{
+	char **args;
+	char *p, *q;
+	char n[16];
+	int argc, i;
+
+	for (argc = 0; argv[argc]; argc++);
+	args = hub_alloc((argc + 1) * sizeof(char *));
+	snprintf(n, sizeof(n), "%u", num);
+	for (i = 0; i < argc; i++) {
+		p = strstr(argv[i], "{}");
+		if (p == NULL) {
+			args[i] = argv[i];
+			continue;
+		}
+		args[i] = hub_alloc(strlen(argv[i]) + strlen(n));
+		q = args[i];
+		memcpy(q, argv[i], p - argv[i]);
+		q += p - argv[i];
+		strcpy(q, n);
+		strcat(q, p + 2);
+	}
+	return args;
+}
+
+static void hub_spawn(struct inst *in, char **argv)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	in->pid = fork();
+	if (in->pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (in->pid == 0) {
+		dup2(sv[1], 0);
+		dup2(sv[1], 1);
+		signal(SIGPIPE, SIG_DFL);
+		argv = hub_args(argv, in->num);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	close(sv[1]);
+	in->fd = sv[0];
+	hub_nonblock(in->fd);
+	in->events = EPOLLIN;
+	hub_watch(in->fd, EPOLL_CTL_ADD, in->events, in);
+	running++;
+}
+
+static void client_events(struct client *c)
+{
+	unsigned int ev = 0;
+
+	/* Stop reading while the instance is behind with what was typed */
+	if (c->inst == NULL || (c->inst->fd != -1 && ring_len(&c->inst->in) < HUB_INBUF))
+		ev |= EPOLLIN;
+	if (ring_len(&c->out))
+		ev |= EPOLLOUT;
+	if (ev != c->events) {
+		c->events = ev;
+		hub_watch(c->fd, EPOLL_CTL_MOD, ev, c);
+	}
+}
+
+static void inst_events(struct inst *in)
+{
+	unsigned int ev = EPOLLIN;
+	struct client *c;
+
+	if (ring_len(&in->in))
+		ev |= EPOLLOUT;
+	if (ev == in->events)
+		return;
+	in->events = ev;
+	hub_watch(in->fd, EPOLL_CTL_MOD, ev, in);
+	for (c = clients; c; c = c->next)
+		if (c->inst == in)
+			client_events(c);
+}
+
+static void client_send(struct client *c, const uint8_t *p, unsigned int len)
+{
+	ring_put(&c->out, p, len, 0);
+}
+
+static void client_printf(struct client *c, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void client_printf(struct client *c, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n > (int)sizeof(buf) - 1)
+		n = sizeof(buf) - 1;
+	client_send(c, (uint8_t *)buf, n);
+}
+
+/* Output from an instance goes to the backlog and everyone watching */
+static void inst_output(struct inst *in, const uint8_t *p, unsigned int len)
+{
+	struct client *c;
+
+	ring_put(&in->backlog, p, len, 1);
+	for (c = clients; c; c = c->next) {
+		if (c->inst != in)
+			continue;
+		client_send(c, p, len);
+		client_events(c);
+	}
+}
+
+static void inst_exit(struct inst *in)
+{
+	char msg[64];
+	int n;
+
+	hub_watch(in->fd, EPOLL_CTL_DEL, 0, NULL);
+	close(in->fd);
+	in->fd = -1;
+	in->in.tail = in->in.head;
+	while (waitpid(in->pid, &in->status, 0) == -1 && errno == EINTR);
+	if (WIFEXITED(in->status))
+		n = snprintf(msg, sizeof(msg), "\r\n[instance %u exited %d]\r\n",
+			in->num, WEXITSTATUS(in->status));
+	else
+		n = snprintf(msg, sizeof(msg), "\r\n[instance %u killed by signal %d]\r\n",
+			in->num, WTERMSIG(in->status));
+	inst_output(in, (uint8_t *)msg, n);
+	running--;
+}
+
+static void inst_read(struct inst *in)
+{
+	ssize_t n = read(in->fd, iobuf, HUB_IO);
+
+	if (n > 0)
+		inst_output(in, iobuf, n);
+	else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+		inst_exit(in);
+}
+
+static void client_close(struct client *c)
+{
+	struct client **p;
+
+	for (p = &clients; *p != c; p = &(*p)->next);
+	*p = c->next;
+	close(c->fd);
+	free(c->out.buf);
+	free(c);
+}
+
+static void client_accept(void)
+{
+	struct client *c;
+	int one = 1;
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c = hub_alloc(sizeof(struct client));
+		c->kind = K_CLIENT;
+		c->fd = fd;
+		ring_init(&c->out, HUB_CLIENTBUF);
+		c->next = clients;
+		clients = c;
+		c->events = EPOLLIN;
+		hub_watch(fd, EPOLL_CTL_ADD, c->events, c);
+		client_printf(c, "conhub: %u instances, %u running. Instance? ", ninst, running);
+		client_events(c);
+	}
+}
+
+static void client_list(struct client *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < ninst; i++) {
+		if (inst[i].fd != -1)
+			client_printf(c, "%u: pid %d\r\n", i, (int)inst[i].pid);
+		else
+			client_printf(c, "%u: exited\r\n", i);
+	}
+}
+
+static void client_backlog(struct client *c, struct ring *b)
+{
+	unsigned int pos = b->tail & (b->size - 1);
+	unsigned int len = ring_len(b);
+
+	if (len > b->size - pos) {
+		client_send(c, b->buf + pos, b->size - pos);
+		len -= b->size - pos;
+		pos = 0;
+	}
+	client_send(c, b->buf + pos, len);
+}
+
+/* The first line picks the instance. Anything after it is input */
+static int client_pick(struct client *c, const uint8_t *p, unsigned int len)
+{
+	unsigned int used = 0;
+	unsigned long n;
+	char *end;
+
+	while (used < len) {
+		uint8_t ch = p[used++];
+		if (ch != '\r' && ch != '\n') {
+			if (c->linelen < sizeof(c->line) - 1)
+				c->line[c->linelen++] = ch;
+			continue;
+		}
+		if (c->linelen == 0)
+			continue;
+		c->line[c->linelen] = 0;
+		c->linelen = 0;
+		if (strcmp(c->line, "l") == 0) {
+			client_list(c);
+			client_printf(c, "Instance? ");
+			continue;
+		}
+		n = strtoul(c->line, &end, 10);
+		if (*end || n >= ninst) {
+			client_printf(c, "No such instance. Instance? ");
+			continue;
+		}
+		c->inst = &inst[n];
+		client_printf(c, "[instance %lu]\r\n", n);
+		/* Catch up with what it printed before we came */
+		client_backlog(c, &c->inst->backlog);
+		break;
+	}
+	return used;
+}
+
+static void client_read(struct client *c)
+{
+	struct inst *in;
+	unsigned int room = HUB_IO;
+	unsigned int used = 0;
+	ssize_t n;
+
+	if (c->inst) {
+		room = HUB_INBUF - ring_len(&c->inst->in);
+		if (room == 0)
+			return;
+	}
+	n = read(c->fd, iobuf, room);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_close(c);
+		return;
+	}
+	if (n < 0)
+		return;
+	if (c->inst == NULL)
+		used = client_pick(c, iobuf, n);
+	in = c->inst;
+	if (in && in->fd != -1 && used < n) {
+		ring_put(&in->in, iobuf + used, n - used, 0);
+		if (ring_write(&in->in, in->fd) == -1)
+			in->in.tail = in->in.head;
+		inst_events(in);
+	}
+	client_events(c);
+}
+
+static void client_write(struct client *c)
+{
+	if (ring_write(&c->out, c->fd) == -1) {
+		client_close(c);
+		return;
+	}
+	client_events(c);
+}
+
+static void hub_signal(int sig)
+{
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev[HUB_EVENTS];
+	const char *spec = "tcp:2300";
+	unsigned int backlog = 16384;
+	unsigned int i;
+	struct client *c;
+	int opt, n, k;
+	int status = 0;
+
+	name = argv[0];
+	while ((opt = getopt(argc, argv, "+l:n:b:")) != -1) {
+		switch (opt) {
+		case 'l':
+			spec = optarg;
+			break;
+		case 'n':
+			ninst = atoi(optarg);
+			break;
+		case 'b':
+			backlog = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+	if (ninst == 0)
+		ninst = 1;
+	/* Round the backlog up to a power of two */
+	for (k = 1024; k < (int)backlog && k < (1 << 24); k <<= 1);
+	backlog = k;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, hub_signal);
+	signal(SIGTERM, hub_signal);
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep == -1) {
+		perror("epoll_create");
+		exit(1);
+	}
+	hub_listen(spec);
+	inst = hub_alloc(ninst * sizeof(struct inst));
+	for (i = 0; i < ninst; i++) {
+		inst[i].kind = K_INST;
+		inst[i].num = i;
+		ring_init(&inst[i].backlog, backlog);
+		ring_init(&inst[i].in, HUB_INBUF);
+		hub_spawn(&inst[i], argv + optind);
+	}
+	fprintf(stderr, "[%u instances, console hub on %s]\n", ninst, spec);
+
+	while (running && !stop) {
+		n = epoll_wait(ep, ev, HUB_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (k = 0; k < n; k++) {
+			int kind = *(int *)ev[k].data.ptr;
+			struct inst *in;
+
+			if (kind == K_LISTEN) {
+				client_accept();
+				continue;
+			}
+			if (kind == K_INST) {
+				in = ev[k].data.ptr;
+				if (in->fd == -1)
+					continue;
+				if (ev[k].events & EPOLLOUT) {
+					if (ring_write(&in->in, in->fd) == -1)
+						in->in.tail = in->in.head;
+					inst_events(in);
+				}
+				if (ev[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					inst_read(in);
+				continue;
+			}
+			/* A client may have been closed earlier in this batch */
+			for (c = clients; c && c != ev[k].data.ptr; c = c->next);
+			if (c == NULL)
+				continue;
+			if (ev[k].events & EPOLLOUT) {
+				client_write(c);
+				for (c = clients; c && c != ev[k].data.ptr; c = c->next);
+				if (c == NULL)
+					continue;
+			}
+			if (ev[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				client_read(c);
+		}
+	}
+	if (stop) {
+		for (i = 0; i < ninst; i++)
+			if (inst[i].fd != -1)
+				kill(inst[i].pid, SIGTERM);
+		for (i = 0; i < ninst; i++)
+			if (inst[i].fd != -1)
+				inst_exit(&inst[i]);
+	}
+	/* Let anyone watching see the ends */
+	for (c = clients; c; c = c->next)
+		ring_write(&c->out, c->fd);
+	if (unix_path)
+		unlink(unix_path);
+	for (i = 0; i < ninst; i++)
+		if (!WIFEXITED(inst[i].status) || WEXITSTATUS(inst[i].status))
+			status = 1;
+	return status;
+}
@@ -0,0 +1,473 @@
+/*
+ *	Host console buffering
+ *
+ *	Input is refilled at most once per tick with a zero timeout select and
+ *	a single read, then handed out a byte at a time so polling a UART
+ *	status costs nothing. We don't set O_NONBLOCK as on a terminal that
+ *	would also apply to stdout and stderr. When stdin is a socket, as
+ *	under conhub, a non blocking recv does it in one call. Output
+ *	is batched and written on a newline, when the buffer fills or at the
+ *	end of the tick.
+ *
+ *	Input can instead come from a script, in which case nothing depends
+ *	on the host: sends are paced by the ticks, delays by the emulated
+ *	clock the board gives us and waits by what the guest prints.
+ *	Input read from the host goes in the replay log if one is being
+ *	kept, and comes from it instead when replaying.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "console.h"
+#include "chardev.h"
+#include "replay.h"
+
+#define CONSOLE_BUF	512
+
+static uint8_t inbuf[CONSOLE_BUF];
+static unsigned int inptr;
+static unsigned int inlen;
+
+static uint8_t outbuf[CONSOLE_BUF];
+static unsigned int outlen;
+
+static int buffered;
+static int eof;
+static int insock;
+
+/* Output patterns being looked for */
+#define WATCH_LEN	128
+
+struct watch {
+	uint8_t text[WATCH_LEN];
+	unsigned int len;
+	unsigned int pos;
+	unsigned int fail[WATCH_LEN];
+	int seen;
+};
+
+static struct watch watch[CONSOLE_WATCHES];
+static unsigned int watching;
+
+/* Input script */
+#define S_SEND		0
+#define S_WAIT		1
+#define S_DELAY		2
+
+struct script_cmd {
+	unsigned int op;
+	uint8_t *text;
+	unsigned int len;
+	unsigned long ms;
+};
+
+static int scripted;
+static struct script_cmd *script;
+static unsigned int script_len;
+static unsigned int script_pc;
+static unsigned int script_sent;	/* Progress through a send */
+static uint64_t script_clock;		/* Emulated ms from the board */
+static uint64_t script_until;		/* End of the current delay */
+
+static void console_write(const uint8_t *p, unsigned int len)
+{
+	while (len) {
+		ssize_t n = write(1, p, len);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			/* Nowhere to put it, so drop it as the old code did */
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+void console_flush(void)
+{
+	if (outlen) {
+		console_write(outbuf, outlen);
+		outlen = 0;
+	}
+}
+
+/* A socket can be read without a select first */
+static void console_insock(void)
+{
+	struct stat st;
+
+	insock = fstat(0, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+void console_init(void)
+{
+	/* Anything the board printed first must come out first */
+	fflush(stdout);
+	atexit(console_flush);
+	buffered = 1;
+	console_insock();
+}
+
+/* Set up the command we have just reached. A wait starts looking at
+   once so output that comes straight after the last send is not missed */
+static void script_arm(void)
+{
+	struct script_cmd *c;
+
+	script_sent = 0;
+	if (script_pc == script_len)
+		return;
+	c = &script[script_pc];
+	if (c->op == S_WAIT)
+		console_watch(CONSOLE_WATCH_SCRIPT, (char *)c->text);
+	else if (c->op == S_DELAY)
+		script_until = script_clock + c->ms;
+}
+
+static void script_next(void)
+{
+	script_pc++;
+	script_arm();
+}
+
+/* Feed the input buffer from the script until something has to wait */
+static void script_run(void)
+{
+	while (script_pc < script_len) {
+		struct script_cmd *c = &script[script_pc];
+		unsigned int n;
+
+		switch (c->op) {
+		case S_SEND:
+			n = c->len - script_sent;
+			if (n > CONSOLE_BUF)
+				n = CONSOLE_BUF;
+			memcpy(inbuf, c->text + script_sent, n);
+			inlen = n;
+			script_sent += n;
+			if (script_sent == c->len)
+				script_next();
+			if (n)
+				return;
+			break;
+		case S_WAIT:
+			if (!console_seen(CONSOLE_WATCH_SCRIPT))
+				return;
+			console_watch(CONSOLE_WATCH_SCRIPT, NULL);
+			script_next();
+			break;
+		case S_DELAY:
+			if (script_clock < script_until)
+				return;
+			script_next();
+			break;
+		}
+	}
+	/* Script over, so the input is finished too */
+	eof = 1;
+}
+
+/* Once per scheduler tick: push out pending output and refill input */
+void console_tick(void)
+{
+	fd_set i;
+	struct timeval tv;
+	ssize_t n;
+
+	console_flush();
+	chardev_poll();
+	if (inptr < inlen || eof)
+		return;
+	inptr = 0;
+	inlen = 0;
+	if (scripted) {
+		script_run();
+		return;
+	}
+	if (replay_playing()) {
+		n = replay_get(REPLAY_CONSOLE, inbuf, CONSOLE_BUF);
+		if (n > 0)
+			inlen = n;
+		else if (n == 0)
+			eof = 1;
+		return;
+	}
+
+	if (insock) {
+		n = recv(0, inbuf, CONSOLE_BUF, MSG_DONTWAIT);
+		if (n < 0 && errno == EAGAIN)
+			return;
+	} else {
+		FD_ZERO(&i);
+		FD_SET(0, &i);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		if (select(1, &i, NULL, NULL, &tv) == -1) {
+			if (errno == EINTR)
+				return;
+			perror("select");
+			exit(1);
+		}
+		if (!FD_ISSET(0, &i))
+			return;
+		n = read(0, inbuf, CONSOLE_BUF);
+	}
+	if (n >= 0)
+		replay_put(REPLAY_CONSOLE, inbuf, n);
+	if (n > 0)
+		inlen = n;
+	else if (n == 0)
+		eof = 1;
+	else if (n < 0 && errno != EINTR) {
+		perror("console");
+		exit(1);
+	}
+}
+
+/* Bit 0 is data waiting, bit 1 room to send. Same as check_chario() */
+unsigned int console_status(void)
+{
+	if (inptr < inlen)
+		return 3;
+	return 2;
+}
+
+/* Input has hit end of file, so stop waiting on it */
+int console_eof(void)
+{
+	return eof;
+}
+
+unsigned int console_getc(void)
+{
+	if (inptr == inlen)
+		return 0xFF;
+	return inbuf[inptr++];
+}
+
+static void console_match(struct watch *w, uint8_t c)
+{
+	while (w->pos && w->text[w->pos] != c)
+		w->pos = w->fail[w->pos - 1];
+	if (w->text[w->pos] == c)
+		w->pos++;
+	if (w->pos == w->len) {
+		w->seen = 1;
+		w->pos = w->fail[w->pos - 1];
+	}
+}
+
+void console_putc(uint8_t c)
+{
+	unsigned int i;
+
+	if (watching) {
+		for (i = 0; i < CONSOLE_WATCHES; i++)
+			if (watch[i].len)
+				console_match(&watch[i], c);
+	}
+	if (!buffered) {
+		console_write(&c, 1);
+		return;
+	}
+	outbuf[outlen++] = c;
+	if (c == '\n' || outlen == CONSOLE_BUF)
+		console_flush();
+}
+
+/* Look for a string in the output from now on. NULL stops looking */
+void console_watch(unsigned int n, const char *pattern)
+{
+	struct watch *w = &watch[n];
+	unsigned int i, k = 0;
+
+	if (w->len)
+		watching--;
+	w->len = 0;
+	w->pos = 0;
+	w->seen = 0;
+	if (pattern == NULL || *pattern == 0)
+		return;
+	w->len = strlen(pattern);
+	if (w->len > WATCH_LEN) {
+		fprintf(stderr, "console: pattern too long.\n");
+		exit(1);
+	}
+	memcpy(w->text, pattern, w->len);
+	/* Where to restart after a mismatch so overlaps are not missed */
+	w->fail[0] = 0;
+	for (i = 1; i < w->len; i++) {
+		while (k && w->text[i] != w->text[k])
+			k = w->fail[k - 1];
+		if (w->text[i] == w->text[k])
+			k++;
+		w->fail[i] = k;
+	}
+	watching++;
+}
+
+/* True once if the pattern has turned up since the last call */
+int console_seen(unsigned int n)
+{
+	int r = watch[n].seen;
+	watch[n].seen = 0;
+	return r;
+}
+
+/* Throw away pending input and output and any end of file, for when
+   stdin and stdout have been replaced */
+void console_reset(void)
+{
+	inptr = 0;
+	inlen = 0;
+	outlen = 0;
+	eof = 0;
+	console_insock();
+}
+
+/* The board's emulated time in milliseconds, for script delays */
+void console_clock(uint64_t ms)
+{
+	script_clock = ms;
+}
+
+/* Turn C style escapes into bytes. Returns the length */
+static unsigned int script_unescape(char *p)
+{
+	uint8_t *o = (uint8_t *)p;
+	uint8_t *start = o;
+	unsigned int v;
+	int n;
+
+	while (*p) {
+		if (*p != '\\' || p[1] == 0) {
+			*o++ = *p++;
+			continue;
+		}
+		p++;
+		switch (*p) {
+		case 'r':
+			*o++ = '\r';
+			break;
+		case 'n':
+			*o++ = '\n';
+			break;
+		case 't':
+			*o++ = '\t';
+			break;
+		case 'e':
+			*o++ = 0x1B;
+			break;
+		case 'x':
+			if (sscanf(p + 1, "%2x%n", &v, &n) == 1) {
+				*o++ = v;
+				p += n;
+				break;
+			}
+			/* Fall through */
+		default:
+			*o++ = *p;
+		}
+		p++;
+	}
+	*o = 0;
+	return o - start;
+}
+
+/* Add a command to the script with its text unescaped */
+static struct script_cmd *script_add(unsigned int op, const char *text)
+{
+	struct script_cmd *c;
+
+	script = realloc(script, (script_len + 1) * sizeof(struct script_cmd));
+	if (script == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	c = &script[script_len++];
+	memset(c, 0, sizeof(*c));
+	c->op = op;
+	c->text = malloc(strlen(text) + 2);
+	if (c->text == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	strcpy((char *)c->text, text);
+	c->len = script_unescape((char *)c->text);
+	return c;
+}
+
+/*
+ *	Take input from a script rather than stdin. Each line is one of
+ *
+ *	send text	send the text
+ *	line text	send the text and a carriage return
+ *	wait text	wait until the guest prints the text
+ *	delay ms	wait for that much emulated time
+ *	prompt text	wait for the text before each send or line from
+ *			here on, or stop doing so if there is no text
+ *
+ *	Text may use \r \n \t \e \\ and \xNN. Blank lines and lines
+ *	starting with # are ignored.
+ */
+void console_script(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char buf[1024];
+	char prompt[1024];
+	unsigned int lineno = 0;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	*prompt = 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		struct script_cmd *c;
+		char *arg;
+		size_t l = strlen(buf);
+
+		lineno++;
+		while (l && (buf[l - 1] == '\n' || buf[l - 1] == '\r'))
+			buf[--l] = 0;
+		if (*buf == 0 || *buf == '#')
+			continue;
+		arg = strchr(buf, ' ');
+		if (arg)
+			*arg++ = 0;
+		else
+			arg = buf + l;
+
+		if (strcmp(buf, "prompt") == 0) {
+			strcpy(prompt, arg);
+			continue;
+		}
+		if (strcmp(buf, "send") == 0 || strcmp(buf, "line") == 0) {
+			if (*prompt)
+				script_add(S_WAIT, prompt);
+			c = script_add(S_SEND, arg);
+			if (buf[0] == 'l')
+				c->text[c->len++] = '\r';
+		} else if (strcmp(buf, "wait") == 0 && *arg)
+			script_add(S_WAIT, arg);
+		else if (strcmp(buf, "delay") == 0) {
+			c = script_add(S_DELAY, arg);
+			c->ms = strtoul(arg, NULL, 0);
+		} else {
+			fprintf(stderr, "%s:%u: bad script line.\n", path, lineno);
+			exit(1);
+		}
+	}
+	fclose(fp);
+	scripted = 1;
+	script_pc = 0;
+	script_arm();
+}
@@ -0,0 +1,29 @@
+#ifndef __CONSOLE_H
+#define __CONSOLE_H
+
+#include <stdint.h>
+
+/*
+ *	Buffered host console shared by the serial models. Until a board
+ *	calls console_init() output is written straight through so boards
+ *	that do not call console_tick() behave as before.
+ */
+
+extern void console_init(void);
+extern void console_tick(void);
+extern unsigned int console_status(void);
+extern unsigned int console_getc(void);
+extern int console_eof(void);
+extern void console_putc(uint8_t c);
+extern void console_flush(void);
+/* Output watchers. Slot 0 is used by input scripts */
+#define CONSOLE_WATCHES		4
+#define CONSOLE_WATCH_SCRIPT	0
+
+extern void console_watch(unsigned int n, const char *pattern);
+extern int console_seen(unsigned int n);
+extern void console_reset(void);
+extern void console_script(const char *path);
+extern void console_clock(uint64_t ms);
+
+#endif
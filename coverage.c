@@ -0,0 +1,96 @@
+/*
+ *	Guest code coverage bitmap
+ *
+ *	The file is "RCCV", the number of addresses covered and then the
+ *	bitmap, bit n of byte n / 8 standing for address n, with the count
+ *	in host byte order. A file that doesn't match is replaced rather
+ *	than merged.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "coverage.h"
+
+struct coverage_header {
+	uint8_t magic[4];
+	uint32_t addresses;
+};
+
+static uint8_t *map;
+static uint32_t map_len;
+static uint32_t map_addresses;
+static const char *map_path;
+
+static void coverage_exit(void)
+{
+	if (coverage_write())
+		perror(map_path);
+}
+
+uint8_t *coverage_create(uint32_t addresses, const char *path)
+{
+	map_len = (addresses + 7) / 8;
+	map_addresses = addresses;
+	map_path = path;
+	map = calloc(map_len, 1);
+	if (map == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	atexit(coverage_exit);
+	return map;
+}
+
+/* Fold in what an earlier run saw */
+static void coverage_merge(int fd)
+{
+	struct coverage_header h;
+	uint8_t buf[4096];
+	uint32_t pos = 0;
+	ssize_t n;
+	ssize_t i;
+
+	if (read(fd, &h, sizeof(h)) != sizeof(h) ||
+	    memcmp(h.magic, "RCCV", 4) || h.addresses != map_addresses)
+		return;
+	while (pos < map_len && (n = read(fd, buf, sizeof(buf))) > 0) {
+		if (n > map_len - pos)
+			n = map_len - pos;
+		for (i = 0; i < n; i++)
+			map[pos++] |= buf[i];
+	}
+}
+
+int coverage_write(void)
+{
+	struct coverage_header h;
+	uint32_t pos = 0;
+	ssize_t n;
+	int fd;
+
+	if (map == NULL)
+		return 0;
+	fd = open(map_path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		return -1;
+	coverage_merge(fd);
+	memcpy(h.magic, "RCCV", 4);
+	h.addresses = map_addresses;
+	if (lseek(fd, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1 ||
+	    write(fd, &h, sizeof(h)) != sizeof(h))
+		goto bad;
+	while (pos < map_len) {
+		n = write(fd, map + pos, map_len - pos);
+		if (n <= 0)
+			goto bad;
+		pos += n;
+	}
+	return close(fd);
+bad:
+	close(fd);
+	return -1;
+}
@@ -0,0 +1,20 @@
+#ifndef __COVERAGE_H
+#define __COVERAGE_H
+
+#include <stdint.h>
+
+/*
+ *	Guest code coverage. One bit per address, set by the CPU core or
+ *	board on each instruction fetch. The bitmap is written at exit and
+ *	ORed into any existing file of the same size, so runs accumulate.
+ */
+
+extern uint8_t *coverage_create(uint32_t addresses, const char *path);
+extern int coverage_write(void);
+
+static inline void coverage_mark(uint8_t *map, uint32_t addr)
+{
+	map[addr >> 3] |= 1 << (addr & 7);
+}
+
+#endif
@@ -0,0 +1,485 @@
+/*
+ *	Copy on write block overlays for disk images
+ *
+ *	The delta file is a 512 byte header, a bitmap with one bit per 512
+ *	byte block of the base image, and then a sparse copy of the image
+ *	holding only the blocks that have been written. A new delta is just
+ *	the header and an empty bitmap so many instances can share one base
+ *	image for the cost of a few kilobytes each.
+ *
+ *	The header is in host byte order. Deltas are per instance scratch
+ *	rather than something to move between machines.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "cow.h"
+
+#define COW_BLOCK	512
+
+static const uint8_t cow_magic[8] = {
+	'R', 'C', 'C', 'O', 'W', 'D', 'L', '1'
+};
+
+struct cow_header {
+	uint8_t magic[8];
+	uint32_t blocksize;
+	uint32_t unused;
+	uint64_t nblocks;
+	uint64_t size;		/* Size of the base image it was made from */
+};
+
+struct cow {
+	int fd;			/* Base image, also the handle we give out */
+	int dfd;		/* Delta file */
+	off_t size;
+	uint64_t nblocks;
+	uint8_t *bitmap;
+	off_t data_off;
+	struct cow *below;	/* Overlay we were stacked on, if any */
+	struct cow *next;
+};
+
+static struct cow *cow_list;
+
+static struct cow *cow_find(int fd)
+{
+	struct cow *c = cow_list;
+	while (c) {
+		if (c->fd == fd)
+			return c;
+		c = c->next;
+	}
+	return NULL;
+}
+
+static int cow_present(struct cow *c, uint64_t b)
+{
+	return c->bitmap[b >> 3] & (1 << (b & 7));
+}
+
+/* A spec is an overlay if it isn't itself a file and the part before
+   the last colon is */
+static char *cow_split(const char *spec)
+{
+	char *base;
+	char *p;
+
+	if (access(spec, F_OK) == 0 || strchr(spec, ':') == NULL)
+		return NULL;
+	base = strdup(spec);
+	if (base == NULL)
+		return NULL;
+	p = strrchr(base, ':');
+	*p = 0;
+	if (p[1] == 0 || access(base, F_OK)) {
+		free(base);
+		return NULL;
+	}
+	return base;
+}
+
+static int cow_load(struct cow *c, const char *delta)
+{
+	struct cow_header h;
+	off_t bitmap_len = (c->nblocks + 7) / 8;
+	struct stat st;
+
+	if (fstat(c->dfd, &st) == -1)
+		return -1;
+	c->data_off = COW_BLOCK + (bitmap_len + COW_BLOCK - 1) / COW_BLOCK * COW_BLOCK;
+	c->bitmap = calloc(1, bitmap_len);
+	if (c->bitmap == NULL)
+		return -1;
+
+	if (st.st_size == 0) {
+		/* New delta: the data area is a hole until written */
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, cow_magic, 8);
+		h.blocksize = COW_BLOCK;
+		h.nblocks = c->nblocks;
+		h.size = c->size;
+		if (pwrite(c->dfd, &h, sizeof(h), 0) != sizeof(h) ||
+		    ftruncate(c->dfd, c->data_off + c->nblocks * COW_BLOCK) == -1)
+			return -1;
+		return 0;
+	}
+	if (pread(c->dfd, &h, sizeof(h), 0) != sizeof(h) ||
+	    memcmp(h.magic, cow_magic, 8) || h.blocksize != COW_BLOCK) {
+		fprintf(stderr, "%s: not an overlay file.\n", delta);
+		errno = EINVAL;
+		return -1;
+	}
+	if (h.nblocks != c->nblocks || h.size != c->size) {
+		fprintf(stderr, "%s: overlay does not match its base image.\n", delta);
+		errno = EINVAL;
+		return -1;
+	}
+	if (pread(c->dfd, c->bitmap, bitmap_len, COW_BLOCK) != bitmap_len)
+		return -1;
+	return 0;
+}
+
+/*
+ *	Open a disk image, or a base:delta overlay pair. Returns an fd in
+ *	the manner of open(2).
+ */
+int cow_open(const char *spec, int flags)
+{
+	struct cow *c;
+	struct stat st;
+	char *base = cow_split(spec);
+	const char *delta;
+	int err;
+
+	if (base == NULL)
+		return open(spec, flags);
+	delta = base + strlen(base) + 1;
+
+	c = calloc(1, sizeof(struct cow));
+	if (c == NULL) {
+		free(base);
+		errno = ENOMEM;
+		return -1;
+	}
+	c->dfd = -1;
+	c->fd = open(base, O_RDONLY);
+	if (c->fd == -1 || fstat(c->fd, &st) == -1)
+		goto fail;
+	c->size = st.st_size;
+	c->nblocks = (c->size + COW_BLOCK - 1) / COW_BLOCK;
+	if ((flags & O_ACCMODE) == O_RDONLY)
+		c->dfd = open(delta, O_RDONLY);
+	else
+		c->dfd = open(delta, O_RDWR|O_CREAT, 0666);
+	if (c->dfd == -1 || cow_load(c, delta) == -1)
+		goto fail;
+	free(base);
+	c->next = cow_list;
+	cow_list = c;
+	return c->fd;
+fail:
+	err = errno;
+	if (c->fd != -1)
+		close(c->fd);
+	if (c->dfd != -1)
+		close(c->dfd);
+	free(c->bitmap);
+	free(c);
+	free(base);
+	errno = err;
+	return -1;
+}
+
+/* Read in runs so that a stretch of blocks from one file is one call */
+static ssize_t cow_read(struct cow *c, uint8_t *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+
+	if (off >= c->size)
+		return 0;
+	if (off + len > c->size)
+		len = c->size - off;
+	while (done < len) {
+		off_t pos = off + done;
+		off_t end = (pos / COW_BLOCK + 1) * COW_BLOCK;
+		int in = cow_present(c, pos / COW_BLOCK);
+		ssize_t r;
+
+		while (end < off + len && !cow_present(c, end / COW_BLOCK) == !in)
+			end += COW_BLOCK;
+		if (end > off + len)
+			end = off + len;
+		if (in)
+			r = pread(c->dfd, buf + done, end - pos, c->data_off + pos);
+		else if (c->below)
+			r = cow_read(c->below, buf + done, end - pos, pos);
+		else
+			r = pread(c->fd, buf + done, end - pos, pos);
+		if (r == -1)
+			return done ? done : -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static int cow_mark(struct cow *c, uint64_t first, uint64_t last)
+{
+	uint64_t b;
+	int dirty = 0;
+
+	for (b = first; b <= last; b++) {
+		if (!cow_present(c, b)) {
+			c->bitmap[b >> 3] |= 1 << (b & 7);
+			dirty = 1;
+		}
+	}
+	if (!dirty)
+		return 0;
+	/* Data was written first so a crash loses the write, not the disk */
+	first >>= 3;
+	last >>= 3;
+	if (pwrite(c->dfd, c->bitmap + first, last - first + 1, COW_BLOCK + first) != last - first + 1)
+		return -1;
+	return 0;
+}
+
+static ssize_t cow_write(struct cow *c, const uint8_t *buf, size_t len, off_t off)
+{
+	uint8_t tmp[COW_BLOCK];
+	size_t done = 0;
+
+	/* The image can't grow */
+	if (off + len > c->size) {
+		if (off >= c->size) {
+			errno = ENOSPC;
+			return -1;
+		}
+		len = c->size - off;
+	}
+	while (done < len) {
+		off_t pos = off + done;
+		uint64_t b = pos / COW_BLOCK;
+		size_t n;
+		ssize_t r;
+
+		if (pos % COW_BLOCK || len - done < COW_BLOCK) {
+			/* Partial block: merge it with the current contents */
+			unsigned int boff = pos % COW_BLOCK;
+			n = COW_BLOCK - boff;
+			if (n > len - done)
+				n = len - done;
+			memset(tmp, 0, COW_BLOCK);
+			if (cow_read(c, tmp, COW_BLOCK, b * COW_BLOCK) == -1)
+				return done ? done : -1;
+			memcpy(tmp + boff, buf + done, n);
+			r = pwrite(c->dfd, tmp, COW_BLOCK, c->data_off + b * COW_BLOCK);
+			if (r != COW_BLOCK)
+				return done ? done : -1;
+		} else {
+			n = (len - done) & ~(COW_BLOCK - 1);
+			r = pwrite(c->dfd, buf + done, n, c->data_off + pos);
+			if (r == -1)
+				return done ? done : -1;
+			n = r & ~(COW_BLOCK - 1);
+			if (n == 0)
+				return done;
+		}
+		if (cow_mark(c, b, (pos + n - 1) / COW_BLOCK) == -1)
+			return done ? done : -1;
+		done += n;
+	}
+	return done;
+}
+
+ssize_t cow_pread(int fd, void *buf, size_t len, off_t off)
+{
+	struct cow *c = cow_find(fd);
+	if (c == NULL)
+		return pread(fd, buf, len, off);
+	return cow_read(c, buf, len, off);
+}
+
+ssize_t cow_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	struct cow *c = cow_find(fd);
+	if (c == NULL)
+		return pwrite(fd, buf, len, off);
+	return cow_write(c, buf, len, off);
+}
+
+off_t cow_size(int fd)
+{
+	struct cow *c = cow_find(fd);
+	struct stat st;
+
+	if (c)
+		return c->size;
+	if (fstat(fd, &st) == -1)
+		return -1;
+	return st.st_size;
+}
+
+/* True if writes to this fd do not reach the file it was opened on */
+int cow_overlay(int fd)
+{
+	return cow_find(fd) != NULL;
+}
+
+int cow_sync(int fd)
+{
+	struct cow *c = cow_find(fd);
+	if (c)
+		return fdatasync(c->dfd);
+	return fdatasync(fd);
+}
+
+/*
+ *	Send all further writes to an open image into a new delta. If the
+ *	image is already an overlay the new one is stacked on top, and the
+ *	old delta is only read from then on. This lets a process that forks
+ *	give each child its own copy of a disk the parent has been using.
+ */
+int cow_redirect(int fd, const char *delta)
+{
+	struct cow *below = cow_find(fd);
+	struct cow *c;
+	struct stat st;
+
+	c = calloc(1, sizeof(struct cow));
+	if (c == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	c->dfd = -1;
+	c->fd = fd;
+	c->below = below;
+	if (below)
+		c->size = below->size;
+	else if (fstat(fd, &st) == -1)
+		goto fail;
+	else
+		c->size = st.st_size;
+	c->nblocks = (c->size + COW_BLOCK - 1) / COW_BLOCK;
+	/* Always a fresh delta as it holds no record of what it sits on */
+	c->dfd = open(delta, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (c->dfd == -1 || cow_load(c, delta) == -1)
+		goto fail;
+	c->next = cow_list;
+	cow_list = c;
+	return 0;
+fail:
+	if (c->dfd != -1)
+		close(c->dfd);
+	free(c->bitmap);
+	free(c);
+	return -1;
+}
+
+int cow_close(int fd)
+{
+	struct cow **p = &cow_list;
+	struct cow *c;
+
+	/* Stacked overlays share the fd so take them all */
+	while ((c = *p) != NULL) {
+		if (c->fd == fd) {
+			*p = c->next;
+			close(c->dfd);
+			free(c->bitmap);
+			free(c);
+			continue;
+		}
+		p = &c->next;
+	}
+	return close(fd);
+}
+
+/*
+ *	stdio access for code such as lib765 that wants a FILE. Plain paths
+ *	are just fopen so there is no change in behaviour for them.
+ */
+
+struct cow_stream {
+	int fd;
+	off_t pos;
+};
+
+static ssize_t cow_stream_read(void *cookie, char *buf, size_t len)
+{
+	struct cow_stream *s = cookie;
+	ssize_t r = cow_pread(s->fd, buf, len, s->pos);
+	if (r > 0)
+		s->pos += r;
+	return r;
+}
+
+static ssize_t cow_stream_write(void *cookie, const char *buf, size_t len)
+{
+	struct cow_stream *s = cookie;
+	ssize_t r = cow_pwrite(s->fd, buf, len, s->pos);
+	if (r <= 0)
+		return 0;
+	s->pos += r;
+	return r;
+}
+
+static int cow_stream_seek(void *cookie, off64_t *off, int whence)
+{
+	struct cow_stream *s = cookie;
+	off_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = *off;
+		break;
+	case SEEK_CUR:
+		pos = s->pos + *off;
+		break;
+	case SEEK_END:
+		pos = cow_size(s->fd) + *off;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	s->pos = pos;
+	*off = pos;
+	return 0;
+}
+
+static int cow_stream_close(void *cookie)
+{
+	struct cow_stream *s = cookie;
+	int r = cow_close(s->fd);
+	free(s);
+	return r;
+}
+
+FILE *cow_fopen(const char *spec, const char *mode)
+{
+	static const cookie_io_functions_t cow_stream_ops = {
+		cow_stream_read,
+		cow_stream_write,
+		cow_stream_seek,
+		cow_stream_close
+	};
+	struct cow_stream *s;
+	char *base = cow_split(spec);
+	FILE *fp;
+
+	if (base == NULL)
+		return fopen(spec, mode);
+	free(base);
+	/* No truncate or append on an overlay */
+	if (*mode != 'r') {
+		errno = EINVAL;
+		return NULL;
+	}
+	s = malloc(sizeof(struct cow_stream));
+	if (s == NULL)
+		return NULL;
+	s->pos = 0;
+	s->fd = cow_open(spec, strchr(mode, '+') ? O_RDWR : O_RDONLY);
+	if (s->fd == -1) {
+		free(s);
+		return NULL;
+	}
+	fp = fopencookie(s, mode, cow_stream_ops);
+	if (fp == NULL)
+		cow_stream_close(s);
+	return fp;
+}
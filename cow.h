@@ -0,0 +1,26 @@
+#ifndef __COW_H
+#define __COW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ *	Copy on write disk overlays. A path of the form base:delta opens the
+ *	base image read only and keeps every write in the delta file, which
+ *	is created empty if it does not exist. Anything else is opened as a
+ *	normal file. The returned fd must then be used with the cow_ calls,
+ *	which pass straight through to pread/pwrite for a plain file.
+ */
+
+extern int cow_open(const char *spec, int flags);
+extern ssize_t cow_pread(int fd, void *buf, size_t len, off_t off);
+extern ssize_t cow_pwrite(int fd, const void *buf, size_t len, off_t off);
+extern off_t cow_size(int fd);
+extern int cow_overlay(int fd);
+extern int cow_sync(int fd);
+extern int cow_redirect(int fd, const char *delta);
+extern int cow_close(int fd);
+extern FILE *cow_fopen(const char *spec, const char *mode);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ *	CPU clock rate and slice budgeting
+ *
+ *	The budget for a slice is hz / rate plus one more whenever the
+ *	carried remainder comes round, so no cycles are lost to rounding
+ *	however long the board runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpuclock.h"
+
+/* Up to 1GHz, to the nearest Hz */
+unsigned long cpuclock_parse(const char *mhz)
+{
+    char *end;
+    double v = strtod(mhz, &end);
+
+    if (end == mhz || *end || v < 0.001 || v > 1000.0) {
+        fprintf(stderr, "%s: clock should be in MHz.\n", mhz);
+        exit(1);
+    }
+    return (unsigned long)(v * 1000000.0 + 0.5);
+}
+
+void cpuclock_init(struct cpuclock *c, unsigned long hz, unsigned int rate)
+{
+    c->hz = hz;
+    c->rate = rate;
+    c->frac = 0;
+    c->over = 0;
+}
+
+/* Cycles to run this slice */
+unsigned int cpuclock_slice(struct cpuclock *c)
+{
+    unsigned int n = c->hz / c->rate;
+
+    c->frac += c->hz % c->rate;
+    if (c->frac >= c->rate) {
+        c->frac -= c->rate;
+        n++;
+    }
+    if (c->over >= n) {
+        c->over -= n;
+        return 0;
+    }
+    n -= c->over;
+    c->over = 0;
+    return n;
+}
+
+/* What the CPU actually did with a slice it was asked to run */
+void cpuclock_ran(struct cpuclock *c, unsigned int asked, unsigned int ran)
+{
+    if (ran > asked)
+        c->over += ran - asked;
+}
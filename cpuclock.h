@@ -0,0 +1,25 @@
+#ifndef __CPUCLOCK_H
+#define __CPUCLOCK_H
+
+/*
+ *	CPU clock rate as given with -X MHz. The main loops run the CPU in
+ *	a fixed number of slices a second, and a clock that doesn't divide
+ *	evenly into them carries the remainder from slice to slice so each
+ *	second gets exactly the clock's worth of cycles. A CPU core that
+ *	finishes past the end of its slice reports what it ran and the
+ *	overrun comes off the next one.
+ */
+
+struct cpuclock {
+    unsigned long hz;		/* CPU clock */
+    unsigned int rate;		/* Slices per second */
+    unsigned int frac;		/* Remainder carried, in 1/rate cycles */
+    unsigned int over;		/* Cycles run past the last slice */
+};
+
+extern unsigned long cpuclock_parse(const char *mhz);
+extern void cpuclock_init(struct cpuclock *c, unsigned long hz, unsigned int rate);
+extern unsigned int cpuclock_slice(struct cpuclock *c);
+extern void cpuclock_ran(struct cpuclock *c, unsigned int asked, unsigned int ran);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ *	Execution trace ring buffer
+ *
+ *	The size is rounded up to a power of two so the write position is a
+ *	mask rather than a compare. A dump is a header of "RCTR", the CPU
+ *	type, record size and count, then the records oldest first, in host
+ *	byte order. Dumping only uses open, write and close so it is safe
+ *	from a signal handler.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "cputrace.h"
+
+struct cputrace {
+	struct cputrace_rec *rec;
+	unsigned int mask;
+	unsigned int next;
+	uint64_t total;
+	uint32_t cpu;
+};
+
+struct cputrace_header {
+	uint8_t magic[4];
+	uint32_t cpu;
+	uint32_t size;
+	uint32_t count;
+};
+
+struct cputrace *cputrace_create(unsigned int cpu, unsigned int records)
+{
+	struct cputrace *t = calloc(1, sizeof(struct cputrace));
+	unsigned int n = 1;
+
+	while (n < records && n < 0x80000000U)
+		n <<= 1;
+	if (t)
+		t->rec = calloc(n, sizeof(struct cputrace_rec));
+	if (t == NULL || t->rec == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	t->mask = n - 1;
+	t->cpu = cpu;
+	return t;
+}
+
+/* The record for the instruction about to run */
+struct cputrace_rec *cputrace_next(struct cputrace *t)
+{
+	t->total++;
+	return t->rec + (t->next++ & t->mask);
+}
+
+static int cputrace_write(int fd, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, b, len);
+		if (r <= 0)
+			return -1;
+		b += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int cputrace_dump(struct cputrace *t, const char *path)
+{
+	struct cputrace_header h;
+	size_t n = t->mask + 1;
+	size_t start = t->next & t->mask;
+	int fd, err;
+
+	memcpy(h.magic, "RCTR", 4);
+	h.cpu = t->cpu;
+	h.size = sizeof(struct cputrace_rec);
+	h.count = t->total < n ? t->total : n;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return -1;
+	err = cputrace_write(fd, &h, sizeof(h));
+	/* Once it has wrapped the oldest record is at the write position */
+	if (err == 0 && t->total >= n)
+		err = cputrace_write(fd, t->rec + start,
+			(n - start) * sizeof(struct cputrace_rec));
+	if (err == 0)
+		err = cputrace_write(fd, t->rec,
+			(t->total < n ? t->total : start) * sizeof(struct cputrace_rec));
+	if (close(fd))
+		err = -1;
+	return err;
+}
+
+void cputrace_free(struct cputrace *t)
+{
+	free(t->rec);
+	free(t);
+}
@@ -0,0 +1,33 @@
+#ifndef __CPUTRACE_H
+#define __CPUTRACE_H
+
+#include <stdint.h>
+
+/*
+ *	Execution trace ring. The CPU core fills in one fixed size record
+ *	per instruction and only when the ring is dumped does anything get
+ *	formatted, by tracedump reading the file later. That makes it cheap
+ *	enough to leave running and see what led up to a wedge or crash.
+ */
+
+#define CPUTRACE_Z80	1
+#define CPUTRACE_6502	2
+
+#define CPUTRACE_RECORDS	65536
+
+struct cputrace_rec {
+	uint64_t tstate;
+	uint16_t pc;
+	uint8_t len;		/* Bytes of op that are valid */
+	uint8_t op[5];
+	uint16_t reg[8];	/* AF BC DE HL IX IY SP or A X Y S P */
+};
+
+struct cputrace;
+
+extern struct cputrace *cputrace_create(unsigned int cpu, unsigned int records);
+extern struct cputrace_rec *cputrace_next(struct cputrace *t);
+extern int cputrace_dump(struct cputrace *t, const char *path);
+extern void cputrace_free(struct cputrace *t);
+
+#endif
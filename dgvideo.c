@@ -397,6 +397,10 @@ struct dgvideo {
 	uint8_t ptr;
 	uint8_t mem[256];	/* 6bit wide */
 	uint8_t last;
+	/* Changes since the last rasterize */
+	uint32_t dirty[8];	/* Characters to redraw, by character row */
+	uint32_t noisemap[128];	/* Noise bytes pending, by scan line */
+	uint8_t noise[128][32];
 	uint32_t raster[128 * 256];
 };
 
@@ -429,6 +433,7 @@ static void dg_raster(struct dgvideo *dg, unsigned int byte)
 void dgvideo_write(struct dgvideo *dg, uint8_t val)
 {
 	dg->mem[dg->ptr] = val & 0x7F;
+	dg->dirty[dg->ptr >> 5] |= 1U << (dg->ptr & 0x1F);
 	if (val == 0xFF) {
 		dg->ptr = 0xFF;
 	}
@@ -448,13 +453,8 @@ void dgvideo_noise(struct dgvideo *dg, unsigned int cycles, uint8_t val)
 	   the 38 machine clocks into 64us, the first 6.2 and last 4.5 of which
 	   are skipped and vertically on lines 1-21 or so */
 	unsigned int line = cycles / 38;
-	unsigned int p;
-	unsigned int x;
-	uint8_t byte;
-	uint32_t *rp;
 	if (line < 20)
 		return;
-	printf("cycle %d line %d\n", cycles, line);
 	cycles -= 21 * 38;
 	cycles %= 38;
 	if (cycles < 3 || cycles >= 35)
@@ -468,26 +468,51 @@ void dgvideo_noise(struct dgvideo *dg, unsigned int cycles, uint8_t val)
 	if (line > 127)
 		return;
 
-	/* Now it's a horizontal byte for that line */
-	for (p = 0; p < 1; p++) {
-		rp = dg->raster + 256 * line + 8 * cycles;
-		byte = val;
-		for (x = 0; x < 8; x++) {
-			if (byte & 0x80)
-				*rp++ = 0xFFAAAAAA;
-			else
-				*rp++ = 0xFF222222;
-			byte <<= 1;
-		}
-		cycles++;
+	/* Now it's a horizontal byte for that line. Just log it, it gets
+	   drawn when we next rasterize */
+	dg->noise[line][cycles] = val;
+	dg->noisemap[line] |= 1U << cycles;
+}
+
+static void dg_noise(struct dgvideo *dg, unsigned int line, unsigned int col)
+{
+	uint32_t *rp = dg->raster + 256 * line + 8 * col;
+	uint8_t byte = dg->noise[line][col];
+	unsigned int x;
+
+	for (x = 0; x < 8; x++) {
+		if (byte & 0x80)
+			*rp++ = 0xFFAAAAAA;
+		else
+			*rp++ = 0xFF222222;
+		byte <<= 1;
 	}
 }
 
+/* Apply everything logged since the last call. Characters are redrawn
+   first and any noise goes on top. The characters under the noise are
+   marked so the next pass cleans it up again */
 void dgvideo_rasterize(struct dgvideo *dg)
 {
-	unsigned int i;
-	for (i = 0; i < 256; i++) {
-		dg_raster(dg, i);
+	unsigned int r, i;
+	uint32_t bits;
+
+	for (r = 0; r < 8; r++) {
+		bits = dg->dirty[r];
+		dg->dirty[r] = 0;
+		for (i = 0; bits; i++, bits >>= 1)
+			if (bits & 1)
+				dg_raster(dg, (r << 5) | i);
+	}
+	for (r = 0; r < 128; r++) {
+		bits = dg->noisemap[r];
+		if (bits == 0)
+			continue;
+		dg->noisemap[r] = 0;
+		dg->dirty[r >> 4] |= bits;
+		for (i = 0; bits; i++, bits >>= 1)
+			if (bits & 1)
+				dg_noise(dg, r, i);
 	}
 }
 
@@ -500,6 +525,8 @@ struct dgvideo *dgvideo_create(void)
 	}
 	dg->ptr = 0;
 	memset(dg->mem, 'A', 256);
+	memset(dg->dirty, 0xFF, sizeof(dg->dirty));
+	memset(dg->noisemap, 0, sizeof(dg->noisemap));
 	dgvideo_rasterize(dg);
 	return dg;
 }
@@ -511,5 +538,6 @@ void dgvideo_free(struct dgvideo *dg)
 
 uint32_t *dgvideo_get_raster(struct dgvideo *dg)
 {
+	dgvideo_rasterize(dg);
 	return dg->raster;
 }
@@ -9,18 +9,23 @@
 
 #include "dgvideo.h"
 #include "dgvideo_render.h"
+#include "framestream.h"
 
 struct dgvideo_renderer {
     struct dgvideo *dg;
+    struct framestream *stream;
 };
     
 
 void dgvideo_render(struct dgvideo_renderer *render)
 {
+    if (render->stream)
+        framestream_frame(render->stream, dgvideo_get_raster(render->dg));
 }
 
 void dgvideo_renderer_free(struct dgvideo_renderer *render)
 {
+    framestream_free(render->stream);
     free(render);
 }
 
@@ -36,5 +41,6 @@ struct dgvideo_renderer *dgvideo_renderer_create(struct dgvideo *dg)
     }
     memset(render, 0, sizeof(struct dgvideo_renderer));
     render->dg = dg;
+    render->stream = framestream_create("DGVIDEO_STREAM", 256, 128);
     return render;
 }
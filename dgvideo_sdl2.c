@@ -6,35 +6,30 @@
 
 #include "dgvideo.h"
 #include "dgvideo_render.h"
-
-extern int sdl_live;
+#include "sdl2_texture.h"
 
 struct dgvideo_renderer {
     struct dgvideo *dg;
-    SDL_Renderer *render;
-    SDL_Texture *texture;
-    SDL_Window *window;
+    struct sdltex *stream;
 };
 
 void dgvideo_render(struct dgvideo_renderer *render)
 {
-    SDL_Rect sr;
+    uint32_t *raster;
 
-    sr.x = 0;
-    sr.y = 0;
-    sr.w = 256;
-    sr.h = 128;
+    /* The changes wait in the dirty map until someone can see them */
+    if (!sdltex_visible(render->stream))
+        return;
+    raster = dgvideo_get_raster(render->dg);
 
-    SDL_UpdateTexture(render->texture, NULL, dgvideo_get_raster(render->dg), 1024);
-    SDL_RenderClear(render->render);
-    SDL_RenderCopy(render->render, render->texture, NULL, &sr);
-    SDL_RenderPresent(render->render);
+    sdltex_compare(render->stream, raster);
+    sdltex_present(render->stream, raster);
 }
 
 void dgvideo_renderer_free(struct dgvideo_renderer *render)
 {
-    if (render->texture)
-        SDL_DestroyTexture(render->texture);
+    if (render->stream)
+        sdltex_free(render->stream);
     free(render);
 }
 
@@ -42,17 +37,6 @@ struct dgvideo_renderer *dgvideo_renderer_create(struct dgvideo *dg)
 {
     struct dgvideo_renderer *render;
 
-    /* We will need a nicer way to do this once we have multiple SDL using
-       devices */
-    if (sdl_live == 0) {
-        sdl_live = 1;
-        if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-            fprintf(stderr, "SDL init failed: %s.\n", SDL_GetError());
-            exit(1);
-        }
-        atexit(SDL_Quit);
-    }
-
     render = malloc(sizeof(struct dgvideo_renderer));
     if (render == NULL) {
         fprintf(stderr, "Out of memory.\n");
@@ -60,33 +44,6 @@ struct dgvideo_renderer *dgvideo_renderer_create(struct dgvideo *dg)
     }
     memset(render, 0, sizeof(struct dgvideo_renderer));
     render->dg = dg;
-    render->window = SDL_CreateWindow("DGVideo",
-        SDL_WINDOWPOS_UNDEFINED,
-        SDL_WINDOWPOS_UNDEFINED,
-        768, 384,
-        SDL_WINDOW_RESIZABLE);
-    if (render->window == NULL) {
-        fprintf(stderr, "Unable to create window: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    render->render = SDL_CreateRenderer(render->window, -1, SDL_RENDERER_ACCELERATED);
-    if (render->render == NULL) {
-        fprintf(stderr, "Unable to create renderer: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-    SDL_RenderSetLogicalSize(render->render, 256, 128);
-
-    render->texture = SDL_CreateTexture(render->render,
-                        SDL_PIXELFORMAT_ARGB8888,
-                        SDL_TEXTUREACCESS_STREAMING,
-                        256, 128);
-    if (render->render == NULL) {
-        fprintf(stderr, "Unable to create renderer: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    SDL_SetRenderDrawColor(render->render, 0, 0, 0, 255);
-    SDL_RenderClear(render->render);
-    SDL_RenderPresent(render->render);
+    render->stream = sdltex_create("DGVideo", 768, 384, 256, 128);
     return render;
 }
@@ -2,28 +2,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include "duart.h"
+#include "chardev.h"
+#include "console.h"
+#include "trace.h"
 
 /* 68681 DUART */
 
+#define RX_FIFO		3
+
 struct duart_port {
 	uint8_t mr1;
 	uint8_t mr2;
-	uint8_t sr;
+	uint8_t sr;		/* Error bits, the rest follow the FIFOs */
 	uint8_t csr;
-	uint8_t rx;
+	uint8_t rx;		/* Last byte read */
+	uint8_t rxfifo[RX_FIFO];
+	uint8_t rxcount;
+	uint8_t thr;		/* Transmit holding register */
+	uint8_t thr_full;
+	uint8_t tx_busy;	/* Shift register still sending */
 	uint8_t mrp;
 	uint8_t txdis;
 	uint8_t rxdis;
+	uint32_t clk;		/* X1 clocks towards the next character */
 };
 
 struct duart {
 	struct duart_port port[2];
 	uint8_t ipcr;
 	uint8_t isr;
-	int32_t ct;		/* We overflow this temporarily */
 	uint16_t ctr;
+	uint32_t ct;		/* Counts until the next terminal count */
+	uint64_t ctbase;	/* X1 clock ct was worked out at */
+	uint64_t clock;		/* X1 clocks run */
 	uint8_t ctstop;
 	uint8_t imr;
 	uint8_t ivr;
@@ -32,12 +44,21 @@ struct duart {
 	uint8_t irq;
 	int input;		/* Which port if any is console */
 	int trace;		/* Debug trace */
+	struct chardev *dev[2];	/* Host devices if attached */
+	int unthrottled;	/* Ignore the baud rate */
 };
 
+/* Only tell the board when the interrupt line actually changes */
 static void duart_irq_calc(struct duart *d)
 {
-	d->irq = d->isr & d->imr;
-	if (d->trace) {
+	uint8_t irq = d->isr & d->imr;
+
+	if (!irq == !d->irq) {
+		d->irq = irq;
+		return;
+	}
+	d->irq = irq;
+	if (TRACE_ON(d->trace)) {
 		if (d->irq)
 			fprintf(stderr, "DUART IRQ asserted.\n");
 		else
@@ -50,7 +71,7 @@ static void duart_irq_raise(struct duart *d, uint8_t m)
 {
 	if (!(d->isr & m)) {
 		d->isr |= m;
-		if (d->trace)
+		if (TRACE_ON(d->trace))
 			fprintf(stderr, "DUART IRQ raised %02X\n", m);
 		duart_irq_calc(d);
 	}
@@ -60,56 +81,132 @@ static void duart_irq_lower(struct duart *d, uint8_t m)
 {
 	if (d->isr & m) {
 		d->isr &= ~m;
-		if (d->trace)
+		if (TRACE_ON(d->trace))
 			fprintf(stderr, "DUART IRQ lowered %02X\n", m);
 		duart_irq_calc(d);
 	}
 }
 
+/* The low status bits come from the FIFO state */
+static uint8_t duart_sr(struct duart *d, int port)
+{
+	struct duart_port *p = &d->port[port];
+	uint8_t r = p->sr & 0xF0;
+
+	if (p->rxcount)
+		r |= 0x01;
+	if (p->rxcount == RX_FIFO)
+		r |= 0x02;
+	if (!p->txdis && !p->thr_full) {
+		r |= 0x04;
+		if (!p->tx_busy)
+			r |= 0x08;
+	}
+	return r;
+}
+
+/* TxRDY and RxRDY or FFULL as picked by MR1 bit 6 */
+static void duart_port_isr(struct duart *d, int port)
+{
+	uint8_t sr = duart_sr(d, port);
+	uint8_t m = 0;
+
+	if (sr & 0x04)
+		m |= 0x01;
+	if (sr & ((d->port[port].mr1 & 0x40) ? 0x02 : 0x01))
+		m |= 0x02;
+	d->isr &= ~(0x03 << (4 * port));
+	d->isr |= m << (4 * port);
+	duart_irq_calc(d);
+}
+
+static uint32_t duart_char_clocks(struct duart *d, int port);
+static int duart_rx_ready(struct duart *d, int port, unsigned int r);
+static void duart_rx(struct duart *d, int port);
+
 static uint8_t duart_input(struct duart *d, int port)
 {
-	if (d->port[port].sr & 0x01) {
-		d->port[port].sr ^= 0x01;
-		duart_irq_lower(d, 2 << (4 * port));
+	struct duart_port *p = &d->port[port];
+	uint32_t cc;
+
+	if (p->rxcount) {
+		p->rx = p->rxfifo[0];
+		p->rxcount--;
+		memmove(p->rxfifo, p->rxfifo + 1, p->rxcount);
+		duart_port_isr(d, port);
+		/* Catch up with time left over from the last tick */
+		cc = duart_char_clocks(d, port);
+		if ((d->unthrottled || p->clk >= cc) &&
+		    duart_rx_ready(d, port, check_chario())) {
+			if (!d->unthrottled)
+				p->clk -= cc;
+			duart_rx(d, port);
+		}
 	}
-	return d->port[port].rx;
+	return p->rx;
 }
 
-static void duart_output(struct duart *d, int port, int value)
+/* Move the holding register into the shifter if it is idle and the
+   host can take the byte. It is sent when it starts so the busy time
+   only shows in TxEMT */
+static void duart_tx_load(struct duart *d, int port)
 {
-	duart_irq_lower(d, 1 << (4 * port));
-	if (d->port[port].txdis)
+	struct duart_port *p = &d->port[port];
+
+	if (!p->thr_full || p->tx_busy)
 		return;
-	if (d->port[port].sr & 0x04) {
-		if (port == 0) {
-			uint8_t v = value & 0xFF;
-			write(1, &v, 1);
-		}
-		d->port[port].sr &= 0xF3;
-		duart_irq_calc(d);
+	if (d->dev[port]) {
+		if (!(chardev_status(d->dev[port]) & 2))
+			return;
+		chardev_putc(d->dev[port], p->thr);
+	} else if (port == 0) {
+		if (!(check_chario() & 2))
+			return;
+		console_putc(p->thr);
 	}
+	p->thr_full = 0;
+	p->tx_busy = !d->unthrottled;
+}
+
+static void duart_output(struct duart *d, int port, int value)
+{
+	struct duart_port *p = &d->port[port];
+
+	if (p->txdis)
+		return;
+	/* Writing a full holding register replaces the byte */
+	p->thr = value;
+	p->thr_full = 1;
+	duart_tx_load(d, port);
+	duart_port_isr(d, port);
 }
 
 static void duart_command(struct duart *d, int port, int value)
 {
+	struct duart_port *p = &d->port[port];
+
 	switch ((value & 0xE0) >> 4) {
 	case 0:
 		break;
 	case 1:
-		d->port[port].mrp = 0;
+		p->mrp = 0;
 		break;
 	case 2:
 		/* Reset RX A */
-		d->port[port].rxdis = 1;
+		p->rxdis = 1;
+		p->rxcount = 0;
 		break;
 	case 3:
+		/* Reset TX */
+		p->txdis = 1;
+		p->thr_full = 0;
+		p->tx_busy = 0;
 		break;
 	case 4:
-		d->port[port].sr &= 0x0F;
+		p->sr &= 0x0F;
 		break;
 	case 5:
 		duart_irq_lower(d, 4 << (4 * port));
-		duart_irq_calc(d);
 		break;
 	case 6:
 		break;		/* Literally start break */
@@ -117,105 +214,211 @@ static void duart_command(struct duart *d, int port, int value)
 		break;		/* Stop break */
 	}
 	if (value & 1)
-		d->port[port].rxdis = 0;
+		p->rxdis = 0;
 	if (value & 2)
-		d->port[port].rxdis = 1;
+		p->rxdis = 1;
 	if (value & 4)
-		d->port[port].txdis = 0;
+		p->txdis = 0;
 	if (value & 8)
-		d->port[port].txdis = 1;
+		p->txdis = 1;
+	duart_tx_load(d, port);
+	duart_port_isr(d, port);
 }
 
-/* Simulate 1/100th second of action */
-static void duart_count(struct duart *d, int n)
+/* X1 clocks per count, or 0 if the counter is not moving. Only the X1
+   sources are modelled */
+static unsigned int duart_ct_div(struct duart *d)
 {
-	/* We are clocked at ??? so divide as needed */
-	uint16_t clock = 184;	/* 1843200 so not entirely accurate
-				   FIXME: we could track partial clocks */
-	if (n == 16)
-		clock /= 16;	/* Again needs accuracy sorting */
-
 	/* Counter mode can be stopped */
-	if (!(d->acr & 0x40))
-		if (d->ctstop)
-			return;
-
-	d->ct -= clock;
-	if (d->ct < 0) {
-		/* Our couunt overran so we compute the remainder */
-		if (d->ctr) {
-			d->ct %= d->ctr;	/* Negative clocks left */
-			d->ct += d->ctr;	/* Plus next cycle */
-		} else
-			d->ct = 0;
-		/* And raise the event */
-		duart_irq_raise(d, 0x08);
-	}
-}
-
-void duart_tick(struct duart *d)
-{
-	uint8_t r = check_chario();
-	if ((r & 1) && d->port[0].rxdis == 0) {
-	        if (d->input == 1) {
-		    d->port[0].rx = next_char();
-		    d->port[0].sr |= 0x01;
-		    duart_irq_raise(d, 0x02);
-                } else if (d->input == 2) {
-		    d->port[1].rx = next_char();
-		    d->port[1].sr |= 0x01;
-		    duart_irq_raise(d, 0x20);
-                }
-	}
-	if (r & 2) {
-		if (!d->port[0].txdis && !(d->port[0].sr & 0x04)) {
-			d->port[0].sr |= 0x0C;
-			duart_irq_raise(d, 0x01);
-		}
-		if (!d->port[1].txdis && !(d->port[1].sr & 0x04)) {
-			d->port[1].sr |= 0x0C;
-			duart_irq_raise(d, 0x10);
-		}
-	}
+	if (!(d->acr & 0x40) && d->ctstop)
+		return 0;
 	switch ((d->acr & 0x70) >> 4) {
 		/* Clock and timer modes */
 	case 0:		/* Counting IP2 */
-		break;
 	case 1:		/* Counting TxCA */
-		break;
 	case 2:		/* Counting TxCB */
-		break;
+		return 0;
 	case 3:		/* Counting EXT/x1 clock  / 16 */
-		duart_count(d, 16);
-		break;
+		return 16;
 	case 4:		/* Timer on IP2 */
-		break;
 	case 5:		/* Timer on IP2/16 */
-		break;
+		return 0;
 	case 6:		/* Timer on X1/CLK */
-		duart_count(d, 1);
-		break;
+		return 1;
 	case 7:		/* Timer on X1/CLK / 16 */
-		duart_count(d, 16);
-		break;
+		return 16;
+	}
+	return 0;
+}
+
+static uint32_t duart_ct_period(struct duart *d)
+{
+	return d->ctr ? d->ctr : 0x10000;
+}
+
+/* Bring the counter up to the current clock. Rather than stepping it
+   we work out how many counts have passed and where in the period it
+   is now, so it costs the same however long it was left */
+static void duart_ct_sync(struct duart *d)
+{
+	unsigned int div = duart_ct_div(d);
+	uint64_t n;
+
+	if (div == 0) {
+		d->ctbase = d->clock;
+		return;
+	}
+	n = (d->clock - d->ctbase) / div;
+	d->ctbase += n * div;
+	if (n < d->ct) {
+		d->ct -= n;
+		return;
 	}
+	n -= d->ct;
+	d->ct = duart_ct_period(d) - n % duart_ct_period(d);
+	duart_irq_raise(d, 0x08);
+}
+
+/* Baud rates for the two sets picked by ACR bit 7. Zero is the timer or
+   an external clock */
+static const uint16_t duart_baud[2][16] = {
+	{ 50, 110, 134, 200, 300, 600, 1200, 1050,
+	  2400, 4800, 7200, 9600, 38400, 0, 0, 0 },
+	{ 75, 110, 134, 150, 300, 600, 1200, 2000,
+	  2400, 4800, 1800, 9600, 19200, 0, 0, 0 }
+};
+
+/* One character at the port's receive rate and format in X1 clocks */
+static uint32_t duart_char_clocks(struct duart *d, int port)
+{
+	struct duart_port *p = &d->port[port];
+	unsigned int sel = p->csr >> 4;
+	uint32_t bits = 1 + 5 + (p->mr1 & 3) + 1;
+	uint16_t baud = duart_baud[d->acr >> 7][sel];
+
+	if ((p->mr1 & 0x18) != 0x10)	/* Parity or multidrop bit */
+		bits++;
+	if ((p->mr2 & 0x0F) >= 8)	/* Two stop bits near enough */
+		bits++;
+	if (baud)
+		return 1843200 * bits / baud;
+	if (sel == 13)			/* Counter/timer is the x16 clock */
+		return 32 * (d->ctr ? d->ctr : 0x10000) * bits;
+	return 16 * bits;		/* External, assume 115200 */
+}
+
+/* A port moves a character when a character time has passed. Any time
+   left over is kept so a read can take the next byte early and keep the
+   long term rate exact */
+static int duart_due(struct duart *d, int port, unsigned int clocks)
+{
+	struct duart_port *p = &d->port[port];
+	uint32_t cc = duart_char_clocks(d, port);
+
+	if (d->unthrottled)
+		return 1;
+	p->clk += clocks;
+	if (p->clk < cc)
+		return 0;
+	p->clk -= cc;
+	if (p->clk > cc)
+		p->clk = cc;
+	return 1;
+}
+
+/* The FIFO only fills from the host while there is room so an attached
+   sender is held off as it would be by RxRTS */
+static int duart_rx_ready(struct duart *d, int port, unsigned int r)
+{
+	if (d->port[port].rxdis || d->port[port].rxcount == RX_FIFO)
+		return 0;
+	if (d->dev[port])
+		return chardev_status(d->dev[port]) & 1;
+	return (r & 1) && d->input == port + 1;
+}
+
+static void duart_rx(struct duart *d, int port)
+{
+	struct duart_port *p = &d->port[port];
+	uint8_t c;
+
+	if (d->dev[port])
+		c = chardev_getc(d->dev[port]);
+	else
+		c = next_char();
+	p->rxfifo[p->rxcount++] = c;
+	duart_port_isr(d, port);
+}
+
+static void duart_port_tick(struct duart *d, int port, unsigned int r,
+			    unsigned int clocks)
+{
+	struct duart_port *p = &d->port[port];
+
+	if (!duart_due(d, port, clocks))
+		return;
+	if (duart_rx_ready(d, port, r))
+		duart_rx(d, port);
+	p->tx_busy = 0;
+	duart_tx_load(d, port);
+	duart_port_isr(d, port);
+}
+
+/* Run the DUART for a number of X1 clocks */
+void duart_run(struct duart *d, unsigned int clocks)
+{
+	unsigned int r = check_chario();
+
+	d->clock += clocks;
+	duart_port_tick(d, 0, r, clocks);
+	duart_port_tick(d, 1, r, clocks);
+	duart_ct_sync(d);
+}
+
+void duart_tick(struct duart *d)
+{
+	duart_run(d, 184);
+}
+
+/* X1 clocks until the counter next interrupts, so the board need not
+   run the CPU past it */
+uint32_t duart_deadline(struct duart *d)
+{
+	unsigned int div = duart_ct_div(d);
+
+	if (div == 0 || !(d->imr & 0x08) || (d->isr & 0x08))
+		return DUART_NEVER;
+	return d->ct * div - (d->clock - d->ctbase);
 }
 
 void duart_reset(struct duart *d)
 {
+	int i;
+
 	d->ctr = 0xFFFF;
-	d->ct = 0x0000;
+	d->ct = 0xFFFF;
+	d->ctbase = d->clock;
+	d->ctstop = 0;
 	d->acr = 0xFF;
 	d->isr = 0;
 	d->imr = 0;
-	d->port[0].mrp = 0;
-	d->port[0].sr = 0x00;
-	d->port[1].mrp = 0;
-	d->port[1].sr = 0x00;
+	d->irq = 0;
+	for (i = 0; i < 2; i++) {
+		struct duart_port *p = &d->port[i];
+		p->mrp = 0;
+		p->sr = 0x00;
+		p->rxcount = 0;
+		p->thr_full = 0;
+		p->tx_busy = 0;
+		if (!p->txdis)
+			d->isr |= 0x01 << (4 * i);
+	}
 }
 
 uint8_t do_duart_read(struct duart *d, uint16_t address)
 {
+	uint8_t r;
+
 	if (!(address & 1))
 		return 0x00;
 	switch (address >> 1) {
@@ -225,17 +428,20 @@ uint8_t do_duart_read(struct duart *d, uint16_t address)
 		d->port[0].mrp = 1;
 		return d->port[0].mr1;
 	case 0x01:		/* SRA */
-		return d->port[0].sr;
+		return duart_sr(d, 0);
 	case 0x02:		/* BRG test */
 	case 0x03:		/* RHRA */
 		return duart_input(d, 0);
 	case 0x04:		/* IPCR */
 		return d->ipcr;
 	case 0x05:		/* ISR */
+		duart_ct_sync(d);
 		return d->isr;
 	case 0x06:		/* CTU */
+		duart_ct_sync(d);
 		return d->ct >> 8;
 	case 0x07:		/* CTL */
+		duart_ct_sync(d);
 		return d->ct & 0xFF;
 	case 0x08:		/* MR1B/MR2B */
 		if (d->port[1].mrp)
@@ -243,19 +449,28 @@ uint8_t do_duart_read(struct duart *d, uint16_t address)
 		d->port[1].mrp = 1;
 		return d->port[1].mr1;
 	case 0x09:		/* SRB */
-		return d->port[1].sr;
+		return duart_sr(d, 1);
 	case 0x0A:		/* 1x/16x Test */
 	case 0x0B:		/* RHRB */
 		return duart_input(d, 1);
 	case 0x0C:		/* IVR */
 		return d->ivr;
 	case 0x0D:		/* IP */
-		return 0xff;	/* d->ip; */
+		/* IP0 and IP1 are the active low CTS inputs */
+		r = 0xFF;
+		if (d->dev[0] && chardev_cts(d->dev[0]))
+			r &= ~0x01;
+		if (d->dev[1] && chardev_cts(d->dev[1]))
+			r &= ~0x02;
+		return r;
 	case 0x0E:		/* START */
-		d->ct = d->ctr;
+		duart_ct_sync(d);
+		d->ct = duart_ct_period(d);
+		d->ctbase = d->clock;
 		d->ctstop = 0;
 		return 0xFF;
 	case 0x0F:		/* STOP */
+		duart_ct_sync(d);
 		d->ctstop = 1;
 		duart_irq_lower(d, 0x08);
 		return 0xFF;
@@ -266,7 +481,7 @@ uint8_t do_duart_read(struct duart *d, uint16_t address)
 uint8_t duart_read(struct duart *d, uint16_t address)
 {
 	uint8_t value = do_duart_read(d, address);
-	if (d->trace)
+	if (TRACE_ON(d->trace))
 		fprintf(stderr, "duart: read reg %02X -> %02X\n",
 			address >> 1, value);
 	return value;
@@ -279,7 +494,7 @@ void duart_write(struct duart *d, uint16_t address, uint8_t value)
 		return;
 	value &= 0xFF;
 
-	if (d->trace)
+	if (TRACE_ON(d->trace))
 		fprintf(stderr, "duart: write reg %02X <- %02X\n",
 			address >> 1, value);
 
@@ -287,8 +502,10 @@ void duart_write(struct duart *d, uint16_t address, uint8_t value)
 	case 0x00:
 		if (d->port[0].mrp)
 			d->port[0].mr2 = value;
-		else
+		else {
 			d->port[0].mr1 = value;
+			duart_port_isr(d, 0);
+		}
 		break;
 	case 0x01:
 		d->port[0].csr = value;
@@ -301,7 +518,10 @@ void duart_write(struct duart *d, uint16_t address, uint8_t value)
 		duart_output(d, 0, value);
 		break;
 	case 0x04:
+		/* Count up to now in the old mode then go on in the new */
+		duart_ct_sync(d);
 		d->acr = value;
+		d->ctbase = d->clock;
 		duart_irq_calc(d);
 		bgrc = 1;
 		break;
@@ -320,8 +540,10 @@ void duart_write(struct duart *d, uint16_t address, uint8_t value)
 	case 0x08:
 		if (d->port[1].mrp)
 			d->port[1].mr2 = value;
-		else
+		else {
 			d->port[1].mr1 = value;
+			duart_port_isr(d, 1);
+		}
 		break;
 	case 0x09:
 		d->port[1].csr = value;
@@ -345,7 +567,7 @@ void duart_write(struct duart *d, uint16_t address, uint8_t value)
 		d->opcr &= ~value;
 		break;
 	}
-	if (bgrc && d->trace) {
+	if (bgrc && TRACE_ON(d->trace)) {
 		printf("BGR %d\n", d->acr >> 7);
 		printf("CSR %d\n", d->port[0].csr >> 4);
 	}
@@ -356,6 +578,18 @@ void duart_set_input(struct duart *duart, int port)
 	duart->input = port;
 }
 
+/* Give a port a host device of its own */
+void duart_attach(struct duart *duart, int port, struct chardev *dev)
+{
+	duart->dev[port] = dev;
+}
+
+/* Feed input as fast as the guest reads it rather than at the baud rate */
+void duart_unthrottle(struct duart *duart, int onoff)
+{
+	duart->unthrottled = onoff;
+}
+
 void duart_trace(struct duart *duart, int onoff)
 {	
 	duart->trace = onoff;
@@ -1,4 +1,7 @@
 struct duart;
+struct chardev;
+
+#define DUART_NEVER	0xFFFFFFFFU	/* No counter deadline pending */
 
 extern struct duart *duart_create(void);
 extern void duart_free(struct duart *duart);
@@ -6,9 +9,13 @@ extern void duart_trace(struct duart *duart, int onoff);
 extern uint8_t duart_read(struct duart *duart, uint16_t addr);
 extern void duart_write(struct duart *duart, uint16_t addr, uint8_t val);
 extern void duart_tick(struct duart *duart);
+extern void duart_run(struct duart *duart, unsigned int clocks);
+extern uint32_t duart_deadline(struct duart *duart);
 extern void duart_reset(struct duart *duart);
 extern uint8_t duart_irq_pending(struct duart *duart);
 extern void duart_set_input(struct duart *duart, int port);
+extern void duart_attach(struct duart *duart, int port, struct chardev *dev);
+extern void duart_unthrottle(struct duart *duart, int onoff);
 extern uint8_t duart_vector(struct duart *duart);
 
 /* Caller proviced */
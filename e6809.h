@@ -3,15 +3,32 @@
 
 #include <stdint.h>
 
+struct e6809 {
+    unsigned x, y;	/* index registers */
+    unsigned u;		/* user stack pointer */
+    unsigned s;		/* hardware stack pointer */
+    unsigned pc;
+    unsigned a, b;
+    unsigned dp;	/* direct page register */
+    unsigned cc;
+    unsigned irq_status;	/* interrupts held off by sync or cwai */
+    unsigned irq_line_i;	/* interrupt lines for e6809_run */
+    unsigned irq_line_f;
+    unsigned *rptr_xyus[4];	/* x, y, u and s by index postbyte */
+    unsigned trace;
+};
+
 /* user defined read and write functions */
 
-extern unsigned char e6809_read8(unsigned address);
-extern void e6809_write8(unsigned address, unsigned char data);
+extern unsigned char e6809_read8(struct e6809 *cpu, unsigned address);
+extern void e6809_write8(struct e6809 *cpu, unsigned address, unsigned char data);
 
-extern void e6809_instruction(unsigned address);
+extern void e6809_instruction(struct e6809 *cpu, unsigned address);
 
-void e6809_reset (int trace);
-unsigned e6809_sstep (unsigned irq_i, unsigned irq_f);
+void e6809_reset (struct e6809 *cpu, int trace);
+unsigned e6809_sstep (struct e6809 *cpu, unsigned irq_i, unsigned irq_f);
+void e6809_irq (struct e6809 *cpu, unsigned irq_i, unsigned irq_f);
+unsigned e6809_run (struct e6809 *cpu, unsigned budget);
 
 struct reg6809 {
     uint16_t pc;
@@ -19,6 +36,6 @@ struct reg6809 {
     uint8_t a,b,dp,cc;
 };
 
-struct reg6809 *e6809_get_regs(void);
+struct reg6809 *e6809_get_regs(struct e6809 *cpu);
 
 #endif
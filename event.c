@@ -0,0 +1,175 @@
+/*
+ *	A small binary min-heap of timed events keyed on absolute T-states.
+ *
+ *	The queue holds pointers to caller owned struct event objects so there
+ *	is no allocation on the hot path. Events with the same deadline fire in
+ *	the order they were armed, which keeps device behaviour deterministic.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "event.h"
+#include "hostperf.h"
+
+#define MAX_EVENTS	32
+
+struct event_queue {
+    struct event *heap[MAX_EVENTS];
+    unsigned int num;
+    uint64_t now;
+    uint64_t seq;
+};
+
+static int event_before(struct event *a, struct event *b)
+{
+    if (a->when != b->when)
+        return a->when < b->when;
+    return a->seq < b->seq;
+}
+
+static void event_place(struct event_queue *q, struct event *e, unsigned int n)
+{
+    q->heap[n] = e;
+    e->slot = n;
+}
+
+static void event_up(struct event_queue *q, unsigned int n)
+{
+    struct event *e = q->heap[n];
+    while (n) {
+        unsigned int p = (n - 1) / 2;
+        if (!event_before(e, q->heap[p]))
+            break;
+        event_place(q, q->heap[p], n);
+        n = p;
+    }
+    event_place(q, e, n);
+}
+
+static void event_down(struct event_queue *q, unsigned int n)
+{
+    struct event *e = q->heap[n];
+    while (1) {
+        unsigned int c = 2 * n + 1;
+        if (c >= q->num)
+            break;
+        if (c + 1 < q->num && event_before(q->heap[c + 1], q->heap[c]))
+            c++;
+        if (!event_before(q->heap[c], e))
+            break;
+        event_place(q, q->heap[c], n);
+        n = c;
+    }
+    event_place(q, e, n);
+}
+
+struct event_queue *event_queue_create(void)
+{
+    struct event_queue *q = malloc(sizeof(struct event_queue));
+    if (q == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memset(q, 0, sizeof(struct event_queue));
+    return q;
+}
+
+void event_queue_free(struct event_queue *q)
+{
+    while (q->num)
+        event_cancel(q, q->heap[0]);
+    free(q);
+}
+
+void event_init(struct event *e, void (*fn)(void *), void *priv)
+{
+    e->when = EVENT_NEVER;
+    e->period = 0;
+    e->seq = 0;
+    e->fn = fn;
+    e->priv = priv;
+    e->slot = -1;
+    e->group = HOSTPERF_RUNNER;
+}
+
+void event_cancel(struct event_queue *q, struct event *e)
+{
+    unsigned int n = e->slot;
+
+    if (e->slot < 0)
+        return;
+    e->slot = -1;
+    e->when = EVENT_NEVER;
+    if (n == --q->num)
+        return;
+    event_place(q, q->heap[q->num], n);
+    event_up(q, n);
+    event_down(q, q->heap[n]->slot);
+}
+
+/* Arm (or re-arm) an event for an absolute T-state. A deadline already
+   in the past fires on the next event_advance() */
+void event_schedule(struct event_queue *q, struct event *e, uint64_t when)
+{
+    event_cancel(q, e);
+    if (q->num == MAX_EVENTS) {
+        fprintf(stderr, "event: queue full.\n");
+        exit(1);
+    }
+    e->when = when;
+    e->seq = q->seq++;
+    event_place(q, e, q->num++);
+    event_up(q, e->slot);
+}
+
+/* Arm an event that fires every period T-states from now */
+void event_periodic(struct event_queue *q, struct event *e, uint64_t period)
+{
+    e->period = period;
+    event_schedule(q, e, q->now + period);
+}
+
+uint64_t event_now(struct event_queue *q)
+{
+    return q->now;
+}
+
+uint64_t event_next(struct event_queue *q)
+{
+    if (q->num == 0)
+        return EVENT_NEVER;
+    return q->heap[0]->when;
+}
+
+/* T-states the CPU may run before the next event is due */
+unsigned int event_budget(struct event_queue *q)
+{
+    uint64_t next = event_next(q);
+    if (next <= q->now)
+        return 0;
+    if (next - q->now > 0x7FFFFFFF)
+        return 0x7FFFFFFF;
+    return next - q->now;
+}
+
+/* Move the clock on and fire everything that is now due. The periodic
+   re-arm happens before the callback so it may cancel or reschedule */
+void event_advance(struct event_queue *q, unsigned int tstates)
+{
+    q->now += tstates;
+    while (q->num && q->heap[0]->when <= q->now) {
+        struct event *e = q->heap[0];
+        if (e->period)
+            event_schedule(q, e, e->when + e->period);
+        else
+            event_cancel(q, e);
+        if (e->group != HOSTPERF_RUNNER) {
+            int prev = hostperf_switch(e->group);
+            e->fn(e->priv);
+            hostperf_switch(prev);
+        } else
+            e->fn(e->priv);
+    }
+}
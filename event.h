@@ -0,0 +1,38 @@
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#include <stdint.h>
+
+/*
+ *	Timed events against an absolute T-state clock. Each device owns its
+ *	struct event and arms it for the next point it needs attention. The
+ *	board runs the CPU up to event_next() and then advances the clock,
+ *	which fires anything that has come due.
+ */
+
+#define EVENT_NEVER	UINT64_MAX
+
+struct event_queue;
+
+struct event {
+    uint64_t when;
+    uint64_t period;		/* Re-arm interval, 0 for one shot */
+    uint64_t seq;		/* Keeps equal deadlines in arming order */
+    void (*fn)(void *priv);
+    void *priv;
+    int slot;			/* Heap position or -1 if idle */
+    int group;			/* hostperf.h subsystem charged for fn */
+};
+
+extern struct event_queue *event_queue_create(void);
+extern void event_queue_free(struct event_queue *q);
+extern void event_init(struct event *e, void (*fn)(void *), void *priv);
+extern void event_schedule(struct event_queue *q, struct event *e, uint64_t when);
+extern void event_periodic(struct event_queue *q, struct event *e, uint64_t period);
+extern void event_cancel(struct event_queue *q, struct event *e);
+extern uint64_t event_now(struct event_queue *q);
+extern uint64_t event_next(struct event_queue *q);
+extern unsigned int event_budget(struct event_queue *q);
+extern void event_advance(struct event_queue *q, unsigned int tstates);
+
+#endif
@@ -21,6 +21,7 @@
 #include "6800.h"
 #include "ide.h"
 #include "acia.h"
+#include "trace.h"
 
 static uint8_t ramrom[65536];
 static uint8_t fast = 0;
@@ -379,14 +380,14 @@ static uint8_t m6800_do_ior(uint16_t addr)
 static uint8_t m6800_ior(uint16_t addr)
 {
 	uint8_t r = m6800_do_ior(addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "IR %04X = %02X\n", addr, r);
 	return r;
 }
 
 static void m6800_iow(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "IW %04X = %02X\n", addr, val);
 	/* Console MP-S at 0x8004 */
 	if (addr >= 0x8004 && addr <= 0x8007)
@@ -424,7 +425,7 @@ uint8_t m6800_read_op(struct m6800 *cpu, uint16_t addr, int debug)
 			return 0xFF;
 		return m6800_ior(addr);
 	}
-	if (!debug && (trace & TRACE_MEM))
+	if (!debug && TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[addr]);
 	return ramrom[addr];
 }
@@ -442,13 +443,13 @@ uint8_t m6800_read(struct m6800 *cpu, uint16_t addr)
 void m6800_write(struct m6800 *cpu, uint16_t addr, uint8_t val)
 {
 	if (addr >= 0xE000) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X (ROM)\n", addr,
 				val);
 	} else if (addr >= 0x8000 && addr < 0xA000)
 		m6800_iow(addr, val);
 	else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
 		ramrom[addr] = val;
 	}
@@ -568,11 +569,11 @@ int main(int argc, char *argv[])
 	wdfdc = wd_init();
 	wd_attach(wdfdc, 0, "Flex2_a.dsk");
 	wd_attach(wdfdc, 1, "Flex2_b.dsk");
-	if (trace & TRACE_ACIA)
+	if (TRACE_ON(trace & TRACE_ACIA))
 		acia_trace(acia, 1);
 	acia_set_input(acia, 1);
 
-	if (trace & TRACE_CPU)
+	if (TRACE_ON(trace & TRACE_CPU))
 		cpu.debug = 1;
 
 	/* This is the wrong way to do it but it's easier for the moment. We
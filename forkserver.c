@@ -0,0 +1,165 @@
+/*
+ *	Fork server for starting many runs of an already booted machine
+ *
+ *	The parent never runs the machine again after it starts serving, so
+ *	each child begins from exactly the same state. Children are not
+ *	waited for; the client can watch for end of file on its connection
+ *	or use the pid it was given. With a job limit the server stops
+ *	accepting while that many children are running, so the rest queue
+ *	on the socket instead of all competing for the host cpus.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "forkserver.h"
+
+/* Read the request. Returns the number of fds passed or -1 */
+static int fs_request(int c, char *overlay, int *fd)
+{
+	union {
+		struct cmsghdr h;
+		uint8_t buf[CMSG_SPACE(2 * sizeof(int))];
+	} cbuf;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	ssize_t len;
+	int n = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = overlay;
+	iov.iov_len = FORKSERVER_PATH - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	do
+		len = recvmsg(c, &msg, 0);
+	while (len == -1 && errno == EINTR);
+	if (len < 0)
+		return -1;
+	overlay[len] = 0;
+	if (len && overlay[len - 1] == '\n')
+		overlay[len - 1] = 0;
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (n > 2)
+				n = 2;
+			memcpy(fd, CMSG_DATA(cm), n * sizeof(int));
+		}
+	}
+	if (n == 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		while (n)
+			close(fd[--n]);
+		return -1;
+	}
+	return n;
+}
+
+/* Wait until fewer than jobs children are running */
+static unsigned int fs_reap(unsigned int running, unsigned int jobs)
+{
+	pid_t pid;
+
+	while (running) {
+		pid = waitpid(-1, NULL, running >= jobs ? 0 : WNOHANG);
+		if (pid > 0)
+			running--;
+		else if (pid == 0)
+			break;
+		else if (errno != EINTR)
+			return 0;
+	}
+	return running;
+}
+
+/*
+ *	Serve requests on a unix socket at path. Only returns in a child,
+ *	with its stdin and stdout replaced and overlay (FORKSERVER_PATH
+ *	bytes) holding the requested overlay path, or on a setup error.
+ *	If jobs is not zero at most that many children run at once.
+ */
+int forkserver_run(const char *path, char *overlay, unsigned int jobs)
+{
+	struct sockaddr_un sun;
+	int s, c;
+	int fd[2];
+	int n;
+	pid_t pid;
+	char reply[32];
+	unsigned int running = 0;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long.\n", path);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1 || bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(s, SOMAXCONN) == -1) {
+		perror(path);
+		return -1;
+	}
+	/* Let the kernel reap the children unless we are counting them */
+	signal(SIGCHLD, jobs ? SIG_DFL : SIG_IGN);
+	fprintf(stderr, "[fork server ready on %s]\n", path);
+
+	while (1) {
+		if (jobs)
+			running = fs_reap(running, jobs);
+		c = accept(s, NULL, NULL);
+		if (c == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			return -1;
+		}
+		n = fs_request(c, overlay, fd);
+		if (n == -1) {
+			if (write(c, "error\n", 6) == -1)
+				perror("fork server");
+			close(c);
+			continue;
+		}
+		pid = fork();
+		if (pid == 0) {
+			signal(SIGCHLD, SIG_DFL);
+			close(s);
+			dup2(fd[0], 0);
+			dup2(fd[n - 1], 1);
+			close(fd[0]);
+			if (n == 2)
+				close(fd[1]);
+			/* c stays open until we exit to tell the client */
+			return 0;
+		}
+		if (pid == -1) {
+			perror("fork");
+			strcpy(reply, "error\n");
+		} else {
+			snprintf(reply, sizeof(reply), "%d\n", (int)pid);
+			running++;
+		}
+		if (write(c, reply, strlen(reply)) == -1)
+			perror("fork server");
+		close(fd[0]);
+		if (n == 2)
+			close(fd[1]);
+		close(c);
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef __FORKSERVER_H
+#define __FORKSERVER_H
+
+/*
+ *	Fork server. Once a machine has booted it listens on a unix socket
+ *	and forks off a copy of itself for each connection. The client sends
+ *	one message holding the path of an overlay file for the disks (which
+ *	may be empty) with its stdin and optionally stdout passed as
+ *	SCM_RIGHTS. The server replies with the child pid as a line of text.
+ *	The connection stays open in the child so the client sees end of
+ *	file when the run is over. A non zero jobs limits how many children
+ *	run at the same time; further connections wait in the listen queue.
+ */
+
+#define FORKSERVER_PATH	1024
+
+extern int forkserver_run(const char *path, char *overlay, unsigned int jobs);
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ *	Stream rasterized video frames to a file or pipe
+ *
+ *	The header is in host byte order, as are the 32bit pixels which are
+ *	whatever the device colour map holds. The stream is meant for tools
+ *	on the same machine that record or compare runs.
+ *
+ *	Devices that draw colour indices can hand them over as they are.
+ *	With the indexed option those go out a byte a pixel with the palette
+ *	in front, otherwise they are expanded here first.
+ *
+ *	Frames are written with blocking writes so that nothing is lost. A
+ *	slow reader can be kept up with by skipping frames, or by capping
+ *	the rate against the host clock.
+ *
+ *	A shared memory stream costs a copy into the mapping per frame and
+ *	no system calls, and is the same whether or not anything watches.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "framestream.h"
+
+#define FS_RAW		0
+#define FS_DELTA	1
+#define FS_INDEXED	2	/* Palette then a byte a pixel */
+
+struct fs_header {
+	uint8_t magic[4];	/* VFRM */
+	uint8_t type;
+	uint8_t colours;	/* Palette entries for an indexed frame */
+	uint16_t width;
+	uint16_t height;
+	uint16_t runs;		/* Row runs that follow for a delta frame */
+	uint32_t frame;		/* Frame number counting skipped ones */
+};
+
+struct fs_run {
+	uint16_t row;
+	uint16_t rows;
+};
+
+struct framestream {
+	int fd;
+	unsigned int width;
+	unsigned int height;
+	unsigned int delta;
+	unsigned int indexed;
+	unsigned int skip;
+	unsigned int fps;
+	uint32_t frame;
+	uint8_t *last;		/* Last frame sent, for deltas */
+	uint32_t *expand;	/* Indexed frames not sent as such */
+	int sent;
+	struct timespec next;	/* Earliest time for the next frame */
+	char *shmname;		/* Shared memory object instead of fd */
+	struct framestream_shm *shm;
+	size_t shmlen;
+};
+
+static int fs_write(struct framestream *fs, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fs->fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int fs_parse(struct framestream *fs, const char *env, char *spec)
+{
+	char *p = strtok(spec, ",");
+
+	if (p == NULL)
+		return -1;
+	if (strncmp(p, "fd:", 3) == 0)
+		fs->fd = atoi(p + 3);
+	else if (strncmp(p, "shm:", 4) == 0) {
+		fs->shmname = strdup(p + 4);
+		if (fs->shmname == NULL)
+			return -1;
+	} else {
+		fs->fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fs->fd == -1) {
+			perror(p);
+			return -1;
+		}
+	}
+	while ((p = strtok(NULL, ",")) != NULL) {
+		if (strcmp(p, "delta") == 0)
+			fs->delta = 1;
+		else if (strcmp(p, "indexed") == 0)
+			fs->indexed = 1;
+		else if (strncmp(p, "skip=", 5) == 0)
+			fs->skip = atoi(p + 5);
+		else if (strncmp(p, "fps=", 4) == 0)
+			fs->fps = atoi(p + 4);
+		else {
+			fprintf(stderr, "%s: unknown option '%s'.\n", env, p);
+			return -1;
+		}
+	}
+	/* Viewers always see whole frames */
+	if (fs->shmname && fs->delta)
+		return -1;
+	return 0;
+}
+
+static void fs_shm_create(struct framestream *fs, const char *env)
+{
+	struct framestream_shm *h;
+	unsigned int bpp = fs->indexed ? 1 : 4;
+	size_t size = fs->width * fs->height * bpp;
+	int fd;
+
+	if (fs->indexed)
+		size += 256 * sizeof(uint32_t);
+	size = (size + 63) & ~(size_t)63;
+	fs->shmlen = 64 + 2 * size;
+	fd = shm_open(fs->shmname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1 || ftruncate(fd, fs->shmlen) == -1) {
+		perror(fs->shmname);
+		exit(1);
+	}
+	h = mmap(NULL, fs->shmlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED) {
+		perror(env);
+		exit(1);
+	}
+	close(fd);
+	h->bpp = bpp;
+	h->width = fs->width;
+	h->height = fs->height;
+	h->size = size;
+	h->offset[0] = 64;
+	h->offset[1] = 64 + size;
+	memcpy(h->magic, "VSHM", 4);
+	fs->shm = h;
+}
+
+/* Create a stream if the environment variable env is set */
+struct framestream *framestream_create(const char *env, unsigned int width, unsigned int height)
+{
+	struct framestream *fs;
+	const char *val = getenv(env);
+	char *spec;
+
+	if (val == NULL || *val == 0)
+		return NULL;
+	fs = calloc(1, sizeof(struct framestream));
+	spec = strdup(val);
+	if (fs == NULL || spec == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	fs->fd = -1;
+	if (fs_parse(fs, env, spec) == -1) {
+		fprintf(stderr, "%s: bad stream '%s'.\n", env, val);
+		exit(1);
+	}
+	free(spec);
+	/* A reader that exits should stop the stream, not the emulator */
+	signal(SIGPIPE, SIG_IGN);
+	fs->width = width;
+	fs->height = height;
+	if (fs->shmname)
+		fs_shm_create(fs, env);
+	if (fs->delta) {
+		/* Big enough for either pixel size */
+		fs->last = malloc(width * height * sizeof(uint32_t));
+		if (fs->last == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	return fs;
+}
+
+/* True if the rate cap says this frame should be dropped */
+static int fs_throttle(struct framestream *fs)
+{
+	struct timespec now;
+
+	if (fs->fps == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < fs->next.tv_sec ||
+	    (now.tv_sec == fs->next.tv_sec && now.tv_nsec < fs->next.tv_nsec))
+		return 1;
+	fs->next = now;
+	fs->next.tv_nsec += 1000000000L / fs->fps;
+	if (fs->next.tv_nsec >= 1000000000L) {
+		fs->next.tv_sec++;
+		fs->next.tv_nsec -= 1000000000L;
+	}
+	return 0;
+}
+
+static int fs_row_same(struct framestream *fs, const uint8_t *raster, unsigned int y, unsigned int bpp)
+{
+	unsigned int off = y * fs->width * bpp;
+	return memcmp(fs->last + off, raster + off, fs->width * bpp) == 0;
+}
+
+/* Raster is bpp bytes a pixel, the header and any palette already gone */
+static int fs_send_delta(struct framestream *fs, struct fs_header *h, const uint8_t *raster,
+	const uint32_t *palette, unsigned int bpp)
+{
+	struct fs_run run[64];
+	unsigned int n = 0;
+	unsigned int y = 0;
+	unsigned int i;
+
+	/* Work out the runs first as the header carries the count */
+	while (y < fs->height) {
+		unsigned int start;
+		if (fs->sent && fs_row_same(fs, raster, y, bpp)) {
+			y++;
+			continue;
+		}
+		start = y;
+		while (y < fs->height && (!fs->sent || !fs_row_same(fs, raster, y, bpp)))
+			y++;
+		/* Too fragmented: merge with the previous run */
+		if (n == 64) {
+			run[63].rows = y - run[63].row;
+			continue;
+		}
+		run[n].row = start;
+		run[n].rows = y - start;
+		n++;
+	}
+	h->type |= FS_DELTA;
+	h->runs = n;
+	if (fs_write(fs, h, sizeof(*h)) ||
+	    (palette && fs_write(fs, palette, h->colours * sizeof(uint32_t))))
+		return -1;
+	for (i = 0; i < n; i++) {
+		unsigned int off = run[i].row * fs->width * bpp;
+		size_t len = run[i].rows * fs->width * bpp;
+		if (fs_write(fs, &run[i], sizeof(struct fs_run)) ||
+		    fs_write(fs, raster + off, len))
+			return -1;
+		memcpy(fs->last + off, raster + off, len);
+	}
+	fs->sent = 1;
+	return 0;
+}
+
+static void fs_send(struct framestream *fs, const void *raster,
+	const uint32_t *palette, unsigned int colours, unsigned int bpp)
+{
+	struct fs_header h;
+	int r;
+
+	memcpy(h.magic, "VFRM", 4);
+	h.type = palette ? FS_INDEXED : FS_RAW;
+	h.colours = palette ? colours : 0;
+	h.width = fs->width;
+	h.height = fs->height;
+	h.runs = 0;
+	h.frame = fs->frame - 1;	/* As counted by fs_due */
+	if (fs->delta)
+		r = fs_send_delta(fs, &h, raster, palette, bpp);
+	else
+		r = fs_write(fs, &h, sizeof(h)) ||
+		    (palette && fs_write(fs, palette, colours * sizeof(uint32_t))) ||
+		    fs_write(fs, raster, fs->width * fs->height * bpp);
+	if (r) {
+		/* Reader went away. Carry on running without video */
+		perror("framestream");
+		close(fs->fd);
+		fs->fd = -1;
+	}
+}
+
+/* Start the next frame in the buffer viewers are not looking at */
+static uint8_t *fs_shm_begin(struct framestream *fs)
+{
+	struct framestream_shm *h = fs->shm;
+	uint32_t n = h->seq / 2 + 1;
+
+	__atomic_store_n(&h->seq, 2 * n - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	h->frame[n & 1] = fs->frame - 1;
+	return (uint8_t *)h + h->offset[n & 1];
+}
+
+static void fs_shm_end(struct framestream *fs)
+{
+	__atomic_store_n(&fs->shm->seq, fs->shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Count the frame and say if it is one to send */
+static int fs_due(struct framestream *fs)
+{
+	uint32_t frame;
+
+	if (fs == NULL || (fs->fd == -1 && fs->shm == NULL))
+		return 0;
+	frame = fs->frame++;
+	if (fs->skip > 1 && frame % fs->skip)
+		return 0;
+	return !fs_throttle(fs);
+}
+
+/* Call once per emulated frame with the finished raster */
+void framestream_frame(struct framestream *fs, const uint32_t *raster)
+{
+	if (!fs_due(fs))
+		return;
+	if (fs->shm) {
+		memcpy(fs_shm_begin(fs), raster, fs->width * fs->height * sizeof(uint32_t));
+		fs_shm_end(fs);
+		return;
+	}
+	fs_send(fs, raster, NULL, 0, sizeof(uint32_t));
+}
+
+/* The same for a device that draws colour indices into a palette of up
+   to 255 colours */
+void framestream_frame8(struct framestream *fs, const uint8_t *pixels,
+	const uint32_t *palette, unsigned int colours)
+{
+	unsigned int i, n = fs ? fs->width * fs->height : 0;
+	uint32_t *p;
+
+	if (!fs_due(fs))
+		return;
+	if (fs->shm) {
+		p = (uint32_t *)fs_shm_begin(fs);
+		if (fs->indexed) {
+			fs->shm->colours = colours;
+			memcpy(p, palette, colours * sizeof(uint32_t));
+			memcpy(p + 256, pixels, n);
+		} else {
+			/* Expand straight into the mapping */
+			for (i = 0; i < n; i++)
+				p[i] = palette[pixels[i]];
+		}
+		fs_shm_end(fs);
+		return;
+	}
+	if (fs->indexed) {
+		fs_send(fs, pixels, palette, colours, 1);
+		return;
+	}
+	if (fs->expand == NULL && (fs->expand = malloc(n * sizeof(uint32_t))) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		fs->expand[i] = palette[pixels[i]];
+	fs_send(fs, fs->expand, NULL, 0, sizeof(uint32_t));
+}
+
+void framestream_free(struct framestream *fs)
+{
+	if (fs == NULL)
+		return;
+	if (fs->fd > 2)
+		close(fs->fd);
+	/* The object stays with the last frame in it, as a file would */
+	if (fs->shm)
+		munmap(fs->shm, fs->shmlen);
+	free(fs->shmname);
+	free(fs->last);
+	free(fs->expand);
+	free(fs);
+}
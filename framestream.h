@@ -0,0 +1,50 @@
+#ifndef __FRAMESTREAM_H
+#define __FRAMESTREAM_H
+
+#include <stdint.h>
+
+/*
+ *	Video frame output for the headless renderers. Each device looks for
+ *	its spec in an environment variable so the same binary can run with
+ *	or without a stream. The spec is
+ *
+ *	path|fd:N[,delta][,indexed][,skip=N][,fps=N]
+ *
+ *	Every frame is a 16 byte header followed by either the whole raster
+ *	or, with delta, runs of rows that differ from the last frame sent.
+ *	With indexed, devices that draw colour indices send a byte a pixel
+ *	after a palette of as many 32bit entries as the header says.
+ *
+ *	shm:/name instead of a path publishes frames in a POSIX shared
+ *	memory object laid out as below, for viewers that map it and poll.
+ *	Frames alternate between two buffers. seq is odd while frame
+ *	(seq + 1) / 2 is being written into buffer ((seq + 1) / 2) & 1 and
+ *	even once it is done, so the newest whole frame is number seq / 2
+ *	in buffer (seq / 2) & 1. That buffer is left alone until seq reaches
+ *	seq / 2 * 2 + 3, which a viewer can check after reading it. Frame
+ *	numbers start at 1. An indexed buffer starts with 256 palette
+ *	entries.
+ */
+
+struct framestream_shm {
+	uint8_t magic[4];	/* VSHM */
+	uint8_t bpp;		/* 1 for indexed or 4 */
+	uint8_t colours;	/* Palette entries in use when indexed */
+	uint16_t width;
+	uint16_t height;
+	uint16_t pad;
+	uint32_t size;		/* Bytes in each buffer */
+	uint32_t offset[2];	/* Of each buffer from the start */
+	uint32_t frame[2];	/* Device frame count, skipped ones too */
+	uint32_t seq;
+};
+
+struct framestream;
+
+extern struct framestream *framestream_create(const char *env, unsigned int width, unsigned int height);
+extern void framestream_frame(struct framestream *fs, const uint32_t *raster);
+extern void framestream_frame8(struct framestream *fs, const uint8_t *pixels,
+	const uint32_t *palette, unsigned int colours);
+extern void framestream_free(struct framestream *fs);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ *	Pre-expanded character glyphs for the character mapped displays
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "glyphcache.h"
+
+struct glyphcache *glyphcache_create(unsigned int count, unsigned int width,
+    unsigned int height)
+{
+    struct glyphcache *g = malloc(sizeof(struct glyphcache));
+
+    if (g)
+        g->pixels = calloc(count * width * height, sizeof(uint32_t));
+    if (g == NULL || g->pixels == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    g->count = count;
+    g->width = width;
+    g->height = height;
+    return g;
+}
+
+void glyphcache_free(struct glyphcache *g)
+{
+    free(g->pixels);
+    free(g);
+}
+
+/* Expand glyph c from its height font rows */
+void glyphcache_set(struct glyphcache *g, unsigned int c, const uint8_t *rows,
+    uint32_t fg, uint32_t bg)
+{
+    uint32_t *p = g->pixels + c * g->width * g->height;
+    unsigned int y, x;
+
+    for (y = 0; y < g->height; y++) {
+        uint8_t bits = *rows++;
+        for (x = 0; x < g->width; x++) {
+            *p++ = (bits & 0x80) ? fg : bg;
+            bits <<= 1;
+        }
+    }
+}
+
+/* Expand every glyph from a font with stride bytes per character */
+void glyphcache_load(struct glyphcache *g, const uint8_t *font,
+    unsigned int stride, uint32_t fg, uint32_t bg)
+{
+    unsigned int c;
+
+    for (c = 0; c < g->count; c++)
+        glyphcache_set(g, c, font + c * stride, fg, bg);
+}
+
+/* Copy glyph c into a frame with pitch pixels per line */
+void glyphcache_draw(struct glyphcache *g, unsigned int c, uint32_t *out,
+    unsigned int pitch)
+{
+    const uint32_t *p = g->pixels + c * g->width * g->height;
+    size_t len = g->width * sizeof(uint32_t);
+    unsigned int y;
+
+    for (y = 0; y < g->height; y++) {
+        memcpy(out, p, len);
+        p += g->width;
+        out += pitch;
+    }
+}
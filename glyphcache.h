@@ -0,0 +1,30 @@
+#ifndef __GLYPHCACHE_H
+#define __GLYPHCACHE_H
+
+#include <stdint.h>
+
+/*
+ *	A font expanded into 32bit pixels ahead of time so that drawing a
+ *	character cell is a memcpy per row. Each font row is one byte with
+ *	the leftmost pixel in the top bit, and a glyph uses the top width
+ *	bits of it. Expand the glyphs again when the colours change.
+ */
+
+struct glyphcache {
+    unsigned int count;
+    unsigned int width;		/* Pixels, 1-8 */
+    unsigned int height;	/* Rows */
+    uint32_t *pixels;		/* count glyphs of height rows of width */
+};
+
+extern struct glyphcache *glyphcache_create(unsigned int count,
+    unsigned int width, unsigned int height);
+extern void glyphcache_free(struct glyphcache *g);
+extern void glyphcache_set(struct glyphcache *g, unsigned int c,
+    const uint8_t *rows, uint32_t fg, uint32_t bg);
+extern void glyphcache_load(struct glyphcache *g, const uint8_t *font,
+    unsigned int stride, uint32_t fg, uint32_t bg);
+extern void glyphcache_draw(struct glyphcache *g, unsigned int c,
+    uint32_t *out, unsigned int pitch);
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <string.h>
+#include "guestmem.h"
+
+void guestmem_init(struct guestmem *m,
+    uint8_t (*read)(int unused, uint16_t addr),
+    void (*write)(int unused, uint16_t addr, uint8_t val))
+{
+    m->read = read;
+    m->write = write;
+    m->rpage = NULL;
+    m->wpage = NULL;
+    m->shift = 12;
+}
+
+/* Host pages the memory map resolves to, NULL entries and a NULL table
+   meaning go through the memory handlers */
+void guestmem_set_pages(struct guestmem *m, uint8_t **rpage, uint8_t **wpage,
+    unsigned int shift)
+{
+    m->rpage = rpage;
+    m->wpage = wpage;
+    m->shift = shift;
+}
+
+void guestmem_put(struct guestmem *m, uint16_t addr, const uint8_t *p, unsigned int len)
+{
+    unsigned int psize = 1 << m->shift;
+    unsigned int n, i;
+    uint8_t *dp;
+
+    while (len) {
+        n = psize - (addr & (psize - 1));
+        if (n > len)
+            n = len;
+        dp = m->wpage ? m->wpage[addr >> m->shift] : NULL;
+        if (dp)
+            memcpy(dp + (addr & (psize - 1)), p, n);
+        else
+            for (i = 0; i < n; i++)
+                m->write(0, addr + i, p[i]);
+        addr += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void guestmem_get(struct guestmem *m, uint16_t addr, uint8_t *p, unsigned int len)
+{
+    unsigned int psize = 1 << m->shift;
+    unsigned int n, i;
+    uint8_t *sp;
+
+    while (len) {
+        n = psize - (addr & (psize - 1));
+        if (n > len)
+            n = len;
+        sp = m->rpage ? m->rpage[addr >> m->shift] : NULL;
+        if (sp)
+            memcpy(p, sp + (addr & (psize - 1)), n);
+        else
+            for (i = 0; i < n; i++)
+                p[i] = m->read(0, addr + i);
+        addr += n;
+        p += n;
+        len -= n;
+    }
+}
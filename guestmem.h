@@ -0,0 +1,30 @@
+#ifndef __GUESTMEM_H
+#define __GUESTMEM_H
+
+#include <stdint.h>
+
+/*
+ *	Block copies between the host and emulated memory for the
+ *	paravirtual devices. Pages the board's map resolves to host memory
+ *	are copied in one go, and anything else goes a byte at a time
+ *	through the board's memory handlers so banking, ROM and watches all
+ *	still apply. Addresses wrap at 64K.
+ */
+
+struct guestmem {
+    uint8_t (*read)(int unused, uint16_t addr);
+    void (*write)(int unused, uint16_t addr, uint8_t val);
+    uint8_t **rpage;		/* Host memory map, see guestmem_set_pages */
+    uint8_t **wpage;
+    unsigned int shift;
+};
+
+extern void guestmem_init(struct guestmem *m,
+    uint8_t (*read)(int unused, uint16_t addr),
+    void (*write)(int unused, uint16_t addr, uint8_t val));
+extern void guestmem_set_pages(struct guestmem *m, uint8_t **rpage, uint8_t **wpage,
+    unsigned int shift);
+extern void guestmem_put(struct guestmem *m, uint16_t addr, const uint8_t *p, unsigned int len);
+extern void guestmem_get(struct guestmem *m, uint16_t addr, uint8_t *p, unsigned int len);
+
+#endif
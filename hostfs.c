@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "hostfs.h"
+#include "trace.h"
+
+/*
+ *	Host directory passthrough. The guest only ever sees the plain
+ *	files directly in the directory: names with a path in them or
+ *	starting with a dot are refused and symbolic links are not
+ *	followed, so nothing outside can be reached.
+ */
+
+static uint16_t hostfs_reg16(struct hostfs *h, unsigned int r)
+{
+    return h->reg[r] | (h->reg[r + 1] << 8);
+}
+
+static void hostfs_result(struct hostfs *h, unsigned int v)
+{
+    h->reg[6] = v;
+    h->reg[7] = v >> 8;
+}
+
+/* Fetch and check a name from the guest */
+static int hostfs_name(struct hostfs *h, char *name)
+{
+    guestmem_get(&h->mem, hostfs_reg16(h, 0), (uint8_t *)name, HOSTFS_NAME);
+    if (memchr(name, 0, HOSTFS_NAME) == NULL)
+        return ENAMETOOLONG;
+    if (*name == 0 || *name == '.' || strchr(name, '/'))
+        return EINVAL;
+    return 0;
+}
+
+static int hostfs_open(struct hostfs *h, int flags)
+{
+    char name[HOSTFS_NAME];
+    struct stat st;
+    int err = hostfs_name(h, name);
+    int i, fd;
+
+    if (err)
+        return err;
+    for (i = 0; i < HOSTFS_FILES; i++)
+        if (h->fd[i] == -1)
+            break;
+    if (i == HOSTFS_FILES)
+        return EMFILE;
+    /* Non blocking until we know it is a plain file, as opening a FIFO
+       for reading would otherwise wait for a writer */
+    fd = openat(h->dirfd, name, flags | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK, 0644);
+    if (fd == -1)
+        return errno;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return EINVAL;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    if (TRACE_ON(h->trace))
+        fprintf(stderr, "hostfs: %d is %s.\n", i, name);
+    h->fd[i] = fd;
+    h->reg[4] = i;
+    hostfs_result(h, i);
+    return 0;
+}
+
+static int hostfs_file(struct hostfs *h)
+{
+    if (h->reg[4] >= HOSTFS_FILES || h->fd[h->reg[4]] == -1)
+        return -1;
+    return h->fd[h->reg[4]];
+}
+
+static int hostfs_io(struct hostfs *h, int wr)
+{
+    int fd = hostfs_file(h);
+    unsigned int len = hostfs_reg16(h, 2);
+    ssize_t n;
+
+    if (fd == -1)
+        return EBADF;
+    if (wr) {
+        guestmem_get(&h->mem, hostfs_reg16(h, 0), h->buf, len);
+        n = write(fd, h->buf, len);
+    } else
+        n = read(fd, h->buf, len);
+    if (n == -1)
+        return errno;
+    if (!wr)
+        guestmem_put(&h->mem, hostfs_reg16(h, 0), h->buf, n);
+    h->moved += n;
+    hostfs_result(h, n);
+    return 0;
+}
+
+static void hostfs_dir_end(struct hostfs *h)
+{
+    if (h->dir)
+        closedir(h->dir);
+    h->dir = NULL;
+}
+
+static int hostfs_dir(struct hostfs *h)
+{
+    int fd;
+
+    hostfs_dir_end(h);
+    fd = openat(h->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return errno;
+    h->dir = fdopendir(fd);
+    if (h->dir == NULL) {
+        close(fd);
+        return errno;
+    }
+    hostfs_result(h, 0);
+    return 0;
+}
+
+static int hostfs_next(struct hostfs *h)
+{
+    struct dirent *de;
+    struct stat st;
+    size_t len;
+    uint32_t size;
+
+    if (h->dir == NULL)
+        return EBADF;
+    while ((de = readdir(h->dir)) != NULL) {
+        len = strlen(de->d_name);
+        if (de->d_name[0] == '.' || len >= HOSTFS_NAME)
+            continue;
+        if (fstatat(h->dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+            !S_ISREG(st.st_mode))
+            continue;
+        size = st.st_size > 0xFFFFFFFF ? 0xFFFFFFFF : st.st_size;
+        memcpy(h->buf, de->d_name, len + 1);
+        h->buf[len + 1] = size;
+        h->buf[len + 2] = size >> 8;
+        h->buf[len + 3] = size >> 16;
+        h->buf[len + 4] = size >> 24;
+        guestmem_put(&h->mem, hostfs_reg16(h, 0), h->buf, len + 5);
+        hostfs_result(h, len + 5);
+        return 0;
+    }
+    hostfs_dir_end(h);
+    hostfs_result(h, 0);
+    return 0;
+}
+
+static int hostfs_command(struct hostfs *h, uint8_t cmd)
+{
+    int fd;
+
+    switch (cmd) {
+    case HOSTFS_OPEN:
+        return hostfs_open(h, O_RDONLY);
+    case HOSTFS_CREATE:
+        return hostfs_open(h, O_WRONLY | O_CREAT | O_TRUNC);
+    case HOSTFS_READ:
+        return hostfs_io(h, 0);
+    case HOSTFS_WRITE:
+        return hostfs_io(h, 1);
+    case HOSTFS_CLOSE:
+        fd = hostfs_file(h);
+        if (fd == -1)
+            return EBADF;
+        h->fd[h->reg[4]] = -1;
+        hostfs_result(h, 0);
+        if (close(fd) == -1)
+            return errno;
+        return 0;
+    case HOSTFS_DIR:
+        return hostfs_dir(h);
+    case HOSTFS_NEXT:
+        return hostfs_next(h);
+    }
+    return EINVAL;
+}
+
+uint8_t hostfs_read(struct hostfs *h, uint8_t addr)
+{
+    return h->reg[addr & 7];
+}
+
+void hostfs_write(struct hostfs *h, uint8_t addr, uint8_t val)
+{
+    int err;
+
+    addr &= 7;
+    if (addr != 5) {
+        h->reg[addr] = val;
+        return;
+    }
+    err = hostfs_command(h, val);
+    if (err) {
+        if (TRACE_ON(h->trace))
+            fprintf(stderr, "hostfs: command %02X failed: %s\n", val, strerror(err));
+        hostfs_result(h, err);
+        h->reg[5] = HOSTFS_READY | HOSTFS_ERR;
+    } else
+        h->reg[5] = HOSTFS_READY;
+}
+
+/* Closes anything the guest left open */
+void hostfs_reset(struct hostfs *h)
+{
+    unsigned int i;
+
+    for (i = 0; i < HOSTFS_FILES; i++) {
+        if (h->fd[i] != -1)
+            close(h->fd[i]);
+        h->fd[i] = -1;
+    }
+    hostfs_dir_end(h);
+    memset(h->reg, 0, sizeof(h->reg));
+    h->reg[5] = HOSTFS_READY;
+}
+
+struct hostfs *hostfs_create(const char *path,
+    uint8_t (*mem_read)(int unused, uint16_t addr),
+    void (*mem_write)(int unused, uint16_t addr, uint8_t val))
+{
+    struct hostfs *h = calloc(1, sizeof(struct hostfs));
+    unsigned int i;
+
+    if (h == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    h->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (h->dirfd == -1) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < HOSTFS_FILES; i++)
+        h->fd[i] = -1;
+    guestmem_init(&h->mem, mem_read, mem_write);
+    hostfs_reset(h);
+    return h;
+}
+
+void hostfs_free(struct hostfs *h)
+{
+    hostfs_reset(h);
+    close(h->dirfd);
+    free(h);
+}
+
+void hostfs_trace(struct hostfs *h, int onoff)
+{
+    h->trace = onoff;
+}
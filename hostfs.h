@@ -0,0 +1,58 @@
+#ifndef __HOSTFS_H
+#define __HOSTFS_H
+
+#include <stdint.h>
+#include "guestmem.h"
+
+/*
+ *	Host directory passthrough. Eight ports through which the guest
+ *	opens, reads, writes and lists the plain files of one host
+ *	directory, with the data copied straight to and from its memory.
+ *
+ *	0-1	Memory address, low byte first
+ *	2-3	Length in bytes
+ *	4	File handle
+ *	5	Command (write) / status (read)
+ *	6-7	Result: bytes moved, the handle opened or the errno
+ *
+ *	Names are NUL terminated at the memory address, without any path.
+ *	HOSTFS_NEXT puts the next name in the buffer followed by its size
+ *	as four bytes low first and a result of 0 ends the list.
+ */
+
+#define HOSTFS_OPEN	0x01		/* Open for reading */
+#define HOSTFS_CREATE	0x02		/* Create or truncate for writing */
+#define HOSTFS_READ	0x03
+#define HOSTFS_WRITE	0x04
+#define HOSTFS_CLOSE	0x05
+#define HOSTFS_DIR	0x06		/* Start the file list again */
+#define HOSTFS_NEXT	0x07
+
+#define HOSTFS_ERR	0x01		/* Status: the last command failed */
+#define HOSTFS_READY	0x40
+
+#define HOSTFS_REGS	8
+#define HOSTFS_FILES	4
+#define HOSTFS_NAME	64
+
+struct hostfs {
+    uint8_t reg[HOSTFS_REGS];
+    int dirfd;
+    int fd[HOSTFS_FILES];
+    void *dir;				/* Listing in progress */
+    struct guestmem mem;
+    uint8_t buf[65536];
+    unsigned long long moved;		/* Bytes read and written */
+    unsigned int trace;
+};
+
+extern struct hostfs *hostfs_create(const char *path,
+    uint8_t (*mem_read)(int unused, uint16_t addr),
+    void (*mem_write)(int unused, uint16_t addr, uint8_t val));
+extern void hostfs_free(struct hostfs *h);
+extern void hostfs_reset(struct hostfs *h);
+extern void hostfs_trace(struct hostfs *h, int onoff);
+extern uint8_t hostfs_read(struct hostfs *h, uint8_t addr);
+extern void hostfs_write(struct hostfs *h, uint8_t addr, uint8_t val);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ *	Host hardware counters by subsystem, see hostperf.h
+ *
+ *	The counters are opened as one perf_event group for this thread so
+ *	a single read() returns them all taken at the same moment.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "hostperf.h"
+
+#ifdef HOSTPERF
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static const char *group_name[HOSTPERF_GROUPS] = {
+    "runner", "cpu", "disk", "serial", "timer", "video", "net"
+};
+
+static const char *counter_name[HOSTPERF_COUNTERS] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses"
+};
+
+static int hp_fd = -1;
+static uint64_t hp_count[HOSTPERF_GROUPS][HOSTPERF_COUNTERS];
+
+#ifdef HOSTPERF
+
+static int hp_group = HOSTPERF_RUNNER;
+static unsigned int hp_num;			/* Counters opened */
+static int hp_member[HOSTPERF_COUNTERS];	/* Which counter each one is */
+static int hp_fds[HOSTPERF_COUNTERS];
+static uint64_t hp_last[HOSTPERF_COUNTERS];
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} hp_event[HOSTPERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) }
+};
+
+static int hp_open_one(int n, int leader, int kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = hp_event[n].type;
+    attr.config = hp_event[n].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = !kernel;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+int hostperf_open(void)
+{
+    int kernel = 1;
+    int n, fd;
+
+    /* Device polling is mostly system calls so count the kernel side
+       too if we are allowed */
+    hp_fds[0] = hp_open_one(HOSTPERF_CYCLES, -1, kernel);
+    if (hp_fds[0] == -1 && (errno == EACCES || errno == EPERM)) {
+        kernel = 0;
+        hp_fds[0] = hp_open_one(HOSTPERF_CYCLES, -1, kernel);
+    }
+    if (hp_fds[0] == -1) {
+        perror("perf_event_open");
+        return -1;
+    }
+    hp_member[0] = HOSTPERF_CYCLES;
+    hp_num = 1;
+    /* Not every CPU has every event. Count what we can */
+    for (n = 1; n < HOSTPERF_COUNTERS; n++) {
+        fd = hp_open_one(n, hp_fds[0], kernel);
+        if (fd == -1)
+            continue;
+        hp_fds[hp_num] = fd;
+        hp_member[hp_num++] = n;
+    }
+    hp_fd = hp_fds[0];
+    ioctl(hp_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    hostperf_switch(HOSTPERF_RUNNER);
+    return 0;
+}
+
+/* Charge what was counted since the last switch and move to group */
+int hostperf_switch(int group)
+{
+    uint64_t v[1 + HOSTPERF_COUNTERS];
+    int prev = hp_group;
+    unsigned int i;
+
+    hp_group = group;
+    if (hp_fd == -1 || read(hp_fd, v, (1 + hp_num) * sizeof(uint64_t)) <= 0)
+        return prev;
+    for (i = 0; i < hp_num && i < v[0]; i++) {
+        hp_count[prev][hp_member[i]] += v[1 + i] - hp_last[i];
+        hp_last[i] = v[1 + i];
+    }
+    return prev;
+}
+
+void hostperf_close(void)
+{
+    unsigned int i;
+
+    if (hp_fd == -1)
+        return;
+    hostperf_switch(hp_group);
+    for (i = 0; i < hp_num; i++)
+        close(hp_fds[i]);
+    hp_fd = -1;
+}
+
+#else
+
+int hostperf_open(void)
+{
+    return -1;
+}
+
+void hostperf_close(void)
+{
+}
+
+#endif
+
+uint64_t hostperf_count(int group, int counter)
+{
+    return hp_count[group][counter];
+}
+
+const char *hostperf_group_name(int group)
+{
+    return group_name[group];
+}
+
+const char *hostperf_counter_name(int counter)
+{
+    return counter_name[counter];
+}
+
+/* Host cost of each subsystem against the emulated T-states run */
+void hostperf_report(FILE *fp, uint64_t tstates)
+{
+    uint64_t *c;
+    int g;
+
+    if (hp_fd == -1)
+        return;
+#ifdef HOSTPERF
+    /* Take the counts up to now, staying in the same group */
+    hostperf_switch(hp_group);
+#endif
+    fprintf(fp, "%-8s %14s %14s %12s %12s %10s\n", "group", "cycles",
+        "instructions", "br-misses", "l1d-misses", "cyc/tstate");
+    for (g = 0; g < HOSTPERF_GROUPS; g++) {
+        c = hp_count[g];
+        if (c[HOSTPERF_CYCLES] == 0 && c[HOSTPERF_INSNS] == 0)
+            continue;
+        fprintf(fp, "%-8s %14llu %14llu %12llu %12llu %10.3f\n",
+            group_name[g],
+            (unsigned long long)c[HOSTPERF_CYCLES],
+            (unsigned long long)c[HOSTPERF_INSNS],
+            (unsigned long long)c[HOSTPERF_BRANCH_MISS],
+            (unsigned long long)c[HOSTPERF_L1D_MISS],
+            tstates ? (double)c[HOSTPERF_CYCLES] / tstates : 0.0);
+    }
+}
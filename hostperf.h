@@ -0,0 +1,52 @@
+#ifndef __HOSTPERF_H
+#define __HOSTPERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ *	Host hardware counters by subsystem, for make HOSTPERF=1 builds.
+ *	Linux perf_event counts host cycles, instructions, branch misses
+ *	and L1 data cache misses for the emulator thread. The board says
+ *	which subsystem it is about to run with hostperf_switch() and
+ *	everything counted since the last switch goes to the one before,
+ *	so the groups add up to the whole run. Event callbacks are charged
+ *	to the group in their struct event.
+ *
+ *	Each switch costs a read() so the counts include a little of their
+ *	own overhead. Other builds compile hostperf_switch() to nothing and
+ *	hostperf_open() reports there is nothing to show.
+ */
+
+#define HOSTPERF_RUNNER		0	/* Main loop, event queue and the rest */
+#define HOSTPERF_CPU		1	/* CPU core, memory and I/O decode */
+#define HOSTPERF_DISK		2
+#define HOSTPERF_SERIAL		3
+#define HOSTPERF_TIMER		4
+#define HOSTPERF_VIDEO		5
+#define HOSTPERF_NET		6
+#define HOSTPERF_GROUPS		7
+
+#define HOSTPERF_CYCLES		0
+#define HOSTPERF_INSNS		1
+#define HOSTPERF_BRANCH_MISS	2
+#define HOSTPERF_L1D_MISS	3
+#define HOSTPERF_COUNTERS	4
+
+extern int hostperf_open(void);
+extern void hostperf_close(void);
+extern uint64_t hostperf_count(int group, int counter);
+extern const char *hostperf_group_name(int group);
+extern const char *hostperf_counter_name(int counter);
+extern void hostperf_report(FILE *fp, uint64_t tstates);
+
+#ifdef HOSTPERF
+extern int hostperf_switch(int group);
+#else
+static inline int hostperf_switch(int group)
+{
+    return HOSTPERF_RUNNER;
+}
+#endif
+
+#endif
@@ -17,6 +17,7 @@
 #include "parity.h"
 
 #include "i8008.h"
+#include "trace.h"
 
 struct i8008 {
 	uint16_t callstack[8];	/* PC is part of the hardware call stack */
@@ -53,19 +54,29 @@ struct i8008 {
 	unsigned int cycle_count;	/* Needed for bit bang serial emulation */
 
 	bool halted;
+
+	/* Banks the board has handed us directly, NULL to call it */
+	uint8_t *rmap[64];
+	uint8_t *wmap[64];
 };
 
-#define tprintf		if (cpu->trace) printf
+#define tprintf		if (TRACE_ON(cpu->trace)) printf
 
 static void what_changed(struct i8008 *cpu);
 
 static const char *regnames = "ABCDEHLM";
 static const char *concode = "CZSP";
 
+static uint8_t read_bank(struct i8008 *cpu, uint8_t bank, uint8_t off)
+{
+	if (cpu->rmap[bank])
+		return cpu->rmap[bank][off];
+	return mem_read(cpu, (bank << 8) | off, 0);
+}
+
 static uint8_t read_M(struct i8008 *cpu)
 {
-	uint8_t bank = cpu->reg_h & 0x3F;
-	return mem_read(cpu, (bank << 8) | cpu->reg_l, 0);
+	return read_bank(cpu, cpu->reg_h & 0x3F, cpu->reg_l);
 }
 
 static uint8_t read_M_debug(struct i8008 *cpu)
@@ -77,7 +88,10 @@ static uint8_t read_M_debug(struct i8008 *cpu)
 static void write_M(struct i8008 *cpu, uint8_t val)
 {
 	uint8_t bank = cpu->reg_h & 0x3f;
-	mem_write(cpu, (bank << 8) | cpu->reg_l, val);
+	if (cpu->wmap[bank])
+		cpu->wmap[bank][cpu->reg_l] = val;
+	else
+		mem_write(cpu, (bank << 8) | cpu->reg_l, val);
 }
 
 /* The detail matters - 0xFF is halt and some setups rely on
@@ -93,7 +107,7 @@ static uint8_t fetch(struct i8008 *cpu)
 		if (cpu->ins_jpos >= cpu->ins_jlen)
 			cpu->ins_jpos = -1;
 	} else {
-		r = mem_read(cpu, (bank << 8) | (cpu->reg_pc & 0xff), 0);
+		r = read_bank(cpu, bank, cpu->reg_pc & 0xff);
 		cpu->reg_pc++;
 	}
 	tprintf("%o ", r);
@@ -395,7 +409,7 @@ static void execute_op(struct i8008 *cpu, uint8_t op)
 			jumpcall(cpu, op);
 	} else
 		opcode00(cpu, op);
-	if (cpu->trace)
+	if (TRACE_ON(cpu->trace))
 		what_changed(cpu);
 	tprintf("\n");
 	if (cpu->step)
@@ -424,6 +438,8 @@ static void execute_one(struct i8008 *cpu)
 	}
 }
 
+/* Runs until the time is up or we halt, which includes i8008_halt() from
+   a signal or device wanting our attention */
 unsigned int i8008_execute(struct i8008 *cpu, unsigned int tstates)
 {
 	cpu->cycle_count = 0;
@@ -507,12 +523,20 @@ struct i8008 *i8008_create(void)
 		fprintf(stderr, "Out of memory.\n");
 		exit(1);
 	}
-	cpu->cycle_count = 0;
+	memset(cpu, 0, sizeof(struct i8008));
 	cpu->breakpt = 0xFFFF;	/* Impossible address */
 	i8008_reset(cpu);
 	return cpu;
 }
 
+/* Let the core read and write a 256 byte bank directly. A NULL pointer
+   leaves that direction to mem_read or mem_write */
+void i8008_map(struct i8008 *cpu, unsigned int bank, uint8_t *rd, uint8_t *wr)
+{
+	cpu->rmap[bank & 0x3F] = rd;
+	cpu->wmap[bank & 0x3F] = wr;
+}
+
 void i8008_trace(struct i8008 *cpu, unsigned int trace)
 {
 	cpu->trace = trace;
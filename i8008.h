@@ -14,6 +14,7 @@ extern void i8008_singlestep(struct i8008 *cpu, unsigned int onoff);
 extern void i8008_halt(struct i8008 *cpu, unsigned int onoff);
 extern unsigned int i8008_execute(struct i8008 *cpu, unsigned int tstates);
 extern unsigned int i8008_get_cycles(struct i8008 *cpu);
+extern void i8008_map(struct i8008 *cpu, unsigned int bank, uint8_t *rd, uint8_t *wr);
 
 /* Platform provided */
 
@@ -0,0 +1,792 @@
+/*
+ *	Peripheral control block of the 80C186/80C188
+ *
+ *	Three timers, two DMA channels and the interrupt controller in
+ *	master mode. The chip select registers are kept so software can
+ *	read back what it set but the board does its own decode.
+ *
+ *	Not modelled:
+ *	Slave mode, cascade and special fully nested modes
+ *	External timer clocks and retriggering
+ *	DRQ pins. Synchronised transfers run as if the request is present
+ *	A PCB relocated into memory space
+ *	Refresh and power save
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "i80188_io.h"
+
+#define I80188_NEVER	UINT64_MAX
+
+/* Timer control */
+#define TMR_EN		0x8000
+#define TMR_INH		0x4000
+#define TMR_INT		0x2000
+#define TMR_RIU		0x1000
+#define TMR_MC		0x0020
+#define TMR_RTG		0x0010
+#define TMR_P		0x0008
+#define TMR_EXT		0x0004
+#define TMR_ALT		0x0002
+#define TMR_CONT	0x0001
+
+/* DMA control */
+#define DMA_DMIO	0x8000
+#define DMA_DDEC	0x4000
+#define DMA_DINC	0x2000
+#define DMA_SMIO	0x1000
+#define DMA_SDEC	0x0800
+#define DMA_SINC	0x0400
+#define DMA_TC		0x0200
+#define DMA_INT		0x0100
+#define DMA_TDRQ	0x0010
+#define DMA_CHG		0x0004
+#define DMA_ST		0x0002
+#define DMA_BW		0x0001
+
+/* Interrupt request bits, which are also how the control registers are
+   indexed */
+#define IRQ_TMR		0
+#define IRQ_DMA0	2
+#define IRQ_DMA1	3
+#define IRQ_INT0	4
+
+#define ICON_MSK	0x0008
+#define ICON_LTM	0x0010
+
+#define INSTS_DHLT	0x8000
+
+struct i80188_timer {
+    uint16_t count;
+    uint16_t cmpa;
+    uint16_t cmpb;
+    uint16_t con;
+    uint64_t base;		/* Clock at which count was last brought up to date */
+    uint64_t due;		/* When it next reaches max count or I80188_NEVER */
+};
+
+struct i80188_dma {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t tc;
+    uint16_t con;
+};
+
+struct i80188_io {
+    uint16_t relreg;
+    uint16_t base;		/* I/O address of the block */
+    /* Interrupt controller */
+    uint16_t icon[8];		/* Control registers by request bit */
+    uint16_t primsk;
+    uint16_t inserv;
+    uint16_t reqst;
+    uint16_t insts;
+    uint8_t pins;		/* INT0-3 levels */
+    /* Timers */
+    struct i80188_timer timer[3];
+    /* DMA */
+    struct i80188_dma dma[2];
+    /* Chip selects */
+    uint16_t cs[5];
+    /* Clocks since reset and the earliest timer deadline */
+    uint64_t clock;
+    uint64_t next;
+
+    e8086_t *cpu;
+    int trace;
+};
+
+/*
+ *	Interrupt controller
+ */
+
+/* Vector type for a request bit. The timers share bit 0 */
+static const uint8_t irq_type[8] = { 8, 0, 10, 11, 12, 13, 14, 15 };
+static const uint8_t timer_type[3] = { 8, 18, 19 };
+
+/* Highest priority in service, 8 if none */
+static unsigned int i80188_serving(struct i80188_io *io)
+{
+    unsigned int best = 8;
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
+        if ((io->inserv & (1 << i)) && (io->icon[i] & 7) < best)
+            best = io->icon[i] & 7;
+    return best;
+}
+
+/* The request that would be acknowledged now, or -1 */
+static int i80188_best(struct i80188_io *io)
+{
+    unsigned int limit = i80188_serving(io);
+    unsigned int i;
+    int best = -1;
+
+    for (i = 0; i < 8; i++) {
+        unsigned int pr = io->icon[i] & 7;
+        if (!(io->reqst & (1 << i)) || (io->icon[i] & ICON_MSK))
+            continue;
+        if (pr > (io->primsk & 7) || pr >= limit)
+            continue;
+        if (best == -1 || pr < (io->icon[best] & 7))
+            best = i;
+    }
+    return best;
+}
+
+static void i80188_recalc(struct i80188_io *io)
+{
+    e86_irq(io->cpu, i80188_best(io) != -1);
+}
+
+/* Acknowledge a request and return its type */
+static unsigned int i80188_ack(struct i80188_io *io, int src)
+{
+    unsigned int type = irq_type[src];
+    unsigned int i;
+
+    io->inserv |= 1 << src;
+    if (src == IRQ_TMR) {
+        for (i = 0; i < 3; i++) {
+            if (io->insts & (1 << i)) {
+                io->insts &= ~(1 << i);
+                type = timer_type[i];
+                break;
+            }
+        }
+        if (!(io->insts & 7))
+            io->reqst &= ~1;
+    } else if (src < IRQ_INT0 || !(io->icon[src] & ICON_LTM))
+        io->reqst &= ~(1 << src);
+    if (io->trace)
+        fprintf(stderr, "[80188: acknowledge type %u]\n", type);
+    i80188_recalc(io);
+    return type;
+}
+
+/* INTA cycle from the CPU */
+static unsigned char i80188_inta(void *ext)
+{
+    struct i80188_io *io = ext;
+    int src = i80188_best(io);
+
+    /* Went away between the request and the acknowledge. The real part
+       offers the lowest priority external vector */
+    if (src == -1)
+        return 15;
+    return i80188_ack(io, src);
+}
+
+static void i80188_eoi(struct i80188_io *io, uint16_t val)
+{
+    unsigned int i;
+    int best = -1;
+
+    if (val & 0x8000) {
+        /* Non specific: the highest priority in service */
+        for (i = 0; i < 8; i++) {
+            if (!(io->inserv & (1 << i)))
+                continue;
+            if (best == -1 || (io->icon[i] & 7) < (io->icon[best] & 7))
+                best = i;
+        }
+    } else {
+        val &= 0x1F;
+        if (val == 8 || val == 18 || val == 19)
+            best = IRQ_TMR;
+        else if (val >= 10 && val <= 15)
+            best = val - 8;
+    }
+    if (best != -1)
+        io->inserv &= ~(1 << best);
+    i80188_recalc(io);
+}
+
+void i80188_interrupt(struct i80188_io *io, unsigned int pin, bool on)
+{
+    uint8_t bit = 1 << pin;
+    unsigned int src = IRQ_INT0 + pin;
+
+    if (on) {
+        /* Edge mode latches the rising edge, level mode follows */
+        if (!(io->pins & bit) || (io->icon[src] & ICON_LTM))
+            io->reqst |= 1 << src;
+        io->pins |= bit;
+    } else {
+        io->pins &= ~bit;
+        if (io->icon[src] & ICON_LTM)
+            io->reqst &= ~(1 << src);
+    }
+    i80188_recalc(io);
+}
+
+/*
+ *	Timers. These count at a quarter of the CPU clock and are brought up
+ *	to date only when read, written or due.
+ */
+
+static void i80188_dma_request(struct i80188_io *io);
+static void i80188_timer_advance(struct i80188_io *io, unsigned int n, uint64_t ticks);
+
+static uint32_t i80188_timer_max(struct i80188_timer *t)
+{
+    uint16_t m = (t->con & TMR_RIU) ? t->cmpb : t->cmpa;
+    return m ? m : 65536;
+}
+
+/* Clocked internally rather than off timer 2 or a pin */
+static bool i80188_timer_free(struct i80188_timer *t, unsigned int n)
+{
+    if (!(t->con & TMR_EN) || (t->con & TMR_EXT))
+        return 0;
+    return n == 2 || !(t->con & TMR_P);
+}
+
+static void i80188_next_deadline(struct i80188_io *io)
+{
+    unsigned int i;
+
+    io->next = I80188_NEVER;
+    for (i = 0; i < 3; i++)
+        if (io->timer[i].due < io->next)
+            io->next = io->timer[i].due;
+}
+
+/* Timer n reached max count */
+static void i80188_timer_expire(struct i80188_io *io, unsigned int n)
+{
+    struct i80188_timer *t = &io->timer[n];
+    unsigned int i;
+
+    t->count = 0;
+    t->con |= TMR_MC;
+    if (t->con & TMR_INT) {
+        io->insts |= 1 << n;
+        io->reqst |= 1 << IRQ_TMR;
+        i80188_recalc(io);
+    }
+    if (t->con & TMR_ALT) {
+        /* Single shot stops after the second count */
+        if ((t->con & TMR_RIU) && !(t->con & TMR_CONT))
+            t->con &= ~TMR_EN;
+        t->con ^= TMR_RIU;
+    } else if (!(t->con & TMR_CONT))
+        t->con &= ~TMR_EN;
+    if (n != 2)
+        return;
+    /* Timer 2 can clock the others and request DMA */
+    for (i = 0; i < 2; i++)
+        if ((io->timer[i].con & (TMR_EN | TMR_EXT | TMR_P)) == (TMR_EN | TMR_P))
+            i80188_timer_advance(io, i, 1);
+    i80188_dma_request(io);
+}
+
+static void i80188_timer_advance(struct i80188_io *io, unsigned int n, uint64_t ticks)
+{
+    struct i80188_timer *t = &io->timer[n];
+
+    while (ticks && (t->con & TMR_EN)) {
+        uint32_t left = i80188_timer_max(t) - t->count;
+        if (ticks < left) {
+            t->count += ticks;
+            return;
+        }
+        ticks -= left;
+        i80188_timer_expire(io, n);
+    }
+}
+
+/* Bring a timer up to the current clock and work out when it next
+   reaches max count */
+static void i80188_timer_sync(struct i80188_io *io, unsigned int n)
+{
+    struct i80188_timer *t = &io->timer[n];
+    uint64_t ticks = (io->clock - t->base) / 4;
+
+    t->base += ticks * 4;
+    if (!i80188_timer_free(t, n)) {
+        t->base = io->clock;
+        t->due = I80188_NEVER;
+        return;
+    }
+    i80188_timer_advance(io, n, ticks);
+    if (i80188_timer_free(t, n))
+        t->due = t->base + (i80188_timer_max(t) - t->count) * 4ULL;
+    else
+        t->due = I80188_NEVER;
+}
+
+static void i80188_timer_sync_all(struct i80188_io *io)
+{
+    /* Timer 2 first as it may clock the others */
+    i80188_timer_sync(io, 2);
+    i80188_timer_sync(io, 0);
+    i80188_timer_sync(io, 1);
+    i80188_next_deadline(io);
+}
+
+static void i80188_timer_control(struct i80188_io *io, unsigned int n, uint16_t val)
+{
+    struct i80188_timer *t = &io->timer[n];
+    uint16_t keep = TMR_EN | TMR_RIU;
+
+    /* EN only changes if INH is set in the same write */
+    if (val & TMR_INH)
+        keep &= ~TMR_EN;
+    val &= ~(TMR_INH | TMR_RIU);
+    if (n == 2)
+        val &= TMR_EN | TMR_INT | TMR_MC | TMR_CONT;
+    t->con = (t->con & keep) | (val & ~keep);
+    /* Stopping a timer clears its pending interrupt status */
+    if (!(t->con & TMR_INT))
+        io->insts &= ~(1 << n);
+    if (!(io->insts & 7))
+        io->reqst &= ~(1 << IRQ_TMR);
+    i80188_recalc(io);
+}
+
+/*
+ *	Advance the clock. Only the compare unless a timer is due.
+ */
+void i80188_event(struct i80188_io *io, unsigned int clocks)
+{
+    io->clock += clocks;
+    if (io->clock < io->next)
+        return;
+    i80188_timer_sync_all(io);
+}
+
+/*
+ *	DMA engine
+ */
+
+/* Move one byte or word and stop the channel if it was the last */
+static unsigned int i80188_dma_unit(struct i80188_io *io, unsigned int ch)
+{
+    struct i80188_dma *d = &io->dma[ch];
+    unsigned int step = (d->con & DMA_BW) ? 2 : 1;
+    unsigned int i;
+
+    /* The 80C188 bus is 8 bits so words go as two bytes */
+    for (i = 0; i < step; i++) {
+        uint8_t byte;
+        if (d->con & DMA_SMIO)
+            byte = i80188_mem_read((d->src + i) & 0xFFFFF);
+        else
+            byte = i80188_io_read(d->src + i);
+        if (d->con & DMA_DMIO)
+            i80188_mem_write((d->dst + i) & 0xFFFFF, byte);
+        else
+            i80188_io_write(d->dst + i, byte);
+    }
+    if (d->con & DMA_SINC)
+        d->src += step;
+    else if (d->con & DMA_SDEC)
+        d->src -= step;
+    if (d->con & DMA_DINC)
+        d->dst += step;
+    else if (d->con & DMA_DDEC)
+        d->dst -= step;
+    d->src &= 0xFFFFF;
+    d->dst &= 0xFFFFF;
+    d->tc--;
+    if ((d->con & DMA_TC) && d->tc == 0) {
+        d->con &= ~DMA_ST;
+        if (d->con & DMA_INT) {
+            io->reqst |= 1 << (IRQ_DMA0 + ch);
+            i80188_recalc(io);
+        }
+        if (io->trace)
+            fprintf(stderr, "[80188: DMA%u complete]\n", ch);
+    }
+    /* Two bus cycles of four clocks each */
+    return 8 * step;
+}
+
+/* A run of bytes between a fixed port and incrementing memory may be
+   handed to the board in one go */
+static unsigned int i80188_dma_bulk(struct i80188_io *io, unsigned int ch, unsigned int n)
+{
+    struct i80188_dma *d = &io->dma[ch];
+    uint16_t con = d->con;
+    size_t len = n;
+    size_t done;
+
+    if ((con & (DMA_BW | DMA_TC)) != DMA_TC)
+        return 0;
+    if (len > (d->tc ? d->tc : 65536))
+        len = d->tc ? d->tc : 65536;
+    if ((con & (DMA_SMIO | DMA_SINC | DMA_SDEC | DMA_DMIO | DMA_DINC | DMA_DDEC))
+        == (DMA_SMIO | DMA_SINC)) {
+        /* Memory to I/O */
+        if (d->src + len > 0x100000)
+            return 0;
+        done = i80188_dma_block(d->dst, d->src, len, 1);
+        d->src += done;
+    } else if ((con & (DMA_SMIO | DMA_SINC | DMA_SDEC | DMA_DMIO | DMA_DINC | DMA_DDEC))
+        == (DMA_DMIO | DMA_DINC)) {
+        /* I/O to memory */
+        if (d->dst + len > 0x100000)
+            return 0;
+        done = i80188_dma_block(d->src, d->dst, len, 0);
+        d->dst += done;
+    } else
+        return 0;
+    if (done == 0)
+        return 0;
+    /* Leave the last byte to go the slow way so completion is handled
+       in one place */
+    if (done == d->tc) {
+        if (con & DMA_SMIO)
+            d->src--;
+        else
+            d->dst--;
+        done--;
+        d->tc -= done;
+        return 8 * done + i80188_dma_unit(io, ch);
+    }
+    d->tc -= done;
+    return 8 * done;
+}
+
+/* Timer 2 reached max count: one transfer on each channel it drives */
+static void i80188_dma_request(struct i80188_io *io)
+{
+    unsigned int i;
+
+    if (io->insts & INSTS_DHLT)
+        return;
+    for (i = 0; i < 2; i++)
+        if ((io->dma[i].con & (DMA_ST | DMA_TDRQ)) == (DMA_ST | DMA_TDRQ))
+            i80188_dma_unit(io, i);
+}
+
+/* Channel that gets the bus, or -1 */
+static int i80188_dma_pick(struct i80188_io *io)
+{
+    bool r0 = (io->dma[0].con & (DMA_ST | DMA_TDRQ)) == DMA_ST;
+    bool r1 = (io->dma[1].con & (DMA_ST | DMA_TDRQ)) == DMA_ST;
+
+    if (io->insts & INSTS_DHLT)
+        return -1;
+    if (r0 && r1 && (io->dma[1].con & 0x20) && !(io->dma[0].con & 0x20))
+        return 1;
+    if (r0)
+        return 0;
+    if (r1)
+        return 1;
+    return -1;
+}
+
+/*
+ *	Run the DMA engine for at most about budget clocks and return the
+ *	clocks used. Zero means the CPU should run.
+ */
+unsigned int i80188_dma(struct i80188_io *io, unsigned int budget)
+{
+    unsigned int used = 0;
+    int ch;
+
+    while (used < budget && (ch = i80188_dma_pick(io)) != -1) {
+        unsigned int n = (budget - used) / 8;
+        unsigned int cost = 0;
+        if (n > 1)
+            cost = i80188_dma_bulk(io, ch, n);
+        if (cost == 0)
+            cost = i80188_dma_unit(io, ch);
+        used += cost;
+    }
+    return used;
+}
+
+/* True if a channel is running unsynchronised or off the DRQ pins. This
+   only changes on a control write or when a transfer finishes so the
+   caller can skip i80188_dma otherwise */
+bool i80188_dma_live(struct i80188_io *io)
+{
+    return i80188_dma_pick(io) != -1;
+}
+
+/*
+ *	Register access. The block is 16 bits wide.
+ */
+
+bool i80188_iospace(struct i80188_io *io, uint16_t addr)
+{
+    if (io->relreg & 0x1000)
+        return 0;
+    return (addr & 0xFF00) == io->base;
+}
+
+uint16_t i80188_read16(struct i80188_io *io, uint16_t addr)
+{
+    struct i80188_timer *t;
+    struct i80188_dma *d;
+    unsigned int i;
+    uint16_t r;
+    int src;
+
+    addr &= 0xFE;
+    switch(addr) {
+    case 0x24:		/* POLL */
+    case 0x26:		/* POLLSTS */
+        src = i80188_best(io);
+        if (src == -1)
+            return 0;
+        if (addr == 0x24)
+            return 0x8000 | i80188_ack(io, src);
+        if (src == IRQ_TMR) {
+            for (i = 0; i < 3; i++)
+                if (io->insts & (1 << i))
+                    return 0x8000 | timer_type[i];
+        }
+        return 0x8000 | irq_type[src];
+    case 0x28:		/* IMASK */
+        r = 0;
+        for (i = 0; i < 8; i++)
+            if (io->icon[i] & ICON_MSK)
+                r |= 1 << i;
+        return r & 0xFD;
+    case 0x2A:
+        return io->primsk;
+    case 0x2C:
+        return io->inserv;
+    case 0x2E:
+        return io->reqst;
+    case 0x30:
+        return io->insts;
+    case 0x32:
+        return io->icon[IRQ_TMR];
+    case 0x34:
+    case 0x36:
+    case 0x38:
+    case 0x3A:
+    case 0x3C:
+    case 0x3E:
+        return io->icon[(addr - 0x30) / 2];
+    case 0x50: case 0x58: case 0x60:
+        i = (addr - 0x50) / 8;
+        i80188_timer_sync_all(io);
+        return io->timer[i].count;
+    case 0x52: case 0x5A: case 0x62:
+        return io->timer[(addr - 0x50) / 8].cmpa;
+    case 0x54: case 0x5C:
+        return io->timer[(addr - 0x50) / 8].cmpb;
+    case 0x56: case 0x5E: case 0x66:
+        t = &io->timer[(addr - 0x50) / 8];
+        return t->con;
+    case 0xA0: case 0xA2: case 0xA4: case 0xA6: case 0xA8:
+        return io->cs[(addr - 0xA0) / 2];
+    case 0xC0: case 0xD0:
+        return io->dma[(addr >> 4) & 1].src;
+    case 0xC2: case 0xD2:
+        return io->dma[(addr >> 4) & 1].src >> 16;
+    case 0xC4: case 0xD4:
+        return io->dma[(addr >> 4) & 1].dst;
+    case 0xC6: case 0xD6:
+        return io->dma[(addr >> 4) & 1].dst >> 16;
+    case 0xC8: case 0xD8:
+        return io->dma[(addr >> 4) & 1].tc;
+    case 0xCA: case 0xDA:
+        d = &io->dma[(addr >> 4) & 1];
+        return d->con;
+    case 0xFE:
+        return io->relreg;
+    }
+    if (io->trace)
+        fprintf(stderr, "[80188: read of unknown PCB register %02X]\n", addr);
+    return 0;
+}
+
+void i80188_write16(struct i80188_io *io, uint16_t addr, uint16_t val)
+{
+    struct i80188_dma *d;
+    unsigned int i;
+
+    addr &= 0xFE;
+    if (io->trace)
+        fprintf(stderr, "[80188: PCB %02X <- %04X]\n", addr, val);
+    switch(addr) {
+    case 0x22:
+        i80188_eoi(io, val);
+        return;
+    case 0x28:
+        for (i = 0; i < 8; i++) {
+            io->icon[i] &= ~ICON_MSK;
+            if (val & (1 << i))
+                io->icon[i] |= ICON_MSK;
+        }
+        break;
+    case 0x2A:
+        io->primsk = val & 7;
+        break;
+    case 0x2C:
+        io->inserv = val & 0xFD;
+        break;
+    case 0x30:
+        io->insts = val & (INSTS_DHLT | 7);
+        if (io->insts & 7)
+            io->reqst |= 1 << IRQ_TMR;
+        else
+            io->reqst &= ~(1 << IRQ_TMR);
+        break;
+    case 0x32:
+        io->icon[IRQ_TMR] = val & 0x0F;
+        break;
+    case 0x34:
+    case 0x36:
+        io->icon[(addr - 0x30) / 2] = val & 0x0F;
+        break;
+    case 0x38:
+    case 0x3A:
+        io->icon[(addr - 0x30) / 2] = val & 0x7F;
+        break;
+    case 0x3C:
+    case 0x3E:
+        io->icon[(addr - 0x30) / 2] = val & 0x1F;
+        break;
+    case 0x50: case 0x58: case 0x60:
+        i80188_timer_sync_all(io);
+        io->timer[(addr - 0x50) / 8].count = val;
+        break;
+    case 0x52: case 0x5A: case 0x62:
+        i80188_timer_sync_all(io);
+        io->timer[(addr - 0x50) / 8].cmpa = val;
+        break;
+    case 0x54: case 0x5C:
+        i80188_timer_sync_all(io);
+        io->timer[(addr - 0x50) / 8].cmpb = val;
+        break;
+    case 0x56: case 0x5E: case 0x66:
+        i80188_timer_sync_all(io);
+        i80188_timer_control(io, (addr - 0x50) / 8, val);
+        break;
+    case 0xA0: case 0xA2: case 0xA4: case 0xA6: case 0xA8:
+        io->cs[(addr - 0xA0) / 2] = val;
+        return;
+    case 0xC0: case 0xD0:
+        d = &io->dma[(addr >> 4) & 1];
+        d->src = (d->src & 0xF0000) | val;
+        return;
+    case 0xC2: case 0xD2:
+        d = &io->dma[(addr >> 4) & 1];
+        d->src = (d->src & 0xFFFF) | ((val & 0x0F) << 16);
+        return;
+    case 0xC4: case 0xD4:
+        d = &io->dma[(addr >> 4) & 1];
+        d->dst = (d->dst & 0xF0000) | val;
+        return;
+    case 0xC6: case 0xD6:
+        d = &io->dma[(addr >> 4) & 1];
+        d->dst = (d->dst & 0xFFFF) | ((val & 0x0F) << 16);
+        return;
+    case 0xC8: case 0xD8:
+        io->dma[(addr >> 4) & 1].tc = val;
+        return;
+    case 0xCA: case 0xDA:
+        d = &io->dma[(addr >> 4) & 1];
+        /* ST only changes if CHG is set in the same write */
+        if (val & DMA_CHG)
+            d->con = val & ~DMA_CHG;
+        else
+            d->con = (val & ~(DMA_CHG | DMA_ST)) | (d->con & DMA_ST);
+        return;
+    case 0xFE:
+        io->relreg = val & 0x70FF;
+        io->base = (val & 0xFF) << 8;
+        if (val & 0x1000)
+            fprintf(stderr, "80188: PCB mapped into memory is not supported.\n");
+        return;
+    default:
+        if (io->trace)
+            fprintf(stderr, "[80188: write to unknown PCB register %02X]\n", addr);
+        return;
+    }
+    /* Timer and interrupt changes */
+    i80188_timer_sync_all(io);
+    i80188_recalc(io);
+}
+
+/* An 8 bit access sees half of the register. A byte write leaves the
+   other half alone */
+uint8_t i80188_read(struct i80188_io *io, uint16_t addr)
+{
+    uint16_t r = i80188_read16(io, addr);
+    return (addr & 1) ? (r >> 8) : r;
+}
+
+void i80188_write(struct i80188_io *io, uint16_t addr, uint8_t val)
+{
+    uint16_t r;
+
+    /* Don't acknowledge or advance anything reading back the old value */
+    switch(addr & 0xFE) {
+    case 0x22:
+    case 0x24:
+    case 0x26:
+        r = 0;
+        break;
+    default:
+        r = i80188_read16(io, addr);
+    }
+    if (addr & 1)
+        r = (r & 0x00FF) | (val << 8);
+    else
+        r = (r & 0xFF00) | val;
+    i80188_write16(io, addr, r);
+}
+
+void i80188_reset(struct i80188_io *io)
+{
+    unsigned int i;
+
+    memset(io->icon, 0, sizeof(io->icon));
+    for (i = 0; i < 8; i++)
+        io->icon[i] = ICON_MSK | 7;
+    io->primsk = 7;
+    io->inserv = 0;
+    io->reqst = 0;
+    io->insts = 0;
+    memset(io->timer, 0, sizeof(io->timer));
+    for (i = 0; i < 3; i++) {
+        io->timer[i].base = io->clock;
+        io->timer[i].due = I80188_NEVER;
+    }
+    io->next = I80188_NEVER;
+    memset(io->dma, 0, sizeof(io->dma));
+    io->cs[0] = 0xFFFB;		/* UMCS */
+    io->relreg = 0x20FF;
+    io->base = 0xFF00;
+    i80188_recalc(io);
+}
+
+struct i80188_io *i80188_create(e8086_t *cpu)
+{
+    struct i80188_io *io = malloc(sizeof(struct i80188_io));
+    if (io == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memset(io, 0, sizeof(struct i80188_io));
+    io->cpu = cpu;
+    /* Set directly as the setter takes the hook as a void * */
+    cpu->inta_ext = io;
+    cpu->inta = i80188_inta;
+    i80188_reset(io);
+    return io;
+}
+
+void i80188_free(struct i80188_io *io)
+{
+    free(io);
+}
+
+void i80188_trace(struct i80188_io *io, int trace)
+{
+    io->trace = trace;
+}
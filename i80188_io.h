@@ -0,0 +1,35 @@
+#ifndef __I80188_IO_H
+#define __I80188_IO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "80x86/e8086.h"
+
+struct i80188_io;
+
+bool i80188_iospace(struct i80188_io *io, uint16_t addr);
+uint8_t i80188_read(struct i80188_io *io, uint16_t addr);
+void i80188_write(struct i80188_io *io, uint16_t addr, uint8_t val);
+uint16_t i80188_read16(struct i80188_io *io, uint16_t addr);
+void i80188_write16(struct i80188_io *io, uint16_t addr, uint16_t val);
+void i80188_event(struct i80188_io *io, unsigned int clocks);
+void i80188_interrupt(struct i80188_io *io, unsigned int pin, bool on);
+unsigned int i80188_dma(struct i80188_io *io, unsigned int budget);
+bool i80188_dma_live(struct i80188_io *io);
+struct i80188_io *i80188_create(e8086_t *cpu);
+void i80188_reset(struct i80188_io *io);
+void i80188_free(struct i80188_io *io);
+void i80188_trace(struct i80188_io *io, int trace);
+
+/* Caller provided. The DMA engine goes through these for memory and
+   I/O. i80188_dma_block may move len bytes between the port and memory
+   from addr up in one go (to_io gives the direction) and return how
+   many it moved, or 0 if they must go a byte at a time */
+extern uint8_t i80188_mem_read(uint32_t addr);
+extern void i80188_mem_write(uint32_t addr, uint8_t val);
+extern uint8_t i80188_io_read(uint16_t port);
+extern void i80188_io_write(uint16_t port, uint8_t val);
+extern size_t i80188_dma_block(uint16_t port, uint32_t addr, size_t len, int to_io);
+
+#endif
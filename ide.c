@@ -25,13 +25,19 @@
 #include <errno.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ide.h"
+#include "blkcache.h"
+#include "cow.h"
 
 #define IDE_IDLE	0
 #define IDE_CMD		1
 #define IDE_DATA_IN	2
 #define IDE_DATA_OUT	3
+#define IDE_FETCH	4	/* Read posted to the I/O thread */
 
 #define DCR_NIEN 	2
 #define DCR_SRST 	4
@@ -70,9 +76,25 @@
 #define IDE_CMD_SEEK		0x70
 #define IDE_CMD_EDD		0x90
 #define IDE_CMD_INTPARAMS	0x91
+#define IDE_CMD_READ_MULTI	0xC4
+#define IDE_CMD_WRITE_MULTI	0xC5
+#define IDE_CMD_SET_MULTI	0xC6
+#define IDE_CMD_FLUSH		0xE7
 #define IDE_CMD_IDENTIFY	0xEC
 #define IDE_CMD_SETFEATURES	0xEF
 
+/* Largest block we offer for READ/WRITE MULTIPLE */
+#define IDE_MAX_MULTI		16
+#define IDE_FILL_RUN		256	/* Sectors a write when making an image */
+
+/* How hard we try to get guest writes onto the host disk, from IDE_SYNC */
+#define IDE_SYNC_NONE		0	/* Leave it to the host */
+#define IDE_SYNC_FLUSH		1	/* FLUSH CACHE, or every write with the
+					   cache turned off */
+#define IDE_SYNC_WRITE		2	/* Every write command */
+
+static int ide_sync_policy = -1;
+
 const uint8_t ide_magic[8] = {
   '1','D','E','D','1','5','C','0'
 };
@@ -122,11 +144,11 @@ static uint16_t le16(uint16_t v)
   return p[0] | (p[1] << 8);
 }
 
-static void ide_xlate_errno(struct ide_taskfile *t, int len)
+static void ide_xlate_errno(struct ide_taskfile *t, int len, int err)
 {
   t->status |= ST_ERR;
   if (len == -1) {
-    if (errno == EIO)
+    if (err == EIO)
       t->error = ERR_UNC;
     else
       t->error = ERR_AMNF;
@@ -140,6 +162,61 @@ static void ide_fault(struct ide_drive *d, const char *p)
 			(int)(d - d->controller->drive), p);
 }
 
+static int ide_policy(void)
+{
+  const char *p;
+
+  if (ide_sync_policy != -1)
+    return ide_sync_policy;
+  ide_sync_policy = IDE_SYNC_FLUSH;
+  p = getenv("IDE_SYNC");
+  if (p == NULL)
+    return ide_sync_policy;
+  if (strcmp(p, "none") == 0)
+    ide_sync_policy = IDE_SYNC_NONE;
+  else if (strcmp(p, "write") == 0)
+    ide_sync_policy = IDE_SYNC_WRITE;
+  else if (strcmp(p, "flush")) {
+    fprintf(stderr, "IDE_SYNC must be none, flush or write.\n");
+    exit(1);
+  }
+  return ide_sync_policy;
+}
+
+/* Push cached writes out to the image, and on to the host disk if sync */
+static int ide_cache_flush(struct ide_drive *d, int sync)
+{
+  if (d->map)
+    return msync(d->map, d->mapsize, sync ? MS_SYNC : MS_ASYNC);
+  if (blkcache_flush(d->fd) == -1)
+    return -1;
+  if (sync && cow_sync(d->fd) == -1)
+    return -1;
+  return 0;
+}
+
+/* Writes must be on the disk when the command completes */
+static int ide_write_through(struct ide_drive *d)
+{
+  int p = ide_policy();
+  return p == IDE_SYNC_WRITE || (p == IDE_SYNC_FLUSH && !d->wcache);
+}
+
+/* The write cache and FLUSH CACHE feature words */
+static void ide_identify_cache(struct ide_drive *d)
+{
+  uint16_t on = d->wcache && ide_policy() != IDE_SYNC_WRITE ? 1 << 5 : 0;
+
+  if (d->identify[80] == 0)
+    d->identify[80] = le16(0x1E);		/* ATA-1 to ATA-4 */
+  d->identify[82] |= le16(1 << 5);		/* Write cache */
+  d->identify[83] |= le16((1 << 14) | (1 << 12));	/* FLUSH CACHE */
+  d->identify[84] |= le16(1 << 14);
+  d->identify[85] = (d->identify[85] & ~le16(1 << 5)) | le16(on);
+  d->identify[86] |= le16(1 << 12);
+  d->identify[87] |= le16(1 << 14);
+}
+
 /* Disk translation */
 static off_t xlate_block(struct ide_taskfile *t)
 {
@@ -150,7 +227,7 @@ static off_t xlate_block(struct ide_taskfile *t)
 /*    fprintf(stderr, "XLATE LBA %02X:%02X:%02X:%02X\n",
       t->lba4, t->lba3, t->lba2, t->lba1);*/
     if (d->lba)
-      return 2 + (((t->lba4 & DEVH_HEAD) << 24) | (t->lba3 << 16) | (t->lba2 << 8) | t->lba1);
+      return d->base + (((t->lba4 & DEVH_HEAD) << 24) | (t->lba3 << 16) | (t->lba2 << 8) | t->lba1);
     ide_fault(d, "LBA on non LBA drive");
   }
 
@@ -168,7 +245,7 @@ static off_t xlate_block(struct ide_taskfile *t)
   /* Sector 1 is first */
   /* Images generally go cylinder/head/sector. This also matters if we ever
      implement more advanced geometry setting */
-  return 1 + ((cyl * d->heads) + (t->lba4 & DEVH_HEAD)) * d->sectors + t->lba1;
+  return d->base - 1 + ((cyl * d->heads) + (t->lba4 & DEVH_HEAD)) * d->sectors + t->lba1;
 }
 
 /* Indicate the drive is ready */
@@ -193,11 +270,179 @@ static void drive_failed(struct ide_taskfile *tf)
   ready(tf);
 }
 
+/* Position the drive at a block. Transfers use pread/pwrite or the map
+   so there is no file position to move */
+static int ide_seek(struct ide_drive *d, off_t block)
+{
+  if (block == -1)
+    return -1;
+  d->pos = 512 * block;
+  return 0;
+}
+
+/* Read the sectors of a command into the buffer. This may run on the
+   I/O thread so it only touches the transfer fields */
+static void ide_fetch(struct ide_drive *d)
+{
+  ssize_t len = blkcache_pread(d->fd, d->buf, 512 * d->length, d->pos);
+
+  if (len == -1) {
+    d->xerr = errno;
+    perror("ide_prefetch");
+    d->good = 0;
+    d->xlen = -1;
+    return;
+  }
+  d->good = len / 512;
+  d->xlen = len % 512;
+}
+
+/*
+ *	Fetch every sector of a read command in one go. Mapped drives hand
+ *	out the data in place. A short or failed fetch is remembered and
+ *	reported when the guest reaches the first sector we don't have.
+ */
+static void ide_prefetch(struct ide_drive *d)
+{
+  ssize_t len = 512 * d->length;
+
+  d->done = 0;
+  d->xerr = 0;
+  if (d->map) {
+    if (d->pos >= d->mapsize)
+      len = 0;
+    else if (d->pos + len > d->mapsize)
+      len = d->mapsize - d->pos;
+    d->xbuf = d->map + d->pos;
+    d->good = len / 512;
+    d->xlen = len % 512;
+  } else {
+    d->xbuf = d->buf;
+    ide_fetch(d);
+  }
+}
+
+/*
+ *	Asynchronous reads. One helper thread services every drive that asks
+ *	for it. The drive stays BSY with the read queued and the guest sees
+ *	the data once a status read finds the fetch finished. Nothing else
+ *	in the drive is touched until then because BSY locks out the
+ *	registers, and reset or detach wait for it.
+ */
+static pthread_mutex_t ide_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ide_io_post = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ide_io_done = PTHREAD_COND_INITIALIZER;
+static struct ide_drive *ide_io_queue;
+static pid_t ide_io_pid;	/* Threads don't survive a fork */
+
+static void *ide_io_thread(void *unused)
+{
+  struct ide_drive *d;
+
+  pthread_mutex_lock(&ide_io_lock);
+  for(;;) {
+    while (ide_io_queue == NULL)
+      pthread_cond_wait(&ide_io_post, &ide_io_lock);
+    d = ide_io_queue;
+    ide_io_queue = d->io_next;
+    pthread_mutex_unlock(&ide_io_lock);
+    ide_fetch(d);
+    pthread_mutex_lock(&ide_io_lock);
+    d->io_busy = 0;
+    pthread_cond_broadcast(&ide_io_done);
+  }
+  return NULL;
+}
+
+/* Called with ide_io_lock held */
+static int ide_io_start(void)
+{
+  pthread_t t;
+
+  if (ide_io_pid == getpid())
+    return 0;
+  if (pthread_create(&t, NULL, ide_io_thread, NULL))
+    return -1;
+  pthread_detach(t);
+  ide_io_pid = getpid();
+  return 0;
+}
+
+/* Queue the read for the current command, -1 to do it inline instead */
+static int ide_io_post_read(struct ide_drive *d)
+{
+  struct ide_drive **p = &ide_io_queue;
+
+  d->done = 0;
+  d->xerr = 0;
+  d->xbuf = d->buf;
+  pthread_mutex_lock(&ide_io_lock);
+  if (ide_io_start()) {
+    pthread_mutex_unlock(&ide_io_lock);
+    return -1;
+  }
+  while (*p)
+    p = &(*p)->io_next;
+  d->io_next = NULL;
+  d->io_busy = 1;
+  *p = d;
+  pthread_cond_signal(&ide_io_post);
+  pthread_mutex_unlock(&ide_io_lock);
+  return 0;
+}
+
+static void ide_io_wait(struct ide_drive *d)
+{
+  if (d->state != IDE_FETCH)
+    return;
+  pthread_mutex_lock(&ide_io_lock);
+  while (d->io_busy)
+    pthread_cond_wait(&ide_io_done, &ide_io_lock);
+  pthread_mutex_unlock(&ide_io_lock);
+}
+
+/* Write out the sectors the guest has sent so far in one go */
+static int ide_write_commit(struct ide_drive *d)
+{
+  ssize_t want = 512 * d->done;
+  ssize_t len = want;
+
+  if (want == 0)
+    return 0;
+  d->xerr = 0;
+  if (d->map) {
+    if (d->pos >= d->mapsize)
+      len = 0;
+    else if (d->pos + len > d->mapsize)
+      len = d->mapsize - d->pos;
+    memcpy(d->map + d->pos, d->buf, len);
+  } else if ((len = blkcache_pwrite(d->fd, d->buf, want, d->pos)) == -1)
+    d->xerr = errno;
+  d->done = 0;
+  if (len == want && ide_write_through(d) && ide_cache_flush(d, 1) == -1) {
+    d->xerr = errno;
+    len = -1;
+  }
+  if (len == want)
+    return 0;
+  d->taskfile.status |= ST_ERR;
+  d->taskfile.status &= ~ST_DSC;
+  ide_xlate_errno(&d->taskfile, len == -1 ? -1 : 0, d->xerr);
+  return -1;
+}
+
+/* A write interrupted by reset or a new command keeps what was sent */
+static void ide_abort_write(struct ide_drive *d)
+{
+  if (d->state == IDE_DATA_OUT)
+    ide_write_commit(d);
+}
+
 static void data_in_state(struct ide_taskfile *tf)
 {
   struct ide_drive *d = tf->drive;
   d->state = IDE_DATA_IN;
-  d->dptr = d->data + 512;
+  d->dptr = d->dend = NULL;
   /* We don't clear DRDY here, drives may well accept a command at this
      point and at least one firmware for RC2014 assumes this */
   tf->status &= ~ST_BSY;
@@ -209,7 +454,9 @@ static void data_out_state(struct ide_taskfile *tf)
 {
   struct ide_drive *d = tf->drive;
   d->state = IDE_DATA_OUT;
-  d->dptr = d->data;
+  d->done = 0;
+  d->dptr = d->buf;
+  d->dend = d->dptr + 512;
   tf->status &= ~ (ST_BSY|ST_DRDY);
   tf->status |= ST_DRQ;
   d->intrq = 1;			/* Double check */
@@ -228,17 +475,25 @@ static void edd_setup(struct ide_taskfile *tf)
 
 void ide_reset(struct ide_controller *c)
 {
+  ide_io_wait(&c->drive[0]);
+  ide_io_wait(&c->drive[1]);
+  ide_abort_write(&c->drive[0]);
+  ide_abort_write(&c->drive[1]);
   if (c->drive[0].present) {
     edd_setup(&c->drive[0].taskfile);
     /* A drive could clear busy then set DRDY up to 2 minutes later if its
        mindnumbingly slow to start up ! We don't emulate any of that */
     c->drive[0].taskfile.status = ST_DRDY;
     c->drive[0].eightbit = 0;
+    c->drive[0].wcache = 1;
+    ide_identify_cache(&c->drive[0]);
   }
   if (c->drive[1].present) {
     edd_setup(&c->drive[1].taskfile);
     c->drive[1].taskfile.status = ST_DRDY;
     c->drive[1].eightbit = 0;
+    c->drive[1].wcache = 1;
+    ide_identify_cache(&c->drive[1]);
   }
   c->selected = 0;
 }
@@ -286,6 +541,7 @@ static void cmd_identify_complete(struct ide_taskfile *tf)
   data_in_state(tf);
   /* Arrange to copy just the identify buffer */
   d->dptr = d->data;
+  d->dend = d->data + 512;
   d->length = 1;
 }
 
@@ -321,7 +577,7 @@ static void cmd_readsectors_complete(struct ide_taskfile *tf)
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
   /* fprintf(stderr, "READ %d SECTORS @ %ld\n", d->length, d->offset); */
-  if (d->offset == -1 ||  lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (ide_seek(d, d->offset) == -1) {
     tf->status |= ST_ERR;
     tf->status &= ~ST_DSC;
     tf->error |= ERR_IDNF;
@@ -329,10 +585,30 @@ static void cmd_readsectors_complete(struct ide_taskfile *tf)
     completed(tf);
     return;
   }
+  d->block = tf->command == IDE_CMD_READ_MULTI ? d->multiple : 1;
+  if (d->async && d->map == NULL && ide_io_post_read(d) == 0) {
+    tf->status |= ST_BSY;
+    tf->status &= ~ST_DRQ;
+    d->state = IDE_FETCH;
+    return;
+  }
+  ide_prefetch(d);
   /* do the xfer */
   data_in_state(tf);
 }
 
+/* See if a posted read has finished and if so start handing it out */
+static void ide_io_poll(struct ide_drive *d)
+{
+  int busy;
+
+  pthread_mutex_lock(&ide_io_lock);
+  busy = d->io_busy;
+  pthread_mutex_unlock(&ide_io_lock);
+  if (!busy)
+    data_in_state(&d->taskfile);
+}
+
 static void cmd_verifysectors_complete(struct ide_taskfile *tf)
 {
   struct ide_drive *d = tf->drive;
@@ -344,7 +620,7 @@ static void cmd_verifysectors_complete(struct ide_taskfile *tf)
   d->offset = xlate_block(tf);
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
-  if (d->offset == -1 || lseek(d->fd, 512 * (d->offset + d->length - 1), SEEK_SET) == -1) {
+  if (d->offset == -1 || ide_seek(d, d->offset + d->length - 1) == -1) {
     tf->status &= ~ST_DSC;
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
@@ -373,7 +649,7 @@ static void cmd_seek_complete(struct ide_taskfile *tf)
   if (d->failed)
     drive_failed(tf);
   d->offset = xlate_block(tf);
-  if (d->offset == -1 || lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (ide_seek(d, d->offset) == -1) {
     tf->status &= ~ST_DSC;
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
@@ -389,6 +665,10 @@ static void cmd_setfeatures_complete(struct ide_taskfile *tf)
     case 0x01:
       d->eightbit = 1;
       break;
+    case 0x02:
+      d->wcache = 1;
+      ide_identify_cache(d);
+      break;
     case 0x03:
       if ((tf->count & 0xF0) >= 0x20) {
         tf->status |= ST_ERR;
@@ -399,6 +679,15 @@ static void cmd_setfeatures_complete(struct ide_taskfile *tf)
     case 0x81:
       d->eightbit = 0;
       break;
+    case 0x82:
+      /* What the cache holds has to reach the disk now */
+      if (ide_cache_flush(d, ide_policy() != IDE_SYNC_NONE) == -1) {
+        ide_xlate_errno(tf, -1, errno);
+        break;
+      }
+      d->wcache = 0;
+      ide_identify_cache(d);
+      break;
     default:
       tf->status |= ST_ERR;
       tf->error |= ERR_ABRT;
@@ -406,6 +695,20 @@ static void cmd_setfeatures_complete(struct ide_taskfile *tf)
   completed(tf);
 }
 
+static void cmd_setmultiple_complete(struct ide_taskfile *tf)
+{
+  struct ide_drive *d = tf->drive;
+  /* 0 turns it off, otherwise a power of two we can do */
+  if (tf->count > IDE_MAX_MULTI || (tf->count & (tf->count - 1))) {
+    tf->status |= ST_ERR;
+    tf->error |= ERR_ABRT;
+  } else {
+    d->multiple = tf->count;
+    d->identify[59] = le16(tf->count ? 0x100 | tf->count : 0);
+  }
+  completed(tf);
+}
+
 static void cmd_writesectors_complete(struct ide_taskfile *tf)
 {
   struct ide_drive *d = tf->drive;
@@ -419,7 +722,7 @@ static void cmd_writesectors_complete(struct ide_taskfile *tf)
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
 /*  fprintf(stderr, "WRITE %d SECTORS @ %ld\n", d->length, d->offset); */
-  if (d->offset == -1 ||  lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (ide_seek(d, d->offset) == -1) {
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
     tf->status &= ~ST_DSC;
@@ -427,6 +730,7 @@ static void cmd_writesectors_complete(struct ide_taskfile *tf)
     completed(tf);
     return;
   }
+  d->block = tf->command == IDE_CMD_WRITE_MULTI ? d->multiple : 1;
   /* do the xfer */
   data_out_state(tf);
 }
@@ -454,44 +758,49 @@ static void ide_set_error(struct ide_drive *d)
   completed(&d->taskfile);
 }
 
+/* Move on to the next sector of a read */
 static int ide_read_sector(struct ide_drive *d)
 {
-  int len;
-
-  d->dptr = d->data;
-  if ((len = read(d->fd, d->data, 512)) != 512) {
-    perror("ide_read_sector");
+  if (d->done == d->good) {
     d->taskfile.status |= ST_ERR;
     d->taskfile.status &= ~ST_DSC;
-    ide_xlate_errno(&d->taskfile, len);
+    ide_xlate_errno(&d->taskfile, d->xlen, d->xerr);
     return -1;
   }
-  HEXDUMP_DATA(d->data)
-  d->offset += 512;
+  d->dptr = d->xbuf + 512 * d->done++;
+  d->dend = d->dptr + 512;
+  d->moved++;
+  HEXDUMP_DATA(d->dptr)
+  d->offset++;
   return 0;
 }
 
+/* A sector of a write is complete. The data goes out with the last one */
 static int ide_write_sector(struct ide_drive *d)
 {
-  int len;
-
-  d->dptr = d->data;
-  if ((len = write(d->fd, d->data, 512)) != 512) {
-    d->taskfile.status |= ST_ERR;
-    d->taskfile.status &= ~ST_DSC;
-    ide_xlate_errno(&d->taskfile, len);
+  HEXDUMP_DATA(d->dptr - 512)
+  d->done++;
+  d->moved++;
+  d->offset++;
+  if (d->length == 1 && ide_write_commit(d) < 0)
     return -1;
-  }
-  HEXDUMP_DATA(d->data)
-  d->offset += 512;
+  d->dptr = d->buf + 512 * d->done;
+  d->dend = d->dptr + 512;
   return 0;
 }
 
+/* Interrupts come at the end of each block, which is one sector unless
+   this is a READ/WRITE MULTIPLE */
+static int ide_block_end(struct ide_drive *d)
+{
+  return d->length == 0 || d->block <= 1 || d->done % d->block == 0;
+}
+
 static uint16_t ide_data_in(struct ide_drive *d, int len)
 {
   uint16_t v;
   if (d->state == IDE_DATA_IN) {
-    if (d->dptr == d->data + 512) {
+    if (d->dptr == d->dend) {
       if (ide_read_sector(d) < 0) {
         ide_set_error(d);	/* Set the LBA or CHS etc */
         return 0xFFFF;		/* and error bits set by read_sector */
@@ -505,9 +814,10 @@ static uint16_t ide_data_in(struct ide_drive *d, int len)
     } else
       d->dptr++;
     d->taskfile.data = v;
-    if (d->dptr == d->data + 512) {
+    if (d->dptr == d->dend) {
       d->length--;
-      d->intrq = 1;		/* we don't yet emulate multimode */
+      if (ide_block_end(d))
+        d->intrq = 1;
       if (d->length == 0) {
         d->state = IDE_IDLE;
         completed(&d->taskfile);
@@ -535,13 +845,14 @@ static void ide_data_out(struct ide_drive *d, uint16_t v, int len)
       *d->dptr++ = v >> 8;
       d->taskfile.data = v >> 8;
     }
-    if (d->dptr == d->data + 512) {
+    if (d->dptr == d->dend) {
       if (ide_write_sector(d) < 0) {
         ide_set_error(d);
         return;
       }
       d->length--;
-      d->intrq = 1;
+      if (ide_block_end(d))
+        d->intrq = 1;
       if (d->length == 0) {
         d->state = IDE_IDLE;
         d->taskfile.status |= ST_DSC;
@@ -553,6 +864,7 @@ static void ide_data_out(struct ide_drive *d, uint16_t v, int len)
 
 static void ide_issue_command(struct ide_taskfile *t)
 {
+  ide_abort_write(t->drive);
   t->status &= ~(ST_ERR|ST_DRDY);
   t->status |= ST_BSY;
   t->error = 0;
@@ -573,9 +885,28 @@ static void ide_issue_command(struct ide_taskfile *t)
     case IDE_CMD_READ_NR:	/* 0x21 */
       cmd_readsectors_complete(t);
       break;
+    case IDE_CMD_READ_MULTI:	/* 0xC4 */
+    case IDE_CMD_WRITE_MULTI:	/* 0xC5 */
+      if (t->drive->multiple == 0) {
+        t->status |= ST_ERR;
+        t->error |= ERR_ABRT;
+        completed(t);
+      } else if (t->command == IDE_CMD_READ_MULTI)
+        cmd_readsectors_complete(t);
+      else
+        cmd_writesectors_complete(t);
+      break;
+    case IDE_CMD_SET_MULTI:	/* 0xC6 */
+      cmd_setmultiple_complete(t);
+      break;
     case IDE_CMD_SETFEATURES:	/* 0xEF */
       cmd_setfeatures_complete(t);
       break;
+    case IDE_CMD_FLUSH:		/* 0xE7 */
+      if (ide_cache_flush(t->drive, ide_policy() != IDE_SYNC_NONE) == -1)
+        ide_xlate_errno(t, -1, errno);
+      completed(t);
+      break;
     case IDE_CMD_VERIFY:	/* 0x40 */
     case IDE_CMD_VERIFY_NR:	/* 0x41 */
       cmd_verifysectors_complete(t);
@@ -606,6 +937,8 @@ uint8_t ide_read8(struct ide_controller *c, uint8_t r)
 {
   struct ide_drive *d = &c->drive[c->selected];
   struct ide_taskfile *t = &d->taskfile;
+  if (d->state == IDE_FETCH)
+    ide_io_poll(d);
   switch(r) {
     case ide_data:
       return ide_data_in(d, 1);
@@ -702,6 +1035,100 @@ uint16_t ide_read16(struct ide_controller *c, uint8_t r)
   return ide_read8(c, r);
 }
 
+/*
+ *	Data words that do not finish a sector only move the pointer, so
+ *	a bus interface that sees lots of them can come here first. They
+ *	return 0 when the full path has to deal with the transfer.
+ */
+
+int ide_read16_fast(struct ide_controller *c, uint16_t *v)
+{
+  struct ide_drive *d = &c->drive[c->selected];
+
+  if (d->state != IDE_DATA_IN || d->eightbit || d->dend - d->dptr <= 2)
+    return 0;
+  *v = d->dptr[0] | (d->dptr[1] << 8);
+  d->taskfile.data = *v;
+  d->dptr += 2;
+  return 1;
+}
+
+int ide_write16_fast(struct ide_controller *c, uint16_t v)
+{
+  struct ide_drive *d = &c->drive[c->selected];
+
+  if (d->state != IDE_DATA_OUT || d->eightbit || d->dend - d->dptr <= 2 ||
+      (d->taskfile.status & ST_BSY))
+    return 0;
+  *d->dptr++ = v;
+  *d->dptr++ = v >> 8;
+  d->taskfile.data = v >> 8;
+  return 1;
+}
+
+/*
+ *	Stream data port transfers for bus interfaces that can see a whole
+ *	block instruction at once. len is in bytes and is taken as bytes in
+ *	8bit mode and little endian words otherwise. The last transfer of
+ *	each sector goes the slow way so the end of sector work is done as
+ *	usual. Returns the bytes moved, which is short when the command
+ *	finishes or fails.
+ */
+size_t ide_read_block(struct ide_controller *c, uint8_t *buf, size_t len)
+{
+  struct ide_drive *d = &c->drive[c->selected];
+  size_t unit = d->eightbit ? 1 : 2;
+  size_t done = 0;
+  size_t n;
+  uint16_t v;
+
+  while (done + unit <= len && d->state == IDE_DATA_IN) {
+    n = d->dend - d->dptr;
+    if (d->dptr && n > unit) {
+      n -= unit;
+      if (n > len - done)
+        n = (len - done) & ~(unit - 1);
+      memcpy(buf + done, d->dptr, n);
+      d->dptr += n;
+      done += n;
+      continue;
+    }
+    v = ide_data_in(d, unit);
+    buf[done++] = v;
+    if (unit == 2)
+      buf[done++] = v >> 8;
+  }
+  return done;
+}
+
+size_t ide_write_block(struct ide_controller *c, const uint8_t *buf, size_t len)
+{
+  struct ide_drive *d = &c->drive[c->selected];
+  size_t unit = d->eightbit ? 1 : 2;
+  size_t done = 0;
+  size_t n;
+
+  while (done + unit <= len && d->state == IDE_DATA_OUT &&
+         !(d->taskfile.status & ST_BSY)) {
+    n = d->dend - d->dptr;
+    if (n > unit) {
+      n -= unit;
+      if (n > len - done)
+        n = (len - done) & ~(unit - 1);
+      memcpy(d->dptr, buf + done, n);
+      d->dptr += n;
+      done += n;
+      continue;
+    }
+    if (unit == 2)
+      ide_data_out(d, buf[done] | (buf[done + 1] << 8), 2);
+    else
+      ide_data_out(d, buf[done], 1);
+    done += unit;
+  }
+  return done;
+}
+
 void ide_write16(struct ide_controller *c, uint8_t r, uint16_t v)
 {
   struct ide_drive *d = &c->drive[c->selected];
@@ -748,17 +1175,42 @@ int ide_attach(struct ide_controller *c, int drive, int fd)
     return -1;
   }
   d->fd = fd;
-  if (read(d->fd, d->data, 512) != 512 ||
-      read(d->fd, d->identify, 512) != 512) {
-    ide_fault(d, "i/o error on attach");
+  d->buf = malloc(256 * 512);
+  if (d->buf == NULL) {
+    ide_fault(d, "out of memory");
     return -1;
   }
+  /* Header and identify block in one read */
+  if (blkcache_pread(d->fd, d->buf, 1024, 0) != 1024) {
+    ide_fault(d, "i/o error on attach");
+    goto fail;
+  }
+  memcpy(d->data, d->buf, 512);
+  memcpy(d->identify, d->buf + 512, 512);
   if (memcmp(d->data, ide_magic, 8)) {
     ide_fault(d, "bad magic");
-    return -1;
+    goto fail;
+  }
+  /* v1 images leave the version byte clear and start data at sector 2 */
+  switch(d->data[IDE_HDR_VERSION]) {
+  case 0:
+    d->base = 2;
+    break;
+  case IDE_IMAGE_V2:
+    d->base = d->data[IDE_HDR_BASE] | (d->data[IDE_HDR_BASE + 1] << 8);
+    if (d->base >= 2)
+      break;
+    /* Fall through */
+  default:
+    ide_fault(d, "unknown image version");
+    goto fail;
   }
-  d->fd = fd;
   d->present = 1;
+  d->multiple = 0;
+  d->identify[47] = le16(0x8000 | IDE_MAX_MULTI);
+  d->identify[59] = 0;
+  d->wcache = 1;
+  ide_identify_cache(d);
   d->heads = d->identify[3];
   d->sectors = d->identify[6];
   d->cylinders = le16(d->identify[1]);
@@ -767,6 +1219,85 @@ int ide_attach(struct ide_controller *c, int drive, int fd)
   else
     d->lba = 0;
   return 0;
+fail:
+  free(d->buf);
+  d->buf = NULL;
+  return -1;
+}
+
+/*
+ *	Do reads for the controller on the I/O thread so a slow host disk
+ *	stalls only the guest waiting on it
+ */
+int ide_set_async(struct ide_controller *c, int on)
+{
+  int r = 0;
+
+  if (on) {
+    pthread_mutex_lock(&ide_io_lock);
+    r = ide_io_start();
+    pthread_mutex_unlock(&ide_io_lock);
+    if (r) {
+      fprintf(stderr, "ide: %s: cannot start I/O thread\n", c->name);
+      on = 0;
+    }
+  }
+  ide_sync(c);
+  c->drive[0].async = on;
+  c->drive[1].async = on;
+  return r;
+}
+
+/*
+ *	Wait for any posted reads, for instance before a fork
+ */
+void ide_sync(struct ide_controller *c)
+{
+  ide_io_wait(&c->drive[0]);
+  ide_io_wait(&c->drive[1]);
+}
+
+/*
+ *	Switch an attached drive to run from a shared mapping of the image
+ *	so sector transfers are a memcpy rather than a syscall each. If the
+ *	image can't be mapped the drive carries on using the file.
+ */
+int ide_map(struct ide_controller *c, int drive)
+{
+  struct ide_drive *d = &c->drive[drive];
+  struct stat st;
+  void *p;
+
+  if (!d->present || d->map)
+    return -1;
+  /* The file under an overlay is the read only base */
+  if (cow_overlay(d->fd)) {
+    ide_fault(d, "cannot map an overlay image");
+    return -1;
+  }
+  if (fstat(d->fd, &st) == -1 || st.st_size < 1024) {
+    ide_fault(d, "cannot size image for mapping");
+    return -1;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, d->fd, 0);
+  if (p == MAP_FAILED) {
+    perror("ide_map");
+    return -1;
+  }
+  d->map = p;
+  d->mapsize = st.st_size;
+  d->pos = 0;
+  return 0;
+}
+
+/*
+ *	Push mapped or cached writes back to the image, and to the host disk
+ *	unless IDE_SYNC is none
+ */
+void ide_flush(struct ide_drive *d)
+{
+  if (ide_cache_flush(d, ide_policy() != IDE_SYNC_NONE) == -1)
+    perror("ide_flush");
 }
 
 /*
@@ -774,11 +1305,99 @@ int ide_attach(struct ide_controller *c, int drive, int fd)
  */
 void ide_detach(struct ide_drive *d)
 {
-  close(d->fd);
+  ide_io_wait(d);
+  if (d->map) {
+    ide_flush(d);
+    munmap(d->map, d->mapsize);
+    d->map = NULL;
+  }
+  free(d->buf);
+  d->buf = NULL;
+  blkcache_close(d->fd);
   d->fd = -1;
   d->present = 0;
 }
 
+/*
+ *	Snapshot support. Only the taskfile and interrupt state are kept. A
+ *	command that was part way through when saved can't be picked up
+ *	again so it comes back aborted.
+ */
+struct ide_drive_state {
+  struct ide_taskfile tf;	/* Drive pointer not used */
+  uint8_t present;
+  uint8_t intrq;
+  uint8_t busy;
+  uint8_t multiple;
+  uint8_t wcache;
+};
+
+struct ide_state {
+  struct ide_drive_state drive[2];
+  int selected;
+  uint16_t data_latch;
+};
+
+size_t ide_save(struct ide_controller *c, void *buf)
+{
+  struct ide_state st;
+  int i;
+
+  if (buf == NULL)
+    return sizeof(st);
+  memset(&st, 0, sizeof(st));
+  for (i = 0; i < 2; i++) {
+    struct ide_drive *d = &c->drive[i];
+    st.drive[i].tf = d->taskfile;
+    st.drive[i].tf.drive = NULL;
+    st.drive[i].present = d->present;
+    st.drive[i].intrq = d->intrq;
+    st.drive[i].busy = d->state != IDE_IDLE;
+    st.drive[i].multiple = d->multiple;
+    st.drive[i].wcache = d->wcache;
+  }
+  st.selected = c->selected;
+  st.data_latch = c->data_latch;
+  memcpy(buf, &st, sizeof(st));
+  return sizeof(st);
+}
+
+int ide_load(struct ide_controller *c, const void *buf, size_t len)
+{
+  struct ide_state st;
+  int i;
+
+  if (len != sizeof(st))
+    return -1;
+  memcpy(&st, buf, sizeof(st));
+  for (i = 0; i < 2; i++)
+    if (st.drive[i].present != c->drive[i].present)
+      return -1;
+  for (i = 0; i < 2; i++) {
+    struct ide_drive *d = &c->drive[i];
+    struct ide_taskfile *tf = &d->taskfile;
+    if (!d->present)
+      continue;
+    ide_io_wait(d);
+    d->state = IDE_IDLE;
+    d->dptr = d->dend = NULL;
+    st.drive[i].tf.drive = d;
+    *tf = st.drive[i].tf;
+    d->intrq = st.drive[i].intrq;
+    d->multiple = st.drive[i].multiple;
+    d->wcache = st.drive[i].wcache;
+    ide_identify_cache(d);
+    if (st.drive[i].busy) {
+      tf->status |= ST_ERR;
+      tf->error = ERR_ABRT;
+      completed(tf);
+    }
+  }
+  c->selected = st.selected;
+  c->data_latch = st.data_latch;
+  return 0;
+}
+
 /*
  *	Free up and release and IDE controller
  */
@@ -792,6 +1411,76 @@ void ide_free(struct ide_controller *c)
   free(c);
 }
 
+/* Sectors read and written on both drives since we started */
+unsigned long long ide_sectors(struct ide_controller *c)
+{
+  return c->drive[0].moved + c->drive[1].moved;
+}
+
+/* Sectors of data on a drive, 0 if there is none */
+uint32_t ide_capacity(struct ide_controller *c, int drive)
+{
+  struct ide_drive *d = &c->drive[drive];
+
+  if (!d->present)
+    return 0;
+  if (d->lba)
+    return le16(d->identify[60]) | (le16(d->identify[61]) << 16);
+  return (uint32_t)d->cylinders * d->heads * d->sectors;
+}
+
+/*
+ *	Move whole sectors between the image and a buffer without going
+ *	through the taskfile, for a paravirtual disk sharing the drive.
+ *	The same caching and sync rules as a command apply. Returns 0 or
+ *	an errno value.
+ */
+int ide_transfer(struct ide_controller *c, int drive, uint32_t lba,
+                 uint8_t *buf, unsigned int n, int wr)
+{
+  struct ide_drive *d = &c->drive[drive];
+  uint32_t size = ide_capacity(c, drive);
+  off_t pos = 512 * (d->base + lba);
+  ssize_t want = 512 * n;
+  ssize_t len;
+
+  if (lba >= size || n > size - lba)
+    return EINVAL;
+  ide_io_wait(d);
+  if (d->map) {
+    if (pos + want > d->mapsize)
+      return EIO;
+    if (wr)
+      memcpy(d->map + pos, buf, want);
+    else
+      memcpy(buf, d->map + pos, want);
+    len = want;
+  } else if (wr)
+    len = blkcache_pwrite(d->fd, buf, want, pos);
+  else
+    len = blkcache_pread(d->fd, buf, want, pos);
+  if (len == -1)
+    return errno;
+  if (len != want)
+    return EIO;
+  d->moved += n;
+  if (wr && ide_write_through(d) && ide_cache_flush(d, 1) == -1)
+    return errno;
+  return 0;
+}
+
+/* FLUSH CACHE for the paravirtual path */
+int ide_transfer_flush(struct ide_controller *c, int drive)
+{
+  struct ide_drive *d = &c->drive[drive];
+
+  if (!d->present)
+    return EINVAL;
+  if (ide_cache_flush(d, ide_policy() != IDE_SYNC_NONE) == -1)
+    return errno;
+  return 0;
+}
+
 /*
  *	Emulation interface for an 8bit controller using latches on the
  *	data register
@@ -844,25 +1533,65 @@ static void make_serial(uint16_t *p)
   make_ascii(p, buf, 20);
 }
 
+/* Formatted sectors read E5. Written a big run at a time */
+static int ide_fill(int fd, uint32_t sectors)
+{
+  uint8_t *buf = malloc(IDE_FILL_RUN * 512);
+  unsigned int n;
+
+  if (buf == NULL)
+    return -1;
+  memset(buf, 0xE5, IDE_FILL_RUN * 512);
+  while (sectors) {
+    n = sectors < IDE_FILL_RUN ? sectors : IDE_FILL_RUN;
+    if (write(fd, buf, n * 512) != (ssize_t)(n * 512)) {
+      free(buf);
+      return -1;
+    }
+    sectors -= n;
+  }
+  free(buf);
+  return 0;
+}
+
 int ide_make_drive(uint8_t type, int fd)
+{
+  return ide_make_image(type, fd, IDE_IMAGE_V1, 0);
+}
+
+/*
+ *	Create an image. A sparse image is sized with ftruncate so the data
+ *	reads back as zero and takes no space until written.
+ */
+int ide_make_image(uint8_t type, int fd, int version, int flags)
 {
   uint8_t s, h;
   uint16_t c;
   uint32_t sectors;
   uint16_t ident[256];
+  unsigned int base = 2;
+  uint8_t *hdr = (uint8_t *)ident;
 
   if (type < 1 || type > MAX_DRIVE_TYPE)
     return -2;
+  if (version != IDE_IMAGE_V1 && version != IDE_IMAGE_V2)
+    return -2;
 
   memset(ident, 0, 512);
   memcpy(ident, ide_magic, 8);
+  if (version == IDE_IMAGE_V2) {
+    base = IDE_V2_BASE;
+    hdr[IDE_HDR_VERSION] = IDE_IMAGE_V2;
+    hdr[IDE_HDR_BASE] = base;
+    hdr[IDE_HDR_BASE + 1] = base >> 8;
+  }
   if (write(fd, ident, 512) != 512)
     return -1;
 
-  memset(ident, 0, 8);
+  memset(ident, 0, sizeof(ident));
   ident[0] = le16((1 << 15) | (1 << 6));	/* Non removable */
   make_serial(ident + 10);
-  ident[47] = 0; /* no read multi for now */
+  ident[47] = le16(0x8000 | IDE_MAX_MULTI);	/* Read/write multiple */
   ident[51] = le16(240 /* PIO2 */ << 8);	/* PIO cycle time */
   ident[53] = le16(1);		/* Geometry words are valid */
 
@@ -933,9 +1662,12 @@ int ide_make_drive(uint8_t type, int fd)
   if (write(fd, ident, 512) != 512)
     return -1;
 
-  memset(ident, 0xE5, 512);
-  while(sectors--)
+  if (flags & IDE_MAKE_SPARSE)
+    return ftruncate(fd, (off_t)(base + sectors) * 512);
+
+  memset(ident, 0, 512);
+  for (base -= 2; base; base--)
     if (write(fd, ident, 512) != 512)
       return -1;
-  return 0;
+  return ide_fill(fd, sectors);
 }
@@ -2,6 +2,7 @@
 #define __IDE_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define ACME_ROADRUNNER		1	/* 504MB classic IDE drive */
 #define ACME_COYOTE		2	/* 20MB early IDE drive */
@@ -12,6 +13,18 @@
 
 #define MAX_DRIVE_TYPE		6
 
+/* Image header. Sector 0 holds the magic, sector 1 the identify block.
+   v1 images have data from sector 2, v2 give the data start (a 4K
+   boundary) as a little endian sector count */
+#define IDE_HDR_VERSION		8
+#define IDE_HDR_BASE		9
+
+#define IDE_IMAGE_V1		1
+#define IDE_IMAGE_V2		2
+#define IDE_V2_BASE		8	/* Sectors before v2 data */
+
+#define IDE_MAKE_SPARSE		1	/* Leave the data unallocated */
+
 #define		ide_data	0
 #define		ide_error_r	1
 #define		ide_feature_w	1
@@ -48,16 +61,33 @@ struct ide_taskfile {
 struct ide_drive {
   struct ide_controller *controller;
   struct ide_taskfile taskfile;
-  unsigned int present:1, intrq:1, failed:1, lba:1, eightbit:1;
+  unsigned int present:1, intrq:1, failed:1, lba:1, eightbit:1, async:1;
+  unsigned int wcache:1;	/* Guest has the write cache on */
   uint16_t cylinders;
   uint8_t heads, sectors;
   uint8_t data[512];
   uint16_t identify[256];
   uint8_t *dptr;
+  uint8_t *dend;		/* End of the sector dptr is in */
+  uint8_t *buf;			/* Whole command transfer buffer */
+  uint8_t *xbuf;		/* Read data, buf or the map */
+  unsigned int done;		/* Sectors transferred this command */
+  unsigned int good;		/* Sectors the prefetch got */
+  int xlen;			/* How the prefetch or write fell short */
+  int xerr;
+  uint8_t multiple;		/* SET MULTIPLE block size, 0 if off */
+  uint8_t block;		/* Sectors per interrupt this command */
   int state;
   int fd;
   off_t offset;
+  off_t base;			/* Sector the image data starts at */
   int length;
+  uint8_t *map;			/* Image mapping or NULL for file I/O */
+  off_t mapsize;
+  off_t pos;			/* Byte position within the map */
+  int io_busy;			/* Read still with the I/O thread */
+  struct ide_drive *io_next;	/* I/O thread queue */
+  unsigned long long moved;	/* Sectors transferred, for the metrics */
 };
 
 struct ide_controller {
@@ -74,13 +104,30 @@ uint8_t ide_read8(struct ide_controller *c, uint8_t r);
 void ide_write8(struct ide_controller *c, uint8_t r, uint8_t v);
 uint16_t ide_read16(struct ide_controller *c, uint8_t r);
 void ide_write16(struct ide_controller *c, uint8_t r, uint16_t v);
+int ide_read16_fast(struct ide_controller *c, uint16_t *v);
+int ide_write16_fast(struct ide_controller *c, uint16_t v);
+size_t ide_read_block(struct ide_controller *c, uint8_t *buf, size_t len);
+size_t ide_write_block(struct ide_controller *c, const uint8_t *buf, size_t len);
 uint8_t ide_read_latched(struct ide_controller *c, uint8_t r);
 void ide_write_latched(struct ide_controller *c, uint8_t r, uint8_t v);
 
 struct ide_controller *ide_allocate(const char *name);
 int ide_attach(struct ide_controller *c, int drive, int fd);
+int ide_map(struct ide_controller *c, int drive);
+int ide_set_async(struct ide_controller *c, int on);
+void ide_sync(struct ide_controller *c);
+void ide_flush(struct ide_drive *d);
 void ide_detach(struct ide_drive *d);
 void ide_free(struct ide_controller *c);
+unsigned long long ide_sectors(struct ide_controller *c);
+uint32_t ide_capacity(struct ide_controller *c, int drive);
+int ide_transfer(struct ide_controller *c, int drive, uint32_t lba,
+                 uint8_t *buf, unsigned int n, int wr);
+int ide_transfer_flush(struct ide_controller *c, int drive);
+
+size_t ide_save(struct ide_controller *c, void *buf);
+int ide_load(struct ide_controller *c, const void *buf, size_t len);
 
 int ide_make_drive(uint8_t type, int fd);
+int ide_make_image(uint8_t type, int fd, int version, int flags);
 #endif
@@ -36,165 +36,108 @@
 #include <string.h>
 #include "intel_8085_emulator.h"
 
-#define reg16_PSW (((uint16_t)reg8[A] << 8) | (uint16_t)reg8[FLAGS])
-#define reg16_BC (((uint16_t)reg8[B] << 8) | (uint16_t)reg8[C])
-#define reg16_DE (((uint16_t)reg8[D] << 8) | (uint16_t)reg8[E])
-#define reg16_HL (((uint16_t)reg8[H] << 8) | (uint16_t)reg8[L])
-
-uint8_t reg8[9], INTE = 0;
-uint16_t reg_SP, reg_PC;
-uint8_t reg_IM = 0x07;	/* Verified with a Tundra CA80C85B */
-uint8_t intprotect;
-#define set_S() reg8[FLAGS] |= 0x80
-#define set_Z() reg8[FLAGS] |= 0x40
-#define set_K() reg8[FLAGS] |= 0x20
-#define set_AC() reg8[FLAGS] |= 0x10
-#define set_P() reg8[FLAGS] |= 0x04
-#define set_V() reg8[FLAGS] |= 0x02
-#define set_C() reg8[FLAGS] |= 0x01
-#define clear_S() reg8[FLAGS] &= 0x7F
-#define clear_Z() reg8[FLAGS] &= 0xBF
-#define clear_K() reg8[FLAGS] &= 0xDF
-#define clear_AC() reg8[FLAGS] &= 0xEF
-#define clear_P() reg8[FLAGS] &= 0xFB
-#define clear_V() reg8[FLAGS] &= 0xFD
-#define clear_C() reg8[FLAGS] &= 0xFE
-#define test_S() (reg8[FLAGS] & 0x80)
-#define test_Z() (reg8[FLAGS] & 0x40)
-#define test_K() (reg8[FLAGS] & 0x20)
-#define test_AC() (reg8[FLAGS] & 0x10)
-#define test_P() (reg8[FLAGS] & 0x04)
-#define test_V() (reg8[FLAGS] & 0x02)
-#define test_C() (reg8[FLAGS] & 0x01)
-
-FILE *i8085_log;
-
-static uint8_t intpend;
-static uint8_t halted;
-
-static const uint8_t parity[0x100] = {
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1
-};
+#define reg16_PSW (((uint16_t)cpu->reg8[A] << 8) | (uint16_t)cpu->reg8[FLAGS])
+#define reg16_BC (((uint16_t)cpu->reg8[B] << 8) | (uint16_t)cpu->reg8[C])
+#define reg16_DE (((uint16_t)cpu->reg8[D] << 8) | (uint16_t)cpu->reg8[E])
+#define reg16_HL (((uint16_t)cpu->reg8[H] << 8) | (uint16_t)cpu->reg8[L])
 
-uint16_t read_RP(uint8_t rp) {
-	switch (rp) {
-		case 0x00:
-			return reg16_BC;
-		case 0x01:
-			return reg16_DE;
-		case 0x02:
-			return reg16_HL;
-		case 0x03:
-			return reg_SP;
-	}
-	return 0;
-}
+#define set_S() cpu->reg8[FLAGS] |= 0x80
+#define set_Z() cpu->reg8[FLAGS] |= 0x40
+#define set_K() cpu->reg8[FLAGS] |= 0x20
+#define set_AC() cpu->reg8[FLAGS] |= 0x10
+#define set_P() cpu->reg8[FLAGS] |= 0x04
+#define set_V() cpu->reg8[FLAGS] |= 0x02
+#define set_C() cpu->reg8[FLAGS] |= 0x01
+#define clear_S() cpu->reg8[FLAGS] &= 0x7F
+#define clear_Z() cpu->reg8[FLAGS] &= 0xBF
+#define clear_K() cpu->reg8[FLAGS] &= 0xDF
+#define clear_AC() cpu->reg8[FLAGS] &= 0xEF
+#define clear_P() cpu->reg8[FLAGS] &= 0xFB
+#define clear_V() cpu->reg8[FLAGS] &= 0xFD
+#define clear_C() cpu->reg8[FLAGS] &= 0xFE
+#define test_S() (cpu->reg8[FLAGS] & 0x80)
+#define test_Z() (cpu->reg8[FLAGS] & 0x40)
+#define test_K() (cpu->reg8[FLAGS] & 0x20)
+#define test_AC() (cpu->reg8[FLAGS] & 0x10)
+#define test_P() (cpu->reg8[FLAGS] & 0x04)
+#define test_V() (cpu->reg8[FLAGS] & 0x02)
+#define test_C() (cpu->reg8[FLAGS] & 0x01)
 
-uint16_t read_RP_PUSHPOP(uint8_t rp) {
-	switch (rp) {
-		case 0x00:
-			return reg16_BC;
-		case 0x01:
-			return reg16_DE;
-		case 0x02:
-			return reg16_HL;
-		case 0x03:
-			return reg16_PSW;
-	}
-	return 0;
-}
+/* S, Z and P for each result */
+static const uint8_t szp_table[0x100] = {
+	0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84
+};
 
-void write_RP(uint8_t rp, uint8_t lb, uint8_t hb) {
-	switch (rp) {
-		case 0x00:
-			reg8[C] = lb;
-			reg8[B] = hb;
-			break;
-		case 0x01:
-			reg8[E] = lb;
-			reg8[D] = hb;
-			break;
-		case 0x02:
-			reg8[L] = lb;
-			reg8[H] = hb;
-			break;
-		case 0x03:
-			reg_SP = (uint16_t)lb | ((uint16_t)hb << 8);
-			break;
-	}
-}
+/* S, Z, K, AC, P and V for INR of each value */
+static const uint8_t inr_table[0x100] = {
+	0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x10,
+	0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x10,
+	0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x14,
+	0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x10,
+	0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x14,
+	0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x14,
+	0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x10,
+	0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x92,
+	0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xB4,
+	0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xB4,
+	0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xB0,
+	0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xB4,
+	0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xB0,
+	0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xB0,
+	0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xB4,
+	0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0x54
+};
 
-void write16_RP(uint8_t rp, uint16_t value) {
-	switch (rp) {
-		case 0x00:
-			reg8[C] = value & 0x00FF;
-			reg8[B] = value >> 8;
-			break;
-		case 0x01:
-			reg8[E] = value & 0x00FF;
-			reg8[D] = value >> 8;
-			break;
-		case 0x02:
-			reg8[L] = value & 0x00FF;
-			reg8[H] = value >> 8;
-			break;
-		case 0x03:
-			reg_SP = value;
-			break;
-	}
-}
+/* The same for DCR */
+static const uint8_t dcr_table[0x100] = {
+	0xA4, 0x54, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10,
+	0x04, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14,
+	0x00, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14,
+	0x00, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10,
+	0x04, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14,
+	0x00, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10,
+	0x04, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10,
+	0x04, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14,
+	0x22, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4,
+	0xA0, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0,
+	0xA4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0,
+	0xA4, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4,
+	0xA0, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0,
+	0xA4, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4,
+	0xA0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4,
+	0xA0, 0xB4, 0xB0, 0xB0, 0xB4, 0xB0, 0xB4, 0xB4, 0xB0, 0xB0, 0xB4, 0xB4, 0xB0, 0xB4, 0xB0, 0xB0
+};
 
-void write16_RP_PUSHPOP(uint8_t rp, uint16_t value) {
-	switch (rp) {
-		case 0x00:
-			reg8[C] = value & 0x00FF;
-			reg8[B] = value >> 8;
-			break;
-		case 0x01:
-			reg8[E] = value & 0x00FF;
-			reg8[D] = value >> 8;
-			break;
-		case 0x02:
-			reg8[L] = value & 0x00FF;
-			reg8[H] = value >> 8;
-			break;
-		case 0x03:
-			reg8[FLAGS] = (value & 0x00FF) & 0xF7;
-			reg8[A] = value >> 8;
-			break;
-	}
-}
+/* Condition codes NZ Z NC C PO PE P M: the flag each tests */
+static const uint8_t cond_mask[8] = {
+	0x40, 0x40, 0x01, 0x01, 0x04, 0x04, 0x80, 0x80
+};
 
-void calc_SZP(uint8_t value) {
-	if (value == 0) set_Z(); else clear_Z();
-	if (value & 0x80) set_S(); else clear_S();
-	if (parity[value]) set_P(); else clear_P();
-}
+#define PAIR(h, l) (((uint16_t)cpu->reg8[h] << 8) | (uint16_t)cpu->reg8[l])
 
-void calc_AC(uint8_t val1, uint8_t val2) {
-	if (((val1 & 0x0F) + (val2 & 0x0F)) > 0x0F) {
-		set_AC();
-	} else {
-		clear_AC();
-	}
-}
+/* K from V and the sign of the result */
+#define FLAG_K(f, r) ((((f) << 4) ^ ((r) >> 2)) & 0x20)
 
-void calc_AC_carry(uint8_t val1, uint8_t val2) {
-	if (((val1 & 0x0F) + (val2 & 0x0F)) >= 0x0F) {
-		set_AC();
-	} else {
-		clear_AC();
-	}
+void calc_SZP(struct i8085 *cpu, uint8_t value) {
+	cpu->reg8[FLAGS] = (cpu->reg8[FLAGS] & 0x3B) | szp_table[value];
 }
 
-void calc_subAC(int8_t val1, uint8_t val2) {
+void calc_subAC(struct i8085 *cpu, int8_t val1, uint8_t val2) {
 	if ((val2 & 0x0F) <= (val1 & 0x0F)) {
 		set_AC();
 	} else {
@@ -202,7 +145,7 @@ void calc_subAC(int8_t val1, uint8_t val2) {
 	}
 }
 
-void calc_subAC_borrow(int8_t val1, uint8_t val2) {
+void calc_subAC_borrow(struct i8085 *cpu, int8_t val1, uint8_t val2) {
 	if ((val2 & 0x0F) < (val1 & 0x0F)) {
 		set_AC();
 	} else {
@@ -210,7 +153,7 @@ void calc_subAC_borrow(int8_t val1, uint8_t val2) {
 	}
 }
 
-void calc_Vadd(int8_t val1, int8_t val2, int c)
+static uint8_t flag_Vadd(int8_t val1, int8_t val2, int c)
 {
 	/* Did adding bits 0-6 together carry into bit 7 ? */
 	uint8_t c6 = ((val1 & 0x7F) + (val2 & 0x7F) + c) & 0x80;
@@ -219,37 +162,39 @@ void calc_Vadd(int8_t val1, int8_t val2, int c)
 	/* V is the xor of the two carries */
 	/* Annoying C has no ^^ operator */
 	if ((!!c6) ^ (!!c7))
-		set_V();
-	else
-		clear_V();
+		return 0x02;
+	return 0;
+}
+
+void calc_Vadd(struct i8085 *cpu, int8_t val1, int8_t val2, int c)
+{
+	cpu->reg8[FLAGS] = (cpu->reg8[FLAGS] & 0xFD) | flag_Vadd(val1, val2, c);
 }
 
 /* 16bit maths is actually 8bit maths done twice */
-void calc_Vadd16(int16_t val1, int16_t val2)
+void calc_Vadd16(struct i8085 *cpu, int16_t val1, int16_t val2)
 {
 	/* Internal carry of the first add */
 	int c = ((val1 & 0xFF) + (val2 & 0xFF)) & 0x100;
 	/* Fed into the carry of the following adc */
-	calc_Vadd(val1 >> 8, val2 >> 8, !!c);
+	calc_Vadd(cpu, val1 >> 8, val2 >> 8, !!c);
 }
 
-void calc_Vsub(int8_t val1, int8_t val2, int c)
+static uint8_t flag_Vsub(int8_t val1, int8_t val2, int c)
 {
 	uint8_t c6 = ((val1 & 0x7F) - (val2 & 0x7F) - c) & 0x80;
 	uint16_t c7 = ((val1 - val2 - c) & 0x100) >> 1;
 	if (c6 ^ c7)
-		set_V();
-	else
-		clear_V();
+		return 0x02;
+	return 0;
 }
 
-void calc_Vsub16(int16_t val1, int16_t val2)
+void calc_Vsub(struct i8085 *cpu, int8_t val1, int8_t val2, int c)
 {
-	int c = (val1 & 0xFF) < (val2 & 0xFF);
-	calc_Vsub(val1 >> 8, val2 >> 8, c);
+	cpu->reg8[FLAGS] = (cpu->reg8[FLAGS] & 0xFD) | flag_Vsub(val1, val2, c);
 }
 
-void calc_K(int8_t r)
+void calc_K(struct i8085 *cpu, int8_t r)
 {
 	if ((!!test_V()) ^ !!(r & 0x80))
 		set_K();
@@ -257,104 +202,210 @@ void calc_K(int8_t r)
 		clear_K();
 }
 
-void calc_KVlogic(uint8_t val)
+uint8_t test_cond(struct i8085 *cpu, uint8_t code) {
+	/* Odd codes want the flag set, even ones want it clear */
+	return !(cpu->reg8[FLAGS] & cond_mask[code]) ^ (code & 1);
+}
+
+/*
+ *	The 8bit arithmetic and logic. Each works out every flag it changes
+ *	and writes them back in one go. Half carry is the carry out of bit 3,
+ *	which subtraction reports inverted.
+ */
+static void alu_add(struct i8085 *cpu, uint8_t val, uint8_t c)
 {
-	clear_V();
-	calc_K(val);
+	uint8_t a = cpu->reg8[A];
+	uint16_t r = (uint16_t)a + val + c;
+	uint8_t f = (cpu->reg8[FLAGS] & 0x08) | szp_table[r & 0xFF];
+
+	f |= ((a ^ val ^ r) & 0x10) | (r >> 8) | flag_Vadd(a, val, c);
+	cpu->reg8[FLAGS] = f | FLAG_K(f, r & 0xFF);
+	cpu->reg8[A] = r;
 }
 
-uint8_t test_cond(uint8_t code) {
-	switch (code) {
-		case 0: //Z not set
-			if (!test_Z()) return 1; else return 0;
-		case 1: //Z set
-			if (test_Z()) return 1; else return 0;
-		case 2: //C not set
-			if (!test_C()) return 1; else return 0;
-		case 3: //C set
-			if (test_C()) return 1; else return 0;
-		case 4: //P not set
-			if (!test_P()) return 1; else return 0;
-		case 5: //P set
-			if (test_P()) return 1; else return 0;
-		case 6: //S not set
-			if (!test_S()) return 1; else return 0;
-		case 7: //S set
-			if (test_S()) return 1; else return 0;
-	}
-	return 0;
+static uint8_t alu_sub(struct i8085 *cpu, uint8_t val, uint8_t c)
+{
+	uint8_t a = cpu->reg8[A];
+	uint16_t r = (uint16_t)a - val - c;
+	uint8_t f = (cpu->reg8[FLAGS] & 0x08) | szp_table[r & 0xFF];
+
+	f |= (~(a ^ val ^ r) & 0x10) | flag_Vsub(a, val, c);
+	if ((r & 0xFF) >= a && (val | c))
+		f |= 0x01;
+	cpu->reg8[FLAGS] = f | FLAG_K(f, r & 0xFF);
+	return r;
+}
+
+/* AND, OR and XOR clear C and V so K is just the sign */
+static void alu_logic(struct i8085 *cpu, uint8_t r, uint8_t ac)
+{
+	cpu->reg8[A] = r;
+	cpu->reg8[FLAGS] = (cpu->reg8[FLAGS] & 0x08) | szp_table[r] | ac | ((r >> 2) & 0x20);
+}
+
+static void op_add(struct i8085 *cpu, uint8_t val)
+{
+	alu_add(cpu, val, 0);
+}
+
+static void op_adc(struct i8085 *cpu, uint8_t val)
+{
+	alu_add(cpu, val, test_C());
+}
+
+static void op_sub(struct i8085 *cpu, uint8_t val)
+{
+	cpu->reg8[A] = alu_sub(cpu, val, 0);
+}
+
+static void op_sbb(struct i8085 *cpu, uint8_t val)
+{
+	cpu->reg8[A] = alu_sub(cpu, val, test_C());
+}
+
+static void op_cmp(struct i8085 *cpu, uint8_t val)
+{
+	alu_sub(cpu, val, 0);
+}
+
+static void op_ana(struct i8085 *cpu, uint8_t val)
+{
+	alu_logic(cpu, cpu->reg8[A] & val, ((cpu->reg8[A] | val) & 0x08) << 1);
+}
+
+static void op_xra(struct i8085 *cpu, uint8_t val)
+{
+	alu_logic(cpu, cpu->reg8[A] ^ val, 0);
+}
+
+static void op_ora(struct i8085 *cpu, uint8_t val)
+{
+	alu_logic(cpu, cpu->reg8[A] | val, 0);
+}
+
+static uint8_t op_inr(struct i8085 *cpu, uint8_t val)
+{
+	cpu->reg8[FLAGS] = (cpu->reg8[FLAGS] & 0x09) | inr_table[val];
+	return val + 1;
+}
+
+static uint8_t op_dcr(struct i8085 *cpu, uint8_t val)
+{
+	cpu->reg8[FLAGS] = (cpu->reg8[FLAGS] & 0x09) | dcr_table[val];
+	return val - 1;
+}
+
+static uint16_t op_inx(struct i8085 *cpu, uint16_t val)
+{
+	val++;
+	cpu->reg8[FLAGS] &= 0xDD;
+	if (val == 0x8000)
+		set_V();
+	if (val == 0x0000)
+		set_K();
+	return val;
+}
+
+static uint16_t op_dcx(struct i8085 *cpu, uint16_t val)
+{
+	val--;
+	cpu->reg8[FLAGS] &= 0xDD;
+	if (val == 0x7FFF)
+		set_V();
+	if (val == 0xFFFF)
+		set_K();
+	return val;
+}
+
+static void op_dad(struct i8085 *cpu, uint16_t val)
+{
+	uint32_t r = (uint32_t)reg16_HL + val;
+
+	calc_Vadd16(cpu, reg16_HL, val);
+	cpu->reg8[L] = r;
+	cpu->reg8[H] = r >> 8;
+	if (r & 0xFFFF0000) set_C(); else clear_C();
+	calc_K(cpu, r >> 8);
 }
 
-void i8085_push(uint16_t value) {
-	i8085_write(--reg_SP, value >> 8);
-	i8085_write(--reg_SP, (uint8_t)value);
+void i8085_push(struct i8085 *cpu, uint16_t value) {
+	i8085_write(cpu, --cpu->sp, value >> 8);
+	i8085_write(cpu, --cpu->sp, (uint8_t)value);
 }
 
-uint16_t i8085_pop() {
+uint16_t i8085_pop(struct i8085 *cpu) {
 	uint16_t temp;
-	temp = i8085_read(reg_SP++);
-	temp |= (uint16_t)i8085_read(reg_SP++) << 8;
+	temp = i8085_read(cpu, cpu->sp++);
+	temp |= (uint16_t)i8085_read(cpu, cpu->sp++) << 8;
 	return temp;
 }
 
-void i8085_set_int(int n)
+/* Interrupts only need looking at again when one of the lines changes */
+void i8085_set_int(struct i8085 *cpu, int n)
 {
-	intpend |= n;
+	if ((cpu->intpend | n) != cpu->intpend) {
+		cpu->intpend |= n;
+		cpu->intcheck = 1;
+	}
 }
 
-void i8085_clear_int(int n)
+void i8085_clear_int(struct i8085 *cpu, int n)
 {
-	intpend &= ~n;
+	cpu->intpend &= ~n;
 }
 
-
-void i8085_jump(uint16_t addr) {
-	reg_PC = addr;
+void i8085_jump(struct i8085 *cpu, uint16_t addr) {
+	cpu->pc = addr;
 }
 
-void i8085_reset() {
-	reg_PC = reg_SP = 0x0000;
-	//reg8[FLAGS] = 0x02;
+void i8085_reset(struct i8085 *cpu) {
+	cpu->pc = cpu->sp = 0x0000;
+	cpu->inte = 0;
+	cpu->im = 0x07;	/* Verified with a Tundra CA80C85B */
+	cpu->intprotect = 0;
+	cpu->halted = 0;
+	cpu->intcheck = 1;
+	//cpu->reg8[FLAGS] = 0x02;
 }
 
-void i8085_write_reg8(reg_t reg, uint8_t value) {
+void i8085_write_reg8(struct i8085 *cpu, reg_t reg, uint8_t value) {
 	if (reg == M) {
-		i8085_write(reg16_HL, value);
+		i8085_write(cpu, reg16_HL, value);
 	} else {
-		reg8[reg] = value;
+		cpu->reg8[reg] = value;
 	}
 }
 
-uint8_t i8085_read_reg8(reg_t reg) {
+uint8_t i8085_read_reg8(struct i8085 *cpu, reg_t reg) {
 	if (reg == M) {
-		return i8085_read(reg16_HL);
+		return i8085_read(cpu, reg16_HL);
 	} else {
-		return reg8[reg];
+		return cpu->reg8[reg];
 	}
 }
 
-uint16_t i8085_read_reg16(reg_t reg) {
+uint16_t i8085_read_reg16(struct i8085 *cpu, reg_t reg) {
 	switch (reg) {
 		case AF: return reg16_PSW;
 		case BC: return reg16_BC;
 		case DE: return reg16_DE;
 		case HL: return reg16_HL;
-		case SP: return reg_SP;
-		case PC: return reg_PC;
+		case SP: return cpu->sp;
+		case PC: return cpu->pc;
 		default:
 			fprintf(stderr, "bogus rr16\n");
 	}
 	return 0;
 }
 
-void i8085_write_reg16(reg_t reg, uint16_t value) {
+void i8085_write_reg16(struct i8085 *cpu, reg_t reg, uint16_t value) {
 	switch (reg) {
-		case AF: reg8[A] = value>>8; reg8[FLAGS] = value; break;
-		case BC: reg8[B] = value>>8; reg8[C] = value; break;
-		case DE: reg8[D] = value>>8; reg8[E] = value; break;
-		case HL: reg8[H] = value>>8; reg8[L] = value; break;
-		case SP: reg_SP = value; break;
-		case PC: reg_PC = value; break;
+		case AF: cpu->reg8[A] = value>>8; cpu->reg8[FLAGS] = value; break;
+		case BC: cpu->reg8[B] = value>>8; cpu->reg8[C] = value; break;
+		case DE: cpu->reg8[D] = value>>8; cpu->reg8[E] = value; break;
+		case HL: cpu->reg8[H] = value>>8; cpu->reg8[L] = value; break;
+		case SP: cpu->sp = value; break;
+		case PC: cpu->pc = value; break;
 		default:
 			fprintf(stderr, "bogus rr16\n");
 	}
@@ -378,138 +429,182 @@ static char *i8085_flags(uint8_t v)
 	return buf;
 }
 
-int i8085_exec(int cycles) {
-	uint8_t opcode, temp8, reg, reg2;
+/*
+ *	The opcode groups are expanded a case per register so that each
+ *	case works on fixed registers rather than decoding them.
+ */
+
+/* The eight source operands in opcode order, M being (HL) */
+#define OPERANDS(op, fn, x) \
+	case op: fn(x, cpu->reg8[B]); cycles -= 4; break; \
+	case op + 1: fn(x, cpu->reg8[C]); cycles -= 4; break; \
+	case op + 2: fn(x, cpu->reg8[D]); cycles -= 4; break; \
+	case op + 3: fn(x, cpu->reg8[E]); cycles -= 4; break; \
+	case op + 4: fn(x, cpu->reg8[H]); cycles -= 4; break; \
+	case op + 5: fn(x, cpu->reg8[L]); cycles -= 4; break; \
+	case op + 6: fn(x, i8085_read(cpu, reg16_HL)); cycles -= 7; break; \
+	case op + 7: fn(x, cpu->reg8[A]); cycles -= 4; break;
+
+#define ALU(fn, val) fn(cpu, val)
+#define MOV(r, val) cpu->reg8[r] = (val)
+#define MOV_M(unused, val) i8085_write(cpu, reg16_HL, val)
+
+/* INR, DCR and MVI on a register */
+#define REG8_OPS(op, r) \
+	case op + 4: cpu->reg8[r] = op_inr(cpu, cpu->reg8[r]); cycles -= 4; break; \
+	case op + 5: cpu->reg8[r] = op_dcr(cpu, cpu->reg8[r]); cycles -= 4; break; \
+	case op + 6: cpu->reg8[r] = i8085_read(cpu, cpu->pc++); cycles -= 7; break;
+
+/* LXI, INX, DAD, DCX, POP and PUSH on BC, DE or HL. Although LXI has
+   no internal side effects we must put the two reads on the bus in order */
+#define PAIR_OPS(op, h, l) \
+	case op + 0x01: \
+		cpu->reg8[l] = i8085_read(cpu, cpu->pc); \
+		cpu->reg8[h] = i8085_read(cpu, cpu->pc + 1); \
+		cpu->pc += 2; \
+		cycles -= 10; \
+		break; \
+	case op + 0x03: \
+		temp16 = op_inx(cpu, PAIR(h, l)); \
+		cpu->reg8[h] = temp16 >> 8; \
+		cpu->reg8[l] = temp16; \
+		cycles -= 6; \
+		break; \
+	case op + 0x09: \
+		op_dad(cpu, PAIR(h, l)); \
+		cycles -= 10; \
+		break; \
+	case op + 0x0B: \
+		temp16 = op_dcx(cpu, PAIR(h, l)); \
+		cpu->reg8[h] = temp16 >> 8; \
+		cpu->reg8[l] = temp16; \
+		cycles -= 6; \
+		break; \
+	case op + 0xC1: \
+		temp16 = i8085_pop(cpu); \
+		cpu->reg8[h] = temp16 >> 8; \
+		cpu->reg8[l] = temp16; \
+		cycles -= 10; \
+		break; \
+	case op + 0xC5: \
+		i8085_push(cpu, PAIR(h, l)); \
+		/* 11 on 8080 12 on 8085 */ \
+		cycles -= 12; \
+		break;
+
+int i8085_exec(struct i8085 *cpu, int cycles) {
+	uint8_t opcode, temp8;
 	uint16_t temp16;
-	uint32_t temp32;
 	uint8_t vec;
 
 	while (cycles > 0) {
+		if (cpu->intcheck) {
 		/* TRAP is edge and level - must see the edge and it held */
-		if (intpend & INT_NMI) {	/* TRAP - NMI */
-			INTE = 0;
-			intpend &= ~8;
-			if (halted)
-				i8085_push(reg_PC + 1);
+		if (cpu->intpend & INT_NMI) {	/* TRAP - NMI */
+			cpu->inte = 0;
+			cpu->intpend &= ~INT_NMI;
+			if (cpu->halted)
+				i8085_push(cpu, cpu->pc + 1);
 			else
-				i8085_push(reg_PC);
-			reg_PC = 0x24;
+				i8085_push(cpu, cpu->pc);
+			cpu->pc = 0x24;
 			cycles -= 12; /* Check me */
-			if (i8085_log)
-				fprintf(i8085_log, "NMI taken.\n");
+			if (cpu->log)
+				fprintf(cpu->log, "NMI taken.\n");
 		/* The others are level except 0x3C which is positive edge.
 		   The 8085 prioritizes so we must do likewise */
-		} else if (INTE && intprotect == 0 && (intpend & ~reg_IM)) {
-			INTE = 0;
-			temp8 = intpend & ~reg_IM;
+		} else if (cpu->inte && cpu->intprotect == 0 && (cpu->intpend & ~cpu->im)) {
+			cpu->inte = 0;
+			temp8 = cpu->intpend & ~cpu->im;
 
-			if (i8085_log)
-				fprintf(i8085_log, "IRQ taken (%x)\n", temp8);
+			if (cpu->log)
+				fprintf(cpu->log, "IRQ taken (%x)\n", temp8);
 
 			if (temp8 & INT_RST75) {
 				/* FIXME: we should temporarily mask not
 				   clear here. We clear in SIM */
 				vec = 0x3C;
-				intpend &= ~INT_RST75;
+				cpu->intpend &= ~INT_RST75;
 			} else if (temp8 & INT_RST65)
 				vec = 0x34;
 			else if (temp8 & INT_RST55)
 				vec = 0x2C;
 			else
 				vec = 0x38;
-			if (halted)
-				i8085_push(reg_PC + 1);
+			if (cpu->halted)
+				i8085_push(cpu, cpu->pc + 1);
 			else
-				i8085_push(reg_PC);
-			reg_PC = vec;
+				i8085_push(cpu, cpu->pc);
+			cpu->pc = vec;
 			cycles -= 12;	/* Check me */
 		}
-		intprotect = 0;
-		halted = 0;
-
-		opcode = i8085_read(reg_PC);
-		
-		if (i8085_log)
-			fprintf(i8085_log, "%04X : %02x %02X %02X : %6s %02X %04X %04X %04X %04X\n",
-				reg_PC, i8085_debug_read(reg_PC), i8085_debug_read(reg_PC + 1), i8085_debug_read(reg_PC + 2),
-				i8085_flags(reg8[FLAGS]), reg8[A], reg16_BC, reg16_DE, reg16_HL, reg_SP);
-		
-		reg_PC++;
+		/* Nothing else can be due until the next change, except
+		   straight after EI */
+		cpu->intcheck = cpu->intprotect;
+		cpu->intprotect = 0;
+		}
+		cpu->halted = 0;
+
+		opcode = i8085_read(cpu, cpu->pc);
+
+		if (cpu->log)
+			fprintf(cpu->log, "%04X : %02x %02X %02X : %6s %02X %04X %04X %04X %04X\n",
+				cpu->pc, i8085_debug_read(cpu, cpu->pc), i8085_debug_read(cpu, cpu->pc + 1), i8085_debug_read(cpu, cpu->pc + 2),
+				i8085_flags(cpu->reg8[FLAGS]), cpu->reg8[A], reg16_BC, reg16_DE, reg16_HL, cpu->sp);
+
+		cpu->pc++;
 
 		switch (opcode) {
 			case 0x3A: //LDA a - load A from memory
-				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				reg8[A] = i8085_read(temp16);
-				reg_PC += 2;
+				temp16 = (uint16_t)i8085_read(cpu, cpu->pc) | ((uint16_t)i8085_read(cpu, cpu->pc+1)<<8);
+				cpu->reg8[A] = i8085_read(cpu, temp16);
+				cpu->pc += 2;
 				cycles -= 13;
 				break;
 			case 0x32: //STA a - store A to memory
-				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				i8085_write(temp16, reg8[A]);
-				reg_PC += 2;
+				temp16 = (uint16_t)i8085_read(cpu, cpu->pc) | ((uint16_t)i8085_read(cpu, cpu->pc+1)<<8);
+				i8085_write(cpu, temp16, cpu->reg8[A]);
+				cpu->pc += 2;
 				cycles -= 13;
 				break;
 			case 0x2A: //LHLD a - load H:L from memory
-				temp16 = (uint16_t)i8085_read(reg_PC);
-				temp16 |= ((uint16_t)i8085_read(reg_PC+1)<<8);
-				reg8[L] = i8085_read(temp16++);
-				reg8[H] = i8085_read(temp16);
-				reg_PC += 2;
+				temp16 = (uint16_t)i8085_read(cpu, cpu->pc);
+				temp16 |= ((uint16_t)i8085_read(cpu, cpu->pc+1)<<8);
+				cpu->reg8[L] = i8085_read(cpu, temp16++);
+				cpu->reg8[H] = i8085_read(cpu, temp16);
+				cpu->pc += 2;
 				cycles -= 16;
 				break;
 			case 0x22: //SHLD a - store H:L to memory
-				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				i8085_write(temp16++, reg8[L]);
-				i8085_write(temp16, reg8[H]);
-				reg_PC += 2;
+				temp16 = (uint16_t)i8085_read(cpu, cpu->pc) | ((uint16_t)i8085_read(cpu, cpu->pc+1)<<8);
+				i8085_write(cpu, temp16++, cpu->reg8[L]);
+				i8085_write(cpu, temp16, cpu->reg8[H]);
+				cpu->pc += 2;
 				cycles -= 16;
 				break;
 			case 0xEB: //XCHG - exchange DE and HL content
-				temp8 = reg8[D];
-				reg8[D] = reg8[H];
-				reg8[H] = temp8;
-				temp8 = reg8[E];
-				reg8[E] = reg8[L];
-				reg8[L] = temp8;
+				temp8 = cpu->reg8[D];
+				cpu->reg8[D] = cpu->reg8[H];
+				cpu->reg8[H] = temp8;
+				temp8 = cpu->reg8[E];
+				cpu->reg8[E] = cpu->reg8[L];
+				cpu->reg8[L] = temp8;
 				cycles -= 5;
 				break;
 			case 0xC6: //ADI # - add immediate to A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8;
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_AC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vadd(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				op_add(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0xCE: //ACI # - add immediate to A with carry
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
-				if (test_C()) calc_AC_carry(reg8[A], temp8); else calc_AC(reg8[A], temp8);
-				/* The carry out is computed including the
-				   carry in of the bit before */
-				calc_Vadd(reg8[A], temp8, test_C());
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				op_adc(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0xD6: //SUI # - subtract immediate from A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				op_sub(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0x27: //DAA - decimal adjust accumulator
-				temp8 = reg8[A];
+				temp8 = cpu->reg8[A];
 				temp16 = temp8;
 				if (((temp16 & 0x0F) > 0x09) || test_AC()) {
 					if (((temp16 & 0x0F) + 0x06) & 0xF0) set_AC(); else clear_AC();
@@ -520,100 +615,74 @@ int i8085_exec(int cycles) {
 					temp16 += 0x60;
 					if (temp16 & 0xFF00) set_C(); //doesn't clear it if this clause is false
 				}
-				calc_SZP((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				calc_SZP(cpu, (uint8_t)temp16);
+				cpu->reg8[A] = (uint8_t)temp16;
 				/* Verify this behaviour */
 				if ((temp8 & 0xF0) == 0x70 &&
 					(temp16 & 0xF0) == 0x80)
 					set_V();
 				else
 					clear_V();
-				calc_K(reg8[A]);
+				calc_K(cpu, cpu->reg8[A]);
 				cycles -= 4;
 				break;
 			case 0xE6: //ANI # - AND immediate with A
-				temp8 = i8085_read(reg_PC++);
-				if ((reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
-				reg8[A] &= temp8;
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				op_ana(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0xF6: //ORI # - OR immediate with A
-				reg8[A] |= i8085_read(reg_PC++);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				op_ora(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0xEE: //XRI # - XOR immediate with A
-				reg8[A] ^= i8085_read(reg_PC++);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				op_xra(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0xDE: //SBI # - subtract immediate from A with borrow
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
-				if (test_C()) calc_subAC_borrow(reg8[A], temp8); else calc_subAC(reg8[A], temp8);
-				calc_Vsub(reg8[A], temp8, test_C());
-				if (((temp16 & 0x00FF) >= reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				op_sbb(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0xFE: //CPI # - compare immediate with A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
+				op_cmp(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 7;
 				break;
 			case 0x07: //RLC - rotate A left
-				if (reg8[A] & 0x80) set_C(); else clear_C();
-				calc_Vadd(reg8[A],reg8[A], reg8[A] & 0x80);
-				reg8[A] = (reg8[A] >> 7) | (reg8[A] << 1);
-				calc_K(reg8[A]);
+				if (cpu->reg8[A] & 0x80) set_C(); else clear_C();
+				calc_Vadd(cpu, cpu->reg8[A],cpu->reg8[A], cpu->reg8[A] & 0x80);
+				cpu->reg8[A] = (cpu->reg8[A] >> 7) | (cpu->reg8[A] << 1);
+				calc_K(cpu, cpu->reg8[A]);
 				cycles -= 4;
 				break;
 			case 0x0F: //RRC - rotate A right
-				if (reg8[A] & 0x01) set_C(); else clear_C();
-				reg8[A] = (reg8[A] << 7) | (reg8[A] >> 1);
+				if (cpu->reg8[A] & 0x01) set_C(); else clear_C();
+				cpu->reg8[A] = (cpu->reg8[A] << 7) | (cpu->reg8[A] >> 1);
 				clear_V();
 				/* Verify if RR ops affect K */
 				cycles -= 4;
 				break;
 			case 0x17: //RAL - rotate A left through carry
 				temp8 = test_C();
-				if (reg8[A] & 0x80) set_C(); else clear_C();
-				calc_Vadd(reg8[A],reg8[A], temp8);
-				reg8[A] = (reg8[A] << 1) | temp8;
-				calc_K(reg8[A]);
+				if (cpu->reg8[A] & 0x80) set_C(); else clear_C();
+				calc_Vadd(cpu, cpu->reg8[A],cpu->reg8[A], temp8);
+				cpu->reg8[A] = (cpu->reg8[A] << 1) | temp8;
+				calc_K(cpu, cpu->reg8[A]);
 				cycles -= 4;
 				break;
 			case 0x1F: //RAR - rotate A right through carry
 				temp8 = test_C();
-				if (reg8[A] & 0x01) set_C(); else clear_C();
-				reg8[A] = (reg8[A] >> 1) | (temp8 << 7);
+				if (cpu->reg8[A] & 0x01) set_C(); else clear_C();
+				cpu->reg8[A] = (cpu->reg8[A] >> 1) | (temp8 << 7);
 				cycles -= 4;
 				/* Verify if RR ops affect K */
 				clear_V();
 				break;
 			case 0x2F: //CMA - complement A
-				reg8[A] = ~reg8[A];
+				cpu->reg8[A] = ~cpu->reg8[A];
 				cycles -= 4;
 				/* This does not affect flags */
 				break;
 			case 0x3F: //CMC - complement carry flag
-				reg8[FLAGS] ^= 1;
+				cpu->reg8[FLAGS] ^= 1;
 				cycles -= 4;
 				break;
 			case 0x37: //STC - set carry flag
@@ -623,8 +692,8 @@ int i8085_exec(int cycles) {
 			case 0xCB: //RSTv
 				if (test_V()) {
 					cycles -= 6;
-					i8085_push(reg_PC);
-					reg_PC = 0x40;
+					i8085_push(cpu, cpu->pc);
+					cpu->pc = 0x40;
 				}
 				cycles -= 6;
 				break;
@@ -636,76 +705,82 @@ int i8085_exec(int cycles) {
 			case 0xDF:
 			case 0xEF:
 			case 0xFF:
-				i8085_push(reg_PC);
-				reg_PC = (uint16_t)((opcode >> 3) & 7) << 3;
+				i8085_push(cpu, cpu->pc);
+				cpu->pc = (uint16_t)((opcode >> 3) & 7) << 3;
 				cycles -= 12;
 				break;
 			case 0xE9: //PCHL - jump to address in H:L
-				reg_PC = reg16_HL;
+				cpu->pc = reg16_HL;
 				/* 6 on 8085 5 on 8080 ... */
 				cycles -= 6;
 				break;
 			case 0xE3: //XTHL - swap H:L with top word on stack
-				temp16 = i8085_pop();
-				i8085_push(reg16_HL);
-				write16_RP(2, temp16);
+				temp16 = i8085_pop(cpu);
+				i8085_push(cpu, reg16_HL);
+				cpu->reg8[L] = temp16;
+				cpu->reg8[H] = temp16 >> 8;
 				cycles -= 16;
 				break;
 			case 0xF9: //SPHL - set SP to content of HL
-				reg_SP = reg16_HL;
+				cpu->sp = reg16_HL;
 				cycles -= 6;
 				break;
 			case 0xDB: //IN p - read input port into A
-				reg8[A] = i8085_inport(i8085_read(reg_PC++));
+				cpu->reg8[A] = i8085_inport(cpu, i8085_read(cpu, cpu->pc++));
 				cycles -= 10;
 				break;
 			case 0xD3: //OUT p - write A to output port
-				i8085_outport(i8085_read(reg_PC++), reg8[A]);
+				i8085_outport(cpu, i8085_read(cpu, cpu->pc++), cpu->reg8[A]);
 				cycles -= 10;
 				break;
 			case 0xFB: //EI - enable intersrupts
-				INTE = 1;
-				intprotect = 1;
+				cpu->inte = 1;
+				cpu->intprotect = 1;
+				cpu->intcheck = 1;
 				cycles -= 4;
 				break;
 			case 0xF3: //DI - disbale interrupts
-				INTE = 0;
+				cpu->inte = 0;
 				cycles -= 4;
 				break;
 			case 0x76: //HLT - halt processor
-				reg_PC--;
+				cpu->pc--;
 				cycles -= 7;
-				halted = 1;
+				cpu->halted = 1;
+				/* Nothing can wake us until someone raises a line so
+				   spin out the rest of the time in one go */
+				if (!cpu->intcheck && !cpu->log && cycles > 0)
+					cycles -= 7 * ((cycles + 6) / 7);
 				break;
 			case 0x00: //NOP - no operation
 				cycles -= 4;
 				break;
 			case 0x08: // DSUB - 16bit subtraction
 				/* Does SUB L,C; SBC H,B for flags */
-				temp8 = reg8[C];
-				temp16 = (uint16_t)reg8[L] - (uint16_t)temp8;
-				if ((temp16 & 0x00FF) >= reg8[L] && temp8)
+				temp8 = cpu->reg8[C];
+				temp16 = (uint16_t)cpu->reg8[L] - (uint16_t)temp8;
+				if ((temp16 & 0x00FF) >= cpu->reg8[L] && temp8)
 					set_C();
 				else
 					clear_C();
-				reg8[L] = (uint8_t)temp16;
+				cpu->reg8[L] = (uint8_t)temp16;
 				/* We don't need the other intermediate flags */
-				temp8 = reg8[B];
-				temp16 = (uint16_t)reg8[H] - (uint16_t)temp8 - (uint16_t)test_C();
+				temp8 = cpu->reg8[B];
+				temp16 = (uint16_t)cpu->reg8[H] - (uint16_t)temp8 - (uint16_t)test_C();
 				if (test_C())
-					calc_subAC_borrow(reg8[H], temp8);
+					calc_subAC_borrow(cpu, cpu->reg8[H], temp8);
 				else
-					calc_subAC(reg8[H], temp8);				
-				calc_Vsub(reg8[H], temp8, test_C());
-				if ((temp16 & 0x00FF) >= reg8[H] && (temp8 | test_C()))
+					calc_subAC(cpu, cpu->reg8[H], temp8);
+				calc_Vsub(cpu, cpu->reg8[H], temp8, test_C());
+				if ((temp16 & 0x00FF) >= cpu->reg8[H] && (temp8 | test_C()))
 					set_C();
 				else
 					clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[H] = (uint8_t)temp16;
+				calc_SZP(cpu, (uint8_t)temp16);
+				calc_K(cpu, temp16);
+				cpu->reg8[H] = (uint8_t)temp16;
 				cycles -= 10;
-				break;					
+				break;
 			case 0x10: // ARHL
 				if (reg16_HL & 1)
 					set_C();
@@ -714,14 +789,14 @@ int i8085_exec(int cycles) {
 				temp16 = reg16_HL >> 1;
 				if (temp16 & 0x4000)
 					temp16 |= 0x8000;
-				i8085_write_reg16(HL, temp16);
+				i8085_write_reg16(cpu, HL, temp16);
 				cycles -= 7;
 				break;
 			case 0x18: // RDEL
 				/* Affects only CY and V */
 				temp16 = reg16_DE;
 				temp8 = test_C();
-				i8085_write_reg16(DE, (temp16 << 1) + temp8);
+				i8085_write_reg16(cpu, DE, (temp16 << 1) + temp8);
 				if (temp16 & 0x8000)
 					set_C();
 				else
@@ -729,376 +804,133 @@ int i8085_exec(int cycles) {
 				cycles -= 10;
 				/* This seems to be a DAD D,D with carry but
 				   I'm not enitrely sure. FIXME */
-				calc_Vadd16(temp16, temp16 + temp8);
+				calc_Vadd16(cpu, temp16, temp16 + temp8);
 				break;
 			case 0x20: // RIM
-				temp8 = reg_IM & 0x07;
-				if (intpend & INT_RST75)
+				temp8 = cpu->im & 0x07;
+				if (cpu->intpend & INT_RST75)
 					temp8 |= 0x10;
-				temp8 |= i8085_get_input() ? 0x80: 0x00;
-				temp8 |= (intpend & 7)  << 4;
-				reg8[A] = temp8;
+				temp8 |= i8085_get_input(cpu) ? 0x80: 0x00;
+				temp8 |= (cpu->intpend & 7)  << 4;
+				cpu->reg8[A] = temp8;
 				cycles -= 4;
 				break;
 			case 0x28: // LDHI
-				i8085_write_reg16(DE, reg16_HL + i8085_read(reg_PC++));
+				i8085_write_reg16(cpu, DE, reg16_HL + i8085_read(cpu, cpu->pc++));
 				cycles -= 10;
 				break;
 			case 0x30: // SIM
-				if (reg8[A] & 0x08)
-					reg_IM = reg8[A] & 0x07;
-				if (reg8[A] & 0x10)
-					intpend &= ~INT_RST75;
-				if (reg8[A] & 0x40)
-					i8085_set_output(reg8[A] & 0x80);
+				if (cpu->reg8[A] & 0x08) {
+					cpu->im = cpu->reg8[A] & 0x07;
+					cpu->intcheck = 1;
+				}
+				if (cpu->reg8[A] & 0x10)
+					cpu->intpend &= ~INT_RST75;
+				if (cpu->reg8[A] & 0x40)
+					i8085_set_output(cpu, cpu->reg8[A] & 0x80);
 				cycles -= 4;
 				break;
 			case 0x38: // LDSI
-				i8085_write_reg16(DE, reg_SP + i8085_read(reg_PC++));
+				i8085_write_reg16(cpu, DE, cpu->sp + i8085_read(cpu, cpu->pc++));
 				cycles -= 10;
 				break;
-			case 0x40: case 0x50: case 0x60: case 0x70: //MOV D,S - move register to register
-			case 0x41: case 0x51: case 0x61: case 0x71:
-			case 0x42: case 0x52: case 0x62: case 0x72:
-			case 0x43: case 0x53: case 0x63: case 0x73:
-			case 0x44: case 0x54: case 0x64: case 0x74:
-			case 0x45: case 0x55: case 0x65: case 0x75:
-			case 0x46: case 0x56: case 0x66:
-			case 0x47: case 0x57: case 0x67: case 0x77:
-			case 0x48: case 0x58: case 0x68: case 0x78:
-			case 0x49: case 0x59: case 0x69: case 0x79:
-			case 0x4A: case 0x5A: case 0x6A: case 0x7A:
-			case 0x4B: case 0x5B: case 0x6B: case 0x7B:
-			case 0x4C: case 0x5C: case 0x6C: case 0x7C:
-			case 0x4D: case 0x5D: case 0x6D: case 0x7D:
-			case 0x4E: case 0x5E: case 0x6E: case 0x7E:
-			case 0x4F: case 0x5F: case 0x6F: case 0x7F:
-				reg = (opcode >> 3) & 7;
-				reg2 = opcode & 7;
-				i8085_write_reg8(reg, i8085_read_reg8(reg2));
-				if ((reg == M) || (reg2 == M)) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+			/* MOV D,S - move register to register */
+			OPERANDS(0x40, MOV, B)
+			OPERANDS(0x48, MOV, C)
+			OPERANDS(0x50, MOV, D)
+			OPERANDS(0x58, MOV, E)
+			OPERANDS(0x60, MOV, H)
+			OPERANDS(0x68, MOV, L)
+			OPERANDS(0x78, MOV, A)
+			case 0x70: MOV_M(0, cpu->reg8[B]); cycles -= 7; break;
+			case 0x71: MOV_M(0, cpu->reg8[C]); cycles -= 7; break;
+			case 0x72: MOV_M(0, cpu->reg8[D]); cycles -= 7; break;
+			case 0x73: MOV_M(0, cpu->reg8[E]); cycles -= 7; break;
+			case 0x74: MOV_M(0, cpu->reg8[H]); cycles -= 7; break;
+			case 0x75: MOV_M(0, cpu->reg8[L]); cycles -= 7; break;
+			case 0x77: MOV_M(0, cpu->reg8[A]); cycles -= 7; break;
+			/* INR, DCR and MVI */
+			REG8_OPS(0x00, B)
+			REG8_OPS(0x08, C)
+			REG8_OPS(0x10, D)
+			REG8_OPS(0x18, E)
+			REG8_OPS(0x20, H)
+			REG8_OPS(0x28, L)
+			REG8_OPS(0x38, A)
+			case 0x34: //INR M
+				temp8 = i8085_read(cpu, reg16_HL);
+				i8085_write(cpu, reg16_HL, op_inr(cpu, temp8));
+				cycles -= 10;
 				break;
-			case 0x06: //MVI D,# - move immediate to register
-			case 0x16:
-			case 0x26:
-			case 0x36:
-			case 0x0E:
-			case 0x1E:
-			case 0x2E:
-			case 0x3E:
-				reg = (opcode >> 3) & 7;
-				i8085_write_reg8(reg, i8085_read(reg_PC++));
-				if (reg == M) {
-					cycles -= 10;
-				} else {
-					cycles -= 7;
-				}
+			case 0x35: //DCR M
+				temp8 = i8085_read(cpu, reg16_HL);
+				i8085_write(cpu, reg16_HL, op_dcr(cpu, temp8));
+				cycles -= 10;
+				break;
+			case 0x36: //MVI M,#
+				i8085_write(cpu, reg16_HL, i8085_read(cpu, cpu->pc++));
+				cycles -= 10;
 				break;
-			case 0x01: //LXI RP,# - load register pair immediate
-			case 0x11:
-			case 0x21:
-			case 0x31:
-				reg = (opcode >> 4) & 3;
-				/* Although there are not internal side effects we must put
-				   the two reads on the bus in order */
-				temp8 = i8085_read(reg_PC);
-				write_RP(reg, temp8, i8085_read(reg_PC + 1));
-				reg_PC += 2;
+			/* LXI, INX, DAD, DCX, POP and PUSH */
+			PAIR_OPS(0x00, B, C)
+			PAIR_OPS(0x10, D, E)
+			PAIR_OPS(0x20, H, L)
+			case 0x31: //LXI SP,#
+				temp16 = i8085_read(cpu, cpu->pc);
+				cpu->sp = temp16 | ((uint16_t)i8085_read(cpu, cpu->pc + 1) << 8);
+				cpu->pc += 2;
 				cycles -= 10;
 				break;
 			case 0x0A: //LDAX BC - load A indirect through BC
-				reg8[A] = i8085_read(reg16_BC);
+				cpu->reg8[A] = i8085_read(cpu, reg16_BC);
 				cycles -= 7;
 				break;
 			case 0x1A: //LDAX DE - load A indirect through DE
-				reg8[A] = i8085_read(reg16_DE);
+				cpu->reg8[A] = i8085_read(cpu, reg16_DE);
 				cycles -= 7;
 				break;
 			case 0x02: //STAX BC - store A indirect through BC
-				i8085_write(reg16_BC, reg8[A]);
+				i8085_write(cpu, reg16_BC, cpu->reg8[A]);
 				cycles -= 7;
 				break;
 			case 0x12: //STAX DE - store A indirect through DE
-				i8085_write(reg16_DE, reg8[A]);
+				i8085_write(cpu, reg16_DE, cpu->reg8[A]);
 				cycles -= 7;
 				break;
-			case 0x04: //INR D - increment register
-			case 0x14:
-			case 0x24:
-			case 0x34:
-			case 0x0C:
-			case 0x1C:
-			case 0x2C:
-			case 0x3C:
-				reg = (opcode >> 3) & 7;
-				temp8 = i8085_read_reg8(reg); //reg8[reg];
-				calc_AC(temp8, 1);
-				calc_SZP(temp8 + 1);
-				if (temp8 == 0x7F)
-					set_V();
-				else
-					clear_V();
-				calc_K(temp8+1);
-				i8085_write_reg8(reg, temp8 + 1); //reg8[reg]++;
-				if (reg == M) {
-					cycles -= 10;
-				} else {
-					cycles -= 4;
-				}
-				break;
-			case 0x05: //DCR D - decrement register
-			case 0x15:
-			case 0x25:
-			case 0x35:
-			case 0x0D:
-			case 0x1D:
-			case 0x2D:
-			case 0x3D:
-				reg = (opcode >> 3) & 7;
-				temp8 = i8085_read_reg8(reg); //reg8[reg];
-				calc_subAC(temp8, 1);
-				calc_SZP(temp8 - 1);
-				if (temp8 == 0x80)
-					set_V();
-				else
-					clear_V();
-				calc_K(temp8 - 1);
-				i8085_write_reg8(reg, temp8 - 1); //reg8[reg]--;
-				if (reg == M) {
-					cycles -= 10;
-				} else {
-					cycles -= 4;
-				}
-				break;
-			case 0x03: //INX RP - increment register pair
-			case 0x13:
-			case 0x23:
-			case 0x33:
-				reg = (opcode >> 4) & 3;
-				temp16 = read_RP(reg) + 1;
-				if (temp16 == 0x8000)
-					set_V();
-				else
-					clear_V();
-				if (temp16 == 0x0000)
-					set_K();
-				else
-					clear_K();
-				write16_RP(reg, temp16);
-				cycles -= 6;
-				break;
-			case 0x0B: //DCX RP - decrement register pair
-			case 0x1B:
-			case 0x2B:
-			case 0x3B:
-				reg = (opcode >> 4) & 3;
-				temp16 = read_RP(reg) - 1;
-				if (temp16 == 0x7FFF)
-					set_V();
-				else
-					clear_V();
-				if (temp16 == 0xFFFF)
-					set_K();
-				else
-					clear_K();
-				write16_RP(reg, temp16);
+			case 0x33: //INX SP
+				cpu->sp = op_inx(cpu, cpu->sp);
 				cycles -= 6;
 				break;
-			case 0x09: //DAD RP - add register pair to HL
-			case 0x19:
-			case 0x29:
-			case 0x39:
-				reg = (opcode >> 4) & 3;
-				calc_Vadd16(reg16_HL, read_RP(reg));
-				temp32 = (uint32_t)reg16_HL + (uint32_t)read_RP(reg);
-				write16_RP(2, (uint16_t)temp32);
-				if (temp32 & 0xFFFF0000) set_C(); else clear_C();
-				calc_K(temp32 >> 8);;
+			case 0x39: //DAD SP
+				op_dad(cpu, cpu->sp);
 				cycles -= 10;
 				break;
-			case 0x80: //ADD S - add register or memory to A
-			case 0x81:
-			case 0x82:
-			case 0x83:
-			case 0x84:
-			case 0x85:
-			case 0x86:
-			case 0x87:
-				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8;
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_AC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vadd(reg8[A], temp8, 0);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
-				break;
-			case 0x88: //ADC S - add register or memory to A with carry
-			case 0x89:
-			case 0x8A:
-			case 0x8B:
-			case 0x8C:
-			case 0x8D:
-			case 0x8E:
-			case 0x8F:
-				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
-				if (test_C()) calc_AC_carry(reg8[A], temp8); else calc_AC(reg8[A], temp8);
-				calc_Vadd(reg8[A], temp8, test_C());
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
-				break;
-			case 0x90: //SUB S - subtract register or memory from A
-			case 0x91:
-			case 0x92:
-			case 0x93:
-			case 0x94:
-			case 0x95:
-			case 0x96:
-			case 0x97:
-				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
-				break;
-			case 0x98: //SBB S - subtract register or memory from A with borrow
-			case 0x99:
-			case 0x9A:
-			case 0x9B:
-			case 0x9C:
-			case 0x9D:
-			case 0x9E:
-			case 0x9F:
-				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
-				if (test_C()) calc_subAC_borrow(reg8[A], temp8); else calc_subAC(reg8[A], temp8);
-				calc_Vsub(reg8[A], temp8, test_C());
-				if (((temp16 & 0x00FF) >= reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
-				break;
-			case 0xA0: //ANA S - AND register with A
-			case 0xA1:
-			case 0xA2:
-			case 0xA3:
-			case 0xA4:
-			case 0xA5:
-			case 0xA6:
-			case 0xA7:
-				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				if ((reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
-				reg8[A] &= temp8;
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
-				break;
-			case 0xB0: //ORA S - OR register with A
-			case 0xB1:
-			case 0xB2:
-			case 0xB3:
-			case 0xB4:
-			case 0xB5:
-			case 0xB6:
-			case 0xB7:
-				reg = opcode & 7;
-				reg8[A] |= i8085_read_reg8(reg);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+			case 0x3B: //DCX SP
+				cpu->sp = op_dcx(cpu, cpu->sp);
+				cycles -= 6;
 				break;
-			case 0xA8: //XRA S - XOR register with A
-			case 0xA9:
-			case 0xAA:
-			case 0xAB:
-			case 0xAC:
-			case 0xAD:
-			case 0xAE:
-			case 0xAF:
-				reg = opcode & 7;
-				reg8[A] ^= i8085_read_reg8(reg);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+			case 0xF1: //POP PSW
+				temp16 = i8085_pop(cpu);
+				cpu->reg8[FLAGS] = (temp16 & 0x00FF) & 0xF7;
+				cpu->reg8[A] = temp16 >> 8;
+				cycles -= 10;
 				break;
-			case 0xB8: //CMP S - compare register with A
-			case 0xB9:
-			case 0xBA:
-			case 0xBB:
-			case 0xBC:
-			case 0xBD:
-			case 0xBE:
-			case 0xBF:
-				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K(temp16);
-				if (reg == M) {
-					cycles -= 7;
-				} else {
-					cycles -= 4;
-				}
+			case 0xF5: //PUSH PSW
+				i8085_push(cpu, reg16_PSW);
+				cycles -= 12;
 				break;
+			OPERANDS(0x80, ALU, op_add)	//ADD S - add register or memory to A
+			OPERANDS(0x88, ALU, op_adc)	//ADC S - add register or memory to A with carry
+			OPERANDS(0x90, ALU, op_sub)	//SUB S - subtract register or memory from A
+			OPERANDS(0x98, ALU, op_sbb)	//SBB S - subtract register or memory from A with borrow
+			OPERANDS(0xA0, ALU, op_ana)	//ANA S - AND register with A
+			OPERANDS(0xA8, ALU, op_xra)	//XRA S - XOR register with A
+			OPERANDS(0xB0, ALU, op_ora)	//ORA S - OR register with A
+			OPERANDS(0xB8, ALU, op_cmp)	//CMP S - compare register with A
 			case 0xC3: //JMP a - unconditional jump
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				reg_PC = temp16;
+				temp16 = (uint8_t)i8085_read(cpu, cpu->pc);
+				temp16 |= (((uint16_t)i8085_read(cpu, cpu->pc + 1)) << 8);
+				cpu->pc = temp16;
 				cycles -= 10;
 				break;
 			case 0xC2: //Jccc - conditional jumps
@@ -1109,48 +941,48 @@ int i8085_exec(int cycles) {
 			case 0xEA:
 			case 0xF2:
 			case 0xFA:
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				if (test_cond((opcode >> 3) & 7)) {
-					reg_PC = temp16;
+				temp16 = (uint8_t)i8085_read(cpu, cpu->pc);
+				temp16 |= (((uint16_t)i8085_read(cpu, cpu->pc + 1)) << 8);
+				if (test_cond(cpu, (opcode >> 3) & 7)) {
+					cpu->pc = temp16;
 					cycles -= 10;
 				} else {
-					reg_PC += 2;
+					cpu->pc += 2;
 					cycles -= 7;
 				}
 				break;
 			case 0xDD: // JNK
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
+				temp16 = (uint8_t)i8085_read(cpu, cpu->pc);
+				temp16 |= (((uint16_t)i8085_read(cpu, cpu->pc + 1)) << 8);
 				if (!test_K()) {
-					reg_PC = temp16;
+					cpu->pc = temp16;
 					cycles -= 10;
 				} else {
-					reg_PC += 2;
+					cpu->pc += 2;
 					cycles -= 7;
 				}
 				break;
 			case 0xED:
-				reg8[L] = i8085_read(reg16_DE);
-				reg8[H] = i8085_read(reg16_DE + 1);
+				cpu->reg8[L] = i8085_read(cpu, reg16_DE);
+				cpu->reg8[H] = i8085_read(cpu, reg16_DE + 1);
 				cycles -= 10;
 				break;
 			case 0xFD:
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
+				temp16 = (uint8_t)i8085_read(cpu, cpu->pc);
+				temp16 |= (((uint16_t)i8085_read(cpu, cpu->pc + 1)) << 8);
 				if (!test_K()) {
-					reg_PC = temp16;
+					cpu->pc = temp16;
 					cycles -= 10;
 				} else {
-					reg_PC += 2;
+					cpu->pc += 2;
 					cycles -= 7;
 				}
 				break;
 			case 0xCD: //CALL a - unconditional call
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				i8085_push(reg_PC + 2);
-				reg_PC = temp16;
+				temp16 = (uint8_t)i8085_read(cpu, cpu->pc);
+				temp16 |= (((uint16_t)i8085_read(cpu, cpu->pc + 1)) << 8);
+				i8085_push(cpu, cpu->pc + 2);
+				cpu->pc = temp16;
 				cycles -= 18;
 				break;
 			case 0xC4: //Cccc - conditional calls
@@ -1161,24 +993,24 @@ int i8085_exec(int cycles) {
 			case 0xEC:
 			case 0xF4:
 			case 0xFC:
-				temp16 = (uint8_t)i8085_read(reg_PC);
-				temp16 |= (((uint16_t)i8085_read(reg_PC + 1)) << 8);
-				if (test_cond((opcode >> 3) & 7)) {
-					i8085_push(reg_PC + 2);
-					reg_PC = temp16;
+				temp16 = (uint8_t)i8085_read(cpu, cpu->pc);
+				temp16 |= (((uint16_t)i8085_read(cpu, cpu->pc + 1)) << 8);
+				if (test_cond(cpu, (opcode >> 3) & 7)) {
+					i8085_push(cpu, cpu->pc + 2);
+					cpu->pc = temp16;
 					cycles -= 18;
 				} else {
-					reg_PC += 2;
+					cpu->pc += 2;
 					cycles -= 9;
 				}
 				break;
 			case 0xD9: //SHLX
-				i8085_write(reg16_DE, reg8[L]);
-				i8085_write(reg16_DE+1, reg8[H]);
+				i8085_write(cpu, reg16_DE, cpu->reg8[L]);
+				i8085_write(cpu, reg16_DE+1, cpu->reg8[H]);
 				cycles -= 10;
 				break;
 			case 0xC9: //RET - unconditional return
-				reg_PC = i8085_pop();
+				cpu->pc = i8085_pop(cpu);
 				cycles -= 10;
 				break;
 			case 0xC0: //Rccc - conditional returns
@@ -1189,32 +1021,15 @@ int i8085_exec(int cycles) {
 			case 0xE8:
 			case 0xF0:
 			case 0xF8:
-				if (test_cond((opcode >> 3) & 7)) {
-					reg_PC = i8085_pop();
+				if (test_cond(cpu, (opcode >> 3) & 7)) {
+					cpu->pc = i8085_pop(cpu);
 					cycles -= 12;
 				} else {
 					cycles -= 6;
 				}
 				break;
-			case 0xC5: //PUSH RP - push register pair on the stack
-			case 0xD5:
-			case 0xE5:
-			case 0xF5:
-				reg = (opcode >> 4) & 3;
-				i8085_push(read_RP_PUSHPOP(reg));
-				/* 11 on 8080 12 on 8085 */
-				cycles -= 12;
-				break;
-			case 0xC1: //POP RP - pop register pair from the stack
-			case 0xD1:
-			case 0xE1:
-			case 0xF1:
-				reg = (opcode >> 4) & 3;
-				write16_RP_PUSHPOP(reg, i8085_pop());
-				cycles -= 10;
-				break;
 			default:
-				printf("UNRECOGNIZED INSTRUCTION @ %04Xh: %02X\n", reg_PC - 1, opcode);
+				printf("UNRECOGNIZED INSTRUCTION @ %04Xh: %02X\n", cpu->pc - 1, opcode);
 				exit(0);
 		}
 
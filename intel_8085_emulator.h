@@ -8,16 +8,30 @@ typedef enum
 }
 reg_t;
 
-extern uint8_t i8085_read(uint16_t addr);
-extern void i8085_write(uint16_t addr, uint8_t value);
-extern uint8_t i8085_debug_read(uint16_t addr);
-extern uint8_t i8085_inport(uint8_t port);
-extern void i8085_outport(uint8_t port, uint8_t value);
-extern int i8085_get_input(void);
-extern void i8085_set_output(int value);
-
-extern void i8085_set_int(int n);
-extern void i8085_clear_int(int n);
+/* One 8085. The board supplies the bus functions below */
+struct i8085 {
+	uint8_t reg8[9];
+	uint16_t sp;
+	uint16_t pc;
+	uint8_t inte;
+	uint8_t im;		/* SIM interrupt masks */
+	uint8_t intpend;
+	uint8_t intprotect;	/* The instruction after EI */
+	uint8_t halted;
+	uint8_t intcheck;	/* Set when an interrupt might have become due */
+	FILE *log;
+};
+
+extern uint8_t i8085_read(struct i8085 *cpu, uint16_t addr);
+extern void i8085_write(struct i8085 *cpu, uint16_t addr, uint8_t value);
+extern uint8_t i8085_debug_read(struct i8085 *cpu, uint16_t addr);
+extern uint8_t i8085_inport(struct i8085 *cpu, uint8_t port);
+extern void i8085_outport(struct i8085 *cpu, uint8_t port, uint8_t value);
+extern int i8085_get_input(struct i8085 *cpu);
+extern void i8085_set_output(struct i8085 *cpu, int value);
+
+extern void i8085_set_int(struct i8085 *cpu, int n);
+extern void i8085_clear_int(struct i8085 *cpu, int n);
 
 #define INT_NMI		0x80
 #define INT_EXTERN	0x40	/* Assumed to provide 0xFF */
@@ -28,16 +42,14 @@ extern void i8085_clear_int(int n);
 #define INT_RST55	0x01
 
 
-extern uint8_t i8085_read_reg8(reg_t reg);
-extern void i8085_write_reg8(reg_t reg, uint8_t value);
-
-extern uint16_t i8085_read_reg16(reg_t reg);
-extern void i8085_write_reg16(reg_t reg, uint16_t value);
+extern uint8_t i8085_read_reg8(struct i8085 *cpu, reg_t reg);
+extern void i8085_write_reg8(struct i8085 *cpu, reg_t reg, uint8_t value);
 
-extern void i8085_reset();
+extern uint16_t i8085_read_reg16(struct i8085 *cpu, reg_t reg);
+extern void i8085_write_reg16(struct i8085 *cpu, reg_t reg, uint16_t value);
 
-extern int i8085_exec(int cycles);
+extern void i8085_reset(struct i8085 *cpu);
 
-extern FILE *i8085_log;
+extern int i8085_exec(struct i8085 *cpu, int cycles);
 
 #endif
@@ -21,30 +21,54 @@
 #include <SDL2/SDL.h>
 
 #include "keymatrix.h"
+#include "trace.h"
 
 struct keymatrix {
     unsigned int rows;
     unsigned int cols;
     unsigned int size;
     SDL_Keycode *matrix;
-    bool *status;
+    int *hash;			/* Matrix position + 1 by keycode, 0 empty */
+    unsigned int hashmask;
+    uint32_t *rowbits;		/* Keys down in each row */
     int trace;
 };
- 
+
+static unsigned int keymatrix_hash(struct keymatrix *km, SDL_Keycode keycode)
+{
+    return ((uint32_t)keycode * 2654435761U) >> 8 & km->hashmask;
+}
+
 /*
  *	Work out what this key is in the matrix
  */
 static int keymatrix_find(struct keymatrix *km, SDL_Keycode keycode)
 {
-    SDL_Keycode *m = km->matrix;
-    unsigned int n = 0;
-    while(n < km->size) {
-        if (*m++ == keycode)
-            return n;
-        n++;
+    unsigned int h = keymatrix_hash(km, keycode);
+    int n;
+
+    while((n = km->hash[h]) != 0) {
+        if (km->matrix[n - 1] == keycode)
+            return n - 1;
+        h = (h + 1) & km->hashmask;
     }
     return -1;
+}
+
+/* Build the keycode lookup. If a key appears twice the first one wins */
+static void keymatrix_build(struct keymatrix *km)
+{
+    unsigned int n;
+    unsigned int h;
 
+    for (n = 0; n < km->size; n++) {
+        if (keymatrix_find(km, km->matrix[n]) != -1)
+            continue;
+        h = keymatrix_hash(km, km->matrix[n]);
+        while (km->hash[h])
+            h = (h + 1) & km->hashmask;
+        km->hash[h] = n + 1;
+    }
 }
 
 /*
@@ -58,12 +82,15 @@ static bool keymatrix_event(struct keymatrix *km, SDL_Keysym *keysym, bool down)
     /* Not a key we emulate */
     if (n == -1)
         return false;
-    if (km->trace)
+    if (TRACE_ON(km->trace))
         fprintf(stderr, "Keysym %02x (%s) was mapped (%d, %d).\n",
             (unsigned int)keysym->sym,
             down ? "Down" : "Up",
             n / km->cols, n % km->cols);
-    km->status[n] = down;
+    if (down)
+        km->rowbits[n / km->cols] |= 1U << (n % km->cols);
+    else
+        km->rowbits[n / km->cols] &= ~(1U << (n % km->cols));
     return true;
 }
 
@@ -75,20 +102,13 @@ static bool keymatrix_event(struct keymatrix *km, SDL_Keysym *keysym, bool down)
 uint8_t keymatrix_input(struct keymatrix *km, uint16_t scanbits)
 {
     unsigned int row;
-    unsigned int col;
-    uint8_t r = 0;
-    bool *p = km->status;
+    uint32_t r = 0;
 
     /* Work out what byte code you get back. For the moment ignore ghosting
        emulation */
-    for (row = 0; row < km->rows; row++) {
-        if (scanbits & (1 << row)) {
-            for (col = 0; col < km->cols; col++) {
-                if (*p++ == true)
-                    r |= (1 << col);
-            }
-        } else
-            p += km->cols;
+    for (row = 0; scanbits && row < km->rows; row++, scanbits >>= 1) {
+        if (scanbits & 1)
+            r |= km->rowbits[row];
     }
     return r;
 }
@@ -107,7 +127,8 @@ bool keymatrix_SDL2event(struct keymatrix *km, SDL_Event *ev)
 
 void keymatrix_free(struct keymatrix *km)
 {
-    free(km->status);
+    free(km->rowbits);
+    free(km->hash);
     free(km);
 }
 
@@ -123,11 +144,18 @@ struct keymatrix *keymatrix_create(unsigned int rows, unsigned int cols, SDL_Key
     km->cols = cols;
     km->size = rows * cols;
     km->matrix = matrix;
-    km->status = calloc(km->size, sizeof(bool));
-    if (km->status == NULL) {
+    /* At most half full so the probes stay short */
+    km->hashmask = 1;
+    while (km->hashmask < 2 * km->size)
+        km->hashmask <<= 1;
+    km->hash = calloc(km->hashmask, sizeof(int));
+    km->hashmask--;
+    km->rowbits = calloc(rows, sizeof(uint32_t));
+    if (km->hash == NULL || km->rowbits == NULL) {
         fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
+    keymatrix_build(km);
     return km;
 }
 
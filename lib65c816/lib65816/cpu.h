@@ -114,11 +114,7 @@ extern union {      /* Program Counter       */
 
 /* Current cycle count */
 
-#if defined ( __sparc__ ) && defined ( __GNUC__ )
-register word32 cpu_cycle_count asm ("g5");
-#else
 extern word32   cpu_cycle_count;
-#endif
 
 
 
@@ -203,6 +199,12 @@ void CPU_clearIRQ( word32 mask );
 
 void CPU_run(void);
 
+/* Run for at least the given number of clock cycles and return how */
+/* many were used. The caller does its own updates between calls    */
+/* instead of relying on E_UPDATE and the update period.            */
+
+word32 CPU_execute(word32 cycles);
+
 /* Internal routine called when the mode bits (e/m/x) change */
 
 void CPU_modeSwitch(void);
@@ -22,11 +22,7 @@ int	cpu_wait;
 int	cpu_trace;
 
 word32	cpu_update_period;
-#if defined( __sparc__ ) && defined( __GNUC__ )
-register word32	cpu_cycle_count asm ("g5");
-#else
 word32	cpu_cycle_count;
-#endif
 
 void CPU_setUpdatePeriod(word32 period)
 {
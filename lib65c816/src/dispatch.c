@@ -149,73 +149,74 @@ byte    cpu_cycle_table[1300] =
 };
 #endif
 
-void CPU_run(void)
-{
-    word32  last_update,next_update;
-    int opcode;
+/* Put the CPU in emulation mode ready for the reset to be taken */
 
-    cpu_cycle_count = 0;
-    last_update = 0;
-    next_update = cpu_update_period;
+static void CPU_start(void)
+{
     E = 1;
     F_setM(1);
     F_setX(1);
     CPU_modeSwitch();
+}
+
+word32 CPU_execute(word32 cycles)
+{
+    word32  start = cpu_cycle_count;
+    int opcode;
 
-dispatch:
-    if (cpu_cycle_count >= next_update) goto update;
-update_resume:
+    if (cpu_curr_opcode_table == NULL)
+        CPU_start();
+
+    while (cpu_cycle_count - start < cycles) {
 #ifdef DEBUG
-    if (cpu_trace) goto debug;
-debug_resume:
+        if (cpu_trace)
+            CPU_debug();
 #endif
-    if (cpu_reset) goto reset;
-    if (cpu_stop) goto dispatch;
-    if (cpu_abort) goto abort;
-    if (cpu_nmi) goto nmi;
-    if (cpu_irq) goto irq;
-irq_return:
-    if (cpu_wait) { cpu_cycle_count++; goto dispatch; }
-    opcode = M_READ_OPCODE(PC.A);
-    PC.W.PC++;
+        if (cpu_reset) {
+            (**cpu_curr_opcode_table[256])();
+            continue;
+        }
+        /* Stopped until reset: let the rest of the machine run */
+        if (cpu_stop) {
+            cpu_cycle_count = start + cycles;
+            break;
+        }
+        if (cpu_abort) {
+            (**cpu_curr_opcode_table[257])();
+            continue;
+        }
+        if (cpu_nmi) {
+            (**cpu_curr_opcode_table[258])();
+            continue;
+        }
+        if (cpu_irq && !(P & 0x04)) {
+            (**cpu_curr_opcode_table[259])();
+            continue;
+        }
+        if (cpu_wait) {
+            cpu_cycle_count++;
+            continue;
+        }
+        opcode = M_READ_OPCODE(PC.A);
+        PC.W.PC++;
 
 #ifdef OLDCYCLES
-    cpu_cycle_count += cpu_curr_cycle_table[opcode];
+        cpu_cycle_count += cpu_curr_cycle_table[opcode];
 #endif
-    (**cpu_curr_opcode_table[opcode])();
-
-    goto dispatch;
-
-/* Special cases. Since these don't happen a lot more often than they   */
-/* do happen, accessing them this way means most of the time the    */
-/* generated code is _not_ branching. Only during the special cases do  */
-/* we take the branch penalty (if there is one).            */
-
-update:
-    E_UPDATE(cpu_cycle_count);
-    last_update = cpu_cycle_count;
-    next_update = last_update + cpu_update_period;
-    goto update_resume;
+        (**cpu_curr_opcode_table[opcode])();
+    }
+    return cpu_cycle_count - start;
+}
 
-#ifdef DEBUG
-debug:
-    CPU_debug();
-    goto debug_resume;
-#endif
-reset:
-    (**cpu_curr_opcode_table[256])();
-    goto dispatch;
-abort:
-    (**cpu_curr_opcode_table[257])();
-    goto dispatch;
-nmi:
-    (**cpu_curr_opcode_table[258])();
-    goto dispatch;
-irq:
-    if (P & 0x04) goto irq_return;
-    (**cpu_curr_opcode_table[259])();
-    goto dispatch;
+void CPU_run(void)
+{
+    cpu_cycle_count = 0;
+    CPU_start();
 
+    while (1) {
+        CPU_execute(cpu_update_period);
+        E_UPDATE(cpu_cycle_count);
+    }
 }
 
 /* Recalculate opcode_offset based on the new processor mode */
@@ -29,6 +29,7 @@ extern "C" {
 #endif
 
 #include <stdarg.h>
+#include <stdio.h>
 
 /*
     Functions which your program should provide are marked here by 
@@ -167,6 +168,15 @@ void	 fdd_setfilename(FDRV_PTR fd, const char *s);
  * FDC. It is intended for use by administration interfaces */
 fd_err_t fdd_new_dsk(FDRV_PTR fd);
 
+/* Replace the fopen() used for DSK files, for example to put an overlay
+ * between the drive and the image. NULL restores fopen() */
+void	 fdd_setopen(FILE *(*fn)(const char *name, const char *mode));
+
+/* Hold sector writes in the in-memory copy of the image and only write
+ * the changed tracks back on fdd_flush() or eject */
+void	 fdd_setwriteback(FDRV_PTR fd, int onoff);
+fd_err_t fdd_flush(FDRV_PTR fd);
+
 
 #ifdef DSK_ERR_OK	/* LIBDSK headers included */
 /* Subclass of FLOPPY_DRIVE: a drive which emulates discs using LIBDSK
@@ -185,6 +195,8 @@ void	 fdl_settype(FDRV_PTR fd, const char *s);
 /* Set the LIBDSK compression type. NULL for automatic */
 const char *   fdl_getcomp(FDRV_PTR fd);		
 void	 fdl_setcomp(FDRV_PTR fd, const char *s);
+/* Write the sectors changed in the cached track back through LIBDSK */
+fd_err_t fdl_flush(FDRV_PTR fd);
 #endif
 
 
@@ -275,6 +287,13 @@ void fdc_set_terminal_count(FDC_PTR self, fdc_byte value);
 void fdc_set_motor(FDC_PTR self, fdc_byte running);
 /* Call this once every cycle round the emulator's main loop */
 void fdc_tick(FDC_PTR self);
+/* Model seek, head load and rotation delays. percent is the fraction of
+ * real drive timing to apply, 0 (the default) completes everything at
+ * once. Time is supplied by calling fdc_advance() */
+void fdc_set_timing(FDC_PTR self, unsigned percent);
+void fdc_advance(FDC_PTR self, unsigned long usec);
+/* Microseconds until the current command stops being busy, 0 if idle */
+unsigned long fdc_busy(FDC_PTR self);
 /* Write to the Digital Output Register. Write -1 to disable DOR emulation */
 void fdc_write_dor(FDC_PTR self, int value);
 /* Read from the Digital Input Register. */
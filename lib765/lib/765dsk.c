@@ -24,6 +24,15 @@
 
 #define SHORT_TIMEOUT	1000
 #define LONGER_TIMEOUT  1333333L
+#define DSK_IMAGE_MAX	(4L << 20)	/* Largest image kept in memory */
+
+static FILE *(*fdd_fopen)(const char *name, const char *mode) = fopen;
+static FLOPPY_DRIVE_VTABLE fdv_dsk;
+
+void fdd_setopen(FILE *(*fn)(const char *name, const char *mode))
+{
+	fdd_fopen = fn ? fn : fopen;
+}
 
 /* Get the status of a DSK file. In fact this routine does not depend on 
  * the drive being a DSK file and could be used by other drive types. */
@@ -61,6 +70,18 @@ fdc_byte fdd_drive_status(FLOPPY_DRIVE *fd)
 }
 
 
+/* Drop the track index and in-memory copy of the image */
+static void fdd_index_free(DSK_FLOPPY_DRIVE *fdd)
+{
+	free(fdd->fdd_tracks);
+	free(fdd->fdd_image);
+	fdd->fdd_tracks    = NULL;
+	fdd->fdd_ntracks   = 0;
+	fdd->fdd_cur       = NULL;
+	fdd->fdd_image     = NULL;
+	fdd->fdd_image_len = 0;
+}
+
 /* Reset variables: No DSK loaded. Called on eject and on initialisation */
 static void fdd_reset(FLOPPY_DRIVE *fd)
 {
@@ -68,12 +89,118 @@ static void fdd_reset(FLOPPY_DRIVE *fd)
 
         fdd->fdd_filename[0] = 0;
         fdd->fdd_fp = NULL;
+	fdd_index_free(fdd);
         memset(fdd->fdd_disk_header,  0, sizeof(fdd->fdd_disk_header));
         memset(fdd->fdd_track_header, 0, sizeof(fdd->fdd_track_header));
 }
 
 
 
+/* Read from the image at a given offset, from memory if we have it.
+ * Returns the number of bytes read */
+static long fdd_read_at(DSK_FLOPPY_DRIVE *fdd, long pos, fdc_byte *buf, long len)
+{
+	if (fdd->fdd_image)
+	{
+		if (pos >= fdd->fdd_image_len) return 0;
+		if (len > fdd->fdd_image_len - pos) 
+			len = fdd->fdd_image_len - pos;
+		memcpy(buf, fdd->fdd_image + pos, len);
+		return len;
+	}
+	if (fseek(fdd->fdd_fp, pos, SEEK_SET)) return 0;
+	return fread(buf, 1, len, fdd->fdd_fp);
+}
+
+/* Write to the image file, keeping the copy in memory up to date. In
+ * writeback mode a write within the current track only marks it dirty */
+static long fdd_write_at(DSK_FLOPPY_DRIVE *fdd, long pos, fdc_byte *buf, long len)
+{
+	if (fdd->fdd_image && pos + len <= fdd->fdd_image_len)
+	{
+		DSK_TRACK *t = fdd->fdd_cur;
+
+		memcpy(fdd->fdd_image + pos, buf, len);
+		if (fdd->fdd_writeback && t && pos >= t->dt_offset &&
+		    pos + len <= t->dt_offset + t->dt_len)
+		{
+			t->dt_dirty = 1;
+			return len;
+		}
+	}
+	if (fseek(fdd->fdd_fp, pos, SEEK_SET)) return 0;
+	return fwrite(buf, 1, len, fdd->fdd_fp);
+}
+
+/* Index the tracks of a newly opened image: where each Track-Info lies,
+ * a copy of it and where each sector's data is. If the image is small
+ * enough it is also read into memory. */
+static void fdd_index_build(DSK_FLOPPY_DRIVE *fdd)
+{
+	fdc_byte *h = fdd->fdd_disk_header;
+	int ext = !memcmp(h, "EXTENDED", 8);
+	long size, offset = 256, secoff;
+	int ntracks, nt, n, maxsec;
+	DSK_TRACK *t;
+
+	fdd_index_free(fdd);
+
+	if (!fseek(fdd->fdd_fp, 0, SEEK_END))
+	{
+		size = ftell(fdd->fdd_fp);
+		if (size > 0 && size <= DSK_IMAGE_MAX)
+			fdd->fdd_image = malloc(size);
+		if (fdd->fdd_image)
+		{
+			fseek(fdd->fdd_fp, 0, SEEK_SET);
+			if (fread(fdd->fdd_image, 1, size, fdd->fdd_fp) < size)
+			{
+				free(fdd->fdd_image);
+				fdd->fdd_image = NULL;
+			}
+			else fdd->fdd_image_len = size;
+		}
+	}
+
+	ntracks = h[0x30] * (h[0x31] > 1 ? 2 : 1);
+	if (ext && ntracks > 256 - 0x34) ntracks = 256 - 0x34;
+	if (!ntracks) return;
+	fdd->fdd_tracks = malloc(ntracks * sizeof(DSK_TRACK));
+	if (!fdd->fdd_tracks) return;
+	fdd->fdd_ntracks = ntracks;
+
+	for (nt = 0; nt < ntracks; nt++)
+	{
+		t = &fdd->fdd_tracks[nt];
+		t->dt_offset = offset;
+		if (ext) offset += 256 * (1 + h[0x34 + nt]);
+		else	 offset += h[0x32] + 256 * h[0x33];
+		t->dt_len   = offset - t->dt_offset;
+		t->dt_dirty = 0;
+
+		t->dt_valid = 
+			fdd_read_at(fdd, t->dt_offset, t->dt_header, 256) == 256 &&
+			!memcmp(t->dt_header, "Track-Info", 10);
+		if (!t->dt_valid) continue;
+
+		memset(t->dt_first, 0, sizeof(t->dt_first));
+		maxsec = t->dt_header[0x15];
+		if (maxsec > DSK_MAXSEC) maxsec = DSK_MAXSEC;
+		secoff = 0;
+		for (n = 0; n < maxsec; n++)
+		{
+			fdc_byte *secid = t->dt_header + 0x18 + 8 * n;
+
+			t->dt_secoff[n] = secoff;
+			t->dt_seclen[n] = ext ? secid[6] + 256 * secid[7]
+					      : 0x80 << t->dt_header[0x14];
+			if (!t->dt_first[secid[2]]) t->dt_first[secid[2]] = n + 1;
+			secoff += t->dt_seclen[n];
+		}
+	}
+}
+
+
 /* Return 1 if this drive is ready, else 0
  * Attempts to open the DSK and load its DSK header, and must
  * therefore be called before any attempted DSK file access. */
@@ -86,10 +213,10 @@ static int fdd_isready(FLOPPY_DRIVE *fd)
 	if (fdd->fdd_fp) return 1;		 /* DSK file is open and OK */	
 	if (fdd->fdd_filename[0] == 0) return 0; /* No filename */
 
-	fdd->fdd_fp = fopen(fdd->fdd_filename, "r+b");
+	fdd->fdd_fp = fdd_fopen(fdd->fdd_filename, "r+b");
 	if (!fdd->fdd_fp)
 	{
-		fdd->fdd_fp = fopen(fdd->fdd_filename, "rb");
+		fdd->fdd_fp = fdd_fopen(fdd->fdd_filename, "rb");
 		if (fdd->fdd_fp)
 		{
 			fd->fd_readonly = 1;	/* Read-only drive */
@@ -122,6 +249,7 @@ static int fdd_isready(FLOPPY_DRIVE *fd)
 	} 
 /* File loaded OK. */
 	fdd->fdd_track_header[0] = 0;	/* Track header not loaded */
+	fdd_index_build(fdd);
 	
         return 1;
 }
@@ -132,12 +260,9 @@ static int fdd_isready(FLOPPY_DRIVE *fd)
  * is the same as cylinder number. For a double-sided disk, track number is
  * (2 * cylinder + head). This is independent of disc format.
  */
-static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
+static int fdd_track_number(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
 {
-	fdc_byte *b;
 	int track;
-	long trk_offset;
-	int nt;
 	if (!fdd->fdd_fp) return -1;
 
 	/* Seek off the edge of the drive */
@@ -160,6 +285,16 @@ static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
 	track = cylinder;
 	if (fdd->fdd_disk_header[0x31] > 1) track *= 2;
 	track += head;
+	return track;
+}
+
+static long fdd_track_offset(DSK_FLOPPY_DRIVE *fdd, int track)
+{
+	fdc_byte *b;
+	long trk_offset;
+	int nt;
+	if (track < 0) return -1;
+	if (track < fdd->fdd_ntracks) return fdd->fdd_tracks[track].dt_offset;
 
         /* Look up the cylinder and head using the header. This behaves 
          * differently in normal and extended DSK files */
@@ -184,12 +319,22 @@ static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
 	return trk_offset;
 }
 
+static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
+{
+	return fdd_track_offset(fdd, fdd_track_number(fdd, cylinder, head));
+}
+
 
 static unsigned char *sector_head(DSK_FLOPPY_DRIVE *fdd, int sector)
 {
         int ms = fdd->fdd_track_header[0x15];
         int sec;
 
+	if (fdd->fdd_cur)
+	{
+		sec = fdd->fdd_cur->dt_first[sector & 0xFF];
+		return sec ? fdd->fdd_track_header + 0x10 + 8 * sec : NULL;
+	}
         for (sec = 0; sec < ms; sec++)
         {
                 if (fdd->fdd_track_header[0x1A + 8 * sec] == sector)
@@ -233,10 +378,20 @@ static fd_err_t fdd_seek_cylinder(FLOPPY_DRIVE *fd, int cylinder)
 /* Load the "Track-Info" header for the current cylinder and given head */
 static fd_err_t fdd_load_track_header(DSK_FLOPPY_DRIVE *fdd, int head)
 {
-        long track = fdd_lookup_track(fdd, fdd->fdd.fd_cylinder, head);
+	int trkno = fdd_track_number(fdd, fdd->fdd.fd_cylinder, head);
+        long track = fdd_track_offset(fdd, trkno);
         if (track < 0) return FD_E_SEEKFAIL;       /* Bad track */
-        fseek(fdd->fdd_fp, track, SEEK_SET);
-        if (fread(fdd->fdd_track_header, 1, 256, fdd->fdd_fp) < 256)
+	fdd->fdd_pos = track + 256;
+	fdd->fdd_cur = NULL;
+	if (trkno < fdd->fdd_ntracks)
+	{
+		DSK_TRACK *t = &fdd->fdd_tracks[trkno];
+		if (!t->dt_valid) return FD_E_NOADDR;
+		memcpy(fdd->fdd_track_header, t->dt_header, 256);
+		fdd->fdd_cur = t;
+		return 0;
+	}
+        if (fdd_read_at(fdd, track, fdd->fdd_track_header, 256) < 256)
                 return FD_E_NOADDR;              /* Missing address mark */
         if (memcmp(fdd->fdd_track_header, "Track-Info", 10))
         {
@@ -266,8 +421,8 @@ static fd_err_t fdd_read_id(FLOPPY_DRIVE *fd, int head, int sector, fdc_byte *bu
 
 
 /* Find the offset of a sector in the current track 
- * Enter with fdd_track_header loaded and the file pointer 
- * just after it (ie, you have just called fdd_load_track_header() ) */
+ * Enter with fdd_track_header loaded (ie, you have just called 
+ * fdd_load_track_header() ) */
 
 static long fdd_sector_offset(DSK_FLOPPY_DRIVE *fdd, int sector, int *seclen,
 			      fdc_byte **secid)
@@ -276,6 +431,14 @@ static long fdd_sector_offset(DSK_FLOPPY_DRIVE *fdd, int sector, int *seclen,
 	long offset = 0;
 	int n;
 
+	if (fdd->fdd_cur)
+	{
+		n = fdd->fdd_cur->dt_first[sector & 0xFF];
+		if (!n--) return -1;
+		*secid  = fdd->fdd_track_header + 0x18 + 8 * n;
+		*seclen = fdd->fdd_cur->dt_seclen[n];
+		return fdd->fdd_cur->dt_secoff[n];
+	}
 	/* Pointer to sector details */
 	*secid = fdd->fdd_track_header + 0x18;
 
@@ -287,7 +450,7 @@ static long fdd_sector_offset(DSK_FLOPPY_DRIVE *fdd, int sector, int *seclen,
 	{
 		for (n = 0; n < maxsec; n++)
 		{
-			*seclen = (*secid)[7] + 256 * (*secid)[8];
+			*seclen = (*secid)[6] + 256 * (*secid)[7];
                        if ((*secid)[2] == sector) return offset;
 			offset   += (*seclen);
 			(*secid) += 8;
@@ -338,8 +501,7 @@ static fd_err_t fdd_seekto_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 		err = FD_E_DATAERR;
 		seclen = *len;
 	}	
-	offs += ftell(fdd->fdd_fp);	
-	fseek(fdd->fdd_fp, offs, SEEK_SET);				
+	fdd->fdd_pos += offs;
 	return err;			
 }
 
@@ -391,7 +553,7 @@ static fd_err_t fdd_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
                         }
 			else *deleted = 1;
                 }
-		if (fread(buf, 1, len, ((DSK_FLOPPY_DRIVE *)fd)->fdd_fp) < len) 
+		if (fdd_read_at(fdd, fdd->fdd_pos, buf, len) < len) 
 			err = FD_E_DATAERR;
 	} while (try_again);
 	return err;
@@ -440,7 +602,7 @@ static fd_err_t fdd_read_track(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 
         if (err == FD_E_DATAERR || err == FD_E_OK)
         {
-                if (fread(buf, 1, trklen, fdd->fdd_fp) < (*len))
+                if (fdd_read_at(fdd, fdd->fdd_pos, buf, trklen) < (*len))
 			err = FD_E_DATAERR;
         }
         return err;
@@ -466,7 +628,7 @@ static fd_err_t fdd_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 	if (err == FD_E_DATAERR || err == 0)
 	{
                 unsigned char odel, *sh = sector_head(fdd, sector);
-		if (fwrite(buf, 1, len, fdd->fdd_fp) < len)
+		if (fdd_write_at(fdd, fdd->fdd_pos, buf, len) < len)
 			err = FD_E_READONLY;
 		fdd->fdd_dirty = 1;
 
@@ -479,9 +641,11 @@ static fd_err_t fdd_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
                 {
                         long track = fdd_lookup_track(fdd, fd->fd_cylinder, head);
                         if (track < 0) return FD_E_SEEKFAIL;       /* Bad track */
-                        fseek(fdd->fdd_fp, track, SEEK_SET);
-                        if (fwrite(fdd->fdd_track_header, 1, 256, fdd->fdd_fp) < 256)
+                        if (fdd_write_at(fdd, track, fdd->fdd_track_header, 256) < 256)
                                 return FD_E_DATAERR; 
+			if (fdd->fdd_cur) 
+				memcpy(fdd->fdd_cur->dt_header, 
+					fdd->fdd_track_header, 256);
                 }
 
 	}
@@ -490,7 +654,7 @@ static fd_err_t fdd_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 
 
 /* Format a track on a DSK. Can grow the DSK file. */
-static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
+static fd_err_t fdd_format_file(FLOPPY_DRIVE *fd, int head,
                 int sectors, fdc_byte *track, fdc_byte filler)
 {
 	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
@@ -664,6 +828,24 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
 	return FD_E_OK;
 }
 
+/* Formatting rewrites the file behind the index, so build it again */
+static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
+                int sectors, fdc_byte *track, fdc_byte filler)
+{
+	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
+	fd_err_t err = fdd_flush(fd);
+
+	if (err) return err;
+	err = fdd_format_file(fd, head, sectors, track, filler);
+
+	if (fdd->fdd_fp && !fd->fd_readonly) 
+	{
+		fflush(fdd->fdd_fp);
+		fdd_index_build(fdd);
+	}
+	return err;
+}
+
 static int fdd_dirty(FLOPPY_DRIVE *fd)
 {
 	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
@@ -671,12 +853,56 @@ static int fdd_dirty(FLOPPY_DRIVE *fd)
 	return fdd->fdd_dirty ? FD_D_DIRTY : FD_D_CLEAN;
 }
 
+/* Write the dirty tracks of the in-memory image back to the file */
+fd_err_t fdd_flush(FDRV_PTR fd)
+{
+	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
+	fd_err_t err = FD_E_OK;
+	DSK_TRACK *t;
+	long len;
+	int nt;
+
+	if (fd->fd_vtable != &fdv_dsk || !fdd->fdd_fp) return FD_E_OK;
+	for (nt = 0; nt < fdd->fdd_ntracks; nt++)
+	{
+		t = &fdd->fdd_tracks[nt];
+		if (!t->dt_dirty) continue;
+		len = t->dt_len;
+		if (len > fdd->fdd_image_len - t->dt_offset)
+			len = fdd->fdd_image_len - t->dt_offset;
+		if (fseek(fdd->fdd_fp, t->dt_offset, SEEK_SET) ||
+		    fwrite(fdd->fdd_image + t->dt_offset, 1, len, fdd->fdd_fp) < len)
+		{
+			fdc_dprintf(0, "Could not write back track %d of %s\n",
+					nt, fdd->fdd_filename);
+			err = FD_E_READONLY;
+			continue;
+		}
+		t->dt_dirty = 0;
+	}
+	fflush(fdd->fdd_fp);
+	return err;
+}
+
+void fdd_setwriteback(FDRV_PTR fd, int onoff)
+{
+	if (fd->fd_vtable == &fdv_dsk)
+	{
+		if (!onoff) fdd_flush(fd);
+		((DSK_FLOPPY_DRIVE *)fd)->fdd_writeback = onoff;
+	}
+}
+
 /* Eject a DSK - close the image file */
 static void fdd_eject(FLOPPY_DRIVE *fd)
 {
         DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
 
-	if (fdd->fdd_fp) fclose(fdd->fdd_fp);
+	if (fdd->fdd_fp) 
+	{
+		fdd_flush(fd);
+		fclose(fdd->fdd_fp);
+	}
 
 	fdd_reset(fd);
 }
@@ -703,6 +929,10 @@ FDRV_PTR fd_newdsk(void)
 {
 	FDRV_PTR p = fd_inew(sizeof(DSK_FLOPPY_DRIVE));
 
+	if (!p) return NULL;
+	((DSK_FLOPPY_DRIVE *)p)->fdd_tracks = NULL;
+	((DSK_FLOPPY_DRIVE *)p)->fdd_image  = NULL;
+	((DSK_FLOPPY_DRIVE *)p)->fdd_writeback = 0;
 	p->fd_vtable = &fdv_dsk;
 	fd_reset(p);
 	return p;
@@ -718,7 +948,7 @@ fd_err_t fdd_new_dsk(FLOPPY_DRIVE *fd)
         int err;
 	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
 
-        fp = fopen(fdd->fdd_filename, "wb");
+        fp = fdd_fopen(fdd->fdd_filename, "wb");
         if (!fp)
         {
                 fdc_dprintf(0, "Cannot open %s\n", fdd->fdd_filename);
@@ -79,6 +79,7 @@ static void fdc_part_reset(FDC_765 *self)
 	self->fdc_exec_pos       = 0;
 	self->fdc_result_len     = 0;
 	self->fdc_result_pos     = 0;
+	self->fdc_delay          = 0;
 	memset(self->fdc_cmd_buf,   0, sizeof(self->fdc_cmd_buf));
 	memset(self->fdc_exec_buf,  0, sizeof(self->fdc_exec_buf));
 	memset(self->fdc_result_buf,0, sizeof(self->fdc_result_buf));
@@ -742,9 +743,39 @@ static void fdc_scan(FDC_765 *self)
 }
 
 
+/* How long the command just executed would have kept a real drive busy,
+ * in microseconds. Assumes a 300rpm drive at 500kbps */
+#define FDC_REV_US	200000L
+#define FDC_BYTE_US	16
+#define FDC_SETTLE_US	15000L
+
+static unsigned long fdc_cmd_time(FDC_765 *self, int cmd, int oldcyl)
+{
+	FLOPPY_DRIVE *fd = self->fdc_dor_drive[self->fdc_cmd_buf[1] & 3];
+	unsigned long step = (16 - (self->fdc_specify[0] >> 4)) * 1000L;
+	unsigned long hlt  = (self->fdc_specify[1] >> 1) * 2000L;
+	unsigned long rot  = FDC_REV_US - self->fdc_clock % FDC_REV_US;
+	int steps = fd ? abs(fd->fd_cylinder - oldcyl) : 0;
+
+	switch(cmd)
+	{
+		case 7:						/* RECALIBRATE */
+		case 15: return steps * step + FDC_SETTLE_US;	/* SEEK */
+		case 2:						/* READ TRACK */
+		case 13: return hlt + rot + FDC_REV_US;		/* FORMAT */
+		case 10: return hlt + rot % (FDC_REV_US / 10);	/* READ ID */
+		case 5:	 case 6:  case 9:  case 12:
+		case 17: case 25: case 30:
+			 return hlt + rot + self->fdc_exec_len * FDC_BYTE_US;
+	}
+	return 0;
+}
+
+
 /* --- Main FDC dispatcher --- */
 static void fdc_execute(FDC_765 *self)
 {
+	int oldcyl = 0;
 /* This code to dump out FDC commands as they are received is very useful
  * in debugging
  *
@@ -758,6 +789,8 @@ static void fdc_execute(FDC_765 *self)
 	/* Check if the DOR (ugh!) is being used to force us to a 
 	   different drive. */
 	fdc_dorcheck(self);
+	if (self->fdc_dor_drive[self->fdc_cmd_buf[1] & 3])
+		oldcyl = self->fdc_dor_drive[self->fdc_cmd_buf[1] & 3]->fd_cylinder;
 
 	/* Reset "seek finished" flag */
 	self->fdc_st0 &= 0xBF;	 
@@ -783,7 +816,9 @@ static void fdc_execute(FDC_765 *self)
 					self->fdc_cmd_buf[0] & 0x1F);
 			fdc_error(self);	break;
 	}
-
+	if (self->fdc_timing)
+		self->fdc_delay = fdc_cmd_time(self, self->fdc_cmd_buf[0] & 0x1F,
+				oldcyl) * self->fdc_timing / 100;
 }
 
 /* Make the FDC drop its "interrupt" line */
@@ -804,6 +839,7 @@ static void fdc_clear_pending_interrupt(FDC_765 *self)
 /* Write a byte to the FDC's "data" register */
 void fdc_write_data(FDC_765 *self, fdc_byte value)
 {
+	if (self->fdc_delay) return;	/* Busy, not accepting data */
 	fdc_byte curcmd;
 
 	fdc_clear_pending_interrupt(self);
@@ -873,6 +909,7 @@ void fdc_write_data(FDC_765 *self, fdc_byte value)
 /* Read the FDC's main data register */
 fdc_byte fdc_read_data (FDC_765 *self)
 {
+	if (self->fdc_delay) return 0xFF;
 	fdc_dprintf(5, "FDC: Read main data register, value = ");
 
 	fdc_clear_pending_interrupt(self);
@@ -918,6 +955,7 @@ fdc_byte fdc_read_data (FDC_765 *self)
 /* Read the FDC's main control register */
 fdc_byte fdc_read_ctrl (FDC_765 *self)
 {
+	if (self->fdc_delay) return 0x10;	/* Busy, no RQM */
 	fdc_dprintf(5, "FDC: Read main status: %02x\n", self->fdc_mainstat);
 	return self->fdc_mainstat;
 }
@@ -1109,10 +1147,30 @@ FDC_PTR fdc_new(void)
 	FDC_PTR self = malloc(sizeof(FDC_765));
 
 	if (!self) return NULL;
+	self->fdc_timing = 0;
+	self->fdc_clock  = 0;
 	fdc_reset(self);
 	return self;	
 }
 
+void fdc_set_timing(FDC_PTR self, unsigned percent)
+{
+	self->fdc_timing = percent;
+	if (!percent) self->fdc_delay = 0;
+}
+
+void fdc_advance(FDC_PTR self, unsigned long usec)
+{
+	self->fdc_clock += usec;
+	if (usec >= self->fdc_delay) self->fdc_delay = 0;
+	else			     self->fdc_delay -= usec;
+}
+
+unsigned long fdc_busy(FDC_PTR self)
+{
+	return self->fdc_delay;
+}
+
 void fdc_destroy(FDC_PTR *p)
 {
 	if (*p) free(*p);
@@ -88,6 +88,23 @@ typedef struct floppy_drive
 /* Subclass of FLOPPY_DRIVE: a drive which emulates discs using the CPCEMU 
  * .DSK format */
 
+/* What a DSK_FLOPPY_DRIVE knows about one track of its image. Built when
+ * the image is opened so a sector is found without touching the file */
+#define DSK_MAXSEC	29		/* Sector entries in a Track-Info */
+
+typedef struct dsk_track
+{
+	long     dt_offset;		/* Of the Track-Info in the file */
+	long     dt_len;		/* Including the Track-Info */
+	int      dt_valid;		/* Track-Info was found */
+	int      dt_dirty;		/* Memory copy is newer than the file */
+	fdc_byte dt_header[256];	/* Copy of the Track-Info */
+	fdc_byte dt_first[256];		/* 1 + entry of first sector with
+					 * that ID, 0 if there is none */
+	long     dt_secoff[DSK_MAXSEC];	/* From the end of the Track-Info */
+	int      dt_seclen[DSK_MAXSEC];
+} DSK_TRACK;
+
 typedef struct dsk_floppy_drive
 {
 /* PUBLIC variables: */
@@ -100,6 +117,13 @@ typedef struct dsk_floppy_drive
 	fdc_byte fdd_disk_header[256];	/* .DSK header */
 	fdc_byte fdd_track_header[256];	/* .DSK track header */
 	int fdd_dirty;			/* Has this disk been written to? */
+	DSK_TRACK *fdd_tracks;		/* Index of the tracks in the image */
+	int fdd_ntracks;
+	DSK_TRACK *fdd_cur;		/* Entry fdd_track_header came from */
+	long fdd_pos;			/* File offset of the chosen sector */
+	fdc_byte *fdd_image;		/* Whole image in memory, or NULL */
+	long fdd_image_len;
+	int fdd_writeback;		/* Writes wait for fdd_flush() */
 } DSK_FLOPPY_DRIVE;
 
 #ifdef DSK_ERR_OK	/* LIBDSK headers included */
@@ -115,6 +139,20 @@ typedef struct libdsk_floppy_drive
 /* PRIVATE variables: */
 	DSK_PDRIVER  fdl_diskp;	
 	DSK_GEOMETRY fdl_diskg;		/* Autoprobed geometry */
+	/* One track read whole, so sectors on it cost no LIBDSK call.
+	 * Written sectors are flagged in fdl_tdirty and go back to the
+	 * image on a track change, fdl_flush() or eject. */
+	fdc_byte    *fdl_track;		/* Sectors then dirty flags, or NULL */
+	size_t       fdl_tlen;		/* Bytes allocated */
+	int          fdl_tcyl;		/* Track held, -1 if none */
+	int          fdl_thead;
+	int          fdl_tfm;		/* dg_fm and rate it was read with */
+	dsk_rate_t   fdl_trate;
+	int          fdl_tvalid;	/* 0 if it could not be read whole */
+	int          fdl_tchanged;	/* Some sector is dirty */
+	dsk_psect_t  fdl_tsectors;	/* Geometry it was read with */
+	dsk_psect_t  fdl_tsecbase;
+	size_t       fdl_tsecsize;
 } LIBDSK_FLOPPY_DRIVE;
 #endif	/* ifdef DSK_ERR_OK */
 
@@ -170,6 +208,13 @@ typedef struct fdc_765
 	int fdc_terminal_count;	/* Set to abort a transfer */	
 	int fdc_isr_countdown;	/* Countdown to interrupt */
 
+	/* Mechanical timing. fdc_timing is a percentage of real drive
+	 * timing, 0 for none. While fdc_delay is running the FDC
+	 * shows itself busy */
+	unsigned fdc_timing;
+	unsigned long fdc_delay;	/* Microseconds */
+	unsigned long fdc_clock;	/* Microseconds, for rotation */
+
 	int fdc_dor;		/* Are we using that horrible kludge, the
 				 * Digital Output Register, rather than
 				 * proper drive select lines? */
@@ -40,6 +40,11 @@ void fdl_reset(FLOPPY_DRIVE *fd)
 	fdl->fdl_type = NULL;
 	fdl->fdl_compress = NULL;
         fdl->fdl_diskp = NULL;
+	free(fdl->fdl_track);
+	fdl->fdl_track = NULL;
+	fdl->fdl_tlen = 0;
+	fdl->fdl_tcyl = -1;
+	fdl->fdl_tchanged = 0;
 }
 
 
@@ -107,6 +112,105 @@ static fd_err_t fdl_xlt_error(dsk_err_t err)
 	return FD_E_NOSECTOR;
 }
 
+/* Write the dirty sectors of the cached track back to the image. A
+ * sector that fails stays dirty and the error is returned. */
+static fd_err_t fdl_writeback(LIBDSK_FLOPPY_DRIVE *fdl)
+{
+	DSK_GEOMETRY *dg = &fdl->fdl_diskg;
+	fdc_byte *dirty;
+	fd_err_t err = FD_E_OK;
+	dsk_err_t e;
+	dsk_psect_t n;
+	int fm = dg->dg_fm;
+	dsk_rate_t rate = dg->dg_datarate;
+
+	if (!fdl->fdl_tchanged) return FD_E_OK;
+	dirty = fdl->fdl_track + fdl->fdl_tsectors * fdl->fdl_tsecsize;
+	dg->dg_fm = fdl->fdl_tfm;
+	dg->dg_datarate = fdl->fdl_trate;
+	fdl->fdl_tchanged = 0;
+	for (n = 0; n < fdl->fdl_tsectors; n++)
+	{
+		if (!dirty[n]) continue;
+		e = dsk_pwrite(fdl->fdl_diskp, dg,
+			fdl->fdl_track + n * fdl->fdl_tsecsize,
+			fdl->fdl_tcyl, fdl->fdl_thead, fdl->fdl_tsecbase + n);
+		if (e)
+		{
+			fdc_dprintf(0, "Could not write back sector %d/%d/%d of %s: %s.\n",
+				fdl->fdl_tcyl, fdl->fdl_thead,
+				fdl->fdl_tsecbase + n, fdl->fdl_filename,
+				dsk_strerror(e));
+			fdl->fdl_tchanged = 1;
+			err = fdl_xlt_error(e);
+			continue;
+		}
+		dirty[n] = 0;
+	}
+	dg->dg_fm = fm;
+	dg->dg_datarate = rate;
+	return err;
+}
+
+/* Forget the cached track, once anything it holds has been written */
+static fd_err_t fdl_discard(LIBDSK_FLOPPY_DRIVE *fdl)
+{
+	fd_err_t err = fdl_writeback(fdl);
+
+	if (!err) fdl->fdl_tcyl = -1;
+	return err;
+}
+
+/* Find a sector in the track cache, reading the track in if need be. 
+ * *where is left NULL if the sector has to go to LIBDSK on its own: it
+ * carries IDs other than the physical ones, is not the usual size or
+ * the track does not read as a whole. */
+static fd_err_t fdl_cached(LIBDSK_FLOPPY_DRIVE *fdl, int xcylinder,
+		int xhead, int head, int sector, int len, fdc_byte **where)
+{
+	DSK_GEOMETRY *dg = &fdl->fdl_diskg;
+	int cylinder = fdl->fdl.fd_cylinder;
+	fd_err_t err;
+	size_t need;
+
+	*where = NULL;
+	if (fdl->fdl_tcyl != cylinder || fdl->fdl_thead != head ||
+	    fdl->fdl_tfm != dg->dg_fm || fdl->fdl_trate != dg->dg_datarate)
+	{
+		err = fdl_discard(fdl);
+		if (err) return err;
+
+		fdl->fdl_tsectors = dg->dg_sectors;
+		fdl->fdl_tsecbase = dg->dg_secbase;
+		fdl->fdl_tsecsize = dg->dg_secsize;
+		need = fdl->fdl_tsectors * (fdl->fdl_tsecsize + 1);
+		if (need > fdl->fdl_tlen)
+		{
+			free(fdl->fdl_track);
+			fdl->fdl_track = malloc(need);
+			fdl->fdl_tlen = fdl->fdl_track ? need : 0;
+		}
+		fdl->fdl_tcyl  = cylinder;
+		fdl->fdl_thead = head;
+		fdl->fdl_tfm   = dg->dg_fm;
+		fdl->fdl_trate = dg->dg_datarate;
+		fdl->fdl_tvalid = need && fdl->fdl_track &&
+			dsk_ptread(fdl->fdl_diskp, dg, fdl->fdl_track,
+				cylinder, head) == DSK_ERR_OK;
+		if (fdl->fdl_tvalid)
+			memset(fdl->fdl_track + fdl->fdl_tsectors * 
+				fdl->fdl_tsecsize, 0, fdl->fdl_tsectors);
+		fdc_dprintf(6, "fdl_cached: track %d/%d %s\n", cylinder,
+			head, fdl->fdl_tvalid ? "loaded" : "not cacheable");
+	}
+	if (!fdl->fdl_tvalid || xcylinder != cylinder || xhead != head ||
+	    len != (int)fdl->fdl_tsecsize || sector < (int)fdl->fdl_tsecbase ||
+	    sector >= (int)(fdl->fdl_tsecbase + fdl->fdl_tsectors))
+		return FD_E_OK;
+	*where = fdl->fdl_track + (sector - fdl->fdl_tsecbase) * fdl->fdl_tsecsize;
+	return FD_E_OK;
+}
+
 /* Seek to a cylinder. */
 
 static fd_err_t fdl_seek_cylinder(FLOPPY_DRIVE *fd, int cylinder)
@@ -169,6 +273,7 @@ static fd_err_t fdl_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 {
 	LIBDSK_FLOPPY_DRIVE *fdl = (LIBDSK_FLOPPY_DRIVE *)fd;
 	dsk_err_t err;
+	fd_err_t fe;
 
 	fdc_dprintf(4, "fdl_read_sector: cyl=%d xc=%d xh=%d h=%d s=%d len=%d\n", 
 			fd->fd_cylinder, xcylinder, xhead, head, sector, len);
@@ -178,6 +283,23 @@ static fd_err_t fdl_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 	fdl->fdl_diskg.dg_fm      = mfm ? 0 : 1;
 	fdl->fdl_diskg.dg_nomulti = multi ? 0 : 1;
 
+	/* A plain read is served from the track cache. Deleted data is
+	 * only seen sector by sector so asking for it goes to LIBDSK. */
+	if (!deleted || !*deleted)
+	{
+		fdc_byte *p;
+
+		fe = fdl_cached(fdl, xcylinder, xhead, head, sector, len, &p);
+		if (fe) return fe;
+		if (p)
+		{
+			memcpy(buf, p, len);
+			return FD_E_OK;
+		}
+	}
+	/* Anything held for this track goes first so LIBDSK sees it */
+	fe = fdl_writeback(fdl);
+	if (fe) return fe;
 	err = dsk_xread(fdl->fdl_diskp, &fdl->fdl_diskg, buf,
 		fd->fd_cylinder, head, xcylinder, xhead, sector, len, deleted);
 
@@ -204,6 +326,8 @@ static fd_err_t fdl_read_track(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 			xcylinder, xhead, head);
 	if (!fdl->fdl_diskp) return FD_E_NOTRDY;
 
+	err = fdl_writeback(fdl);
+	if (err) return err;
 	err = dsk_xtread(fdl->fdl_diskp, &fdl->fdl_diskg, buf,
 			fd->fd_cylinder, head, xcylinder, xhead);
 	return fdl_xlt_error(err);
@@ -218,6 +342,7 @@ static fd_err_t fdl_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 {
 	LIBDSK_FLOPPY_DRIVE *fdl = (LIBDSK_FLOPPY_DRIVE *)fd;
 	dsk_err_t err;
+	fd_err_t fe;
 
 	fdc_dprintf(4, "fdl_write_sector: xc=%d xh=%d h=%d s=%d\n", 
 			xcylinder, xhead, head, sector);
@@ -227,6 +352,27 @@ static fd_err_t fdl_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 /* lib765 0.3.3: Oops. Get the FM/MFM flag round the right way. */
 	fdl->fdl_diskg.dg_fm      = mfm ? 0 : 1;
 	fdl->fdl_diskg.dg_nomulti = multi ? 0 : 1;
+
+	/* Writes to the cached track stay there until it is left */
+	if (!deleted)
+	{
+		fdc_byte *p;
+
+		if (fd->fd_readonly) return FD_E_READONLY;
+		fe = fdl_cached(fdl, xcylinder, xhead, head, sector, len, &p);
+		if (fe) return fe;
+		if (p)
+		{
+			memcpy(p, buf, len);
+			fdl->fdl_track[fdl->fdl_tsectors * fdl->fdl_tsecsize +
+				sector - fdl->fdl_tsecbase] = 1;
+			fdl->fdl_tchanged = 1;
+			return FD_E_OK;
+		}
+	}
+	/* Going round the cache, so it must not hold an older copy */
+	fe = fdl_discard(fdl);
+	if (fe) return fe;
 	err = dsk_xwrite(fdl->fdl_diskp, &fdl->fdl_diskg, buf,
 		fd->fd_cylinder, head, xcylinder, xhead, sector, len, deleted);
 	if (err == DSK_ERR_NOTIMPL)
@@ -246,12 +392,15 @@ static fd_err_t fdl_format_track(FLOPPY_DRIVE *fd, int head,
 	LIBDSK_FLOPPY_DRIVE *fdl = (LIBDSK_FLOPPY_DRIVE *)fd;
 	int n, os;
 	dsk_err_t err;
+	fd_err_t fe;
 	DSK_FORMAT *formbuf;
 	
 	fdc_dprintf(4, "fdl_format_track: cyl=%d h=%d s=%d\n", 
 			fd->fd_cylinder, head, sectors);
 	if (!fdl->fdl_diskp) return FD_E_NOTRDY;
 
+	fe = fdl_discard(fdl);
+	if (fe) return fe;
 	formbuf = malloc(sectors * sizeof(DSK_FORMAT));
 	if (!formbuf) return FD_E_READONLY;
 
@@ -288,6 +437,7 @@ static int fdl_dirty(FLOPPY_DRIVE *fd)
 
 	if (fdl->fdl_diskp)
 	{
+		if (fdl->fdl_tchanged) return FD_D_DIRTY;
 		return dsk_dirty(fdl->fdl_diskp);
 	}
 	else
@@ -301,7 +451,11 @@ static void fdl_eject(FLOPPY_DRIVE *fd)
 {
         LIBDSK_FLOPPY_DRIVE *fdl = (LIBDSK_FLOPPY_DRIVE *)fd;
 
-	if (fdl->fdl_diskp) dsk_close(&fdl->fdl_diskp);
+	if (fdl->fdl_diskp)
+	{
+		fdl_writeback(fdl);
+		dsk_close(&fdl->fdl_diskp);
+	}
 
 	fdl_reset(fd);
 }
@@ -389,6 +543,7 @@ FDRV_PTR fd_newldsk(void)
 	FDRV_PTR fd = fd_inew(sizeof(LIBDSK_FLOPPY_DRIVE));
 
 	fd->fd_vtable = &fdv_libdsk;
+	((LIBDSK_FLOPPY_DRIVE *)fd)->fdl_track = NULL;
 	fdl_reset(fd);
 	return fd;
 	}
@@ -452,6 +607,17 @@ void     fdl_settype(FDRV_PTR fd, const char *s)
         }
 }
 
+fd_err_t fdl_flush(FDRV_PTR fd)
+{
+        if (fd->fd_vtable == &fdv_libdsk)
+        {
+                LIBDSK_FLOPPY_DRIVE *fdl = (LIBDSK_FLOPPY_DRIVE *)fd;
+
+                if (fdl->fdl_diskp) return fdl_writeback(fdl);
+        }
+        return FD_E_OK;
+}
+
 const char *   fdl_getcomp(FDRV_PTR fd)
 {
         if (fd->fd_vtable == &fdv_libdsk)
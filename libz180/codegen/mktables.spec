@@ -107,7 +107,9 @@ JR (C|NZ|NC|Z)?,?\(PC\+e\)
 RETI
 	ctx->IFF1 = ctx->IFF2;
 	ctx->tstates += 8;
-	%RET		
+	%RET
+	if (ctx->reti)
+		ctx->reti(ctx->ioParam);
 		
 RETN
 	ctx->IFF1 = ctx->IFF2;
@@ -318,6 +320,7 @@ IN0 (A|B|C|D|E|F|H|L),\(n\)
 	adjustFlags(ctx, BR.%1);
 
 INDR
+	doBlockIO(ctx, 0, -1);
 	%IND
 	if (BR.B != 0)
 	{
@@ -338,6 +341,7 @@ IND
 	VALFLAG(F_PV, parityBit[(flagval & 7) ^ BR.B]);
 
 INIR
+	doBlockIO(ctx, 0, 1);
 	%INI
 	if (BR.B != 0)
 	{
@@ -522,6 +526,7 @@ OUTI
 	adjustFlags(ctx, BR.B);
 
 OTIR
+	doBlockIO(ctx, 1, 1);
 	%OUTI
 	if (BR.B != 0)
 	{
@@ -564,6 +569,7 @@ OUTD
 	adjustFlags(ctx, BR.B);
 
 OTDR
+	doBlockIO(ctx, 1, -1);
 	%OUTD
 	if (BR.B != 0)
 	{
@@ -132,7 +132,7 @@ struct Z180OpcodeTable
  */ 
 static void write8 (Z180Context* ctx, ushort addr, byte val)
 {
-	ctx->tstates += 3;
+	ctx->tstates += 3 + ctx->memWait;
 	ctx->memWrite(ctx->memParam, addr, val);	
 }
 
@@ -146,7 +146,7 @@ static void write16 (Z180Context* ctx, ushort addr, ushort val)
 
 static byte read8 (Z180Context* ctx, ushort addr)
 {
-	ctx->tstates += 3;
+	ctx->tstates += 3 + ctx->memWait;
 	return ctx->memRead(ctx->memParam, addr);	
 }
 
@@ -161,14 +161,14 @@ static ushort read16 (Z180Context* ctx, ushort addr)
 
 static byte ioRead (Z180Context* ctx, ushort addr)
 {
-	ctx->tstates += 4;
+	ctx->tstates += 4 + ctx->ioWait;
 	return ctx->ioRead(ctx->ioParam, addr);
 }
 
 
 static void ioWrite (Z180Context* ctx, ushort addr, byte val)
 {
-	ctx->tstates += 4;
+	ctx->tstates += 4 + ctx->ioWait;
 	ctx->ioWrite(ctx->ioParam, addr, val);
 }
 
@@ -229,33 +229,81 @@ static int parityBit[256] = {
 	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 
 	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1 };
 
+/* S, Z, 5, 3 and parity of a result */
+static const byte sz53pTable[256] = {
+	0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x08, 0x0C, 0x0C, 0x08, 0x0C, 0x08, 0x08, 0x0C,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x0C, 0x08, 0x08, 0x0C, 0x08, 0x0C, 0x0C, 0x08,
+	0x20, 0x24, 0x24, 0x20, 0x24, 0x20, 0x20, 0x24, 0x2C, 0x28, 0x28, 0x2C, 0x28, 0x2C, 0x2C, 0x28,
+	0x24, 0x20, 0x20, 0x24, 0x20, 0x24, 0x24, 0x20, 0x28, 0x2C, 0x2C, 0x28, 0x2C, 0x28, 0x28, 0x2C,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x0C, 0x08, 0x08, 0x0C, 0x08, 0x0C, 0x0C, 0x08,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x08, 0x0C, 0x0C, 0x08, 0x0C, 0x08, 0x08, 0x0C,
+	0x24, 0x20, 0x20, 0x24, 0x20, 0x24, 0x24, 0x20, 0x28, 0x2C, 0x2C, 0x28, 0x2C, 0x28, 0x28, 0x2C,
+	0x20, 0x24, 0x24, 0x20, 0x24, 0x20, 0x20, 0x24, 0x2C, 0x28, 0x28, 0x2C, 0x28, 0x2C, 0x2C, 0x28,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x8C, 0x88, 0x88, 0x8C, 0x88, 0x8C, 0x8C, 0x88,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x88, 0x8C, 0x8C, 0x88, 0x8C, 0x88, 0x88, 0x8C,
+	0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA8, 0xAC, 0xAC, 0xA8, 0xAC, 0xA8, 0xA8, 0xAC,
+	0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xAC, 0xA8, 0xA8, 0xAC, 0xA8, 0xAC, 0xAC, 0xA8,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x88, 0x8C, 0x8C, 0x88, 0x8C, 0x88, 0x88, 0x8C,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x8C, 0x88, 0x88, 0x8C, 0x88, 0x8C, 0x8C, 0x88,
+	0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xAC, 0xA8, 0xA8, 0xAC, 0xA8, 0xAC, 0xAC, 0xA8,
+	0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA8, 0xAC, 0xAC, 0xA8, 0xAC, 0xA8, 0xA8, 0xAC };
+
+/* Everything but C after an INC, by result */
+static const byte incTable[256] = {
+	0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x94, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8,
+	0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8 };
+
+/* Everything but C after a DEC, by result */
+static const byte decTable[256] = {
+	0x42, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3A,
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3E,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA };
+
+
 
 static void adjustFlags (Z180Context* ctx, byte val)
 {
-	VALFLAG(F_5, (val & F_5) != 0);
-	VALFLAG(F_3, (val & F_3) != 0);
+	BR.F = (BR.F & ~(F_5 | F_3)) | (val & (F_5 | F_3));
 }
 
 
 static void adjustFlagSZP (Z180Context* ctx, byte val)
 {
-	VALFLAG(F_S, (val & 0x80) != 0);
-	VALFLAG(F_Z, (val == 0));
-	VALFLAG(F_PV, parityBit[val]);
+	BR.F = (BR.F & ~(F_S | F_Z | F_PV)) | (sz53pTable[val] & (F_S | F_Z | F_PV));
 }
 
 
 /* Adjust flags after AND, OR, XOR, TST */
 static void adjustLogicResult (Z180Context* ctx, int flagH, byte res)
 {
-    VALFLAG(F_S, (res & 0x80) != 0);
-    VALFLAG(F_Z, (res == 0));
-    VALFLAG(F_H, flagH);
-    VALFLAG(F_N, 0);
-    VALFLAG(F_C, 0);
-    VALFLAG(F_PV, parityBit[res]);
-
-    adjustFlags(ctx, res);
+    BR.F = sz53pTable[res] | (flagH ? F_H : 0);
 }
 
 static void adjustLogicFlag (Z180Context* ctx, int flagH)
@@ -335,37 +383,25 @@ static int doComplement(byte v)
 /** Do an arithmetic operation (ADD, SUB, ADC, SBC y CP) */
 static byte doArithmetic (Z180Context* ctx, byte value, int withCarry, int isSub)
 {
+	int carry = withCarry && (BR.F & F_C);
+	byte a = BR.A;
 	ushort res; /* To detect carry */
+	byte f;
 
+	/* H is worked out without the carry in, as it always has been here */
 	if (isSub)
 	{
-		SETFLAG(F_N);
-		VALFLAG(F_H, (((BR.A & 0x0F) - (value & 0x0F)) & 0x10) != 0);
-		res = BR.A - value;
-		if (withCarry && GETFLAG(F_C))
-			res--;
+		res = a - value - carry;
+		f = F_N | (((a & 0x0F) - (value & 0x0F)) & F_H) |
+			(((a ^ value) & (a ^ res) & 0x80) >> 5);
 	}
 	else
 	{
-		RESFLAG(F_N);
-		VALFLAG(F_H, (((BR.A & 0x0F) + (value & 0x0F)) & 0x10) != 0);
-		res = BR.A + value;
-		if (withCarry && GETFLAG(F_C))
-			res++;
+		res = a + value + carry;
+		f = (((a & 0x0F) + (value & 0x0F)) & F_H) |
+			((~(a ^ value) & (a ^ res) & 0x80) >> 5);
 	}
-	VALFLAG(F_S, ((res & 0x80) != 0));
-	VALFLAG(F_C, ((res & 0x100) != 0));
-	VALFLAG(F_Z, ((res & 0xff) == 0));
-	int minuend_sign = BR.A & 0x80;
-	int subtrahend_sign = value & 0x80;
-	int result_sign = res & 0x80;
-	int overflow;
-	if(isSub)
-		overflow = minuend_sign != subtrahend_sign && result_sign != minuend_sign;
-	else
-		overflow = minuend_sign == subtrahend_sign && result_sign != minuend_sign;
-	VALFLAG(F_PV, overflow);
-	adjustFlags(ctx, res);
+	BR.F = f | (sz53pTable[res & 0xFF] & ~F_PV) | ((res >> 8) & F_C);
 
 	return (byte)(res & 0xFF);
 }
@@ -431,17 +467,12 @@ static void doXOR (Z180Context* ctx, byte value)
 
 static void doBIT (Z180Context* ctx, int b, byte val)
 {
-	if (val & (1 << b))
-        RESFLAG(F_Z | F_PV);
-    else
-        SETFLAG(F_Z | F_PV);
+	byte f = (BR.F & (F_5 | F_3 | F_C)) | F_H;
 
-    SETFLAG(F_H);
-    RESFLAG(F_N);
-
-    RESFLAG(F_S);
-    if ((b == 7) && !GETFLAG(F_Z))
-        SETFLAG(F_S);
+	if (val & (1 << b))
+		BR.F = f | (b == 7 ? F_S : 0);
+	else
+		BR.F = f | F_Z | F_PV;
 }
 
 
@@ -476,39 +507,31 @@ byte doSetRes (Z180Context* ctx, int bit, int pos, byte val)
 static byte doIncDec (Z180Context* ctx, byte val, int isDec)
 {
     if (isDec)
-    {
-        VALFLAG(F_PV, (val & 0x80) && !((val - 1) & 0x80));
-        val--;
-        VALFLAG(F_H, (val & 0x0F) == 0x0F);
-    }
+        BR.F = (BR.F & F_C) | decTable[--val];
     else
-    {
-        VALFLAG(F_PV, !(val & 0x80) && ((val + 1) & 0x80));
-        val++;
-        VALFLAG(F_H, !(val & 0x0F));
-    }
+        BR.F = (BR.F & F_C) | incTable[++val];
 
-    VALFLAG(F_S, ((val & 0x80) != 0));
-    VALFLAG(F_Z, (val == 0));
-    VALFLAG(F_N, isDec);
+    return val;
+}
 
-    adjustFlags(ctx, val);
 
-    return val;
+/* Flags after a rotate or shift: the 8080 style ones only touch 5, 3,
+   H, N and C */
+static void adjustShiftFlags (Z180Context* ctx, int adjFlags, byte val, byte carry)
+{
+    if (adjFlags)
+        BR.F = sz53pTable[val] | carry;
+    else
+        BR.F = (BR.F & (F_S | F_Z | F_PV)) | (val & (F_5 | F_3)) | carry;
 }
 
 
 static byte doRLC (Z180Context* ctx, int adjFlags, byte val)
 {
-    VALFLAG(F_C, (val & 0x80) != 0);
-    val <<= 1;
-    val |= (byte)GETFLAG(F_C);
+    byte c = val >> 7;
 
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val << 1) | c;
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -516,16 +539,10 @@ static byte doRLC (Z180Context* ctx, int adjFlags, byte val)
 
 static byte doRL (Z180Context* ctx, int adjFlags, byte val)
 {
-    int CY = GETFLAG(F_C);
-    VALFLAG(F_C, (val & 0x80) != 0);
-    val <<= 1;
-    val |= (byte)CY;
+    byte c = val >> 7;
 
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val << 1) | (BR.F & F_C);
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -533,15 +550,10 @@ static byte doRL (Z180Context* ctx, int adjFlags, byte val)
 
 static byte doRRC (Z180Context* ctx, int adjFlags, byte val)
 {
-    VALFLAG(F_C, (val & 0x01) != 0);
-    val >>= 1;
-    val |= ((byte)GETFLAG(F_C) << 7);
-
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
+    byte c = val & 0x01;
 
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val >> 1) | (c << 7);
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -549,16 +561,10 @@ static byte doRRC (Z180Context* ctx, int adjFlags, byte val)
 
 static byte doRR (Z180Context* ctx, int adjFlags, byte val)
 {
-    int CY = GETFLAG(F_C);
-    VALFLAG(F_C, (val & 0x01));
-    val >>= 1;
-    val |= (CY << 7);
+    byte c = val & 0x01;
 
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val >> 1) | ((BR.F & F_C) << 7);
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -566,15 +572,12 @@ static byte doRR (Z180Context* ctx, int adjFlags, byte val)
 
 static byte doSL (Z180Context* ctx, byte val, int isArith)
 {
-    VALFLAG(F_C, (val & 0x80) != 0);
-    val <<= 1;
+    byte c = val >> 7;
 
+    val <<= 1;
     if (!isArith)
         val |= 1;
-
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-    adjustFlagSZP(ctx, val);
+    BR.F = sz53pTable[val] | c;
 
     return val;
 }
@@ -582,17 +585,10 @@ static byte doSL (Z180Context* ctx, byte val, int isArith)
 
 static byte doSR (Z180Context* ctx, byte val, int isArith)
 {
-    int b = val & 0x80;
-
-    VALFLAG(F_C, (val & 0x01) != 0);
-    val >>= 1;
-
-    if (isArith)
-        val |= b;
+    byte c = val & 0x01;
 
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-    adjustFlagSZP(ctx, val);
+    val = (val >> 1) | (isArith ? (val & 0x80) : 0);
+    BR.F = sz53pTable[val] | c;
 
     return val;
 }
@@ -616,6 +612,45 @@ static ushort doPop (Z180Context* ctx)
 }
 
 
+/* Run all but the last iteration of an INIR/INDR (out 0) or OTIR/OTDR
+ * (out 1) through the board's bulk port hook unless an interrupt is
+ * waiting. Each iteration is 19 T-states and the opcode fetch of the
+ * first has already been counted. The final iteration is done normally
+ * so the flags come out right. */
+static void doBlockIO(Z180Context* ctx, int out, int dir)
+{
+	unsigned n, got, i;
+	ushort port;
+	byte buf[256];
+
+	if (out ? ctx->ioBlockWrite == NULL : ctx->ioBlockRead == NULL)
+		return;
+	if (ctx->nmi_req || (ctx->int_req && ctx->IFF1))
+		return;
+
+	n = (BR.B ? BR.B : 256) - 1;
+	if (n == 0)
+		return;
+	if (out) {
+		/* OUTI drops B before the port is driven */
+		port = WR.BC - 0x100;
+		for (i = 0; i < n; i++)
+			buf[i] = ctx->memRead(ctx->memParam, WR.HL + dir * (int)i);
+		got = ctx->ioBlockWrite(ctx->ioParam, port, buf, n);
+	} else {
+		port = WR.BC;
+		got = ctx->ioBlockRead(ctx->ioParam, port, buf, n);
+		for (i = 0; i < got; i++)
+			ctx->memWrite(ctx->memParam, WR.HL + dir * (int)i, buf[i]);
+	}
+	WR.HL += dir * (int)got;
+	BR.B -= got;
+	/* Two opcode fetches and a data access each time round */
+	ctx->tstates += (19 + 3 * ctx->memWait + ctx->ioWait) * got;
+	ctx->R = (ctx->R & 0x80) | ((ctx->R + 2 * got) & 0x7f);
+}
+
+
 static byte doCP_HL(Z180Context * ctx)
 {
 	byte val = read8(ctx, WR.HL);
@@ -700,6 +735,9 @@ static void do_execute(Z180Context* ctx)
 		}
 
 		INCR;
+#ifdef LIBZ180_PROFILE
+		ctx->prof_ops = (ctx->prof_ops << 8) | opcode;
+#endif
 		func = entries[opcode].func;
 		if (func != NULL)
 		{			
@@ -760,6 +798,7 @@ static void do_nmi(Z180Context* ctx)
     doPush(ctx, ctx->PC);
 	ctx->PC = 0x0066;	
 	ctx->nmi_req = 0;
+	ctx->interrupts++;
 	ctx->tstates += 5;
 }
 
@@ -768,6 +807,7 @@ static void do_int(Z180Context* ctx)
 {
     unsigned int mode = ctx->int_req;
     unhalt(ctx);
+	ctx->interrupts++;
 	ctx->IFF1 = 0;
 	ctx->IFF2 = 0;
 	ctx->int_req = 0;
@@ -797,6 +837,39 @@ static void do_int(Z180Context* ctx)
 }
 
 
+#ifdef LIBZ180_PROFILE
+
+/* Run one instruction and charge it to its opcode. The bytes before the
+ * opcode in prof_ops are the prefixes, which are never zero */
+static void profile_execute(Z180Context* ctx)
+{
+	Z180Profile* p = ctx->profile;
+	ushort pc = ctx->PC;
+	unsigned ops;
+	byte prefix;
+	int group = 0;
+
+	ctx->prof_ops = 0;
+	do_execute(ctx);
+	ops = ctx->prof_ops;
+	prefix = ops >> 8;
+	if (prefix == 0xCB)
+		group = ((ops >> 16) & 0xFF) == 0xDD ? 5 :
+			((ops >> 16) & 0xFF) == 0xFD ? 6 : 1;
+	else if (prefix == 0xED)
+		group = 2;
+	else if (prefix == 0xDD)
+		group = 3;
+	else if (prefix == 0xFD)
+		group = 4;
+	p->count[group][ops & 0xFF]++;
+	p->tstates[group][ops & 0xFF] += ctx->tstates;
+	p->page[pc >> 8]++;
+}
+
+#endif
+
+
 unsigned Z180Execute (Z180Context* ctx)
 {
 	ctx->tstates = 0;
@@ -807,6 +880,12 @@ unsigned Z180Execute (Z180Context* ctx)
 	else
 	{
 		ctx->defer_int = 0;
+		ctx->instructions++;
+#ifdef LIBZ180_PROFILE
+		if (ctx->profile)
+			profile_execute(ctx);
+		else
+#endif
 		do_execute(ctx);
 	}
 	return ctx->tstates;
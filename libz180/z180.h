@@ -74,6 +74,19 @@ typedef enum
 } Z180Flags;
 
 
+/** Opcode profile groups: unprefixed, CB, ED, DD, FD, DDCB and FDCB */
+#define Z180_PROFILE_GROUPS	7
+
+/** Execution counts kept when the library is built with LIBZ180_PROFILE
+ * and the context has a profile attached. */
+typedef struct
+{
+	unsigned long long count[Z180_PROFILE_GROUPS][256];	/**< Per opcode */
+	unsigned long long tstates[Z180_PROFILE_GROUPS][256];	/**< T-states per opcode */
+	unsigned long long page[256];	/**< Instructions by PC high byte */
+} Z180Profile;
+
+
 /** A Z180 execution context. */
 typedef struct
 {
@@ -98,6 +111,26 @@ typedef struct
 	
 	byte		halted;
 	unsigned	tstates;
+	unsigned long long instructions;	/**< Executed, not counting interrupts */
+
+	/* Wait states added to every memory and I/O access. Zero unless the
+	 * on chip DCNTL model programs them. */
+	unsigned	memWait;
+	unsigned	ioWait;
+
+	/* Optional bulk port transfers for INIR/INDR and OTIR/OTDR, or
+	 * NULL. They move up to len bytes between the port and buf in
+	 * transfer order and return how many were moved, 0 if the port must
+	 * be done a byte at a time. The port is BC as of the first transfer;
+	 * B counts down as usual. Memory still goes through memRead and
+	 * memWrite. */
+	unsigned	(*ioBlockRead)(int param, ushort port, byte *buf, unsigned len);
+	unsigned	(*ioBlockWrite)(int param, ushort port, const byte *buf, unsigned len);
+
+	/* Called once a RETI has executed, or NULL. Daisy chained
+	 * peripherals watch for ED 4D on the bus; this lets a board run
+	 * the chain without decoding every opcode fetch itself. */
+	void		(*reti)(int param);
 
 	/* Below are implementation details which may change without
 	 * warning; they should not be relied upon by any user of this
@@ -135,6 +168,15 @@ typedef struct
 
 	void (*trace)(unsigned int memparam);
 
+	/* Opcode profile, or NULL. Only filled in by a profiling build */
+	Z180Profile *profile;
+
+	/* Opcode bytes fetched for the current instruction */
+	unsigned prof_ops;
+
+	/* Interrupts and NMIs taken */
+	unsigned long long interrupts;
+
 } Z180Context;
 
 
@@ -32,6 +32,7 @@
 #define OPCODES_HEADER	"opcodes_decl.h"
 #define OPCODES_IMPL	"opcodes_impl.c"
 #define OPCODES_TABLE	"opcodes_table.h"
+#define OPCODES_SWITCH	"opcodes_switch.h"
 
 
 /* =========================================================
@@ -229,6 +230,42 @@ int printCall (char* s, FILE* code)
 }
 
 
+/** Substitutes the submatches of an opcode into a line of its code */
+void substLine (char* cmd, char* line, regmatch_t* matches, char* out)
+{
+	char parm[5], subst[20];
+	int i;
+
+	strncpy(out, cmd, MAX_LINE);
+	strcpy(parm, "%0");
+	for (i = 1; i < MAX_MATCH; i++)
+	{
+		parm[1] = i + '0';
+		strncpy(subst, &line[matches[i].rm_so], matches[i].rm_eo - matches[i].rm_so);
+		subst[matches[i].rm_eo - matches[i].rm_so] = 0;
+
+		substStr(out, parm, subst);
+	}
+}
+
+
+/** True if an opcode's code uses F other than through the flag helpers.
+ *  In a lazy flags build F has to be brought up to date before that */
+int usesF (Item* item, char* line, regmatch_t* matches)
+{
+	char tmp[MAX_LINE];
+	char** cmds;
+
+	for (cmds = item->line; *cmds; cmds++)
+	{
+		substLine(*cmds, line, matches, tmp);
+		if (strstr(tmp, "BR.F") || strstr(tmp, "wr.AF") || strstr(tmp, "WR.AF"))
+			return 1;
+	}
+	return 0;
+}
+
+
 /** Reads the opcode list and generates output code based on the spec */
 void generateCodeTable (FILE* opcodes, FILE* code)
 {
@@ -236,7 +273,6 @@ void generateCodeTable (FILE* opcodes, FILE* code)
 	char last[MAX_LINE];
 	char tmp[MAX_LINE];
 	char name[MAX_LINE];
-	char parm[5], subst[20];
 	int i;
 	char* p, *q;
 	char** cmds;
@@ -282,25 +318,16 @@ void generateCodeTable (FILE* opcodes, FILE* code)
 		/* Print function stub */
 		fixName(line, name);
 		fprintf(code, "static void %s (Z80Context* ctx)\n{\n", name);
+		if (usesF(item, line, matches))
+			fprintf(code, "\tSYNCFLAGS();\n");
 				
 		/* Substitute submatches in each output line and print the code */
 		cmds = item->line;
-		strcpy(parm, "%0");
 		while (*cmds)
 		{
 			if (!printCall(*cmds, code))
 			{
-				strncpy(tmp, *cmds, MAX_LINE);
-				q = tmp;
-		
-				for (i = 1; i < MAX_MATCH; i++)
-				{
-					parm[1] = i + '0';
-					strncpy(subst, &line[matches[i].rm_so], matches[i].rm_eo - matches[i].rm_so);
-					subst[matches[i].rm_eo - matches[i].rm_so] = 0;
-					
-					substStr(tmp, parm, subst);
-				}
+				substLine(*cmds, line, matches, tmp);
 				fprintf(code, "%s\n", tmp);
 			}
 			
@@ -661,24 +688,76 @@ void outputTable(struct Z80OpcodeTable* table, FILE* file)
 }
 	
 
-void generateParserTables(FILE* opcodes, FILE* table)
+/* =========================================================
+ *  Switch dispatcher generator
+ * ========================================================= */
+
+/** Outputs the switch for one table and then those of its prefixes. Each
+ *  prefix table is a label in the same function so the only indirect
+ *  branch left is the jump table the compiler makes for each switch. */
+void outputSwitch(struct Z80OpcodeTable* table, FILE* file)
+{
+	int i;
+	struct Z80OpcodeEntry* opc;
+	
+	if (strcmp(table->name, "main"))
+		fprintf(file, "table_%s:\n", table->name);
+	if (table->opcode_offset > 0)
+		fprintf(file, "\toffset = %d;\n\tDECR;\n", table->opcode_offset);
+	fprintf(file, "\topcode = fetch_opcode(ctx, offset);\n");
+	fprintf(file, "\tswitch (opcode)\n\t{\n");
+	
+	for (i = 0, opc = table->entries; i < 256; i++, opc++)
+	{
+		if (opc->func)
+			fprintf(file, "\tcase 0x%02X: DISPATCH(%s);\n", i, opc->func);
+		else if (opc->table)
+			fprintf(file, "\tcase 0x%02X: goto table_%s;\n", i, opc->table->name);
+	}
+	/* Undefined opcodes are a NOP */
+	fprintf(file, "\tdefault: return;\n\t}\n\n");
+	
+	for (i = 0, opc = table->entries; i < 256; i++, opc++)
+	{
+		if (opc->table)
+			outputSwitch(opc->table, file);
+	}
+}
+
+
+void generateSwitch(struct Z80OpcodeTable* mainTable, FILE* file)
+{
+	printf("Outputting switch dispatcher...");
+	fprintf(file, "static void do_execute(Z80Context* ctx)\n{\n");
+	fprintf(file, "\tbyte opcode;\n\tint offset = 0;\n");
+	fprintf(file, "\tctx->M1PC = ctx->PC;\n\n");
+	outputSwitch(mainTable, file);
+	fprintf(file, "}\n");
+	printf("done\n");
+}
+
+
+void generateParserTables(FILE* opcodes, FILE* table, FILE* sw)
 {
 	struct Z80OpcodeTable* mainTable = createTableTree(opcodes, table);
 	scanOpcodes(opcodes, mainTable);
 	fprintf(table, "\n\n");
 	outputTable(mainTable, table);
+	generateSwitch(mainTable, sw);
 }
 
 
 void generateParser(void)
 {
-	FILE* table, *opcodes;
+	FILE* table, *opcodes, *sw;
 	
 	opcodes = openOrDie(OPCODES_LIST, "rb");
 	table = openOrDie(OPCODES_TABLE, "wb");
+	sw = openOrDie(OPCODES_SWITCH, "wb");
 	
-	generateParserTables(opcodes, table);
+	generateParserTables(opcodes, table, sw);
 	
+	fclose(sw);
 	fclose(table);
 	fclose(opcodes);
 }
@@ -106,7 +106,9 @@ JR (C|NZ|NC|Z)?,?\(PC\+e\)
 
 RETI
 	ctx->IFF1 = ctx->IFF2;
-	%RET		
+	%RET
+	if (ctx->reti)
+		ctx->reti(ctx->ioParam);
 		
 RETN
 	ctx->IFF1 = ctx->IFF2;
@@ -311,6 +313,7 @@ IN A,\(n\)
 	BR.A = ioRead(ctx, BR.A << 8 | port);
 
 INDR
+	doBlockIO(ctx, 0, -1);
 	%IND
 	if (BR.B != 0)
 	{
@@ -331,6 +334,7 @@ IND
 	VALFLAG(F_PV, parityBit[(flagval & 7) ^ BR.B]);
 
 INIR
+	doBlockIO(ctx, 0, 1);
 	%INI
 	if (BR.B != 0)
 	{
@@ -452,6 +456,7 @@ LD (BC|DE|HL|SP|IX|IY),nn
 	
 
 LDIR
+	doBlockMove(ctx, 1);
 	%LDI
 	if (WR.BC != 0)
 	{
@@ -472,6 +477,7 @@ LDI
 	VALFLAG(F_PV, WR.BC != 0);
 
 LDDR
+	doBlockMove(ctx, -1);
 	%LDD
 	if (WR.BC != 0)
 	{
@@ -515,6 +521,7 @@ OUTI
 	adjustFlags(ctx, BR.B);
 
 OTIR
+	doBlockIO(ctx, 1, 1);
 	%OUTI
 	if (BR.B != 0)
 	{
@@ -536,6 +543,7 @@ OUTD
 	adjustFlags(ctx, BR.B);
 
 OTDR
+	doBlockIO(ctx, 1, -1);
 	%OUTD
 	if (BR.B != 0)
 	{
@@ -25,6 +25,7 @@
 
 #include "z80.h"
 #include "string.h"
+#include "stdlib.h"
 
 
 #define BR (ctx->R1.br)
@@ -36,6 +37,24 @@
 
 #define VALFLAG(F,V) valFlag(ctx, F, V)
 
+/* A LIBZ80_LAZY_FLAGS build has the common ALU helpers note what F is to
+ * be worked out from rather than work it out. Code that looks at F other
+ * than through the flag helpers must SYNCFLAGS() first, and code that sets
+ * all of it must LAZYDONE() so the stale note is not used later. */
+#ifdef LIBZ80_LAZY_FLAGS
+static void syncFlags(Z80Context* ctx);
+static byte lazyCarry(Z80Context* ctx);
+#define SYNCFLAGS() do { if (ctx->lazy_op) syncFlags(ctx); } while(0)
+#define LAZYDONE() do { ctx->lazy_op = LAZY_NONE; } while(0)
+#define CARRY() lazyCarry(ctx)
+#define ZERO() (ctx->lazy_op ? (ctx->lazy_res & 0xFF) == 0 : GETFLAG(F_Z))
+#else
+#define SYNCFLAGS() do { } while(0)
+#define LAZYDONE() do { } while(0)
+#define CARRY() (BR.F & F_C)
+#define ZERO() GETFLAG(F_Z)
+#endif
+
 
 /* ---------------------------------------------------------
  *  Flag tricks
@@ -133,6 +152,14 @@ struct Z80OpcodeTable
 static void write8 (Z80Context* ctx, ushort addr, byte val)
 {
 	ctx->tstates += 3;
+#ifdef LIBZ80_BLOCK_CACHE
+	if (ctx->codePage && ctx->memPageWrite &&
+	    ctx->memPageWrite[addr >> Z80_PAGE_SHIFT])
+	{
+		ctx->memPageWrite[addr >> Z80_PAGE_SHIFT][addr & Z80_PAGE_MASK] = val;
+		return;
+	}
+#endif
 	ctx->memWrite(ctx->memParam, addr, val);	
 }
 
@@ -147,6 +174,11 @@ static void write16 (Z80Context* ctx, ushort addr, ushort val)
 static byte read8 (Z80Context* ctx, ushort addr)
 {
 	ctx->tstates += 3;
+#ifdef LIBZ80_BLOCK_CACHE
+	if (ctx->codePage && ctx->memPageRead &&
+	    ctx->memPageRead[addr >> Z80_PAGE_SHIFT])
+		return ctx->memPageRead[addr >> Z80_PAGE_SHIFT][addr & Z80_PAGE_MASK];
+#endif
 	return ctx->memRead(ctx->memParam, addr);	
 }
 
@@ -181,12 +213,14 @@ static void ioWrite (Z80Context* ctx, ushort addr, byte val)
 /** Sets a flag */
 static void setFlag(Z80Context* ctx, Z80Flags flag)
 {
+	SYNCFLAGS();
 	BR.F |= flag;
 }
 
 /** Resets a flag */
 static void resFlag(Z80Context* ctx, Z80Flags flag)
 {
+	SYNCFLAGS();
 	BR.F &= ~flag;
 }
 
@@ -202,6 +236,7 @@ static void valFlag(Z80Context* ctx, Z80Flags flag, int val)
 /** Returns a flag */
 static int getFlag(Z80Context* ctx, Z80Flags flag)
 {
+	SYNCFLAGS();
 	return (BR.F & flag) != 0;
 }
 
@@ -229,33 +264,165 @@ static int parityBit[256] = {
 	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 
 	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1 };
 
+/* S, Z, 5, 3 and parity of a result */
+static const byte sz53pTable[256] = {
+	0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x08, 0x0C, 0x0C, 0x08, 0x0C, 0x08, 0x08, 0x0C,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x0C, 0x08, 0x08, 0x0C, 0x08, 0x0C, 0x0C, 0x08,
+	0x20, 0x24, 0x24, 0x20, 0x24, 0x20, 0x20, 0x24, 0x2C, 0x28, 0x28, 0x2C, 0x28, 0x2C, 0x2C, 0x28,
+	0x24, 0x20, 0x20, 0x24, 0x20, 0x24, 0x24, 0x20, 0x28, 0x2C, 0x2C, 0x28, 0x2C, 0x28, 0x28, 0x2C,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x0C, 0x08, 0x08, 0x0C, 0x08, 0x0C, 0x0C, 0x08,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x08, 0x0C, 0x0C, 0x08, 0x0C, 0x08, 0x08, 0x0C,
+	0x24, 0x20, 0x20, 0x24, 0x20, 0x24, 0x24, 0x20, 0x28, 0x2C, 0x2C, 0x28, 0x2C, 0x28, 0x28, 0x2C,
+	0x20, 0x24, 0x24, 0x20, 0x24, 0x20, 0x20, 0x24, 0x2C, 0x28, 0x28, 0x2C, 0x28, 0x2C, 0x2C, 0x28,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x8C, 0x88, 0x88, 0x8C, 0x88, 0x8C, 0x8C, 0x88,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x88, 0x8C, 0x8C, 0x88, 0x8C, 0x88, 0x88, 0x8C,
+	0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA8, 0xAC, 0xAC, 0xA8, 0xAC, 0xA8, 0xA8, 0xAC,
+	0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xAC, 0xA8, 0xA8, 0xAC, 0xA8, 0xAC, 0xAC, 0xA8,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x88, 0x8C, 0x8C, 0x88, 0x8C, 0x88, 0x88, 0x8C,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x8C, 0x88, 0x88, 0x8C, 0x88, 0x8C, 0x8C, 0x88,
+	0xA0, 0xA4, 0xA4, 0xA0, 0xA4, 0xA0, 0xA0, 0xA4, 0xAC, 0xA8, 0xA8, 0xAC, 0xA8, 0xAC, 0xAC, 0xA8,
+	0xA4, 0xA0, 0xA0, 0xA4, 0xA0, 0xA4, 0xA4, 0xA0, 0xA8, 0xAC, 0xAC, 0xA8, 0xAC, 0xA8, 0xA8, 0xAC };
+
+/* Everything but C after an INC, by result */
+static const byte incTable[256] = {
+	0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+	0x94, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8,
+	0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8,
+	0xB0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8 };
+
+/* Everything but C after a DEC, by result */
+static const byte decTable[256] = {
+	0x42, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3A,
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3A,
+	0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x3E,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x8A, 0x9A,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA,
+	0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xA2, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xBA };
+
+
+/* Flags after ADD, ADC, SUB, SBC or CP, from the 9-bit result. H is worked
+ * out without the carry in, as it always has been here */
+static byte arithFlags (byte a, byte value, ushort res, int isSub)
+{
+	byte f;
+
+	if (isSub)
+		f = F_N | (((a & 0x0F) - (value & 0x0F)) & F_H) |
+			(((a ^ value) & (a ^ res) & 0x80) >> 5);
+	else
+		f = (((a & 0x0F) + (value & 0x0F)) & F_H) |
+			((~(a ^ value) & (a ^ res) & 0x80) >> 5);
+	return f | (sz53pTable[res & 0xFF] & ~F_PV) | ((res >> 8) & F_C);
+}
+
+
+#ifdef LIBZ80_LAZY_FLAGS
+
+/* What lazy_op says F is waiting on. lazy_res is the result each time;
+ * lazy_a and lazy_v are the operands of an arithmetic op, and for the
+ * others lazy_v holds the bits kept from before (H for a logic op, C for
+ * INC and DEC) */
+enum
+{
+	LAZY_NONE,
+	LAZY_ADD,
+	LAZY_SUB,
+	LAZY_LOGIC,
+	LAZY_INC,
+	LAZY_DEC
+};
+
+static void syncFlags (Z80Context* ctx)
+{
+	byte res = ctx->lazy_res & 0xFF;
+
+	switch (ctx->lazy_op)
+	{
+	case LAZY_ADD:
+	case LAZY_SUB:
+		BR.F = arithFlags(ctx->lazy_a, ctx->lazy_v, ctx->lazy_res,
+			ctx->lazy_op == LAZY_SUB);
+		break;
+	case LAZY_LOGIC:
+		BR.F = sz53pTable[res] | ctx->lazy_v;
+		break;
+	case LAZY_INC:
+		BR.F = incTable[res] | ctx->lazy_v;
+		break;
+	case LAZY_DEC:
+		BR.F = decTable[res] | ctx->lazy_v;
+		break;
+	}
+	ctx->lazy_op = LAZY_NONE;
+}
+
+/* The carry flag without working out the rest */
+static byte lazyCarry (Z80Context* ctx)
+{
+	switch (ctx->lazy_op)
+	{
+	case LAZY_NONE:
+		return BR.F & F_C;
+	case LAZY_ADD:
+	case LAZY_SUB:
+		return (ctx->lazy_res >> 8) & F_C;
+	case LAZY_LOGIC:
+		return 0;
+	default:
+		return ctx->lazy_v;
+	}
+}
+
+#endif
+
+
 
 static void adjustFlags (Z80Context* ctx, byte val)
 {
-	VALFLAG(F_5, (val & F_5) != 0);
-	VALFLAG(F_3, (val & F_3) != 0);
+	SYNCFLAGS();
+	BR.F = (BR.F & ~(F_5 | F_3)) | (val & (F_5 | F_3));
 }
 
 
 static void adjustFlagSZP (Z80Context* ctx, byte val)
 {
-	VALFLAG(F_S, (val & 0x80) != 0);
-	VALFLAG(F_Z, (val == 0));
-	VALFLAG(F_PV, parityBit[val]);
+	SYNCFLAGS();
+	BR.F = (BR.F & ~(F_S | F_Z | F_PV)) | (sz53pTable[val] & (F_S | F_Z | F_PV));
 }
 
 
 /* Adjust flags after AND, OR, XOR */
 static void adjustLogicFlag (Z80Context* ctx, int flagH)
 {
-    VALFLAG(F_S, (BR.A & 0x80) != 0);
-    VALFLAG(F_Z, (BR.A == 0));
-    VALFLAG(F_H, flagH);
-    VALFLAG(F_N, 0);
-    VALFLAG(F_C, 0);
-    VALFLAG(F_PV, parityBit[BR.A]);
-
-    adjustFlags(ctx, BR.A);
+#ifdef LIBZ80_LAZY_FLAGS
+    ctx->lazy_op = LAZY_LOGIC;
+    ctx->lazy_res = BR.A;
+    ctx->lazy_v = flagH ? F_H : 0;
+#else
+    BR.F = sz53pTable[BR.A] | (flagH ? F_H : 0);
+#endif
 }
 
 
@@ -283,16 +450,16 @@ static int condition(Z80Context* ctx, Z80Condition cond)
 		return 1;
 		
 	if (cond == C_Z)
-		return GETFLAG(F_Z);
+		return ZERO();
 	
 	if (cond == C_NZ)
-		return !GETFLAG(F_Z);
+		return !ZERO();
 	
 	if (cond == C_C)
-		return GETFLAG(F_C);
+		return CARRY() != 0;
 	
 	if (cond == C_NC)
-		return !GETFLAG(F_C);
+		return !CARRY();
 		
 	if (cond == C_M)
 		return GETFLAG(F_S);
@@ -330,37 +497,21 @@ static int doComplement(byte v)
 /** Do an arithmetic operation (ADD, SUB, ADC, SBC y CP) */
 static byte doArithmetic (Z80Context* ctx, byte value, int withCarry, int isSub)
 {
+	int carry = withCarry && CARRY();
 	ushort res; /* To detect carry */
 
 	if (isSub)
-	{
-		SETFLAG(F_N);
-		VALFLAG(F_H, (((BR.A & 0x0F) - (value & 0x0F)) & 0x10) != 0);
-		res = BR.A - value;
-		if (withCarry && GETFLAG(F_C))
-			res--;
-	}
-	else
-	{
-		RESFLAG(F_N);
-		VALFLAG(F_H, (((BR.A & 0x0F) + (value & 0x0F)) & 0x10) != 0);
-		res = BR.A + value;
-		if (withCarry && GETFLAG(F_C))
-			res++;
-	}
-	VALFLAG(F_S, ((res & 0x80) != 0));
-	VALFLAG(F_C, ((res & 0x100) != 0));
-	VALFLAG(F_Z, ((res & 0xff) == 0));
-	int minuend_sign = BR.A & 0x80;
-	int subtrahend_sign = value & 0x80;
-	int result_sign = res & 0x80;
-	int overflow;
-	if(isSub)
-		overflow = minuend_sign != subtrahend_sign && result_sign != minuend_sign;
+		res = BR.A - value - carry;
 	else
-		overflow = minuend_sign == subtrahend_sign && result_sign != minuend_sign;
-	VALFLAG(F_PV, overflow);
-	adjustFlags(ctx, res);
+		res = BR.A + value + carry;
+#ifdef LIBZ80_LAZY_FLAGS
+	ctx->lazy_op = isSub ? LAZY_SUB : LAZY_ADD;
+	ctx->lazy_a = BR.A;
+	ctx->lazy_v = value;
+	ctx->lazy_res = res;
+#else
+	BR.F = arithFlags(BR.A, value, res, isSub);
+#endif
 
 	return (byte)(res & 0xFF);
 }
@@ -426,17 +577,15 @@ static void doXOR (Z80Context* ctx, byte value)
 
 static void doBIT (Z80Context* ctx, int b, byte val)
 {
-	if (val & (1 << b))
-        RESFLAG(F_Z | F_PV);
-    else
-        SETFLAG(F_Z | F_PV);
+	byte f;
 
-    SETFLAG(F_H);
-    RESFLAG(F_N);
+	SYNCFLAGS();
+	f = (BR.F & (F_5 | F_3 | F_C)) | F_H;
 
-    RESFLAG(F_S);
-    if ((b == 7) && !GETFLAG(F_Z))
-        SETFLAG(F_S);
+	if (val & (1 << b))
+		BR.F = f | (b == 7 ? F_S : 0);
+	else
+		BR.F = f | F_Z | F_PV;
 }
 
 
@@ -470,40 +619,44 @@ byte doSetRes (Z80Context* ctx, int bit, int pos, byte val)
 
 static byte doIncDec (Z80Context* ctx, byte val, int isDec)
 {
+#ifdef LIBZ80_LAZY_FLAGS
+    ctx->lazy_v = CARRY();
+    ctx->lazy_op = isDec ? LAZY_DEC : LAZY_INC;
+    ctx->lazy_res = isDec ? --val : ++val;
+#else
     if (isDec)
+        BR.F = (BR.F & F_C) | decTable[--val];
+    else
+        BR.F = (BR.F & F_C) | incTable[++val];
+#endif
+
+    return val;
+}
+
+
+/* Flags after a rotate or shift: the 8080 style ones only touch 5, 3,
+   H, N and C */
+static void adjustShiftFlags (Z80Context* ctx, int adjFlags, byte val, byte carry)
+{
+    if (adjFlags)
     {
-        VALFLAG(F_PV, (val & 0x80) && !((val - 1) & 0x80));
-        val--;
-        VALFLAG(F_H, (val & 0x0F) == 0x0F);
+        LAZYDONE();
+        BR.F = sz53pTable[val] | carry;
     }
     else
     {
-        VALFLAG(F_PV, !(val & 0x80) && ((val + 1) & 0x80));
-        val++;
-        VALFLAG(F_H, !(val & 0x0F));
+        SYNCFLAGS();
+        BR.F = (BR.F & (F_S | F_Z | F_PV)) | (val & (F_5 | F_3)) | carry;
     }
-
-    VALFLAG(F_S, ((val & 0x80) != 0));
-    VALFLAG(F_Z, (val == 0));
-    VALFLAG(F_N, isDec);
-
-    adjustFlags(ctx, val);
-
-    return val;
 }
 
 
 static byte doRLC (Z80Context* ctx, int adjFlags, byte val)
 {
-    VALFLAG(F_C, (val & 0x80) != 0);
-    val <<= 1;
-    val |= (byte)GETFLAG(F_C);
+    byte c = val >> 7;
 
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val << 1) | c;
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -511,16 +664,10 @@ static byte doRLC (Z80Context* ctx, int adjFlags, byte val)
 
 static byte doRL (Z80Context* ctx, int adjFlags, byte val)
 {
-    int CY = GETFLAG(F_C);
-    VALFLAG(F_C, (val & 0x80) != 0);
-    val <<= 1;
-    val |= (byte)CY;
+    byte c = val >> 7;
 
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val << 1) | CARRY();
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -528,15 +675,10 @@ static byte doRL (Z80Context* ctx, int adjFlags, byte val)
 
 static byte doRRC (Z80Context* ctx, int adjFlags, byte val)
 {
-    VALFLAG(F_C, (val & 0x01) != 0);
-    val >>= 1;
-    val |= ((byte)GETFLAG(F_C) << 7);
+    byte c = val & 0x01;
 
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val >> 1) | (c << 7);
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -544,16 +686,10 @@ static byte doRRC (Z80Context* ctx, int adjFlags, byte val)
 
 static byte doRR (Z80Context* ctx, int adjFlags, byte val)
 {
-    int CY = GETFLAG(F_C);
-    VALFLAG(F_C, (val & 0x01));
-    val >>= 1;
-    val |= (CY << 7);
-
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
+    byte c = val & 0x01;
 
-    if (adjFlags)
-        adjustFlagSZP(ctx, val);
+    val = (val >> 1) | (CARRY() << 7);
+    adjustShiftFlags(ctx, adjFlags, val, c);
 
     return val;
 }
@@ -561,15 +697,13 @@ static byte doRR (Z80Context* ctx, int adjFlags, byte val)
 
 static byte doSL (Z80Context* ctx, byte val, int isArith)
 {
-    VALFLAG(F_C, (val & 0x80) != 0);
-    val <<= 1;
+    byte c = val >> 7;
 
+    val <<= 1;
     if (!isArith)
         val |= 1;
-
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-    adjustFlagSZP(ctx, val);
+    LAZYDONE();
+    BR.F = sz53pTable[val] | c;
 
     return val;
 }
@@ -577,17 +711,11 @@ static byte doSL (Z80Context* ctx, byte val, int isArith)
 
 static byte doSR (Z80Context* ctx, byte val, int isArith)
 {
-    int b = val & 0x80;
+    byte c = val & 0x01;
 
-    VALFLAG(F_C, (val & 0x01) != 0);
-    val >>= 1;
-
-    if (isArith)
-        val |= b;
-
-    adjustFlags(ctx, val);
-    RESFLAG(F_H | F_N);
-    adjustFlagSZP(ctx, val);
+    val = (val >> 1) | (isArith ? (val & 0x80) : 0);
+    LAZYDONE();
+    BR.F = sz53pTable[val] | c;
 
     return val;
 }
@@ -611,6 +739,140 @@ static ushort doPop (Z80Context* ctx)
 }
 
 
+/* Run all but the last iteration of an LDIR (dir 1) or LDDR (dir -1)
+ * straight between host pages, stopping at a page the board did not map,
+ * as soon as an interrupt would be taken or at the end of the slice. The
+ * caller then does one ordinary iteration, which sets the flags. Each
+ * iteration is 21 T-states and the opcode fetch of the first one has
+ * already been counted. */
+static void doBlockMove(Z80Context* ctx, int dir)
+{
+	unsigned n, len, i;
+	unsigned start = ctx->tstates - 8;
+	byte *src, *dst;
+
+	if (ctx->memPageRead == NULL || ctx->memPageWrite == NULL)
+		return;
+	if (ctx->nmi_req || (ctx->int_req && ctx->IFF1))
+		return;
+	if (ctx->tstates_limit <= start)
+		return;
+
+	n = (ushort)(WR.BC - 1);
+	if (n > (ctx->tstates_limit - start - 1) / 21)
+		n = (ctx->tstates_limit - start - 1) / 21;
+
+	while (n) {
+		src = ctx->memPageRead[WR.HL >> Z80_PAGE_SHIFT];
+		dst = ctx->memPageWrite[WR.DE >> Z80_PAGE_SHIFT];
+		if (src == NULL || dst == NULL)
+			break;
+		src += WR.HL & Z80_PAGE_MASK;
+		dst += WR.DE & Z80_PAGE_MASK;
+		if (dir > 0) {
+			len = Z80_PAGE_MASK + 1 - (WR.HL & Z80_PAGE_MASK);
+			if (len > Z80_PAGE_MASK + 1 - (WR.DE & Z80_PAGE_MASK))
+				len = Z80_PAGE_MASK + 1 - (WR.DE & Z80_PAGE_MASK);
+			if (len > n)
+				len = n;
+			/* An overlapping forward copy repeats the pattern */
+			if (dst > src && dst < src + len)
+				for (i = 0; i < len; i++)
+					dst[i] = src[i];
+			else
+				memmove(dst, src, len);
+		} else {
+			len = (WR.HL & Z80_PAGE_MASK) + 1;
+			if (len > (WR.DE & Z80_PAGE_MASK) + 1)
+				len = (WR.DE & Z80_PAGE_MASK) + 1;
+			if (len > n)
+				len = n;
+			if (src > dst && src < dst + len)
+				for (i = 0; i < len; i++)
+					*(dst - i) = *(src - i);
+			else
+				memmove(dst - len + 1, src - len + 1, len);
+		}
+		WR.HL += dir * len;
+		WR.DE += dir * len;
+		WR.BC -= len;
+		ctx->tstates += 21 * len;
+		ctx->R = (ctx->R & 0x80) | ((ctx->R + 2 * len) & 0x7f);
+		ctx->instructions += len;
+		n -= len;
+	}
+}
+
+
+/* Run all but the last iteration of an INIR/INDR (out 0) or OTIR/OTDR
+ * (out 1) through the board's bulk port hook, with the same limits as
+ * doBlockMove. The device always sees the bytes in transfer order; going
+ * down they are staged in a buffer and turned around. The final
+ * iteration is again done normally for the flags. */
+static void doBlockIO(Z80Context* ctx, int out, int dir)
+{
+	unsigned n, len, got, i;
+	unsigned start = ctx->tstates - 8;
+	ushort port;
+	byte *p;
+	byte tmp[256];
+
+	if (out ? (ctx->ioBlockWrite == NULL || ctx->memPageRead == NULL) :
+		(ctx->ioBlockRead == NULL || ctx->memPageWrite == NULL))
+		return;
+	if (ctx->nmi_req || (ctx->int_req && ctx->IFF1))
+		return;
+	if (ctx->tstates_limit <= start)
+		return;
+
+	n = (BR.B ? BR.B : 256) - 1;
+	if (n > (ctx->tstates_limit - start - 1) / 21)
+		n = (ctx->tstates_limit - start - 1) / 21;
+	/* OUTI drops B before the port is driven */
+	port = out ? (ushort)(WR.BC - 0x100) : WR.BC;
+
+	while (n) {
+		if (out)
+			p = ctx->memPageRead[WR.HL >> Z80_PAGE_SHIFT];
+		else
+			p = ctx->memPageWrite[WR.HL >> Z80_PAGE_SHIFT];
+		if (p == NULL)
+			break;
+		p += WR.HL & Z80_PAGE_MASK;
+		if (dir > 0)
+			len = Z80_PAGE_MASK + 1 - (WR.HL & Z80_PAGE_MASK);
+		else
+			len = (WR.HL & Z80_PAGE_MASK) + 1;
+		if (len > n)
+			len = n;
+		if (dir > 0) {
+			if (out)
+				got = ctx->ioBlockWrite(ctx->ioParam, port, p, len);
+			else
+				got = ctx->ioBlockRead(ctx->ioParam, port, p, len);
+		} else if (out) {
+			for (i = 0; i < len; i++)
+				tmp[i] = *(p - i);
+			got = ctx->ioBlockWrite(ctx->ioParam, port, tmp, len);
+		} else {
+			got = ctx->ioBlockRead(ctx->ioParam, port, tmp, len);
+			for (i = 0; i < got; i++)
+				*(p - i) = tmp[i];
+		}
+		if (got == 0)
+			break;
+		WR.HL += dir * (int)got;
+		BR.B -= got;
+		ctx->tstates += 21 * got;
+		ctx->R = (ctx->R & 0x80) | ((ctx->R + 2 * got) & 0x7f);
+		ctx->instructions += got;
+		n -= got;
+		if (got < len)
+			break;
+	}
+}
+
+
 static byte doCP_HL(Z80Context * ctx)
 {
 	byte val = read8(ctx, WR.HL);
@@ -659,6 +921,55 @@ static void doDAA(Z80Context * ctx) {
  */ 
 
 
+/* Fetch an opcode or prefix byte, or take it from the bus during an IM0
+   interrupt acknowledge */
+static byte fetch_opcode(Z80Context* ctx, int offset)
+{
+	byte opcode;
+
+	if (ctx->exec_int_vector)
+	{
+		opcode = ctx->int_vector;
+		ctx->tstates += 6;
+	}
+	else
+	{
+		ctx->M1 = 1;
+		opcode = read8(ctx, ctx->PC + offset);
+		ctx->M1 = 0;
+		ctx->PC++;
+		ctx->tstates += 1;
+	}
+
+	INCR;
+#ifdef LIBZ80_PROFILE
+	ctx->prof_ops = (ctx->prof_ops << 8) | opcode;
+#endif
+	return opcode;
+}
+
+
+#ifdef LIBZ80_SWITCH_DISPATCH
+
+/* Generated by mktables: one switch per prefix table with the opcode
+ * implementations called directly so they can be inlined */
+#define DISPATCH(f) \
+	do { \
+		ctx->PC -= offset; \
+		if (ctx->trace) \
+		{ \
+			SYNCFLAGS(); \
+			ctx->trace(ctx->memParam); \
+		} \
+		f(ctx); \
+		ctx->PC += offset; \
+		return; \
+	} while(0)
+
+#include "codegen/opcodes_switch.h"
+
+#else
+
 static void do_execute(Z80Context* ctx)
 {
 	const struct Z80OpcodeTable* current = &opcodes_main;
@@ -671,27 +982,16 @@ static void do_execute(Z80Context* ctx)
 
 	do
 	{
-		if (ctx->exec_int_vector)
-		{
-			opcode = ctx->int_vector;
-			ctx->tstates += 6;
-		}
-		else
-		{
-			ctx->M1 = 1;
-			opcode = read8(ctx, ctx->PC + offset);
-			ctx->M1 = 0;
-			ctx->PC++;
-			ctx->tstates += 1;
-		}
-
-		INCR;
+		opcode = fetch_opcode(ctx, offset);
 		func = entries[opcode].func;
 		if (func != NULL)
 		{			
 			ctx->PC -= offset;
 			if (ctx->trace)
+			{
+				SYNCFLAGS();
 				ctx->trace(ctx->memParam);
+			}
 			func(ctx);
 			ctx->PC += offset;
 			break;
@@ -713,6 +1013,8 @@ static void do_execute(Z80Context* ctx)
 	} while(1);
 }
 
+#endif
+
 
 static void unhalt(Z80Context* ctx)
 {
@@ -732,6 +1034,7 @@ static void do_nmi(Z80Context* ctx)
     doPush(ctx, ctx->PC);
 	ctx->PC = 0x0066;	
 	ctx->nmi_req = 0;
+	ctx->interrupts++;
 	ctx->tstates += 5;
 }
 
@@ -739,6 +1042,7 @@ static void do_nmi(Z80Context* ctx)
 static void do_int(Z80Context* ctx)
 {
     unhalt(ctx);
+	ctx->interrupts++;
 	ctx->IFF1 = 0;
 	ctx->IFF2 = 0;
 	ctx->int_req = 0;
@@ -764,8 +1068,301 @@ static void do_int(Z80Context* ctx)
 }
 
 
-void Z80Execute (Z80Context* ctx)
+#ifdef LIBZ80_PROFILE
+
+/* Run one instruction and charge it to its opcode. The bytes before the
+ * opcode in prof_ops are the prefixes, which are never zero */
+static void profile_execute(Z80Context* ctx)
+{
+	Z80Profile* p = ctx->profile;
+	unsigned start = ctx->tstates;
+	ushort pc = ctx->PC;
+	unsigned ops;
+	byte prefix;
+	int group = 0;
+
+	ctx->prof_ops = 0;
+	do_execute(ctx);
+	ops = ctx->prof_ops;
+	prefix = ops >> 8;
+	if (prefix == 0xCB)
+		group = ((ops >> 16) & 0xFF) == 0xDD ? 5 :
+			((ops >> 16) & 0xFF) == 0xFD ? 6 : 1;
+	else if (prefix == 0xED)
+		group = 2;
+	else if (prefix == 0xDD)
+		group = 3;
+	else if (prefix == 0xFD)
+		group = 4;
+	p->count[group][ops & 0xFF]++;
+	p->tstates[group][ops & 0xFF] += ctx->tstates - start;
+	p->page[pc >> 8]++;
+}
+
+#endif
+
+
+#ifdef LIBZ80_BLOCK_CACHE
+
+/* ---------------------------------------------------------
+ *  Code cache
+ * ---------------------------------------------------------
+ *
+ * Instructions in pages the board gives host pointers for are decoded
+ * once into the handler to call and what fetching the opcode and its
+ * prefixes would have done to PC, R and the T-states, so running them
+ * again skips the fetches and the walk through the prefix tables. Pages
+ * are keyed on their host pointer, so banking does not throw anything
+ * away, and a write to one only drops the instructions it lands in.
+ */
+
+#define CODE_PAGES	64
+#define CODE_HASH	256
+#define CODE_PAGE_SIZE	(1 << Z80_PAGE_SHIFT)
+
+struct code_op
+{
+	Z80OpcodeFunc func;	/* NULL if not decoded yet */
+	byte fetches;		/* Opcode and prefix bytes fetched */
+	byte offset;		/* Displacement skipped by DDCB and FDCB */
+	byte span;		/* Bytes from the start the decode read */
+	signed char r;		/* Change to R */
+	ushort tstates;		/* T-states the fetches take */
+};
+
+struct code_page
+{
+	byte *page;
+	int ok;			/* Board agreed to report writes */
+	struct code_op op[CODE_PAGE_SIZE];
+};
+
+struct code_cache
+{
+	unsigned used;
+	struct code_page *last;
+	struct code_page *hash[CODE_HASH];
+	struct code_page pages[CODE_PAGES];
+};
+
+
+static unsigned code_hash (byte *page)
+{
+	return ((unsigned long)page >> Z80_PAGE_SHIFT) & (CODE_HASH - 1);
+}
+
+
+static struct code_page* code_find (struct code_cache* cc, byte *page)
+{
+	unsigned h = code_hash(page);
+
+	while (cc->hash[h])
+	{
+		if (cc->hash[h]->page == page)
+			return cc->hash[h];
+		h = (h + 1) & (CODE_HASH - 1);
+	}
+	return NULL;
+}
+
+
+void Z80CodeFlush (Z80Context* ctx)
+{
+	struct code_cache* cc = ctx->code_cache;
+	unsigned i;
+
+	if (cc == NULL)
+		return;
+	for (i = 0; i < cc->used; i++)
+	{
+		if (cc->pages[i].ok && ctx->codePage)
+			ctx->codePage(ctx->memParam, cc->pages[i].page, 0);
+		memset(cc->pages[i].op, 0, sizeof(cc->pages[i].op));
+	}
+	memset(cc->hash, 0, sizeof(cc->hash));
+	cc->used = 0;
+	cc->last = NULL;
+}
+
+
+/* Look up or add the page, asking the board to tell us about writes */
+static struct code_page* code_page (Z80Context* ctx, byte *page)
 {
+	struct code_cache* cc = ctx->code_cache;
+	struct code_page* cp;
+	unsigned h;
+
+	if (cc == NULL)
+	{
+		cc = calloc(1, sizeof(struct code_cache));
+		if (cc == NULL)
+			return NULL;
+		ctx->code_cache = cc;
+	}
+	if (cc->last && cc->last->page == page)
+		return cc->last;
+	cp = code_find(cc, page);
+	if (cp == NULL)
+	{
+		if (cc->used == CODE_PAGES)
+			Z80CodeFlush(ctx);
+		cp = &cc->pages[cc->used++];
+		cp->page = page;
+		cp->ok = ctx->codePage(ctx->memParam, page, 1);
+		h = code_hash(page);
+		while (cc->hash[h])
+			h = (h + 1) & (CODE_HASH - 1);
+		cc->hash[h] = cp;
+	}
+	cc->last = cp;
+	return cp;
+}
+
+
+/* Walk the tables as do_execute() would. Instructions running off the
+ * end of the page, and opcodes that do nothing, are left uncached */
+static int code_decode (byte *page, unsigned off, struct code_op* op)
+{
+	const struct Z80OpcodeEntry* entries = opcodes_main.entries;
+	unsigned fetches = 0, offset = 0;
+	int r = 0;
+	byte opcode;
+
+	do
+	{
+		if (off + fetches + offset >= CODE_PAGE_SIZE)
+			return 0;
+		opcode = page[off + fetches + offset];
+		fetches++;
+		r++;
+		if (entries[opcode].func != NULL)
+		{
+			op->fetches = fetches;
+			op->offset = offset;
+			op->span = fetches + offset;
+			op->r = r;
+			op->tstates = fetches * 4;
+			op->func = entries[opcode].func;
+			return 1;
+		}
+		if (entries[opcode].table == NULL)
+			return 0;
+		offset = entries[opcode].table->opcode_offset;
+		entries = entries[opcode].table->entries;
+		if (offset > 0)
+			r--;
+	} while(1);
+}
+
+
+/* Run the next instruction from the cache if it can be */
+static int code_execute (Z80Context* ctx)
+{
+	byte *page = ctx->memPageRead[ctx->PC >> Z80_PAGE_SHIFT];
+	struct code_page* cp;
+	struct code_op* op;
+
+	if (page == NULL || (cp = code_page(ctx, page)) == NULL || !cp->ok)
+		return 0;
+	op = &cp->op[ctx->PC & Z80_PAGE_MASK];
+	if (op->func == NULL && !code_decode(page, ctx->PC & Z80_PAGE_MASK, op))
+		return 0;
+
+	ctx->M1PC = ctx->PC;
+	ctx->PC += op->fetches;
+	ctx->R = (ctx->R & 0x80) | ((ctx->R + op->r) & 0x7f);
+	ctx->tstates += op->tstates;
+	ctx->PC -= op->offset;
+	if (ctx->trace)
+	{
+		SYNCFLAGS();
+		ctx->trace(ctx->memParam);
+	}
+	op->func(ctx);
+	ctx->PC += op->offset;
+	return 1;
+}
+
+
+/* Run cached instructions back to back for as long as nothing but the
+ * next one needs looking at: no interrupt waiting, no trace hook and the
+ * same page. Anything else goes back through execute() */
+static void code_run (Z80Context* ctx, unsigned tstates, volatile int *stop)
+{
+	struct code_cache* cc = ctx->code_cache;
+	struct code_page* cp;
+	struct code_op* op;
+
+	if (cc == NULL || (cp = cc->last) == NULL || !cp->ok ||
+	    ctx->codePage == NULL || ctx->trace)
+		return;
+#ifdef LIBZ80_PROFILE
+	if (ctx->profile)
+		return;
+#endif
+	while (ctx->tstates < tstates && !(stop && *stop))
+	{
+		if (ctx->nmi_req || (ctx->int_req && ctx->IFF1) ||
+		    ctx->memPageRead == NULL ||
+		    ctx->memPageRead[ctx->PC >> Z80_PAGE_SHIFT] != cp->page)
+			return;
+		op = &cp->op[ctx->PC & Z80_PAGE_MASK];
+		if (op->func == NULL)
+			return;
+		ctx->op_tstates = ctx->tstates;
+		ctx->instructions++;
+		ctx->defer_int = 0;
+		if (ctx->coverage)
+			ctx->coverage[ctx->PC >> 3] |= 1 << (ctx->PC & 7);
+		ctx->M1PC = ctx->PC;
+		ctx->PC += op->fetches;
+		ctx->R = (ctx->R & 0x80) | ((ctx->R + op->r) & 0x7f);
+		ctx->tstates += op->tstates;
+		ctx->PC -= op->offset;
+		op->func(ctx);
+		ctx->PC += op->offset;
+	}
+}
+
+
+void Z80CodeWritten (Z80Context* ctx, byte *page, unsigned offset)
+{
+	struct code_page* cp;
+	unsigned i;
+
+	if (ctx->code_cache == NULL)
+		return;
+	cp = code_find(ctx->code_cache, page);
+	if (cp == NULL)
+		return;
+	/* Anything decoded from up to three bytes before */
+	for (i = 0; i < 4 && i <= offset; i++)
+		if (cp->op[offset - i].span > i)
+			cp->op[offset - i].func = NULL;
+}
+
+#define CODE_RUN(t, s) code_run(ctx, t, s)
+
+#else
+
+#define CODE_RUN(t, s) do { } while(0)
+
+void Z80CodeWritten (Z80Context* ctx, byte *page, unsigned offset)
+{
+}
+
+
+void Z80CodeFlush (Z80Context* ctx)
+{
+}
+
+#endif
+
+
+static void execute (Z80Context* ctx)
+{
+	ctx->op_tstates = ctx->tstates;
+	ctx->instructions++;
 	if (ctx->nmi_req)
 		do_nmi(ctx);
 	else if (ctx->int_req && !ctx->defer_int && ctx->IFF1)
@@ -773,16 +1370,56 @@ void Z80Execute (Z80Context* ctx)
 	else
 	{
 		ctx->defer_int = 0;
+		if (ctx->coverage)
+			ctx->coverage[ctx->PC >> 3] |= 1 << (ctx->PC & 7);
+#ifdef LIBZ80_PROFILE
+		if (ctx->profile)
+			profile_execute(ctx);
+		else
+#endif
+#ifdef LIBZ80_BLOCK_CACHE
+		if (ctx->codePage == NULL || ctx->memPageRead == NULL ||
+		    !code_execute(ctx))
+#endif
 		do_execute(ctx);
 	}
 }
 
 
+/* F is always up to date by the time the board gets control back */
+void Z80Execute (Z80Context* ctx)
+{
+	execute(ctx);
+	SYNCFLAGS();
+}
+
+
 unsigned Z80ExecuteTStates(Z80Context* ctx, unsigned tstates)
 {
 	ctx->tstates = 0;
+	ctx->tstates_limit = tstates;
 	while (ctx->tstates < tstates)
-		Z80Execute(ctx);
+	{
+		execute(ctx);
+		CODE_RUN(tstates, NULL);
+	}
+	SYNCFLAGS();
+	ctx->tstates_limit = 0;
+	return ctx->tstates;
+}
+
+
+unsigned Z80ExecuteTStatesStop(Z80Context* ctx, unsigned tstates, volatile int *stop)
+{
+	ctx->tstates = 0;
+	ctx->tstates_limit = tstates;
+	while (ctx->tstates < tstates && !*stop)
+	{
+		execute(ctx);
+		CODE_RUN(tstates, stop);
+	}
+	SYNCFLAGS();
+	ctx->tstates_limit = 0;
 	return ctx->tstates;
 }
 
@@ -863,6 +1500,7 @@ void Z80Debug (Z80Context* ctx, char* dump, char* decode)
 void Z80RESET (Z80Context* ctx)
 {
 	ctx->PC = 0x0000;
+	LAZYDONE();
 	BR.F = 0;
 	ctx->IM = 0;
 	ctx->IFF1 = ctx->IFF2 = 0;
@@ -74,6 +74,22 @@ typedef enum
 } Z80Flags;
 
 
+/** Opcode profile groups: unprefixed, CB, ED, DD, FD, DDCB and FDCB */
+#define Z80_PAGE_SHIFT	12
+#define Z80_PAGE_MASK	0x0FFF
+
+#define Z80_PROFILE_GROUPS	7
+
+/** Execution counts kept when the library is built with LIBZ80_PROFILE
+ * and the context has a profile attached. */
+typedef struct
+{
+	unsigned long long count[Z80_PROFILE_GROUPS][256];	/**< Per opcode */
+	unsigned long long tstates[Z80_PROFILE_GROUPS][256];	/**< T-states per opcode */
+	unsigned long long page[256];	/**< Instructions by PC high byte */
+} Z80Profile;
+
+
 /** A Z80 execution context. */
 typedef struct
 {
@@ -98,6 +114,40 @@ typedef struct
 	
 	byte		halted;
 	unsigned	tstates;
+	/* tstates when the current instruction began, for devices that
+	 * need to know which events came due before an I/O access */
+	unsigned	op_tstates;
+
+	/* Optional tables of host pointers for each Z80_PAGE sized page,
+	 * or NULL. A NULL entry means the page must go through memRead or
+	 * memWrite. Only used to run LDIR and LDDR in bulk and by the
+	 * code cache, so a board should clear them while it traces memory
+	 * or instructions. */
+	byte		**memPageRead;
+	byte		**memPageWrite;
+
+	/* Optional bulk port transfers for INIR/INDR and OTIR/OTDR, or
+	 * NULL. They move up to len bytes between the port and buf in
+	 * transfer order and return how many were moved, 0 if the port must
+	 * be done a byte at a time. The port is BC as of the first transfer;
+	 * B counts down as usual. Used only along with memPageWrite (input)
+	 * or memPageRead (output). */
+	unsigned	(*ioBlockRead)(int param, ushort port, byte *buf, unsigned len);
+	unsigned	(*ioBlockWrite)(int param, ushort port, const byte *buf, unsigned len);
+
+	/* Called once a RETI has executed, or NULL. Daisy chained
+	 * peripherals watch for ED 4D on the bus; this lets a board run
+	 * the chain without decoding every opcode fetch itself. */
+	void		(*reti)(int param);
+
+	/* Set to let a code cache build run instructions from pages in
+	 * memPageRead without fetching and decoding them each time, or
+	 * NULL. Called with cached 1 when the library starts caching a
+	 * page: the board returns 0 to refuse, otherwise it must report
+	 * every later write to that memory through Z80CodeWritten, however
+	 * it is mapped, until called for the page with cached 0. Opcode
+	 * fetches from cached pages do not go through memRead. */
+	int		(*codePage)(int param, byte *page, int cached);
 
 	/* Below are implementation details which may change without
 	 * warning; they should not be relied upon by any user of this
@@ -133,8 +183,38 @@ typedef struct
 
 	byte exec_int_vector;
 
+	/* End of the current Z80ExecuteTStates slice, or 0 */
+	unsigned tstates_limit;
+
+	/* Instructions run, for working out emulator speed */
+	unsigned long long instructions;
+
+	/* Interrupts and NMIs taken */
+	unsigned long long interrupts;
+
 	void (*trace)(unsigned int memparam);
 
+	/* Bitmap of instruction addresses run, one bit each, or NULL */
+	byte *coverage;
+
+	/* Opcode profile, or NULL. Only filled in by a profiling build */
+	Z80Profile *profile;
+
+	/* Opcode bytes fetched for the current instruction */
+	unsigned prof_ops;
+
+	/* Where F is to be worked out from in a lazy flags build. F is
+	 * brought up to date before the trace hook is called and before
+	 * the Z80Execute functions return, but not for memory and I/O
+	 * callbacks. */
+	byte lazy_op;
+	byte lazy_a;
+	byte lazy_v;
+	ushort lazy_res;
+
+	/* Decoded instructions, in a code cache build */
+	void *code_cache;
+
 } Z80Context;
 
 
@@ -146,6 +226,13 @@ void Z80Execute (Z80Context* ctx);
  * ctx->tstates.*/
 unsigned Z80ExecuteTStates(Z80Context* ctx, unsigned tstates);
 
+/** Execute instructions until at least tstates cycles are used or until
+ * *stop becomes non-zero. The flag is tested after each instruction so a
+ * device can end the slice early, for example when it raises an interrupt.
+ * The flag is not cleared. Returns the number of tstates actually executed.
+ * Note: Resets ctx->tstates.*/
+unsigned Z80ExecuteTStatesStop(Z80Context* ctx, unsigned tstates, volatile int *stop);
+
 /** Decode the next instruction to be executed.
  * dump and decode can be NULL if such information is not needed
  *
@@ -171,6 +258,14 @@ void Z80INT (Z80Context* ctx, byte value);
 void Z80NOINT(Z80Context* ctx);
 
 
+/** Tell a code cache build that the byte at offset in a page the
+ * codePage hook accepted has been written. */
+void Z80CodeWritten (Z80Context* ctx, byte *page, unsigned offset);
+
+/** Throw away all decoded code, for when memory has been changed
+ * without each write being reported. */
+void Z80CodeFlush (Z80Context* ctx);
+
 /** Lower the NMI line (edge trigger is managed internally) */
 void Z80NMI (Z80Context* ctx);
 
@@ -40,6 +40,9 @@
 #include "libz80/z80.h"
 #include "ide.h"
 #include "sdcard.h"
+#include "trace.h"
+#include "cpuclock.h"
+#include "z80run.h"
 
 static uint8_t rom[65536];
 static uint8_t ram[65536];	/* We never use the banked 16K */
@@ -83,7 +86,6 @@ static void reti_event(void);
 
 static uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate = 0;
 	uint8_t r;
 
 	if (addr < 0x4000 && !romdis)
@@ -91,37 +93,16 @@ static uint8_t mem_read(int unused, uint16_t addr)
 	else if (addr >= 0x8000 && addr <= banktop) {
 		/* Simulate tight decode providing crap for absent banks */
 		if (ramsel > rsmask) {	/* This works as mask is power of 2 - 1 */
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "[Read from invalid bank %d]\n", ramsel);
 			r = rand();
 		} else
 			r = altram[ramsel & rsmask][addr & bankmask];
 	} else
 		r = ram[addr];
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, r);
 
-	/* Look for ED with M1, followed directly by 4D and if so trigger
-	   the interrupt chain */
-	if (cpu_z80.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r== 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1) {
-		if (trace & TRACE_IRQ)
-			fprintf(stderr, "RETI seen.\n");
-		reti_event();
-	}
-	rstate = 0;
 	return r;
 }
 
@@ -133,11 +114,11 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
 		printf("PC=%04X Wrote oddly to %04X with %02X\n",
 			cpu_z80.PC, addr, val);
 #endif
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %04X = %02X\n", addr, val);
 	if (addr < 0x4000) {
 		if (!romdis) {
-			if (trace & TRACE_MEM) {
+			if (TRACE_ON(trace & TRACE_MEM)) {
 				fprintf(stderr, "[Discarded: ROM]\n");
 				return;
 			}
@@ -147,7 +128,7 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
 	}
 	if (addr >= 0x8000 && addr <= banktop) {
 		if (ramsel > rsmask) {
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "[Write to invalid bank %d]\n", ramsel);
 		} else
 			altram[ramsel & rsmask][addr & bankmask] = val;
@@ -236,7 +217,7 @@ static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
 	uint8_t vector;
 	chan->intbits |= m;
 	chan->pending |= new;
-	if (trace & TRACE_SIO)
+	if (TRACE_ON(trace & TRACE_SIO))
 		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
 	if (chan->pending) {
 		if (!sio->irq) {
@@ -254,7 +235,7 @@ static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
 				else if (chan->intbits & INT_ERR)
 					vector |= 2;
 			}
-			if (trace & (TRACE_SIO | TRACE_IRQ))
+			if (TRACE_ON(trace & (TRACE_SIO | TRACE_IRQ)))
 				fprintf(stderr,
 					"SIO2 interrupt %02X\n", vector);
 			chan->vector = vector;
@@ -269,7 +250,7 @@ static void sio2_reti(struct z80_sio_chan *chan)
 		chan->irq = 0;
 	/* Recalculate the pending state and vectors */
 	sio2_raise_int(chan, 0);
-	if (trace & (TRACE_IRQ|TRACE_SIO))
+	if (TRACE_ON(trace & (TRACE_IRQ|TRACE_SIO)))
 		fprintf(stderr, "Acked interrupt from SIO.\n");
 }
 
@@ -283,7 +264,7 @@ static int sio2_check_im2(struct z80_sio_chan *chan)
 			chan->vector += (sio[1].wr[2] & 0xF1);
 		else
 			chan->vector += sio[1].wr[2];
-		if (trace & (TRACE_IRQ|TRACE_SIO))
+		if (TRACE_ON(trace & (TRACE_IRQ|TRACE_SIO)))
 			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
 				(int)(chan - sio), chan->vector);
 		if (chan == sio)
@@ -302,7 +283,7 @@ static int sio2_check_im2(struct z80_sio_chan *chan)
  */
 static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 {
-	if (trace & TRACE_SIO)
+	if (TRACE_ON(trace & TRACE_SIO))
 		fprintf(stderr, "SIO %d queue %d: ",
 			(int) (chan - sio), c);
 	/* Receive disabled */
@@ -312,7 +293,7 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 	}
 	/* Overrun */
 	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Overrun.\n");
 		chan->data[2] = c;
 		chan->rr[1] |= 0x20;	/* Overrun flagged */
@@ -320,7 +301,7 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 		sio2_raise_int(chan, INT_ERR);
 	} else {
 		/* FIFO add */
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Queued %d (mode %d)\n",
 				chan->dptr, chan->wr[1] & 0x18);
 		chan->data[chan->dptr++] = c;
@@ -392,18 +373,18 @@ static uint8_t sio2_read(uint16_t addr)
 		uint8_t r = chan->wr[0] & 007;
 		chan->wr[0] &= ~007;
 
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read reg %d = ",
 				(addr & 1) ? 'b' : 'a', r);
 		switch (r) {
 		case 0:
 		case 1:
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "%02X\n", chan->rr[r]);
 			return chan->rr[r];
 		case 2:
 			if (chan != sio) {
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr, "%02X\n",
 						chan->rr[2]);
 				return chan->rr[2];
@@ -425,7 +406,7 @@ static uint8_t sio2_read(uint16_t addr)
 		sio2_clear_int(chan, INT_RX);
 		chan->rr[0] &= 0x3F;
 		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read data %d\n",
 				(addr & 1) ? 'b' : 'a', c);
 		if (chan->dptr && (chan->wr[1] & 0x10))
@@ -440,7 +421,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 	struct z80_sio_chan *chan = (addr & 1) ? sio + 1 : sio;
 	uint8_t r;
 	if (addr & 2) {
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr,
 				"sio%c write reg %d with %02X\n",
 				(addr & 1) ? 'b' : 'a',
@@ -460,7 +441,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
 				break;
 			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr,
 						"[channel reset]\n");
 				sio2_channel_reset(chan);
@@ -497,7 +478,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		case 6:
 		case 7:
 			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
 					(addr & 2) ? 'b' : 'a', r, val);
 			chan->wr[r] = val;
@@ -515,7 +496,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		chan->txint = 1;
 		/* Should check chan->wr[5] & 8 */
 		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c write data %d\n",
 				(addr & 1) ? 'b' : 'a', val);
 		write(1, &val, 1);
@@ -580,7 +561,7 @@ static void ctc_interrupt(struct z80_ctc *c)
 		if (!(ctc_irqmask & (1 << i))) {
 			ctc_irqmask |= 1 << i;
 			recalc_interrupts();
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d wants to interrupt.\n", i);
 		}
 	}
@@ -589,7 +570,7 @@ static void ctc_interrupt(struct z80_ctc *c)
 static void ctc_reti(int ctcnum)
 {
 	ctc_irqmask &= ~(1 << ctcnum);
-	if (trace & TRACE_IRQ)
+	if (TRACE_ON(trace & TRACE_IRQ))
 		fprintf(stderr, "Acked interrupt from CTC %d.\n", ctcnum);
 }
 
@@ -604,7 +585,7 @@ static int ctc_check_im2(void)
 			if (ctc_irqmask & (1 << i)) {
 				uint8_t vector = ctc[0].vector & 0xF8;
 				vector += 2 * i;
-				if (trace & TRACE_IRQ)
+				if (TRACE_ON(trace & TRACE_IRQ))
 					fprintf(stderr, "New live interrupt is from CTC %d vector %x.\n", i, vector);
 				live_irq = IRQ_CTC + i;
 				Z80INT(&cpu_z80, vector);
@@ -684,12 +665,12 @@ static void ctc_write(uint8_t channel, uint8_t val)
 {
 	struct z80_ctc *c = ctc + channel;
 	if (c->ctrl & CTC_TCONST) {
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d constant loaded with %02X\n", channel, val);
 		c->reload = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET)) {
 			c->count = (c->reload - 1) << 8;
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
 		c->ctrl &= ~CTC_TCONST|CTC_RESET;
@@ -697,25 +678,25 @@ static void ctc_write(uint8_t channel, uint8_t val)
 		/* We don't yet model the weirdness around edge wanted
 		   toggling and clock starts */
 		/* Check rule on resets */
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d control loaded with %02X\n", channel, val);
 		c->ctrl = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == CTC_RESET) {
 			c->count = (c->reload - 1) << 8;
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
 		/* Undocumented */
 		if (!(c->ctrl & CTC_IRQ) && (ctc_irqmask & (1 << channel))) {
 			ctc_irqmask &= ~(1 << channel);
 			if (ctc_irqmask == 0) {
-				if (trace & TRACE_IRQ)
+				if (TRACE_ON(trace & TRACE_IRQ))
 					fprintf(stderr, "CTC %d irq reset.\n", channel);
 				recalc_interrupts();
 			}
 		}
 	} else {
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d vector loaded with %02X\n", channel, val);
 		c->vector = val;
 	}
@@ -724,7 +705,7 @@ static void ctc_write(uint8_t channel, uint8_t val)
 static uint8_t ctc_read(uint8_t channel)
 {
 	uint8_t val = ctc[channel].count >> 8;
-	if (trace & TRACE_CTC)
+	if (TRACE_ON(trace & TRACE_CTC))
 		fprintf(stderr, "CTC %d reads %02x\n", channel, val);
 	return val;
 }
@@ -749,7 +730,7 @@ static struct z80_pio pio[1];
 static uint8_t spi_byte_sent(uint8_t val)
 {
 	uint8_t r = sd_spi_in(sdcard, val);
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 		fprintf(stderr,	"[SPI %02X:%02X]\n", val, r);
 	fflush(stdout);
 	return r;
@@ -768,14 +749,14 @@ static void bitbang_spi(uint8_t val)
 		return;
 
 	if (val & 0x08) {		/* CS high - deselected */
-		if ((trace & TRACE_SPI) && (delta & 0x08))
+		if (TRACE_ON(trace & TRACE_SPI) && (delta & 0x08))
 			fprintf(stderr,	"[Raised \\CS]\n");
 		bits = 0;
 		sd_spi_raise_cs(sdcard);
 		return;
 	}
 	if (delta & 0x08) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "[Lowered \\CS]\n");
 		sd_spi_lower_cs(sdcard);
 	}
@@ -945,7 +926,7 @@ static void memory_control(uint8_t val)
 		if (val & 0x40)
 			ramsel |= 0x8;
 	}
-	if (trace & TRACE_PAGE) {
+	if (TRACE_ON(trace & TRACE_PAGE)) {
 		fprintf(stderr, "memory control: romdis %d intdis %d ramsel %d romsel %d.\n",
 			romdis, intdis, ramsel, romsel);
 		if (ramsel > rsmask)
@@ -955,7 +936,7 @@ static void memory_control(uint8_t val)
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x07)
@@ -966,14 +947,14 @@ static uint8_t io_read(int unused, uint16_t addr)
 		return my_ide_read(addr & 7);
 	if (addr >= 0x18 && addr <= 0x1F)
 		return pio_read(addr & 3);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x07)
@@ -989,7 +970,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr,
 			"Unknown write to port %04X of %02X\n", addr, val);
 }
@@ -999,6 +980,14 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
  *	who delivers next. Also used when we need to check for new interrupts
  *	and there is no interrupt pending.
  */
+/* RETI executed by the CPU */
+static void linc80_reti(int unused)
+{
+	if (TRACE_ON(trace & TRACE_IRQ))
+		fprintf(stderr, "RETI seen.\n");
+	reti_event();
+}
+
 static void reti_event(void)
 {
 	switch(live_irq) {
@@ -1049,13 +1038,35 @@ static void exit_cleanup(void)
 static void usage(void)
 {
 	fprintf(stderr,
-		"linc80: [-x] [-f] [-b banks] [-r rompath] [-i idepath] [-s sdcard] [-d debug]\n");
+		"linc80: [-x] [-f] [-X MHz] [-b banks] [-r rompath] [-i idepath] [-s sdcard] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
+/* Run between each slice of CPU time */
+static void linc80_step(void)
+{
+	sio2_timer();
+	ctc_tick(364);
+}
+
+static void linc80_tick(void)
+{
+	if (int_recalc) {
+		/* If there is no pending IRQ but we think there now
+		   might be one we use the same logic as for reti */
+		if (!live_irq)
+			reti_event();
+		/* Clear this after because reti_event may set the
+		   flags to indicate there is more happening. We will
+		   pick up the next state changes on the reti if so */
+		if (!(cpu_z80.IFF1|cpu_z80.IFF2))
+			int_recalc = 0;
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
+	static struct z80run run;
 	int opt;
 	int fd;
 	char *rompath = "linc80.rom";
@@ -1063,7 +1074,7 @@ int main(int argc, char *argv[])
 	char *sdpath = NULL;
 	int banks = 1;
 
-	while ((opt = getopt(argc, argv, "r:i:d:fxb:s:")) != -1) {
+	while ((opt = getopt(argc, argv, "r:i:d:fxb:s:X:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -1080,6 +1091,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			run.hz = cpuclock_parse(optarg);
+			break;
 		case 'x':
 			linc80x = 1;
 			banktop = 0xFFFF;
@@ -1145,7 +1159,7 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
 
@@ -1153,11 +1167,6 @@ int main(int argc, char *argv[])
 	ctc_init();
 	pio_reset();
 
-	/* 5ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 5000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -1178,37 +1187,19 @@ int main(int argc, char *argv[])
 	cpu_z80.ioWrite = io_write;
 	cpu_z80.memRead = mem_read;
 	cpu_z80.memWrite = mem_write;
-
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	/* We run 7372000 t-states per second */
-	/* We run 369 cycles per I/O check, do that 100 times then poll the
-	   slow stuff and nap for 5ms. */
-	while (1) {
-		int i;
-		/* 36400 T states */
-		for (i = 0; i < 100; i++) {
-			Z80ExecuteTStates(&cpu_z80, 369);
-			sio2_timer();
-			ctc_tick(364);
-		}
-		/* Do 5ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
-		if (int_recalc) {
-			/* If there is no pending IRQ but we think there now
-			   might be one we use the same logic as for reti */
-			if (!live_irq)
-				reti_event();
-			/* Clear this after because reti_event may set the
-			   flags to indicate there is more happening. We will
-			   pick up the next state changes on the reti if so */
-			if (!(cpu_z80.IFF1|cpu_z80.IFF2))
-				int_recalc = 0;
-		}
-	}
+	cpu_z80.reti = linc80_reti;
+
+	/* We run 7372800 t-states per second, 369 cycles per I/O check,
+	   100 of those then poll the slow stuff and nap for 5ms. */
+	run.cpu = &cpu_z80;
+	if (run.hz == 0)
+		run.hz = 7372800;
+	run.rate = 20000;
+	run.steps = 100;
+	run.ticks = 1;
+	run.step = linc80_step;
+	run.tick = linc80_tick;
+	run.fast = fast;
+	z80run_loop(&run);
 	exit(0);
 }
@@ -112,8 +112,11 @@ M68KMAKE_PROTOTYPE_FOOTER
 /* Build the opcode handler table */
 void m68ki_build_opcode_table(void);
 
-extern void (*m68ki_instruction_jump_table[0x10000])(void); /* opcode handler jump table */
-extern unsigned char m68ki_cycles[][0x10000];
+/* Each opcode maps to a handler number, which picks the handler and its
+   cycles. This keeps the tables small enough to stay in cache */
+extern unsigned short m68ki_instruction_index[0x10000];              /* handler number for each opcode */
+extern void (*m68ki_instruction_handler[M68KI_NUM_HANDLERS])(void); /* opcode handlers by number */
+extern unsigned char m68ki_cycles[][M68KI_NUM_HANDLERS];
 
 
 /* ======================================================================== */
@@ -131,12 +134,15 @@ M68KMAKE_TABLE_HEADER
 /* ========================= OPCODE TABLE BUILDER ========================= */
 /* ======================================================================== */
 
+#include <string.h>
 #include "m68kops.h"
 
 #define NUM_CPU_TYPES 3
 
-void  (*m68ki_instruction_jump_table[0x10000])(void); /* opcode handler jump table */
-unsigned char m68ki_cycles[NUM_CPU_TYPES][0x10000]; /* Cycles used by CPU type */
+unsigned short m68ki_instruction_index[0x10000];              /* handler number for each opcode */
+void (*m68ki_instruction_handler[M68KI_NUM_HANDLERS])(void); /* opcode handlers by number */
+unsigned char m68ki_cycles[NUM_CPU_TYPES][M68KI_NUM_HANDLERS]; /* Cycles used by CPU type */
+static unsigned int m68ki_num_handlers;
 
 /* This is used to generate the opcode handler jump table */
 typedef struct
@@ -162,108 +168,107 @@ M68KMAKE_TABLE_FOOTER
 };
 
 
-/* Build the opcode handler jump table */
+/* Allocate the next handler number */
+static unsigned int m68ki_add_handler(void (*handler)(void), unsigned char *cycles)
+{
+	unsigned int n = m68ki_num_handlers++;
+	int k;
+
+	m68ki_instruction_handler[n] = handler;
+	for(k=0;k<NUM_CPU_TYPES;k++)
+		m68ki_cycles[k][n] = cycles ? cycles[k] : 0;
+	return n;
+}
+
+/* Build the opcode handler index table */
 void m68ki_build_opcode_table(void)
 {
 	opcode_handler_struct *ostruct;
+	unsigned char cycles[NUM_CPU_TYPES];
 	int cycle_cost;
 	int instr;
 	int i;
 	int j;
-	int k;
+	int shift;
+	unsigned int n = 0;
 
-	for(i = 0; i < 0x10000; i++)
-	{
-		/* default to illegal */
-		m68ki_instruction_jump_table[i] = m68k_op_illegal;
-		for(k=0;k<NUM_CPU_TYPES;k++)
-			m68ki_cycles[k][i] = 0;
-	}
+	/* Handler 0 is illegal and everything defaults to it */
+	m68ki_num_handlers = 0;
+	m68ki_add_handler(m68k_op_illegal, NULL);
+	memset(m68ki_instruction_index, 0, sizeof(m68ki_instruction_index));
 
 	ostruct = m68k_opcode_handler_table;
 	while(ostruct->mask != 0xff00)
 	{
+		n = m68ki_add_handler(ostruct->opcode_handler, ostruct->cycles);
 		for(i = 0;i < 0x10000;i++)
 		{
 			if((i & ostruct->mask) == ostruct->match)
-			{
-				m68ki_instruction_jump_table[i] = ostruct->opcode_handler;
-				for(k=0;k<NUM_CPU_TYPES;k++)
-					m68ki_cycles[k][i] = ostruct->cycles[k];
-			}
+				m68ki_instruction_index[i] = n;
 		}
 		ostruct++;
 	}
 	while(ostruct->mask == 0xff00)
 	{
+		n = m68ki_add_handler(ostruct->opcode_handler, ostruct->cycles);
 		for(i = 0;i <= 0xff;i++)
-		{
-			m68ki_instruction_jump_table[ostruct->match | i] = ostruct->opcode_handler;
-			for(k=0;k<NUM_CPU_TYPES;k++)
-				m68ki_cycles[k][ostruct->match | i] = ostruct->cycles[k];
-		}
+			m68ki_instruction_index[ostruct->match | i] = n;
 		ostruct++;
 	}
 	while(ostruct->mask == 0xf1f8)
 	{
+		// For all shift operations with known shift distance (encoded in instruction word)
+		shift = (ostruct->match & 0xf000) == 0xe000 && (!(ostruct->match & 0x20));
+		if(!shift)
+			n = m68ki_add_handler(ostruct->opcode_handler, ostruct->cycles);
 		for(i = 0;i < 8;i++)
 		{
+			if(shift)
+			{
+				// On the 68000 and 68010 shift distance affect execution time.
+				// Add the cycle cost of shifting; 2 times the shift distance.
+				// Each distance gets its own handler number to carry it
+				cycle_cost = ((((i-1)&7)+1)<<1);
+				memcpy(cycles, ostruct->cycles, sizeof(cycles));
+				cycles[0] += cycle_cost;
+				cycles[1] += cycle_cost;
+				// On the 68020 shift distance does not affect execution time
+				cycles[2] += 0;
+				n = m68ki_add_handler(ostruct->opcode_handler, cycles);
+			}
 			for(j = 0;j < 8;j++)
 			{
 				instr = ostruct->match | (i << 9) | j;
-				m68ki_instruction_jump_table[instr] = ostruct->opcode_handler;
-				for(k=0;k<NUM_CPU_TYPES;k++)
-					m68ki_cycles[k][instr] = ostruct->cycles[k];
-				// For all shift operations with known shift distance (encoded in instruction word)
-				if((instr & 0xf000) == 0xe000 && (!(instr & 0x20)))
-				{
-					// On the 68000 and 68010 shift distance affect execution time.
-					// Add the cycle cost of shifting; 2 times the shift distance
-					cycle_cost = ((((i-1)&7)+1)<<1);
-					m68ki_cycles[0][instr] += cycle_cost;
-					m68ki_cycles[1][instr] += cycle_cost;
-					// On the 68020 shift distance does not affect execution time
-					m68ki_cycles[2][instr] += 0;
-				}
+				m68ki_instruction_index[instr] = n;
 			}
 		}
 		ostruct++;
 	}
 	while(ostruct->mask == 0xfff0)
 	{
+		n = m68ki_add_handler(ostruct->opcode_handler, ostruct->cycles);
 		for(i = 0;i <= 0x0f;i++)
-		{
-			m68ki_instruction_jump_table[ostruct->match | i] = ostruct->opcode_handler;
-			for(k=0;k<NUM_CPU_TYPES;k++)
-				m68ki_cycles[k][ostruct->match | i] = ostruct->cycles[k];
-		}
+			m68ki_instruction_index[ostruct->match | i] = n;
 		ostruct++;
 	}
 	while(ostruct->mask == 0xf1ff)
 	{
+		n = m68ki_add_handler(ostruct->opcode_handler, ostruct->cycles);
 		for(i = 0;i <= 0x07;i++)
-		{
-			m68ki_instruction_jump_table[ostruct->match | (i << 9)] = ostruct->opcode_handler;
-			for(k=0;k<NUM_CPU_TYPES;k++)
-				m68ki_cycles[k][ostruct->match | (i << 9)] = ostruct->cycles[k];
-		}
+			m68ki_instruction_index[ostruct->match | (i << 9)] = n;
 		ostruct++;
 	}
 	while(ostruct->mask == 0xfff8)
 	{
+		n = m68ki_add_handler(ostruct->opcode_handler, ostruct->cycles);
 		for(i = 0;i <= 0x07;i++)
-		{
-			m68ki_instruction_jump_table[ostruct->match | i] = ostruct->opcode_handler;
-			for(k=0;k<NUM_CPU_TYPES;k++)
-				m68ki_cycles[k][ostruct->match | i] = ostruct->cycles[k];
-		}
+			m68ki_instruction_index[ostruct->match | i] = n;
 		ostruct++;
 	}
 	while(ostruct->mask == 0xffff)
 	{
-		m68ki_instruction_jump_table[ostruct->match] = ostruct->opcode_handler;
-		for(k=0;k<NUM_CPU_TYPES;k++)
-			m68ki_cycles[k][ostruct->match] = ostruct->cycles[k];
+		n = m68ki_add_handler(ostruct->opcode_handler, ostruct->cycles);
+		m68ki_instruction_index[ostruct->match] = n;
 		ostruct++;
 	}
 }
@@ -639,6 +639,8 @@ void m68k_set_cpu_type(unsigned int cpu_type)
 /* ASG: removed per-instruction interrupt checks */
 int m68k_execute(int num_cycles)
 {
+	uint handler;
+
 	/* Make sure we're not stopped */
 	if(!CPU_STOPPED)
 	{
@@ -670,8 +672,9 @@ int m68k_execute(int num_cycles)
 
 			/* Read an instruction and call its handler */
 			REG_IR = m68ki_read_imm_16();
-			m68ki_instruction_jump_table[REG_IR]();
-			USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
+			handler = m68ki_instruction_index[REG_IR];
+			m68ki_instruction_handler[handler]();
+			USE_CYCLES(CYC_INSTRUCTION[handler]);
 
 			/* Trace m68k_exception, if necessary */
 			m68ki_exception_if_trace(); /* auto-disable (see m68kcpu.h) */
@@ -325,13 +325,14 @@ static char* make_signed_hex_str_32(uint val)
 /* make string of immediate value */
 static char* get_imm_str_s(uint size)
 {
-	static char str[15];
+	/* Room for all of make_signed_hex_str_*'s buffer */
+	static char str[21];
 	if(size == 0)
-		snprintf(str, 15, "#%s", make_signed_hex_str_8(read_imm_8()));
+		snprintf(str, sizeof(str), "#%s", make_signed_hex_str_8(read_imm_8()));
 	else if(size == 1)
-		snprintf(str, 15, "#%s", make_signed_hex_str_16(read_imm_16()));
+		snprintf(str, sizeof(str), "#%s", make_signed_hex_str_16(read_imm_16()));
 	else
-		snprintf(str, 15, "#%s", make_signed_hex_str_32(read_imm_32()));
+		snprintf(str, sizeof(str), "#%s", make_signed_hex_str_32(read_imm_32()));
 	return str;
 }
 
@@ -818,6 +818,23 @@ void print_opcode_output_table(FILE* filep)
 		write_table_entry(filep, g_opcode_output_table+i);
 }
 
+/* The number of handler numbers the table builder hands out: one for
+   illegal, one per table entry and seven more for each immediate shift
+   as every shift distance has its own timing */
+int count_handlers(void)
+{
+	int i;
+	int n = 1 + g_opcode_output_table_length;
+
+	for(i=0;i<g_opcode_output_table_length;i++)
+	{
+		opcode_struct* op = g_opcode_output_table+i;
+		if(op->op_mask == 0xf1f8 && (op->op_match & 0xf000) == 0xe000 && !(op->op_match & 0x20))
+			n += 7;
+	}
+	return n;
+}
+
 /* Write an entry in the opcode handler table */
 void write_table_entry(FILE* filep, opcode_struct* op)
 {
@@ -1395,6 +1412,7 @@ int main(int argc, char **argv)
 
 			print_opcode_output_table(g_table_file);
 
+			fprintf(g_prototype_file, "#define M68KI_NUM_HANDLERS %d\n\n", count_handlers());
 			fprintf(g_prototype_file, "%s\n\n", prototype_footer_insert);
 			fprintf(g_table_file, "%s\n\n", table_footer_insert);
 			fprintf(g_ops_ac_file, "%s\n\n", ophandler_footer_insert);
@@ -1,28 +1,366 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "ide.h"
 
-int main(int argc, const char *argv[])
+/*
+ *	CP/M file system as RomWBW lays out an 8MB hd512 slice: 16 sectors
+ *	a track, 16 system tracks, 4K blocks with 16 bit pointers and 512
+ *	directory entries in the first four blocks.
+ */
+#define CPM_SLICE	(1040 * 16)	/* Sectors */
+#define CPM_SYSTEM	(16 * 16)
+#define CPM_BLOCK	4096
+#define CPM_BLOCKS	2048
+#define CPM_DIRENT	512
+#define CPM_DIRBLOCKS	(CPM_DIRENT * 32 / CPM_BLOCK)
+
+static const char *name;
+static uint8_t *cpm;			/* The slice being built */
+static unsigned int cpm_next = CPM_DIRBLOCKS;	/* Next free block */
+static unsigned int cpm_dirent;
+
+static void usage(void)
+{
+  fprintf(stderr, "%s [-2] [-s] [-c dir|tarfile] [-r raw[@lba]] [type] [path]\n", name);
+  fprintf(stderr, "  -2  4K aligned v2 image\n");
+  fprintf(stderr, "  -s  sparse image (data reads as zero until written)\n");
+  fprintf(stderr, "  -c  CP/M file system in the first slice holding the files given\n");
+  fprintf(stderr, "  -r  copy a raw file system image in at a sector of the data\n");
+  exit(1);
+}
+
+/* Host name to the 11 padded upper case characters CP/M wants */
+static int cpm_name(const char *path, uint8_t *fcb)
+{
+  const char *p = strrchr(path, '/');
+  unsigned int i = 0;
+
+  p = p ? p + 1 : path;
+  memset(fcb, ' ', 11);
+  while (*p && *p != '.' && i < 8)
+    fcb[i++] = *p++;
+  if (i == 0 || (*p && *p != '.'))
+    return -1;
+  if (*p == '.') {
+    p++;
+    for (i = 8; *p && i < 11; i++)
+      fcb[i] = *p++;
+    if (*p)
+      return -1;
+  }
+  for (i = 0; i < 11; i++) {
+    fcb[i] = toupper(fcb[i]);
+    if (fcb[i] <= ' ' && fcb[i] != ' ')
+      return -1;
+    if (strchr("<>.,;:=?*[]", fcb[i]))
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ *	Each directory entry covers two 16K logical extents. EX and S2 give
+ *	the last extent the entry holds and RC the records in it.
+ */
+static void cpm_add(const char *path, const uint8_t *data, size_t len)
+{
+  uint8_t fcb[11];
+  unsigned int need = (len + CPM_BLOCK - 1) / CPM_BLOCK;
+  unsigned int records = (len + 127) / 128;
+  unsigned int i, n, ext = 0;
+  uint8_t *d;
+
+  if (cpm_name(path, fcb)) {
+    fprintf(stderr, "%s: %s: no CP/M name for this, skipped.\n", name, path);
+    return;
+  }
+  for (i = 0; i < cpm_dirent; i++)
+    if (memcmp(cpm + 32 * i + 1, fcb, 11) == 0) {
+      fprintf(stderr, "%s: %s: already have %.8s.%.3s, skipped.\n", name,
+        path, fcb, fcb + 8);
+      return;
+    }
+  if (cpm_next + need > CPM_BLOCKS ||
+      cpm_dirent + (need + 7) / 8 + (need == 0) > CPM_DIRENT) {
+    fprintf(stderr, "%s: %s: disk full.\n", name, path);
+    exit(1);
+  }
+  memcpy(cpm + cpm_next * CPM_BLOCK, data, len);
+  do {
+    d = cpm + 32 * cpm_dirent++;
+    memset(d, 0, 32);
+    memcpy(d + 1, fcb, 11);
+    n = records > 256 ? 256 : records;
+    records -= n;
+    if (n) {
+      ext += (n - 1) / 128;
+      d[15] = n - 128 * ((n - 1) / 128);
+    }
+    d[12] = ext & 0x1F;
+    d[14] = ext >> 5;
+    for (i = 0; i < 8 && need; i++, need--) {
+      d[16 + 2 * i] = cpm_next;
+      d[17 + 2 * i] = cpm_next >> 8;
+      cpm_next++;
+    }
+    ext++;
+  } while (records);
+}
+
+static uint8_t *load(const char *path, int fd, size_t len)
 {
-  int t, fd;
-  if (argc != 3) {
-    fprintf(stderr, "%s [type] [path]\n", argv[0]);
+  uint8_t *buf = malloc(len + 1);
+  size_t done = 0;
+  ssize_t r;
+
+  if (buf == NULL) {
+    fprintf(stderr, "%s: out of memory.\n", name);
+    exit(1);
+  }
+  while (done < len) {
+    r = read(fd, buf + done, len - done);
+    if (r <= 0) {
+      if (r == 0)
+        fprintf(stderr, "%s: %s: short file.\n", name, path);
+      else
+        perror(path);
+      exit(1);
+    }
+    done += r;
+  }
+  return buf;
+}
+
+static void cpm_dir(const char *path)
+{
+  struct dirent **de;
+  struct stat st;
+  char *file;
+  uint8_t *data;
+  int n, i, fd;
+
+  n = scandir(path, &de, NULL, alphasort);
+  if (n == -1) {
+    perror(path);
     exit(1);
   }
-  t = atoi(argv[1]);
+  for (i = 0; i < n; i++) {
+    if (de[i]->d_name[0] == '.') {
+      free(de[i]);
+      continue;
+    }
+    file = malloc(strlen(path) + strlen(de[i]->d_name) + 2);
+    if (file == NULL) {
+      fprintf(stderr, "%s: out of memory.\n", name);
+      exit(1);
+    }
+    sprintf(file, "%s/%s", path, de[i]->d_name);
+    fd = open(file, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      perror(file);
+      exit(1);
+    }
+    if (S_ISREG(st.st_mode)) {
+      data = load(file, fd, st.st_size);
+      cpm_add(file, data, st.st_size);
+      free(data);
+    }
+    close(fd);
+    free(file);
+    free(de[i]);
+  }
+  free(de);
+}
+
+static unsigned long tar_octal(const uint8_t *p, unsigned int len)
+{
+  unsigned long v = 0;
+
+  while (len-- && *p == ' ')
+    p++;
+  while (len-- && *p >= '0' && *p <= '7')
+    v = (v << 3) | (*p++ - '0');
+  return v;
+}
+
+/* Plain files from a ustar or v7 tar, directories in it flattened */
+static void cpm_tar(const char *path, int fd)
+{
+  uint8_t hdr[512];
+  char file[101];
+  unsigned long len;
+  uint8_t *data;
+  ssize_t r;
+
+  for (;;) {
+    r = read(fd, hdr, 512);
+    if (r != 512) {
+      fprintf(stderr, "%s: %s: truncated tar file.\n", name, path);
+      exit(1);
+    }
+    if (hdr[0] == 0)
+      return;
+    memcpy(file, hdr, 100);
+    file[100] = 0;
+    len = tar_octal(hdr + 124, 12);
+    data = load(path, fd, (len + 511) & ~511UL);
+    if (hdr[156] == '0' || hdr[156] == 0)
+      cpm_add(file, data, len);
+    free(data);
+  }
+}
+
+/* Lay out the slice in memory and write it in one go */
+static void cpm_write(int fd, off_t base, const char *src)
+{
+  struct stat st;
+  int sfd;
+  size_t len = CPM_SLICE * 512;
+
+  cpm = malloc(len);
+  if (cpm == NULL) {
+    fprintf(stderr, "%s: out of memory.\n", name);
+    exit(1);
+  }
+  memset(cpm, 0xE5, len);
+  cpm += CPM_SYSTEM * 512;
+  if (stat(src, &st) == -1) {
+    perror(src);
+    exit(1);
+  }
+  if (S_ISDIR(st.st_mode))
+    cpm_dir(src);
+  else {
+    sfd = open(src, O_RDONLY);
+    if (sfd == -1) {
+      perror(src);
+      exit(1);
+    }
+    cpm_tar(src, sfd);
+    close(sfd);
+  }
+  cpm -= CPM_SYSTEM * 512;
+  if (pwrite(fd, cpm, len, base * 512) != (ssize_t)len) {
+    perror("write");
+    exit(1);
+  }
+  free(cpm);
+}
+
+/* A raw file system image, as FUZIX's mkfs and ucp make, a chunk at a time */
+static void raw_write(int fd, off_t base, uint32_t sectors, char *src)
+{
+  char *at = strrchr(src, '@');
+  unsigned long lba = 0;
+  static uint8_t buf[256 * 512];
+  struct stat st;
+  off_t pos;
+  ssize_t r;
+  int sfd;
+
+  if (at) {
+    *at++ = 0;
+    lba = strtoul(at, NULL, 0);
+  }
+  sfd = open(src, O_RDONLY);
+  if (sfd == -1 || fstat(sfd, &st) == -1) {
+    perror(src);
+    exit(1);
+  }
+  if (lba + (st.st_size + 511) / 512 > sectors) {
+    fprintf(stderr, "%s: %s: does not fit on the disk.\n", name, src);
+    exit(1);
+  }
+  pos = (base + lba) * 512;
+  while ((r = read(sfd, buf, sizeof(buf))) > 0) {
+    if (pwrite(fd, buf, r, pos) != r) {
+      perror("write");
+      exit(1);
+    }
+    pos += r;
+  }
+  if (r == -1) {
+    perror(src);
+    exit(1);
+  }
+  close(sfd);
+}
+
+int main(int argc, char *argv[])
+{
+  int t, fd, opt;
+  int version = IDE_IMAGE_V1;
+  int flags = 0;
+  const char *cpm_src = NULL;
+  char *raw_src = NULL;
+  uint16_t ident[256];
+  uint32_t sectors;
+  off_t base;
+
+  name = argv[0];
+  while ((opt = getopt(argc, argv, "2sc:r:")) != -1) {
+    switch(opt) {
+      case '2':
+        version = IDE_IMAGE_V2;
+        break;
+      case 's':
+        flags |= IDE_MAKE_SPARSE;
+        break;
+      case 'c':
+        cpm_src = optarg;
+        break;
+      case 'r':
+        raw_src = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind + 2 != argc)
+    usage();
+  t = atoi(argv[optind]);
   if (t < 1 || t > MAX_DRIVE_TYPE) {
     fprintf(stderr, "%s: unknown drive type.\n", argv[0]);
     exit(1);
   }
-  fd = open(argv[2], O_WRONLY|O_TRUNC|O_CREAT|O_EXCL, 0666);
+  fd = open(argv[optind + 1], O_RDWR|O_TRUNC|O_CREAT|O_EXCL, 0666);
   if (fd == -1) {
-    perror(argv[2]);
+    perror(argv[optind + 1]);
+    exit(1);
+  }
+  if (ide_make_image(t, fd, version, flags) < 0) {
+    perror(argv[optind + 1]);
     exit(1);
   }
-  if (ide_make_drive(t, fd) < 0) {
-    perror(argv[2]);
+  if (cpm_src == NULL && raw_src == NULL)
+    return 0;
+
+  if (pread(fd, ident, 512, 512) != 512) {
+    perror(argv[optind + 1]);
+    exit(1);
+  }
+  /* Capacity from identify words 57-58, little endian on disk */
+  sectors = ((uint8_t *)ident)[114] | (((uint8_t *)ident)[115] << 8) |
+    (((uint8_t *)ident)[116] << 16) | (((uint8_t *)ident)[117] << 24);
+  base = version == IDE_IMAGE_V2 ? IDE_V2_BASE : 2;
+  if (cpm_src) {
+    if (sectors < CPM_SLICE) {
+      fprintf(stderr, "%s: drive too small for a CP/M slice.\n", argv[0]);
+      exit(1);
+    }
+    cpm_write(fd, base, cpm_src);
+  }
+  if (raw_src)
+    raw_write(fd, base, sectors, raw_src);
+  if (close(fd)) {
+    perror(argv[optind + 1]);
     exit(1);
   }
   return 0;
@@ -29,14 +29,19 @@
 #include "system.h"
 #include "libz180/z180.h"
 #include "z180_io.h"
+#include "cpuclock.h"
+#include "z180run.h"
 
 #include "ide.h"
 #include "propio.h"
 #include "rtc_bitbang.h"
 #include "sdcard.h"
 #include "z80dis.h"
+#include "ramalloc.h"
+#include "trace.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Low 512K is ROM */
+#define RAMROM_SIZE	(1024 * 1024)
+static uint8_t *ramrom;		/* Low 512K is ROM */
 
 static uint8_t fast = 0;
 static uint8_t int_recalc = 0;
@@ -44,10 +49,11 @@ static struct sdcard *sdcard;
 static struct z180_io *io;
 static struct propio *prop;
 
-static uint16_t tstate_steps = 737;	/* 18.432MHz */
+static unsigned long cpu_hz = 18432000;
 
 /* IRQ source that is live in IM2 */
 static uint8_t live_irq;
+static struct z180run run;
 
 static Z180Context cpu_z180;
 
@@ -67,12 +73,12 @@ volatile int emulator_done;
 
 static int trace = 0;
 
-static void reti_event(void);
+static void reti_event(int unused);
 
 static uint8_t do_mem_read(uint16_t addr, int quiet)
 {
 	uint32_t pa = z180_mmu_translate(io, addr);
-	if (!quiet && (trace & TRACE_MEM))
+	if (!quiet && TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X[%06X] -> %02X\n", addr, pa, ramrom[pa]);
 	return ramrom[pa];
 }
@@ -81,12 +87,12 @@ void mem_write(int unused, uint16_t addr, uint8_t val)
 {
 	uint32_t pa = z180_mmu_translate(io, addr);
 	if (pa < 0x80000) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04X[%06X] *ROM*\n",
 				addr, pa);
 		return;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %04X[%06X] <- %02X\n", addr, pa, val);
 	ramrom[pa] = val;
 }
@@ -105,26 +111,7 @@ void z180_phys_write(int unused, uint32_t addr, uint8_t val)
 
 uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate = 0;
-	uint8_t r = do_mem_read(addr, 0);
-
-	if (cpu_z180.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r == 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1)
-		reti_event();
-	rstate = 0;
-	return r;
+	return do_mem_read(addr, 0);
 }
 
 static unsigned int nbytes;
@@ -147,7 +134,7 @@ static void markiv_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -216,14 +203,14 @@ struct ide_controller *ide0;
 static uint8_t my_ide_read(uint16_t addr)
 {
 	uint8_t r =  ide_read8(ide0, addr);
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide read %d = %02X\n", addr, r);
 	return r;
 }
 
 static void my_ide_write(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide write %d = %02X\n", addr, val);
 	ide_write8(ide0, addr, val);
 }
@@ -242,7 +229,7 @@ uint8_t z180_csio_write(struct z180_io *io, uint8_t bits)
 		return 0xFF;
 
 	r = bitrev[sd_spi_in(sdcard, bitrev[bits])];
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 		fprintf(stderr,	"[SPI %02X:%02X]\n", bitrev[bits], bitrev[r]);
 	return r;
 }
@@ -260,7 +247,7 @@ static void sd_write(uint8_t val)
 	static uint8_t sysio = 0xFF;
 	uint8_t delta = val ^ sysio;
 	if (sdcard && (delta & (1 << 2))) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "[SPI CS %sed]\n",
 				(val & (1 << 2)) ? "lower" : "rais");
 		if (val & (1 << 2))
@@ -297,7 +284,7 @@ static void xar_write(uint8_t v)
 
 uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if (z180_iospace(io, addr))
 		return z180_read(io, addr);
@@ -313,7 +300,7 @@ uint8_t io_read(int unused, uint16_t addr)
 		return rtc_read(rtc);
 	if (addr >= 0xA8 && addr <= 0xAB && prop)
 		return propio_read(prop, addr);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
@@ -322,11 +309,12 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 {
 	unsigned int known = 0;
 
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 
 	if (z180_iospace(io, addr)) {
 		z180_write(io, addr, val);
+		run.dma_live = z180_dma_live(io);
 		known = 1;
 	}
 	addr &= 0xFF;
@@ -348,13 +336,13 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 		trace &= 0xFF;
 		trace |= val << 8;
 		printf("trace set to %d\n", trace);
-	} else if (!known && (trace & TRACE_UNK))
+	} else if (!known && TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
-static void reti_event(void)
+static void reti_event(int unused)
 {
-	if (live_irq && (trace & TRACE_IRQ))
+	if (live_irq && TRACE_ON(trace & TRACE_IRQ))
 		fprintf(stderr, "RETI\n");
 	live_irq = 0;
 }
@@ -374,13 +362,29 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "markiv: [-f] [-i idepath] [-p proppath] [-r rompath] [-S sdpath] [-d debug]\n");
+	fprintf(stderr, "markiv: [-f] [-X MHz] [-i idepath] [-p proppath] [-r rompath] [-S sdpath] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
+/* Every frame (20ms) */
+static void markiv_frame(void)
+{
+	if (int_recalc) {
+		/* If there is no pending Z180 vector IRQ but we think
+		   there now might be one we use the same logic as for
+		   reti */
+//		if (!live_irq)
+//			poll_irq_event();
+		/* Clear this after because reti_event may set the
+		   flags to indicate there is more happening. We will
+		   pick up the next state changes on the reti if so */
+		if (!(cpu_z180.IFF1|cpu_z180.IFF2))
+			int_recalc = 0;
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
 	int opt;
 	int fd;
 	char *rompath = "markiv.rom";
@@ -388,11 +392,7 @@ int main(int argc, char *argv[])
 	char *idepath = NULL;
 	char *proppath = NULL;
 
-	uint8_t *p = ramrom;
-	while (p < ramrom + sizeof(ramrom))
-		*p++= rand();
-
-	while ((opt = getopt(argc, argv, "r:S:i:d:fp:")) != -1) {
+	while ((opt = getopt(argc, argv, "r:S:i:d:fp:X:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -410,6 +410,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 		case 'p':
 			proppath = optarg;
 			break;
@@ -420,12 +423,16 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	/* The ROM half is filled from the image */
+	ramrom = ram_alloc(RAMROM_SIZE);
+	ram_scramble(ramrom + 524288, RAMROM_SIZE - 524288);
+
 	fd = open(rompath, O_RDONLY);
 	if (fd == -1) {
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom, 524288) != 524288) {
+	if (ram_load(fd, ramrom, 524288) != 524288) {
 		fprintf(stderr, "markiv: ROM image should be 512K.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -455,27 +462,22 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
 
 	if (proppath) {
 		prop = propio_create(proppath);
 		propio_set_input(prop, 0);
-		propio_trace(prop, trace & TRACE_PROP);
+		propio_trace(prop, TRACE_ON(trace & TRACE_PROP));
 	}
 
 	io = z180_create(&cpu_z180);
 	z180_set_input(io, 0, 1);
-	z180_trace(io, trace & TRACE_CPU_IO);
+	z180_trace(io, TRACE_ON(trace & TRACE_CPU_IO));
 
 	rtc = rtc_create();
-	rtc_trace(rtc, trace & TRACE_RTC);
-
-	/* 20ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 20000000L;
+	rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
@@ -497,49 +499,18 @@ int main(int argc, char *argv[])
 	cpu_z180.ioWrite = io_write;
 	cpu_z180.memRead = mem_read;
 	cpu_z180.memWrite = mem_write;
+	cpu_z180.reti = reti_event;
 	cpu_z180.trace = markiv_trace;
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!emulator_done) {
-		int states = 0;
-		unsigned int i, j;
-		/* We have to run the DMA engine and Z180 in step per
-		   instruction otherwise we will mess up on stalling DMA */
-
-		/* Do an emulated 20ms of work (368640 clocks) */
-		for (i = 0; i < 50; i++) {
-			for (j = 0; j < 10; j++) {
-				while (states < tstate_steps) {
-					unsigned int used;
-					used = z180_dma(io);
-					if (used == 0)
-						used = Z180Execute(&cpu_z180);
-					states += used;
-				}
-				z180_event(io, states);
-				states -= tstate_steps;
-			}
-		}
-
-		/* Do 20ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
-		if (int_recalc) {
-			/* If there is no pending Z180 vector IRQ but we think
-			   there now might be one we use the same logic as for
-			   reti */
-//			if (!live_irq)
-//				poll_irq_event();
-			/* Clear this after because reti_event may set the
-			   flags to indicate there is more happening. We will
-			   pick up the next state changes on the reti if so */
-			if (!(cpu_z180.IFF1|cpu_z180.IFF2))
-				int_recalc = 0;
-		}
-	}
+	run.cpu = &cpu_z180;
+	run.io = io;
+	run.hz = cpu_hz;
+	run.rate = 25000;
+	run.steps = 10;
+	run.ticks = 50;
+	run.frame = markiv_frame;
+	run.fast = fast;
+	run.done = &emulator_done;
+	z180run_loop(&run);
 	exit(0);
 }
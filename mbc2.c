@@ -10,6 +10,11 @@
  *
  *	We only emulate the Z80 side, the IOS side is faked directly by
  *	emulation
+ *
+ *	As an emulator extension the IOS also does multi-sector transfers.
+ *	Write opcode 0x70 takes a count of 1-32 sectors, then write opcode
+ *	0x71 or read opcode 0xF0 moves that many sectors from the current
+ *	track and sector and leaves them pointing after the run.
  */
 
 #include <stdio.h>
@@ -23,6 +28,12 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include "libz80/z80.h"
+#include "blkcache.h"
+#include "console.h"
+#include "cow.h"
+#include "trace.h"
+#include "cpuclock.h"
+#include "z80run.h"
 
 static uint8_t ram[131072];
 
@@ -35,11 +46,13 @@ static uint16_t ios_track;
 static uint8_t ios_sector;
 static uint8_t ios_error;
 static uint8_t ios_sysflag = 2;	/* RTC */
-static int ios_fd;
+static int ios_fd = -1;
 static uint8_t ios_cmd;
 static int ios_dptr;
 static int ios_data;
-static uint8_t ios_buf[512];
+static uint8_t ios_count = 1;	/* Sectors per multi-sector command */
+#define IOS_MAXSEC	32
+static uint8_t ios_buf[512 * IOS_MAXSEC];
 static uint8_t ios_timer_expired;
 
 static Z80Context cpu_z80;
@@ -68,15 +81,15 @@ static uint8_t mem_read(int unused, uint16_t addr)
 {
 	uint8_t r;
 	unsigned int va = addr;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X <- ", addr);
 	if (va < 0x8000)
 		va += 0x8000 * bank;
 	/* 8000-FFFF map 1:1 */
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "@%05X ", va);
 	r = ram[va];	
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%02X\n", r);
 	return r;
 }
@@ -84,47 +97,24 @@ static uint8_t mem_read(int unused, uint16_t addr)
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
 	unsigned int va = addr;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04X ", addr);
 	if (va < 0x8000)
 		va += 0x8000 * bank;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "@%05X -> %02X\n", va, val);
 	/* 8000-FFFF map 1:1 */
 	ram[va] = val;
 }
 
-static int check_chario(void)
+static unsigned int check_chario(void)
 {
-	fd_set i, o;
-	struct timeval tv;
-	unsigned int r = 0;
-
-	FD_ZERO(&i);
-	FD_SET(0, &i);
-	FD_ZERO(&o);
-	FD_SET(1, &o);
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-
-	if (select(2, &i, NULL, NULL, &tv) == -1) {
-		perror("select");
-		exit(1);
-	}
-	if (FD_ISSET(0, &i))
-		r |= 1;
-	if (FD_ISSET(1, &o))
-		r |= 2;
-	return r;
+	return console_status();
 }
 
 static unsigned int next_char(void)
 {
-	char c;
-	if (read(0, &c, 1) != 1) {
-		printf("(tty read without ready byte)\n");
-		return 0xFF;
-	}
+	unsigned int c = console_getc();
 	if (c == 0x0A)
 		c = '\r';
 	return c;
@@ -166,59 +156,68 @@ static void ios_open(void)
 {
 	char buf[32];
 
-	if (trace & TRACE_DISK)
+	if (TRACE_ON(trace & TRACE_DISK))
 		fprintf(stderr, "IOS: Open disk %d.\n", ios_disk);
 	if (ios_disk > 99) {
 		ios_error = 16;
 		return;
 	}
 	snprintf(buf, 32, "DS%dN%02d.DSK", diskset, ios_disk);
-	if (ios_fd)
-		close(ios_fd);
-	ios_fd = open(buf, O_RDWR);
+	if (ios_fd != -1)
+		blkcache_close(ios_fd);
+	ios_fd = cow_open(buf, O_RDWR);
 	if (ios_fd == -1)
 		ios_error = 3;
-	if (trace & TRACE_DISK)
+	if (TRACE_ON(trace & TRACE_DISK))
 		fprintf(stderr, "IOS: Open %d result %d.\n", ios_disk, ios_fd);
 }
 
-static int ios_seek(void)
+/* Byte offset of the current track and sector or -1 */
+static off_t ios_seek(void)
 {
-	off_t offset;
-
-	if (trace & TRACE_DISK)
+	if (TRACE_ON(trace & TRACE_DISK))
 		fprintf(stderr, "IOS: Seek %d %d %d.\n", ios_fd, ios_track, ios_sector);
 
 	if (ios_fd == -1 || ios_sector > 31 || ios_track > 511) {
 		ios_error = 18;
 		return -1;
 	}
-	offset = (ios_track * 32 + ios_sector) * 512;
-	if (lseek(ios_fd, offset, SEEK_SET) == -1) {
-		ios_error =  19;
-		return -1;
-	}
-	return 0;
+	return (ios_track * 32 + ios_sector) * 512;
+}
+
+/* Step on past a multi-sector run. Running off the last track leaves it
+   out of range so the next access fails */
+static void ios_advance(unsigned int n)
+{
+	unsigned int s = ios_track * 32 + ios_sector + n;
+	ios_track = s / 32;
+	ios_sector = s % 32;
 }
 
-static void ios_read_sector(void)
+static void ios_read_sector(unsigned int n)
 {
-	if(ios_seek())
+	off_t offset = ios_seek();
+	if (offset == -1)
 		return;
-	if (trace & TRACE_DISK)
-		fprintf(stderr, "IOS: Read.\n");
-	if (read(ios_fd, ios_buf, 512) != 512)
-		ios_error = 19; 
+	if (TRACE_ON(trace & TRACE_DISK))
+		fprintf(stderr, "IOS: Read %d.\n", n);
+	if (ios_track * 32 + ios_sector + n > 512 * 32)
+		ios_error = 18;
+	else if (blkcache_pread(ios_fd, ios_buf, 512 * n, offset) != 512 * n)
+		ios_error = 19;
 }
 
-static void ios_write_sector(void)
+static void ios_write_sector(unsigned int n)
 {
-	if(ios_seek())
+	off_t offset = ios_seek();
+	if (offset == -1)
 		return;
-	if (trace & TRACE_DISK)
-		fprintf(stderr, "IOS: Write.\n");
-	if (write(ios_fd, ios_buf, 512) != 512)
-		ios_error = 19; 
+	if (TRACE_ON(trace & TRACE_DISK))
+		fprintf(stderr, "IOS: Write %d.\n", n);
+	if (ios_track * 32 + ios_sector + n > 512 * 32)
+		ios_error = 18;
+	else if (blkcache_pwrite(ios_fd, ios_buf, 512 * n, offset) != 512 * n)
+		ios_error = 19;
 }
 
 static void ios_op(uint8_t val)
@@ -229,8 +228,15 @@ static void ios_op(uint8_t val)
 	if (val == 0xFF)
 		return;
 	ios_data = 1;
-	if (trace & TRACE_IOS)
+	if (TRACE_ON(trace & TRACE_IOS))
 		fprintf(stderr, "IOS_cmd %02X\n", ios_cmd);
+	/* Multi-sector read */
+	if (val == 0xF0) {
+		ios_data = 512 * ios_count;
+		ios_read_sector(ios_count);
+		ios_advance(ios_count);
+		return;
+	}
 	if (val & 0x80) {
 		if (val > 0x89) {
 			ios_cmd = 0xFF;
@@ -257,13 +263,13 @@ static void ios_op(uint8_t val)
 			break;
 		case 0x85:
 			ios_buf[0] = ios_error;
-			if (trace & TRACE_IOS)
+			if (TRACE_ON(trace & TRACE_IOS))
 				fprintf(stderr, "ios_error was %02X\n", ios_error);
 			ios_error = 0;
 			break;
 		case 0x86:
 			ios_data = 512;
-			ios_read_sector();
+			ios_read_sector(1);
 			break;
 		case 0x87:
 			/* FIXME?? */
@@ -277,7 +283,9 @@ static void ios_op(uint8_t val)
 			ios_timer_expired = 0;
 			break;
 		}
-	} else {
+	} else if (val == 0x71) {
+		ios_data = 512 * ios_count;
+	} else if (val != 0x70) {
 		if (val == 2 || val > 0x0D) {
 			fprintf(stderr, "Unemulated command %02X\n", val);
 			ios_cmd = 0xFF;
@@ -308,15 +316,14 @@ static void ios_tx(uint8_t val)
 		return;
 	if (ios_dptr >= ios_data)
 		return;
-	if (trace & TRACE_IOS)
+	if (TRACE_ON(trace & TRACE_IOS))
 		fprintf(stderr, "[T%02X]", val);
 	ios_buf[ios_dptr++] = val;
 	if (ios_dptr != ios_data)
 		return;
 	switch(ios_cmd) {
 	case 0x01:
-		putchar(ios_buf[0]);
-		fflush(stdout);
+		console_putc(ios_buf[0]);
 		break;
 	case 0x09:
 		ios_disk = ios_buf[0];
@@ -324,56 +331,67 @@ static void ios_tx(uint8_t val)
 		break;
 	case 0x0A:
 		ios_track = ios_buf[0] + (((uint16_t)ios_buf[1]) << 8);
-                if (trace & TRACE_DISK)
+                if (TRACE_ON(trace & TRACE_DISK))
 			fprintf(stderr, "Track now %d.\n", ios_track);
 		break;
 	case 0x0B:
 		ios_sector = ios_buf[0];
-                if (trace & TRACE_DISK)
+                if (TRACE_ON(trace & TRACE_DISK))
 			fprintf(stderr, "Sector now %d.\n", ios_sector);
 		break;
 	case 0x0C:
-		ios_write_sector();
+		ios_write_sector(1);
 		break;
 	case 0x0D:
 		if (ios_buf[0] < 3) {
 			bank = ios_buf[0];
 			/* 0 1 2 map to 0 2 3 */
-	                if (trace & TRACE_BANK)
+	                if (TRACE_ON(trace & TRACE_BANK))
 				fprintf(stderr, "Bank set to %d: physical ", bank);
 			if (bank)
 				bank++;
-	                if (trace & TRACE_BANK)
+	                if (TRACE_ON(trace & TRACE_BANK))
 				fprintf(stderr, "%d.\n", bank);
 		}
 		break;
+	case 0x70:
+		ios_count = ios_buf[0];
+		if (ios_count == 0 || ios_count > IOS_MAXSEC) {
+			ios_count = 1;
+			ios_error = 18;
+		}
+		break;
+	case 0x71:
+		ios_write_sector(ios_count);
+		ios_advance(ios_count);
+		break;
 	}
 }
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr == 0)
 		return ios_rx();
 	if (addr == 1)
 		return ios_rx_char();
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr == 0)
 		ios_tx(val);
 	else if (addr == 1)
 		ios_op(val);
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr,
 			"Unknown write to port %04X of %02X\n", addr, val);
 }
@@ -393,21 +411,36 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "mbc2: [-f] [-i] [-s diskset] [-d debug] [-b image] [-a addr]\n");
+	fprintf(stderr, "mbc2: [-f] [-X MHz] [-i] [-s diskset] [-d debug] [-b image] [-a addr] [-K blocks]\n");
 	exit(EXIT_FAILURE);
 }
 
+static void mbc2_tick(void)
+{
+	console_tick();
+	if (int_on && (check_chario() & 1))
+		Z80INT(&cpu_z80, 0xFF);
+}
+
+static void mbc2_frame(void)
+{
+	ios_timer_expired = 1;
+	if (int_on)
+		Z80INT(&cpu_z80, 0xFF);
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
+	static struct z80run run;
 	int opt;
 	int fd;
 	int l;
-	int fast;
+	int fast = 0;
+	unsigned int cache_blocks = 1024;
 	char *image = "fuzix.bin";
 	uint16_t addr = 0x0000;
 
-	while ((opt = getopt(argc, argv, "d:s:ib:a:f")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:ib:a:fK:X:")) != -1) {
 		switch (opt) {
 		case 's':
 			diskset = atoi(optarg);
@@ -426,9 +459,15 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			run.hz = cpuclock_parse(optarg);
+			break;
 		case 'a':
 			addr = atoi(optarg);
 			break;
+		case 'K':
+			cache_blocks = atoi(optarg);
+			break;
 		default:
 			usage();
 		}
@@ -454,10 +493,10 @@ int main(int argc, char *argv[])
 	}
 	printf("Loaded %d bytes at %04X.\n", l, addr);
 
-	/* 5ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 5000000L;
+	/* Cached writes reach the disk at exit, which cleanup() gives us */
+	blkcache_init(cache_blocks);
+	signal(SIGINT, cleanup);
+	signal(SIGTERM, cleanup);
 
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
@@ -473,6 +512,7 @@ int main(int argc, char *argv[])
 		term.c_cc[VSTOP] = 0;
 		tcsetattr(0, TCSADRAIN, &term);
 	}
+	console_init();
 
 	Z80RESET(&cpu_z80);
 	cpu_z80.ioRead = io_read;
@@ -480,28 +520,16 @@ int main(int argc, char *argv[])
 	cpu_z80.memRead = mem_read;
 	cpu_z80.memWrite = mem_write;
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!done) {
-		int l;
-		for (l = 0; l < 10; l++) {
-			int i;
-			/* 40000 T states */
-			for (i = 0; i < 100; i++) {
-				Z80ExecuteTStates(&cpu_z80, 400);
-			}
-			if (int_on && (check_chario() & 1))
-				Z80INT(&cpu_z80, 0xFF);
-			/* Do 5ms of I/O and delays */
-			if (!fast)
-				nanosleep(&tc, NULL);
-		}
-		ios_timer_expired = 1;
-		if (int_on)
-			Z80INT(&cpu_z80, 0xFF);
-	}
+	run.cpu = &cpu_z80;
+	if (run.hz == 0)
+		run.hz = 8000000;
+	run.rate = 20000;
+	run.steps = 100;
+	run.ticks = 10;
+	run.tick = mbc2_tick;
+	run.frame = mbc2_frame;
+	run.fast = fast;
+	run.done = &done;
+	z80run_loop(&run);
 	exit(0);
 }
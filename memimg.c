@@ -0,0 +1,185 @@
+/*
+ *	Memory images with a write back policy
+ *
+ *	Touched pages are kept in a bitmap so a flush only writes what the
+ *	guest changed. A shared mapping is written back with msync, a
+ *	private copy with cow_pwrite so an overlay gets just the changes.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cow.h"
+#include "memimg.h"
+
+struct memimg {
+	int fd;
+	int policy;
+	int mapped;		/* Shared mapping rather than a private copy */
+	uint8_t *base;
+	uint32_t size;
+	unsigned int shift;	/* Page size as a power of two */
+	uint8_t *dirty;		/* One byte per page */
+	unsigned int pages;
+	unsigned int ndirty;
+	time_t last;		/* Last periodic flush */
+};
+
+int memimg_policy(const char *name)
+{
+	if (strcmp(name, "kernel") == 0)
+		return MEMIMG_KERNEL;
+	if (strcmp(name, "sync") == 0)
+		return MEMIMG_SYNC;
+	if (strcmp(name, "exit") == 0)
+		return MEMIMG_EXIT;
+	return -1;
+}
+
+struct memimg *memimg_open(const char *spec, int policy)
+{
+	struct memimg *m = calloc(1, sizeof(struct memimg));
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t size;
+
+	if (m == NULL) {
+		fprintf(stderr, "memimg: out of memory.\n");
+		exit(1);
+	}
+	m->fd = cow_open(spec, O_RDWR);
+	if (m->fd == -1) {
+		perror(spec);
+		free(m);
+		return NULL;
+	}
+	size = cow_size(m->fd);
+	if (size <= 0 || size > 0xFFFFFFFFUL) {
+		fprintf(stderr, "memimg: unusable image size for '%s'.\n", spec);
+		cow_close(m->fd);
+		free(m);
+		return NULL;
+	}
+	m->size = size;
+	m->policy = policy;
+	while ((1L << m->shift) < pagesize)
+		m->shift++;
+	m->pages = (m->size + (1UL << m->shift) - 1) >> m->shift;
+	m->dirty = calloc(m->pages, 1);
+	if (m->dirty == NULL) {
+		fprintf(stderr, "memimg: out of memory.\n");
+		exit(1);
+	}
+
+	if (policy != MEMIMG_EXIT && !cow_overlay(m->fd)) {
+		m->base = mmap(0, m->size, PROT_READ|PROT_WRITE, MAP_SHARED, m->fd, 0);
+		if (m->base == MAP_FAILED) {
+			fprintf(stderr, "memimg: unable to map '%s'.\n", spec);
+			cow_close(m->fd);
+			free(m->dirty);
+			free(m);
+			return NULL;
+		}
+		m->mapped = 1;
+	} else {
+		/* An overlay has no mapping for the kernel to write back */
+		if (m->policy == MEMIMG_KERNEL)
+			m->policy = MEMIMG_EXIT;
+		m->base = malloc(m->size);
+		if (m->base == NULL) {
+			fprintf(stderr, "memimg: out of memory.\n");
+			exit(1);
+		}
+		if (cow_pread(m->fd, m->base, m->size, 0) != m->size) {
+			fprintf(stderr, "memimg: unable to read '%s'.\n", spec);
+			cow_close(m->fd);
+			free(m->base);
+			free(m->dirty);
+			free(m);
+			return NULL;
+		}
+	}
+	m->last = time(NULL);
+	return m;
+}
+
+uint8_t *memimg_base(struct memimg *m)
+{
+	return m->base;
+}
+
+uint32_t memimg_size(struct memimg *m)
+{
+	return m->size;
+}
+
+void memimg_touch(struct memimg *m, uint32_t off)
+{
+	uint8_t *d = m->dirty + (off >> m->shift);
+	if (*d == 0) {
+		*d = 1;
+		m->ndirty++;
+	}
+}
+
+/* Write back each run of touched pages with one call */
+int memimg_flush(struct memimg *m)
+{
+	unsigned int i = 0, n;
+	size_t off, len;
+	int err = 0;
+
+	while (m->ndirty && i < m->pages) {
+		if (!m->dirty[i]) {
+			i++;
+			continue;
+		}
+		for (n = i; n < m->pages && m->dirty[n]; n++)
+			m->dirty[n] = 0;
+		m->ndirty -= n - i;
+		off = (size_t)i << m->shift;
+		len = ((size_t)n << m->shift) - off;
+		if (off + len > m->size)
+			len = m->size - off;
+		if (m->mapped) {
+			if (msync(m->base + off, len, MS_SYNC) == -1)
+				err = -1;
+		} else if (cow_pwrite(m->fd, m->base + off, len, off) != len)
+			err = -1;
+		i = n;
+	}
+	if (err)
+		fprintf(stderr, "memimg: write back failed.\n");
+	return err;
+}
+
+/* Called regularly by the board. Only the sync policy does anything */
+void memimg_tick(struct memimg *m)
+{
+	time_t now;
+
+	if (m->policy != MEMIMG_SYNC || m->ndirty == 0)
+		return;
+	now = time(NULL);
+	if (now != m->last) {
+		m->last = now;
+		memimg_flush(m);
+	}
+}
+
+void memimg_close(struct memimg *m)
+{
+	if (m->policy != MEMIMG_KERNEL)
+		memimg_flush(m);
+	if (m->mapped)
+		munmap(m->base, m->size);
+	else
+		free(m->base);
+	cow_close(m->fd);
+	free(m->dirty);
+	free(m);
+}
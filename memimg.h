@@ -0,0 +1,28 @@
+#ifndef __MEMIMG_H
+#define __MEMIMG_H
+
+#include <stdint.h>
+
+/*
+ *	A file image the guest addresses as memory, such as a battery backed
+ *	card. The board marks what it writes with memimg_touch() and the
+ *	policy decides when the touched pages go back to the file. Overlay
+ *	specs (base:delta) always keep a private copy and write the delta.
+ */
+
+#define MEMIMG_KERNEL	0	/* Shared mapping, the kernel writes back */
+#define MEMIMG_SYNC	1	/* Touched pages written back every second */
+#define MEMIMG_EXIT	2	/* Private copy written back on close */
+
+struct memimg;
+
+extern int memimg_policy(const char *name);
+extern struct memimg *memimg_open(const char *spec, int policy);
+extern uint8_t *memimg_base(struct memimg *m);
+extern uint32_t memimg_size(struct memimg *m);
+extern void memimg_touch(struct memimg *m, uint32_t off);
+extern int memimg_flush(struct memimg *m);
+extern void memimg_tick(struct memimg *m);
+extern void memimg_close(struct memimg *m);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ *	Performance counters and speed control over a socket
+ *
+ *	Connections are accepted and read from with a zero timeout poll()
+ *	once a frame. When a client's request line is complete the report
+ *	is built in memory and written in one go, which a socket buffer
+ *	always has room for, and the connection closed. Rates are worked
+ *	out over the time since the last report so a scrape every few
+ *	seconds shows whether the board is keeping up right now. A speed
+ *	request is handed to the board instead and answered with "ok".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+
+#define METRICS_CLIENTS	4
+#define METRICS_REQ	256
+
+struct client {
+	int fd;
+	unsigned int len;
+	char req[METRICS_REQ];
+};
+
+static int listen_fd = -1;
+static const char *prefix;
+static void (*report)(FILE *fp);
+static void (*speed)(int speed);
+static struct client clients[METRICS_CLIENTS];
+
+/* Where the last report left off, for the rates */
+static struct timespec start;
+static double last_wall;
+static double last_cpu;
+static uint64_t last_cycles;
+
+static void metrics_nonblock(int fd)
+{
+	int f = fcntl(fd, F_GETFL);
+	if (f == -1 || fcntl(fd, F_SETFL, f | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+}
+
+static void metrics_bind(int domain, struct sockaddr *sa, socklen_t len,
+			 const char *spec)
+{
+	int one = 1;
+
+	listen_fd = socket(domain, SOCK_STREAM, 0);
+	if (listen_fd == -1) {
+		perror("socket");
+		exit(1);
+	}
+	if (domain == AF_INET)
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(listen_fd, sa, len) == -1 || listen(listen_fd, METRICS_CLIENTS) == -1) {
+		perror(spec);
+		exit(1);
+	}
+	metrics_nonblock(listen_fd);
+	fprintf(stderr, "[metrics on %s]\n", spec);
+}
+
+static void metrics_tcp(const char *spec)
+{
+	struct sockaddr_in sin;
+	const char *p = strrchr(spec, ':');
+	char addr[64];
+	char *end;
+	long port;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (p) {
+		if (p - spec >= (int)sizeof(addr)) {
+			fprintf(stderr, "tcp:%s: bad address.\n", spec);
+			exit(1);
+		}
+		memcpy(addr, spec, p - spec);
+		addr[p - spec] = 0;
+		if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+			fprintf(stderr, "tcp:%s: bad address.\n", spec);
+			exit(1);
+		}
+		p++;
+	} else
+		p = spec;
+	port = strtol(p, &end, 10);
+	if (*p == 0 || *end || port < 1 || port > 65535) {
+		fprintf(stderr, "tcp:%s: bad port.\n", spec);
+		exit(1);
+	}
+	sin.sin_port = htons(port);
+	metrics_bind(AF_INET, (struct sockaddr *)&sin, sizeof(sin), spec);
+}
+
+static void metrics_unix(const char *path)
+{
+	struct sockaddr_un sun;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long.\n", path);
+		exit(1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	metrics_bind(AF_UNIX, (struct sockaddr *)&sun, sizeof(sun), path);
+}
+
+void metrics_listen(const char *spec, const char *name, void (*fn)(FILE *fp),
+		    void (*speed_fn)(int speed))
+{
+	unsigned int i;
+
+	if (strncmp(spec, "tcp:", 4) == 0)
+		metrics_tcp(spec + 4);
+	else if (strncmp(spec, "unix:", 5) == 0)
+		metrics_unix(spec + 5);
+	else {
+		fprintf(stderr, "%s: metrics want tcp:[addr:]port or unix:path.\n", spec);
+		exit(1);
+	}
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		clients[i].fd = -1;
+	prefix = name;
+	report = fn;
+	speed = speed_fn;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+static double metrics_wall(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static double metrics_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void metrics_head(FILE *fp, const char *name, const char *help,
+			 const char *type)
+{
+	fprintf(fp, "# HELP %s_%s %s\n# TYPE %s_%s %s\n",
+		prefix, name, help, prefix, name, type);
+}
+
+void metrics_counter(FILE *fp, const char *name, const char *help,
+		     unsigned long long value)
+{
+	metrics_head(fp, name, help, "counter");
+	fprintf(fp, "%s_%s %llu\n", prefix, name, value);
+}
+
+static void metrics_value(FILE *fp, const char *name, const char *help,
+			  const char *type, double value)
+{
+	metrics_head(fp, name, help, type);
+	fprintf(fp, "%s_%s %.9g\n", prefix, name, value);
+}
+
+/* The main loop figures and the rates since the last report */
+void metrics_clock(FILE *fp, const struct metrics_clock *c)
+{
+	double wall = metrics_wall();
+	double cpu = metrics_cpu();
+	double dwall = wall - last_wall;
+	double emulated = c->hz ? (double)(c->cycles - last_cycles) / c->hz : 0;
+
+	metrics_counter(fp, "cycles_total", "Emulated clocks run", c->cycles);
+	metrics_value(fp, "target_hz", "Clock the board is meant to run at",
+		"gauge", c->hz);
+	metrics_value(fp, "achieved_hz", "Emulated clock rate since the last report",
+		"gauge", dwall > 0 ? (c->cycles - last_cycles) / dwall : 0);
+	metrics_value(fp, "host_cpu_per_emulated_second",
+		"Host CPU seconds per emulated second since the last report",
+		"gauge", emulated > 0 ? (cpu - last_cpu) / emulated : 0);
+	metrics_value(fp, "host_seconds_total", "Host time since start",
+		"counter", wall);
+	metrics_value(fp, "host_cpu_seconds_total", "Host CPU time used",
+		"counter", cpu);
+	metrics_value(fp, "sleep_seconds_total", "Host time spent waiting for real time",
+		"counter", c->sleep_ns / 1e9);
+	metrics_counter(fp, "resyncs_total", "Times the board fell too far behind to catch up",
+		c->resyncs);
+	metrics_counter(fp, "irqs_total", "Interrupts taken", c->irqs);
+	last_wall = wall;
+	last_cpu = cpu;
+	last_cycles = c->cycles;
+}
+
+/* "speed" and a multiple of real time, max, auto or pause. -3 if it isn't */
+static int metrics_speed(const char *req)
+{
+	char *end;
+	long n;
+
+	if (strncmp(req, "speed ", 6))
+		return -3;
+	req += 6;
+	if (strncmp(req, "max", 3) == 0)
+		return METRICS_SPEED_MAX;
+	if (strncmp(req, "auto", 4) == 0)
+		return METRICS_SPEED_AUTO;
+	if (strncmp(req, "pause", 5) == 0)
+		return METRICS_SPEED_PAUSE;
+	n = strtol(req, &end, 10);
+	if (end == req || n < 1 || n > 1000)
+		return -3;
+	return n;
+}
+
+static void metrics_reply(struct client *cl)
+{
+	char *body = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int n = metrics_speed(cl->req);
+
+	if (speed && n != -3) {
+		speed(n);
+		if (write(cl->fd, "ok\n", 3) != 3)
+			fprintf(stderr, "metrics: short write.\n");
+		return;
+	}
+	fp = open_memstream(&body, &len);
+	if (fp == NULL)
+		return;
+	if (strncmp(cl->req, "GET ", 4) == 0)
+		fprintf(fp, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n\r\n");
+	report(fp);
+	fclose(fp);
+	if (write(cl->fd, body, len) != (ssize_t)len)
+		fprintf(stderr, "metrics: short write.\n");
+	free(body);
+}
+
+static void metrics_accept(void)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		if (clients[i].fd == -1)
+			break;
+	if (i == METRICS_CLIENTS)
+		return;
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1)
+		return;
+	metrics_nonblock(fd);
+	clients[i].fd = fd;
+	clients[i].len = 0;
+}
+
+/* Take what has arrived and answer once there is a whole line */
+static void metrics_read(struct client *cl)
+{
+	ssize_t n = read(cl->fd, cl->req + cl->len, METRICS_REQ - 1 - cl->len);
+
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0) {
+		cl->len += n;
+		cl->req[cl->len] = 0;
+		if (!strchr(cl->req, '\n') && cl->len < METRICS_REQ - 1)
+			return;
+		metrics_reply(cl);
+	}
+	close(cl->fd);
+	cl->fd = -1;
+}
+
+/* Stop serving, as a forked child does so the parent's socket isn't shared */
+void metrics_close(void)
+{
+	unsigned int i;
+
+	if (listen_fd == -1)
+		return;
+	close(listen_fd);
+	listen_fd = -1;
+	for (i = 0; i < METRICS_CLIENTS; i++) {
+		if (clients[i].fd != -1)
+			close(clients[i].fd);
+		clients[i].fd = -1;
+	}
+}
+
+void metrics_poll(void)
+{
+	struct pollfd pfd[1 + METRICS_CLIENTS];
+	unsigned int i;
+
+	if (listen_fd == -1)
+		return;
+	pfd[0].fd = listen_fd;
+	pfd[0].events = POLLIN;
+	for (i = 0; i < METRICS_CLIENTS; i++) {
+		pfd[i + 1].fd = clients[i].fd;
+		pfd[i + 1].events = POLLIN;
+	}
+	if (poll(pfd, 1 + METRICS_CLIENTS, 0) <= 0)
+		return;
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		if (pfd[i + 1].revents)
+			metrics_read(&clients[i]);
+	if (pfd[0].revents)
+		metrics_accept();
+}
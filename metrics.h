@@ -0,0 +1,44 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ *	Control socket. Performance counters are served in the Prometheus
+ *	text format on a unix ("unix:path") or TCP ("tcp:[addr:]port",
+ *	loopback by default) socket. A client sends a request line and gets
+ *	the counters back, wrapped in an HTTP reply if it asked with GET,
+ *	and the connection is closed. metrics_poll() is called once a frame
+ *	and never blocks.
+ *
+ *	The board's report function is handed the stream to write to. It
+ *	gives metrics_clock() the figures from its main loop and then adds
+ *	a metrics_counter() for each device fitted.
+ *
+ *	A request of "speed" followed by a multiple of real time, "max",
+ *	"auto" or "pause" is handed to the board's speed function instead,
+ *	if it has one, and answered with "ok".
+ */
+
+#define METRICS_SPEED_AUTO	-2
+#define METRICS_SPEED_PAUSE	-1
+#define METRICS_SPEED_MAX	0
+
+struct metrics_clock {
+	uint64_t cycles;	/* Emulated clocks run */
+	uint64_t hz;		/* Clock the board is meant to run at */
+	uint64_t sleep_ns;	/* Host time spent waiting for real time */
+	uint64_t resyncs;	/* Times it fell too far behind to catch up */
+	uint64_t irqs;		/* Interrupts taken */
+};
+
+extern void metrics_listen(const char *spec, const char *prefix,
+			   void (*report)(FILE *fp), void (*speed)(int speed));
+extern void metrics_poll(void);
+extern void metrics_close(void);
+extern void metrics_clock(FILE *fp, const struct metrics_clock *c);
+extern void metrics_counter(FILE *fp, const char *name, const char *help,
+			    unsigned long long value);
+
+#endif
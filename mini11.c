@@ -25,6 +25,7 @@
 #include "rtc_bitbang.h"
 #include "w5100.h"
 #include "sdcard.h"
+#include "trace.h"
 
 static uint8_t ram[512 * 1024];		/* Covers the banked card */
 static uint8_t rom[32768];		/* System EPROM */
@@ -123,7 +124,7 @@ void m6800_sci_change(struct m6800 *cpu)
 	unsigned int divider = 1 << (cpu->io.baud & 7);
 
 	/* SCI changed status - could add debug here FIXME */
-	if (!(trace & TRACE_UART))
+	if (!TRACE_ON(trace & TRACE_UART))
 		return;
 
 	baseclock /= prescale;
@@ -155,6 +156,7 @@ static void flatarecalc(struct m6800 *cpu)
 	if (bits & 0x10)
 		flatahigh += 0x10000;
 	romen = !!(bits & 0x08);
+	m6800_decode_flush(cpu);
 }
 
 
@@ -193,10 +195,10 @@ void m68hc11_spi_begin(struct m6800 *cpu, uint8_t val)
 {
 	spi_rxbyte = 0xFF;
 	if (sdcard) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "SPI -> %02X\n", val);
 		spi_rxbyte = sd_spi_in(sdcard, val);
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "SPI <- %02X\n", spi_rxbyte);
 	}
 }
@@ -225,7 +227,7 @@ uint8_t m6800_read(struct m6800 *cpu, uint16_t addr)
 {
 	uint8_t r;
 	r = *m6800_map(addr, 0);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, r);
 	return r;
 }
@@ -330,7 +332,7 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
 
@@ -360,7 +362,7 @@ int main(int argc, char *argv[])
 	else	/* 68HC11A0 */
 		m68hc11a_reset(&cpu, 0, 0, NULL, NULL);
 
-	if (trace & TRACE_CPU)
+	if (TRACE_ON(trace & TRACE_CPU))
 		cpu.debug = 1;
 
 	/* This is the wrong way to do it but it's easier for the moment. We
@@ -53,6 +53,8 @@
 #include "libz180/z180.h"
 #include "lib765/include/765.h"
 #include "z180_io.h"
+#include "cpuclock.h"
+#include "z180run.h"
 
 #include "16x50.h"
 #include "ide.h"
@@ -63,9 +65,11 @@
 #include "tms9918a.h"
 #include "tms9918a_render.h"
 #include "z80dis.h"
+#include "trace.h"
+#include "ramalloc.h"
 
-static uint8_t ram[1024 * 1024];
-static uint8_t rom[512 * 1024];
+static uint8_t *ram;
+static uint8_t *rom;
 
 static uint8_t fast = 0;
 static uint8_t int_recalc = 0;
@@ -82,10 +86,11 @@ struct ps2 *ps2;
 static uint8_t acr;
 static uint8_t rmap;
 
-static uint16_t tstate_steps = 737;	/* 18.432MHz */
+static unsigned long cpu_hz = 18432000;
 
 /* IRQ source that is live in IM2 */
 static uint8_t live_irq;
+static struct z180run run;
 
 static Z180Context cpu_z180;
 
@@ -108,7 +113,7 @@ volatile int emulator_done;
 
 static int trace = 0;
 
-static void reti_event(void);
+static void reti_event(int unused);
 
 uint8_t z180_phys_read(int unused, uint32_t addr)
 {
@@ -128,7 +133,7 @@ static uint8_t do_mem_read(uint16_t addr, int quiet)
 {
 	uint32_t pa = z180_mmu_translate(io, addr);
 	uint8_t r = z180_phys_read(0, pa);
-	if (!quiet && (trace & TRACE_MEM))
+	if (!quiet && TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X[%06X] -> %02X\n", addr, pa, r);
 	return r;
 }
@@ -137,37 +142,19 @@ void mem_write(int unused, uint16_t addr, uint8_t val)
 {
 	uint32_t pa = z180_mmu_translate(io, addr);
 	if (!(acr & 0x80) && pa < 0x8000) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04X[%06X] *ROM*\n",
 				addr, pa);
 		return;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %04X[%06X] <- %02X\n", addr, pa, val);
 	ram[pa] = val;
 }
 
 uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate = 0;
-	uint8_t r = do_mem_read(addr, 0);
-	if (cpu_z180.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r == 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1)
-		reti_event();
-	rstate = 0;
-	return r;
+	return do_mem_read(addr, 0);
 }
 
 static unsigned int nbytes;
@@ -190,7 +177,7 @@ static void n8_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -267,7 +254,7 @@ uint8_t z180_csio_write(struct z180_io *io, uint8_t bits)
 		return 0xFF;
 
 	r = bitrev[sd_spi_in(sdcard, bitrev[bits])];
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 		fprintf(stderr,	"[SPI %02X:%02X]\n", bitrev[bits], bitrev[r]);
 	return r;
 }
@@ -275,7 +262,7 @@ uint8_t z180_csio_write(struct z180_io *io, uint8_t bits)
 
 static void fdc_log(int debuglevel, char *fmt, va_list ap)
 {
-	if ((trace & TRACE_FDC) || debuglevel == 0)
+	if (TRACE_ON(trace & TRACE_FDC) || debuglevel == 0)
 		vfprintf(stderr, "fdc: ", ap);
 }
 
@@ -283,12 +270,12 @@ static void fdc_write(uint8_t addr, uint8_t val)
 {
 	switch(addr) {
 	case 0x8D:	/* Data */
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "FDC Data: %02X\n", val);
 		fdc_write_data(fdc, val);
 		break;
 	case 0x92:	/* DOR */
-		if (trace & TRACE_FDC) {
+		if (TRACE_ON(trace & TRACE_FDC)) {
 			fprintf(stderr, "FDC DOR %02X [", val);
 			if (val & 0x80)
 				fprintf(stderr, "SPECIAL ");
@@ -321,7 +308,7 @@ static void fdc_write(uint8_t addr, uint8_t val)
 #endif
 		break;
 	case 0x91:	/* DCR */
-		if (trace & TRACE_FDC) {
+		if (TRACE_ON(trace & TRACE_FDC)) {
 			fprintf(stderr, "FDC DCR %02X [", val);
 			if (!(val & 4))
 				fprintf(stderr, "WCOMP");
@@ -345,11 +332,11 @@ static void fdc_write(uint8_t addr, uint8_t val)
 	case 0x93:	/* TC */
 		fdc_set_terminal_count(fdc, 0);
 		fdc_set_terminal_count(fdc, 1);
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "FDC TC\n");
 		break;
 	case 90:	/* DAC */
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "FDC DAC\n");
 		break;
 	default:
@@ -362,23 +349,23 @@ static uint8_t fdc_read(uint8_t addr)
 	uint8_t val = 0x78;
 	switch(addr) {
 	case 0x8C:	/* Status*/
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "FDC Read Status: ");
 		val = fdc_read_ctrl(fdc);
 		break;
 	case 0x8D:	/* Data */
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "FDC Read Data: ");
 		val = fdc_read_data(fdc);
 		break;
 	case 0x93:	/* TC */
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "FDC TC: ");
 		break;
 	default:
 		fprintf(stderr, "FDC bogus read %02X: ", addr);
 	}
-	if (trace & TRACE_FDC)
+	if (TRACE_ON(trace & TRACE_FDC))
 		fprintf(stderr, "%02X\n", val);
 	return val;
 }
@@ -399,7 +386,7 @@ static void sysio_write(uint8_t val)
 	static uint8_t sysio = 0xFF;
 	uint8_t delta = val ^ sysio;
 	if (sdcard && (delta & 4)) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "[SPI CS %sed]\n",
 				(val & 4) ? "lower" : "rais");
 		if (val & 4)
@@ -429,7 +416,7 @@ static void kbd_out(uint8_t r)
 
 uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if (z180_iospace(io, addr))
 		return z180_read(io, addr);
@@ -445,7 +432,7 @@ uint8_t io_read(int unused, uint16_t addr)
 		return fdc_read(addr);
 	if ((addr == 0x98 || addr == 0x99) && vdp)
 		return tms9918a_read(vdp, addr & 1);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
@@ -454,11 +441,12 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 {
 	uint8_t known = 0;
 
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 
 	if (z180_iospace(io, addr)) {
 		z180_write(io, addr, val);
+		run.dma_live = z180_dma_live(io);
 		known = 1;
 	}
 	if ((addr & 0xFF) == 0xBA) {
@@ -489,7 +477,7 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 		trace &= 0xFF;
 		trace |= val << 8;
 		printf("trace set to %d\n", trace);
-	} else if (!known && (trace & TRACE_UNK))
+	} else if (!known && TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -502,9 +490,9 @@ static void poll_irq_event(void)
 		z180_interrupt(io, 0, 0, 0);
 }
 
-static void reti_event(void)
+static void reti_event(int unused)
 {
-	if (live_irq && (trace & TRACE_IRQ))
+	if (live_irq && TRACE_ON(trace & TRACE_IRQ))
 		fprintf(stderr, "RETI\n");
 	live_irq = 0;
 	poll_irq_event();
@@ -525,13 +513,43 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "n8: [-f] [-i idepath] [-S sdpath] [-F fdpath] [-R] [-r rompath] [-d debug]\n");
+	fprintf(stderr, "n8: [-f] [-X MHz] [-i idepath] [-S sdpath] [-F fdpath] [-R] [-r rompath] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
+/* Every ten slices */
+static void n8_tick(void)
+{
+	/* We want to run UI events regularly it seems */
+	ui_event();
+	ps2_event(ps2, 7372);
+}
+
+/* Every frame (20ms) */
+static void n8_frame(void)
+{
+	/* 50Hz which is near enough */
+	if (tms9918a_visible(vdprend)) {
+		tms9918a_rasterize(vdp);
+		tms9918a_render(vdprend);
+	} else
+		tms9918a_vblank(vdp);
+	if (int_recalc) {
+		/* If there is no pending Z180 vector IRQ but we think
+		   there now might be one we use the same logic as for
+		   reti */
+		if (!live_irq)
+			poll_irq_event();
+		/* Clear this after because reti_event may set the
+		   flags to indicate there is more happening. We will
+		   pick up the next state changes on the reti if so */
+		if (!(cpu_z180.IFF1|cpu_z180.IFF2))
+			int_recalc = 0;
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
 	int opt;
 	int fd;
 	char *rompath = "n8.rom";
@@ -539,11 +557,11 @@ int main(int argc, char *argv[])
 	char *idepath = NULL;
 	char *patha = NULL, *pathb = NULL;
 
-	uint8_t *p = ram;
-	while (p < ram + sizeof(ram))
-		*p++= rand();
+	ram = ram_alloc(1024 * 1024);
+	ram_scramble(ram, 1024 * 1024);
+	rom = ram_alloc(512 * 1024);
 
-	while ((opt = getopt(argc, argv, "r:S:i:d:fF:")) != -1) {
+	while ((opt = getopt(argc, argv, "r:S:i:d:fF:X:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -561,6 +579,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 			break;
 		case 'F':
 			if (pathb) {
@@ -586,7 +607,7 @@ int main(int argc, char *argv[])
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, rom, 524288) != 524288) {
+	if (ram_load(fd, rom, 524288) != 524288) {
 		fprintf(stderr, "n8: ROM image should be 512K.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -600,7 +621,7 @@ int main(int argc, char *argv[])
 		else
 			ppide_attach(ppide, 0, fd);
 	}
-	ppide_trace(ppide, trace & TRACE_PPIDE);
+	ppide_trace(ppide, TRACE_ON(trace & TRACE_PPIDE));
 
 	sdcard = sd_create("sd0");
 	if (sdpath) {
@@ -610,23 +631,23 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
 
 	io = z180_create(&cpu_z180);
 	z180_set_input(io, 0, 1);
-	z180_trace(io, trace & TRACE_CPU_IO);
+	z180_trace(io, TRACE_ON(trace & TRACE_CPU_IO));
 
-	rtc_trace(rtc, trace & TRACE_RTC);
+	rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 
 	vdp = tms9918a_create();
-	tms9918a_trace(vdp, !!(trace & TRACE_TMS9918A));
+	tms9918a_trace(vdp, !!TRACE_ON(trace & TRACE_TMS9918A));
 	vdprend = tms9918a_renderer_create(vdp);
 
 	/* Divider for a microsecond clock */
 	ps2 = ps2_create(18);
-	ps2_trace(ps2, trace & TRACE_PS2);
+	ps2_trace(ps2, TRACE_ON(trace & TRACE_PS2));
 	fdc = fdc_new();
 
 	lib765_register_error_function(fdc_log);
@@ -655,11 +676,6 @@ int main(int argc, char *argv[])
 	fdc_setdrive(fdc, 0, drive_a);
 	fdc_setdrive(fdc, 1, drive_b);
 
-	/* 20ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 20000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -680,57 +696,20 @@ int main(int argc, char *argv[])
 	cpu_z180.ioWrite = io_write;
 	cpu_z180.memRead = mem_read;
 	cpu_z180.memWrite = mem_write;
+	cpu_z180.reti = reti_event;
 	cpu_z180.trace = n8_trace;
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!emulator_done) {
-		int states = 0;
-		unsigned int i, j;
-		/* We have to run the DMA engine and Z180 in step per
-		   instruction otherwise we will mess up on stalling DMA */
-
-		/* Do an emulated 20ms of work (368640 clocks) */
-		for (i = 0; i < 50; i++) {
-			for (j = 0; j < 10; j++) {
-				while (states < tstate_steps) {
-					unsigned int used;
-					used = z180_dma(io);
-					if (used == 0)
-						used = Z180Execute(&cpu_z180);
-					states += used;
-				}
-				z180_event(io, states);
-				states -= tstate_steps;
-			}
-			/* We want to run UI events regularly it seems */
-			ui_event();
-			ps2_event(ps2, 7372);
-		}
-
-		/* 50Hz which is near enough */
-		tms9918a_rasterize(vdp);
-		tms9918a_render(vdprend);
-
-		/* Do 20ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
-		if (int_recalc) {
-			/* If there is no pending Z180 vector IRQ but we think
-			   there now might be one we use the same logic as for
-			   reti */
-			if (!live_irq)
-				poll_irq_event();
-			/* Clear this after because reti_event may set the
-			   flags to indicate there is more happening. We will
-			   pick up the next state changes on the reti if so */
-			if (!(cpu_z180.IFF1|cpu_z180.IFF2))
-				int_recalc = 0;
-		}
-	}
+	run.cpu = &cpu_z180;
+	run.io = io;
+	run.hz = cpu_hz;
+	run.rate = 25000;
+	run.steps = 10;
+	run.ticks = 50;
+	run.tick = n8_tick;
+	run.frame = n8_frame;
+	run.fast = fast;
+	run.done = &emulator_done;
+	z180run_loop(&run);
 	fd_eject(drive_a);
 	fd_eject(drive_b);
 	fdc_destroy(&fdc);
@@ -7,6 +7,7 @@
 
 #include "system.h"
 #include "ps2.h"
+#include "sdl2_texture.h"
 
 extern struct ps2 *ps2;
 
@@ -39,7 +40,7 @@ static void make_ps2_code(SDL_Event *ev)
 void ui_event(void)
 {
 	SDL_Event ev;
-	while (SDL_PollEvent(&ev)) {
+	while (sdltex_poll_event(&ev)) {
 		switch(ev.type) {
 		case SDL_QUIT:
 			emulator_done = 1;
@@ -3,9 +3,9 @@
  *
  *	Z80 CPU at 2MHz (NASCOM 1) or 4MHz (NASCOM 2)
  *	Keyboard 0x00
- *	6402 UART (emulated for serial I/O but not yet tape) 0x01/0x02
+ *	6402 UART (serial I/O, or a tape file while the drive is on) 0x01/0x02
  *	Z80 PIO (not emulated) at 0x04
- *	Nascom floppy disk controller 0xE0
+ *	Nascom floppy disk controller 0xE0, or a Gemini GM829/849 with SASI
  *	Gemini GM106 RTC at 0x20
  *
  *	Various memory configurations
@@ -35,8 +35,10 @@
 #include <SDL2/SDL.h>
 
 #include "keymatrix.h"
+#include "sdl2_texture.h"
 
 #include "nasfont.h"
+#include "glyphcache.h"
 
 #include "58174.h"
 #include "wd17xx.h"
@@ -45,14 +47,17 @@
 #include "z80dis.h"
 
 #include "sasi.h"
+#include "blkcache.h"
+#include "cow.h"
+#include "trace.h"
+#include "vclock.h"
 
 #define CWIDTH 8
 #define CHEIGHT 15
 
-static SDL_Window *window;
-static SDL_Renderer *render;
-static SDL_Texture *texture;
+static struct sdltex *screen;
 static uint32_t texturebits[48 * CWIDTH * 16 * CHEIGHT];
+static struct glyphcache *glyphs;
 
 struct keymatrix *matrix;
 
@@ -64,10 +69,17 @@ static uint64_t is_present;
 //static uint8_t rpage = 0, wpage = 0;
 static unsigned int cpmmap;
 static uint16_t vidbase = 0x0800;
+static uint8_t vid_dirty[1024];		/* Video bytes written since the last frame */
+static unsigned int vid_changed;	/* Any vid_dirty set */
+static unsigned int vid_all = 1;	/* Redraw the whole screen */
 
 static struct wd17xx *fdc;
 static struct mm58174 *rtc;
 static uint8_t kbd_row;
+static uint8_t tape_drive;		/* Port 0 bit 4, the tape LED and relay */
+static uint8_t *tape;
+static size_t tape_len;
+static size_t tape_pos;
 static struct sasi_bus *sasi;
 static uint8_t sasi_en;
 
@@ -81,6 +93,12 @@ static unsigned int fdc_gemini;
 
 static Z80Context cpu_z80;
 static uint8_t fast;
+static uint64_t cycles;		/* T-states run, for the RTC */
+
+static uint64_t nascom_cycles(void)
+{
+	return cycles;
+}
 volatile int emulator_done;
 
 #define TRACE_MEM	0x000001
@@ -91,6 +109,7 @@ volatile int emulator_done;
 #define TRACE_KEY	0x000020
 #define TRACE_FDC	0x000040
 #define TRACE_RTC	0x000080
+#define TRACE_TAPE	0x000100
 
 static int trace = 0;
 
@@ -112,11 +131,11 @@ uint8_t mem_read(int unused, uint16_t addr)
 {
 	uint8_t *p = mmu(addr, false);
 	if (p == NULL) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X not readable\n", addr);
 		return 0xFF;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%04X -> %02X\n", addr, *p);
 	return *p;
 }
@@ -126,11 +145,15 @@ void mem_write(int unused, uint16_t addr, uint8_t val)
 	uint8_t *p = mmu(addr, true);
 
 	if (p) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X <- %02X\n", addr, val);
 		*p = val;
+		if ((unsigned int)(p - base_mem - vidbase) < 1024) {
+			vid_dirty[p - base_mem - vidbase] = 1;
+			vid_changed = 1;
+		}
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X ROM (write %02X fail)\n", addr, val);
 	}
 }
@@ -162,7 +185,7 @@ static void nascom_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -245,24 +268,59 @@ static uint8_t z80pio_read(uint8_t addr)
 	return 0xFF;
 }
 
-/* We have this wired to the consoie for teletype emulation but it was
-   normally wired ot the tape interface which we don't yet cover */
+/* We have this wired to the consoie for teletype emulation. While the
+   tape drive is on it reads the tape file instead, as fast as the ROM
+   takes the bytes rather than at cassette speed */
 static uint8_t uart_status(void)
 {
 	uint8_t reg = 0;
-	unsigned int r = check_chario();
+	unsigned int r;
+
+	if (tape && tape_drive)
+		return tape_pos < tape_len ? 0xC0 : 0x40;
+	r = check_chario();
 	if (r & 1)
 		reg |= 0x80;
 	if (r & 2)
 		reg |= 0x40;
-	return r;
+	return reg;
 }
 
 static uint8_t uart_data(void)
 {
+	if (tape && tape_drive) {
+		if (tape_pos == tape_len)
+			return 0x00;
+		if (++tape_pos == tape_len && TRACE_ON(trace & TRACE_TAPE))
+			fprintf(stderr, "tape: end of tape.\n");
+		return tape[tape_pos - 1];
+	}
 	return next_char();
 }
 
+/* The whole tape file, played from the start */
+static void tape_load(const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		exit(1);
+	}
+	tape_len = st.st_size;
+	tape = malloc(tape_len + 1);
+	if (tape == NULL) {
+		fprintf(stderr, "nascom: out of memory.\n");
+		exit(1);
+	}
+	if (read(fd, tape, tape_len) != (ssize_t)tape_len) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
 /* No interrupts or other magic so for the moment just do this */
 static void uart_transmit(uint8_t val)
 {
@@ -337,6 +395,58 @@ static uint8_t gemini_scsi_read(uint8_t addr)
 	}
 }
 
+/*
+ *	INIR and OTIR on the Gemini SASI data port move a data phase in one
+ *	go. The Z80 needs host page tables for that, which cover the plain
+ *	RAM and ROM but not the video RAM whose writes have to be seen.
+ */
+static uint8_t *mem_rpage[16];
+static uint8_t *mem_wpage[16];
+
+static void mem_pages(void)
+{
+	unsigned int i;
+	uint64_t page;
+
+	for (i = 0; i < 16; i++) {
+		page = 0xFULL << (4 * i);
+		mem_rpage[i] = mem_wpage[i] = NULL;
+		if ((is_present & page) != page || (is_base & page) != page)
+			continue;
+		mem_rpage[i] = base_mem + (i << 12);
+		if (!(is_rom & page) && (vidbase >> 12) != i)
+			mem_wpage[i] = base_mem + (i << 12);
+	}
+	/* Memory tracing has to see every access */
+	if (TRACE_ON(trace & TRACE_MEM))
+		cpu_z80.memPageRead = cpu_z80.memPageWrite = NULL;
+	else {
+		cpu_z80.memPageRead = mem_rpage;
+		cpu_z80.memPageWrite = mem_wpage;
+	}
+}
+
+static int sasi_bulk_port(uint16_t addr)
+{
+	if (!sasi || (addr & 0xFF) != 0xE6 || TRACE_ON(trace & TRACE_IO))
+		return 0;
+	return fdc_gemini == GM829 || sasi_en;
+}
+
+static unsigned io_block_read(int unused, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	if (!sasi_bulk_port(addr))
+		return 0;
+	return sasi_read_bulk(sasi, buf, len);
+}
+
+static unsigned io_block_write(int unused, uint16_t addr, const uint8_t *buf, unsigned len)
+{
+	if (!sasi_bulk_port(addr))
+		return 0;
+	return sasi_write_bulk(sasi, buf, len);
+}
+
 /*
  *	Port offsets
  *	0 : FDC status / command
@@ -371,11 +481,11 @@ static void lucas_fdc_write(uint16_t addr, uint8_t val)
 		wd17xx_write_data(fdc, val);
 		break;
 	case 0x04:
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "fdc: latch set to %x\n", fdc_latch);
 		fdc_latch = val;
 		/* For our purposes the 849A is the same */
-		if (fdc_gemini == 849) {
+		if (fdc_gemini == GM849 || fdc_gemini == GM849A) {
 			/* WD2793 */
 			/* Fudge a bit - the 849 can handle 8 drives */
 			if (val & 4)
@@ -455,7 +565,7 @@ static uint8_t lucas_fdc_read(uint16_t addr)
 				r |= 0x80;
 			return r;
 		} else {
-			if (trace & TRACE_FDC) {
+			if (TRACE_ON(trace & TRACE_FDC)) {
 				fprintf(stderr, "fdc: latch read as %x\n", fdc_latch & 0x5F);
 				return fdc_latch & 0x5F;
 			}
@@ -481,7 +591,7 @@ static uint8_t lucas_fdc_read(uint16_t addr)
 			rx |= 0x80;
 		if (wd17xx_intrq(fdc))		/* If INTRQ set bit 0 */
 			rx |= 0x01;
-		if (trace & TRACE_FDC)
+		if (TRACE_ON(trace & TRACE_FDC))
 			fprintf(stderr, "fdc: status read as %x\n", rx);
 		return rx;
 	case 0x06:
@@ -496,7 +606,7 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 
 	if (nascom_ver == 1)
 		port &= 0x07;
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "=== OUT %02X, %02X\n", addr & 0xFF, val);
 	/* NASCOM base ports */
 	switch(port) {
@@ -505,6 +615,11 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 				kbd_row = (kbd_row + 1) & 15;
 			if (val & 2)
 				kbd_row = 0;
+			if ((val & 0x10) != tape_drive && tape &&
+			    TRACE_ON(trace & TRACE_TAPE))
+				fprintf(stderr, "tape: drive %s at %lu.\n",
+					(val & 0x10) ? "on" : "off", (unsigned long)tape_pos);
+			tape_drive = val & 0x10;
 //			if (val & 8)
 //				prime_nmi();
 			break;
@@ -565,7 +680,7 @@ static uint8_t do_io_read(int unused, uint16_t addr)
 uint8_t io_read(int unused, uint16_t addr)
 {
 	uint8_t r = do_io_read(unused, addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "=== IN %02X = %02X\n", addr & 0xFF, r);
 	return r;
 }
@@ -583,55 +698,46 @@ uint8_t io_read(int unused, uint16_t addr)
 
 static void raster_char(unsigned int y, unsigned int x, uint8_t c)
 {
-	uint8_t *fp = &nascom_font_raw[16 * c];
-	uint32_t *pixp;
-	unsigned int rows, pixels;
-
 	if (nascom_ver == 1)
 		c &= 0x7F;
-
-	pixp = texturebits + x * CWIDTH + 48 * CWIDTH * y * CHEIGHT;
-	for (rows = 0; rows < CHEIGHT; rows++) {
-		uint8_t bits = *fp++;
-		for (pixels = 0; pixels < CWIDTH; pixels++) {
-			if (bits & 0x80)
-				*pixp++ = 0xFFD0D0D0;
-			else
-				*pixp++ = 0xFF000000;
-			bits <<= 1;
-		}
-		/* We moved on one char, move on the other 47 */
-		pixp += 47 * CWIDTH;
-	}
+	glyphcache_draw(glyphs, c,
+		texturebits + x * CWIDTH + 48 * CWIDTH * y * CHEIGHT,
+		48 * CWIDTH);
 }
-		
-static void nascom_rasterize(void)
+
+/* Redraw the characters written since the last frame. Returns 0 if the
+   screen has not changed */
+static int nascom_rasterize(void)
 {
 	unsigned int lptr = 0x03CA;
 	unsigned int lines, cols;
 	uint8_t *ptr;
+
+	if (!vid_changed && !vid_all)
+		return 0;
 	for (lines = 0; lines < 16; lines ++) {
 		ptr = base_mem + vidbase + lptr;
 		for (cols = 0; cols < 48; cols ++) {
-			raster_char(lines, cols, *ptr++);
+			if (vid_all || vid_dirty[lptr + cols]) {
+				vid_dirty[lptr + cols] = 0;
+				raster_char(lines, cols, *ptr);
+			}
+			ptr++;
 		}
 		lptr += 0x40;
 		lptr &= 0x03FF;
 	}
+	/* The margins are never shown */
+	memset(vid_dirty, 0, sizeof(vid_dirty));
+	vid_changed = 0;
+	vid_all = 0;
+	return 1;
 }
 
 static void nascom_render(void)
 {
-	SDL_Rect rect;
-	
-	rect.x = rect.y = 0;
-	rect.w = 48 * CWIDTH;
-	rect.h = 16 * CHEIGHT;
-
-	SDL_UpdateTexture(texture, NULL, texturebits, 48 * CWIDTH * 4);
-	SDL_RenderClear(render);
-	SDL_RenderCopy(render, texture, NULL, &rect);
-	SDL_RenderPresent(render);
+	sdltex_compare(screen, texturebits);
+	sdltex_present(screen, texturebits);
 }
 
 /* Most PC layouts don't have a colon key so use # */
@@ -649,7 +755,7 @@ static void keytranslate(SDL_Event *ev)
 static void ui_event(void)
 {
 	SDL_Event ev;
-	while (SDL_PollEvent(&ev)) {
+	while (sdltex_poll_event(&ev)) {
 		switch(ev.type) {
 		case SDL_QUIT:
 			emulator_done = 1;
@@ -659,6 +765,9 @@ static void ui_event(void)
 			keytranslate(&ev);
 			keymatrix_SDL2event(matrix, &ev);
 			break;
+		case SDL_WINDOWEVENT:
+			vid_all = 1;
+			break;
 		}
 	}
 }
@@ -696,13 +805,14 @@ struct diskgeom disktypes[] = {
 static struct diskgeom *guess_format(const char *path)
 {
 	struct diskgeom *d = disktypes;
-	struct stat s;
 	off_t size;
-	if (stat(path, &s) == -1) {
+	/* The same way the drive will open it, overlay and all */
+	int fd = cow_open(path, O_RDWR);
+	if (fd == -1 || (size = cow_size(fd)) == -1) {
 		perror(path);
 		exit(1);
 	}
-	size = s.st_size;
+	cow_close(fd);
 	while(d->name) {
 		if (d->size == size)
 			return d;
@@ -791,7 +901,7 @@ static int romload(const char *path, uint8_t *mem, unsigned int base, unsigned i
 
 static void usage(void)
 {
-	fprintf(stderr, "nascom: [-f] [-1] [-2] [-3] [-b basic] [-c] [-e eprom] [-r rom] [-m] [-R] [-d debug]\n");
+	fprintf(stderr, "nascom: [-f] [-1] [-2] [-3] [-b basic] [-c] [-e eprom] [-r rom] [-m] [-R] [-W] [-t fdcpercent] [-G 829|849|849a] [-S sasidisk] [-K blocks] [-T tape] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -808,8 +918,14 @@ int main(int argc, char *argv[])
 	unsigned int hasrtc = 0;
 	unsigned int maxmem = 0;
 	static unsigned int need_fdc = 0;
-
-	while ((opt = getopt(argc, argv, "123b:cd:e:fmr:A:B:C:D:R")) != -1) {
+	unsigned int fdc_inram = 0;
+	unsigned int fdc_timing = 0;
+	char *sasi_path[8];
+	unsigned int sasi_disks = 0;
+	unsigned int cache_blocks = 0;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "123b:cd:e:fmr:t:A:B:C:D:G:K:RS:T:W")) != -1) {
 		switch (opt) {
 		case '1':
 			nascom_ver = 1;
@@ -858,6 +974,38 @@ int main(int argc, char *argv[])
 		case 'R':
 			hasrtc = 1;
 			break;
+		case 'W':
+			fdc_inram = 1;
+			break;
+		case 't':
+			fdc_timing = atoi(optarg);
+			break;
+		case 'T':
+			tape_load(optarg);
+			break;
+		case 'G':
+			if (strcmp(optarg, "829") == 0)
+				fdc_gemini = GM829;
+			else if (strcmp(optarg, "849") == 0)
+				fdc_gemini = GM849;
+			else if (strcmp(optarg, "849a") == 0)
+				fdc_gemini = GM849A;
+			else {
+				fprintf(stderr, "nascom: unknown Gemini card '%s'.\n", optarg);
+				exit(1);
+			}
+			need_fdc = 1;
+			break;
+		case 'S':
+			if (sasi_disks == 8) {
+				fprintf(stderr, "nascom: too many SASI disks.\n");
+				exit(1);
+			}
+			sasi_path[sasi_disks++] = optarg;
+			break;
+		case 'K':
+			cache_blocks = atoi(optarg);
+			break;
 		default:
 			usage();
 		}
@@ -924,9 +1072,16 @@ int main(int argc, char *argv[])
 		is_base |= 0xFFFFFFFFFFFFULL << 8;
 	}
 
+	if (sasi_disks && fdc_gemini == 0) {
+		fprintf(stderr, "nascom: SASI disks need a Gemini card (-G).\n");
+		exit(1);
+	}
+	/* Floppies and SASI disks share the host block cache */
+	blkcache_init(cache_blocks);
 	if (need_fdc) {
-		unsigned i;
 		fdc = wd17xx_create();
+		wd17xx_set_inram(fdc, fdc_inram);
+		wd17xx_set_timing(fdc, fdc_timing);
 		for (i = 0; i < 4; i++) {
 			if (fdc_path[i]) {
 				struct diskgeom *d = guess_format(fdc_path[i]);
@@ -934,50 +1089,26 @@ int main(int argc, char *argv[])
 				wd17xx_attach(fdc, i, fdc_path[i], d->sides, d->tracks, d->spt, d->secsize);
 			}
 		}
-		wd17xx_trace(fdc, trace & TRACE_FDC);
+		wd17xx_trace(fdc, TRACE_ON(trace & TRACE_FDC));
+	}
+	if (sasi_disks) {
+		sasi = sasi_bus_create();
+		for (i = 0; i < sasi_disks; i++)
+			sasi_disk_attach(sasi, i, sasi_path[i], 512);
+		sasi_bus_reset(sasi);
 	}
 	/* GM816 RTC emulation */
 	if (hasrtc) {
+		vclock_set_source(nascom_cycles, tstates * 10000,
+			fast ? VCLOCK_ANCHORED : VCLOCK_WALL);
 		rtc = mm58174_create();
-		mm58174_trace(rtc, trace & TRACE_RTC);
+		mm58174_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 	}
 	matrix = keymatrix_create(9, 7, keyboard);
-	keymatrix_trace(matrix, trace & TRACE_KEY);
-	atexit(SDL_Quit);
-	if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-		fprintf(stderr, "nascom: unable to initialize SDL: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	window = SDL_CreateWindow("Nascom",
-			SDL_WINDOWPOS_UNDEFINED,
-			SDL_WINDOWPOS_UNDEFINED,
-			48 * CWIDTH, 16 * CHEIGHT,
-			SDL_WINDOW_RESIZABLE);
-	if (window == NULL) {
-		fprintf(stderr, "nascom: unable to open window: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	render = SDL_CreateRenderer(window, -1, 0);
-	if (render == NULL) {
-		fprintf(stderr, "nascom: unable to create renderer: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	texture = SDL_CreateTexture(render, SDL_PIXELFORMAT_ARGB8888,
-		SDL_TEXTUREACCESS_STREAMING,
-		48 * CWIDTH, 16 * CHEIGHT);
-	if (texture == NULL) {
-		fprintf(stderr, "nascom: unable to create texture: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	SDL_SetRenderDrawColor(render, 0, 0, 0, 255);
-	SDL_RenderClear(render);
-	SDL_RenderPresent(render);
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-	SDL_RenderSetLogicalSize(render, 48 * CWIDTH,  16 * CHEIGHT);
+	keymatrix_trace(matrix, TRACE_ON(trace & TRACE_KEY));
+	screen = sdltex_create("Nascom", 48 * CWIDTH, 16 * CHEIGHT, 48 * CWIDTH, 16 * CHEIGHT);
+	glyphs = glyphcache_create(256, CWIDTH, CHEIGHT);
+	glyphcache_load(glyphs, nascom_font_raw, 16, 0xFFD0D0D0, 0xFF000000);
 
 	/* 10ms - it's a balance between nice behaviour and simulation
 	   smoothness */
@@ -1006,6 +1137,9 @@ int main(int argc, char *argv[])
 	cpu_z80.memRead = mem_read;
 	cpu_z80.memWrite = mem_write;
 	cpu_z80.trace = nascom_trace;
+	cpu_z80.ioBlockRead = io_block_read;
+	cpu_z80.ioBlockWrite = io_block_write;
+	mem_pages();
 
 	/* Emulate the jump logic */
 	if (cpmmap)
@@ -1020,17 +1154,24 @@ int main(int argc, char *argv[])
 		int i;
 		/* Each cycle we do 20000 or 40000 T states */
 		for (i = 0; i < 100; i++) {
-			Z80ExecuteTStates(&cpu_z80, tstates);
+			cycles += Z80ExecuteTStates(&cpu_z80, tstates);
+			/* Each run is 100us */
+			if (fdc)
+				wd17xx_tick(fdc, 100);
 		}
 
 		/* We want to run UI events before we rasterize */
 		ui_event();
-		nascom_rasterize();
-		nascom_render();
+		if (sdltex_visible(screen) &&
+		    (nascom_rasterize() || sdltex_recording(screen)))
+			nascom_render();
 		if (fdc_motor) {
 			fdc_motor--;
-			if (fdc_motor == 0 && (trace & TRACE_FDC))
+			if (fdc_motor == 0 && TRACE_ON(trace & TRACE_FDC))
 				fprintf(stderr, "fdc: motor timeout.\n");
+			/* Disk gone idle, a good time to write back */
+			if (fdc_motor == 0 && fdc_inram)
+				wd17xx_flush(fdc);
 		}
 		if (rtc) {
 			/* Annoyingly the 58174 on the GM816 is wired to NMI */
@@ -1042,5 +1183,7 @@ int main(int argc, char *argv[])
 		if (!fast)
 			nanosleep(&tc, NULL);
 	}
+	if (fdc)
+		wd17xx_free(fdc);
 	exit(0);
 }
@@ -28,19 +28,24 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/mman.h>
 
 #include <SDL2/SDL.h>
 
 #include "keymatrix.h"
+#include "sdl2_texture.h"
 
 #include "libz80/z80.h"
 #include "z80dis.h"
+#include "memimg.h"
+#include "trace.h"
+#include "vclock.h"
 
-static SDL_Window *window;
-static SDL_Renderer *render;
-static SDL_Texture *texture;
+static struct sdltex *screen;
 static uint32_t texturebits[480 * 64];
+static uint32_t pixels[256][8];	/* Each byte expanded to 8 pixels */
+static uint8_t vid_dirty[64];	/* Lines written since the last frame */
+static unsigned int vid_all = 1;	/* Whole screen needs redrawing */
+static unsigned int vid_top, vid_bottom;	/* Lines redrawn this frame */
 
 struct keymatrix *matrix;
 
@@ -48,8 +53,10 @@ static uint8_t ram[131072];
 static uint8_t rom[524288];
 static uint8_t rom_mask = 0x0F;
 static uint8_t ram_mask = 0x03;
+static struct memimg *card;
 static uint8_t *pcmcia;			/* Battery backed usually */
 static uint32_t pcmcia_size;
+static int card_policy = MEMIMG_KERNEL;
 
 static Z80Context cpu_z80;
 static uint8_t irqmask = 0x00;
@@ -75,6 +82,12 @@ static uint8_t sound[4];
 static uint8_t cardstat = CSTAT_PRESENT | CSTAT_5V;
 
 static uint8_t fast;
+static uint64_t cycles;		/* T-states run, for the RTC */
+
+static uint64_t nc100_cycles(void)
+{
+	return cycles;
+}
 volatile int emulator_done;
 
 #define TRACE_MEM	0x000001
@@ -111,6 +124,8 @@ static uint8_t *mmu(uint16_t addr, bool write)
 		pa = ((bank & 0x3F) << 14) + addr;
 		if (pa >= pcmcia_size)
 			return NULL; 
+		if (write)
+			memimg_touch(card, pa);
 		return pcmcia + pa;
 	case 0xC0:
 		return NULL;
@@ -125,7 +140,7 @@ uint8_t mem_read(int unused, uint16_t addr)
 		fprintf(stderr, "%04X not readable\n", addr);
 		return 0xFF;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%04X -> %02X\n", addr, *p);
 	return *p;
 }
@@ -133,13 +148,20 @@ uint8_t mem_read(int unused, uint16_t addr)
 void mem_write(int unused, uint16_t addr, uint8_t val)
 {
 	uint8_t *p = mmu(addr, true);
+	unsigned int off;
 
 	if (p) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X <- %02X\n", addr, val);
 		*p = val;
+		/* Note writes that land in the video window */
+		if (p >= ram && p < ram + sizeof(ram)) {
+			off = p - ram - (vidbase << 8);
+			if (off < 64 * 64)
+				vid_dirty[off >> 6] = 1;
+		}
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X ROM (write %02X fail)\n", addr, val);
 	}
 }
@@ -171,7 +193,7 @@ static void nc100_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -356,7 +378,7 @@ static void tc8521_write(uint8_t addr, uint8_t val)
 	switch(addr) {
 	case 0x0D:/* Page : bit 3 is timer enable 2 alarm enable - we ignore */
 		rtc_page = val & 3;
-		time(&t);
+		t = vclock_time();
 		rtc_tm = localtime(&t);
 		break;
 	case 0x0E:		/* Test */
@@ -449,15 +471,17 @@ static void dump_banks(void)
 void io_write(int unused, uint16_t addr, uint8_t val)
 {
 	uint8_t dev = addr & 0xF0;
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "=== OUT %02X, %02X\n", addr & 0xFF, val);
 	switch(dev) {
 	case 0x00:	/* Display control (W)*/
+		if (vidbase != (val & 0xF0))
+			vid_all = 1;
 		vidbase = val & 0xF0;
 		break;
 	case 0x10:	/* Memory management (RW) */
 		bankr[addr & 3] = val;
-		if (trace & TRACE_BANK)
+		if (TRACE_ON(trace & TRACE_BANK))
 			dump_banks();
 		return;
 	case 0x20:	/* Card control (W) */
@@ -550,51 +574,53 @@ static uint8_t do_io_read(int unused, uint16_t addr)
 uint8_t io_read(int unused, uint16_t addr)
 {
 	uint8_t r = do_io_read(unused, addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "=== IN %02X = %02X\n", addr & 0xFF, r);
 	return r;
 }
 
-/* We maybe shouldn't do it all every frame but who cares 8) */
+/* Only the lines written since the last frame are expanded again */
 static void nc100_rasterize(void)
 {
-	uint8_t *vscan = ram + (vidbase << 8);
-	uint32_t *tp = texturebits;
+	uint8_t *vscan;
+	uint32_t *tp;
 	unsigned int y, x, b;
-	uint8_t bits;
-	for (y = 0; y < 64 ; y++) {
+
+	if (vid_all) {
+		for (x = 0; x < 256; x++)
+			for (b = 0; b < 8; b++)
+				pixels[x][b] = (x & (0x80 >> b)) ? 0xFF333333 : 0xFFCCCCBB;
+	}
+	vid_top = 64;
+	vid_bottom = 0;
+	for (y = 0; y < 64; y++) {
+		if (!vid_all && !vid_dirty[y])
+			continue;
+		vid_dirty[y] = 0;
+		if (vid_top > y)
+			vid_top = y;
+		vid_bottom = y + 1;
+		/* 64 bytes a line of which the last 4 are unused */
+		vscan = ram + (vidbase << 8) + y * 64;
+		tp = texturebits + y * 480;
 		for (x = 0; x < 60; x++) {
-			bits = *vscan++;
-			for (b = 0; b < 8; b++) {
-				if (bits & 0x80)
-					*tp++ = 0xFF333333;
-				else
-					*tp++ = 0xFFCCCCBB;
-				bits <<= 1;
-			}
+			memcpy(tp, pixels[*vscan++], sizeof(pixels[0]));
+			tp += 8;
 		}
-		vscan += 4;	/* 4 unused bytes per line */
 	}
+	vid_all = 0;
 }
 
 static void nc100_render(void)
 {
-	SDL_Rect rect;
-	
-	rect.x = rect.y = 0;
-	rect.w = 480;
-	rect.h = 64;
-
-	SDL_UpdateTexture(texture, NULL, texturebits, 480 * 4);
-	SDL_RenderClear(render);
-	SDL_RenderCopy(render, texture, NULL, &rect);
-	SDL_RenderPresent(render);
+	sdltex_dirty_span(screen, vid_top, vid_bottom);
+	sdltex_present(screen, texturebits);
 }
 
 static void ui_event(void)
 {
 	SDL_Event ev;
-	while (SDL_PollEvent(&ev)) {
+	while (sdltex_poll_event(&ev)) {
 		switch(ev.type) {
 		case SDL_QUIT:
 			Z80NMI(&cpu_z80);
@@ -622,7 +648,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "nc100: [-f] [-p pcmcia] [-r rompath] [-d debug]\n");
+	fprintf(stderr, "nc100: [-f] [-p pcmcia] [-P kernel|sync|exit] [-r rompath] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -635,7 +661,7 @@ int main(int argc, char *argv[])
 	char *pcmcia_path = NULL;
 	int romsize;
 
-	while ((opt = getopt(argc, argv, "p:r:d:f")) != -1) {
+	while ((opt = getopt(argc, argv, "p:P:r:d:f")) != -1) {
 		switch (opt) {
 		case 'p':
 			pcmcia_path = optarg;
@@ -646,6 +672,11 @@ int main(int argc, char *argv[])
 		case 'd':
 			trace = atoi(optarg);
 			break;
+		case 'P':
+			card_policy = memimg_policy(optarg);
+			if (card_policy == -1)
+				usage();
+			break;
 		case 'f':
 			fast = 1;
 			break;
@@ -679,66 +710,18 @@ int main(int argc, char *argv[])
 		close(fd);
 	}
 	if (pcmcia_path) {
-		off_t size;
-		fd = open(pcmcia_path, O_RDWR);
-		if (fd == -1) {
-			perror(pcmcia_path);
-			exit(EXIT_FAILURE);
-		}
-		size = lseek(fd, 0, SEEK_END);
-		if (size == -1) {
-			fprintf(stderr, "nc100: unable to get size of '%s'.\n", pcmcia_path);
-			exit(EXIT_FAILURE);
-		}
-		pcmcia = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED,
-			fd, 0);
-		if (pcmcia == MAP_FAILED) {
-			fprintf(stderr, "nc100: unable to map PCMCIA card image '%s'.\n",
-				pcmcia_path);
+		card = memimg_open(pcmcia_path, card_policy);
+		if (card == NULL)
 			exit(EXIT_FAILURE);
-		}
+		pcmcia = memimg_base(card);
+		pcmcia_size = memimg_size(card);
 		cardstat &= ~CSTAT_PRESENT;
-		pcmcia_size = size;
-		fprintf(stderr, "nc100: mapped %dKB PCMCIA image.\n", pcmcia_size);
+		fprintf(stderr, "nc100: mapped %dKB PCMCIA image.\n", pcmcia_size >> 10);
 	}
 
 	matrix = keymatrix_create(10, 8, keyboard);
-	keymatrix_trace(matrix, trace & TRACE_KEY);
-	atexit(SDL_Quit);
-	if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-		fprintf(stderr, "nc100: unable to initialize SDL: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	window = SDL_CreateWindow("NC100",
-			SDL_WINDOWPOS_UNDEFINED,
-			SDL_WINDOWPOS_UNDEFINED,
-			480, 64,
-			SDL_WINDOW_RESIZABLE);
-	if (window == NULL) {
-		fprintf(stderr, "nc100: unable to open window: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	render = SDL_CreateRenderer(window, -1, 0);
-	if (render == NULL) {
-		fprintf(stderr, "nc100: unable to create renderer: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	texture = SDL_CreateTexture(render, SDL_PIXELFORMAT_ARGB8888,
-		SDL_TEXTUREACCESS_STREAMING,
-		480, 64);
-	if (texture == NULL) {
-		fprintf(stderr, "nc100: unable to create texture: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	SDL_SetRenderDrawColor(render, 0, 0, 0, 255);
-	SDL_RenderClear(render);
-	SDL_RenderPresent(render);
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-	SDL_RenderSetLogicalSize(render, 480, 64);
+	keymatrix_trace(matrix, TRACE_ON(trace & TRACE_KEY));
+	screen = sdltex_create("NC100", 480, 64, 480, 64);
 
 	/* 10ms - it's a balance between nice behaviour and simulation
 	   smoothness */
@@ -746,6 +729,9 @@ int main(int argc, char *argv[])
 	tc.tv_sec = 0;
 	tc.tv_nsec = 10000000L;
 
+	/* So the card and disk images are written back */
+	signal(SIGTERM, cleanup);
+
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -761,6 +747,9 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
+	/* 60000 T-states each 5ms round the loop below */
+	vclock_set_source(nc100_cycles, 12000000, fast ? VCLOCK_ANCHORED : VCLOCK_WALL);
+
 	Z80RESET(&cpu_z80);
 	cpu_z80.ioRead = io_read;
 	cpu_z80.ioWrite = io_write;
@@ -776,17 +765,21 @@ int main(int argc, char *argv[])
 	while (!emulator_done) {
 		int i;
 		for (i = 0; i < 100; i++) {
-			Z80ExecuteTStates(&cpu_z80, 600);
+			cycles += Z80ExecuteTStates(&cpu_z80, 600);
 		}
 
 		/* We want to run UI events before we rasterize */
 		ui_event();
-		nc100_rasterize();
-		nc100_render();
+		if (sdltex_visible(screen)) {
+			nc100_rasterize();
+			nc100_render();
+		}
 		raise_irq(IRQ_TICK);
 		if ((~irqstat & irqmask) & 0x0F) {
 			Z80INT(&cpu_z80, 0xFF);
 		}
+		if (card)
+			memimg_tick(card);
 		/* Do 5ms of I/O and delays */
 		if (!fast)
 			nanosleep(&tc, NULL);
@@ -797,5 +790,7 @@ int main(int argc, char *argv[])
 		write(fd, rtc_ram, 26);
 		close(fd);
 	}
+	if (card)
+		memimg_close(card);
 	exit(0);
 }
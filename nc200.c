@@ -54,20 +54,26 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/mman.h>
 
 #include <SDL2/SDL.h>
 
 #include "keymatrix.h"
+#include "sdl2_texture.h"
 
 #include "libz80/z80.h"
 #include "lib765/include/765.h"
 #include "z80dis.h"
+#include "cow.h"
+#include "memimg.h"
+#include "trace.h"
+#include "vclock.h"
 
-static SDL_Window *window;
-static SDL_Renderer *render;
-static SDL_Texture *texture;
+static struct sdltex *screen;
 static uint32_t texturebits[480 * 128];
+static uint32_t pixels[256][8];	/* Each byte expanded to 8 pixels */
+static uint8_t vid_dirty[128];	/* Lines written since the last frame */
+static unsigned int vid_all = 1;	/* Whole screen needs redrawing */
+static unsigned int vid_top, vid_bottom;	/* Lines redrawn this frame */
 
 static FDC_PTR fdc;
 static FDRV_PTR drive;
@@ -77,8 +83,10 @@ struct keymatrix *matrix;
 
 static uint8_t ram[131072];
 static uint8_t rom[524288];
+static struct memimg *card;
 static uint8_t *pcmcia;			/* Battery backed usually */
 static uint32_t pcmcia_size;
+static int card_policy = MEMIMG_KERNEL;
 
 static Z80Context cpu_z80;
 static uint8_t irqmask = 0x00;
@@ -106,6 +114,12 @@ static uint8_t pctrl;
 #define PCTRL_BACKLIGHT		0x04
 
 static uint8_t fast;
+static uint64_t cycles;		/* T-states run, for the RTC */
+
+static uint64_t nc200_cycles(void)
+{
+	return cycles;
+}
 volatile int emulator_done;
 
 #define TRACE_MEM	0x000001
@@ -142,6 +156,8 @@ static uint8_t *mmu(uint16_t addr, bool write)
 		pa = ((bank & 0x3F) << 14) + addr;
 		if (pa >= pcmcia_size)
 			return NULL; 
+		if (write)
+			memimg_touch(card, pa);
 		return pcmcia + pa;
 	case 0xC0:
 		return NULL;
@@ -156,7 +172,7 @@ uint8_t mem_read(int unused, uint16_t addr)
 		fprintf(stderr, "%04X not readable\n", addr);
 		return 0xFF;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%04X -> %02X\n", addr, *p);
 	return *p;
 }
@@ -164,12 +180,19 @@ uint8_t mem_read(int unused, uint16_t addr)
 void mem_write(int unused, uint16_t addr, uint8_t val)
 {
 	uint8_t *p = mmu(addr, true);
+	unsigned int off;
 	if (p) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X <- %02X\n", addr, val);
 		*p = val;
+		/* Note writes that land in the video window */
+		if (p >= ram && p < ram + sizeof(ram)) {
+			off = p - ram - (vidbase << 8);
+			if (off < 128 * 64)
+				vid_dirty[off >> 6] = 1;
+		}
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X ROM (write %02X fail)\n", addr, val);
 	}
 }
@@ -201,7 +224,7 @@ static void nc200_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -302,7 +325,7 @@ static uint8_t rtc_ram[64];
 
 static uint8_t mc146818_read(uint8_t addr)
 {
-	time_t t = time(NULL);
+	time_t t = vclock_time();
 	struct tm *rtc_tm = localtime(&t);
 
 	/* Should never occur but don't crash if we are in nonsenseville */	
@@ -407,7 +430,7 @@ static void do_misc(uint8_t val)
 
 static void fdc_log(int debuglevel, char *fmt, va_list ap)
 {
-	if ((trace & TRACE_FDC) || debuglevel == 0) {
+	if (TRACE_ON(trace & TRACE_FDC) || debuglevel == 0) {
 		vfprintf(stderr, fmt, ap);
 	}
 }
@@ -474,15 +497,17 @@ static void nc200_reset(void)
 void io_write(int unused, uint16_t addr, uint8_t val)
 {
 	uint8_t dev = addr & 0xF0;
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "=== OUT %02X, %02X\n", addr & 0xFF, val);
 	switch(dev) {
 	case 0x00:	/* Display control (W)*/
+		if (vidbase != (val & 0xE0))
+			vid_all = 1;
 		vidbase = val & 0xE0;
 		break;
 	case 0x10:	/* Memory management (RW) */
 		bankr[addr & 3] = val;
-		if (trace & TRACE_BANK)
+		if (TRACE_ON(trace & TRACE_BANK))
 			dump_banks();
 		return;
 	case 0x20:	/* Card control (W). Also FDC control */
@@ -507,6 +532,8 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 		irqmask = val;
 		return;
 	case 0x70:	/* Power control */
+		if ((pctrl ^ val) & PCTRL_BACKLIGHT)
+			vid_all = 1;
 		pctrl = val;
 		if ((val & 0x01) == 0) {
 			/* We don't quite the program in this case because
@@ -583,47 +610,49 @@ static uint8_t do_io_read(int unused, uint16_t addr)
 uint8_t io_read(int unused, uint16_t addr)
 {
 	uint8_t r = do_io_read(unused, addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "=== IN %02X = %02X\n", addr & 0xFF, r);
 	return r;
 }
 
-/* We maybe shouldn't do it all every frame but who cares 8) */
+/* Only the lines written since the last frame are expanded again */
 static void nc200_rasterize(void)
 {
-	uint8_t *vscan = ram + (vidbase << 8);
-	uint32_t *tp = texturebits;
+	uint8_t *vscan;
+	uint32_t *tp;
 	unsigned int y, x, b;
-	uint8_t bits;
-	for (y = 0; y < 128 ; y++) {
+
+	if (vid_all) {
+		for (x = 0; x < 256; x++)
+			for (b = 0; b < 8; b++)
+				pixels[x][b] = (x & (0x80 >> b)) ? 0xFF333333 :
+					(pctrl & PCTRL_BACKLIGHT) ? 0xFFBBBBAA :
+					0xFFEEEEDD;
+	}
+	vid_top = 128;
+	vid_bottom = 0;
+	for (y = 0; y < 128; y++) {
+		if (!vid_all && !vid_dirty[y])
+			continue;
+		vid_dirty[y] = 0;
+		if (vid_top > y)
+			vid_top = y;
+		vid_bottom = y + 1;
+		/* 64 bytes a line of which the last 4 are unused */
+		vscan = ram + (vidbase << 8) + y * 64;
+		tp = texturebits + y * 480;
 		for (x = 0; x < 60; x++) {
-			bits = *vscan++;
-			for (b = 0; b < 8; b++) {
-				if (bits & 0x80)
-					*tp++ = 0xFF333333;
-				else if (!(pctrl & PCTRL_BACKLIGHT))
-					*tp++ = 0xFFEEEEDD;
-				else
-					*tp++ = 0xFFBBBBAA;
-				bits <<= 1;
-			}
+			memcpy(tp, pixels[*vscan++], sizeof(pixels[0]));
+			tp += 8;
 		}
-		vscan += 4;	/* 4 unused bytes per line */
 	}
+	vid_all = 0;
 }
 
 static void nc200_render(void)
 {
-	SDL_Rect rect;
-	
-	rect.x = rect.y = 0;
-	rect.w = 480;
-	rect.h = 128;
-
-	SDL_UpdateTexture(texture, NULL, texturebits, 480 * 4);
-	SDL_RenderClear(render);
-	SDL_RenderCopy(render, texture, NULL, &rect);
-	SDL_RenderPresent(render);
+	sdltex_dirty_span(screen, vid_top, vid_bottom);
+	sdltex_present(screen, texturebits);
 }
 
 static void swap_disk(int n)
@@ -638,7 +667,7 @@ static void swap_disk(int n)
 static void ui_event(void)
 {
 	SDL_Event ev;
-	while (SDL_PollEvent(&ev)) {
+	while (sdltex_poll_event(&ev)) {
 		switch(ev.type) {
 		/* FIXME: should fake the  magic key combo ? */
 		case SDL_QUIT:
@@ -675,7 +704,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "nc200: [-f] [-p pcmcia] [-r rompath] [-A diskpath] [-[1234] disk{n}] [-d debug]\n");
+	fprintf(stderr, "nc200: [-f] [-p pcmcia] [-P kernel|sync|exit] [-r rompath] [-A diskpath] [-[1234] disk{n}] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -687,8 +716,9 @@ int main(int argc, char *argv[])
 	char *rom_path = "nc200.rom";
 	char *pcmcia_path = NULL;
 	char *fd_path = NULL;
+	unsigned int flush_frames = 0;
 
-	while ((opt = getopt(argc, argv, "p:r:d:fA:1:2:3:4:")) != -1) {
+	while ((opt = getopt(argc, argv, "p:P:r:d:fA:1:2:3:4:")) != -1) {
 		switch (opt) {
 		case 'A':
 			fd_path = optarg;
@@ -702,6 +732,11 @@ int main(int argc, char *argv[])
 		case 'd':
 			trace = atoi(optarg);
 			break;
+		case 'P':
+			card_policy = memimg_policy(optarg);
+			if (card_policy == -1)
+				usage();
+			break;
 		case 'f':
 			fast = 1;
 			break;
@@ -735,39 +770,30 @@ int main(int argc, char *argv[])
 		close(fd);
 	}
 	if (pcmcia_path) {
-		off_t size;
-		fd = open(pcmcia_path, O_RDWR);
-		if (fd == -1) {
-			perror(pcmcia_path);
-			exit(EXIT_FAILURE);
-		}
-		size = lseek(fd, 0, SEEK_END);
-		if (size == -1) {
-			fprintf(stderr, "nc200: unable to get size of '%s'.\n", pcmcia_path);
-			exit(EXIT_FAILURE);
-		}
-		pcmcia = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED,
-			fd, 0);
-		if (pcmcia == MAP_FAILED) {
-			fprintf(stderr, "nc200: unable to map PCMCIA card image '%s'.\n",
-				pcmcia_path);
+		card = memimg_open(pcmcia_path, card_policy);
+		if (card == NULL)
 			exit(EXIT_FAILURE);
-		}
+		pcmcia = memimg_base(card);
+		pcmcia_size = memimg_size(card);
 		cardstat &= ~CSTAT_PRESENT;
-		pcmcia_size = size;
-		fprintf(stderr, "nc200: mapped %dKB PCMCIA image.\n", pcmcia_size);
+		fprintf(stderr, "nc200: mapped %dKB PCMCIA image.\n", pcmcia_size >> 10);
 	}
 
 	matrix = keymatrix_create(10, 8, keyboard);
-	keymatrix_trace(matrix, trace & TRACE_KEY);
+	keymatrix_trace(matrix, TRACE_ON(trace & TRACE_KEY));
 
 	fdc = fdc_new();
 
 	lib765_register_error_function(fdc_log);
+	/* Disk paths may be base:delta overlays */
+	fdd_setopen(cow_fopen);
 
 	drive = fd_newdsk();
 	if (fd_path)
 		fdd_setfilename(drive, fd_path);
+	/* The DSK driver keeps the image in memory and tracks dirty tracks
+	   itself, so the card policy maps onto holding writes back */
+	fdd_setwriteback(drive, card_policy != MEMIMG_KERNEL);
 
 	fd_settype(drive, FD_35);
 	fd_setheads(drive, 2);
@@ -777,41 +803,7 @@ int main(int argc, char *argv[])
 	fdc_setisr(fdc, fdc_isr);
 	fdc_setdrive(fdc, 0, drive);
 
-	atexit(SDL_Quit);
-	if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-		fprintf(stderr, "nc200: unable to initialize SDL: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	window = SDL_CreateWindow("NC200",
-			SDL_WINDOWPOS_UNDEFINED,
-			SDL_WINDOWPOS_UNDEFINED,
-			480, 128,
-			SDL_WINDOW_RESIZABLE);
-	if (window == NULL) {
-		fprintf(stderr, "nc200: unable to open window: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	render = SDL_CreateRenderer(window, -1, 0);
-	if (render == NULL) {
-		fprintf(stderr, "nc200: unable to create renderer: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	texture = SDL_CreateTexture(render, SDL_PIXELFORMAT_ARGB8888,
-		SDL_TEXTUREACCESS_STREAMING,
-		480, 128);
-	if (texture == NULL) {
-		fprintf(stderr, "nc200: unable to create texture: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	SDL_SetRenderDrawColor(render, 0, 0, 0, 255);
-	SDL_RenderClear(render);
-	SDL_RenderPresent(render);
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-	SDL_RenderSetLogicalSize(render, 480, 128);
+	screen = sdltex_create("NC200", 480, 128, 480, 128);
 
 	/* 10ms - it's a balance between nice behaviour and simulation
 	   smoothness */
@@ -819,6 +811,9 @@ int main(int argc, char *argv[])
 	tc.tv_sec = 0;
 	tc.tv_nsec = 10000000L;
 
+	/* So the card and disk images are written back */
+	signal(SIGTERM, cleanup);
+
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -834,6 +829,9 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
+	/* 60000 T-states each 5ms round the loop below */
+	vclock_set_source(nc200_cycles, 12000000, fast ? VCLOCK_ANCHORED : VCLOCK_WALL);
+
 	Z80RESET(&cpu_z80);
 	cpu_z80.ioRead = io_read;
 	cpu_z80.ioWrite = io_write;
@@ -849,17 +847,26 @@ int main(int argc, char *argv[])
 	while (!emulator_done) {
 		int i;
 		for (i = 0; i < 100; i++) {
-			Z80ExecuteTStates(&cpu_z80, 600);
+			cycles += Z80ExecuteTStates(&cpu_z80, 600);
 			fdc_tick(fdc);
 		}
 
 		/* We want to run UI events before we rasterize */
 		ui_event();
-		nc200_rasterize();
-		nc200_render();
+		if (sdltex_visible(screen)) {
+			nc200_rasterize();
+			nc200_render();
+		}
 		raise_irq(IRQ_TICK);
 		if ((~irqstat & irqmask) & 0x0F)
 			Z80INT(&cpu_z80, 0xFF);
+		if (card)
+			memimg_tick(card);
+		/* About once a second */
+		if (card_policy == MEMIMG_SYNC && ++flush_frames == 100) {
+			flush_frames = 0;
+			fdd_flush(drive);
+		}
 		/* Do 5ms of I/O and delays */
 		if (!fast)
 			nanosleep(&tc, NULL);
@@ -870,6 +877,8 @@ int main(int argc, char *argv[])
 		write(fd, rtc_ram, 64);
 		close(fd);
 	}
+	if (card)
+		memimg_close(card);
 	fd_eject(drive);
 	fdc_destroy(&fdc);
 	fd_destroy(&drive);
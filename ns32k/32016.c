@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fenv.h>
 
 #define _NS32K_PRIV
 
@@ -46,10 +47,30 @@ static int ns32016_irq;
 
 /*
  *	Simple memory interface
+ *
+ *	If the board has given us a plain memory view we read that directly,
+ *	otherwise each byte goes through ns32016_read8.
  */
+
+static const uint8_t *ram;
+static uint32_t ramsize;
+
+void ns32016_set_ram(const uint8_t *base, uint32_t size)
+{
+	ram = base;
+	ramsize = base ? size : 0;
+}
+
+/* True if len bytes from addr are in the direct memory view */
+static inline int in_ram(uint32_t addr, uint32_t len)
+{
+	return addr < ramsize && ramsize - addr >= len;
+}
  
 static uint8_t read_x8(uint32_t addr)
 {
+	if (in_ram(addr, 1))
+		return ram[addr];
 	return ns32016_read8(addr);
 }
 
@@ -59,29 +80,36 @@ static uint32_t read_n(uint32_t addr, uint32_t size)
 	addr += size;
 	while(size--) {
 		v <<= 8;
-		v |= ns32016_read8(--addr);
+		v |= read_x8(--addr);
 	}
 	return v;
 }
 
 static uint16_t read_x16(uint32_t addr)
 {
-	uint16_t r = ns32016_read8(addr);
-	r |= ns32016_read8(addr) << 8;
+	uint16_t r;
+	if (in_ram(addr, 2))
+		return ram[addr] | (ram[addr + 1] << 8);
+	r = ns32016_read8(addr);
+	r |= ns32016_read8(addr + 1) << 8;
 	return r;
 }
 
 static uint32_t read_x32(uint32_t addr)
 {
-	uint32_t r = read_x16(addr);
-	r |= read_x16(addr) << 16;
+	uint32_t r;
+	if (in_ram(addr, 4))
+		return ram[addr] | (ram[addr + 1] << 8) |
+			(ram[addr + 2] << 16) | ((uint32_t)ram[addr + 3] << 24);
+	r = read_x16(addr);
+	r |= read_x16(addr + 2) << 16;
 	return r;
 }
 
 static uint64_t read_x64(uint32_t addr)
 {
 	uint64_t r = read_x32(addr);
-	r |= ((uint64_t)read_x32(addr)) << 32;
+	r |= ((uint64_t)read_x32(addr + 4)) << 32;
 	return r;
 }
 
@@ -1052,6 +1080,169 @@ void TakeInterrupt(uint32_t IntBase)
 	pc = temp2 + temp3;
 }
 
+/* A trap entered the way SVC is, with the PC of the instruction */
+static void TakeTrap(uint32_t vector)
+{
+	uint32_t temp = psr;
+	uint32_t temp2, temp3;
+
+	psr &= ~0x700;
+	pushd((temp << 16) | mod);
+	pushd(startpc);
+	temp = read_x32(intbase + (vector * 4));
+	mod = temp & 0xFFFF;
+	temp3 = temp >> 16;
+	sb = read_x32(mod);
+	temp2 = read_x32(mod + 8);
+	pc = temp2 + temp3;
+}
+
+/*
+ *	NS32081 floating point unit
+ *
+ *	Its formats are IEEE single and double so the host does the sums,
+ *	in double and then rounded to single where needed, which gives the
+ *	same answer as doing them in single. The FSR rounding mode is put on
+ *	the host around each instruction. NaN, infinity and denormals are
+ *	reserved operands, and the part has no denormal results: those are
+ *	underflows, which give zero unless UEN is set. Invalid operation,
+ *	divide by zero and overflow always trap, underflow and inexact only
+ *	when enabled, through the SLV vector with TT saying why.
+ */
+
+#define FSR_TT		0x0007		/* Trap type */
+#define FSR_UEN		0x0008		/* Underflow trap enable */
+#define FSR_UF		0x0010		/* Underflow flag */
+#define FSR_IEN		0x0020		/* Inexact trap enable */
+#define FSR_IF		0x0040		/* Inexact flag */
+#define FSR_RM		0x0180		/* Rounding mode */
+
+#define TT_UNDERFLOW	1
+#define TT_OVERFLOW	2
+#define TT_DIVZERO	3
+#define TT_INVALID	5
+#define TT_INEXACT	6
+
+#define SLV_VECTOR	3
+
+static const int fpu_rm[4] = { FE_TONEAREST, FE_TOWARDZERO, FE_UPWARD, FE_DOWNWARD };
+
+static int fpu_reserved(uint64_t v, int dbl)
+{
+	uint32_t e;
+
+	if (dbl) {
+		e = (v >> 52) & 0x7FF;
+		return e == 0x7FF || (e == 0 && (v & 0xFFFFFFFFFFFFFULL));
+	}
+	e = (v >> 23) & 0xFF;
+	return e == 0xFF || (e == 0 && (v & 0x7FFFFF));
+}
+
+static void fpu_begin(void)
+{
+	feclearexcept(FE_ALL_EXCEPT);
+	if (FSR & FSR_RM)
+		fesetround(fpu_rm[(FSR & FSR_RM) >> 7]);
+}
+
+/* Finish an instruction with trap type tt, 0 for none */
+static uint32_t fpu_end(uint32_t tt)
+{
+	if (FSR & FSR_RM)
+		fesetround(FE_TONEAREST);
+	FSR = (FSR & ~FSR_TT) | tt;
+	return tt;
+}
+
+/* Read a float operand as a double. Returns 1 if it is reserved */
+static int fpu_get(uint32_t c, int dbl, double *v)
+{
+	if (dbl) {
+		Temp64Type t;
+		t.u64 = ReadGen64(c);
+		*v = t.f64;
+		return fpu_reserved(t.u64, 1);
+	} else {
+		Temp32Type t;
+		t.u32 = ReadGen(c);
+		*v = t.f32;
+		return fpu_reserved(t.u32, 0);
+	}
+}
+
+/* Round a result to the destination format and check what happened */
+static uint32_t fpu_put(double v, int dbl, uint32_t *temp, Temp64Type *temp64)
+{
+	int ex, tiny;
+	Temp32Type q;
+
+	if (dbl) {
+		temp64->f64 = v;
+		tiny = fpu_reserved(temp64->u64, 1);
+	} else {
+		q.f32 = (float) v;
+		tiny = fpu_reserved(q.u32, 0);
+	}
+	ex = fetestexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_INEXACT);
+	if (ex & FE_INVALID)
+		return fpu_end(TT_INVALID);
+	if (ex & FE_DIVBYZERO)
+		return fpu_end(TT_DIVZERO);
+	if (ex & FE_OVERFLOW)
+		return fpu_end(TT_OVERFLOW);
+	/* Past overflow a reserved result can only be a denormal */
+	if (tiny) {
+		if (FSR & FSR_UEN)
+			return fpu_end(TT_UNDERFLOW);
+		FSR |= FSR_UF;
+		v = signbit(v) ? -0.0 : 0.0;
+		if (dbl)
+			temp64->f64 = v;
+		else
+			q.f32 = (float) v;
+	} else if (ex & FE_INEXACT) {
+		if (FSR & FSR_IEN)
+			return fpu_end(TT_INEXACT);
+		FSR |= FSR_IF;
+	}
+	if (!dbl)
+		*temp = q.u32;
+	return fpu_end(0);
+}
+
+/* Store a whole number in an integer of size bytes, trapping if it won't fit */
+static uint32_t fpu_put_int(double v, uint32_t size, uint32_t *temp)
+{
+	double lim = ldexp(1.0, size * 8 - 1);
+
+	if (v >= lim || v < -lim)
+		return fpu_end(TT_OVERFLOW);
+	*temp = (uint32_t) (int32_t) v;
+	return fpu_end(0);
+}
+
+/*
+ *	Slave processor time: the ID byte and operation word go out, then
+ *	each operand that isn't an FPU register 16 bits a bus cycle, and the
+ *	status word comes back. rmw counts the destination both ways. exec
+ *	is the NS32081 execution time in clocks, run at the CPU clock.
+ */
+static int fpu_clocks(int exec, int rmw)
+{
+	int xfer = 3;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (Regs[i].Whole == 0xFFFF)
+			continue;
+		if (gentype[i] == Register && Regs[i].opfelder.RegType != Integer)
+			continue;
+		xfer += (OpSize.Op[i] + 1) / 2 * ((i == 1 && rmw) ? 2 : 1);
+	}
+	return exec + 4 * xfer;
+}
+
 void WarnIfShiftInvalid(uint32_t shift, uint8_t size)
 {
 	size *= 8;		// 8, 16, 32
@@ -1083,12 +1274,15 @@ uint32_t ReturnCommon(void)
 	return 0;		// OK
 }
 
-void ns32016_exec(unsigned int cycles)
+/* Run for about tstates clocks and return how many were used */
+unsigned int ns32016_exec(unsigned int tstates)
 {
+	int cycles = tstates;
 	uint32_t opcode, WriteIndex;
 	uint32_t temp = 0, temp2, temp3;
 	Temp64Type temp64;
 	uint32_t Function;
+	uint32_t tt;		// FPU trap type
 
 	if (ns32016_irq & 2) {
 		// NMI is edge sensitive, so it should be cleared here
@@ -1104,6 +1298,7 @@ void ns32016_exec(unsigned int cycles)
 		cycles -= 8;
 
 		CLEAR_TRAP();
+		tt = 0;
 
 		WriteSize = szVaries;	// The size a result may be written as
 		WriteIndex = 1;	// Default to writing operand 0
@@ -1548,17 +1743,8 @@ void ns32016_exec(unsigned int cycles)
 
 		case SVC:
 			{
-				temp = psr;
-				psr &= ~0x700;
 				// In SVC, the address pushed is the address of the SVC opcode
-				pushd((temp << 16) | mod);
-				pushd(startpc);
-				temp = read_x32(intbase + (5 * 4));
-				mod = temp & 0xFFFF;
-				temp3 = temp >> 16;
-				sb = read_x32(mod);
-				temp2 = read_x32(mod + 8);
-				pc = temp2 + temp3;
+				TakeTrap(5);
 				continue;
 			}
 			// No break due to continue
@@ -2669,231 +2855,171 @@ void ns32016_exec(unsigned int cycles)
 			// Format 9
 		case MOVif:
 			{
-				Temp32Type Src;
-				Src.u32 = ReadGen(0);
-				if (Regs[1].opfelder.RegType == DoublePrecision) {
-					temp64.f64 = (double) Src.s32;
-				} else {
-					Temp32Type q;
-					q.f32 = (float) Src.s32;
-					temp = q.u32;
-				}
+				int dbl = Regs[1].opfelder.RegType == DoublePrecision;
+				int32_t Src = ReadGen(0);
+
+				// ReadGen zero extends
+				if (OpSize.Op[0] == sz8)
+					Src = (int8_t) Src;
+				else if (OpSize.Op[0] == sz16)
+					Src = (int16_t) Src;
+				fpu_begin();
+				tt = fpu_put((double) Src, dbl, &temp, &temp64);
+				cycles -= fpu_clocks(dbl ? 62 : 54, 0);
 			}
 			break;
 
 		case LFSR:
 			{
 				FSR = ReadGen(0);
+				cycles -= fpu_clocks(18, 0);
 				continue;
 			}
 			// No break due to continue
 
 		case MOVLF:
 			{
-				Temp32Type q;
-				temp64.u64 = ReadGen64(0);
-				q.f32 = (float) temp64.f64;
-				temp = q.u32;
+				double Src;
+
+				fpu_begin();
+				if (fpu_get(0, 1, &Src))
+					tt = fpu_end(TT_INVALID);
+				else
+					tt = fpu_put(Src, 0, &temp, &temp64);
+				cycles -= fpu_clocks(46, 0);
 			}
 			break;
 
 		case MOVFL:
 			{
-				Temp32Type Src;
-				Src.u32 = ReadGen(0);
-				temp64.f64 = (double) Src.f32;
-			}
-			break;
+				double Src;
 
-		case ROUND:
-			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					temp64.u64 = ReadGen64(0);
-					//              temp = (int32_t) round(temp64.f64);
-					temp = 0;
-				} else {
-					Temp32Type q;
-					q.u32 = ReadGen(0);
-					//              temp = (int32_t) roundf(q.f32);
-					temp = 0;
-				}
+				fpu_begin();
+				if (fpu_get(0, 0, &Src))
+					tt = fpu_end(TT_INVALID);
+				else
+					tt = fpu_put(Src, 1, &temp, &temp64);
+				cycles -= fpu_clocks(38, 0);
 			}
 			break;
 
+		case ROUND:
 		case TRUNC:
+		case FLOOR:
 			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					temp64.u64 = ReadGen64(0);
-					temp = (int32_t) temp64.f64;
-				} else {
-					Temp32Type q;
-					q.u32 = ReadGen(0);
-					temp = (int32_t) q.f32;
+				int dbl = Regs[0].opfelder.RegType == DoublePrecision;
+				double Src;
+
+				fpu_begin();
+				if (fpu_get(0, dbl, &Src))
+					tt = fpu_end(TT_INVALID);
+				else {
+					// These ignore the FSR rounding mode
+					if (Function == ROUND) {
+						fesetround(FE_TONEAREST);
+						Src = nearbyint(Src);
+					} else if (Function == TRUNC)
+						Src = trunc(Src);
+					else
+						Src = floor(Src);
+					tt = fpu_put_int(Src, OpSize.Op[1], &temp);
 				}
+				cycles -= fpu_clocks(dbl ? 70 : 66, 0);
 			}
 			break;
 
 		case SFSR:
 			{
 				temp = FSR;
-			}
-			break;
-
-		case FLOOR:
-			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					temp64.u64 = ReadGen64(0);
-					//              temp = (int32_t) floor(temp64.f64);
-					temp = 0;
-				} else {
-					Temp32Type q;
-					q.u32 = ReadGen(0);
-					//             temp = (int32_t) floorf(q.f32);
-					temp = 0;
-				}
+				cycles -= fpu_clocks(14, 0);
 			}
 			break;
 
 			// Format 11
 		case ADDf:
+		case SUBf:
+		case MULf:
+		case DIVf:
 			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					Temp64Type Src;
-					Src.u64 = ReadGen64(0);
-					temp64.u64 = ReadGen64(1);
-
-					temp64.f64 += Src.f64;
-				} else {
-					Temp32Type Src, Dst;
-					Src.u32 = ReadGen(0);
-					Dst.u32 = ReadGen(1);
-
-					Dst.f32 += Src.f32;
-					temp = Dst.u32;
+				static const int exec[4][2] = {
+					{ 74, 74 }, { 74, 74 }, { 80, 108 }, { 98, 130 }
+				};
+				int dbl = Regs[0].opfelder.RegType == DoublePrecision;
+				double Src, Dst;
+				int bad;
+				int op = Function == ADDf ? 0 : Function == SUBf ? 1 : Function == MULf ? 2 : 3;
+
+				fpu_begin();
+				bad = fpu_get(0, dbl, &Src);
+				bad |= fpu_get(1, dbl, &Dst);
+				if (bad)
+					tt = fpu_end(TT_INVALID);
+				else {
+					switch (op) {
+					case 0:
+						Dst += Src;
+						break;
+					case 1:
+						Dst -= Src;
+						break;
+					case 2:
+						Dst *= Src;
+						break;
+					case 3:
+						Dst /= Src;
+						break;
+					}
+					tt = fpu_put(Dst, dbl, &temp, &temp64);
 				}
+				cycles -= fpu_clocks(exec[op][dbl], 1);
 			}
 			break;
 
 		case MOVf:
+		case NEGf:
+		case ABSf:
 			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					temp64.u64 = ReadGen64(0);
-				} else {
-					temp = ReadGen(0);
+				int dbl = Regs[0].opfelder.RegType == DoublePrecision;
+				double Src;
+
+				fpu_begin();
+				if (fpu_get(0, dbl, &Src))
+					tt = fpu_end(TT_INVALID);
+				else {
+					if (Function == NEGf)
+						Src = -Src;
+					else if (Function == ABSf)
+						Src = fabs(Src);
+					tt = fpu_put(Src, dbl, &temp, &temp64);
 				}
+				cycles -= fpu_clocks(Function == MOVf ? (dbl ? 32 : 28) : (dbl ? 34 : 30), 0);
 			}
 			break;
 
 		case CMPf:
 			{
-				L_FLAG = 0;
-
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					Temp64Type Src;
-					Src.u64 = ReadGen64(0);
-					temp64.u64 = ReadGen64(1);
-
-					Z_FLAG = TEST(Src.f64 == temp64.f64);
-					N_FLAG = TEST(Src.f64 > temp64.f64);
-				} else {
-					Temp32Type Src, Dst;
-					Src.u32 = ReadGen(0);
-					Dst.u32 = ReadGen(1);
-
-					Z_FLAG = TEST(Src.f32 == Dst.f32);
-					N_FLAG = TEST(Src.f32 > Dst.f32);
-				}
+				int dbl = Regs[0].opfelder.RegType == DoublePrecision;
+				double Src, Dst;
+				int bad;
+
+				fpu_begin();
+				bad = fpu_get(0, dbl, &Src);
+				bad |= fpu_get(1, dbl, &Dst);
+				if (bad)
+					tt = fpu_end(TT_INVALID);
+				else {
+					L_FLAG = 0;
+					Z_FLAG = TEST(Src == Dst);
+					N_FLAG = TEST(Src > Dst);
+					tt = fpu_end(0);
+				}
+				cycles -= fpu_clocks(dbl ? 62 : 58, 0);
+				if (tt)
+					break;
 				continue;
 			}
 			// No break due to continue
 
-		case SUBf:
-			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					Temp64Type Src;
-					Src.u64 = ReadGen64(0);
-					temp64.u64 = ReadGen64(1);
-
-					temp64.f64 -= Src.f64;
-				} else {
-					Temp32Type Src, Dst;
-					Src.u32 = ReadGen(0);
-					Dst.u32 = ReadGen(1);
-
-					Dst.f32 -= Src.f32;
-					temp = Dst.u32;
-				}
-			}
-			break;
-
-		case NEGf:
-			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					Temp64Type Src;
-					Src.u64 = ReadGen64(0);
-					temp64.f64 = -Src.f64;
-				} else {
-					Temp32Type Src, Dst;
-					Src.u32 = ReadGen(0);
-					Dst.f32 = -Src.f32;
-					temp = Dst.u32;
-				}
-			}
-			break;
-
-		case DIVf:
-			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					Temp64Type Src;
-					Src.u64 = ReadGen64(0);
-					temp64.u64 = ReadGen64(1);
-
-					temp64.f64 /= Src.f64;
-				} else {
-					Temp32Type Src, Dst;
-					Src.u32 = ReadGen(0);
-					Dst.u32 = ReadGen(1);
-
-					Dst.f32 /= Src.f32;
-					temp = Dst.u32;
-				}
-			}
-			break;
-
-		case MULf:
-			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					Temp64Type Src;
-					Src.u64 = ReadGen64(0);
-					temp64.u64 = ReadGen64(1);
-
-					temp64.f64 *= Src.f64;
-				} else {
-					Temp32Type Src, Dst;
-					Src.u32 = ReadGen(0);
-					Dst.u32 = ReadGen(1);
-
-					Dst.f32 *= Src.f32;
-					temp = Dst.u32;
-				}
-			}
-			break;
-
-		case ABSf:
-			{
-				if (Regs[0].opfelder.RegType == DoublePrecision) {
-					Temp64Type Src;
-					Src.u64 = ReadGen64(0);
-					temp64.f64 = fabs(Src.f64);
-				} else {
-					Temp32Type Src, Dst;
-					Src.u32 = ReadGen(0);
-					Dst.f32 = fabsf(Src.f32);
-					temp = Dst.u32;
-				}
-			}
-			break;
-
 		default:
 			{
 				if (Function < TRAP) {
@@ -2905,6 +3031,12 @@ void ns32016_exec(unsigned int cycles)
 			// No break due to goto
 		}
 
+		if (tt) {
+			// The destination is left alone
+			TakeTrap(SLV_VECTOR);
+			continue;
+		}
+
 		if (WriteSize && (WriteSize <= sz64)) {
 			switch (gentype[WriteIndex]) {
 			case Memory:
@@ -2984,4 +3116,6 @@ void ns32016_exec(unsigned int cycles)
 		}
 #endif
 	}
+	// Zero, or minus the overrun past the slice
+	return tstates - cycles;
 }
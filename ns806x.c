@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "ns806x.h"
+#include "trace.h"
 
 /*
  *	The NS8060 series aka the SC/MP and SC/MP-II
@@ -30,11 +31,16 @@ struct ns8060 {
     uint8_t input;		/* A and B bits */
 
     int trace;			/* TODO */
+
+    uint8_t *flat;		/* Plain 64K memory if the board has it */
+    int stop;			/* Set to end an ns8060_execute early */
 };
 
 
 static uint8_t mread(struct ns8060 *cpu, uint16_t addr)
 {
+    if (cpu->flat)
+        return cpu->flat[addr];
     return mem_read(cpu, addr);
 }
 
@@ -47,7 +53,10 @@ static uint16_t mread16(struct ns8060 *cpu, uint16_t addr)
 
 static void mwrite(struct ns8060 *cpu, uint16_t addr, uint8_t val)
 {
-    return mem_write(cpu, addr, val);
+    if (cpu->flat)
+        cpu->flat[addr] = val;
+    else
+        mem_write(cpu, addr, val);
 }
 
 /* Binary */
@@ -145,7 +154,7 @@ static void fetch_instruction(struct ns8060 *cpu)
 {
     cpu->p[0] = add12(cpu->p[0], 1);
     cpu->i = mread(cpu, cpu->p[0]);
-    if (cpu->trace) {
+    if (TRACE_ON(cpu->trace)) {
         fprintf(stderr, "%04X: ", cpu->p[0]);
         fprintf(stderr, "%s %02X%02X %04X %04X %04X",
             cpu_flags(cpu),
@@ -174,7 +183,7 @@ static int8_t get_off8(struct ns8060 *cpu)
     int8_t v;
     cpu->p[0] = add12(cpu->p[0], 1);
     v = mread(cpu, cpu->p[0]);
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "%02X ", v);
     return v;
 }
@@ -184,7 +193,7 @@ static uint8_t get_imm8(struct ns8060 *cpu)
     uint8_t v;
     cpu->p[0] = add12(cpu->p[0], 1);
     v = mread(cpu, cpu->p[0]);
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "%02X ", v);
     return v;
 }
@@ -338,7 +347,7 @@ static unsigned int execute_op(struct ns8060 *cpu)
     uint16_t tmp16;
     unsigned int ptr;
 
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "%02X ", cpu->i);
 
     if ((cpu->i & 0xC0) == 0xC0)
@@ -466,17 +475,46 @@ static unsigned int execute_op(struct ns8060 *cpu)
     }
 }
 
-unsigned int ns8060_execute_one(struct ns8060 *cpu)
+static unsigned int execute_one(struct ns8060 *cpu)
 {
     unsigned int clocks = 0;
     clocks += check_interrupt(cpu);
     fetch_instruction(cpu);
     clocks += execute_op(cpu);
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "\n");
     return clocks;
 }
 
+unsigned int ns8060_execute_one(struct ns8060 *cpu)
+{
+    return execute_one(cpu);
+}
+
+/* Run for at least the given clocks, or until ns8060_stop() is called by one
+   of the board helpers. Returns the clocks actually run */
+unsigned int ns8060_execute(struct ns8060 *cpu, unsigned int cycles)
+{
+    unsigned int clocks = 0;
+
+    cpu->stop = 0;
+    while (clocks < cycles && !cpu->stop)
+        clocks += execute_one(cpu);
+    return clocks;
+}
+
+void ns8060_stop(struct ns8060 *cpu)
+{
+    cpu->stop = 1;
+}
+
+/* Give the core plain memory to use instead of mem_read and mem_write. On
+   the 807x the on chip RAM and ROM still come first */
+void ns8060_set_flat(struct ns8060 *cpu, uint8_t *mem)
+{
+    cpu->flat = mem;
+}
+
 void ns8060_reset(struct ns8060 *cpu)
 {
     cpu->p[0] = 0;
@@ -496,7 +534,10 @@ struct ns8060 *ns8060_create(void)
         exit(1);
     }
     cpu->trace = 0;
+    cpu->flat = NULL;
+    cpu->stop = 0;
     ns8060_reset(cpu);
+    return cpu;
 }
 
 void ns8060_trace(struct ns8060 *cpu, unsigned int onoff)
@@ -8,6 +8,9 @@ extern struct ns8060 *ns8060_create(void);
 extern void ns8060_reset(struct ns8060 *cpu);
 extern void ns8060_trace(struct ns8060 *cpu, unsigned int onoff);
 extern unsigned int ns8060_execute_one(struct ns8060 *cpu);
+extern unsigned int ns8060_execute(struct ns8060 *cpu, unsigned int cycles);
+extern void ns8060_stop(struct ns8060 *cpu);
+extern void ns8060_set_flat(struct ns8060 *cpu, uint8_t *mem);
 extern void ns8060_seta(struct ns8060 *cpu, unsigned int a);
 extern void ns8060_setb(struct ns8060 *cpu, unsigned int b);
 
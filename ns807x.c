@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "ns807x.h"
+#include "trace.h"
 
 /*
  *	The NS8070/72/73 - "7000 series"
@@ -51,6 +52,9 @@ struct ns8070 {
     uint8_t input;
 
     int trace;			/* TODO */
+
+    uint8_t *flat;		/* Plain 64K memory if the board has it */
+    int stop;			/* Set to end an ns8070_execute early */
 };
 
 
@@ -60,6 +64,8 @@ static uint8_t mread(struct ns8070 *cpu, uint16_t addr)
         return cpu->ram[addr - 0xFFC0];
     if (cpu->rom && addr < 0xA00)
         return cpu->rom[addr];
+    if (cpu->flat)
+        return cpu->flat[addr];
     return mem_read(cpu, addr);
 }
 
@@ -74,9 +80,14 @@ static void mwrite(struct ns8070 *cpu, uint16_t addr, uint8_t val)
 {
     if (addr >= 0xFFC0)
         cpu->ram[addr - 0xFFC0] = val;
-    else if (!cpu->rom || addr >= 0xA00)
-        return mem_write(cpu, addr, val);
-    if (cpu->trace)
+    else if (!cpu->rom || addr >= 0xA00) {
+        if (cpu->flat)
+            cpu->flat[addr] = val;
+        else
+            mem_write(cpu, addr, val);
+        return;
+    }
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "Write to ROM 0x%04X<-%02X\n", addr, val);
 }
 
@@ -220,7 +231,7 @@ static void fetch_instruction(struct ns8070 *cpu)
 {
     cpu->pc++;
     cpu->i = mread(cpu, cpu->pc);
-    if (cpu->trace) {
+    if (TRACE_ON(cpu->trace)) {
         fprintf(stderr, "%04X: ", cpu->pc);
         fprintf(stderr, "%s %02X%02X %04X %04X %04X %04X",
             cpu_flags(cpu),
@@ -323,7 +334,7 @@ static unsigned int check_interrupt(struct ns8070 *cpu)
 static int8_t get_off8(struct ns8070 *cpu)
 {
     int8_t v = mread(cpu, ++cpu->pc);
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "%02X ", v);
     return v;
 }
@@ -331,7 +342,7 @@ static int8_t get_off8(struct ns8070 *cpu)
 static uint8_t get_imm8(struct ns8070 *cpu)
 {
     uint8_t v = mread(cpu, ++cpu->pc);
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "%02X ", v);
     return v;
 }
@@ -460,7 +471,7 @@ static unsigned int execute_op(struct ns8070 *cpu)
     uint8_t tmp8;
     uint16_t tmp16;
 
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "%02X ", cpu->i);
 
     /* The upper half of the instruction space has a rather more sane decode
@@ -757,17 +768,46 @@ static unsigned int execute_op(struct ns8070 *cpu)
     }
 }
 
-unsigned int ns8070_execute_one(struct ns8070 *cpu)
+static unsigned int execute_one(struct ns8070 *cpu)
 {
     unsigned int clocks = 0;
     clocks += check_interrupt(cpu);
     fetch_instruction(cpu);
     clocks += execute_op(cpu);
-    if (cpu->trace)
+    if (TRACE_ON(cpu->trace))
         fprintf(stderr, "\n");
     return clocks;
 }
 
+unsigned int ns8070_execute_one(struct ns8070 *cpu)
+{
+    return execute_one(cpu);
+}
+
+/* Run for at least the given clocks, or until ns8070_stop() is called by one
+   of the board helpers. Returns the clocks actually run */
+unsigned int ns8070_execute(struct ns8070 *cpu, unsigned int cycles)
+{
+    unsigned int clocks = 0;
+
+    cpu->stop = 0;
+    while (clocks < cycles && !cpu->stop)
+        clocks += execute_one(cpu);
+    return clocks;
+}
+
+void ns8070_stop(struct ns8070 *cpu)
+{
+    cpu->stop = 1;
+}
+
+/* Give the core plain memory to use instead of mem_read and mem_write. On
+   the 807x the on chip RAM and ROM still come first */
+void ns8070_set_flat(struct ns8070 *cpu, uint8_t *mem)
+{
+    cpu->flat = mem;
+}
+
 void ns8070_reset(struct ns8070 *cpu)
 {
     cpu->pc = 0;
@@ -787,7 +827,10 @@ struct ns8070 *ns8070_create(uint8_t *rom)
     }
     cpu->rom = rom;
     cpu->trace = 0;
+    cpu->flat = NULL;
+    cpu->stop = 0;
     ns8070_reset(cpu);
+    return cpu;
 }
 
 void ns8070_trace(struct ns8070 *cpu, unsigned int onoff)
@@ -0,0 +1,71 @@
+/*
+ *	Keep emulated time in step with the host
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include "pace.h"
+
+/* Further behind than this and we give up catching up */
+#define PACE_SLIP	100000000LL
+
+static int64_t pace_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+void pace_init(struct pace *p, uint64_t hz)
+{
+    p->hz = hz;
+    p->cycles = 0;
+    clock_gettime(CLOCK_MONOTONIC, &p->base);
+}
+
+/* Whole seconds go into the base so the sum below can't overflow and
+   odd clock rates don't drift */
+void pace_run(struct pace *p, unsigned long cycles)
+{
+    p->cycles += cycles;
+    p->base.tv_sec += p->cycles / p->hz;
+    p->cycles %= p->hz;
+}
+
+/*
+ *	Sleep until the deadline. If fd is not -1 wake early when it becomes
+ *	readable and return 1 so the board can deal with the input at once.
+ */
+int pace_wait(struct pace *p, int fd)
+{
+    struct timespec now, due;
+    struct pollfd pfd;
+    int64_t left;
+
+    due = p->base;
+    due.tv_nsec += p->cycles * 1000000000ULL / p->hz;
+    if (due.tv_nsec >= 1000000000L) {
+        due.tv_nsec -= 1000000000L;
+        due.tv_sec++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = pace_diff(&due, &now);
+    if (left <= 0) {
+        if (left < -PACE_SLIP) {
+            p->base = now;
+            p->cycles = 0;
+        }
+        return 0;
+    }
+    /* poll only does milliseconds so finish off with a sleep */
+    if (fd != -1 && left >= 1000000LL) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, left / 1000000LL) > 0)
+            return 1;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+    return 0;
+}
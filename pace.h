@@ -0,0 +1,25 @@
+#ifndef __PACE_H
+#define __PACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ *	Wall clock pacing. The board reports the cycles it has run and
+ *	pace_wait() sleeps until the host has caught up with them, so the
+ *	sleep is to an absolute deadline and host timer slack doesn't add
+ *	up. A board that falls well behind is resynced rather than left to
+ *	run flat out catching up.
+ */
+
+struct pace {
+    uint64_t hz;
+    struct timespec base;	/* Host time at which cycles was zero */
+    uint64_t cycles;		/* Run since base, kept under hz */
+};
+
+extern void pace_init(struct pace *p, uint64_t hz);
+extern void pace_run(struct pace *p, unsigned long cycles);
+extern int pace_wait(struct pace *p, int fd);
+
+#endif
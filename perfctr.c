@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "perfctr.h"
+
+/*
+ *	Guest performance counters. The board hands us its own clock and
+ *	instruction count so nothing here runs until the guest asks.
+ */
+
+static uint64_t perfctr_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void perfctr_now(struct perfctr *p, uint64_t *v)
+{
+    v[PERFCTR_TSTATES] = p->tstates();
+    v[PERFCTR_HOSTNS] = perfctr_ns();
+    v[PERFCTR_INSNS] = p->insns();
+}
+
+uint8_t perfctr_read(struct perfctr *p, uint8_t addr)
+{
+    addr &= 7;
+    if (addr == 0)
+        return PERFCTR_ID;
+    if (addr == 1)
+        return p->sel;
+    if (p->sel >= PERFCTR_COUNTERS)
+        return 0xFF;
+    return p->latch[p->sel] >> (8 * (addr - 2));
+}
+
+void perfctr_write(struct perfctr *p, uint8_t addr, uint8_t val)
+{
+    uint64_t now[PERFCTR_COUNTERS];
+    unsigned int i;
+
+    addr &= 7;
+    if (addr == 1) {
+        p->sel = val;
+        return;
+    }
+    if (addr != 0)
+        return;
+    if (val & PERFCTR_MARK) {
+        if (p->mark)
+            p->mark(val & 0x7F);
+        return;
+    }
+    perfctr_now(p, now);
+    for (i = 0; i < PERFCTR_COUNTERS; i++) {
+        if (val == PERFCTR_LATCH)
+            p->latch[i] = now[i] - p->base[i];
+        else if (val == PERFCTR_RESET) {
+            p->base[i] = now[i];
+            p->latch[i] = 0;
+        }
+    }
+}
+
+struct perfctr *perfctr_create(uint64_t (*tstates)(void),
+    uint64_t (*insns)(void), void (*mark)(unsigned int n))
+{
+    struct perfctr *p = calloc(1, sizeof(struct perfctr));
+
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    p->tstates = tstates;
+    p->insns = insns;
+    p->mark = mark;
+    /* The board's counts start from power on. The CPU may not be set up
+       yet so only the host clock is taken now */
+    p->base[PERFCTR_HOSTNS] = perfctr_ns();
+    return p;
+}
+
+void perfctr_free(struct perfctr *p)
+{
+    free(p);
+}
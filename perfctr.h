@@ -0,0 +1,47 @@
+#ifndef __PERFCTR_H
+#define __PERFCTR_H
+
+#include <stdint.h>
+
+/*
+ *	Guest performance counters. Eight ports through which a guest can
+ *	time itself in emulated clocks, instructions and host time, which
+ *	stay right when the board runs flat out.
+ *
+ *	0	Command (write) / PERFCTR_ID (read)
+ *	1	Counter shown in 2-7, one of PERFCTR_TSTATES and so on
+ *	2-7	That counter as of the last latch, 48 bits low byte first
+ *
+ *	A latch takes all three counters at once so they agree with each
+ *	other. A reset counts them from zero from then on. A mark puts the
+ *	low seven bits of the command in the execution trace, if the board
+ *	keeps one, to line up a run with a host profile.
+ */
+
+#define PERFCTR_LATCH	0x01
+#define PERFCTR_RESET	0x02
+#define PERFCTR_MARK	0x80		/* 0x80-0xFF */
+
+#define PERFCTR_TSTATES	0
+#define PERFCTR_HOSTNS	1
+#define PERFCTR_INSNS	2
+#define PERFCTR_COUNTERS 3
+
+#define PERFCTR_ID	0xC5
+
+struct perfctr {
+    uint8_t sel;
+    uint64_t latch[PERFCTR_COUNTERS];
+    uint64_t base[PERFCTR_COUNTERS];
+    uint64_t (*tstates)(void);
+    uint64_t (*insns)(void);
+    void (*mark)(unsigned int n);	/* Or NULL */
+};
+
+extern struct perfctr *perfctr_create(uint64_t (*tstates)(void),
+    uint64_t (*insns)(void), void (*mark)(unsigned int n));
+extern void perfctr_free(struct perfctr *p);
+extern uint8_t perfctr_read(struct perfctr *p, uint8_t addr);
+extern void perfctr_write(struct perfctr *p, uint8_t addr, uint8_t val);
+
+#endif
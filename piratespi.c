@@ -156,12 +156,83 @@ int piratespi_alt(struct piratespi *spi, int alt)
 	return wait_pirate_byte(spi);
 }
 
+/* Keeping several bulk commands queued hides the USB latency between
+   them. The Bus Pirate UART buffer is small so don't overdo it */
+#define PIRATE_INFLIGHT	4
+
+static int pirate_write(struct piratespi *spi, const uint8_t *p, unsigned int len)
+{
+	int r;
+	while (len) {
+		r = write(spi->fd, p, len);
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int pirate_read(struct piratespi *spi, uint8_t *p, unsigned int len)
+{
+	int r;
+	while (len) {
+		r = read(spi->fd, p, len);
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ *	Bulk transfer using the 16 byte SPI command. Up to PIRATE_INFLIGHT
+ *	commands are written ahead of the replies, each acknowledge and
+ *	reply being collected in order as the next command is queued, so a
+ *	512 byte block streams rather than paying a round trip per chunk.
+ *	in may be NULL to clock out 0xFF and out NULL to discard replies.
+ */
+int piratespi_txrx_block(struct piratespi *spi, const uint8_t *in, uint8_t *out, unsigned int len)
+{
+	uint8_t buf[17 * PIRATE_INFLIGHT];
+	uint8_t reply[17];
+	unsigned int sent = 0, done = 0, inflight = 0;
+	unsigned int n, p;
+
+	while (done < len) {
+		p = 0;
+		while (sent < len && inflight < PIRATE_INFLIGHT) {
+			n = len - sent > 16 ? 16 : len - sent;
+			buf[p++] = 0x10 | (n - 1);
+			if (in)
+				memcpy(buf + p, in + sent, n);
+			else
+				memset(buf + p, 0xFF, n);
+			p += n;
+			sent += n;
+			inflight++;
+		}
+		if (p && pirate_write(spi, buf, p))
+			return -1;
+		/* Oldest command: acknowledge then the bytes clocked in */
+		n = len - done > 16 ? 16 : len - done;
+		if (pirate_read(spi, reply, n + 1))
+			return -1;
+		if (out)
+			memcpy(out + done, reply + 1, n);
+		done += n;
+		inflight--;
+	}
+	return 0;
+}
+
 int piratespi_txrx(struct piratespi *spi, uint8_t byte)
 {
-	send_pirate_byte(spi, 0x10);
-	wait_pirate_byte(spi);
-	send_pirate_byte(spi, byte);
-	return wait_pirate_byte(spi);
+	uint8_t r;
+	if (piratespi_txrx_block(spi, &byte, &r, 1) == -1)
+		return -1;
+	return r;
 }
 
 void piratespi_free(struct piratespi *spi)
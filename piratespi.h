@@ -4,5 +4,6 @@ struct piratespi;
 int piratespi_cs(struct piratespi *spi, int cs);
 int piratespi_alt(struct piratespi *spi, int alt);
 int piratespi_txrx(struct piratespi *sp, uint8_t byte);
+int piratespi_txrx_block(struct piratespi *spi, const uint8_t *in, uint8_t *out, unsigned int len);
 void piratespi_free(struct piratespi *spi);
 struct piratespi *piratespi_create(const char *path);
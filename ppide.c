@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include "system.h"
 #include "ppide.h"
+#include "trace.h"
 
 /*
  *	Emulate PPIDE. It's not a particularly good emulation of the actual
@@ -24,20 +25,32 @@ void ppide_write(struct ppide *ppide, uint8_t addr, uint8_t val)
         case 0:	/* Port A data */
         case 1:	/* Port B data */
             ppide->pioreg[addr] = val;
-            if (ppide->trace)
+            if (TRACE_ON(ppide->trace))
                 fprintf(stderr, "Data now %04X\n", (((uint16_t)ppide->pioreg[1]) << 8) | ppide->pioreg[0]);
             break;
         case 2:	/* Port C - address/control lines */
             ppide->pioreg[addr] = val;
             if (ppide->ide == NULL)
                 return;
+            /* The data register strobes of a sector transfer. Words
+               within a sector come straight from the buffer */
+            if (val == 0x48 && changed == 0x40 && !TRACE_ON(ppide->trace)) {
+                if (ide_read16_fast(ppide->ide, &d)) {
+                    ppide->pioreg[0] = d;
+                    ppide->pioreg[1] = d >> 8;
+                    return;
+                }
+            } else if (val == 0x08 && changed == 0x20 && !TRACE_ON(ppide->trace)) {
+                if (ide_write16_fast(ppide->ide, ((uint16_t)ppide->pioreg[1] << 8) | ppide->pioreg[0]))
+                    return;
+            }
             if (val & 0x80) {
-                if (ppide->trace)
+                if (TRACE_ON(ppide->trace))
                     fprintf(stderr, "ide reset state (%02X).\n", val);
                 ide_reset_begin(ppide->ide);
                 return;
             }
-            if ((ppide->trace) && (dlow & 0x80))
+            if (TRACE_ON(ppide->trace) && (dlow & 0x80))
                 fprintf(stderr, "ide exits reset.\n");
 
             /* This register is effectively the bus to the IDE device
@@ -48,22 +61,33 @@ void ppide_write(struct ppide *ppide, uint8_t addr, uint8_t val)
             if (val & 0x10)
                 d += 2;
             if (dlow & 0x20) {
-                if (ppide->trace)
+                if (TRACE_ON(ppide->trace))
                     fprintf(stderr, "write edge: %02X = %04X\n", d,
                         ((uint16_t)ppide->pioreg[1] << 8) | ppide->pioreg[0]);
                 ide_write16(ppide->ide, d, ((uint16_t)ppide->pioreg[1] << 8) | ppide->pioreg[0]);
             } else if (dhigh & 0x40) {
                 /* Prime the data ports on the rising edge */
-                if (ppide->trace)
+                if (TRACE_ON(ppide->trace))
                     fprintf(stderr, "read edge: %02X = ", d);
                 d = ide_read16(ppide->ide, d);
-                if (ppide->trace)
+                if (TRACE_ON(ppide->trace))
                     fprintf(stderr, "%04X\n", d);
                 ppide->pioreg[0] = d;
                 ppide->pioreg[1] = d >> 8;
             }
             break;
         case 3: /* Control register */
+            /* A bit set/reset moves one port C line, as drivers that
+               strobe /RD and /WR that way expect. It goes through the
+               port C path so the sector fast path sees it too */
+            if (!(val & 0x80)) {
+                uint8_t bit = 1 << ((val >> 1) & 7);
+                if (val & 1)
+                    ppide_write(ppide, 2, ppide->pioreg[2] | bit);
+                else
+                    ppide_write(ppide, 2, ppide->pioreg[2] & ~bit);
+                return;
+            }
             /* We could check the direction bits but we don't */
             ppide->pioreg[addr] = val;
             break;
@@ -72,7 +96,7 @@ void ppide_write(struct ppide *ppide, uint8_t addr, uint8_t val)
 
 uint8_t ppide_read(struct ppide *ppide, uint8_t addr)
 {
-    if (ppide->trace)
+    if (TRACE_ON(ppide->trace))
         fprintf(stderr, "ide read %d:%02X\n", addr, ppide->pioreg[addr]);
     return ppide->pioreg[addr];
 }
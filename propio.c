@@ -6,6 +6,8 @@
 #include <fcntl.h>
 
 #include "propio.h"
+#include "console.h"
+#include "trace.h"
 
 /* PropIO v2 */
 
@@ -31,6 +33,10 @@ struct propio {
     uint8_t err;
     int fd;
     off_t cardsize;
+    uint8_t *ahead;	/* Read ahead buffer or NULL */
+    unsigned int ahead_max;	/* Sectors it holds */
+    unsigned int ahead_len;	/* Sectors valid */
+    uint32_t ahead_lba;	/* First sector in it */
     unsigned int input;
     unsigned int trace;
 };
@@ -57,6 +63,36 @@ static void u32tobuf(struct propio *prop, uint32_t t)
     prop->rlen = 4;
 }
 
+/* Guests read the card in order so fetch a run of sectors at once
+   when asked to. Returns the sector data or NULL */
+static uint8_t *propio_sector(struct propio *prop, uint32_t lba)
+{
+    ssize_t n;
+
+    if (prop->ahead == NULL) {
+        if (pread(prop->fd, prop->sbuf, 512, (off_t)lba << 9) != 512)
+            return NULL;
+        return prop->sbuf;
+    }
+    if (lba - prop->ahead_lba < prop->ahead_len)
+        return prop->ahead + ((lba - prop->ahead_lba) << 9);
+    n = pread(prop->fd, prop->ahead, prop->ahead_max << 9, (off_t)lba << 9);
+    if (n < 512) {
+        prop->ahead_len = 0;
+        return NULL;
+    }
+    prop->ahead_lba = lba;
+    prop->ahead_len = n >> 9;
+    return prop->ahead;
+}
+
+/* Keep the read ahead copy in step with a sector just written */
+static void propio_ahead_update(struct propio *prop, uint32_t lba)
+{
+    if (prop->ahead && lba - prop->ahead_lba < prop->ahead_len)
+        memcpy(prop->ahead + ((lba - prop->ahead_lba) << 9), prop->sbuf, 512);
+}
+
 uint8_t propio_read(struct propio *prop, uint8_t addr)
 {
     uint8_t r, v;
@@ -81,13 +117,13 @@ uint8_t propio_read(struct propio *prop, uint8_t addr)
         return prop->st;
     case 3:		/* Data transfer */
         if (prop->rlen) {
-            if (prop->trace)
+            if (TRACE_ON(prop->trace))
                 fprintf(stderr, "propio: read byte %02X\n", *prop->rptr);
             prop->rlen--;
             return *prop->rptr++;
         }
         else {
-            if (prop->trace)
+            if (TRACE_ON(prop->trace))
                 fprintf(stderr, "propio: read byte - empty.\n");
             return 0xFF; 
         }
@@ -98,6 +134,7 @@ uint8_t propio_read(struct propio *prop, uint8_t addr)
 void propio_write(struct propio *prop, uint8_t addr, uint8_t val)
 {
     off_t lba;
+    uint8_t *sec;
 
     addr &= 3;
 
@@ -107,10 +144,10 @@ void propio_write(struct propio *prop, uint8_t addr, uint8_t val)
             break;
         case 1:
             /* write to screen */
-            write(1, &val, 1);
+            console_putc(val);
             break;
         case 2:
-            if (prop->trace)
+            if (TRACE_ON(prop->trace))
                 fprintf(stderr, "Command %02X\n", val);
             /* commands */
             switch(val) {
@@ -170,16 +207,14 @@ void propio_write(struct propio *prop, uint8_t addr, uint8_t val)
                 }
                 break;
             case 0x30:	/* READ */
-                lba = buftou32(prop);
-                lba <<= 9;
                 prop->err = 0;
                 prop->st = 0;
-                if (lseek(prop->fd, lba, SEEK_SET) < 0 ||
-                    read(prop->fd, prop->sbuf, 512) != 512) {
+                sec = propio_sector(prop, buftou32(prop));
+                if (sec == NULL) {
                     prop->err = -6;
                     /* Do error packet FIXME */
                 } else {
-                    prop->rptr = prop->sbuf;
+                    prop->rptr = sec;
                     prop->rlen = sizeof(prop->sbuf);
                 }
                 prop->tptr = prop->rbuf;
@@ -197,11 +232,11 @@ void propio_write(struct propio *prop, uint8_t addr, uint8_t val)
                 lba <<= 9;
                 prop->err = 0;
                 prop->st = 0;
-                if (lseek(prop->fd, lba, SEEK_SET) < 0 ||
-                    write(prop->fd, prop->sbuf, 512) != 512) {
+                if (pwrite(prop->fd, prop->sbuf, 512, lba) != 512) {
                     prop->err = -6;
                     /* FIXME: do error packet */
                 }
+                propio_ahead_update(prop, lba >> 9);
                 prop->tptr = prop->rbuf;
                 prop->tlen = 4;
                 break;
@@ -212,7 +247,7 @@ void propio_write(struct propio *prop, uint8_t addr, uint8_t val)
                 memcpy(prop->rbuf,"\x9F\x00\x0E\x03", 4);
                 break;
             default:
-                if (prop->trace)
+                if (TRACE_ON(prop->trace))
                     fprintf(stderr, "propio: unknown command %02X\n", val);
                 break;
             }
@@ -220,11 +255,11 @@ void propio_write(struct propio *prop, uint8_t addr, uint8_t val)
         case 3:
             /* data write */
             if (prop->tlen) {
-                if (prop->trace)
+                if (TRACE_ON(prop->trace))
                     fprintf(stderr, "propio: queue byte %02X\n", val);
                 *prop->tptr++ = val;
                 prop->tlen--;
-            } else if (prop->trace)
+            } else if (TRACE_ON(prop->trace))
                 fprintf(stderr, "propio: write byte over.\n");
             break;
     }
@@ -263,6 +298,7 @@ void propio_free(struct propio *prop)
 {
     if (prop->fd != -1)
         close(prop->fd);
+    free(prop->ahead);
     free(prop);
 }
 
@@ -279,6 +315,22 @@ void propio_set_input(struct propio *prop, int onoff)
     prop->input = onoff;
 }
 
+/* Read this many sectors at a time, or 0 to read each as asked */
+void propio_readahead(struct propio *prop, unsigned int sectors)
+{
+    free(prop->ahead);
+    prop->ahead = NULL;
+    prop->ahead_len = 0;
+    prop->ahead_max = sectors;
+    if (sectors == 0)
+        return;
+    prop->ahead = malloc(sectors << 9);
+    if (prop->ahead == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+}
+
 void propio_trace(struct propio *prop, int onoff)
 {
     prop->trace = onoff;
@@ -6,6 +6,7 @@ struct propio *propio_create(const char *path);
 void propio_free(struct propio *prop);
 void propio_reset(struct propio *prop);
 void propio_set_input(struct propio *prop, int onoff);
+void propio_readahead(struct propio *prop, unsigned int sectors);
 void propio_trace(struct propio *prop, int onoff);
 
 /* Caller proviced */
@@ -10,6 +10,7 @@
 
 #define PS2_INTERNAL
 #include "ps2.h"
+#include "trace.h"
 
 /* Replace with a table */
 static int parity_even(uint8_t b)
@@ -34,7 +35,7 @@ static int ps2_state_idle(struct ps2 *ps2, int clocks)
     /* Go into host wait mode as it wants to talk to us */
     if (ps2->clock_in == 0) {
         ps2->busy = 1;
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2 host pulled clock low for receive.\n");
         ps2_abort(ps2);
     }
@@ -43,7 +44,7 @@ static int ps2_state_idle(struct ps2 *ps2, int clocks)
 
 static void ps2_idle(struct ps2 *ps2)
 {
-    if (ps2->trace)
+    if (TRACE_ON(ps2->trace))
         fprintf(stderr, "PS2 goes idle.\n");
     ps2->state = ps2_state_idle;
     ps2->clock_out = 1;
@@ -65,7 +66,7 @@ static int ps2_wait_host_2(struct ps2 *ps2, int clocks)
     ps2->receive = 0;	/* Clear receive buffer */
     ps2->step = 0;
     ps2->wait = DELAY_BIT_TO_CLOCK;
-    if (ps2->trace)
+    if (TRACE_ON(ps2->trace))
         fprintf(stderr, "PS2 ready to receive.\n");
     return clocks;
 }
@@ -80,7 +81,7 @@ static int ps2_wait_host(struct ps2 *ps2, int clocks)
         return 0;
     }
     if (ps2->data_in == 0) {
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2 host pulled data low for receive.\n");
         ps2->state = ps2_wait_host_2;
         return clocks;
@@ -112,13 +113,13 @@ static int ps2_send_byte(struct ps2 *ps2, int clocks)
     /* Load a bit onto the bus with the clock high */
     if (ps2->step == 1) {		/* Data */
         if (ps2->clock_in == 0) {	/* Pulled low by remote */
-            if (ps2->trace)
+            if (TRACE_ON(ps2->trace))
                 fprintf(stderr, "PS2: Host aborted our transmit bits left %d.\n",
                     ps2->count);
             ps2_abort(ps2);
             return clocks;
         }
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2: load bit for host.\n");
         if (ps2->trace && ps2->data_in == 0)
             fprintf(stderr, "PS2: **error** host has data pulled down.\n");
@@ -129,7 +130,7 @@ static int ps2_send_byte(struct ps2 *ps2, int clocks)
     }
     /* Pull the clock low - the remote will then read the bit */
     if (ps2->step == 2)	{	/* Clock toggle */
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2: clock low - bit ready for host (%d).\n", ps2->data_out);
         ps2->clock_out = 0;
         ps2->wait = DELAY_BIT_TO_CLOCK;
@@ -137,7 +138,7 @@ static int ps2_send_byte(struct ps2 *ps2, int clocks)
     }
     /* Pull the clock high indicating we are going to send a new bit */
     if (ps2->step == 3) {
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2: clock back high on send.\n");
         ps2->clock_out = 1;
         ps2->wait = DELAY_BIT_TO_CLOCK;
@@ -168,7 +169,7 @@ static int ps2_send_wait(struct ps2 *ps2, int clocks)
         return 0;
     /* The host has let the clock float, we can talk - in 50ms time. If it
        pulls it low again it will abort */
-    if (ps2->trace)
+    if (TRACE_ON(ps2->trace))
         fprintf(stderr, "PS2: host has released clock.\n");
     ps2->state = ps2_send_byte;
     ps2->wait = DELAY_SEND_BYTE;
@@ -190,7 +191,7 @@ static void ps2_begin_sending(struct ps2 *ps2, uint8_t byte)
     ps2->busy = 1;
     ps2->state = ps2_send_wait;
     ps2->count = 11;		/* Send 11 bits */
-    if (ps2->trace)
+    if (TRACE_ON(ps2->trace))
         fprintf(stderr, "PS2: begin sending %02X (%X).\n", byte, r);
 }
 
@@ -214,7 +215,7 @@ static int ps2_ack_byte(struct ps2 *ps2, int clocks)
             return 0;
         }
         ps2->wait = DELAY_BIT_TO_CLOCK;
-        if (ps2->trace)	
+        if (TRACE_ON(ps2->trace))	
             fprintf(stderr, "PS2: host released data line.\n");
         return clocks;
     }
@@ -222,7 +223,7 @@ static int ps2_ack_byte(struct ps2 *ps2, int clocks)
     if (ps2->step == 2) {
         ps2->data_out = 0;
         ps2->wait = DELAY_BIT_TO_CLOCK;
-        if (ps2->trace)	
+        if (TRACE_ON(ps2->trace))	
             fprintf(stderr, "PS2: pull data low.\n");
         return clocks;
     }
@@ -230,7 +231,7 @@ static int ps2_ack_byte(struct ps2 *ps2, int clocks)
     if (ps2->step == 3) {
         ps2->clock_out = 0;
         ps2->wait = DELAY_BIT_TO_CLOCK;
-        if (ps2->trace)	
+        if (TRACE_ON(ps2->trace))	
             fprintf(stderr, "PS2: pull clock low.\n");
         return clocks;
     }
@@ -240,7 +241,7 @@ static int ps2_ack_byte(struct ps2 *ps2, int clocks)
         ps2->data_out = 1;
         /* And the cycle is over */
         /* Process the byte that arrived */
-        if (ps2->trace) {
+        if (TRACE_ON(ps2->trace)) {
             fprintf(stderr, "PS2: release clock and data.\n");
             fprintf(stderr, "PS2: received %04X.\n", ps2->receive);
         }
@@ -274,7 +275,7 @@ static int ps2_receive_byte(struct ps2 *ps2, int clocks)
     if (ps2->step == 1) {
         ps2->clock_out = 0;
         ps2->wait = DELAY_BIT_TO_CLOCK;
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2: receive clock low\n");
         return --clocks;
     }
@@ -282,7 +283,7 @@ static int ps2_receive_byte(struct ps2 *ps2, int clocks)
     if (ps2->step == 2) {
         ps2->clock_out = 1;
         ps2->wait = DELAY_BIT_TO_CLOCK;
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2: receive clock high\n");
         return --clocks;
     }
@@ -294,7 +295,7 @@ static int ps2_receive_byte(struct ps2 *ps2, int clocks)
         /* FIXME: should also consider data_out being low */
         ps2->receive |= (ps2->data_in) ? (1 << 9) : 0;
         ps2->wait = DELAY_BIT_TO_CLOCK;
-        if (ps2->trace)
+        if (TRACE_ON(ps2->trace))
             fprintf(stderr, "PS2: sample - %d\n", ps2->data_in);
         return --clocks;
     }
@@ -345,7 +346,7 @@ static void ps2_queue_reply(struct ps2 *ps2, uint8_t r)
     if (ps2->rbufptr == PS2_BUFSIZ)
         return;
     ps2->rbuffer[ps2->rbufptr++] = r;
-    if (ps2->trace)
+    if (TRACE_ON(ps2->trace))
         fprintf(stderr, "PS2: queued reply %02X rbufptr %d\n", r, ps2->rbufptr);
 }
 
@@ -510,6 +511,43 @@ void ps2_event(struct ps2 *ps2, unsigned int clocks)
     ps2_poll(ps2);
 }
 
+/*
+ *	How many more ps2_event calls of this size would do nothing but
+ *	count down a delay, or PS2_IDLE if nothing will happen until the
+ *	host moves a line or a byte is queued. Lets the caller skip the
+ *	calls in between without changing the timing.
+ */
+unsigned int ps2_quiet(struct ps2 *ps2, unsigned int clocks)
+{
+    unsigned int n = clocks / ps2->divider;
+
+    if (ps2->state == ps2_state_idle) {
+        if (ps2->clock_in && (ps2->busy || (!ps2->rbufptr && !ps2->bufptr)))
+            return PS2_IDLE;
+        return 0;
+    }
+    if (ps2->state == ps2_wait_host) {
+        if (ps2->clock_in || ps2->data_in == 0)
+            return 0;
+        return PS2_IDLE;
+    }
+    if (ps2->state == ps2_wait_host_2 || ps2->state == ps2_send_wait)
+        return ps2->clock_in ? 0 : PS2_IDLE;
+    /* Sending, receiving or acking. A receive aborts at once if the host
+       pulls the clock */
+    if (ps2->state == ps2_receive_byte && ps2->clock_in == 0)
+        return 0;
+    if (n == 0 || ps2->wait == 0)
+        return 0;
+    return (ps2->wait - 1) / n;
+}
+
+/* Skip n calls of ps2_event that ps2_quiet said would only count down */
+void ps2_skip(struct ps2 *ps2, unsigned int clocks, unsigned int n)
+{
+    ps2->wait -= n * (clocks / ps2->divider);
+}
+
 void ps2_trace(struct ps2 *ps2, int onoff)
 {
     ps2->trace = onoff;
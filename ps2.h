@@ -52,5 +52,9 @@ void ps2_set_lines(struct ps2 *ps2, unsigned int clock, unsigned int data);
 unsigned int ps2_get_clock(struct ps2 *ps2);
 unsigned int ps2_get_data(struct ps2 *ps2);
 void ps2_event(struct ps2 *ps2, unsigned int clocks);
+unsigned int ps2_quiet(struct ps2 *ps2, unsigned int clocks);
+void ps2_skip(struct ps2 *ps2, unsigned int clocks, unsigned int n);
+
+#define PS2_IDLE	(~0U)
 void ps2_trace(struct ps2 *ps2, int onoff);
 void ps2_queue_byte(struct ps2 *ps2, uint8_t byte);
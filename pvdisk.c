@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pvdisk.h"
+#include "trace.h"
+
+/*
+ *	Paravirtual disk on the first drive of an IDE controller
+ */
+
+static uint32_t pvdisk_lba(struct pvdisk *pv)
+{
+    return pv->reg[0] | (pv->reg[1] << 8) | (pv->reg[2] << 16) |
+        ((uint32_t)pv->reg[3] << 24);
+}
+
+static void pvdisk_set_lba(struct pvdisk *pv, uint32_t lba)
+{
+    pv->reg[0] = lba;
+    pv->reg[1] = lba >> 8;
+    pv->reg[2] = lba >> 16;
+    pv->reg[3] = lba >> 24;
+}
+
+static uint16_t pvdisk_addr(struct pvdisk *pv)
+{
+    return pv->reg[5] | (pv->reg[6] << 8);
+}
+
+static void pvdisk_set_addr(struct pvdisk *pv, uint16_t addr)
+{
+    pv->reg[5] = addr;
+    pv->reg[6] = addr >> 8;
+}
+
+/* Returns the sectors moved */
+static unsigned int pvdisk_command(struct pvdisk *pv, uint8_t cmd)
+{
+    uint32_t lba = pvdisk_lba(pv);
+    uint16_t addr = pvdisk_addr(pv);
+    unsigned int n = pv->reg[4];
+    int err = 0;
+
+    if (TRACE_ON(pv->trace))
+        fprintf(stderr, "pvdisk: command %02X LBA %u count %u address %04X\n",
+            cmd, lba, n, addr);
+    switch (cmd) {
+    case PVDISK_READ:
+        if (n == 0 || n > 128 || (err = ide_transfer(pv->ide, 0, lba, pv->buf, n, 0)))
+            break;
+        guestmem_put(&pv->mem, addr, pv->buf, 512 * n);
+        pvdisk_set_lba(pv, lba + n);
+        pvdisk_set_addr(pv, addr + 512 * n);
+        pv->reg[7] = PVDISK_READY;
+        return n;
+    case PVDISK_WRITE:
+        if (n == 0 || n > 128)
+            break;
+        guestmem_get(&pv->mem, addr, pv->buf, 512 * n);
+        if ((err = ide_transfer(pv->ide, 0, lba, pv->buf, n, 1)))
+            break;
+        pvdisk_set_lba(pv, lba + n);
+        pvdisk_set_addr(pv, addr + 512 * n);
+        pv->reg[7] = PVDISK_READY;
+        return n;
+    case PVDISK_FLUSH:
+        if ((err = ide_transfer_flush(pv->ide, 0)))
+            break;
+        pv->reg[7] = PVDISK_READY;
+        return 0;
+    case PVDISK_SIZE:
+        pvdisk_set_lba(pv, ide_capacity(pv->ide, 0));
+        pv->reg[7] = PVDISK_READY;
+        return 0;
+    }
+    if (TRACE_ON(pv->trace))
+        fprintf(stderr, "pvdisk: command %02X failed: %s\n", cmd,
+            err ? strerror(err) : "bad request");
+    pv->reg[7] = PVDISK_READY | PVDISK_ERR;
+    return 0;
+}
+
+uint8_t pvdisk_read(struct pvdisk *pv, uint8_t addr)
+{
+    return pv->reg[addr & 7];
+}
+
+/* Returns the clocks the write took */
+unsigned int pvdisk_write(struct pvdisk *pv, uint8_t addr, uint8_t val)
+{
+    addr &= 7;
+    if (addr == 7)
+        return pvdisk_command(pv, val) * pv->cost;
+    pv->reg[addr] = val;
+    return 0;
+}
+
+void pvdisk_reset(struct pvdisk *pv)
+{
+    memset(pv->reg, 0, sizeof(pv->reg));
+    pv->reg[7] = PVDISK_READY;
+}
+
+struct pvdisk *pvdisk_create(struct ide_controller *ide, unsigned int cost,
+    uint8_t (*mem_read)(int unused, uint16_t addr),
+    void (*mem_write)(int unused, uint16_t addr, uint8_t val))
+{
+    struct pvdisk *pv = calloc(1, sizeof(struct pvdisk));
+    if (pv == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    pv->ide = ide;
+    pv->cost = cost;
+    guestmem_init(&pv->mem, mem_read, mem_write);
+    pvdisk_reset(pv);
+    return pv;
+}
+
+void pvdisk_free(struct pvdisk *pv)
+{
+    free(pv);
+}
+
+void pvdisk_trace(struct pvdisk *pv, int onoff)
+{
+    pv->trace = onoff;
+}
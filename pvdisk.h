@@ -0,0 +1,52 @@
+#ifndef __PVDISK_H
+#define __PVDISK_H
+
+#include <stdint.h>
+#include "ide.h"
+#include "guestmem.h"
+
+/*
+ *	Paravirtual disk. Eight ports in front of an IDE drive's image that
+ *	skip the taskfile: load the LBA, a sector count and a memory address
+ *	and write a command, and the sectors are copied between the image
+ *	and memory before the OUT finishes.
+ *
+ *	0-3	LBA, low byte first
+ *	4	Sector count, 1-128
+ *	5-6	Memory address, low byte first
+ *	7	Command (write) / status (read)
+ *
+ *	After a transfer the LBA and address registers point past the end so
+ *	a run of commands can just keep going. PVDISK_SIZE loads the LBA
+ *	registers with the number of sectors on the disk.
+ */
+
+#define PVDISK_READ	0x20		/* Disk to memory */
+#define PVDISK_WRITE	0x30		/* Memory to disk */
+#define PVDISK_FLUSH	0xE7		/* Push the writes to the host disk */
+#define PVDISK_SIZE	0xEC
+
+#define PVDISK_ERR	0x01		/* Status: the last command failed */
+#define PVDISK_READY	0x40
+
+#define PVDISK_REGS	8
+
+struct pvdisk {
+    uint8_t reg[PVDISK_REGS];
+    struct ide_controller *ide;
+    unsigned int cost;			/* Clocks to charge a sector */
+    struct guestmem mem;
+    uint8_t buf[128 * 512];
+    unsigned int trace;
+};
+
+extern struct pvdisk *pvdisk_create(struct ide_controller *ide, unsigned int cost,
+    uint8_t (*mem_read)(int unused, uint16_t addr),
+    void (*mem_write)(int unused, uint16_t addr, uint8_t val));
+extern void pvdisk_free(struct pvdisk *pv);
+extern void pvdisk_reset(struct pvdisk *pv);
+extern void pvdisk_trace(struct pvdisk *pv, int onoff);
+extern uint8_t pvdisk_read(struct pvdisk *pv, uint8_t addr);
+extern unsigned int pvdisk_write(struct pvdisk *pv, uint8_t addr, uint8_t val);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ *	Quantum sync between a primary CPU and secondaries on host threads
+ *
+ *	Each secondary counts the slices it has been granted and the ones it
+ *	has run. The primary counts slices locally and only takes the lock
+ *	once per quantum. A secondary may fall at most backlog slices behind
+ *	before the primary waits for it, which keeps the pair in step when
+ *	running against real time. Only the forking thread survives fork()
+ *	so the fork server child gets new threads for every secondary.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "qsync.h"
+
+#define MAX_QSYNC	16
+
+struct qsync {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		/* More slices granted */
+	pthread_cond_t done_cv;		/* Some granted slices done */
+	void (*run)(void *priv);
+	void *priv;
+	unsigned long granted;
+	unsigned long done;
+	unsigned int pending;		/* Slices not yet handed over */
+	unsigned int quantum;
+	unsigned int backlog;
+	int quit;
+};
+
+static struct qsync *qsyncs[MAX_QSYNC];
+static int qsync_atfork;
+
+static void *qsync_thread(void *p)
+{
+	struct qsync *q = p;
+	unsigned long n, i;
+
+	pthread_mutex_lock(&q->lock);
+	while (1) {
+		while (q->done == q->granted && !q->quit)
+			pthread_cond_wait(&q->wake, &q->lock);
+		if (q->quit)
+			break;
+		n = q->granted - q->done;
+		pthread_mutex_unlock(&q->lock);
+		for (i = 0; i < n; i++)
+			q->run(q->priv);
+		pthread_mutex_lock(&q->lock);
+		q->done += n;
+		pthread_cond_broadcast(&q->done_cv);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+static void qsync_start(struct qsync *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->wake, NULL);
+	pthread_cond_init(&q->done_cv, NULL);
+	q->quit = 0;
+	if (pthread_create(&q->thread, NULL, qsync_thread, q)) {
+		fprintf(stderr, "qsync: unable to start thread.\n");
+		exit(1);
+	}
+}
+
+/* Hand over the slices we are holding, waiting if too far behind */
+static void qsync_grant(struct qsync *q)
+{
+	if (q->pending == 0)
+		return;
+	pthread_mutex_lock(&q->lock);
+	q->granted += q->pending;
+	q->pending = 0;
+	pthread_cond_signal(&q->wake);
+	while (q->granted - q->done > q->backlog)
+		pthread_cond_wait(&q->done_cv, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* The secondaries are idle and their locks held across a fork */
+static void qsync_prefork(void)
+{
+	int i;
+	for (i = 0; i < MAX_QSYNC; i++) {
+		if (qsyncs[i]) {
+			qsync_sync(qsyncs[i]);
+			pthread_mutex_lock(&qsyncs[i]->lock);
+		}
+	}
+}
+
+static void qsync_postfork(void)
+{
+	int i;
+	for (i = 0; i < MAX_QSYNC; i++)
+		if (qsyncs[i])
+			pthread_mutex_unlock(&qsyncs[i]->lock);
+}
+
+static void qsync_childfork(void)
+{
+	int i;
+	for (i = 0; i < MAX_QSYNC; i++)
+		if (qsyncs[i])
+			qsync_start(qsyncs[i]);
+}
+
+/*
+ *	Create a secondary that calls run(priv) for each slice. Slices are
+ *	handed over quantum at a time and it may be up to backlog slices
+ *	behind the primary.
+ */
+struct qsync *qsync_create(void (*run)(void *priv), void *priv,
+	unsigned int quantum, unsigned int backlog)
+{
+	struct qsync *q;
+	int i;
+
+	for (i = 0; i < MAX_QSYNC; i++)
+		if (qsyncs[i] == NULL)
+			break;
+	if (i == MAX_QSYNC) {
+		fprintf(stderr, "qsync: too many CPUs.\n");
+		exit(1);
+	}
+	q = calloc(1, sizeof(struct qsync));
+	if (q == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	if (!qsync_atfork) {
+		pthread_atfork(qsync_prefork, qsync_postfork, qsync_childfork);
+		qsync_atfork = 1;
+	}
+	q->run = run;
+	q->priv = priv;
+	q->quantum = quantum ? quantum : 1;
+	q->backlog = backlog < q->quantum ? q->quantum : backlog;
+	qsync_start(q);
+	qsyncs[i] = q;
+	return q;
+}
+
+void qsync_free(struct qsync *q)
+{
+	int i;
+
+	qsync_sync(q);
+	pthread_mutex_lock(&q->lock);
+	q->quit = 1;
+	pthread_cond_signal(&q->wake);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->thread, NULL);
+	for (i = 0; i < MAX_QSYNC; i++)
+		if (qsyncs[i] == q)
+			qsyncs[i] = NULL;
+	free(q);
+}
+
+/* One slice of primary time has gone by */
+void qsync_tick(struct qsync *q)
+{
+	if (++q->pending >= q->quantum)
+		qsync_grant(q);
+}
+
+/* Wait for the secondary to run every slice so far. Call before touching
+   anything shared with it */
+void qsync_sync(struct qsync *q)
+{
+	qsync_grant(q);
+	pthread_mutex_lock(&q->lock);
+	while (q->done != q->granted)
+		pthread_cond_wait(&q->done_cv, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
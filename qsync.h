@@ -0,0 +1,22 @@
+#ifndef __QSYNC_H
+#define __QSYNC_H
+
+/*
+ *	Quantum sync. A secondary CPU runs on its own host thread, one
+ *	slice at a time, through slices the primary CPU hands it as its own
+ *	time goes by. The primary hands them over in quanta so the two run
+ *	in parallel, and before it touches anything the two share (a latch,
+ *	a mailbox, dual port RAM) it calls qsync_sync() to wait for the
+ *	secondary to catch up. The secondary then sees exactly the timing it
+ *	would have seen if its slices had been run in line.
+ */
+
+struct qsync;
+
+extern struct qsync *qsync_create(void (*run)(void *priv), void *priv,
+	unsigned int quantum, unsigned int backlog);
+extern void qsync_free(struct qsync *q);
+extern void qsync_tick(struct qsync *q);
+extern void qsync_sync(struct qsync *q);
+
+#endif
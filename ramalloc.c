@@ -0,0 +1,89 @@
+/*
+ *	Lazily committed guest memory
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ramalloc.h"
+
+/* Page aligned, so a snapshot can also be mapped over it. With
+   RAM_MERGEABLE set in the environment the pages are offered to KSM so
+   instances running the same image share identical memory */
+uint8_t *ram_alloc(size_t size)
+{
+	uint8_t *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+#ifdef MADV_MERGEABLE
+	if (getenv("RAM_MERGEABLE") && madvise(p, size, MADV_MERGEABLE))
+		perror("madvise");
+#endif
+	return p;
+}
+
+/* A word at a time from a fixed xorshift, as rand() per byte was most of
+   the startup time for the 1MB boards */
+void ram_scramble(uint8_t *p, size_t len)
+{
+	static uint64_t x = 0x9E3779B97F4A7C15ULL;
+	uint8_t *e = p + len;
+
+	while (p < e) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		if (e - p < 8) {
+			memcpy(p, &x, e - p);
+			break;
+		}
+		memcpy(p, &x, 8);
+		p += 8;
+	}
+}
+
+void ram_free(uint8_t *p, size_t size)
+{
+	munmap(p, size);
+}
+
+/*
+ *	Like read() from the current offset. The part of the image that is
+ *	page aligned in both the file and memory and lies within the file is
+ *	mapped rather than copied. Everything else is read as normal.
+ */
+ssize_t ram_load(int fd, uint8_t *p, size_t len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t off = lseek(fd, 0, SEEK_CUR);
+	struct stat st;
+	size_t map = 0;
+	ssize_t r;
+
+	if (off != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    off < st.st_size && !(off % pagesize) &&
+	    !((uintptr_t)p % pagesize)) {
+		map = len;
+		if (map > st.st_size - off)
+			map = st.st_size - off;
+		map &= ~(size_t)(pagesize - 1);
+		if (map && mmap(p, map, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, fd, off) == MAP_FAILED)
+			map = 0;
+		if (map && lseek(fd, off + map, SEEK_SET) == -1)
+			return -1;
+	}
+	if (map == len)
+		return len;
+	r = read(fd, p + map, len - map);
+	if (r < 0)
+		return map ? (ssize_t)map : -1;
+	return map + r;
+}
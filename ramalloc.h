@@ -0,0 +1,25 @@
+#ifndef __RAMALLOC_H
+#define __RAMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ *	Guest memory. This is an anonymous mapping, so the kernel only
+ *	commits pages the guest touches. Power-on RAM is random, but only
+ *	over the range the configured board can reach. Anything past that
+ *	stays as untouched zero pages. The scramble is the same every run
+ *	so KSM can still merge it between instances.
+ *
+ *	ram_load() is read() for ROM images. Whole pages are mapped copy on
+ *	write from the file, so instances using the same ROM share it in the
+ *	page cache until something such as flash emulation writes to it.
+ */
+
+extern uint8_t *ram_alloc(size_t size);
+extern void ram_scramble(uint8_t *p, size_t len);
+extern void ram_free(uint8_t *p, size_t size);
+extern ssize_t ram_load(int fd, uint8_t *p, size_t len);
+
+#endif
@@ -5,37 +5,53 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "ramf.h"
+#include "trace.h"
 
 /*
  *	RAMF Battery Backed RAM Disk
+ *
+ *	Two units each with half the space. The image is mapped once and
+ *	each unit keeps a pointer to its next byte which only has to be
+ *	worked out again when the sector registers are loaded.
  */
 
 struct ramf {
     int fd;
 
     uint8_t *addr;
+    uint32_t size;
+    uint32_t half;
     uint8_t port[2][2];
-    uint16_t count[2];
+    uint8_t *cur[2];
 
     unsigned int trace;
 };
 
-static uint8_t *ramaddr(struct ramf *ramf, uint8_t high)
+static void ramf_seek(struct ramf *ramf, uint8_t high)
 {
-    uint32_t offset = high ? 4096 * 1024 : 0;
-    offset += (ramf->port[high][0] & 0x1F) << 17;
+    uint32_t offset = (ramf->port[high][0] & 0x1F) << 17;
     offset += ramf->port[high][1] << 9;
-    offset += ramf->count[high]++;
-    return ramf->addr + offset;
+    ramf->cur[high] = ramf->addr + high * ramf->half +
+        (offset & (ramf->half - 1));
+}
+
+/* Smaller disks wrap as if the top address lines were not fitted */
+static uint8_t *ramaddr(struct ramf *ramf, uint8_t high)
+{
+    uint8_t *p = ramf->cur[high]++;
+    if (ramf->cur[high] == ramf->addr + (high + 1) * ramf->half)
+        ramf->cur[high] -= ramf->half;
+    return p;
 }
 
 void ramf_write(struct ramf *ramf, uint8_t addr, uint8_t val)
 {
     uint8_t high = (addr & 4) ? 1 : 0;
-    if (ramf->trace)
+    if (TRACE_ON(ramf->trace))
         fprintf(stderr, "RAMF write %d = %d\n", addr, val);
     addr &= 3;
     if (addr == 0)
@@ -44,14 +60,14 @@ void ramf_write(struct ramf *ramf, uint8_t addr, uint8_t val)
         return;
     else {
         ramf->port[high][addr & 1] = val;
-        ramf->count[high] = 0;
+        ramf_seek(ramf, high);
     }
 }
 
 uint8_t ramf_read(struct ramf *ramf, uint8_t addr)
 {
     uint8_t high = (addr & 4) ? 1 : 0;
-    if (ramf->trace)
+    if (TRACE_ON(ramf->trace))
         fprintf(stderr, "RAMF read %d\n", addr);
     addr &= 3;
     if (addr == 0)
@@ -61,36 +77,88 @@ uint8_t ramf_read(struct ramf *ramf, uint8_t addr)
     return ramf->port[high][addr];
 }
 
-struct ramf *ramf_create(const char *path)
+/* Map the space up front so the disk never takes a page fault mid
+   transfer. Huge pages are used if asked for and the host has them */
+static uint8_t *ramf_map(struct ramf *ramf, unsigned int flags)
+{
+    int mflags = ramf->fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED;
+    uint8_t *p = MAP_FAILED;
+
+#ifdef MAP_POPULATE
+    mflags |= MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+    if ((flags & RAMF_HUGE) && ramf->fd == -1)
+        p = mmap(NULL, ramf->size, PROT_READ|PROT_WRITE,
+            mflags | MAP_HUGETLB, -1, 0L);
+#endif
+    if (p == MAP_FAILED)
+        p = mmap(NULL, ramf->size, PROT_READ|PROT_WRITE, mflags,
+            ramf->fd, 0L);
+#ifdef MADV_HUGEPAGE
+    if (p != MAP_FAILED && (flags & RAMF_HUGE))
+        madvise(p, ramf->size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+/* A NULL path gives a scratch disk that is lost at exit. Size is in
+   bytes, a power of two up to the full 8MB, or 0 for the full size */
+struct ramf *ramf_create(const char *path, uint32_t size, unsigned int flags)
 {
-    struct ramf *ramf = malloc(sizeof(struct ramf));
+    struct ramf *ramf;
+    struct stat st;
+
+    if (size == 0)
+        size = RAMF_MAX;
+    if (size > RAMF_MAX || size < 1024 || (size & (size - 1))) {
+        fprintf(stderr, "ramf: size must be a power of two from 1K to 8192K.\n");
+        return NULL;
+    }
+    ramf = malloc(sizeof(struct ramf));
     if (ramf == NULL) {
         fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
     memset(ramf, 0, sizeof(struct ramf));
+    ramf->size = size;
+    ramf->half = size / 2;
 
-    ramf->fd = open(path, O_RDWR|O_CREAT, 0600);
-    if(ramf->fd == -1) {
-        perror(path);
-        free(ramf);
-        return NULL;
+    ramf->fd = -1;
+    if (path) {
+        ramf->fd = open(path, O_RDWR|O_CREAT, 0600);
+        if(ramf->fd == -1) {
+            perror(path);
+            free(ramf);
+            return NULL;
+        }
+        /* Touching the map past the end of the file would fault */
+        if (fstat(ramf->fd, &st) == -1 ||
+            (st.st_size < size && ftruncate(ramf->fd, size) == -1)) {
+            perror(path);
+            close(ramf->fd);
+            free(ramf);
+            return NULL;
+        }
     }
-    ramf->addr = mmap(NULL, 8192 * 1024, PROT_READ|PROT_WRITE,
-        MAP_SHARED, ramf->fd, 0L);
+    ramf->addr = ramf_map(ramf, flags);
     if (ramf->addr == MAP_FAILED) {
         perror("mmap");
-        close(ramf->fd);
+        if (ramf->fd != -1)
+            close(ramf->fd);
+        free(ramf);
         return NULL;
     }
+    ramf_seek(ramf, 0);
+    ramf_seek(ramf, 1);
     return ramf;
 }
 
 void ramf_free(struct ramf *ramf)
 {
     if (ramf->addr)
-        munmap(ramf->addr, 8192 * 1024);
-    if (ramf->fd)
+        munmap(ramf->addr, ramf->size);
+    if (ramf->fd != -1)
         close(ramf->fd);
     free(ramf);
 }
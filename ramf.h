@@ -1,8 +1,11 @@
 struct ramf;
 
+#define RAMF_MAX	(8192 * 1024)	/* Two 4MB units */
+#define RAMF_HUGE	1		/* Back with huge pages if possible */
+
 void ramf_write(struct ramf *ramf, uint8_t addr, uint8_t val);
 uint8_t ramf_read(struct ramf *ramf, uint8_t addr);
-struct ramf *ramf_create(const char *path);
+struct ramf *ramf_create(const char *path, uint32_t size, unsigned int flags);
 void ramf_free(struct ramf *ramf);
 void ramf_trace(struct ramf *ramf, unsigned int onoff);
 
@@ -37,6 +37,7 @@
 #include "ppide.h"
 #include "rtc_bitbang.h"
 #include "z80dis.h"
+#include "trace.h"
 
 static uint8_t ram[32][32768];	/* 1MB ROM for now */
 static uint8_t rom[32][32768];	/* 1MB ROM for now */
@@ -84,7 +85,7 @@ static void recalc_banks(void)
     rombank = romlatch & 0x3F;
     rambank = ramlatch & 0x1F;
 
-    if (trace & TRACE_BANK) {
+    if (TRACE_ON(trace & TRACE_BANK)) {
         fprintf(stderr, "MMU: RAM %s [%02X] ROM %s [%02X]%s\n",
             onoff[lram_on], rambank, onoff[rom_on], rombank,
             (rom_on && lram_on) ? " (contention)":"");
@@ -108,7 +109,7 @@ static uint8_t *mem_mmu(uint16_t addr)
 static uint8_t mem_read(int unused, uint16_t addr)
 {
     uint8_t *r = mem_mmu(addr);
-    if (trace & TRACE_MEM) {
+    if (TRACE_ON(trace & TRACE_MEM)) {
         fprintf(stderr, "R %04X -> ", addr);
         if (r)
             fprintf(stderr, "%02X\n", *r);
@@ -123,7 +124,7 @@ static uint8_t mem_read(int unused, uint16_t addr)
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
     uint8_t *r = mem_mmu(addr);
-    if (trace & TRACE_MEM) {
+    if (TRACE_ON(trace & TRACE_MEM)) {
         fprintf(stderr, "W %04X <- %02X", addr, val);
         if (r) {
             fprintf(stderr, "\n");
@@ -161,7 +162,7 @@ static void cpu_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -219,7 +220,7 @@ unsigned int next_char(void)
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "read %02x\n", addr);
     addr &= 0xFF;
     if (ppide && addr >= 0x60 && addr <= 0x67) 	/* Aliased */
@@ -228,14 +229,14 @@ static uint8_t io_read(int unused, uint16_t addr)
         return uart16x50_read(uart, addr & 7);
     if (addr >= 0x70 && addr <= 0x77)
         return rtc_read(rtc);
-    if (trace & TRACE_UNK)
+    if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown read from port %04X\n", addr);
     return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "write %02x <- %02x\n", addr & 0xFF, val);
     addr &= 0xFF;
     if (ppide && addr >= 0x60 && addr <= 0x67)	/* Aliased */
@@ -245,12 +246,12 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
     else if (addr >= 0x70 && addr <= 0x77)
         rtc_write(rtc, val);
     else if (addr >= 0x78 && addr <= 0x7B) {
-        if (trace & TRACE_BANK)
+        if (TRACE_ON(trace & TRACE_BANK))
             fprintf(stderr, "RAM bank to %02X\n", val);
         ramlatch = val;
         recalc_banks();
     } else if (addr >= 0x7C && addr <= 0x7F) {
-        if (trace & TRACE_BANK)
+        if (TRACE_ON(trace & TRACE_BANK))
             fprintf(stderr, "ROM bank to %02X\n", val);
         romlatch = val;
         recalc_banks();
@@ -259,7 +260,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
         printf("trace set to %d\n", val);
         trace = val;
     }
-    else if (trace & TRACE_UNK)
+    else if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown write to port %02X of %02X\n",
             addr & 0xFF, val);
 }
@@ -354,9 +355,9 @@ int main(int argc, char *argv[])
     }
 
     rtc = rtc_create();
-    rtc_trace(rtc, trace & TRACE_RTC);
+    rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
     uart = uart16x50_create();
-    uart16x50_trace(uart, trace & TRACE_UART);
+    uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
     uart16x50_set_input(uart, 1);
 
     recalc_banks();
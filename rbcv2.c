@@ -44,6 +44,8 @@
 #include "ramf.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "console.h"
+#include "trace.h"
 
 #define HIRAM	63
 
@@ -82,21 +84,21 @@ static int trace = 0;
 
 static uint8_t mem_read(int unused, uint16_t addr)
 {
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "R %04X: ", addr);
     if (addr > 32767) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "HR %04X<-%02X\n",
                 addr & 0x7FFF, ramrom[HIRAM][addr & 0x7FFF]);
         return ramrom[HIRAM][addr & 0x7FFF];
     }
     if (rombank & 0x80) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "LR%d %04X<-%02X\n",
                 rambank, addr, ramrom[32 + (rambank)][addr]);
         return ramrom[32 + (rambank)][addr];
     }
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "LF%d %04X<->%02X\n",
             rombank & 0x1F, addr, ramrom[rombank & 0x1F][addr]);
     return ramrom[rombank & 0x1F][addr];
@@ -104,18 +106,18 @@ static uint8_t mem_read(int unused, uint16_t addr)
 
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "W %04X: ", addr);
     if (addr > 32767) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "HR %04X->%02X\n",addr, val);
         ramrom[HIRAM][addr & 0x7FFF] = val;
     }
     else if (rombank & 0x80) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "LR%d %04X->%02X\n", (rambank), addr, val);
         ramrom[32 + (rambank)][addr] = val;
-    } else if (trace & TRACE_MEM)
+    } else if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "LF%d %04X->ROM\n",
             (rombank & 0x1F), addr);
 }
@@ -126,6 +128,9 @@ unsigned int check_chario(void)
     struct timeval tv;
     unsigned int r = 0;
 
+    /* A guest looking for input wants to see what it has written */
+    console_flush();
+
     FD_ZERO(&i);
     FD_SET(0, &i);
     FD_ZERO(&o);
@@ -158,7 +163,7 @@ unsigned int next_char(void)
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "read %02x\n", addr);
     addr &= 0xFF;
     if (addr >= 0x28 && addr <= 0x2C && wiznet)
@@ -175,14 +180,14 @@ static uint8_t io_read(int unused, uint16_t addr)
         return propio_read(propio, addr);
     if (addr >= 0xC0 && addr <= 0xDF)
         return uart16x50_read(uart[((addr - 0xC0) >> 3) + 1], addr & 7);
-    if (trace & TRACE_UNK)
+    if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown read from port %04X\n", addr);
     return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "write %02x <- %02x\n", addr & 0xFF, val);
     addr &= 0xFF;
     if (addr >= 0x28 && addr <= 0x2C && wiznet)
@@ -194,11 +199,11 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
     else if (addr >= 0x70 && addr <= 0x77)
         rtc_write(rtc, val);
     else if (addr >= 0x78 && addr <= 0x79) {
-        if (trace & TRACE_BANK)
+        if (TRACE_ON(trace & TRACE_BANK))
             fprintf(stderr, "RAM bank to %02X\n", val);
         rambank = val & ram_mask;
     } else if (addr >= 0x7C && addr <= 0x7F) {
-        if (trace & TRACE_BANK) {
+        if (TRACE_ON(trace & TRACE_BANK)) {
             fprintf(stderr, "ROM bank to %02X\n", val);
             if (val & 0x80)
                 fprintf(stderr, "Using RAM bank %d\n", rambank);
@@ -215,7 +220,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
         printf("trace set to %d\n", val);
         trace = val;
     }
-    else if (trace & TRACE_UNK)
+    else if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown write to port %02X of %02X\n",
             addr & 0xFF, val);
 }
@@ -235,7 +240,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-    fprintf(stderr, "rcbv2: [-1] [-f] [-r rompath] [-i idepath] [-t] [-p] [-s sdcardpath] [-d tracemask] [-R]\n");
+    fprintf(stderr, "rcbv2: [-1] [-f] [-r rompath] [-i idepath] [-t] [-p] [-s sdcardpath] [-d tracemask] [-R ramfpath] [-A] [-F ramfkb] [-H] [-a sectors]\n");
     exit(EXIT_FAILURE);
 }
 
@@ -249,9 +254,13 @@ int main(int argc, char *argv[])
     char *idepath[2] = { NULL, NULL };
     int i;
     char *ramfpath = NULL;
+    int ramfanon = 0;
+    uint32_t ramfsize = 0;
+    unsigned int ramfflags = 0;
     unsigned int prop = 0;
+    unsigned int readahead = 0;
 
-    while((opt = getopt(argc, argv, "1r:i:s:ptd:fR:w")) != -1) {
+    while((opt = getopt(argc, argv, "1r:i:s:ptd:fR:wAF:Ha:")) != -1) {
         switch(opt) {
             case '1':
                 ram_mask = 0x03;	/* 4 x 32K banks only */
@@ -285,6 +294,18 @@ int main(int argc, char *argv[])
             case 'w':
                 wiznet = 1;
                 break;
+            case 'A':
+                ramfanon = 1;
+                break;
+            case 'F':
+                ramfsize = atoi(optarg) * 1024;
+                break;
+            case 'H':
+                ramfflags |= RAMF_HUGE;
+                break;
+            case 'a':
+                readahead = atoi(optarg);
+                break;
             default:
                 usage();
         }
@@ -327,21 +348,23 @@ int main(int argc, char *argv[])
     }
 
     rtc = rtc_create();
-    rtc_trace(rtc, trace & TRACE_RTC);
+    rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 
     if (prop) {
         propio = propio_create(ppath);
         propio_set_input(propio, 1);
-        propio_trace(propio, trace & TRACE_PROP);
+        propio_readahead(propio, readahead);
+        propio_trace(propio, TRACE_ON(trace & TRACE_PROP));
     }
 
-    if (ramfpath)
-        ramf = ramf_create(ramfpath);
+    /* A scratch RAMF disk needs no backing file */
+    if (ramfpath || ramfanon)
+        ramf = ramf_create(ramfanon ? NULL : ramfpath, ramfsize, ramfflags);
 
     for (i = 0; i < 5; i++)
         uart[i] = uart16x50_create();
 
-    uart16x50_trace(uart[0], trace & TRACE_UART);
+    uart16x50_trace(uart[0], TRACE_ON(trace & TRACE_UART));
     if (!prop)
         uart16x50_set_input(uart[0], 1);
 
@@ -381,9 +404,12 @@ int main(int argc, char *argv[])
        matched with that. The scheme here works fine except when the host
        is loaded though */
 
+    console_init();
+
     /* 4MHz Z80 - 4,000,000 tstates / second */
     while (!done) {
         Z80ExecuteTStates(&cpu_z80, 400000);
+        console_flush();
 	/* Do 100ms of I/O and delays */
 	if (!fast)
 	    nanosleep(&tc, NULL);
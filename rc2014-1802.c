@@ -37,8 +37,10 @@
 #include "ppide.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "trace.h"
+#include "ramalloc.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
+static uint8_t *ramrom;	/* Covers the banked card */
 
 static unsigned int bankreg[4];
 static uint8_t bankenable;
@@ -201,7 +203,7 @@ static void my_ide_write(uint16_t addr, uint8_t val)
 
 uint8_t cp1802_inport(uint8_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if ((addr >= 0xA0 && addr <= 0xA7) && acia)
 		return acia_read(acia, addr & 1);
@@ -217,18 +219,18 @@ uint8_t cp1802_inport(uint8_t addr)
 		return rtc_read(rtcdev);
 	else if (addr >= 0xC0 && addr <= 0xCF && uart)
 		return uart16x50_read(uart, addr & 0x0F);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 void cp1802_outport(uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	if (addr == 0xFF && bankhigh) {
 		mmureg = val;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "MMUreg set to %02X\n", val);
 	} else if ((addr >= 0xA0 && addr <= 0xA7) && acia)
 		acia_write(acia, addr & 1, val);
@@ -243,10 +245,10 @@ void cp1802_outport(uint8_t addr, uint8_t val)
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
 	} else if (addr == 0x0C && rtc)
@@ -254,12 +256,12 @@ void cp1802_outport(uint8_t addr, uint8_t val)
 	else if (addr >= 0xC0 && addr <= 0xCF && uart)
 		uart16x50_write(uart, addr & 0x0F, val);
 	else if (addr == 0x80) {
-		if (trace & TRACE_LED)
+		if (TRACE_ON(trace & TRACE_LED))
 			printf("[%02X]\n", val);
 	} else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -281,7 +283,7 @@ uint8_t cp1802_read(struct cp1802 *cpu, uint16_t addr)
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 
 		val = ramrom[(higha << 16) + addr];
-		if (trace & TRACE_MEM) {
+		if (TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "R %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
@@ -290,12 +292,12 @@ uint8_t cp1802_read(struct cp1802 *cpu, uint16_t addr)
 		return val;
 	} else 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R %04x[%02X] = %02X\n", addr, (unsigned int) bankreg[bank], (unsigned int) ramrom[(bankreg[bank] << 14) + (addr & 0x3FFF)]);
 		addr &= 0x3FFF;
 		return ramrom[(bankreg[bank] << 14) + addr];
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[addr]);
 	return ramrom[addr];
 }
@@ -316,35 +318,35 @@ void cp1802_write(struct cp1802 *cpu, uint16_t addr, uint8_t val)
 		higha |= (reg & 0x4) ? 4 : 0;
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 		
-		if (trace & TRACE_MEM) {
+		if (TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "W %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
 				(unsigned int)val);
 		}
 		if (!(higha & 8)) {
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "[Discard: ROM]\n");
 			return;
 		}
 		ramrom[(higha << 16)+ addr] = val;
 	} else if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04x[%02X] = %02X\n", (unsigned int) addr, (unsigned int) bankreg[bank], (unsigned int) val);
 		if (bankreg[bank] >= 32) {
 			addr &= 0x3FFF;
 			ramrom[(bankreg[bank] << 14) + addr] = val;
 		}
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
 		if (addr >= 32768 && !bank512)
 			ramrom[addr] = val;
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	}
 }
@@ -454,6 +456,8 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	if (type != 1802 && type != 1804 && type != 1805 && type != 1806) {
 		fprintf(stderr, "rc2014: unknown CPU type. Please select from 1802, 1804, 1805, 1806.\n");
 		exit(1);
@@ -482,7 +486,7 @@ int main(int argc, char *argv[])
 			perror("lseek");
 			exit(1);
 		}
-		if (read(fd, ramrom, 65536) < 2048) {
+		if (ram_load(fd, ramrom, 65536) < 2048) {
 			fprintf(stderr, "rc2014: short rom '%s'.\n", rompath);
 			exit(EXIT_FAILURE);
 		}
@@ -495,7 +499,7 @@ int main(int argc, char *argv[])
 			perror(rompath);
 			exit(EXIT_FAILURE);
 		}
-		if (read(fd, ramrom, 524288) != 524288) {
+		if (ram_load(fd, ramrom, 524288) != 524288) {
 			fprintf(stderr, "rc2014: banked rom image should be 512K.\n");
 			exit(EXIT_FAILURE);
 		}
@@ -527,20 +531,20 @@ int main(int argc, char *argv[])
 				ide = 0;
 			} else
 				ppide_attach(ppide, 0, ide_fd);
-			if (trace & TRACE_PPIDE)
+			if (TRACE_ON(trace & TRACE_PPIDE))
 				ppide_trace(ppide, 1);
 		}
 	}
 
 	if (acia_uart) {
 		acia = acia_create();
-		acia_trace(acia, trace & TRACE_ACIA);
+		acia_trace(acia, TRACE_ON(trace & TRACE_ACIA));
 		acia_set_input(acia, acia_input);
 	}
 
 	if (uart_16550a) {
 		uart = uart16x50_create();
-		uart16x50_trace(uart, trace & TRACE_UART);
+		uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
 		uart16x50_set_input(uart, !acia_input);
 	}
 
@@ -552,7 +556,7 @@ int main(int argc, char *argv[])
 	if (rtc) {
 		rtcdev = rtc_create();
 		rtc_reset(rtcdev);
-		if (trace & TRACE_RTC)
+		if (TRACE_ON(trace & TRACE_RTC))
 			rtc_trace(rtcdev, 1);
 	}
 
@@ -590,10 +594,7 @@ int main(int argc, char *argv[])
 		int i;
 		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
-			/* TODO: need to loop for the desired tstates */
-			cpu.mcycles = 0;
-			while(cpu.mcycles < mcycles)
-				cp1802_run(&cpu);
+			cp1802_run_cycles(&cpu, mcycles);
 			if (acia)
 				acia_timer(acia);
 			if (uart)
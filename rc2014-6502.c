@@ -23,14 +23,19 @@
 #include <errno.h>
 #include <sys/select.h>
 #include "6502.h"
+#include "cputrace.h"
+#include "coverage.h"
 #include "16x50.h"
 #include "acia.h"
 #include "ide.h"
 #include "6522.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "trace.h"
+#include "ramalloc.h"
+#include "cpuclock.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
+static uint8_t *ramrom;	/* Covers the banked card */
 
 static unsigned int bankreg[4];
 static uint8_t bankenable;
@@ -40,7 +45,7 @@ static uint8_t wiznet = 0;
 static uint8_t iopage = 0xFE;
 static uint16_t addrinvert = 0x0000;
 
-static uint16_t tstate_steps = 200;	/* 4MHz */
+static unsigned long cpu_hz = 4000000;
 
 /* Who is pulling on the interrupt line */
 
@@ -72,6 +77,8 @@ static volatile int done;
 
 static int trace = 0;
 
+static struct m6502 cpu;
+
 unsigned int check_chario(void)
 {
 	fd_set i, o;
@@ -156,9 +163,44 @@ void via_handshake_b(struct via6522 *via)
 {
 }
 
+/* The VIA runs off the CPU clock. Bring it up to the current cycle
+   before the CPU looks at it so the timers read exactly */
+static uint64_t via_clock;
+
+static void via_sync(void)
+{
+	uint64_t now = getclockticks(&cpu);
+	via_tick(via, now - via_clock);
+	via_clock = now;
+}
+
+static void via_irq_update(void)
+{
+	if (via_irq_pending(via))
+		int_set(IRQ_VIA);
+	else
+		int_clear(IRQ_VIA);
+}
+
+static uint8_t my_via_read(uint8_t addr)
+{
+	uint8_t r;
+	via_sync();
+	r = via_read(via, addr);
+	via_irq_update();
+	return r;
+}
+
+static void my_via_write(uint8_t addr, uint8_t val)
+{
+	via_sync();
+	via_write(via, addr, val);
+	via_irq_update();
+}
+
 uint8_t mmio_read_6502(uint8_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow)
 		return acia_read(acia, addr & 1);
@@ -169,19 +211,19 @@ uint8_t mmio_read_6502(uint8_t addr)
 	if (addr >= 0x28 && addr <= 0x2C && wiznet)
 		return nic_w5100_read(wiz, addr & 3);
 	if (addr >= 0x60 && addr <= 0x6F)
-		return via_read(via, addr & 0x0F);
+		return my_via_read(addr & 0x0F);
 	if (addr == 0x0C && rtc)
 		return rtc_read(rtc);
 	if (addr >= 0xC0 && addr <= 0xCF && uart)
 		return uart16x50_read(uart, addr & 0x0F);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 void mmio_write_6502(uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow)
 		acia_write(acia, addr & 1, val);
@@ -192,14 +234,14 @@ void mmio_write_6502(uint8_t addr, uint8_t val)
 	else if (addr >= 0x28 && addr <= 0x2C && wiznet)
 		nic_w5100_write(wiz, addr & 3, val);
 	else if (addr >= 0x60 && addr <= 0x6F)
-		via_write(via, addr & 0x0F, val);
+		my_via_write(addr & 0x0F, val);
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
 	} else if (addr == 0x0C && rtc)
@@ -209,11 +251,11 @@ void mmio_write_6502(uint8_t addr, uint8_t val)
 	else if (addr == 0x00) {
 		printf("trace set to %d\n", val);
 		trace = val;
-		if (trace & TRACE_CPU)
-			log_6502 = 1;
+		if (TRACE_ON(trace & TRACE_CPU))
+			cpu.log = 1;
 		else
-			log_6502 = 0;
-	} else if (trace & TRACE_UNK)
+			cpu.log = 0;
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -223,18 +265,18 @@ uint8_t do_6502_read(uint16_t addr)
 	uint16_t xaddr = addr ^ addrinvert;
 	if (bankenable) {
 		unsigned int bank = (xaddr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R %04X[%02X] = %02X\n", addr, (unsigned int) bankreg[bank], (unsigned int) ramrom[(bankreg[bank] << 14) + (xaddr & 0x3FFF)]);
 		xaddr &= 0x3FFF;
 		return ramrom[(bankreg[bank] << 14) + xaddr];
 	}
 	/* When banking is off the entire 64K is occupied by repeats of ROM 0 */
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[xaddr & 0x3FFF]);
 	return ramrom[xaddr & 0x3FFF];
 }
 
-uint8_t read6502(uint16_t addr)
+uint8_t read6502(struct m6502 *cpu, uint16_t addr)
 {
 	uint8_t r;
 
@@ -245,7 +287,7 @@ uint8_t read6502(uint16_t addr)
 	return r;
 }
 
-uint8_t read6502_debug(uint16_t addr)
+uint8_t read6502_debug(struct m6502 *cpu, uint16_t addr)
 {
 	/* Avoid side effects for debug */
 	if (addr >> 8 == iopage)
@@ -255,7 +297,7 @@ uint8_t read6502_debug(uint16_t addr)
 }
 
 
-void write6502(uint16_t addr, uint8_t val)
+void write6502(struct m6502 *cpu, uint16_t addr, uint8_t val)
 {
 	uint16_t xaddr = addr ^ addrinvert;
 
@@ -265,29 +307,26 @@ void write6502(uint16_t addr, uint8_t val)
 	}
 	if (bankenable) {
 		unsigned int bank = (xaddr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04X[%02X] = %02X\n", (unsigned int) addr, (unsigned int) bankreg[bank], (unsigned int) val);
 		if (bankreg[bank] >= 32) {
 			xaddr &= 0x3FFF;
 			ramrom[(bankreg[bank] << 14) + xaddr] = val;
 		}
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	}
 }
 
 static void poll_irq_event(void)
 {
-	if (via_irq_pending(via))
-		int_set(IRQ_VIA);
-	else
-		int_clear(IRQ_VIA);
+	via_irq_update();
 	if (acia) {
 		if (acia_irq_pending(acia))
 			int_set(IRQ_ACIA);
@@ -302,10 +341,52 @@ static void poll_irq_event(void)
 	}
 }
 
-static void irqnotify(void)
+/* Run the CPU for clocks stopping at each VIA timer interrupt */
+static void run_slice(unsigned int clocks)
+{
+	unsigned int n;
+
+	while (clocks) {
+		n = via_deadline(via);
+		if (n > clocks)
+			n = clocks;
+		exec6502(&cpu, n);
+		via_sync();
+		via_irq_update();
+		clocks -= n;
+	}
+}
+
+static void irqnotify(struct m6502 *unused)
 {
 	if (live_irq)
-		irq6502();
+		irq6502(&cpu);
+}
+
+/*
+ *	-x keeps the last CPUTRACE_RECORDS instructions and writes them out
+ *	at exit, on SIGUSR2 and if we crash. tracedump decodes the file.
+ */
+
+static char *ring_path;
+static volatile sig_atomic_t ring_request;
+
+static void ring_write(void)
+{
+	if (cputrace_dump(cpu.trace, ring_path))
+		perror(ring_path);
+}
+
+static void ring_crash(int sig)
+{
+	cputrace_dump(cpu.trace, ring_path);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void ring_signal(int sig)
+{
+	ring_request = 1;
 }
 
 static struct termios saved_term, term;
@@ -323,21 +404,23 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014-6502: [-1] [-A] [-a] [-f] [-i idepath] [-R] [-r rompath] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014-6502: [-1] [-A] [-a] [-f] [-X MHz] [-i idepath] [-R] [-r rompath] [-w] [-x tracefile] [-q coverage] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
 	static struct timespec tc;
+	struct cpuclock clk;
 	int opt;
 	int fd;
 	int input = 0;	/* undefined */
 	int usertc = 0;
 	char *rompath = "rc2014-6502.rom";
 	char *idepath;
+	char *cov_path = NULL;
 
-	while ((opt = getopt(argc, argv, "1Aad:fi:r:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "1Aad:fi:q:r:Rwx:X:")) != -1) {
 		switch (opt) {
 		case '1':
 			input = 2;
@@ -363,12 +446,21 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 		case 'R':
 			usertc = 1;
 			break;
 		case 'w':
 			wiznet = 1;
 			break;
+		case 'x':
+			ring_path = optarg;
+			break;
+		case 'q':
+			cov_path = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -376,6 +468,8 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	if (input == 0) {
 		fprintf(stderr, "rc2014-6502: no UART selected, defaulting to 16550A\n");
 		input = 2;
@@ -386,7 +480,7 @@ int main(int argc, char *argv[])
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom, 524288) != 524288) {
+	if (ram_load(fd, ramrom, 524288) != 524288) {
 		fprintf(stderr, "rc2014-6502: banked rom image should be 512K.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -411,17 +505,17 @@ int main(int argc, char *argv[])
 	if (input == 1) {
 		acia = acia_create();
 		acia_set_input(acia, 1);
-		acia_trace(acia, trace & TRACE_ACIA);
+		acia_trace(acia, TRACE_ON(trace & TRACE_ACIA));
 	} else {
 		uart = uart16x50_create();
 		uart16x50_set_input(uart, 1);
-		uart16x50_trace(uart, trace & TRACE_UART);
+		uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
 		uart16x50_reset(uart);
 	}
 
 	if (usertc) {
 		rtc = rtc_create();
-		rtc_trace(rtc, trace & TRACE_RTC);
+		rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 	}
 
 	if (wiznet) {
@@ -449,35 +543,43 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-	if (trace & TRACE_CPU)
-		log_6502 = 1;
+	if (TRACE_ON(trace & TRACE_CPU))
+		cpu.log = 1;
 
 	via = via_create();
-	via_trace(via, trace & TRACE_VIA);
+	via_trace(via, TRACE_ON(trace & TRACE_VIA));
 
 	init6502();
-	reset6502();
-	hookexternal(irqnotify);
+	reset6502(&cpu);
+	hookexternal(&cpu, irqnotify);
+	if (cov_path)
+		cpu.cover = coverage_create(0x10000, cov_path);
+	if (ring_path) {
+		cpu.trace = cputrace_create(CPUTRACE_6502, CPUTRACE_RECORDS);
+		signal(SIGSEGV, ring_crash);
+		signal(SIGBUS, ring_crash);
+		signal(SIGFPE, ring_crash);
+		signal(SIGABRT, ring_crash);
+		signal(SIGUSR2, ring_signal);
+	}
 
 	/* This is the wrong way to do it but it's easier for the moment. We
 	   should track how much real time has occurred and try to keep cycle
 	   matched with that. The scheme here works fine except when the host
 	   is loaded though */
 
-	/* We run 4000000 t-states per second */
-	/* We run 200 cycles per I/O check, do that 100 times then poll the
-	   slow stuff and nap for 5ms. */
+	/* We run cpu_hz cycles a second in 50us slices, do 100 of those
+	   then poll the slow stuff and nap for 5ms. */
+	cpuclock_init(&clk, cpu_hz, 20000);
 	while (!done) {
 		int i;
-		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
 			/* FIXME: should check return and keep adjusting */
-			exec6502(tstate_steps);
+			run_slice(cpuclock_slice(&clk));
 			if (acia)
 				acia_timer(acia);
 			if (input == 2)
 				uart16x50_event(uart);
-			via_tick(via, tstate_steps);
 		}
 		if (wiznet)
 			w5100_process(wiz);
@@ -485,6 +587,12 @@ int main(int argc, char *argv[])
 		if (!fast)
 			nanosleep(&tc, NULL);
 		poll_irq_event();
+		if (ring_request) {
+			ring_request = 0;
+			ring_write();
+		}
 	}
+	if (ring_path)
+		ring_write();
 	exit(0);
 }
@@ -30,8 +30,11 @@
 #include "6522.h"
 #include "16x50.h"
 #include "w5100.h"
+#include "trace.h"
+#include "ramalloc.h"
+#include "cpuclock.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
+static uint8_t *ramrom;	/* Covers the banked card */
 
 static unsigned int bankreg[4];
 static uint8_t bankenable;
@@ -40,7 +43,7 @@ static uint8_t fast = 0;
 static uint8_t wiznet = 0;
 static uint8_t iopage = 0xFE;
 
-static uint16_t tstate_steps = 200;
+static unsigned long cpu_hz = 4000000;
 
 /* Who is pulling on the interrupt line */
 
@@ -142,11 +145,64 @@ void via_handshake_b(struct via6522 *via)
 {
 }
 
+/* The VIA runs at half the CPU clock. Bring it up to the current cycle
+   before the CPU looks at it so the timers read exactly */
+static word32 via_cycles;
+
+static void via_sync(void)
+{
+	word32 n = (cpu_cycle_count - via_cycles) / 2;
+	via_tick(via, n);
+	via_cycles += 2 * n;
+}
+
+static void via_irq_update(void)
+{
+	if (via_irq_pending(via))
+		CPU_addIRQ(IRQ_VIA);
+	else
+		CPU_clearIRQ(IRQ_VIA);
+}
+
+static uint8_t my_via_read(uint8_t addr)
+{
+	uint8_t r;
+	via_sync();
+	r = via_read(via, addr);
+	via_irq_update();
+	return r;
+}
+
+static void my_via_write(uint8_t addr, uint8_t val)
+{
+	via_sync();
+	via_write(via, addr, val);
+	via_irq_update();
+}
+
+/* Run the CPU for cycles stopping at each VIA timer interrupt */
+static void run_slice(word32 cycles)
+{
+	word32 n;
+
+	while (cycles) {
+		n = via_deadline(via);
+		if (n == VIA_IDLE || 2 * n > cycles)
+			n = cycles;
+		else
+			n = 2 * n - (cpu_cycle_count - via_cycles);
+		CPU_execute(n);
+		via_sync();
+		via_irq_update();
+		cycles -= n;
+	}
+}
+
 
 
 uint8_t mmio_read_65c816(uint8_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow)
 		return acia_read(acia, addr & 1);
@@ -157,19 +213,19 @@ uint8_t mmio_read_65c816(uint8_t addr)
 	if (addr >= 0x28 && addr <= 0x2C && wiznet)
 		return nic_w5100_read(wiz, addr & 3);
 	if (addr >= 0x60 && addr <= 0x6F)
-		return via_read(via, addr & 0x0F);
+		return my_via_read(addr & 0x0F);
 	if (addr == 0x0C && rtc)
 		return rtc_read(rtc);
 	if (addr >= 0xC0 && addr <= 0xCF && uart)
 		return uart16x50_read(uart, addr & 0x0F);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 void mmio_write_65c816(uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow)
 		acia_write(acia, addr & 1, val);
@@ -180,14 +236,14 @@ void mmio_write_65c816(uint8_t addr, uint8_t val)
 	else if (addr >= 0x28 && addr <= 0x2C && wiznet)
 		nic_w5100_write(wiz, addr & 3, val);
 	else if (addr >= 0x60 && addr <= 0x6F)
-		via_write(via, addr & 0x0F, val);
+		my_via_write(addr & 0x0F, val);
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
 	} else if (addr == 0x0C && rtc)
@@ -197,11 +253,11 @@ void mmio_write_65c816(uint8_t addr, uint8_t val)
 	else if (addr == 0x00) {
 		printf("trace set to %d\n", val);
 		trace = val;
-		if (trace & TRACE_CPU)
+		if (TRACE_ON(trace & TRACE_CPU))
 			CPU_setTrace(1);
 		else
 			CPU_setTrace(0);
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -211,13 +267,13 @@ uint8_t do_65c816_read(uint16_t addr)
 {
 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R %04X[%02X] = %02X\n", addr, (unsigned int) bankreg[bank], (unsigned int) ramrom[(bankreg[bank] << 14) + (addr & 0x3FFF)]);
 		addr &= 0x3FFF;
 		return ramrom[(bankreg[bank] << 14) + addr];
 	}
 	/* When banking is off the entire 64K is occupied by repeats of ROM 0 */
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[addr & 0x3FFF]);
 	return ramrom[addr & 0x3FFF];
 }
@@ -248,19 +304,19 @@ void write65c816(uint32_t addr, uint8_t val)
 	}
 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04X[%02X] = %02X\n", (unsigned int) addr, (unsigned int) bankreg[bank], (unsigned int) val);
 		if (bankreg[bank] >= 32) {
 			addr &= 0x3FFF;
 			ramrom[(bankreg[bank] << 14) + addr] = val;
 		}
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	}
 }
@@ -281,7 +337,6 @@ void system_process(void)
 		acia_timer(acia);
 	if (uart)
 		uart16x50_event(uart);
-	via_tick(via, 100);
 
 	if (acia) {
 		if (acia_irq_pending(acia))
@@ -289,10 +344,7 @@ void system_process(void)
 		else
 			CPU_clearIRQ(IRQ_ACIA);
 	}
-	if (via_irq_pending(via))
-		CPU_addIRQ(IRQ_VIA);
-	else
-		CPU_clearIRQ(IRQ_VIA);
+	via_irq_update();
 
 	if (uart) {
 		if (uart16x50_irq_pending(uart))
@@ -301,7 +353,7 @@ void system_process(void)
 			CPU_clearIRQ(IRQ_16550A);
 	}
 
-	if (n++ == 100) {
+	if (++n == 100) {
 		n = 0;
 		if (wiznet)
 			w5100_process(wiz);
@@ -326,12 +378,13 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014: [-1] [-A] [-a] [-c] [-f] [-R] [-r rompath] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014: [-1] [-A] [-a] [-c] [-f] [-X MHz] [-R] [-r rompath] [-w] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
+	struct cpuclock clk;
 	int opt;
 	int fd;
 	char *rompath = "rc2014-65c816.rom";
@@ -339,7 +392,7 @@ int main(int argc, char *argv[])
 	int input = 0;
 	int hasrtc = 0;
 
-	while ((opt = getopt(argc, argv, "1Aad:fi:r:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "1Aad:fi:r:RwX:")) != -1) {
 		switch (opt) {
 		case '1':
 			input = 2;
@@ -365,6 +418,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 		case 'R':
 			hasrtc = 1;
 			break;
@@ -378,6 +434,8 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	if (input == 0) {
 		fprintf(stderr, "rc2014: no UART selected, defaulting to 16550A\n");
 		input = 2;
@@ -388,7 +446,7 @@ int main(int argc, char *argv[])
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom, 524288) != 524288) {
+	if (ram_load(fd, ramrom, 524288) != 524288) {
 		fprintf(stderr, "rc2014: banked rom image should be 512K.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -413,18 +471,18 @@ int main(int argc, char *argv[])
 	if (input == 1) {
 		acia = acia_create();
 		acia_set_input(acia, 1);
-		acia_trace(acia, trace & TRACE_ACIA);
+		acia_trace(acia, TRACE_ON(trace & TRACE_ACIA));
 	} else {
 		uart = uart16x50_create();
 		uart16x50_set_input(uart, 1);
-		uart16x50_trace(uart, trace & TRACE_UART);
+		uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
 	}
 
 	via = via_create();
 
 	if (hasrtc) {
 		rtc = rtc_create();
-		rtc_trace(rtc, trace & TRACE_RTC);
+		rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 	}
 
 	if (wiznet) {
@@ -448,12 +506,15 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-	if (trace & TRACE_CPU)
+	if (TRACE_ON(trace & TRACE_CPU))
 		CPU_setTrace(1);
 
 	CPUEvent_initialize();
-	CPU_setUpdatePeriod(tstate_steps);
 	CPU_reset();
-	CPU_run();
-	exit(0);
+	/* Run the CPU in slices with the board work in between */
+	cpuclock_init(&clk, cpu_hz, 20000);
+	while (1) {
+		run_slice(cpuclock_slice(&clk));
+		system_process();
+	}
 }
@@ -23,8 +23,10 @@
 #include "ide.h"
 #include "acia.h"
 #include "16x50.h"
+#include "trace.h"
+#include "ramalloc.h"
 
-static uint8_t ramrom[1024 * 1024];
+static uint8_t *ramrom;
 
 static uint8_t banksel;
 static uint8_t bankreg[4];
@@ -155,29 +157,32 @@ static uint8_t m6800_do_ior(uint8_t addr)
 static uint8_t m6800_ior(uint16_t addr)
 {
 	uint8_t r = m6800_do_ior(addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "IR %04X = %02X\n", addr, r);
 	return r;
 }
 
 static void m6800_iow(uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "IW %04X = %02X\n", addr, val);
 	if (acia && addr >= 0xA0 && addr <= 0xA1)
 		acia_write(acia, addr & 1, val);
 	else if (ide && addr >= 0x10 && addr <= 0x17) {
 		/* IDE at 0xFE10 for now */
 		my_ide_write(addr & 7, val);
-	} else if (addr == 0x38)
+	} else if (addr == 0x38) {
 		banksel = val & 3;
-	else if (addr >= 0x78 && addr <= 0x7B)
+		m6800_decode_flush(&cpu);
+	} else if (addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr - 0x78] = val & 0x3F;
-	else if (addr >= 0x7C && addr <= 0x7F)
+		m6800_decode_flush(&cpu);
+	} else if (addr >= 0x7C && addr <= 0x7F) {
 		bankenable = val & 1;
-	else if (uart && addr >= 0xC0 && addr <= 0xC7)
+		m6800_decode_flush(&cpu);
+	} else if (uart && addr >= 0xC0 && addr <= 0xC7)
 		uart16x50_write(uart, addr & 7, val);
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown I/O write to 0x%02X of %02X\n",
 			addr, val);
 }
@@ -221,7 +226,7 @@ uint8_t m6800_read_op(struct m6800 *cpu, uint16_t addr, int debug)
 		r = 0xFF;
 	else
 		r = *ptr;
-	if (!debug && (trace & TRACE_MEM))
+	if (!debug && TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, r);
 	return r;
 }
@@ -244,10 +249,10 @@ void m6800_write(struct m6800 *cpu, uint16_t addr, uint8_t val)
 	else {
 		ptr = mmu_map(addr, 1);
 		if (ptr == NULL) {
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "W: %04X (ROM) with %02X\n", addr, val);
 		} else  {
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "W: %04X = %02X\n", addr, val);
 			*ptr = val;
 		}
@@ -319,12 +324,14 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	fd = open(rompath, O_RDONLY);
 	if (fd == -1) {
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom, romsize) != romsize) {
+	if (ram_load(fd, ramrom, romsize) != romsize) {
 		fprintf(stderr, "rc2014-6800: short rom '%s'.\n",
 			rompath);
 		exit(EXIT_FAILURE);
@@ -370,17 +377,17 @@ int main(int argc, char *argv[])
 
 	if (uarttype == 0) {
 		acia = acia_create();
-		if (trace & TRACE_UART)
+		if (TRACE_ON(trace & TRACE_UART))
 			acia_trace(acia, 1);
 		acia_set_input(acia, 1);
 	} else {
 		uart = uart16x50_create();
-		if (trace & TRACE_UART)
+		if (TRACE_ON(trace & TRACE_UART))
 			uart16x50_trace(uart, 1);
 		uart16x50_set_input(uart, 1);
 	}
 
-	if (trace & TRACE_CPU)
+	if (TRACE_ON(trace & TRACE_CPU))
 		cpu.debug = 1;
 
 	/* This is the wrong way to do it but it's easier for the moment. We
@@ -38,8 +38,12 @@
 #include "16x50.h"
 #include "w5100.h"
 #include "sram_mmu8.h"
+#include "trace.h"
+#include "coverage.h"
+#include "ramalloc.h"
+#include "cpuclock.h"
 
-static uint8_t ramrom[1024 * 1024];	/* ROM low RAM high */
+static uint8_t *ramrom;	/* ROM low RAM high */
 
 static uint8_t fast = 0;
 static uint8_t wiznet = 0;
@@ -47,7 +51,7 @@ static uint8_t bmmu = 0;
 
 static int kernelmode;
 
-static uint16_t tstate_steps = 200;
+static unsigned long cpu_hz = 4000000;	/* Roughly right for an 8MHz 68008 */
 
 /* Who is pulling on the interrupt line */
 
@@ -79,7 +83,7 @@ static int irq_mask;
 
 static void add_irq(int n)
 {
-	if (!(irq_mask & (1 << n)) && (trace & TRACE_IRQ))
+	if (!(irq_mask & (1 << n)) && TRACE_ON(trace & TRACE_IRQ))
 		fprintf(stderr, "[IRQ %02X]\n", irq_mask);
 	irq_mask |= (1 << n);
 	m68k_set_irq(2);
@@ -91,7 +95,7 @@ static void remove_irq(int n)
 		irq_mask &= ~(1 << n);
 		if (!irq_mask) {
 			m68k_set_irq(0);
-			if (trace & TRACE_IRQ)
+			if (TRACE_ON(trace & TRACE_IRQ))
 				fprintf(stderr, "[IRQ cleared]\n");
 		}
 	}
@@ -175,7 +179,7 @@ static uint8_t do_mmio_read_68000(uint16_t addr)
 		return rtc_read(rtc);
 	if (addr >= 0xC0 && addr <= 0xCF && uart)
 		return uart16x50_read(uart, addr & 0x0F);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
@@ -183,17 +187,17 @@ static uint8_t do_mmio_read_68000(uint16_t addr)
 uint8_t mmio_read_68000(uint16_t addr)
 {
 	uint8_t r;
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %04x <- ", addr);
 	r = do_mmio_read_68000(addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "%02x\n", r);
 	return r;
 }
 
 void mmio_write_68000(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %04x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow)
@@ -216,10 +220,10 @@ void mmio_write_68000(uint16_t addr, uint8_t val)
 		printf("trace set to %d\n", val);
 		trace = val;
 #if 0		
-		if (trace & TRACE_CPU)
+		if (TRACE_ON(trace & TRACE_CPU))
 		else
 #endif		
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -246,6 +250,29 @@ uint8_t *bmmu_translate(unsigned int addr, int wflag, int silent)
 	/* We don't emulate bus error yet */
 }
 
+/*
+ *	Word and long accesses that stay within one 8K page translate the
+ *	same way for every byte, so look the page up once. Returns NULL if
+ *	it has to be done a byte at a time with all the checks.
+ */
+static uint8_t *fast_translate(unsigned int addr, unsigned int len, int wflag)
+{
+	addr &= 0xFFFFF;
+	if (TRACE_ON(trace & TRACE_MEM) || (addr & 0x1FFF) > 0x2000 - len)
+		return NULL;
+	if ((addr & 0xF0000) == 0x10000)
+		return NULL;
+	if (bmmu == 0)
+		return ramrom + addr;
+	if (!(addr & 0x80000)) {
+		if (!kernelmode || (wflag && addr < 0x10000))
+			return NULL;
+		return ramrom + addr;
+	}
+	/* bmmu_translate ends up asking for the non supervisor map */
+	return sram_mmu_cached(mmu, addr & 0x7FFFF, wflag, 0);
+}
+
 unsigned int cpu_read_byte_dasm(unsigned int addr)
 {
 	uint8_t *ptr = bmmu_translate(addr, 0, 0);
@@ -282,30 +309,48 @@ unsigned int cpu_read_byte(unsigned int addr)
 {
 	unsigned int r;
 	
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %06X = ", addr & 0xFFFFF);
 	r = do_cpu_read_byte(addr);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%02X\n", r);
 	return r;
 }
 
 unsigned int cpu_read_word(unsigned int addr)
 {
+	uint8_t *p = fast_translate(addr, 2, 0);
+	if (p)
+		return (p[0] << 8) | p[1];
 	return (cpu_read_byte(addr) << 8) | cpu_read_byte(addr + 1);
 }
 
 unsigned int cpu_read_long(unsigned int addr)
 {
+	uint8_t *p = fast_translate(addr, 4, 0);
+	if (p)
+		return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
 	return (cpu_read_word(addr) << 16) | cpu_read_word(addr + 2);
 }
 
+/* Opcode and immediate fetches. The prefetch asks for aligned longs so
+   they nearly always take the single lookup in cpu_read_long */
+unsigned int cpu_read_imm_word(unsigned int addr)
+{
+	return cpu_read_word(addr);
+}
+
+unsigned int cpu_read_imm_long(unsigned int addr)
+{
+	return cpu_read_long(addr);
+}
+
 void cpu_write_byte(unsigned int addr, unsigned int value)
 {
 	uint8_t *ptr;
 
 	addr &= 0xFFFFF;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %06X = %02X\n",
 			addr & 0xFFFFF, value);
 	if ((addr & 0xF0000) == 0x10000)
@@ -321,12 +366,26 @@ void cpu_write_byte(unsigned int addr, unsigned int value)
 
 void cpu_write_word(unsigned int addr, unsigned int value)
 {
+	uint8_t *p = fast_translate(addr, 2, 1);
+	if (p) {
+		p[0] = value >> 8;
+		p[1] = value;
+		return;
+	}
 	cpu_write_byte(addr, value >> 8);
 	cpu_write_byte(addr + 1, value);
 }
 
 void cpu_write_long(unsigned int addr, unsigned int value)
 {
+	uint8_t *p = fast_translate(addr, 4, 1);
+	if (p) {
+		p[0] = value >> 24;
+		p[1] = value >> 16;
+		p[2] = value >> 8;
+		p[3] = value;
+		return;
+	}
 	cpu_write_word(addr, value >> 16);
 	cpu_write_word(addr + 2, value);
 }
@@ -337,9 +396,14 @@ void cpu_write_pd(unsigned int addr, unsigned int value)
 	cpu_write_word(addr, value >> 16);
 }
 
+/* Instruction addresses run, see -q. Release builds have no hook */
+static uint8_t *cov;
+
 void cpu_instr_callback(void)
 {
-	if (trace & TRACE_CPU) {
+	if (cov)
+		coverage_mark(cov, m68k_get_reg(NULL, M68K_REG_PC) & 0xFFFFF);
+	if (TRACE_ON(trace & TRACE_CPU)) {
 		char buf[128];
 		unsigned int pc = m68k_get_reg(NULL, M68K_REG_PC);
 		m68k_disassemble(buf, pc, M68K_CPU_TYPE_68000);
@@ -368,7 +432,7 @@ void system_process(void)
 		acia_timer(acia);
 	if (uart)
 		uart16x50_event(uart);
-	if (n++ == 100) {
+	if (++n == 100) {
 		n = 0;
 		if (wiznet)
 			w5100_process(wiz);
@@ -405,12 +469,13 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014-68008: [-1] [-A] [-a] [-b] [-f] [-R] [-r rompath] [-i disk] [-I disk] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014-68008: [-1] [-A] [-a] [-b] [-f] [-X MHz] [-R] [-r rompath] [-i disk] [-I disk] [-w] [-q coverage] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
+	struct cpuclock clk;
 	int opt;
 	int fd;
 	int ppi = 0;
@@ -420,7 +485,7 @@ int main(int argc, char *argv[])
 	int has_acia = 0;
 	int has_16550a = 0;
 
-	while ((opt = getopt(argc, argv, "1Aabd:fi:r:I:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "1Aabd:fi:q:r:I:RwX:")) != -1) {
 		switch (opt) {
 		case '1':
 			has_16550a = 1;
@@ -455,6 +520,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 		case 'R':
 			has_rtc = 1;
 			break;
@@ -464,6 +532,9 @@ int main(int argc, char *argv[])
 		case 'b':
 			bmmu = 1;
 			break;
+		case 'q':
+			cov = coverage_create(1 << 20, optarg);
+			break;
 		default:
 			usage();
 		}
@@ -471,6 +542,8 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	if (has_acia == 0 && has_16550a == 0) {
 		fprintf(stderr, "rc2014: no UART selected, defaulting to 16550A\n");
 		has_16550a = 1;
@@ -481,7 +554,7 @@ int main(int argc, char *argv[])
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom, 524288) != 524288) {
+	if (ram_load(fd, ramrom, 524288) != 524288) {
 		fprintf(stderr, "rc2014: ROM image should be 512K.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -511,17 +584,17 @@ int main(int argc, char *argv[])
 			ppide_attach(ppide, 0, ide_fd);
 			ppide_reset(ppide);
 		}
-		if (trace & TRACE_PPIDE)
+		if (TRACE_ON(trace & TRACE_PPIDE))
 			ppide_trace(ppide, 1);
 	}
 	if (has_rtc) {
 		rtc = rtc_create();
-		rtc_trace(rtc, trace & TRACE_RTC);
+		rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 	}
 	if (has_16550a) {
 		uart = uart16x50_create();
 		uart16x50_set_input(uart, 1);
-		uart16x50_trace(uart, trace & TRACE_UART);
+		uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
 	}
 	if (wiznet) {
 		wiz = nic_w5100_alloc();
@@ -530,11 +603,11 @@ int main(int argc, char *argv[])
 	if (has_acia) {
 		acia = acia_create();
 		acia_set_input(acia, 1);
-		acia_trace(acia, trace & TRACE_ACIA);
+		acia_trace(acia, TRACE_ON(trace & TRACE_ACIA));
 	}
 	if (bmmu) {
 		mmu = sram_mmu_create();
-		sram_mmu_trace(mmu, trace & TRACE_MMU);
+		sram_mmu_trace(mmu, TRACE_ON(trace & TRACE_MMU));
 	}
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
@@ -554,8 +627,10 @@ int main(int argc, char *argv[])
 	/* Really should be 68008 */
 	m68k_set_cpu_type(M68K_CPU_TYPE_68000);
 	m68k_pulse_reset();
+	cpuclock_init(&clk, cpu_hz, 20000);
 	while(1) {
-		m68k_execute(tstate_steps);	/* 4MHz roughly right for 8MHz 68008 */
+		unsigned int n = cpuclock_slice(&clk);
+		cpuclock_ran(&clk, n, m68k_execute(n));
 		system_process();
 	}
 }
@@ -35,8 +35,11 @@
 #include "ppide.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "trace.h"
+#include "coverage.h"
+#include "ramalloc.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
+static uint8_t *ramrom;	/* Covers the banked card */
 
 static unsigned int bankreg[4];
 static uint8_t bankenable;
@@ -82,6 +85,8 @@ static volatile int done;
 
 static int trace = 0;
 
+static struct e6809 cpu;
+
 unsigned int check_chario(void)
 {
 	fd_set i, o;
@@ -155,16 +160,26 @@ static void my_ide_write(uint16_t addr, uint8_t val)
 	ide_write8(ide0, addr, val);
 }
 
-/* Clock timer 3 off timer 2 */
+/* Timer 3 is clocked off timer 2 which we pick up with m6840_falls() */
 void m6840_output_change(struct m6840 *m, uint8_t outputs)
 {
-	static int old = 0;
-	if ((outputs ^ old) & 2) {
-		/* timer 2 high to low -> clock timer 3 */
-		if (!(outputs & 2))
-			m6840_external_clock(ptm, 3);
-	}
-	old = outputs;
+}
+
+/* Timer 2 is clocked by E and clocks timer 3 on its falling edges */
+static void ptm_run(unsigned int cycles)
+{
+	m6840_tick(ptm, cycles);
+	m6840_external_clocks(ptm, 2, cycles);
+	m6840_external_clocks(ptm, 3, m6840_falls(ptm, 2));
+}
+
+/* Cycles until the next interrupt from timer 1 or 2, or from timer 3
+   on the internal clock. Timer 3 off timer 2 shows up after the run */
+static unsigned int ptm_deadline(void)
+{
+	unsigned int d = m6840_deadline(ptm);
+	unsigned int n = m6840_external_deadline(ptm, 2);
+	return n < d ? n : d;
 }
 
 static uint8_t m6809_do_inport(uint8_t addr)
@@ -183,7 +198,7 @@ static uint8_t m6809_do_inport(uint8_t addr)
 		return rtc_read(rtcdev);
 	if (addr >= 0xC0 && addr <= 0xC7)
 		return uart16x50_read(uart, addr & 7);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
@@ -191,21 +206,21 @@ static uint8_t m6809_do_inport(uint8_t addr)
 uint8_t m6809_inport(uint8_t addr)
 {
 	uint8_t r;
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x = ", addr);
 	r = m6809_do_inport(addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "%02x\n", r);
 	return r;
 }
 
 void m6809_outport(uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	if (addr == 0xFF && bankhigh) {
 		mmureg = val;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "MMUreg set to %02X\n", val);
 	}
 	else if (addr == 0x80)
@@ -225,10 +240,10 @@ void m6809_outport(uint8_t addr, uint8_t val)
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
 	} else if (addr == 0x0C && rtc)
@@ -236,10 +251,28 @@ void m6809_outport(uint8_t addr, uint8_t val)
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
+/* Where in ramrom an address currently lands, as do_e6809_read8 */
+static uint32_t phys_addr(unsigned addr)
+{
+	if (bankhigh) {
+		uint8_t reg = mmureg;
+		uint32_t higha;
+		if (addr < 0xE000)
+			reg >>= 1;
+		higha = (reg & 0x40) ? 1 : 0;
+		higha |= (reg & 0x10) ? 2 : 0;
+		higha |= (reg & 0x4) ? 4 : 0;
+		higha |= (reg & 0x01) ? 8 : 0;
+		return (higha << 16) + addr;
+	} else if (bankenable)
+		return (bankreg[(addr & 0xC000) >> 14] << 14) + (addr & 0x3FFF);
+	return addr;
+}
+
 unsigned char do_e6809_read8(unsigned addr, unsigned debug)
 {
 	if (addr >> 8 == 0xFE) {
@@ -259,7 +292,7 @@ unsigned char do_e6809_read8(unsigned addr, unsigned debug)
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 
 		val = ramrom[(higha << 16) + addr];
-		if (trace & TRACE_MEM) {
+		if (TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "R %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
@@ -268,17 +301,17 @@ unsigned char do_e6809_read8(unsigned addr, unsigned debug)
 		return val;
 	} else 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R %04x[%02X] = %02X\n", addr, (unsigned int) bankreg[bank], (unsigned int) ramrom[(bankreg[bank] << 14) + (addr & 0x3FFF)]);
 		addr &= 0x3FFF;
 		return ramrom[(bankreg[bank] << 14) + addr];
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[addr]);
 	return ramrom[addr];
 }
 
-unsigned char e6809_read8(unsigned addr)
+unsigned char e6809_read8(struct e6809 *cpu, unsigned addr)
 {
 	return do_e6809_read8(addr, 0);
 }
@@ -288,7 +321,7 @@ unsigned char e6809_read8_debug(unsigned addr)
 	return do_e6809_read8(addr, 1);
 }
 
-void e6809_write8(unsigned addr, unsigned char val)
+void e6809_write8(struct e6809 *cpu, unsigned addr, unsigned char val)
 {
 	if (addr >> 8 == 0xFE) {
 		m6809_outport(addr & 0xFF, val);
@@ -304,35 +337,35 @@ void e6809_write8(unsigned addr, unsigned char val)
 		higha |= (reg & 0x4) ? 4 : 0;
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 
-		if (trace & TRACE_MEM) {
+		if (TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "W %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
 				(unsigned int)val);
 		}
 		if (!(higha & 8)) {
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "[Discard: ROM]\n");
 			return;
 		}
 		ramrom[(higha << 16)+ addr] = val;
 	} else if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04x[%02X] = %02X\n", (unsigned int) addr, (unsigned int) bankreg[bank], (unsigned int) val);
 		if (bankreg[bank] >= 32) {
 			addr &= 0x3FFF;
 			ramrom[(bankreg[bank] << 14) + addr] = val;
 		}
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
 		if (addr < 32768 && !bank512)
 			ramrom[addr] = val;
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	}
 }
@@ -355,12 +388,18 @@ static const char *make_flags(uint8_t cc)
 	return buf;
 }
 
+/* Instruction addresses run, by physical address, see -q */
+static uint8_t *cov;
+
 /* Called each new instruction issue */
-void e6809_instruction(unsigned pc)
+void e6809_instruction(struct e6809 *cpu, unsigned pc)
 {
 	char buf[80];
-	struct reg6809 *r = e6809_get_regs();
-	if (trace & TRACE_CPU) {
+	struct reg6809 *r;
+	if (cov)
+		coverage_mark(cov, phys_addr(pc));
+	if (TRACE_ON(trace & TRACE_CPU)) {
+		r = e6809_get_regs(cpu);
 		d6809_disassemble(buf, pc);
 		fprintf(stderr, "%04X: %-16.16s | ", pc, buf);
 		fprintf(stderr, "%s %02X:%02X %04X %04X %04X %04X\n",
@@ -384,7 +423,7 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014-6809: [-b] [-f] [-R] [-i idepath] [-I ppidepath] [-r rompath] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014-6809: [-b] [-f] [-R] [-i idepath] [-I ppidepath] [-r rompath] [-w] [-q coverage] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -398,7 +437,7 @@ int main(int argc, char *argv[])
 	char *idepath;
 	unsigned int cycles = 0;
 
-	while ((opt = getopt(argc, argv, "1abBd:fi:I:r:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "1abBd:fi:I:q:r:Rw")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -433,6 +472,9 @@ int main(int argc, char *argv[])
 		case 'w':
 			wiznet = 1;
 			break;
+		case 'q':
+			cov = coverage_create(1024 * 1024, optarg);
+			break;
 		default:
 			usage();
 		}
@@ -440,6 +482,8 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	if (rom == 0 && bank512 == 0 && bankhigh == 0) {
 		fprintf(stderr, "rc2014-6809: no ROM\n");
 		exit(EXIT_FAILURE);
@@ -451,7 +495,7 @@ int main(int argc, char *argv[])
 			perror(rompath);
 			exit(EXIT_FAILURE);
 		}
-		if (read(fd, ramrom + 32768, 32768) != 32768) {
+		if (ram_load(fd, ramrom + 32768, 32768) != 32768) {
 			fprintf(stderr, "rc2014: short rom '%s'.\n", rompath);
 			exit(EXIT_FAILURE);
 		}
@@ -464,7 +508,7 @@ int main(int argc, char *argv[])
 			perror(rompath);
 			exit(EXIT_FAILURE);
 		}
-		if (read(fd, ramrom, 524288) != 524288) {
+		if (ram_load(fd, ramrom, 524288) != 524288) {
 			fprintf(stderr, "rc2014: banked rom image should be 512K.\n");
 			exit(EXIT_FAILURE);
 		}
@@ -496,17 +540,17 @@ int main(int argc, char *argv[])
 				ide = 0;
 			} else
 				ppide_attach(ppide, 0, ide_fd);
-			if (trace & TRACE_PPIDE)
+			if (TRACE_ON(trace & TRACE_PPIDE))
 				ppide_trace(ppide, 1);
 		}
 	}
 
 	uart = uart16x50_create();
-	uart16x50_trace(uart, trace & TRACE_UART);
+	uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
 	uart16x50_set_input(uart, 1);
 
 	ptm = m6840_create();
-	m6840_trace(ptm, trace & TRACE_PTM);
+	m6840_trace(ptm, TRACE_ON(trace & TRACE_PTM));
 
 	if (wiznet) {
 		wiz = nic_w5100_alloc();
@@ -516,7 +560,7 @@ int main(int argc, char *argv[])
 	if (rtc) {
 		rtcdev = rtc_create();
 		rtc_reset(rtcdev);
-		if (trace & TRACE_RTC)
+		if (TRACE_ON(trace & TRACE_RTC))
 			rtc_trace(rtcdev, 1);
 	}
 
@@ -540,7 +584,7 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-	e6809_reset(trace & TRACE_CPU);
+	e6809_reset(&cpu, TRACE_ON(trace & TRACE_CPU));
 
 	/* This is the wrong way to do it but it's easier for the moment. We
 	   should track how much real time has occurred and try to keep cycle
@@ -548,16 +592,23 @@ int main(int argc, char *argv[])
 	   is loaded though */
 
 	while (!done) {
-		unsigned int i, j;
+		unsigned int i, n, d;
 		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
-			while(cycles < clockrate)
-				cycles += e6809_sstep(live_irq, 0);
-			m6840_tick(ptm, cycles);
-			for (j = 0; j < cycles; j++)
-				m6840_external_clock(ptm, 2);
+			/* Stop early when a timer is due so the interrupt is
+			   taken on the cycle it happens */
+			while (cycles < clockrate) {
+				n = clockrate - cycles;
+				d = ptm_deadline();
+				if (d < n)
+					n = d;
+				e6809_irq(&cpu, live_irq, 0);
+				n = e6809_run(&cpu, n);
+				ptm_run(n);
+				cycles += n;
+				recalc_interrupts();
+			}
 			cycles -= clockrate;
-			recalc_interrupts();
 		}
 		/* Drive the  serial */
 		uart16x50_event(uart);
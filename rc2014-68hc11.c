@@ -32,8 +32,10 @@
 #include "rtc_bitbang.h"
 #include "w5100.h"
 #include "sdcard.h"
+#include "trace.h"
+#include "ramalloc.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
+static uint8_t *ramrom;	/* Covers the banked card */
 static uint8_t monitor[12288];		/* Monitor ROM - usually Buffalo */
 static uint8_t eerom[2048];		/* EEROM - not properly emulated yet */
 
@@ -156,7 +158,7 @@ void m6800_sci_change(struct m6800 *cpu)
 	unsigned int divider = 1 << (cpu->io.baud & 7);
 
 	/* SCI changed status - could add debug here FIXME */
-	if (!(trace & TRACE_UART))
+	if (!TRACE_ON(trace & TRACE_UART))
 		return;
 
 	baseclock /= prescale;
@@ -191,6 +193,7 @@ static void flatarecalc(struct m6800 *cpu)
 		flatahigh += 0x40000;
 	if (bits & 0x08)
 		flatahigh += 0x80000;
+	m6800_decode_flush(cpu);
 }
 
 
@@ -229,10 +232,10 @@ void m68hc11_spi_begin(struct m6800 *cpu, uint8_t val)
 {
 	spi_rxbyte = 0xFF;
 	if (sdcard) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "SPI -> %02X\n", val);
 		spi_rxbyte = sd_spi_in(sdcard, val);
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "SPI <- %02X\n", spi_rxbyte);
 	}
 }
@@ -264,7 +267,7 @@ static void my_ide_write(uint16_t addr, uint8_t val)
 
 uint8_t m6800_inport(uint8_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
 		return my_ide_read(addr & 7);
@@ -276,18 +279,19 @@ uint8_t m6800_inport(uint8_t addr)
 		return nic_w5100_read(wiz, addr & 3);
 	if (addr == 0x0C && rtc)
 		return rtc_read(rtcdev);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 void m6800_outport(uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	if (addr == 0xFF && bankhigh) {
 		mmureg = val;
-		if (trace & TRACE_512)
+		m6800_decode_flush(&cpu);
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "MMUreg set to %02X\n", val);
 	}
 	else if (addr == 0x80)
@@ -303,12 +307,14 @@ void m6800_outport(uint8_t addr, uint8_t val)
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		m6800_decode_flush(&cpu);
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
+		m6800_decode_flush(&cpu);
 	} else if (addr == 0x0C && rtc)
 		rtc_write(rtcdev, val);
 	else if (addr == 0xFD) {
@@ -318,7 +324,7 @@ void m6800_outport(uint8_t addr, uint8_t val)
 		protlow = val;
 	else if (addr == 0xFB)
 		prothi = val;
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -341,7 +347,7 @@ uint8_t m6800_read_op(struct m6800 *cpu, uint16_t addr, int debug)
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 
 		val = ramrom[(higha << 16) + addr];
-		if (!debug && (trace & TRACE_MEM)) {
+		if (!debug && TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "R %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
@@ -350,16 +356,16 @@ uint8_t m6800_read_op(struct m6800 *cpu, uint16_t addr, int debug)
 		return val;
 	} else 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (!debug && (trace & TRACE_MEM))
+		if (!debug && TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R %04x[%02X] = %02X\n", addr, (unsigned int) bankreg[bank], (unsigned int) ramrom[(bankreg[bank] << 14) + (addr & 0x3FFF)]);
 		addr &= 0x3FFF;
 		return ramrom[(bankreg[bank] << 14) + addr];
 	} else if (bankflat) {
-		if (!debug && (trace & TRACE_MEM))
+		if (!debug && TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R [%02X]%04x = %02X\n", flatahigh >> 16, addr, (unsigned int) ramrom[flatahigh + addr]);
 		return ramrom[flatahigh + addr];
 	}
-	if (!debug && (trace & TRACE_MEM))
+	if (!debug && TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[addr]);
 	return ramrom[addr];
 }
@@ -396,44 +402,44 @@ void m6800_write(struct m6800 *cpu, uint16_t addr, uint8_t val)
 		higha |= (reg & 0x4) ? 4 : 0;
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 
-		if (trace & TRACE_MEM) {
+		if (TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "W %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
 				(unsigned int)val);
 		}
 		if (!(higha & 8)) {
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "[Discard: ROM]\n");
 			return;
 		}
 		ramrom[(higha << 16)+ addr] = val;
 	} else if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04x[%02X] = %02X\n", (unsigned int) addr, (unsigned int) bankreg[bank], (unsigned int) val);
 		if (bankreg[bank] >= 32) {
 			addr &= 0x3FFF;
 			ramrom[(bankreg[bank] << 14) + addr] = val;
 		}
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else if (bankflat) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W [%02X]%04x = %02X\n", flatahigh >> 16, (unsigned int) addr, (unsigned int) val);
 		if (flatahigh >= 0x80000)
 			ramrom[flatahigh + addr] = val;
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else if (bankflat) {
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
 		if (addr < 32768 && !bank512)
 			ramrom[addr] = val;
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	}
 }
@@ -530,6 +536,8 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	if (rom == 0 && bank512 == 0 && bankhigh == 0 && bankflat == 0) {
 		fprintf(stderr, "rc2014-68hc11: no ROM\n");
 		exit(EXIT_FAILURE);
@@ -541,7 +549,7 @@ int main(int argc, char *argv[])
 			perror(rompath);
 			exit(EXIT_FAILURE);
 		}
-		if (read(fd, ramrom + 32768, 32768) != 32768) {
+		if (ram_load(fd, ramrom + 32768, 32768) != 32768) {
 			fprintf(stderr, "rc2014-68hc11: short rom '%s'.\n", rompath);
 			exit(EXIT_FAILURE);
 		}
@@ -568,7 +576,7 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
 
@@ -578,7 +586,7 @@ int main(int argc, char *argv[])
 			perror(rompath);
 			exit(EXIT_FAILURE);
 		}
-		if (read(fd, ramrom, 524288) != 524288) {
+		if (ram_load(fd, ramrom, 524288) != 524288) {
 			fprintf(stderr, "rc2014-68hc11: banked rom image should be 512K.\n");
 			exit(EXIT_FAILURE);
 		}
@@ -611,7 +619,7 @@ int main(int argc, char *argv[])
 				ide = 0;
 			} else
 				ppide_attach(ppide, 0, ide_fd);
-			if (trace & TRACE_PPIDE)
+			if (TRACE_ON(trace & TRACE_PPIDE))
 				ppide_trace(ppide, 1);
 		}
 	}
@@ -624,7 +632,7 @@ int main(int argc, char *argv[])
 	if (rtc) {
 		rtcdev = rtc_create();
 		rtc_reset(rtcdev);
-		if (trace & TRACE_RTC)
+		if (TRACE_ON(trace & TRACE_RTC))
 			rtc_trace(rtcdev, 1);
 	}
 
@@ -654,7 +662,7 @@ int main(int argc, char *argv[])
 	else	/* 68HC11E0 for now */
 		m68hc11e_reset(&cpu, 0, 0, NULL, NULL);
 
-	if (trace & TRACE_CPU)
+	if (TRACE_ON(trace & TRACE_CPU))
 		cpu.debug = 1;
 
 	/* This is the wrong way to do it but it's easier for the moment. We
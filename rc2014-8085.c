@@ -37,8 +37,11 @@
 #include "ppide.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "trace.h"
+#include "ramalloc.h"
+#include "cpuclock.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
+static uint8_t *ramrom;	/* Covers the banked card */
 
 static unsigned int bankreg[4];
 static uint8_t bankenable;
@@ -55,7 +58,7 @@ struct ppide *ppide;
 struct rtc *rtcdev;
 struct uart16x50 *uart;
 
-static uint16_t tstate_steps = 369;	/* RC2014 speed (7.4MHz)*/
+static unsigned long cpu_hz = 7372800;	/* RC2014 speed */
 
 /* Who is pulling on the interrupt line */
 
@@ -86,6 +89,8 @@ static volatile int done;
 
 static int trace = 0;
 
+static struct i8085 cpu;
+
 /* FIXME: emulate paging off correctly, also be nice to emulate with less
    memory fitted */
 uint8_t i8085_do_read(uint16_t addr)
@@ -102,7 +107,7 @@ uint8_t i8085_do_read(uint16_t addr)
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 
 		val = ramrom[(higha << 16) + addr];
-		if (trace & TRACE_MEM) {
+		if (TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "R %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
@@ -111,28 +116,28 @@ uint8_t i8085_do_read(uint16_t addr)
 		return val;
 	} else 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R %04x[%02X] = %02X\n", addr, (unsigned int) bankreg[bank], (unsigned int) ramrom[(bankreg[bank] << 14) + (addr & 0x3FFF)]);
 		addr &= 0x3FFF;
 		return ramrom[(bankreg[bank] << 14) + addr];
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[addr]);
 	return ramrom[addr];
 }
 
-uint8_t i8085_debug_read(uint16_t addr)
+uint8_t i8085_debug_read(struct i8085 *cpu, uint16_t addr)
 {
 	return i8085_do_read(addr);	/* No side effects */
 }
 
-uint8_t i8085_read(uint16_t addr)
+uint8_t i8085_read(struct i8085 *cpu, uint16_t addr)
 {
 	return i8085_do_read(addr);
 }
 
 
-void i8085_write(uint16_t addr, uint8_t val)
+void i8085_write(struct i8085 *cpu, uint16_t addr, uint8_t val)
 {
 	if (bankhigh) {
 		uint8_t reg = mmureg;
@@ -144,35 +149,35 @@ void i8085_write(uint16_t addr, uint8_t val)
 		higha |= (reg & 0x4) ? 4 : 0;
 		higha |= (reg & 0x01) ? 8 : 0;	/* ROM/RAM */
 		
-		if (trace & TRACE_MEM) {
+		if (TRACE_ON(trace & TRACE_MEM)) {
 			fprintf(stderr, "W %04X[%02X] = %02X\n",
 				(unsigned int)addr,
 				(unsigned int)higha,
 				(unsigned int)val);
 		}
 		if (!(higha & 8)) {
-			if (trace & TRACE_MEM)
+			if (TRACE_ON(trace & TRACE_MEM))
 				fprintf(stderr, "[Discard: ROM]\n");
 			return;
 		}
 		ramrom[(higha << 16)+ addr] = val;
 	} else if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04x[%02X] = %02X\n", (unsigned int) addr, (unsigned int) bankreg[bank], (unsigned int) val);
 		if (bankreg[bank] >= 32) {
 			addr &= 0x3FFF;
 			ramrom[(bankreg[bank] << 14) + addr] = val;
 		}
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
 		if (addr >= 8192 && !bank512)
 			ramrom[addr] = val;
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	}
 }
@@ -218,9 +223,9 @@ unsigned int next_char(void)
 void recalc_interrupts(void)
 {
 	if (live_irq)
-		i8085_set_int(INT_RST65);
+		i8085_set_int(&cpu, INT_RST65);
 	else
-		i8085_clear_int(INT_RST65);
+		i8085_clear_int(&cpu, INT_RST65);
 }
 
 static void int_set(int src)
@@ -268,9 +273,9 @@ static void my_ide_write(uint16_t addr, uint8_t val)
    
  */
 
-uint8_t i8085_inport(uint8_t addr)
+uint8_t i8085_inport(struct i8085 *cpu, uint8_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if ((addr >= 0xA0 && addr <= 0xA7) && acia)
 		return acia_read(acia, addr & 1);
@@ -286,18 +291,18 @@ uint8_t i8085_inport(uint8_t addr)
 		return rtc_read(rtcdev);
 	else if (addr >= 0xC0 && addr <= 0xCF && uart)
 		return uart16x50_read(uart, addr & 0x0F);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
-void i8085_outport(uint8_t addr, uint8_t val)
+void i8085_outport(struct i8085 *cpu, uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	if (addr == 0xFF && bankhigh) {
 		mmureg = val;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "MMUreg set to %02X\n", val);
 	} else if ((addr >= 0xA0 && addr <= 0xA7) && acia)
 		acia_write(acia, addr & 1, val);
@@ -312,10 +317,10 @@ void i8085_outport(uint8_t addr, uint8_t val)
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
 	} else if (addr == 0x0C && rtc)
@@ -325,20 +330,20 @@ void i8085_outport(uint8_t addr, uint8_t val)
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
 /* For now we don't emulate the bitbang port */
 
-int i8085_get_input(void)
+int i8085_get_input(struct i8085 *cpu)
 {
 	return 0;
 }
 
 /* And we emulate wiring the SIM bit to M1 */
 
-void i8085_set_output(int value)
+void i8085_set_output(struct i8085 *cpu, int value)
 {
 }
 
@@ -363,13 +368,14 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014-8085: [-1] [-a] [-b] [-B] [-e rombank] [-f] [-i idepath] [-I ppidepath] [-R] [-r rompath] [-e rombank] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014-8085: [-1] [-a] [-b] [-B] [-e rombank] [-f] [-X MHz] [-i idepath] [-I ppidepath] [-R] [-r rompath] [-e rombank] [-w] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
 	static struct timespec tc;
+	struct cpuclock clk;
 	int opt;
 	int fd;
 	int rom = 1;
@@ -379,7 +385,7 @@ int main(int argc, char *argv[])
 	int acia_input;
 	int uart_16550a = 0;
 
-	while ((opt = getopt(argc, argv, "1abBd:e:fi:I:r:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "1abBd:e:fi:I:r:RwX:")) != -1) {
 		switch (opt) {
 		case '1':
 			uart_16550a = 1;
@@ -420,6 +426,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 		case 'R':
 			rtc = 1;
 			break;
@@ -433,6 +442,8 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	if (acia_uart == 0 && uart_16550a == 0) {
 		fprintf(stderr, "rc2014-8085: no UART selected, defaulting to 68B50\n");
 		acia_uart = 1;
@@ -457,7 +468,7 @@ int main(int argc, char *argv[])
 			perror("lseek");
 			exit(1);
 		}
-		if (read(fd, ramrom, 65536) < 2048) {
+		if (ram_load(fd, ramrom, 65536) < 2048) {
 			fprintf(stderr, "rc2014-8085: short rom '%s'.\n", rompath);
 			exit(EXIT_FAILURE);
 		}
@@ -470,7 +481,7 @@ int main(int argc, char *argv[])
 			perror(rompath);
 			exit(EXIT_FAILURE);
 		}
-		if (read(fd, ramrom, 524288) != 524288) {
+		if (ram_load(fd, ramrom, 524288) != 524288) {
 			fprintf(stderr, "rc2014-8085: banked rom image should be 512K.\n");
 			exit(EXIT_FAILURE);
 		}
@@ -502,20 +513,20 @@ int main(int argc, char *argv[])
 				ide = 0;
 			} else
 				ppide_attach(ppide, 0, ide_fd);
-			if (trace & TRACE_PPIDE)
+			if (TRACE_ON(trace & TRACE_PPIDE))
 				ppide_trace(ppide, 1);
 		}
 	}
 
 	if (acia_uart) {
 		acia = acia_create();
-		if (trace & TRACE_ACIA)
+		if (TRACE_ON(trace & TRACE_ACIA))
 			acia_trace(acia, 1);
 		acia_set_input(acia, acia_input);
 	}
 	if (uart_16550a) {
 		uart = uart16x50_create();
-		if (trace & TRACE_UART)
+		if (TRACE_ON(trace & TRACE_UART))
 			uart16x50_trace(uart, 1);
 		uart16x50_set_input(uart, 1);
 	}
@@ -528,7 +539,7 @@ int main(int argc, char *argv[])
 	if (rtc) {
 		rtcdev = rtc_create();
 		rtc_reset(rtcdev);
-		if (trace & TRACE_RTC)
+		if (TRACE_ON(trace & TRACE_RTC))
 			rtc_trace(rtcdev, 1);
 	}
 
@@ -552,9 +563,9 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-	i8085_reset();
-	if (trace & TRACE_CPU) {
-		i8085_log = stderr;
+	i8085_reset(&cpu);
+	if (TRACE_ON(trace & TRACE_CPU)) {
+		cpu.log = stderr;
 	}
 
 	/* This is the wrong way to do it but it's easier for the moment. We
@@ -562,14 +573,15 @@ int main(int argc, char *argv[])
 	   matched with that. The scheme here works fine except when the host
 	   is loaded though */
 
-	/* We run 7372000 t-states per second */
-	/* We run 369 cycles per I/O check, do that 100 times then poll the
-	   slow stuff and nap for 5ms. */
+	/* We run cpu_hz cycles a second in 50us slices, do 100 of those
+	   then poll the slow stuff and nap for 5ms. */
+	cpuclock_init(&clk, cpu_hz, 20000);
 	while (!done) {
 		int i;
-		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
-			i8085_exec(tstate_steps);
+			int n = cpuclock_slice(&clk);
+			/* What comes back is the overrun, zero or less */
+			cpuclock_ran(&clk, n, n - i8085_exec(&cpu, n));
 			if (acia)
 				acia_timer(acia);
 			if (uart_16550a) {
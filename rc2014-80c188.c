@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -21,23 +22,30 @@
 #include <errno.h>
 #include <sys/select.h>
 #include "80x86/e8086.h"
+#include "i80188_io.h"
 #include "ide.h"
 #include "ppide.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "trace.h"
+#include "ramalloc.h"
+#include "cpuclock.h"
 
-static uint8_t ramrom[1024 * 1024];
+static uint8_t *ramrom;
 
 static uint8_t rtc;
 static uint8_t fast = 0;
 static uint8_t wiznet = 0;
+static uint8_t prefetch = 0;
 
 e8086_t *cpu;
+static struct i80188_io *pcb;
+static bool dma_live;
 struct ppide *ppide;
 struct rtc *rtcdev;
 static nic_w5100_t *wiz;
 
-static uint16_t tstate_steps = 369;	/* RC2014 speed (7.4MHz)  for now */
+static unsigned long cpu_hz = 7372800;	/* RC2014 speed for now */
 
 static volatile int done;
 
@@ -68,7 +76,7 @@ static int trace = 0;
 
 uint8_t i808x_do_read(uint32_t addr)
 {
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %06X = %02X\n", addr, ramrom[addr]);
 	return ramrom[addr];
 }
@@ -98,7 +106,7 @@ void do_i808x_write(uint32_t addr, uint8_t val)
 		return;
 	}
 	ramrom[addr] = val;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %06X = %02X\n", addr, val);
 }
 
@@ -152,13 +160,13 @@ unsigned int next_char(void)
 	return c;
 }
 
-/* FIXME: we really need to do the right 80C188 vectoring */
+/* Board interrupts are wired to INT0 of the interrupt controller */
 void recalc_interrupts(void)
 {
-	if (live_irq)
-		e86_irq(cpu, 0x20);
-	else
-		e86_irq(cpu, 0);
+	/* The UART is set up before the CPU exists */
+	if (pcb == NULL)
+		return;
+	i80188_interrupt(pcb, 0, live_irq != 0);
 }
 
 static void int_set(int src)
@@ -264,7 +272,7 @@ static void show_settings(struct uart16x50 *uptr)
 {
     uint32_t baud;
 
-    if (!(trace & TRACE_UART))
+    if (!TRACE_ON(trace & TRACE_UART))
         return;
 
     baud = uptr->ls + (uptr->ms << 8);
@@ -431,7 +439,7 @@ static void my_ide_write(uint16_t addr, uint8_t val)
 
 static uint8_t i808x_inport(uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %04x\n", addr);
 	addr &= 0xFF;
 	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
@@ -446,14 +454,14 @@ static uint8_t i808x_inport(uint16_t addr)
 		return rtc_read(rtcdev);
 	else if (addr >= 0xC0 && addr <= 0xCF && uart_16550a)
 		return uart_read(&uart, addr & 0x0F);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void i808x_outport(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %04x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
@@ -471,33 +479,90 @@ static void i808x_outport(uint16_t addr, uint8_t val)
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
+/* The peripheral control block sits on the internal bus and is seen
+   before anything external */
+
 static uint8_t i808x_in8(void *mem, unsigned long addr)
 {
+	if (i80188_iospace(pcb, addr))
+		return i80188_read(pcb, addr);
 	return i808x_inport(addr & 0xFFFF);
 }
 
 static uint16_t i808x_in16(void *mem, unsigned long addr)
 {
-	uint16_t r = i808x_inport(addr);
+	uint16_t r;
+	if (i80188_iospace(pcb, addr))
+		return i80188_read16(pcb, addr);
+	r = i808x_inport(addr);
 	r |= i808x_inport(addr + 1) << 8;
 	return r;
 }
 
 static void i808x_out8(void *mem, unsigned long addr, uint8_t val)
 {
+	if (i80188_iospace(pcb, addr)) {
+		i80188_write(pcb, addr, val);
+		dma_live = i80188_dma_live(pcb);
+		return;
+	}
 	i808x_outport(addr, val);
 }
 
 static void i808x_out16(void *mem, unsigned long addr, uint16_t val)
 {
+	if (i80188_iospace(pcb, addr)) {
+		i80188_write16(pcb, addr, val);
+		dma_live = i80188_dma_live(pcb);
+		return;
+	}
 	i808x_outport(addr, val);
 	i808x_outport(addr + 1, val >> 8);
 }
 
+/* DMA engine side of the bus */
+
+uint8_t i80188_mem_read(uint32_t addr)
+{
+	return i808x_do_read(addr);
+}
+
+void i80188_mem_write(uint32_t addr, uint8_t val)
+{
+	do_i808x_write(addr, val);
+}
+
+uint8_t i80188_io_read(uint16_t port)
+{
+	return i808x_inport(port);
+}
+
+void i80188_io_write(uint16_t port, uint8_t val)
+{
+	i808x_outport(port, val);
+}
+
+/* Bulk transfers between the CF data port and memory unless something
+   wants to see each access */
+size_t i80188_dma_block(uint16_t port, uint32_t addr, size_t len, int to_io)
+{
+	port &= 0xFF;
+	if (ide != 1 || (port != 0x10 && port != 0x90))
+		return 0;
+	if (TRACE_ON(trace & (TRACE_MEM | TRACE_IO)))
+		return 0;
+	if (to_io)
+		return ide_write_block(ide0, ramrom + addr, len);
+	/* ROM is the top half and doesn't take writes */
+	if (addr + len > 512 * 1024)
+		return 0;
+	return ide_read_block(ide0, ramrom + addr, len);
+}
+
 static void poll_irq_event(void)
 {
 }
@@ -517,13 +582,14 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014-80c188: [-1] [-f] [-R] [-r rompath] [-e rombank] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014-80c188: [-1] [-f] [-X MHz] [-p] [-R] [-r rompath] [-e rombank] [-w] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
 	static struct timespec tc;
+	struct cpuclock clk;
 	int opt;
 	int fd;
 	char *rompath = "rc2014-808x.rom";
@@ -531,7 +597,7 @@ int main(int argc, char *argv[])
 
 	uart_16550a = 1;
 
-	while ((opt = getopt(argc, argv, "d:fi:I:r:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "d:fi:I:pr:RwX:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -550,6 +616,12 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
+		case 'p':
+			prefetch = 1;
+			break;
 		case 'R':
 			rtc = 1;
 			break;
@@ -563,12 +635,14 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	fd = open(rompath, O_RDONLY);
 	if (fd == -1) {
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom + 512 * 1024, 512 * 1024) < 512 * 1024) {
+	if (ram_load(fd, ramrom + 512 * 1024, 512 * 1024) < 512 * 1024) {
 		fprintf(stderr, "rc2014: short rom '%s'.\n", rompath);
 		exit(EXIT_FAILURE);
 	}
@@ -598,7 +672,7 @@ int main(int argc, char *argv[])
 				ide = 0;
 			} else
 				ppide_attach(ppide, 0, ide_fd);
-			if (trace & TRACE_PPIDE)
+			if (TRACE_ON(trace & TRACE_PPIDE))
 				ppide_trace(ppide, 1);
 		}
 	}
@@ -614,7 +688,7 @@ int main(int argc, char *argv[])
 	if (rtc) {
 		rtcdev = rtc_create();
 		rtc_reset(rtcdev);
-		if (trace & TRACE_RTC)
+		if (TRACE_ON(trace & TRACE_RTC))
 			rtc_trace(rtcdev, 1);
 	}
 
@@ -644,17 +718,22 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	e86_init(cpu);
-	/* FIXME: no 80C188 emulation so need to tweak emulator later */
 	e86_set_80186(cpu);
+	pcb = i80188_create(cpu);
+	if (TRACE_ON(trace & TRACE_IRQ))
+		i80188_trace(pcb, 1);
 	/* Bus interfaces */
 	e86_set_mem(cpu, NULL, i808x_read8, i808x_write8, i808x_read16, i808x_write16);
 	e86_set_prt(cpu, NULL, i808x_in8, i808x_out8, i808x_in16, i808x_out16);
-	e86_set_ram(cpu, ramrom, sizeof(ramrom));
+	e86_set_ram(cpu, ramrom, 1024 * 1024);
+	/* Model the prefetch queue only if asked, it costs a lot */
+	if (!prefetch)
+		e86_set_pq_direct(cpu, 1);
 
 	/* Reset the CPU */	
 	e86_reset(cpu);
 
-	if (trace & TRACE_CPU) {
+	if (TRACE_ON(trace & TRACE_CPU)) {
 //		i808x_log = stderr;
 	}
 
@@ -663,14 +742,21 @@ int main(int argc, char *argv[])
 	   matched with that. The scheme here works fine except when the host
 	   is loaded though */
 
-	/* We run 7372000 t-states per second */
-	/* We run 369 cycles per I/O check, do that 100 times then poll the
-	   slow stuff and nap for 5ms. */
+	/* We run cpu_hz cycles a second in 50us slices, do 100 of those
+	   then poll the slow stuff and nap for 5ms. */
+	cpuclock_init(&clk, cpu_hz, 20000);
 	while (!done) {
 		int i;
-		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
-			e86_clock(cpu, tstate_steps);
+			unsigned int n = cpuclock_slice(&clk);
+			unsigned int used = 0;
+			if (dma_live) {
+				used = i80188_dma(pcb, n);
+				dma_live = i80188_dma_live(pcb);
+			}
+			if (used < n)
+				e86_clock(cpu, n - used);
+			i80188_event(pcb, n);
 			if (uart_16550a)
 				uart_event(&uart);
 		}
@@ -20,8 +20,11 @@
 #include "ppide.h"
 #include "rtc_bitbang.h"
 #include "w5100.h"
+#include "trace.h"
+#include "ramalloc.h"
+#include "cpuclock.h"
 
-static uint8_t ramrom[1024 * 1024];
+static uint8_t *ramrom;
 static uint8_t rtc;
 static uint8_t fast = 0;
 static uint8_t wiznet = 0;
@@ -29,7 +32,7 @@ struct ppide *ppide;
 struct rtc *rtcdev;
 struct uart16x50 *uart;
 
-static uint16_t tstate_steps = 369;	/* RC2014 speed (7.4MHz)*/
+static unsigned long cpu_hz = 7372800;	/* RC2014 speed */
 
 /* Who is pulling on the interrupt line */
 
@@ -143,7 +146,7 @@ uint8_t ns32016_do_port_read(uint32_t addr)
 {
 	if (addr & 1)
 		return 0xFF;
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr >>= 1;
 	addr &= 0xFF;
@@ -159,16 +162,25 @@ uint8_t ns32016_do_port_read(uint32_t addr)
 		return rtc_read(rtcdev);
 	else if (addr >= 0xC0 && addr <= 0xCF && uart)
 		return uart16x50_read(uart, addr & 0x0F);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
+/* The CPU can read RAM directly unless we are tracing memory accesses */
+static void ram_view(void)
+{
+	if (TRACE_ON(trace & TRACE_MEM))
+		ns32016_set_ram(NULL, 0);
+	else
+		ns32016_set_ram(ramrom, 1024 * 1024);
+}
+
 void ns32016_do_port_write(uint32_t addr, uint8_t val)
 {
 	if (addr & 1)
 		return;
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr >>= 1;
 	addr &= 0xFF;
@@ -187,7 +199,8 @@ void ns32016_do_port_write(uint32_t addr, uint8_t val)
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+		ram_view();
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -211,7 +224,7 @@ uint8_t ns32016_debug_read8(uint16_t addr)
 uint8_t ns32016_read8(uint32_t addr)
 {
 	uint8_t r = ns32016_do_read(addr, 0);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %06X = %02X\n", addr, r);
 	return r;
 }
@@ -222,7 +235,7 @@ void ns32016_write8(uint32_t addr, uint8_t val)
 		ns32016_do_port_write(addr, val);
 		return;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %06X = %02X\n", addr, val);
 	if (addr > 0x8000)
 		ramrom[addr] = val;
@@ -248,19 +261,20 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "rc2014-ns32k: [-1] [-a] [-b] [-B] [-e rombank] [-f] [-i idepath] [-I ppidepath] [-R] [-r rompath] [-e rombank] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014-ns32k: [-1] [-a] [-b] [-B] [-e rombank] [-f] [-X MHz] [-i idepath] [-I ppidepath] [-R] [-r rompath] [-e rombank] [-w] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
 	static struct timespec tc;
+	struct cpuclock clk;
 	int opt;
 	int fd;
 	char *rompath = "rc2014-ns32k.rom";
 	char *idepath = NULL;
 
-	while ((opt = getopt(argc, argv, "d:fi:I:r:Rw")) != -1) {
+	while ((opt = getopt(argc, argv, "d:fi:I:r:RwX:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -279,6 +293,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 		case 'R':
 			rtc = 1;
 			break;
@@ -292,12 +309,14 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	ramrom = ram_alloc(1024 * 1024);
+
 	fd = open(rompath, O_RDONLY);
 	if (fd == -1) {
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom, 32768) != 32768) {
+	if (ram_load(fd, ramrom, 32768) != 32768) {
 		fprintf(stderr, "rc2014-ns32k: short rom '%s'.\n", rompath);
 		exit(EXIT_FAILURE);
 	}
@@ -327,13 +346,13 @@ int main(int argc, char *argv[])
 				ide = 0;
 			} else
 				ppide_attach(ppide, 0, ide_fd);
-			if (trace & TRACE_PPIDE)
+			if (TRACE_ON(trace & TRACE_PPIDE))
 				ppide_trace(ppide, 1);
 		}
 	}
 
 	uart = uart16x50_create();
-	if (trace & TRACE_UART)
+	if (TRACE_ON(trace & TRACE_UART))
 		uart16x50_trace(uart, 1);
 	uart16x50_set_input(uart, 1);
 
@@ -345,7 +364,7 @@ int main(int argc, char *argv[])
 	if (rtc) {
 		rtcdev = rtc_create();
 		rtc_reset(rtcdev);
-		if (trace & TRACE_RTC)
+		if (TRACE_ON(trace & TRACE_RTC))
 			rtc_trace(rtcdev, 1);
 	}
 
@@ -370,9 +389,10 @@ int main(int argc, char *argv[])
 	}
 
 	ns32016_init();
+	ram_view();
 	ns32016_reset_addr(0);
 
-	if (trace & TRACE_CPU) {
+	if (TRACE_ON(trace & TRACE_CPU)) {
 	}
 
 	/* This is the wrong way to do it but it's easier for the moment. We
@@ -380,14 +400,14 @@ int main(int argc, char *argv[])
 	   matched with that. The scheme here works fine except when the host
 	   is loaded though */
 
-	/* We run 7372000 t-states per second */
-	/* We run 369 cycles per I/O check, do that 100 times then poll the
-	   slow stuff and nap for 5ms. */
+	/* We run cpu_hz cycles a second in 50us slices, do 100 of those
+	   then poll the slow stuff and nap for 5ms. */
+	cpuclock_init(&clk, cpu_hz, 20000);
 	while (!done) {
 		int i;
-		/* 36400 T states for base RC2014 - varies for others */
 		for (i = 0; i < 100; i++) {
-			ns32016_exec(tstate_steps);
+			unsigned int n = cpuclock_slice(&clk);
+			cpuclock_ran(&clk, n, ns32016_exec(n));
 			uart16x50_event(uart);
 			if (uart16x50_irq_pending(uart))
 				int_set(IRQ_16550A);
@@ -27,11 +27,19 @@
 #include "libz180/z180.h"
 #include "lib765/include/765.h"
 #include "z180_io.h"
+#include "cpuclock.h"
+#include "z180run.h"
 
 #include "16x50.h"
 #include "acia.h"
+#include "console.h"
+#include "chardev.h"
+#include "metrics.h"
 #include "ide.h"
 #include "ppide.h"
+#include "pvdisk.h"
+#include "hostfs.h"
+#include "perfctr.h"
 #include "piratespi.h"
 #include "rtc_bitbang.h"
 #include "sdcard.h"
@@ -39,15 +47,23 @@
 #include "tms9918a_render.h"
 #include "w5100.h"
 #include "z80dis.h"
+#include "z80prof.h"
 #include "zxkey.h"
+#include "ramalloc.h"
+#include "trace.h"
 
-static uint8_t ramrom[1024 * 1024];	/* Low 512K is ROM */
+#define RAMROM_SIZE	(1024 * 1024)
+static uint8_t *ramrom;		/* Low 512K is ROM */
 
 #define CPUBOARD_Z180		0
 
 static uint8_t cpuboard = CPUBOARD_Z180;
 
 static uint8_t fast = 0;
+static uint8_t auto_turbo;		/* Pick fast or real time by frame */
+static unsigned int auto_fdc;		/* Accesses seen by auto turbo */
+static unsigned int auto_rtc;
+static unsigned int auto_vdp;
 static uint8_t int_recalc = 0;
 static uint8_t wiznet = 0;
 static uint8_t has_tms;
@@ -58,6 +74,10 @@ static uint8_t bankreg[4];
 static uint8_t mem_map = 0;
 static uint32_t ram_base = 0x80000;
 static struct ppide *ppide;
+static struct pvdisk *pvdisk;
+static int pvdisk_cost = -1;		/* -p clocks a sector, -1 if not fitted */
+static struct hostfs *hostfs;
+static struct perfctr *perfctr;
 static struct sdcard *sdcard;
 static FDC_PTR fdc;
 static FDRV_PTR drive_a, drive_b;
@@ -70,10 +90,12 @@ static struct uart16x50 *uart;
 static struct piratespi *pspi;
 static unsigned int pspi_cs = 0;
 
-static uint16_t tstate_steps = 737;	/* 18.432MHz */
+static unsigned long board_hz = 18432000;
+static unsigned long cpu_hz;		/* From -X, else board_hz */
 
 /* IRQ source that is live in IM2 */
 static uint8_t live_irq;
+static struct z180run run;
 
 static Z180Context cpu_z180;
 
@@ -100,7 +122,7 @@ volatile int emulator_done;
 
 static int trace = 0;
 
-static void reti_event(void);
+static void reti_event(int unused);
 
 /*
  *	Model the bank registers on the paged memory
@@ -158,7 +180,7 @@ static uint8_t do_mem_read0(uint16_t addr, int quiet)
 	if (banked)
 		pa = bank_translate(pa);
 	r = z180_phys_read(0, pa);
-	if (!quiet && (trace & TRACE_MEM))
+	if (!quiet && TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X[%06X] -> %02X\n", addr, pa, r);
 	return r;
 }
@@ -168,14 +190,13 @@ static void mem_write0(uint16_t addr, uint8_t val)
 	uint32_t pa = z180_mmu_translate(io, addr);
 	if (banked)
 		pa = bank_translate(pa);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %04X[%06X] <- %02X\n", addr, pa, val);
 	z180_phys_write(0, pa, val);
 }
 
 uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate = 0;
 	uint8_t r;
 
 	switch (cpuboard) {
@@ -186,22 +207,6 @@ uint8_t mem_read(int unused, uint16_t addr)
 		fputs("invalid cpu type.\n", stderr);
 		exit(1);
 	}
-	if (cpu_z180.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r == 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1)
-		reti_event();
-	rstate = 0;
 	return r;
 }
 
@@ -237,7 +242,7 @@ static void rc2014_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -259,37 +264,12 @@ static void rc2014_trace(unsigned unused)
 
 unsigned int check_chario(void)
 {
-	fd_set i, o;
-	struct timeval tv;
-	unsigned int r = 0;
-
-	FD_ZERO(&i);
-	FD_SET(0, &i);
-	FD_ZERO(&o);
-	FD_SET(1, &o);
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-
-	if (select(2, &i, NULL, NULL, &tv) == -1) {
-		if (errno == EINTR)
-			return 0;
-		perror("select");
-		exit(1);
-	}
-	if (FD_ISSET(0, &i))
-		r |= 1;
-	if (FD_ISSET(1, &o))
-		r |= 2;
-	return r;
+	return console_status();
 }
 
 unsigned int next_char(void)
 {
-	char c;
-	if (read(0, &c, 1) != 1) {
-		printf("(tty read without ready byte)\n");
-		return 0xFF;
-	}
+	unsigned int c = console_getc();
 	if (c == 0x0A)
 		c = '\r';
 	return c;
@@ -306,14 +286,14 @@ struct ide_controller *ide0;
 static uint8_t my_ide_read(uint16_t addr)
 {
 	uint8_t r =  ide_read8(ide0, addr);
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide read %d = %02X\n", addr, r);
 	return r;
 }
 
 static void my_ide_write(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide write %d = %02X\n", addr, val);
 	ide_write8(ide0, addr, val);
 }
@@ -324,15 +304,88 @@ struct rtc *rtc;
 
 #include "bitrev.h"
 
+/*
+ *	The CSIO hands us one byte at a time, which over USB to a Bus Pirate
+ *	is a round trip each. To make a real card usable we follow enough
+ *	of the SD protocol to spot block data phases: a read block is
+ *	fetched in one pipelined burst once the card sends its start token,
+ *	and a write block is gathered and sent once the host has supplied it
+ *	all (the card only clocks back 0xFF meanwhile). Blocks are assumed to
+ *	be 512 bytes plus CRC, as on every card we care about.
+ */
+#define PSPI_BLOCK	514
+
+static uint8_t pspi_buf[PSPI_BLOCK];
+static unsigned int pspi_ptr;
+static unsigned int pspi_len;
+static unsigned int pspi_mode;	/* 0 byte at a time, 1 read ahead, 2 gather */
+static unsigned int pspi_cmdp;	/* Bytes of command still to come */
+static uint8_t pspi_cmd;
+
+static void pspi_flush(void)
+{
+	if (pspi_mode == 2 && pspi_ptr)
+		piratespi_txrx_block(pspi, pspi_buf, NULL, pspi_ptr);
+	pspi_mode = 0;
+	pspi_cmdp = 0;
+}
+
+static int pspi_txrx(uint8_t v)
+{
+	int r;
+
+	if (pspi_mode == 1) {
+		/* A host that skips the CRC ends the burst early */
+		if (v == 0xFF) {
+			r = pspi_buf[pspi_ptr++];
+			if (pspi_ptr == pspi_len)
+				pspi_mode = 0;
+			return r;
+		}
+		pspi_mode = 0;
+	}
+	if (pspi_mode == 2) {
+		pspi_buf[pspi_ptr++] = v;
+		if (pspi_ptr == pspi_len)
+			pspi_flush();
+		return 0xFF;
+	}
+	if (pspi_cmdp)
+		pspi_cmdp--;
+	else if ((v & 0xC0) == 0x40) {
+		pspi_cmd = v & 0x3F;
+		pspi_cmdp = 5;
+	}
+	r = piratespi_txrx(pspi, v);
+	if (r == -1 || pspi_cmdp)
+		return r;
+	/* Start token for a CMD17/18 block: fetch the lot */
+	if (v == 0xFF && r == 0xFE && (pspi_cmd == 17 || pspi_cmd == 18)) {
+		if (piratespi_txrx_block(pspi, NULL, pspi_buf, PSPI_BLOCK) == 0) {
+			pspi_mode = 1;
+			pspi_ptr = 0;
+			pspi_len = PSPI_BLOCK;
+		}
+	}
+	/* Data token from the host for CMD24/25: gather the block */
+	if ((v == 0xFE && pspi_cmd == 24) || (v == 0xFC && pspi_cmd == 25)) {
+		pspi_mode = 2;
+		pspi_ptr = 0;
+		pspi_len = PSPI_BLOCK;
+	}
+	return r;
+}
+
 uint8_t z180_csio_write(struct z180_io *io, uint8_t bits)
 {
 	uint8_t r;
 
 	if (pspi_cs == 0 && pspi) {
-		r = piratespi_txrx(pspi, bitrev[bits]);
-		if (r == -1)
+		int c = pspi_txrx(bitrev[bits]);
+		if (c == -1)
 			return 0xFF;
-		if (trace & TRACE_SPI)
+		r = c;
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr,	"[SPI2 %02X:%02X]\n", bitrev[bits], r);
 		return bitrev[r];
 	}
@@ -341,14 +394,14 @@ uint8_t z180_csio_write(struct z180_io *io, uint8_t bits)
 		return 0xFF;
 
 	r = bitrev[sd_spi_in(sdcard, bitrev[bits])];
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 		fprintf(stderr,	"[SPI %02X:%02X]\n", bitrev[bits], bitrev[r]);
 	return r;
 }
 
 static void fdc_log(int debuglevel, char *fmt, va_list ap)
 {
-	if ((trace & TRACE_FDC) || debuglevel == 0)
+	if (TRACE_ON(trace & TRACE_FDC) || debuglevel == 0)
 		vfprintf(stderr, "fdc: ", ap);
 }
 
@@ -477,7 +530,7 @@ static void sysio_write(uint8_t val)
 	static uint8_t sysio = 0xFF;
 	uint8_t delta = val ^ sysio;
 	if (sdcard && (delta & 4)) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "[SPI CS %sed]\n",
 				(val & 4) ? "rais" : "lower");
 		if (val & 4)
@@ -486,9 +539,10 @@ static void sysio_write(uint8_t val)
 			sd_spi_lower_cs(sdcard);
 	}
 	if (pspi && (delta & 8)) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "[SPI2 CS %sed]\n",
 				(val & 8) ? "rais" : "lower");
+		pspi_flush();
 		piratespi_cs(pspi, val & 8);
 	}
 	pspi_cs = val & 8;
@@ -501,7 +555,7 @@ static void sysio_write(uint8_t val)
 
 static uint8_t io_read_2014(uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if (z180_iospace(io, addr))
 		return z180_read(io, addr);
@@ -516,30 +570,43 @@ static uint8_t io_read_2014(uint16_t addr)
 		return acia_read(acia, addr & 1);
 	if (addr >= 0xA0 && addr <= 0xA7 && uart)
 		return uart16x50_read(uart, addr & 7);
-	if (addr >= 0x48 && addr < 0x50) 
+	if (addr >= 0x48 && addr < 0x50) {
+		auto_fdc++;
 		return fdc_read(addr & 7);
+	}
 	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
 		return my_ide_read(addr & 7);
 	if (addr >= 0x20 && addr <= 0x27 && ide == 2)
 		return ppide_read(ppide, addr & 3);
 	if (addr >= 0x28 && addr <= 0x2C && wiznet)
 		return nic_w5100_read(wiz, addr & 3);
-	if (addr == 0x0C && rtc)
+	if (addr == 0x0C && rtc) {
+		auto_rtc++;
 		return rtc_read(rtc);
-	if ((addr == 0x98 || addr == 0x99) && vdp)
+	}
+	if ((addr == 0x98 || addr == 0x99) && vdp) {
+		auto_vdp += addr & 1;
 		return tms9918a_read(vdp, addr & 1);
-	if (trace & TRACE_UNK)
+	}
+	if (addr >= 0xF0 && addr <= 0xF7 && pvdisk)
+		return pvdisk_read(pvdisk, addr & 7);
+	if (addr >= 0xE8 && addr <= 0xEF && hostfs)
+		return hostfs_read(hostfs, addr & 7);
+	if (addr >= 0xD8 && addr <= 0xDF && perfctr)
+		return perfctr_read(perfctr, addr & 7);
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 
 	if (z180_iospace(io, addr)) {
 		z180_write(io, addr, val);
+		run.dma_live = z180_dma_live(io);
 		known = 1;
 	}
 	if ((addr & 0xFF) == 0xBA) {
@@ -551,8 +618,10 @@ static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
 		acia_write(acia, addr & 1, val);
 	else if (addr >= 0xA0 && addr <= 0xA7 && uart)
 		uart16x50_write(uart, addr & 7, val);
-	else if (addr >= 0x48 && addr < 0x50)
+	else if (addr >= 0x48 && addr < 0x50) {
+		auto_fdc++;
 		fdc_write(addr & 7, val);
+	}
 	else if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
 		my_ide_write(addr & 7, val);
 	else if (addr >= 0x20 && addr <= 0x27 && ide == 2)
@@ -565,16 +634,24 @@ static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
 		sysio_write(val);
 	} else if (banked && addr >= 0x78 && addr < 0x7C) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (banked && addr >= 0x7C && addr <=0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
 	} else if (addr == 0x0D)
 		diag_write(val);
 	else if ((addr == 0x98 || addr == 0x99) && vdp)
 		tms9918a_write(vdp, addr & 1, val);
+	else if (addr >= 0xF0 && addr <= 0xF7 && pvdisk) {
+		/* The whole transfer happens in the OUT */
+		auto_fdc++;
+		cpu_z180.tstates += pvdisk_write(pvdisk, addr & 7, val);
+	} else if (addr >= 0xE8 && addr <= 0xEF && hostfs)
+		hostfs_write(hostfs, addr & 7, val);
+	else if (addr >= 0xD8 && addr <= 0xDF && perfctr)
+		perfctr_write(perfctr, addr & 7, val);
 	else if (addr == 0xFD) {
 		trace &= 0xFF00;
 		trace |= val;
@@ -583,7 +660,7 @@ static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
 		trace &= 0xFF;
 		trace |= val << 8;
 		printf("trace set to %d\n", trace);
-	} else if (!known && (trace & TRACE_UNK))
+	} else if (!known && TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -622,14 +699,67 @@ static void poll_irq_event(void)
 		z180_interrupt(io, 0, 0, 0);
 }
 
-static void reti_event(void)
+static void reti_event(int unused)
 {
-	if (live_irq && (trace & TRACE_IRQ))
+	if (live_irq && TRACE_ON(trace & TRACE_IRQ))
 		fprintf(stderr, "RETI\n");
 	live_irq = 0;
 	poll_irq_event();
 }
 
+/*
+ *	Opcode profile. -Q writes a report at exit and on SIGUSR2. The
+ *	counts are only kept when libz180 is built with PROFILE=1.
+ */
+
+static char *prof_path;
+static Z180Profile *prof;
+static volatile sig_atomic_t prof_request;
+
+static void prof_write(void)
+{
+	FILE *fp = fopen(prof_path, "w");
+	if (fp == NULL) {
+		perror(prof_path);
+		return;
+	}
+	z80prof_report(fp, prof->count, prof->tstates, prof->page);
+	if (fclose(fp))
+		perror(prof_path);
+}
+
+static void prof_signal(int sig)
+{
+	prof_request = 1;
+}
+
+/*
+ *	INIR and OTIR on the CF data register move a sector run in one go,
+ *	unless something wants to see each access.
+ */
+static int io_block_ok(uint16_t addr)
+{
+	if ((addr & 0xFF) != 0x10 || ide != 1 || z180_iospace(io, addr))
+		return 0;
+	if (prof || TRACE_ON(trace & (TRACE_MEM | TRACE_IO | TRACE_CPU | TRACE_IDE)))
+		return 0;
+	return 1;
+}
+
+static unsigned io_block_read(int unused, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	if (!io_block_ok(addr))
+		return 0;
+	return ide_read_block(ide0, buf, len);
+}
+
+static unsigned io_block_write(int unused, uint16_t addr, const uint8_t *buf, unsigned len)
+{
+	if (!io_block_ok(addr))
+		return 0;
+	return ide_write_block(ide0, buf, len);
+}
+
 static struct termios saved_term, term;
 
 static void cleanup(int sig)
@@ -643,15 +773,172 @@ static void exit_cleanup(void)
 	tcsetattr(0, TCSADRAIN, &saved_term);
 }
 
+/* The clock as of the instruction running, for the performance counters */
+static uint64_t perf_tstates(void)
+{
+	return run.cycles + run.states + cpu_z180.tstates;
+}
+
+static uint64_t perf_insns(void)
+{
+	return cpu_z180.instructions;
+}
+
 static void usage(void)
 {
-	fprintf(stderr, "rc2014-z180: [-a] [-b] [-f] [-i idepath] [-P buspirate] [-R] [-r rompath] [-w] [-d debug]\n");
+	fprintf(stderr, "rc2014-z180: [-a] [-A] [-b] [-f] [-X MHz] [-h metrics] [-i idepath] [-p clocks] [-e hostdir] [-6] [-P buspirate] [-Q profile] [-R] [-r rompath] [-N] [-U asci0|asci1=device] [-w] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
+/* What -h serves: the clock and then whatever I/O is fitted */
+static void metrics_report(FILE *fp)
+{
+	struct metrics_clock c;
+
+	c.cycles = run.cycles;
+	c.hz = run.hz;
+	c.sleep_ns = run.sleep_ns;
+	c.resyncs = 0;
+	c.irqs = cpu_z180.interrupts;
+	metrics_clock(fp, &c);
+	metrics_counter(fp, "asci0_bytes_total", "ASCI 0 bytes received and sent", z180_asci_bytes(io, 0));
+	metrics_counter(fp, "asci1_bytes_total", "ASCI 1 bytes received and sent", z180_asci_bytes(io, 1));
+	if (ide0)
+		metrics_counter(fp, "ide_sectors_total", "CF sectors read and written", ide_sectors(ide0));
+	if (ppide)
+		metrics_counter(fp, "ppide_sectors_total", "PPIDE sectors read and written", ide_sectors(ppide->ide));
+	if (hostfs)
+		metrics_counter(fp, "hostfs_bytes_total", "Host directory bytes read and written", hostfs->moved);
+	if (sdcard)
+		metrics_counter(fp, "sd_blocks_total", "SD card blocks read and written", sd_blocks(sdcard));
+	if (acia)
+		metrics_counter(fp, "acia_bytes_total", "6850 ACIA bytes received and sent", acia_bytes(acia));
+	if (uart)
+		metrics_counter(fp, "uart_bytes_total", "16x50 UART bytes received and sent", uart16x50_bytes(uart));
+	if (wiznet)
+		metrics_counter(fp, "w5100_packets_total", "W5100 datagrams, frames and TCP reads and writes", nic_w5100_packets(wiz));
+	if (vdp)
+		metrics_counter(fp, "tms9918a_frames_total", "TMS9918A frames", tms9918a_frames(vdp));
+}
+
+/* Every ten slices */
+static void rc2014_z180_tick(void)
+{
+	fdc_tick(fdc);
+	console_tick();
+	/* We want to run UI events regularly it seems */
+	ui_event();
+}
+
+static volatile int paused;
+
+/* Change speed from the control socket */
+static void speed_set(int n)
+{
+	paused = n == METRICS_SPEED_PAUSE;
+	if (paused)
+		return;
+	auto_turbo = n == METRICS_SPEED_AUTO;
+	if (auto_turbo)
+		return;
+	run.fast = n == METRICS_SPEED_MAX;
+	run.speed = n;
+}
+
+/* Keep the sockets served until told to go again */
+static void pause_wait(void)
+{
+	struct timespec ts = { 0, 20000000L };
+
+	while (paused && !emulator_done) {
+		nanosleep(&ts, NULL);
+		if (wiznet)
+			w5100_process(wiz);
+		metrics_poll();
+	}
+}
+
+/*
+ *	Auto turbo, as on rc2014: disk traffic or a quiet frame runs flat
+ *	out, serial, network, clock or video status traffic runs real time
+ *	for a while after.
+ */
+
+#define AUTO_HOLD	25
+
+static uint64_t auto_disk;
+static uint64_t auto_io;
+static unsigned int auto_hold;
+
+static void auto_speed(void)
+{
+	uint64_t disk = auto_fdc;
+	uint64_t act = auto_rtc + auto_vdp;
+
+	act += z180_asci_bytes(io, 0) + z180_asci_bytes(io, 1);
+	if (ide0)
+		disk += ide_sectors(ide0);
+	if (ppide)
+		disk += ide_sectors(ppide->ide);
+	if (sdcard)
+		disk += sd_blocks(sdcard);
+	if (acia)
+		act += acia_bytes(acia);
+	if (uart)
+		act += uart16x50_bytes(uart);
+	if (wiznet)
+		act += nic_w5100_packets(wiz);
+
+	if (disk != auto_disk)
+		run.fast = 1;
+	else if (act != auto_io) {
+		run.fast = 0;
+		auto_hold = AUTO_HOLD;
+	} else if (auto_hold) {
+		run.fast = 0;
+		auto_hold--;
+	} else
+		run.fast = 1;
+	auto_disk = disk;
+	auto_io = act;
+}
+
+/* Every frame (20ms) */
+static void rc2014_z180_frame(void)
+{
+	/* 50Hz which is near enough */
+	if (vdp && tms9918a_visible(vdprend)) {
+		tms9918a_rasterize(vdp);
+		tms9918a_render(vdprend);
+	} else if (vdp)
+		tms9918a_vblank(vdp);
+	if (wiznet)
+		w5100_process(wiz);
+	metrics_poll();
+	if (prof_request) {
+		prof_request = 0;
+		prof_write();
+	}
+	if (int_recalc) {
+		/* If there is no pending Z180 vector IRQ but we think
+		   there now might be one we use the same logic as for
+		   reti */
+		if (!live_irq)
+			poll_irq_event();
+		/* Clear this after because reti_event may set the
+		   flags to indicate there is more happening. We will
+		   pick up the next state changes on the reti if so */
+		if (!(cpu_z180.IFF1|cpu_z180.IFF2))
+			int_recalc = 0;
+	}
+	if (auto_turbo)
+		auto_speed();
+	if (paused)
+		pause_wait();
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
 	int opt;
 	int fd;
 	char *rompath = "rc2014-z180.rom";
@@ -660,13 +947,17 @@ int main(int argc, char *argv[])
 	char *patha = NULL, *pathb = NULL;
 	char *piratepath = NULL;
 	int input = 0;
+	char *asci_spec[2] = { NULL, NULL };
+	int unthrottled = 0;
+	char *metrics_spec = NULL;
+	char *hostfs_path = NULL;
+	int want_perfctr = 0;
 
-	uint8_t *p = ramrom;
-	while (p < ramrom + sizeof(ramrom))
-		*p++= rand();
-
-	while ((opt = getopt(argc, argv, "1acd:fF:i:I:lm:r:sP:RS:Twzb")) != -1) {
+	while ((opt = getopt(argc, argv, "16aAcd:e:fF:h:i:I:lm:p:r:sP:Q:NRS:TU:wzbX:")) != -1) {
 		switch (opt) {
+		case 'h':
+			metrics_spec = optarg;
+			break;
 		case 'r':
 			rompath = optarg;
 			break;
@@ -702,7 +993,7 @@ int main(int argc, char *argv[])
 			if (strcmp(optarg, "riz180") == 0) {
 				/* A DIP Z180 running more slowly and with
 				   only 128K RAM and 256K flash accessible */
-				tstate_steps = 294;
+				board_hz = 7372800;
 				banked = 0;
 				input = 0;
 				ram_base = 0x40000;
@@ -716,6 +1007,22 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
+		case 'A':
+			auto_turbo = 1;
+			break;
+		case 'e':
+			hostfs_path = optarg;
+			break;
+		case 'p':
+			pvdisk_cost = atoi(optarg);
+			if (pvdisk_cost < 0) {
+				fprintf(stderr, "rc2014-z180: -p wants clocks per sector.\n");
+				exit(1);
+			}
+			break;
 		case 'P':
 			piratepath = optarg;
 			break;
@@ -744,12 +1051,29 @@ int main(int argc, char *argv[])
 			else
 				patha = optarg;
 			break;
+		case '6':
+			want_perfctr = 1;
+			break;
 		case 'z':
 			zxkey = zxkey_create();
 			break;
 		case 'T':
 			has_tms = 1;
 			break;
+		case 'Q':
+			prof_path = optarg;
+			break;
+		case 'N':
+			unthrottled = 1;
+			break;
+		case 'U':
+			if (strncmp(optarg, "asci0=", 6) == 0)
+				asci_spec[0] = optarg + 6;
+			else if (strncmp(optarg, "asci1=", 6) == 0)
+				asci_spec[1] = optarg + 6;
+			else
+				usage();
+			break;
 		default:
 			usage();
 		}
@@ -757,12 +1081,16 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
+	/* The ROM part is filled from the image */
+	ramrom = ram_alloc(RAMROM_SIZE);
+	ram_scramble(ramrom + ram_base, RAMROM_SIZE - ram_base);
+
 	fd = open(rompath, O_RDONLY);
 	if (fd == -1) {
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, ramrom, ram_base) != ram_base) {
+	if (ram_load(fd, ramrom, ram_base) != ram_base) {
 		fprintf(stderr, "rc2014-z180: ROM image should be %dK.\n",
 			ram_base >> 10);
 		exit(EXIT_FAILURE);
@@ -794,9 +1122,26 @@ int main(int argc, char *argv[])
 			ide = 0;
 		} else
 			ppide_attach(ppide, 0, ide_fd);
-		if (trace & TRACE_PPIDE)
+		if (TRACE_ON(trace & TRACE_PPIDE))
 			ppide_trace(ppide, 1);
 	}
+	if (pvdisk_cost >= 0) {
+		struct ide_controller *c = ide == 1 ? ide0 : ide == 2 ? ppide->ide : NULL;
+		if (c == NULL || ide_capacity(c, 0) == 0) {
+			fprintf(stderr, "rc2014-z180: the paravirtual disk needs a disk from -i or -I.\n");
+			exit(1);
+		}
+		pvdisk = pvdisk_create(c, pvdisk_cost, mem_read, mem_write);
+		if (TRACE_ON(trace & TRACE_IDE))
+			pvdisk_trace(pvdisk, 1);
+	}
+	if (hostfs_path) {
+		hostfs = hostfs_create(hostfs_path, mem_read, mem_write);
+		if (TRACE_ON(trace & TRACE_IO))
+			hostfs_trace(hostfs, 1);
+	}
+	if (want_perfctr)
+		perfctr = perfctr_create(perf_tstates, perf_insns, NULL);
 	if (sdpath) {
 		sdcard = sd_create("sd0");
 		fd = open(sdpath, O_RDWR);
@@ -805,12 +1150,12 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
 
 	io = z180_create(&cpu_z180);
-	z180_trace(io, trace & TRACE_CPU_IO);
+	z180_trace(io, TRACE_ON(trace & TRACE_CPU_IO));
 
 	switch(input) {
 		case 0:
@@ -818,22 +1163,32 @@ int main(int argc, char *argv[])
 			break;
 		case 1:
 			acia = acia_create();
-			acia_trace(acia, trace & TRACE_ACIA);
+			acia_trace(acia, TRACE_ON(trace & TRACE_ACIA));
 			acia_set_input(acia, 1);
 			break;
 		case 2:
 			uart = uart16x50_create();
-			uart16x50_trace(uart, trace & TRACE_UART);
+			uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
 			uart16x50_set_input(uart, 1);
 			break;
 	}
+	z180_unthrottle(io, 0, unthrottled);
+	z180_unthrottle(io, 1, unthrottled);
+	if (acia)
+		acia_unthrottle(acia, unthrottled);
+	if (uart)
+		uart16x50_unthrottle(uart, unthrottled);
+	if (asci_spec[0])
+		z180_attach(io, 0, chardev_create(asci_spec[0]));
+	if (asci_spec[1])
+		z180_attach(io, 1, chardev_create(asci_spec[1]));
 
 	if (rtc)
-		rtc_trace(rtc, trace & TRACE_RTC);
+		rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 
 	if (has_tms) {
 		vdp = tms9918a_create();
-		tms9918a_trace(vdp, !!(trace & TRACE_TMS9918A));
+		tms9918a_trace(vdp, !!TRACE_ON(trace & TRACE_TMS9918A));
 		vdprend = tms9918a_renderer_create(vdp);
 	}
 	if (wiznet) {
@@ -872,11 +1227,6 @@ int main(int argc, char *argv[])
 	if (piratepath)
 		pspi = piratespi_create(piratepath);
 
-	/* 20ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 20000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -892,12 +1242,26 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
+	console_init();
+
 	Z180RESET(&cpu_z180);
 	cpu_z180.ioRead = io_read;
 	cpu_z180.ioWrite = io_write;
+	cpu_z180.ioBlockRead = io_block_read;
+	cpu_z180.ioBlockWrite = io_block_write;
 	cpu_z180.memRead = mem_read;
 	cpu_z180.memWrite = mem_write;
+	cpu_z180.reti = reti_event;
 	cpu_z180.trace = rc2014_trace;
+	if (prof_path) {
+		prof = calloc(1, sizeof(Z180Profile));
+		if (prof == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		cpu_z180.profile = prof;
+		signal(SIGUSR2, prof_signal);
+	}
 
 	/* We don't have a GPIO control pin on the SC126, but we do have
 	   devices that need to be wired to \RESET so emulate that with
@@ -907,58 +1271,20 @@ int main(int argc, char *argv[])
 		piratespi_alt(pspi, 1);
 	}
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!emulator_done) {
-		int states = 0;
-		unsigned int i, j;
-		/* We have to run the DMA engine and Z180 in step per
-		   instruction otherwise we will mess up on stalling DMA */
-
-		/* Do an emulated 20ms of work (368640 clocks) */
-		for (i = 0; i < 50; i++) {
-			for (j = 0; j < 10; j++) {
-				while (states < tstate_steps) {
-					unsigned int used;
-					used = z180_dma(io);
-					if (used == 0)
-						used = Z180Execute(&cpu_z180);
-					states += used;
-				}
-				z180_event(io, states);
-				states -= tstate_steps;
-			}
-			fdc_tick(fdc);
-			/* We want to run UI events regularly it seems */
-			ui_event();
-		}
-
-		/* 50Hz which is near enough */
-		if (vdp) {
-			tms9918a_rasterize(vdp);
-			tms9918a_render(vdprend);
-		}
-		if (wiznet)
-			w5100_process(wiz);
-		/* Do 20ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
-		if (int_recalc) {
-			/* If there is no pending Z180 vector IRQ but we think
-			   there now might be one we use the same logic as for
-			   reti */
-			if (!live_irq)
-				poll_irq_event();
-			/* Clear this after because reti_event may set the
-			   flags to indicate there is more happening. We will
-			   pick up the next state changes on the reti if so */
-			if (!(cpu_z180.IFF1|cpu_z180.IFF2))
-				int_recalc = 0;
-		}
-	}
+	if (metrics_spec)
+		metrics_listen(metrics_spec, "rc2014_z180", metrics_report, speed_set);
+
+	run.cpu = &cpu_z180;
+	run.io = io;
+	run.hz = cpu_hz ? cpu_hz : board_hz;
+	run.rate = 25000;
+	run.steps = 10;
+	run.ticks = 50;
+	run.tick = rc2014_z180_tick;
+	run.frame = rc2014_z180_frame;
+	run.fast = fast;
+	run.done = &emulator_done;
+	z180run_loop(&run);
 	fd_eject(drive_a);
 	fd_eject(drive_b);
 	fdc_destroy(&fdc);
@@ -966,5 +1292,11 @@ int main(int argc, char *argv[])
 	fd_destroy(&drive_b);
 	if (pspi)
 		piratespi_free(pspi);
+	if (hostfs)
+		hostfs_free(hostfs);
+	if (perfctr)
+		perfctr_free(perfctr);
+	if (prof_path)
+		prof_write();
 	exit(0);
 }
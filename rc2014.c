@@ -33,19 +33,35 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <poll.h>
 
 #include "system.h"
+#include "event.h"
+#include "forkserver.h"
+#include "replay.h"
+#include "console.h"
+#include "chardev.h"
+#include "metrics.h"
+#include "cow.h"
+#include "cputrace.h"
+#include "coverage.h"
+#include "blkcache.h"
 #include "libz80/z80.h"
 #include "lib765/include/765.h"
 
 #include "acia.h"
+#include "16x50.h"
 #include "amd9511.h"
 #include "ide.h"
 #include "ppide.h"
+#include "pvdisk.h"
+#include "hostfs.h"
+#include "perfctr.h"
+#include "tracefilt.h"
 #include "ps2.h"
 #include "rtc_bitbang.h"
 #include "sdcard.h"
+#include "snapshot.h"
 #include "tms9918a.h"
 #include "tms9918a_render.h"
 #include "w5100.h"
@@ -53,8 +69,19 @@
 #include "z80dma.h"
 #include "zxkey.h"
 #include "z80dis.h"
-
-static uint8_t ramrom[1024 * 1024];	/* Covers the banked card */
+#include "z80prof.h"
+#include "z80samp.h"
+#include "z80irq.h"
+#include "ramalloc.h"
+#include "cpuclock.h"
+#include "trace.h"
+#include "vclock.h"
+#include "hostperf.h"
+
+/* Covers the banked card. Allocated page aligned so that a snapshot
+   can be mapped over it */
+#define RAMROM_SIZE	(1024 * 1024)
+static uint8_t *ramrom;
 
 static unsigned int bankreg[4];
 static uint8_t bankenable;
@@ -75,42 +102,66 @@ static uint32_t romsize = 65536;
 #define CPUBOARD_PDOG128	9
 #define CPUBOARD_PDOG512	10
 
+/* The rc2014-<board> builds fix the board so its memory map inlines */
+#ifdef RC2014_BOARD
+static const uint8_t cpuboard = RC2014_BOARD;
+#else
 static uint8_t cpuboard = CPUBOARD_Z80;
+#endif
 
 static uint8_t have_ctc;
 static uint8_t have_pio;
 static uint8_t have_ps2;
 static uint8_t have_kio;
 static uint8_t have_wiznet;
+static const char *wiz_tap;	/* TAP device for MACRAW, see -n */
 static uint8_t have_cpld_serial;
 static uint8_t have_im2;
 static uint8_t have_16x50;
 static uint8_t have_copro;
 static uint8_t have_tms;
+static uint8_t tms_timed;	/* Model VDP access and beam timing */
+static uint8_t tms_lines;	/* Draw the VDP a scan line at a time */
+static unsigned int tms_line;
+static struct event tms_line_ev;
 
 static uint8_t port30 = 0;
 static uint8_t port38 = 0;
 static uint8_t fast = 0;
+static unsigned int auto_fdc;		/* Accesses seen by auto turbo */
+static unsigned int auto_rtc;
+static unsigned int auto_vdp;
 static uint8_t int_recalc = 0;
 static uint8_t is_z512;
 static uint8_t z512_control = 0;
 
 static struct ppide *ppide;
+static struct pvdisk *pvdisk;
+static int pvdisk_cost = -1;		/* -3 clocks a sector, -1 if not fitted */
+static struct hostfs *hostfs;
+static struct perfctr *perfctr;
 static struct sdcard *sdcard;
 static struct z80copro *copro;
+static struct z80dma *dma;
 static FDC_PTR fdc;
 static FDRV_PTR drive_a, drive_b;
+static unsigned int fdd_hold;		/* DSK writes wait in memory */
+static unsigned int fdc_timing;		/* Percent of real drive timing */
+static uint64_t fdc_time;		/* T-state the FDC clock is at */
+static struct event fdc_time_ev;
 static struct tms9918a *vdp;
 static struct tms9918a_renderer *vdprend;
 static struct amd9511 *amd9511;
 struct ps2 *ps2;
+static struct event_queue *evq;
 
 struct zxkey *zxkey;
 
-static uint16_t tstate_steps = 365;	/* RC2014 speed */
+static uint16_t tstate_steps = 365;	/* RC2014 speed, clocks per 50us */
+static unsigned long cpu_hz;		/* From -2, else tstate_steps */
 
-/* IRQ source that is live in IM2 */
-static uint8_t live_irq;
+/* IM2 daisy chain, lines in priority order */
+static struct z80irq *irq;
 
 #define IRQ_SIOA	1
 #define IRQ_SIOB	2
@@ -145,23 +196,61 @@ volatile int emulator_done;
 #define TRACE_FDC	0x100000
 #define TRACE_PS2	0x200000
 #define TRACE_ACIA	0x400000
+#define TRACE_START	0x800000
 
+/* trace is what prints right now, trace_want what -d and -5 asked for.
+   A filter narrows trace for each instruction and each access */
 static int trace = 0;
+static int trace_want;
+static struct tracefilt *tfilt;
+
+static const struct tracefilt_class trace_classes[] = {
+	{ "mem", TRACE_MEM }, { "io", TRACE_IO }, { "rom", TRACE_ROM },
+	{ "unk", TRACE_UNK }, { "cpu", TRACE_CPU }, { "512", TRACE_512 },
+	{ "rtc", TRACE_RTC }, { "sio", TRACE_SIO }, { "ctc", TRACE_CTC },
+	{ "cpld", TRACE_CPLD }, { "irq", TRACE_IRQ }, { "uart", TRACE_UART },
+	{ "z84c15", TRACE_Z84C15 }, { "ide", TRACE_IDE }, { "spi", TRACE_SPI },
+	{ "sd", TRACE_SD }, { "ppide", TRACE_PPIDE }, { "copro", TRACE_COPRO },
+	{ "copro_io", TRACE_COPRO_IO }, { "tms9918a", TRACE_TMS9918A },
+	{ "fdc", TRACE_FDC }, { "ps2", TRACE_PS2 }, { "acia", TRACE_ACIA },
+	{ "start", TRACE_START }, { NULL, 0 }
+};
 
-static void reti_event(void);
+static void reti_event(int unused);
+
+/* How much of ramrom the selected CPU board can address */
+static uint32_t ramrom_extent(void)
+{
+	switch (cpuboard) {
+	case CPUBOARD_Z80:
+	case CPUBOARD_EASYZ80:
+	case CPUBOARD_TINYZ80:
+		return bank512 ? RAMROM_SIZE : 65536;
+	case CPUBOARD_SC108:
+	case CPUBOARD_SC114:
+	case CPUBOARD_SC121:
+		return 3 * 65536;
+	case CPUBOARD_Z80SBC64:
+	case CPUBOARD_ZRCC:
+		return 2 * 65536;
+	case CPUBOARD_MICRO80:
+		return 4 * 65536;
+	}
+	return RAMROM_SIZE;
+}
 
 static uint8_t mem_read0(uint16_t addr)
 {
 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "R %04x[%02X] = %02X\n", addr, (unsigned int) bankreg[bank], (unsigned int) ramrom[(bankreg[bank] << 14) + (addr & 0x3FFF)]);
 		addr &= 0x3FFF;
 		return ramrom[(bankreg[bank] << 14) + addr];
 	}
 	if (bank512 && !bankenable)
 		addr &= 0x3FFF;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[addr]);
 	return ramrom[addr];
 }
@@ -170,21 +259,21 @@ static void mem_write0(uint16_t addr, uint8_t val)
 {
 	if (bankenable) {
 		unsigned int bank = (addr & 0xC000) >> 14;
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04x[%02X] = %02X\n", (unsigned int) addr, (unsigned int) bankreg[bank], (unsigned int) val);
 		if (bankreg[bank] >= 32) {
 			addr &= 0x3FFF;
 			ramrom[(bankreg[bank] << 14) + addr] = val;
 		}
 		/* ROM writes go nowhere */
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	} else {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W: %04X = %02X\n", addr, val);
 		if (addr >= 8192 && !bank512)
 			ramrom[addr] = val;
-		else if (trace & TRACE_MEM)
+		else if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 	}
 }
@@ -198,7 +287,7 @@ static uint8_t mem_read108(uint16_t addr)
 		aphys = addr + 131072;
 	else
 		aphys = addr + 65536;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %05X = %02X\n", aphys, ramrom[aphys]);
 	return ramrom[aphys];
 }
@@ -206,17 +295,17 @@ static uint8_t mem_read108(uint16_t addr)
 static void mem_write108(uint16_t addr, uint8_t val)
 {
 	uint32_t aphys;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %04X = %02X\n", addr, val);
 	if (addr < 0x8000 && !(port38 & 0x01)) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 		return;
 	} else if (port38 & 0x80)
 		aphys = addr + 131072;
 	else
 		aphys = addr + 65536;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: aphys %05X\n", aphys);
 	ramrom[aphys] = val;
 }
@@ -230,7 +319,7 @@ static uint8_t mem_read114(uint16_t addr)
 		aphys = addr + 131072;
 	else
 		aphys = addr + 65536;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, ramrom[aphys]);
 	return ramrom[aphys];
 }
@@ -238,10 +327,10 @@ static uint8_t mem_read114(uint16_t addr)
 static void mem_write114(uint16_t addr, uint8_t val)
 {
 	uint32_t aphys;
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %04X = %02X\n", addr, val);
 	if (addr < 0x8000 && !(port38 & 0x01)) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "[Discarded: ROM]\n");
 		return;
 	} else if (port30 & 0x01)
@@ -267,14 +356,14 @@ static uint8_t mem_read64(uint16_t addr)
 		r = ramrom[addr];
 	else
 		r = ramrom[bankreg[0] * 0x8000 + addr];
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04x = %02X\n", addr, r);
 	return r;
 }
 
 static void mem_write64(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04x = %02X\n", addr, val);
 	if (addr >= 0x8000)	/* Top 32K is common */
 		ramrom[addr + 65536] = val;
@@ -391,7 +480,7 @@ static uint8_t mem_readzrcc(uint16_t addr)
 		r = ramrom[addr + 65536];	/* Top 32K is common */
 	else
 		r = ramrom[bankreg[0] * 0x8000 + addr];
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04x = %02X\n", addr, r);
 	return r;
 }
@@ -399,11 +488,11 @@ static uint8_t mem_readzrcc(uint16_t addr)
 static void mem_writezrcc(uint16_t addr, uint8_t val)
 {
 	if (addr <= 0x40 && bankreg[1]) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04X = %02X [ROM]\n", addr, val);
 		return;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04X = %02X\n", addr, val);
 	if (addr >= 0x8000)
 		ramrom[addr + 65536] = val;
@@ -453,7 +542,7 @@ static uint8_t *mmu_micro80_z84c15(uint16_t addr, int write)
 	/* Depending upon final flash wiring. PIO might control
 	   this and it might be 32K */
 	/* CS0 low selects ROM always */
-	if (trace & TRACE_MEM) {
+	if (TRACE_ON(trace & TRACE_MEM)) {
 		if (cs0)
 			fprintf(stderr, "R");
 		if (cs1)
@@ -476,7 +565,7 @@ static uint8_t *mmu_micro80_z84c15(uint16_t addr, int write)
 static uint8_t mem_read_micro80(uint16_t addr)
 {
 	uint8_t val = *mmu_micro80_z84c15(addr, 0);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04x = %02X\n", addr, val);
 	return val;
 }
@@ -484,7 +573,7 @@ static uint8_t mem_read_micro80(uint16_t addr)
 static void mem_write_micro80(uint16_t addr, uint8_t val)
 {
 	uint8_t *p = mmu_micro80_z84c15(addr, 1);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04x = %02X\n", addr, val);
 	if (p == NULL)
 		fprintf(stderr, "%04x: write to ROM of %02X attempted.\n", addr, val);
@@ -525,7 +614,7 @@ static uint8_t *mmu_pickled128(uint16_t addr, uint8_t wr)
 static uint8_t mem_read_pickled128(uint16_t addr)
 {
 	uint8_t *p = mmu_pickled128(addr, 0);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, *p);
 	return *p;
 }
@@ -537,7 +626,7 @@ static void mem_write_pickled128(uint16_t addr, uint8_t val)
 		fprintf(stderr, "%04X: write to ROM of %02X attempted.\n", addr, val);
 		return;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%04X = %02X\n", addr, val);
 	*p = val;
 }
@@ -557,7 +646,7 @@ static uint8_t *mmu_pickled512(uint16_t addr, uint8_t wr)
 static uint8_t mem_read_pickled512(uint16_t addr)
 {
 	uint8_t *p = mmu_pickled512(addr, 0);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X = %02X\n", addr, *p);
 	return *p;
 }
@@ -569,11 +658,229 @@ static void mem_write_pickled512(uint16_t addr, uint8_t val)
 		fprintf(stderr, "%04X: write to ROM of %02X attempted.\n", addr, val);
 		return;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%04X = %02X\n", addr, val);
 	*p = val;
 }
 
+/*
+ *	Fast path memory map. Each 4K page has a read and a write pointer
+ *	that are rebuilt whenever a banking register changes. A NULL entry
+ *	sends the access through the board specific code above, which is how
+ *	ROM write protect, the ZRCC boot ROM and memory tracing are handled.
+ */
+
+#define MEM_PAGE_SHIFT	Z80_PAGE_SHIFT
+#define MEM_PAGE_MASK	Z80_PAGE_MASK
+#define MEM_PAGES	16
+
+static uint8_t *mem_rpage[MEM_PAGES];
+static uint8_t *mem_wpage[MEM_PAGES];
+
+/* Pages of ramrom written since the last checkpoint, see -J. While
+   tracking, a write entry is only filled in once the page it points at
+   is dirty, so the first write to each page goes the slow way and marks it */
+static unsigned int mem_track;
+static uint8_t mem_dirty[RAMROM_SIZE >> MEM_PAGE_SHIFT];
+
+/* Pages of ramrom a code cache build of libz80 has decoded instructions
+   from. Writes to them are kept out of the table so each can be reported */
+static uint8_t mem_code[RAMROM_SIZE >> MEM_PAGE_SHIFT];
+static unsigned int mem_code_pages;
+
+/* Watchpoints and breakpoints, see -l. A page with one on it has its
+   entries left out of the table so only accesses to it are checked */
+#define WATCH_READ	1
+#define WATCH_WRITE	2
+#define WATCH_EXEC	4
+#define WATCH_MAX	16
+
+struct watch {
+	uint16_t start;
+	uint16_t end;
+	unsigned int how;
+};
+
+static struct watch watch[WATCH_MAX];
+static unsigned int watches;
+static uint8_t watch_page[MEM_PAGES];
+
+static void watch_hit(uint16_t addr, unsigned int how, uint8_t val);
+static void z80_trace(unsigned unused);
+
+/* Execution trace ring, see -x */
+static struct cputrace *ring;
+/* Instruction addresses run, see -q */
+static char *cov_path;
+static uint8_t *cov;
+/* Opcode profile, see -Q */
+static Z80Profile *prof;
+
+static uint8_t *mem_page_phys(uint16_t addr, int wr)
+{
+	switch (cpuboard) {
+	case CPUBOARD_Z80:
+	case CPUBOARD_EASYZ80:
+	case CPUBOARD_TINYZ80:
+		if (bankenable) {
+			unsigned int bank = (addr & 0xC000) >> 14;
+			if (wr && bankreg[bank] < 32)
+				return NULL;
+			return &ramrom[(bankreg[bank] << 14) + (addr & 0x3FFF)];
+		}
+		if (bank512) {
+			if (wr)
+				return NULL;
+			return &ramrom[addr & 0x3FFF];
+		}
+		if (wr && addr < 8192)
+			return NULL;
+		return &ramrom[addr];
+	case CPUBOARD_SC108:
+		if (addr < 0x8000 && !(port38 & 0x01))
+			return wr ? NULL : &ramrom[addr];
+		if (port38 & 0x80)
+			return &ramrom[addr + 131072];
+		return &ramrom[addr + 65536];
+	case CPUBOARD_SC114:
+	case CPUBOARD_SC121:
+		if (addr < 0x8000 && !(port38 & 0x01))
+			return wr ? NULL : &ramrom[addr];
+		if (port30 & 0x01)
+			return &ramrom[addr + 131072];
+		return &ramrom[addr + 65536];
+	case CPUBOARD_Z80SBC64:
+		if (addr >= 0x8000)
+			return &ramrom[wr ? addr + 65536 : addr];
+		return &ramrom[bankreg[0] * 0x8000 + addr];
+	case CPUBOARD_ZRCC:
+		/* Leave the page holding the boot ROM to the slow path */
+		if (addr < 0x1000 && (wr ? bankreg[1] : !bankreg[1]))
+			return NULL;
+		if (addr >= 0x8000)
+			return &ramrom[addr + 65536];
+		return &ramrom[bankreg[0] * 0x8000 + addr];
+	case CPUBOARD_MICRO80:
+		return mmu_micro80_z84c15(addr, wr);
+	case CPUBOARD_PDOG128:
+		return mmu_pickled128(addr, wr);
+	case CPUBOARD_PDOG512:
+		return mmu_pickled512(addr, wr);
+	}
+	return NULL;
+}
+
+static uint8_t *mem_page_map(uint16_t addr, int wr)
+{
+	uint8_t *p = mem_page_phys(addr, wr);
+
+	if (wr && p && p >= ramrom && p < ramrom + RAMROM_SIZE) {
+		unsigned int n = (p - ramrom) >> MEM_PAGE_SHIFT;
+		if ((mem_track && !mem_dirty[n]) || mem_code[n])
+			return NULL;
+	}
+	return p;
+}
+
+/* The page of ramrom a write to addr lands in, or NULL */
+static uint8_t *mem_write_page(uint16_t addr)
+{
+	uint16_t base = addr & ~MEM_PAGE_MASK;
+	uint8_t *p = mem_page_phys(base, 1);
+
+	/* The ZRCC boot ROM page writes through to the RAM under it */
+	if (p == NULL && cpuboard == CPUBOARD_ZRCC && addr < 0x1000)
+		p = &ramrom[bankreg[0] * 0x8000 + base];
+	if (p == NULL || p < ramrom || p >= ramrom + RAMROM_SIZE)
+		return NULL;
+	return p;
+}
+
+/* A write is taking the slow path while tracking. Mark the page it lands
+   in and let further writes to it go the fast way until the next checkpoint */
+static void mem_dirty_write(uint16_t addr)
+{
+	uint16_t base = addr & ~MEM_PAGE_MASK;
+	uint8_t *p = mem_write_page(addr);
+
+	if (p == NULL)
+		return;
+	mem_dirty[(p - ramrom) >> MEM_PAGE_SHIFT] = 1;
+	if (!TRACE_ON(trace_want & TRACE_MEM))
+		mem_wpage[addr >> MEM_PAGE_SHIFT] = mem_page_map(base, 1);
+}
+
+static void mem_remap(void);
+
+/* A write is taking the slow path. If it is to code libz80 has cached
+   let it throw the instructions there away */
+static void mem_code_write(uint16_t addr)
+{
+	uint8_t *p = mem_write_page(addr);
+
+	if (p && mem_code[(p - ramrom) >> MEM_PAGE_SHIFT])
+		Z80CodeWritten(&cpu_z80, p, addr & MEM_PAGE_MASK);
+}
+
+/* libz80 is starting or stopping caching code from a page */
+static int mem_code_page(int unused, uint8_t *page, int cached)
+{
+	unsigned int n;
+
+	if (page < ramrom || page >= ramrom + RAMROM_SIZE)
+		return 0;
+	n = (page - ramrom) >> MEM_PAGE_SHIFT;
+	if (mem_code[n] != cached) {
+		mem_code[n] = cached;
+		mem_code_pages += cached ? 1 : -1;
+		mem_remap();
+	}
+	return 1;
+}
+
+/* Call whenever anything that affects the memory map changes */
+static void mem_remap(void)
+{
+	unsigned int i;
+	uint16_t addr = 0;
+
+	for (i = 0; i < MEM_PAGES; i++) {
+		if (TRACE_ON(trace_want & TRACE_MEM)) {
+			mem_rpage[i] = NULL;
+			mem_wpage[i] = NULL;
+		} else {
+			mem_rpage[i] = mem_page_map(addr, 0);
+			mem_wpage[i] = mem_page_map(addr, 1);
+		}
+		if (watch_page[i] & (WATCH_READ | WATCH_EXEC))
+			mem_rpage[i] = NULL;
+		if (watch_page[i] & WATCH_WRITE)
+			mem_wpage[i] = NULL;
+		addr += 1 << MEM_PAGE_SHIFT;
+	}
+	/* LDIR and LDDR use the table directly unless someone is watching */
+	if (ring || prof || TRACE_ON(trace_want & (TRACE_MEM | TRACE_CPU))) {
+		cpu_z80.memPageRead = NULL;
+		cpu_z80.memPageWrite = NULL;
+	} else {
+		cpu_z80.memPageRead = mem_rpage;
+		cpu_z80.memPageWrite = mem_wpage;
+	}
+	/* The hook costs a call per instruction, so only set it when needed */
+	cpu_z80.trace = ring || TRACE_ON(trace_want & TRACE_CPU) ||
+		(tfilt && (tfilt->given & TRACEFILT_PC)) ? z80_trace : NULL;
+	/* And so do DMA block copies */
+	if (dma)
+		z80dma_set_pages(dma, cpu_z80.memPageRead, cpu_z80.memPageWrite,
+			MEM_PAGE_SHIFT);
+	if (pvdisk)
+		guestmem_set_pages(&pvdisk->mem, cpu_z80.memPageRead, cpu_z80.memPageWrite,
+			MEM_PAGE_SHIFT);
+	if (hostfs)
+		guestmem_set_pages(&hostfs->mem, cpu_z80.memPageRead, cpu_z80.memPageWrite,
+			MEM_PAGE_SHIFT);
+}
+
 uint8_t do_mem_read(uint16_t addr, int quiet)
 {
 	uint8_t r;
@@ -619,29 +926,51 @@ uint8_t do_mem_read(uint16_t addr, int quiet)
 
 uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate = 0;
-	uint8_t r = do_mem_read(addr, 0);
-
-	if (cpu_z80.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r == 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1)
-		reti_event();
-	rstate = 0;
+	uint8_t *p = mem_rpage[addr >> MEM_PAGE_SHIFT];
+	uint8_t r;
+	int saved;
+
+	if (p)
+		return p[addr & MEM_PAGE_MASK];
+	if (tfilt && !TRACEFILT_HIT(tfilt, TRACEFILT_MEM, mem, addr)) {
+		saved = trace;
+		trace &= ~TRACE_MEM;
+		r = do_mem_read(addr, 0);
+		trace = saved;
+	} else
+		r = do_mem_read(addr, 0);
+	if (watch_page[addr >> MEM_PAGE_SHIFT])
+		watch_hit(addr, cpu_z80.M1 ? WATCH_EXEC : WATCH_READ, r);
 	return r;
 }
 
+static void do_mem_write(uint16_t addr, uint8_t val);
+
 void mem_write(int unused, uint16_t addr, uint8_t val)
+{
+	uint8_t *p = mem_wpage[addr >> MEM_PAGE_SHIFT];
+	int saved;
+
+	if (p) {
+		p[addr & MEM_PAGE_MASK] = val;
+		return;
+	}
+	if (mem_track)
+		mem_dirty_write(addr);
+	if (mem_code_pages)
+		mem_code_write(addr);
+	if (watch_page[addr >> MEM_PAGE_SHIFT])
+		watch_hit(addr, WATCH_WRITE, val);
+	if (tfilt && !TRACEFILT_HIT(tfilt, TRACEFILT_MEM, mem, addr)) {
+		saved = trace;
+		trace &= ~TRACE_MEM;
+		do_mem_write(addr, val);
+		trace = saved;
+	} else
+		do_mem_write(addr, val);
+}
+
+static void do_mem_write(uint16_t addr, uint8_t val)
 {
 	switch (cpuboard) {
 	case CPUBOARD_Z80:
@@ -696,12 +1025,18 @@ uint8_t z80dis_byte_quiet(uint16_t addr)
 	return do_mem_read(addr, 1);
 }
 
+static void ring_record(void);
+
 static void z80_trace(unsigned unused)
 {
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (ring)
+		ring_record();
+	if (tfilt)
+		trace = TRACEFILT_HIT(tfilt, TRACEFILT_PC, pc, cpu_z80.M1PC) ? trace_want : 0;
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -723,47 +1058,63 @@ static void z80_trace(unsigned unused)
 
 
 
+/* Console I/O goes via console.c which refills once per serial tick */
 unsigned int check_chario(void)
 {
-	fd_set i, o;
-	struct timeval tv;
-	unsigned int r = 0;
-
-	FD_ZERO(&i);
-	FD_SET(0, &i);
-	FD_ZERO(&o);
-	FD_SET(1, &o);
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-
-	if (select(2, &i, NULL, NULL, &tv) == -1) {
-		if (errno == EINTR)
-			return 0;
-		perror("select");
-		exit(1);
-	}
-	if (FD_ISSET(0, &i))
-		r |= 1;
-	if (FD_ISSET(1, &o))
-		r |= 2;
-	return r;
+	return console_status();
 }
 
 unsigned int next_char(void)
 {
-	char c;
-	if (read(0, &c, 1) != 1) {
-		printf("(tty read without ready byte)\n");
-		return 0xFF;
-	}
+	unsigned int c = console_getc();
 	if (c == 0x0A)
 		c = '\r';
 	return c;
 }
 
+/* Set to end the current CPU slice early so interrupts are seen */
+static volatile int cpu_stop;
+
 void recalc_interrupts(void)
 {
 	int_recalc = 1;
+	cpu_stop = 1;
+}
+
+/*
+ *	Idle detection. A HALT with nothing to wake it, or the same
+ *	instruction reading the same serial status over and over, means the
+ *	guest is waiting for a device. Rather than interpret the wait we let
+ *	the main loop skip the CPU on to the next device event.
+ */
+
+#define IDLE_POLLS	32
+
+static unsigned int idle_polls;
+static int idle_output;		/* Guest wrote to a port this frame */
+static uint16_t idle_pc;
+static uint16_t idle_port;
+static uint8_t idle_val;
+
+/* Called by the serial models when their status register is read */
+static void idle_poll(uint16_t port, uint8_t val)
+{
+	if (cpu_z80.M1PC == idle_pc && port == idle_port && val == idle_val) {
+		if (++idle_polls >= IDLE_POLLS)
+			cpu_stop = 1;
+		return;
+	}
+	idle_pc = cpu_z80.M1PC;
+	idle_port = port;
+	idle_val = val;
+	idle_polls = 0;
+}
+
+static int cpu_idle(void)
+{
+	if (cpu_z80.halted)
+		return !cpu_z80.nmi_req && !(cpu_z80.int_req && cpu_z80.IFF1);
+	return idle_polls >= IDLE_POLLS;
 }
 
 struct acia *acia;
@@ -777,253 +1128,25 @@ static void acia_check_irq(struct acia *acia)
 }
 
 
-/* UART: very mimimal for the moment */
-
-struct uart16x50 {
-    uint8_t ier;
-    uint8_t iir;
-    uint8_t fcr;
-    uint8_t lcr;
-    uint8_t mcr;
-    uint8_t lsr;
-    uint8_t msr;
-    uint8_t scratch;
-    uint8_t ls;
-    uint8_t ms;
-    uint8_t dlab;
-    uint8_t irq;
-#define RXDA	1
-#define TEMT	2
-#define MODEM	8
-    uint8_t irqline;
-    uint8_t input;
-};
-
-static struct uart16x50 uart[1];
+static struct uart16x50 *uart;
+static uint8_t serial_unthrottled;	/* -N: ignore the baud rates */
 
-static void uart_init(struct uart16x50 *uptr, int in)
+static void uart_check_irq(struct uart16x50 *uptr)
 {
-    uptr->dlab = 0;
-    uptr->input = in;
+	if (uart16x50_irq_pending(uptr))
+		Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
 }
 
-static void uart_check_irq(struct uart16x50 *uptr)
+/* The 16x50 model doesn't tell us when its line goes up */
+static void uart_irq_update(void)
 {
-    if (uptr->irqline)
-	    Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
-}
-
-/* Compute the interrupt indicator register from what is pending */
-static void uart_recalc_iir(struct uart16x50 *uptr)
-{
-    if (uptr->irq & RXDA)
-        uptr->iir = 0x04;
-    else if (uptr->irq & TEMT)
-        uptr->iir = 0x02;
-    else if (uptr->irq & MODEM)
-        uptr->iir = 0x00;
-    else {
-        uptr->iir = 0x01;	/* No interrupt */
-        uptr->irqline = 0;
-        return;
-    }
-    /* Ok so we have an event, do we need to waggle the line */
-    if (uptr->irqline)
-        return;
-    uptr->irqline = uptr->irq;
-
-}
-
-/* Raise an interrupt source. Only has an effect if enabled in the ier */
-static void uart_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (uptr->irq & n)
-        return;
-    if (!(uptr->ier & n))
-        return;
-    uptr->irq |= n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_clear_interrupt(struct uart16x50 *uptr, uint8_t n)
-{
-    if (!(uptr->irq & n))
-        return;
-    uptr->irq &= ~n;
-    uart_recalc_iir(uptr);
-}
-
-static void uart_event(struct uart16x50 *uptr)
-{
-    uint8_t r = check_chario();
-    uint8_t old = uptr->lsr;
-    uint8_t dhigh;
-    if (uptr->input && (r & 1))
-        uptr->lsr |= 0x01;	/* RX not empty */
-    if (r & 2)
-        uptr->lsr |= 0x60;	/* TX empty */
-    dhigh = (old ^ uptr->lsr);
-    dhigh &= uptr->lsr;		/* Changed high bits */
-    if (dhigh & 1)
-        uart_interrupt(uptr, RXDA);
-    if (dhigh & 0x2)
-        uart_interrupt(uptr, TEMT);
-}
-
-static void show_settings(struct uart16x50 *uptr)
-{
-    uint32_t baud;
-
-    if (!(trace & TRACE_UART))
-        return;
-
-    baud = uptr->ls + (uptr->ms << 8);
-    if (baud == 0)
-        baud = 1843200;
-    baud = 1843200 / baud;
-    baud /= 16;
-    fprintf(stderr, "[%d:%d",
-            baud, (uptr->lcr &3) + 5);
-    switch(uptr->lcr & 0x38) {
-        case 0x00:
-        case 0x10:
-        case 0x20:
-        case 0x30:
-            fprintf(stderr, "N");
-            break;
-        case 0x08:
-            fprintf(stderr, "O");
-            break;
-        case 0x18:
-            fprintf(stderr, "E");
-            break;
-        case 0x28:
-            fprintf(stderr, "M");
-            break;
-        case 0x38:
-            fprintf(stderr, "S");
-            break;
-    }
-    fprintf(stderr, "%d ",
-            (uptr->lcr & 4) ? 2 : 1);
-
-    if (uptr->lcr & 0x40)
-        fprintf(stderr, "break ");
-    if (uptr->lcr & 0x80)
-        fprintf(stderr, "dlab ");
-    if (uptr->mcr & 1)
-        fprintf(stderr, "DTR ");
-    if (uptr->mcr & 2)
-        fprintf(stderr, "RTS ");
-    if (uptr->mcr & 4)
-        fprintf(stderr, "OUT1 ");
-    if (uptr->mcr & 8)
-        fprintf(stderr, "OUT2 ");
-    if (uptr->mcr & 16)
-        fprintf(stderr, "LOOP ");
-    fprintf(stderr, "ier %02x]\n", uptr->ier);
-}
-
-static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
-{
-    switch(addr) {
-    case 0:	/* If dlab = 0, then write else LS*/
-        if (uptr->dlab == 0) {
-            if (uptr == &uart[0]) {
-                putchar(val);
-                fflush(stdout);
-            }
-            uart_clear_interrupt(uptr, TEMT);
-            uart_interrupt(uptr, TEMT);
-        } else {
-            uptr->ls = val;
-            show_settings(uptr);
-        }
-        break;
-    case 1:	/* If dlab = 0, then IER */
-        if (uptr->dlab) {
-            uptr->ms= val;
-            show_settings(uptr);
-        }
-        else
-            uptr->ier = val;
-        break;
-    case 2:	/* FCR */
-        uptr->fcr = val & 0x9F;
-        break;
-    case 3:	/* LCR */
-        uptr->lcr = val;
-        uptr->dlab = (uptr->lcr & 0x80);
-        show_settings(uptr);
-        break;
-    case 4:	/* MCR */
-        uptr->mcr = val & 0x3F;
-        break;
-    case 5:	/* LSR (r/o) */
-        break;
-    case 6:	/* MSR (r/o) */
-        break;
-    case 7:	/* Scratch */
-        uptr->scratch = val;
-        break;
-    }
-}
-
-static uint8_t uart_read(struct uart16x50 *uptr, uint8_t addr)
-{
-    uint8_t r;
-
-    switch(addr) {
-    case 0:
-        /* receive buffer */
-        if (uptr == &uart[0] && uptr->dlab == 0) {
-            uart_clear_interrupt(uptr, RXDA);
-            if (check_chario() & 1)
-                return next_char();
-            return 0x00;
-        } else
-            return uptr->ls;
-        break;
-    case 1:
-        /* IER */
-        if (uptr->dlab == 0)
-            return uptr->ier;
-        return uptr->ms;
-    case 2:
-        /* IIR */
-        return uptr->iir;
-    case 3:
-        /* LCR */
-        return uptr->lcr;
-    case 4:
-        /* mcr */
-        return uptr->mcr;
-    case 5:
-        /* lsr */
-        r = check_chario();
-        uptr->lsr &=0x90;
-        if (r & 1)
-             uptr->lsr |= 0x01;	/* Data ready */
-        if (r & 2)
-             uptr->lsr |= 0x60;	/* TX empty | holding empty */
-        /* Reading the LSR causes these bits to clear */
-        r = uptr->lsr;
-        uptr->lsr &= 0xF0;
-        return r;
-    case 6:
-        /* msr */
-        uptr->msr &= 0x7F;
-        r = uptr->msr;
-        /* Reading clears the delta bits */
-        uptr->msr &= 0xF0;
-        uart_clear_interrupt(uptr, MODEM);
-        return r;
-    case 7:
-        return uptr->scratch;
-    }
-    return 0xFF;
-}
+	static uint8_t line;
+	uint8_t now = uart16x50_irq_pending(uart);
 
+	if (now && !line)
+		recalc_interrupts();
+	line = now;
+}
 
 struct z80_sio_chan {
 	uint8_t wr[8];
@@ -1044,14 +1167,23 @@ struct z80_sio_chan {
 static int sio2;
 static int sio2_input;
 static struct z80_sio_chan sio[2];
+static struct chardev *sio_dev[2];	/* Host devices if given */
+static unsigned long long sio_bytes;	/* Both channels, both ways */
 
 /*
  *	Interrupts. We don't handle IM2 yet.
  */
 
+/* Keep the router in step with a channel's interrupt request */
+static void sio2_irq(struct z80_sio_chan *chan, int on)
+{
+	chan->irq = on;
+	z80irq_set(irq, IRQ_SIOA + (chan - sio), on);
+}
+
 static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
 {
-	if (trace & TRACE_IRQ) {
+	if (TRACE_ON(trace & TRACE_IRQ)) {
 		fprintf(stderr, "Clear intbits %d %x\n",
 			(int)(chan - sio), m);
 	}
@@ -1060,7 +1192,7 @@ static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
 	/* Check me - does it auto clear down or do you have to reti it ? */
 	if (!(sio->intbits | sio[1].intbits)) {
 		sio->rr[1] &= ~0x02;
-		chan->irq = 0;
+		sio2_irq(chan, 0);
 	}
 	recalc_interrupts();
 }
@@ -1069,11 +1201,11 @@ static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
 {
 	uint8_t new = (chan->intbits ^ m) & m;
 	chan->intbits |= m;
-	if ((trace & TRACE_SIO) && new)
+	if (TRACE_ON(trace & TRACE_SIO) && new)
 		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
 	if (new) {
 		if (!sio->irq) {
-			chan->irq = 1;
+			sio2_irq(chan, 1);
 			sio->rr[1] |= 0x02;
 			recalc_interrupts();
 		}
@@ -1084,55 +1216,50 @@ static void sio2_reti(struct z80_sio_chan *chan)
 {
 	/* Recalculate the pending state and vectors */
 	/* FIXME: what really goes here */
-	sio->irq = 0;
+	sio2_irq(sio, 0);
 	recalc_interrupts();
 }
 
-static int sio2_check_im2(struct z80_sio_chan *chan)
+static void sio2_reti_line(void *priv)
+{
+	sio2_reti(priv);
+}
+
+/* Called by the interrupt router when this channel heads the chain */
+static uint8_t sio2_vector(void *priv)
 {
+	struct z80_sio_chan *chan = priv;
 	uint8_t vector = sio[1].wr[2];
-	/* See if we have an IRQ pending and if so deliver it and return 1 */
-	if (chan->irq) {
-		/* Do the vector calculation in the right place */
-		/* FIXME: move this to other platforms */
-		if (sio[1].wr[1] & 0x04) {
-			/* This is a subset of the real options. FIXME: add
-			   external status change */
-			if (sio[1].wr[1] & 0x04) {
-				vector &= 0xF1;
-				if (chan == sio)
-					vector |= 1 << 3;
-				if (chan->intbits & INT_RX)
-					vector |= 4;
-				else if (chan->intbits & INT_ERR)
-					vector |= 2;
-			}
-			if (trace & TRACE_SIO)
-				fprintf(stderr, "SIO2 interrupt %02X\n", vector);
-			chan->vector = vector;
-		} else {
-			chan->vector = vector;
-		}
-		if (trace & (TRACE_IRQ|TRACE_SIO))
-			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
-				(int)(chan - sio), chan->vector);
+
+	/* Do the vector calculation in the right place */
+	/* FIXME: move this to other platforms */
+	if (sio[1].wr[1] & 0x04) {
+		/* This is a subset of the real options. FIXME: add
+		   external status change */
+		vector &= 0xF1;
 		if (chan == sio)
-			live_irq = IRQ_SIOA;
-		else
-			live_irq = IRQ_SIOB;
-		Z80INT(&cpu_z80, chan->vector);
-		return 1;
+			vector |= 1 << 3;
+		if (chan->intbits & INT_RX)
+			vector |= 4;
+		else if (chan->intbits & INT_ERR)
+			vector |= 2;
+		if (TRACE_ON(trace & TRACE_SIO))
+			fprintf(stderr, "SIO2 interrupt %02X\n", vector);
 	}
-	return 0;
+	chan->vector = vector;
+	if (TRACE_ON(trace & (TRACE_IRQ|TRACE_SIO)))
+		fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
+			(int)(chan - sio), chan->vector);
+	return vector;
 }
 
 /*
- *	The SIO replaces the last character in the FIFO on an
- *	overrun.
+ *	The receive FIFO is three deep. A character arriving when it is
+ *	full replaces the last one and flags the overrun against it.
  */
 static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 {
-	if (trace & TRACE_SIO)
+	if (TRACE_ON(trace & TRACE_SIO))
 		fprintf(stderr, "SIO %d queue %d: ", (int) (chan - sio), c);
 	/* Receive disabled */
 	if (!(chan->wr[3] & 1)) {
@@ -1140,8 +1267,8 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 		return;
 	}
 	/* Overrun */
-	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
+	if (chan->dptr == 3) {
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Overrun.\n");
 		chan->data[2] = c;
 		chan->rr[1] |= 0x20;	/* Overrun flagged */
@@ -1149,7 +1276,8 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 		sio2_raise_int(chan, INT_ERR);
 	} else {
 		/* FIFO add */
-		if (trace & TRACE_SIO)
+		sio_bytes++;
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Queued %d (mode %d)\n", chan->dptr, chan->wr[1] & 0x18);
 		chan->data[chan->dptr++] = c;
 		chan->rr[0] |= 1;
@@ -1169,13 +1297,38 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 	/* Need to deal with interrupt results */
 }
 
+/* An attached channel only takes input while there is room in the FIFO
+   and RTS is on. CTS and DCD follow the host side */
+static void sio2_dev_timer(struct z80_sio_chan *chan, struct chardev *dev)
+{
+	unsigned int c = chardev_status(dev);
+
+	chan->rr[0] &= ~0x28;
+	if (chardev_connected(dev))
+		chan->rr[0] |= 0x08;
+	if (chardev_cts(dev))
+		chan->rr[0] |= 0x20;
+	if ((c & 1) && chan->dptr < 3 && (chan->wr[5] & 0x02))
+		sio2_queue(chan, chardev_getc(dev));
+	if ((c & 2) && !(chan->rr[0] & 0x04)) {
+		chan->rr[0] |= 0x04;
+		if (chan->wr[1] & 0x02)
+			sio2_raise_int(chan, INT_TX);
+	}
+}
+
 static void sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
 {
+	if (sio_dev[ab]) {
+		sio2_dev_timer(chan, sio_dev[ab]);
+		return;
+	}
 	if (ab == 0) {
 		int c = check_chario();
 
+		/* Console input waits for room so a paste isn't lost */
 		if (sio2_input) {
-			if (c & 1)
+			if ((c & 1) && chan->dptr < 3)
 				sio2_queue(chan, next_char());
 		}
 		if (c & 2) {
@@ -1194,10 +1347,19 @@ static void sio2_channel_timer(struct z80_sio_chan *chan, uint8_t ab)
 	}
 }
 
-static void sio2_timer(void)
+/* One character at the channel's clock mode and format in clocks of
+   the 7.3728MHz SIO clock */
+static unsigned int sio2_char_clocks(struct z80_sio_chan *chan)
 {
-	sio2_channel_timer(sio, 0);
-	sio2_channel_timer(sio + 1, 1);
+	static const uint8_t rxbits[4] = { 5, 7, 6, 8 };
+	static const uint8_t mult[4] = { 1, 16, 32, 64 };
+	unsigned int bits = 1 + rxbits[chan->wr[3] >> 6] + 1;
+
+	if (chan->wr[4] & 0x01)
+		bits++;
+	if ((chan->wr[4] & 0x0C) >= 0x08)	/* 1.5 or 2 stop bits */
+		bits++;
+	return mult[chan->wr[4] >> 6] * bits;
 }
 
 static void sio2_channel_reset(struct z80_sio_chan *chan)
@@ -1225,17 +1387,18 @@ static uint8_t sio2_read(uint16_t addr)
 		chan->rr[0] &= ~2;
 		if (chan == sio && (sio[0].intbits | sio[1].intbits))
 			chan->rr[0] |= 2;
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read reg %d = ", (addr & 2) ? 'b' : 'a', r);
 		switch (r) {
 		case 0:
 		case 1:
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "%02X\n", chan->rr[r]);
+			idle_poll(0x100 | (addr & 3), chan->rr[r]);
 			return chan->rr[r];
 		case 2:
 			if (chan != sio) {
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr, "%02X\n", chan->rr[2]);
 				return chan->rr[2];
 			}
@@ -1256,7 +1419,10 @@ static uint8_t sio2_read(uint16_t addr)
 		sio2_clear_int(chan, INT_RX);
 		chan->rr[0] &= 0x3F;
 		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
+		/* Unthrottled the next byte arrives as soon as there is room */
+		if (serial_unthrottled && chan->dptr == 0)
+			sio2_channel_timer(chan, chan - sio);
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read data %d\n", (addr & 2) ? 'b' : 'a', c);
 		if (chan->dptr && (chan->wr[1] & 0x10))
 			sio2_raise_int(chan, INT_RX);
@@ -1270,7 +1436,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
 	uint8_t r;
 	if (!(addr & 1)) {
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c write reg %d with %02X\n", (addr & 2) ? 'b' : 'a', chan->wr[0] & 7, val);
 		switch (chan->wr[0] & 007) {
 		case 0:
@@ -1287,7 +1453,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
 				break;
 			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr, "[channel reset]\n");
 				sio2_channel_reset(chan);
 				break;
@@ -1303,7 +1469,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 				break;
 			case 070:	/* Return from interrupt (channel A) */
 				if (chan == sio) {
-					sio->irq = 0;
+					sio2_irq(sio, 0);
 					sio->rr[1] &= ~0x02;
 					sio2_clear_int(sio, INT_RX | INT_TX | INT_ERR);
 					sio2_clear_int(sio + 1, INT_RX | INT_TX | INT_ERR);
@@ -1319,7 +1485,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		case 6:
 		case 7:
 			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
 					(addr & 2) ? 'b' : 'a', r, val);
 			chan->wr[r] = val;
@@ -1337,13 +1503,16 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		chan->txint = 1;
 		/* Should check chan->wr[5] & 8 */
 		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c write data %d\n", (addr & 2) ? 'b' : 'a', val);
-		if (chan == sio)
-			write(1, &val, 1);
+		sio_bytes++;
+		if (sio_dev[chan - sio])
+			chardev_putc(sio_dev[chan - sio], val);
+		else if (chan == sio)
+			console_putc(val);
 		else {
 //			write(1, "\033[1m;", 5);
-			write(1, &val,1);
+			console_putc(val);
 //			write(1, "\033[0m;", 5);
 		}
 	}
@@ -1355,14 +1524,14 @@ struct ide_controller *ide0;
 static uint8_t my_ide_read(uint16_t addr)
 {
 	uint8_t r =  ide_read8(ide0, addr);
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide read %d = %02X\n", addr, r);
 	return r;
 }
 
 static void my_ide_write(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide write %d = %02X\n", addr, val);
 	ide_write8(ide0, addr, val);
 }
@@ -1416,8 +1585,9 @@ static void ctc_interrupt(struct z80_ctc *c)
 	if (c->ctrl & CTC_IRQ) {
 		if (!(ctc_irqmask & (1 << i))) {
 			ctc_irqmask |= 1 << i;
+			z80irq_set(irq, IRQ_CTC + i, 1);
 			recalc_interrupts();
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d wants to interrupt.\n", i);
 		}
 	}
@@ -1427,148 +1597,247 @@ static void ctc_reti(int ctcnum)
 {
 	if (ctc_irqmask & (1 << ctcnum)) {
 		ctc_irqmask &= ~(1 << ctcnum);
-		if (trace & TRACE_IRQ)
+		z80irq_set(irq, IRQ_CTC + ctcnum, 0);
+		if (TRACE_ON(trace & TRACE_IRQ))
 			fprintf(stderr, "Acked interrupt from CTC %d.\n", ctcnum);
 	}
 }
 
-/* After a RETI or when idle compute the status of the interrupt line and
-   if we are head of the chain this time then raise our interrupt */
+static void ctc_reti_line(void *priv)
+{
+	ctc_reti((struct z80_ctc *)priv - ctc);
+}
 
-static int ctc_check_im2(void)
+/* Called by the interrupt router when this channel heads the chain */
+static uint8_t ctc_vector(void *priv)
 {
-	if (ctc_irqmask) {
-		int i;
-		for (i = 0; i < 4; i++) {	/* FIXME: correct order ? */
-			if (ctc_irqmask & (1 << i)) {
-				uint8_t vector = ctc[0].vector & 0xF8;
-				vector += 2 * i;
-				if (trace & TRACE_IRQ)
-					fprintf(stderr, "New live interrupt is from CTC %d vector %x.\n", i, vector);
-				live_irq = IRQ_CTC + i;
-				Z80INT(&cpu_z80, vector);
-				return 1;
-			}
-		}
-	}
-	return 0;
+	int i = (struct z80_ctc *)priv - ctc;
+	uint8_t vector = ctc[0].vector & 0xF8;
+
+	vector += 2 * i;
+	if (TRACE_ON(trace & TRACE_IRQ))
+		fprintf(stderr, "New live interrupt is from CTC %d vector %x.\n", i, vector);
+	return vector;
+}
+
+/*
+ *	The counters are not stepped. The old model ticked every channel
+ *	once per poll and on the EasyZ80 and TinyZ80 fed in the UART clock
+ *	as pulses, so we keep that granularity but only work out where we
+ *	are when the guest looks, and schedule an event for the next tick
+ *	on which a channel that can interrupt reaches zero.
+ */
+static struct event ctc_ev;
+static uint64_t ctc_last;		/* Time of the last tick applied */
+static uint64_t ctc_due;		/* When ctc_ev is armed for */
+static unsigned int ctc_period;		/* Clocks between ticks */
+static unsigned int ctc_clocks;		/* CTC clocks per tick */
+
+/* Pulses per tick from the 1.8432MHz UART clock, counted like ctc_clocks
+   per 50us of CPU time. CTC 2 runs at half the rate */
+#define CTC_UART_HZ	1843200
+
+static unsigned int ctc_ext(int i)
+{
+	if (cpuboard != CPUBOARD_EASYZ80 && cpuboard != CPUBOARD_TINYZ80)
+		return 0;
+	return i == 2 ? CTC_UART_HZ / 40000 : CTC_UART_HZ / 20000;
+}
+
+/* CTC 2 is chained into CTC 3 except on the SC121 where 0-2 are for
+   the SIO baud and only 3 is a timer */
+static int ctc_chained(void)
+{
+	return cpuboard != CPUBOARD_SC121;
 }
 
-/* Model the chains between the CTC devices */
-static void ctc_receive_pulse(int i);
+static unsigned int ctc_decby(struct z80_ctc *c)
+{
+	/* 16x not 256x downscale - so increase by 16x */
+	if (!(c->ctrl & CTC_PRESCALER))
+		return ctc_clocks << 4;
+	return ctc_clocks;
+}
 
-static void ctc_pulse(int i)
+/* Run a timer for ticks ticks, returning how many times it hit zero */
+static uint64_t ctc_time(struct z80_ctc *c, uint64_t ticks)
 {
-	if (cpuboard != CPUBOARD_SC121) {
-		/* Model CTC 2 chained into CTC 3 */
-		if (i == 2)
-			ctc_receive_pulse(3);
+	uint64_t t = ticks * ctc_decby(c);
+	uint64_t r = (c->reload ? c->reload : 256) << 8;
+	uint64_t f;
+
+	if (t <= c->count) {
+		c->count -= t;
+		return 0;
 	}
-	/* The SC121 has 0-2 for SIO baud and only 3 for a timer */
+	t -= c->count;
+	f = (t + r - 1) / r;
+	c->count = f * r - t;
+	return f;
 }
 
-/* We don't worry about edge directions just a logical pulse model */
-static void ctc_receive_pulse(int i)
+/* We don't worry about edge directions just a logical pulse model.
+   Count n pulses, returning how many times it hit zero */
+static uint64_t ctc_count(struct z80_ctc *c, uint64_t n)
 {
-	struct z80_ctc *c = ctc + i;
-	if (c->ctrl & CTC_COUNTER) {
-		if (CTC_STOPPED(c))
-			return;
-		if (c->count >= 0x0100)
-			c->count -= 0x100;	/* No scaling on pulses */
-		if ((c->count & 0xFF00) == 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			c->count = c->reload << 8;
-		}
-	} else {
-		if (c->ctrl & CTC_PULSE)
-			c->ctrl &= ~CTC_PULSE;
+	unsigned int h = c->count >> 8;
+	unsigned int p = c->reload ? c->reload : 1;
+
+	if (n == 0)
+		return 0;
+	/* A zero count goes off on the next pulse */
+	if (n < h) {
+		c->count -= n << 8;
+		return 0;
 	}
+	n -= h ? h : 1;
+	c->count = (c->reload - n % p) << 8;
+	return n / p + 1;
+}
+
+/* The tick on which channel i hits zero for the nth time, 0 for never */
+static uint64_t ctc_fire_tick(int i, uint64_t n)
+{
+	struct z80_ctc *c = ctc + i;
+	unsigned int h = c->count >> 8;
+	uint64_t pulse;
+	unsigned int e;
+
+	if (CTC_STOPPED(c))
+		return 0;
+	if (!(c->ctrl & CTC_COUNTER))
+		return (c->count + (n - 1) * ((c->reload ? c->reload : 256) << 8)) / ctc_decby(c) + 1;
+	pulse = (h ? h : 1) + (n - 1) * (c->reload ? c->reload : 1);
+	if (i == 3)
+		return ctc_chained() ? ctc_fire_tick(2, pulse) : 0;
+	e = ctc_ext(i);
+	if (e == 0)
+		return 0;
+	return (pulse + e - 1) / e;
 }
 
-/* Model counters */
-static void ctc_tick(unsigned int clocks)
+static void ctc_run(uint64_t ticks)
 {
 	struct z80_ctc *c = ctc;
+	uint64_t fired[4];
+	uint64_t n;
 	int i;
-	int n;
-	int decby;
 
 	for (i = 0; i < 4; i++, c++) {
-		/* Waiting a value */
-		if (CTC_STOPPED(c))
-			continue;
-		/* Pulse trigger mode */
-		if (c->ctrl & CTC_COUNTER)
-			continue;
-		/* 256x downscaled */
-		decby = clocks;
-		/* 16x not 256x downscale - so increase by 16x */
-		if (!(c->ctrl & CTC_PRESCALER))
-			decby <<= 4;
-		/* Now iterate over the events. We need to deal with wraps
-		   because we might have something counters chained */
-		n = c->count - decby;
-		while (n < 0) {
-			ctc_interrupt(c);
-			ctc_pulse(i);
-			if (c->reload == 0)
-				n += 256 << 8;
-			else
-				n += c->reload << 8;
+		if (i < 3)
+			n = ticks * ctc_ext(i);
+		else
+			n = ctc_chained() ? fired[2] : 0;
+		fired[i] = 0;
+		if (c->ctrl & CTC_COUNTER) {
+			if (!CTC_STOPPED(c))
+				fired[i] = ctc_count(c, n);
+		} else {
+			if (n)
+				c->ctrl &= ~CTC_PULSE;
+			if (!CTC_STOPPED(c))
+				fired[i] = ctc_time(c, ticks);
 		}
-		c->count = n;
+		if (fired[i])
+			ctc_interrupt(c);
+	}
+}
+
+/* Apply every tick at or before when */
+static void ctc_sync(uint64_t when)
+{
+	uint64_t n;
+
+	if (ctc_period == 0 || when < ctc_last + ctc_period)
+		return;
+	n = (when - ctc_last) / ctc_period;
+	ctc_run(n);
+	ctc_last += n * ctc_period;
+}
+
+/* Arm the event for the next tick that can raise an interrupt */
+static void ctc_arm(void)
+{
+	uint64_t best = 0;
+	uint64_t k;
+	int i;
+
+	if (ctc_period == 0)
+		return;
+	for (i = 0; i < 4; i++) {
+		if (!(ctc[i].ctrl & CTC_IRQ))
+			continue;
+		k = ctc_fire_tick(i, 1);
+		if (k && (best == 0 || k < best))
+			best = k;
+	}
+	if (best == 0) {
+		event_cancel(evq, &ctc_ev);
+		return;
 	}
+	ctc_due = ctc_last + best * ctc_period;
+	event_schedule(evq, &ctc_ev, ctc_due);
+}
+
+static void ctc_event(void *unused)
+{
+	ctc_sync(ctc_due);
+	ctc_arm();
 }
 
 static void ctc_write(uint8_t channel, uint8_t val)
 {
 	struct z80_ctc *c = ctc + channel;
+
+	ctc_sync(event_now(evq) + cpu_z80.op_tstates);
 	if (c->ctrl & CTC_TCONST) {
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d constant loaded with %02X\n", channel, val);
 		c->reload = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET)) {
 			c->count = (c->reload - 1) << 8;
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
 		c->ctrl &= ~CTC_TCONST|CTC_RESET;
 	} else if (val & CTC_CONTROL) {
 		/* We don't yet model the weirdness around edge wanted
 		   toggling and clock starts */
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d control loaded with %02X\n", channel, val);
 		c->ctrl = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == CTC_RESET) {
 			c->count = (c->reload - 1) << 8;
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
 		/* Undocumented */
 		if (!(c->ctrl & CTC_IRQ) && (ctc_irqmask & (1 << channel))) {
 			ctc_irqmask &= ~(1 << channel);
+			z80irq_set(irq, IRQ_CTC + channel, 0);
 			if (ctc_irqmask == 0) {
-				if (trace & TRACE_IRQ)
+				if (TRACE_ON(trace & TRACE_IRQ))
 					fprintf(stderr, "CTC %d irq reset.\n", channel);
-				if (live_irq == IRQ_CTC + channel)
-					live_irq = 0;
+				z80irq_cancel(irq, IRQ_CTC + channel);
 			}
 		}
 	} else {
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d vector loaded with %02X\n", channel, val);
 		/* Only works on channel 0 */
 		if (channel == 0)
 			c->vector = val;
 	}
+	ctc_arm();
 }
 
 static uint8_t ctc_read(uint8_t channel)
 {
-	uint8_t val = ctc[channel].count >> 8;
-	if (trace & TRACE_CTC)
+	uint8_t val;
+
+	ctc_sync(event_now(evq) + cpu_z80.op_tstates);
+	val = ctc[channel].count >> 8;
+	if (TRACE_ON(trace & TRACE_CTC))
 		fprintf(stderr, "CTC %d reads %02x\n", channel, val);
 	return val;
 }
@@ -1600,7 +1869,7 @@ static uint8_t pio_cs;
 static uint8_t spi_byte_sent(uint8_t val)
 {
 	uint8_t r = sd_spi_in(sdcard, val);
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 		fprintf(stderr,	"[SPI %02X:%02X]\n", val, r);
 	return r;
 }
@@ -1622,14 +1891,14 @@ static void bitbang_spi(uint8_t val)
 
 	if ((pio_cs & 0x03) == 0x01) {		/* CS high - deselected */
 		if (!oldcs) {
-			if (trace & TRACE_SPI)
+			if (TRACE_ON(trace & TRACE_SPI))
 				fprintf(stderr,	"[Raised \\CS]\n");
 			bits = 0;
 			oldcs = 1;
 			sd_spi_raise_cs(sdcard);
 		}
 	} else if (oldcs) {
-		if (trace & TRACE_SPI)
+		if (TRACE_ON(trace & TRACE_SPI))
 			fprintf(stderr, "[Lowered \\CS]\n");
 		oldcs = 0;
 		sd_spi_lower_cs(sdcard);
@@ -1822,16 +2091,17 @@ static void pio_reset(void)
 static void toggle_rom(void)
 {
 	if (bankreg[0] == 0) {
-		if (trace & TRACE_ROM)
+		if (TRACE_ON(trace & TRACE_ROM))
 			fprintf(stderr, "[ROM out]\n");
 		bankreg[0] = 34;
 		bankreg[1] = 35;
 	} else {
-		if (trace & TRACE_ROM)
+		if (TRACE_ON(trace & TRACE_ROM))
 			fprintf(stderr, "[ROM in]\n");
 		bankreg[0] = 0;
 		bankreg[1] = 1;
 	}
+	mem_remap();
 }
 
 /*
@@ -1856,7 +2126,7 @@ static void sbc64_cpld_timer(void)
 static uint8_t sbc64_cpld_uart_rx(void)
 {
 	sbc64_cpld_status &= ~1;
-	if (trace & TRACE_CPLD)
+	if (TRACE_ON(trace & TRACE_CPLD))
 		fprintf(stderr, "CPLD rx %02X.\n", sbc64_cpld_char);
 	return sbc64_cpld_char;
 }
@@ -1865,12 +2135,13 @@ static uint8_t sbc64_cpld_uart_status(void)
 {
 //	if (trace & TRACE_CPLD)
 //		fprintf(stderr, "CPLD status %02X.\n", sbc64_cpld_status);
+	idle_poll(0xF8, sbc64_cpld_status);
 	return sbc64_cpld_status;
 }
 
 static void sbc64_cpld_uart_ctrl(uint8_t val)
 {
-	if (trace & TRACE_CPLD)
+	if (TRACE_ON(trace & TRACE_CPLD))
 		fprintf(stderr, "CPLD control %02X.\n", val);
 }
 
@@ -1887,26 +2158,25 @@ static void sbc64_cpld_uart_tx(uint8_t val)
 		/* Look mummy a start a bit */
 		bitcount = 1;
 		bits = 0;
-		if (trace & TRACE_CPLD)
+		if (TRACE_ON(trace & TRACE_CPLD))
 			fprintf(stderr, "[start]");
 		return;
 	}
 	/* This works because all the existing code does one write per bit */
 	if (bitcount == 9) {
 		if (val & 1) {
-			if (trace & TRACE_CPLD)
+			if (TRACE_ON(trace & TRACE_CPLD))
 				fprintf(stderr, "[stop]");
-			putchar(bits);
-			fflush(stdout);
+			console_putc(bits);
 		} else	/* Framing error should be a stop bit */
-			putchar('?');
+			console_putc('?');
 		bitcount = 0;
 		bits = 0;
 		return;
 	}
 	bits >>= 1;
 	bits |= val ? 0x80: 0x00;
-	if (trace & TRACE_CPLD)
+	if (TRACE_ON(trace & TRACE_CPLD))
 		fprintf(stderr, "[%d]", val);
 	bitcount++;
 }
@@ -1918,9 +2188,10 @@ static void sbc64_cpld_bankreg(uint8_t val)
 	/* Bit 2 is the LED */
 	val &= 3;
 	if (bankreg[0] != val) {
-		if (trace & TRACE_CPLD)
+		if (TRACE_ON(trace & TRACE_CPLD))
 			fprintf(stderr, "Bank set to %02X\n", val);
 		bankreg[0] = val;
+		mem_remap();
 	}
 }
 
@@ -1954,7 +2225,7 @@ static uint8_t z84c15_read(uint8_t port)
 
 static void z84c15_write(uint8_t port, uint8_t val)
 {
-	if (trace & TRACE_Z84C15)
+	if (TRACE_ON(trace & TRACE_Z84C15))
 		fprintf(stderr, "z84c15: write %02X <- %02X\n",
 			port, val);
 	switch(port) {
@@ -1971,9 +2242,11 @@ static void z84c15_write(uint8_t port, uint8_t val)
 			break;
 		case 2:
 			z84c15.csbr = val;
+			mem_remap();
 			break;
 		case 3:
 			z84c15.mcr = val;
+			mem_remap();
 			break;
 		default:
 			fprintf(stderr, "Read invalid SCRP  %d\n", z84c15.scrp);
@@ -2015,7 +2288,7 @@ static void kio_write(uint8_t addr, uint8_t val)
 
 static void fdc_log(int debuglevel, char *fmt, va_list ap)
 {
-	if ((trace & TRACE_FDC) || debuglevel == 0)
+	if (TRACE_ON(trace & TRACE_FDC) || debuglevel == 0)
 		vfprintf(stderr, "fdc: ", ap);
 }
 
@@ -2139,7 +2412,7 @@ static void z512_write(uint8_t addr, uint8_t val)
 			b >>= 2;
 		if (val & 0x01)
 			b >>= 1;
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Z512 SIO serial clock: %d\n", b);
 	}
 }
@@ -2152,9 +2425,64 @@ static void z512_write_wd(uint8_t addr, uint8_t val)
 
 /* PS/2 keyboard and mouse - only keyboard bits for now */
 
+/*
+ *	The keyboard is stepped every ps2_step clocks but most steps do
+ *	nothing, so we only run the ones that do. Before the host looks at
+ *	or changes the lines we catch up with every step that would have
+ *	run before this instruction started.
+ */
+static struct event ps2_ev;
+static uint64_t ps2_last;		/* Time of the last step done */
+static uint64_t ps2_due;		/* When ps2_ev is armed for */
+static unsigned int ps2_step;
+
+static void ps2_sync(uint64_t when)
+{
+	uint64_t n;
+	unsigned int q;
+
+	if (when < ps2_last + ps2_step)
+		return;
+	n = (when - ps2_last) / ps2_step;
+	while (n) {
+		q = ps2_quiet(ps2, ps2_step);
+		if (q == PS2_IDLE || q >= n) {
+			if (q != PS2_IDLE)
+				ps2_skip(ps2, ps2_step, n);
+			ps2_last += n * ps2_step;
+			return;
+		}
+		ps2_skip(ps2, ps2_step, q);
+		ps2_event(ps2, ps2_step);
+		ps2_last += (q + 1) * (uint64_t)ps2_step;
+		n -= q + 1;
+	}
+}
+
+/* Arm the event for the next step that does something */
+static void ps2_arm(void)
+{
+	unsigned int q = ps2_quiet(ps2, ps2_step);
+
+	if (q == PS2_IDLE) {
+		event_cancel(evq, &ps2_ev);
+		return;
+	}
+	ps2_due = ps2_last + (q + 1) * (uint64_t)ps2_step;
+	event_schedule(evq, &ps2_ev, ps2_due);
+}
+
+static void ps2_step_event(void *unused)
+{
+	ps2_sync(ps2_due);
+	ps2_arm();
+}
+
 static uint8_t ps2_read(void)
 {
 	uint8_t r = 0x00;
+
+	ps2_sync(event_now(evq) + cpu_z80.op_tstates);
 	if (ps2_get_clock(ps2))
 		r |= 0x04;
 	if (ps2_get_data(ps2))
@@ -2164,143 +2492,495 @@ static uint8_t ps2_read(void)
 
 static void ps2_write(uint8_t val)
 {
+	ps2_sync(event_now(evq) + cpu_z80.op_tstates);
 	ps2_set_lines(ps2, !!(val & 0x01) , !!(val & 0x02));
+	ps2_arm();
 }
 
-static uint8_t io_read_2014(uint16_t addr)
-{
-	if (trace & TRACE_IO)
-		fprintf(stderr, "read %02x\n", addr);
-	if (copro && (addr & 0xFC) == 0xBC)
-		return z80copro_ioread(copro, addr);
-	if ((addr & 0xFF) == 0xBA) {
-		return 0xCC;
-	}
-	if (zxkey && (addr & 0xFC) == 0xFC)
-		return zxkey_scan(zxkey, addr);
+/*
+ *	The RC2014 bus decode. The cards fitted do not change once we are
+ *	running so the decode chain is walked once per port at start up to
+ *	build a table of handlers. Each handler gets the full port address.
+ */
 
-	addr &= 0xFF;
+typedef uint8_t (*io_read_fn)(uint16_t addr);
+typedef void (*io_write_fn)(uint16_t addr, uint8_t val);
 
-	if (addr >= 0x80 && addr <= 0x9F && have_kio)
-		return kio_read(addr & 0x1F);
-	if (addr >= 0x48 && addr < 0x50) 
-		return fdc_read(addr & 7);
-	if ((addr == 0x42 || addr == 0x43) && amd9511)
-		return amd9511_read(amd9511, addr);
-	if ((addr >= 0xA0 && addr <= 0xA7) && acia && acia_narrow == 1)
-		return acia_read(acia, addr & 1);
-	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow == 2)
-		return acia_read(acia, addr & 1);
-	if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
-		return acia_read(acia, addr & 1);
-	if ((addr >= 0x80 && addr <= 0x87) && sio2 && !have_kio)
-		return sio2_read(addr & 3);
-	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
-		return my_ide_read(addr & 7);
-	if (addr >= 0x20 && addr <= 0x27 && ide == 2)
-		return ppide_read(ppide, addr & 3);
-	if (addr >= 0x28 && addr <= 0x2C && have_wiznet)
-		return nic_w5100_read(wiz, addr & 3);
-	if (addr >= 0x68 && addr <= 0x6F && have_pio)
-		return pio_read2(addr & 3);
+static io_read_fn io_rmap[256];
+static io_write_fn io_wmap[256];
 
-	if (addr == 0xBB && ps2)
-		return ps2_read();
-	if (addr == 0xC0 && rtc)
-		return rtc_read(rtc);
-	/* Scott Baker is 0x90-93, suggested defaults for the
-	   Stephen Cousins boards at 0x88-0x8B. No doubt we'll get
-	   an official CTC board at another address  */
-	if (addr >= 0x88 && addr <= 0x8B && have_ctc)
-		return ctc_read(addr & 3);
-	if ((addr == 0x98 || addr == 0x99) && vdp)
-		return tms9918a_read(vdp, addr & 1);
-	if (addr >= 0xA0 && addr <= 0xA7 && have_16x50)
-		return uart_read(&uart[0], addr & 7);
-	if (addr == 0x6D && is_z512)
-		return z512_read(addr);
-	if (trace & TRACE_UNK)
-		fprintf(stderr, "Unknown read from port %04X\n", addr);
-	return 0x78;	/* 78 is what my actual board floats at */
+static uint8_t io_dma_r(uint16_t addr)
+{
+	return z80dma_read(dma);
 }
 
-static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
+static uint8_t io_copro_r(uint16_t addr)
 {
-	if (trace & TRACE_IO)
-		fprintf(stderr, "write %02x <- %02x\n", addr, val);
+	return z80copro_ioread(copro, addr);
+}
 
-	if (copro && (addr & 0xFC) == 0xBC) {
-		z80copro_iowrite(copro, addr, val);
-		return;
-	}
-	if ((addr & 0xFF) == 0xBA) {
-		/* Quart */
-		return;
+static uint8_t io_quart_r(uint16_t addr)
+{
+	return 0xCC;
+}
+
+static uint8_t io_zxkey_r(uint16_t addr)
+{
+	return zxkey_scan(zxkey, addr);
+}
+
+static uint8_t io_kio_r(uint16_t addr)
+{
+	return kio_read(addr & 0x1F);
+}
+
+/* Bring the FDC's mechanical clock up to now. It runs in microseconds */
+static void fdc_catchup(void)
+{
+	uint64_t now = event_now(evq) + cpu_z80.tstates;
+	unsigned long us = (now - fdc_time) * 1000000 / cpu_hz;
+
+	if (us) {
+		fdc_advance(fdc, us);
+		fdc_time += (uint64_t)us * cpu_hz / 1000000;
 	}
-	addr &= 0xFF;
+}
+
+/* Wake up when the FDC stops being busy so an idle guest polling
+   the status skips straight there */
+static void fdc_time_arm(void)
+{
+	unsigned long us = fdc_busy(fdc);
+	if (us)
+		event_schedule(evq, &fdc_time_ev, fdc_time + ((uint64_t)us * cpu_hz + 999999) / 1000000);
+}
+
+static void fdc_time_event(void *unused)
+{
+	fdc_catchup();
+	fdc_time_arm();
+}
+
+static uint8_t io_fdc_r(uint16_t addr)
+{
+	auto_fdc++;
+	if (fdc_timing)
+		fdc_catchup();
+	return fdc_read(addr & 7);
+}
+
+static uint8_t io_amd9511_r(uint16_t addr)
+{
+	amd9511_time(amd9511, event_now(evq) + cpu_z80.tstates);
+	return amd9511_read(amd9511, addr & 0xFF);
+}
+
+static uint8_t io_acia_r(uint16_t addr)
+{
+	uint8_t r = acia_read(acia, addr & 1);
+	if (!(addr & 1))
+		idle_poll(addr & 0xFF, r);
+	return r;
+}
+
+static uint8_t io_sio2_r(uint16_t addr)
+{
+	return sio2_read(addr & 3);
+}
+
+static uint8_t io_ide_r(uint16_t addr)
+{
+	return my_ide_read(addr & 7);
+}
+
+static uint8_t io_ppide_r(uint16_t addr)
+{
+	return ppide_read(ppide, addr & 3);
+}
+
+static uint8_t io_w5100_r(uint16_t addr)
+{
+	return nic_w5100_read(wiz, addr & 3);
+}
+
+static uint8_t io_pio_r(uint16_t addr)
+{
+	return pio_read2(addr & 3);
+}
+
+static uint8_t io_ps2_r(uint16_t addr)
+{
+	return ps2_read();
+}
+
+static uint8_t io_rtc_r(uint16_t addr)
+{
+	auto_rtc++;
+	return rtc_read(rtc);
+}
+
+static uint8_t io_ctc_r(uint16_t addr)
+{
+	return ctc_read(addr & 3);
+}
+
+static uint8_t io_tms9918a_r(uint16_t addr)
+{
+	tms9918a_sync(vdp, event_now(evq) + cpu_z80.tstates);
+	if (addr & 1)
+		auto_vdp++;
+	return tms9918a_read(vdp, addr & 1);
+}
+
+static uint8_t io_uart_r(uint16_t addr)
+{
+	uint8_t r = uart16x50_read(uart, addr & 7);
+	if ((addr & 7) == 5)
+		idle_poll(0xA5, r);
+	uart_irq_update();
+	return r;
+}
+
+static uint8_t io_z512_r(uint16_t addr)
+{
+	return z512_read(addr & 0xFF);
+}
+
+static uint8_t io_pvdisk_r(uint16_t addr)
+{
+	return pvdisk_read(pvdisk, addr & 7);
+}
+
+static uint8_t io_hostfs_r(uint16_t addr)
+{
+	return hostfs_read(hostfs, addr & 7);
+}
+
+static uint8_t io_perfctr_r(uint16_t addr)
+{
+	return perfctr_read(perfctr, addr & 7);
+}
+
+static io_read_fn io_read_decode(uint8_t addr)
+{
+	if (addr == 0xE0 && dma)
+		return io_dma_r;
+	if (copro && (addr & 0xFC) == 0xBC)
+		return io_copro_r;
+	if (addr == 0xBA)
+		return io_quart_r;
+	if (zxkey && (addr & 0xFC) == 0xFC)
+		return io_zxkey_r;
 	if (addr >= 0x80 && addr <= 0x9F && have_kio)
-		kio_write(addr & 0x1F, val);
-	else if (addr >= 0x48 && addr < 0x50)
-		fdc_write(addr & 7, val);
-	else if ((addr == 0x42 || addr == 0x43) && amd9511)
-		amd9511_write(amd9511, addr, val);
-	else if ((addr >= 0xA0 && addr <= 0xA7) && acia && acia_narrow == 1)
-		acia_write(acia, addr & 1, val);
-	else if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow == 2)
-		acia_write(acia, addr & 1, val);
-	else if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
-		acia_write(acia, addr & 1, val);
-	else if ((addr >= 0x80 && addr <= 0x87) && sio2 && !have_kio)
-		sio2_write(addr & 3, val);
-	else if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
-		my_ide_write(addr & 7, val);
-	else if (addr >= 0x20 && addr <= 0x27 && ide == 2)
-		ppide_write(ppide, addr & 3, val);
-	else if (addr >= 0x28 && addr <= 0x2C && have_wiznet)
-		nic_w5100_write(wiz, addr & 3, val);
-	else if (addr >= 0x68 && addr <= 0x6F && have_pio)
-		pio_write2(addr & 3, val);
+		return io_kio_r;
+	if (addr >= 0x48 && addr < 0x50) 
+		return io_fdc_r;
+	if ((addr == 0x42 || addr == 0x43) && amd9511)
+		return io_amd9511_r;
+	if ((addr >= 0xA0 && addr <= 0xA7) && acia && acia_narrow == 1)
+		return io_acia_r;
+	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow == 2)
+		return io_acia_r;
+	if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
+		return io_acia_r;
+	if ((addr >= 0x80 && addr <= 0x87) && sio2 && !have_kio)
+		return io_sio2_r;
+	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
+		return io_ide_r;
+	if (addr >= 0x20 && addr <= 0x27 && ide == 2)
+		return io_ppide_r;
+	if (addr >= 0x28 && addr <= 0x2C && have_wiznet)
+		return io_w5100_r;
+	if (addr >= 0x68 && addr <= 0x6F && have_pio)
+		return io_pio_r;
+
+	if (addr == 0xBB && ps2)
+		return io_ps2_r;
+	if (addr == 0xC0 && rtc)
+		return io_rtc_r;
+	/* Scott Baker is 0x90-93, suggested defaults for the
+	   Stephen Cousins boards at 0x88-0x8B. No doubt we'll get
+	   an official CTC board at another address  */
+	if (addr >= 0x88 && addr <= 0x8B && have_ctc)
+		return io_ctc_r;
+	if ((addr == 0x98 || addr == 0x99) && vdp)
+		return io_tms9918a_r;
+	if (addr >= 0xA0 && addr <= 0xA7 && have_16x50)
+		return io_uart_r;
+	if (addr == 0x6D && is_z512)
+		return io_z512_r;
+	if (addr >= 0xF0 && addr <= 0xF7 && pvdisk)
+		return io_pvdisk_r;
+	if (addr >= 0xE8 && addr <= 0xEF && hostfs)
+		return io_hostfs_r;
+	if (addr >= 0xD8 && addr <= 0xDF && perfctr)
+		return io_perfctr_r;
+	return NULL;
+}
+
+static uint8_t io_read_2014(uint16_t addr)
+{
+	io_read_fn fn = io_rmap[addr & 0xFF];
+
+	if (TRACE_ON(trace & TRACE_IO))
+		fprintf(stderr, "read %02x\n", addr);
+	if (fn)
+		return fn(addr);
+	if (TRACE_ON(trace & TRACE_UNK))
+		fprintf(stderr, "Unknown read from port %04X\n", addr & 0xFF);
+	return 0x78;	/* 78 is what my actual board floats at */
+}
+
+static void io_dma_w(uint16_t addr, uint8_t val)
+{
+	z80dma_write(dma, val);
+	/* It takes the bus as soon as it is enabled */
+	if (z80dma_active(dma))
+		cpu_stop = 1;
+}
+
+static void io_copro_w(uint16_t addr, uint8_t val)
+{
+	z80copro_iowrite(copro, addr, val);
+}
+
+static void io_quart_w(uint16_t addr, uint8_t val)
+{
+}
+
+static void io_kio_w(uint16_t addr, uint8_t val)
+{
+	kio_write(addr & 0x1F, val);
+}
+
+static void io_fdc_w(uint16_t addr, uint8_t val)
+{
+	auto_fdc++;
+	if (fdc_timing)
+		fdc_catchup();
+	fdc_write(addr & 7, val);
+	if (fdc_timing)
+		fdc_time_arm();
+}
+
+static void io_amd9511_w(uint16_t addr, uint8_t val)
+{
+	amd9511_time(amd9511, event_now(evq) + cpu_z80.tstates);
+	amd9511_write(amd9511, addr & 0xFF, val);
+}
+
+static void io_acia_w(uint16_t addr, uint8_t val)
+{
+	acia_write(acia, addr & 1, val);
+}
+
+static void io_sio2_w(uint16_t addr, uint8_t val)
+{
+	sio2_write(addr & 3, val);
+}
+
+static void io_ide_w(uint16_t addr, uint8_t val)
+{
+	my_ide_write(addr & 7, val);
+}
+
+static void io_ppide_w(uint16_t addr, uint8_t val)
+{
+	ppide_write(ppide, addr & 3, val);
+}
+
+static void io_w5100_w(uint16_t addr, uint8_t val)
+{
+	nic_w5100_write(wiz, addr & 3, val);
+}
+
+static void io_pio_w(uint16_t addr, uint8_t val)
+{
+	pio_write2(addr & 3, val);
+}
+
+static void io_bank512_w(uint16_t addr, uint8_t val)
+{
+	bankreg[addr & 3] = val & 0x3F;
+	mem_remap();
+	if (TRACE_ON(trace & TRACE_512))
+		fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
+}
+
+static void io_bankenable_w(uint16_t addr, uint8_t val)
+{
+	if (TRACE_ON(trace & TRACE_512))
+		fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
+	bankenable = val & 1;
+	mem_remap();
+}
+
+static void io_ps2_w(uint16_t addr, uint8_t val)
+{
+	ps2_write(val);
+}
+
+static void io_rtc_w(uint16_t addr, uint8_t val)
+{
+	rtc_write(rtc, val);
+}
+
+static void io_ctc_w(uint16_t addr, uint8_t val)
+{
+	ctc_write(addr & 3, val);
+}
+
+static void io_tms9918a_w(uint16_t addr, uint8_t val)
+{
+	tms9918a_sync(vdp, event_now(evq) + cpu_z80.tstates);
+	tms9918a_write(vdp, addr & 1, val);
+}
+
+static void io_uart_w(uint16_t addr, uint8_t val)
+{
+	uart16x50_write(uart, addr & 7, val);
+	uart_irq_update();
+}
+
+static void io_z512_w(uint16_t addr, uint8_t val)
+{
+	z512_write(addr & 0xFF, val);
+}
+
+static void io_z512_wd_w(uint16_t addr, uint8_t val)
+{
+	z512_write_wd(addr & 0xFF, val);
+}
+
+/* The whole transfer happens in the OUT, which takes as long as asked */
+static void io_pvdisk_w(uint16_t addr, uint8_t val)
+{
+	auto_fdc++;
+	cpu_z80.tstates += pvdisk_write(pvdisk, addr & 7, val);
+}
+
+static void io_hostfs_w(uint16_t addr, uint8_t val)
+{
+	hostfs_write(hostfs, addr & 7, val);
+}
+
+static void io_perfctr_w(uint16_t addr, uint8_t val)
+{
+	perfctr_write(perfctr, addr & 7, val);
+}
+
+static void io_toggle_rom_w(uint16_t addr, uint8_t val)
+{
+	toggle_rom();
+}
+
+static void io_trace_lo_w(uint16_t addr, uint8_t val)
+{
+	trace &= 0xFF00;
+	trace |= val;
+	mem_remap();
+	fprintf(stderr, "trace set to %04X\n", trace);
+}
+
+static void io_trace_hi_w(uint16_t addr, uint8_t val)
+{
+	trace &= 0xFF;
+	trace |= val << 8;
+	mem_remap();
+	printf("trace set to %d\n", trace);
+}
+
+static io_write_fn io_write_decode(uint8_t addr)
+{
+	if (addr == 0xE0 && dma)
+		return io_dma_w;
+	if (copro && (addr & 0xFC) == 0xBC)
+		return io_copro_w;
+	if (addr == 0xBA)
+		return io_quart_w;
+	if (addr >= 0x80 && addr <= 0x9F && have_kio)
+		return io_kio_w;
+	if (addr >= 0x48 && addr < 0x50)
+		return io_fdc_w;
+	if ((addr == 0x42 || addr == 0x43) && amd9511)
+		return io_amd9511_w;
+	if ((addr >= 0xA0 && addr <= 0xA7) && acia && acia_narrow == 1)
+		return io_acia_w;
+	if ((addr >= 0x80 && addr <= 0x87) && acia && acia_narrow == 2)
+		return io_acia_w;
+	if ((addr >= 0x80 && addr <= 0xBF) && acia && !acia_narrow)
+		return io_acia_w;
+	if ((addr >= 0x80 && addr <= 0x87) && sio2 && !have_kio)
+		return io_sio2_w;
+	if ((addr >= 0x10 && addr <= 0x17) && ide == 1)
+		return io_ide_w;
+	if (addr >= 0x20 && addr <= 0x27 && ide == 2)
+		return io_ppide_w;
+	if (addr >= 0x28 && addr <= 0x2C && have_wiznet)
+		return io_w5100_w;
+	if (addr >= 0x68 && addr <= 0x6F && have_pio)
+		return io_pio_w;
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
-	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
-		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
-			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
-	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
-			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
-		bankenable = val & 1;
-	} else if (addr == 0xBB && ps2)
-		ps2_write(val);
-	else if (addr == 0xC0 && rtc)
-		rtc_write(rtc, val);
-	else if (addr >= 0x88 && addr <= 0x8B && have_ctc)
-		ctc_write(addr & 3, val);
-	else if ((addr == 0x98 || addr == 0x99) && vdp)
-		tms9918a_write(vdp, addr & 1, val);
-	else if (addr >= 0xA0 && addr <= 0xA7 && have_16x50)
-		uart_write(&uart[0], addr & 7, val);
-	else if (addr == 0x6D && is_z512)
-		z512_write(addr, val);
-	else if (addr == 0x6F && is_z512)
-		z512_write_wd(addr, val);
+	if (bank512 && addr >= 0x78 && addr <= 0x7B)
+		return io_bank512_w;
+	if (bank512 && addr >= 0x7C && addr <= 0x7F)
+		return io_bankenable_w;
+	if (addr == 0xBB && ps2)
+		return io_ps2_w;
+	if (addr == 0xC0 && rtc)
+		return io_rtc_w;
+	if (addr >= 0x88 && addr <= 0x8B && have_ctc)
+		return io_ctc_w;
+	if ((addr == 0x98 || addr == 0x99) && vdp)
+		return io_tms9918a_w;
+	if (addr >= 0xA0 && addr <= 0xA7 && have_16x50)
+		return io_uart_w;
+	if (addr == 0x6D && is_z512)
+		return io_z512_w;
+	if (addr == 0x6F && is_z512)
+		return io_z512_wd_w;
+	if (addr >= 0xF0 && addr <= 0xF7 && pvdisk)
+		return io_pvdisk_w;
+	if (addr >= 0xE8 && addr <= 0xEF && hostfs)
+		return io_hostfs_w;
+	if (addr >= 0xD8 && addr <= 0xDF && perfctr)
+		return io_perfctr_w;
 	/* The switchable/pageable ROM is not very well decoded */
-	else if (switchrom && (addr & 0x7F) >= 0x38 && (addr & 0x7F) <= 0x3F)
-		toggle_rom();
-	else if (addr == 0xFD) {
-		trace &= 0xFF00;
-		trace |= val;
-		fprintf(stderr, "trace set to %04X\n", trace);
-	} else if (addr == 0xFE) {
-		trace &= 0xFF;
-		trace |= val << 8;
-		printf("trace set to %d\n", trace);
-	} else if (!known && (trace & TRACE_UNK))
-		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
+	if (switchrom && (addr & 0x7F) >= 0x38 && (addr & 0x7F) <= 0x3F)
+		return io_toggle_rom_w;
+	if (addr == 0xFD)
+		return io_trace_lo_w;
+	if (addr == 0xFE)
+		return io_trace_hi_w;
+	return NULL;
+}
+
+static void io_write_2014(uint16_t addr, uint8_t val, uint8_t known)
+{
+	io_write_fn fn = io_wmap[addr & 0xFF];
+
+	if (TRACE_ON(trace & TRACE_IO))
+		fprintf(stderr, "write %02x <- %02x\n", addr, val);
+	if (fn)
+		fn(addr, val);
+	else if (!known && TRACE_ON(trace & TRACE_UNK))
+		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr & 0xFF, val);
+}
+
+/* Call once all the cards have been set up */
+static void io_map_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++) {
+		io_rmap[i] = io_read_decode(i);
+		io_wmap[i] = io_write_decode(i);
+	}
 }
 
 static uint8_t io_read_4(uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr >= 0x80 && addr <= 0x83)
@@ -2313,14 +2993,14 @@ static uint8_t io_read_4(uint16_t addr)
 		return rtc_read(rtc);
 	if (addr >= 0x88 && addr <= 0x8B)
 		return ctc_read(addr & 3);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write_4(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr >= 0x80 && addr <= 0x83)
@@ -2332,29 +3012,31 @@ static void io_write_4(uint16_t addr, uint8_t val)
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		mem_remap();
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
+		mem_remap();
 	} else if (addr == 0xC0 && rtc)
 		rtc_write(rtc, val);
 	else if (addr >= 0x88 && addr <= 0x8B)
 		ctc_write(addr & 3, val);
-	else if (addr == 0xFC) {
-		putchar(val);
-		fflush(stdout);
-	} else if (addr == 0xFD) {
+	else if (addr == 0xFC)
+		console_putc(val);
+	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+		mem_remap();
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
 static uint8_t io_read_5(uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr >= 0x18 && addr <= 0x1B)
@@ -2371,14 +3053,14 @@ static uint8_t io_read_5(uint16_t addr)
 		return z84c15_read(addr);
 	if (addr >= 0x1C && addr <= 0x1F)
 		return pio_read(addr & 3);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write_5(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr >= 0x18 && addr <= 0x1B)
@@ -2390,12 +3072,14 @@ static void io_write_5(uint16_t addr, uint8_t val)
 	/* FIXME: real bank512 alias at 0x70-77 for 78-7F */
 	else if (bank512 && addr >= 0x78 && addr <= 0x7B) {
 		bankreg[addr & 3] = val & 0x3F;
-		if (trace & TRACE_512)
+		mem_remap();
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Bank %d set to %d\n", addr & 3, val);
 	} else if (bank512 && addr >= 0x7C && addr <= 0x7F) {
-		if (trace & TRACE_512)
+		if (TRACE_ON(trace & TRACE_512))
 			fprintf(stderr, "Banking %sabled.\n", (val & 1) ? "en" : "dis");
 		bankenable = val & 1;
+		mem_remap();
 	} else if (addr == 0xC0 && rtc)
 		rtc_write(rtc, val);
 	else if (addr >= 0x10 && addr <= 0x13)
@@ -2404,13 +3088,13 @@ static void io_write_5(uint16_t addr, uint8_t val)
 		pio_write(addr & 3, val);
 	else if ((addr >= 0xEE && addr <= 0xF1) || addr == 0xF4)
 		z84c15_write(addr, val);
-	else if (addr == 0xFC) {
-		putchar(val);
-		fflush(stdout);
-	} else if (addr == 0xFD) {
+	else if (addr == 0xFC)
+		console_putc(val);
+	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+		mem_remap();
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -2418,9 +3102,10 @@ static void io_write_1(uint16_t addr, uint8_t val)
 {
 	if ((addr & 0xFF) == 0x38) {
 		val &= 0x81;
-		if (val != port38 && (trace & TRACE_ROM))
+		if (val != port38 && TRACE_ON(trace & TRACE_ROM))
 			fprintf(stderr, "Bank set to %02X\n", val);
 		port38 = val;
+		mem_remap();
 		return;
 	}
 	io_write_2014(addr, val, 0);
@@ -2479,7 +3164,7 @@ static void io_write_2(uint16_t addr, uint8_t val)
 			printf("[LED on]\n");
 		return;
 	case 0x20:
-		if (trace & TRACE_UART) {
+		if (TRACE_ON(trace & TRACE_UART)) {
 			if (val & 1)
 				fprintf(stderr, "[RTS high]\n");
 			else
@@ -2491,14 +3176,16 @@ static void io_write_2(uint16_t addr, uint8_t val)
 		known = 1;
 		break;
 	case 0x30:
-		if (trace & TRACE_ROM)
+		if (TRACE_ON(trace & TRACE_ROM))
 			fprintf(stderr, "RAM Bank set to %02X\n", val);
 		port30 = val;
+		mem_remap();
 		return;
 	case 0x38:
-		if (trace & TRACE_ROM)
+		if (TRACE_ON(trace & TRACE_ROM))
 			fprintf(stderr, "ROM Bank set to %02X\n", val);
 		port38 = val;
+		mem_remap();
 		return;
 	}
 	io_write_2014(addr, val, known);
@@ -2517,7 +3204,7 @@ static uint8_t io_read_micro80(uint16_t addr)
 		return z84c15_read(r);
 	else if (r >= 0x90 && r <= 0x97)
 		return my_ide_read(r & 7);
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
@@ -2538,167 +3225,1650 @@ static void io_write_micro80(uint16_t addr, uint8_t val)
 	else if (addr == 0xFD) {
 		printf("trace set to %d\n", val);
 		trace = val;
-	} else if (trace & TRACE_UNK)
+		mem_remap();
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
-static void io_write_pdog(uint16_t addr, uint8_t val)
+static void io_write_pdog(uint16_t addr, uint8_t val)
+{
+	if ((addr & 0xFB) == 0x78) {	/* 78 or 7C */
+		if (cpuboard == CPUBOARD_PDOG512)
+			val &= 0x8F;
+		pick_bank = val;
+		mem_remap();
+	} else
+		io_write_2014(addr, val, 0);
+}
+
+
+static void do_io_write(uint16_t addr, uint8_t val);
+static uint8_t do_io_read(uint16_t addr);
+
+/* Only the memory and CPU trace go on for ports the filter leaves out */
+#define TRACE_NOT_IO	(TRACE_MEM | TRACE_CPU)
+
+void io_write(int unused, uint16_t addr, uint8_t val)
+{
+	int saved;
+
+	/* Any output means the guest is doing something */
+	idle_polls = 0;
+	idle_output = 1;
+	if (tfilt && !TRACEFILT_HIT(tfilt, TRACEFILT_IO, io, addr & 0xFF)) {
+		saved = trace;
+		trace &= TRACE_NOT_IO;
+		do_io_write(addr, val);
+		trace = saved;
+	} else
+		do_io_write(addr, val);
+}
+
+static void do_io_write(uint16_t addr, uint8_t val)
+{
+	switch (cpuboard) {
+	case CPUBOARD_Z80:
+		io_write_2014(addr, val, 0);
+		break;
+	case CPUBOARD_SC108:
+		io_write_1(addr, val);
+		break;
+	case CPUBOARD_SC114:
+	case CPUBOARD_SC121:
+		io_write_2(addr, val);
+		break;
+	case CPUBOARD_Z80SBC64:
+	case CPUBOARD_ZRCC:
+		io_write_3(addr, val);
+		break;
+	case CPUBOARD_EASYZ80:
+		io_write_4(addr, val);
+		break;
+	case CPUBOARD_MICRO80:
+		io_write_micro80(addr, val);
+		break;
+	case CPUBOARD_TINYZ80:
+		io_write_5(addr, val);
+		break;
+	case CPUBOARD_PDOG128:
+	case CPUBOARD_PDOG512:
+		io_write_pdog(addr, val);
+		break;
+	default:
+		fprintf(stderr, "bad cpuboard\n");
+		exit(1);
+	}
+}
+
+uint8_t io_read(int unused, uint16_t addr)
+{
+	uint8_t r;
+	int saved;
+
+	if (tfilt && !TRACEFILT_HIT(tfilt, TRACEFILT_IO, io, addr & 0xFF)) {
+		saved = trace;
+		trace &= TRACE_NOT_IO;
+		r = do_io_read(addr);
+		trace = saved;
+		return r;
+	}
+	return do_io_read(addr);
+}
+
+static uint8_t do_io_read(uint16_t addr)
+{
+	switch (cpuboard) {
+	case CPUBOARD_Z80:
+	case CPUBOARD_SC108:
+	case CPUBOARD_PDOG128:
+	case CPUBOARD_PDOG512:
+		return io_read_2014(addr);
+	case CPUBOARD_SC114:
+	case CPUBOARD_SC121:
+		return io_read_2(addr);
+	case CPUBOARD_Z80SBC64:
+	case CPUBOARD_ZRCC:
+		return io_read_3(addr);
+	case CPUBOARD_EASYZ80:
+		return io_read_4(addr);
+	case CPUBOARD_MICRO80:
+		return io_read_micro80(addr);
+	case CPUBOARD_TINYZ80:
+		return io_read_5(addr);
+	default:
+		fprintf(stderr, "bad cpuboard\n");
+		exit(1);
+	}
+}
+
+/*
+ *	INIR and OTIR on the CF data register move a sector run in one go,
+ *	and on the Wiznet data register a run of a socket buffer. Only for
+ *	the boards that decode through io_rmap, and not while the port
+ *	traffic is being traced.
+ */
+static unsigned io_block_read(int unused, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	if (TRACE_ON(trace & TRACE_IO))
+		return 0;
+	if ((addr & 0xFF) == 0x2B && io_rmap[0x2B] == io_w5100_r)
+		return nic_w5100_read_block(wiz, buf, len);
+	if ((addr & 0xFF) != 0x10 || io_rmap[0x10] != io_ide_r)
+		return 0;
+	if (TRACE_ON(trace & TRACE_IDE))
+		return 0;
+	return ide_read_block(ide0, buf, len);
+}
+
+static unsigned io_block_write(int unused, uint16_t addr, const uint8_t *buf, unsigned len)
+{
+	if (TRACE_ON(trace & TRACE_IO))
+		return 0;
+	if ((addr & 0xFF) == 0x2B && io_wmap[0x2B] == io_w5100_w)
+		return nic_w5100_write_block(wiz, buf, len);
+	if ((addr & 0xFF) != 0x10 || io_wmap[0x10] != io_ide_w)
+		return 0;
+	if (TRACE_ON(trace & TRACE_IDE))
+		return 0;
+	return ide_write_block(ide0, buf, len);
+}
+
+static void io_block_init(void)
+{
+	switch (cpuboard) {
+	case CPUBOARD_Z80:
+	case CPUBOARD_SC108:
+	case CPUBOARD_PDOG128:
+	case CPUBOARD_PDOG512:
+	case CPUBOARD_SC114:
+	case CPUBOARD_SC121:
+		cpu_z80.ioBlockRead = io_block_read;
+		cpu_z80.ioBlockWrite = io_block_write;
+		break;
+	default:
+		cpu_z80.ioBlockRead = NULL;
+		cpu_z80.ioBlockWrite = NULL;
+	}
+}
+
+static void poll_irq_event(void)
+{
+	uint8_t vector;
+
+	if (acia)
+		acia_check_irq(acia);
+	if (uart)
+		uart_check_irq(uart);
+	if (have_im2) {
+		if (z80irq_next(irq, &vector))
+			Z80INT(&cpu_z80, vector);
+		/* TMS9918A no IM2 handling */
+	} else {
+		if (z80irq_any(irq, &vector))
+			Z80INT(&cpu_z80, vector);
+		if (vdp && tms9918a_irq_pending(vdp))
+			Z80INT(&cpu_z80, 0xFF);
+	}
+}
+
+/* Put the chain sources on the router */
+static void irq_init(void)
+{
+	unsigned int i;
+
+	irq = z80irq_create();
+	if (sio2 || have_kio) {
+		z80irq_source(irq, IRQ_SIOA, sio2_vector, sio2_reti_line, sio);
+		z80irq_source(irq, IRQ_SIOB, sio2_vector, sio2_reti_line, sio + 1);
+	}
+	if (have_ctc || have_kio)
+		for (i = 0; i < 4; i++)
+			z80irq_source(irq, IRQ_CTC + i, ctc_vector, ctc_reti_line, ctc + i);
+}
+
+/* Rebuild the pending lines from the device state after a load */
+static void irq_resync(void)
+{
+	unsigned int i;
+
+	z80irq_set(irq, IRQ_SIOA, sio[0].irq);
+	z80irq_set(irq, IRQ_SIOB, sio[1].irq);
+	for (i = 0; i < 4; i++)
+		z80irq_set(irq, IRQ_CTC + i, ctc_irqmask & (1 << i));
+}
+
+static void reti_event(int unused)
+{
+	if (z80irq_live(irq) && TRACE_ON(trace & TRACE_IRQ))
+		fprintf(stderr, "RETI\n");
+	/* If IM2 is not wired then all the things respond at the same
+	   time. I think they can also fight over the vector but ignore
+	   that */
+	if (have_im2)
+		z80irq_reti(irq);
+	else
+		z80irq_reti_all(irq);
+	poll_irq_event();
+}
+
+/*
+ *	Whole machine snapshots. A machine booted to a prompt can be saved
+ *	and later runs started straight from there with -L. The snapshot
+ *	has to be loaded into a machine set up with the same options as the
+ *	one that saved it; the disks are not in it and should match too.
+ *
+ *	With -J the machine also checkpoints itself every so many emulated
+ *	seconds. The first is a full snapshot to the -O path and those after
+ *	it go to path.1, path.2 and so on, holding only the pages written
+ *	since the one before and chained back to it. Loading any of them
+ *	rebuilds memory from the whole chain.
+ */
+
+static char *snap_path;
+static volatile sig_atomic_t snap_request;
+
+/* Incrementals before the chain starts again from a full snapshot */
+#define CK_CHAIN	32
+
+static unsigned int ck_secs;
+static unsigned int ck_frames;
+static unsigned int ck_request;
+static unsigned int ck_seq;
+static char *ck_parent;		/* What the next checkpoint chains to */
+static uint64_t ck_id;
+
+/* The options that decide what hardware there is */
+struct snap_config {
+	uint32_t romsize;
+	uint32_t hz;
+	uint8_t cpuboard;
+	uint8_t bank512;
+	uint8_t switchrom;
+	uint8_t is_z512;
+	uint8_t acia;
+	uint8_t acia_narrow;
+	uint8_t sio2;
+	uint8_t uart16x50;
+	uint8_t ctc;
+	uint8_t pio;
+	uint8_t kio;
+	uint8_t im2;
+	uint8_t cpld_serial;
+	uint8_t rtc;
+	uint8_t ide;
+	uint8_t tms;
+	uint8_t wiznet;
+	uint8_t pvdisk;
+};
+
+/* Board latches and glue that live in this file */
+struct snap_board {
+	uint32_t bankreg[4];
+	uint32_t z512_wdog;
+	uint8_t bankenable;
+	uint8_t port30;
+	uint8_t port38;
+	uint8_t z512_control;
+	uint8_t pick_bank;
+	uint8_t live_irq;
+	uint8_t int_recalc;
+	uint8_t ctc_irqmask;
+	uint8_t pio_cs;
+	uint8_t sbc64_cpld_status;
+	uint8_t sbc64_cpld_char;
+};
+
+static void snap_get_config(struct snap_config *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->romsize = romsize;
+	c->hz = cpu_hz;
+	c->cpuboard = cpuboard;
+	c->bank512 = bank512;
+	c->switchrom = switchrom;
+	c->is_z512 = is_z512;
+	c->acia = acia != NULL;
+	c->acia_narrow = acia_narrow;
+	c->sio2 = sio2;
+	c->uart16x50 = have_16x50;
+	c->ctc = have_ctc;
+	c->pio = have_pio;
+	c->kio = have_kio;
+	c->im2 = have_im2;
+	c->cpld_serial = have_cpld_serial;
+	c->rtc = rtc != NULL;
+	c->ide = ide;
+	c->tms = have_tms;
+	c->wiznet = have_wiznet;
+	c->pvdisk = pvdisk != NULL;
+}
+
+static void snap_get_board(struct snap_board *b)
+{
+	unsigned int i;
+
+	memset(b, 0, sizeof(*b));
+	for (i = 0; i < 4; i++)
+		b->bankreg[i] = bankreg[i];
+	b->z512_wdog = z512_wdog;
+	b->bankenable = bankenable;
+	b->port30 = port30;
+	b->port38 = port38;
+	b->z512_control = z512_control;
+	b->pick_bank = pick_bank;
+	b->live_irq = z80irq_live(irq);
+	b->int_recalc = int_recalc;
+	b->ctc_irqmask = ctc_irqmask;
+	b->pio_cs = pio_cs;
+	b->sbc64_cpld_status = sbc64_cpld_status;
+	b->sbc64_cpld_char = sbc64_cpld_char;
+}
+
+static void snap_set_board(const struct snap_board *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		bankreg[i] = b->bankreg[i];
+	z512_wdog = b->z512_wdog;
+	bankenable = b->bankenable;
+	port30 = b->port30;
+	port38 = b->port38;
+	z512_control = b->z512_control;
+	pick_bank = b->pick_bank;
+	z80irq_set_live(irq, b->live_irq);
+	int_recalc = b->int_recalc;
+	ctc_irqmask = b->ctc_irqmask;
+	pio_cs = b->pio_cs;
+	sbc64_cpld_status = b->sbc64_cpld_status;
+	sbc64_cpld_char = b->sbc64_cpld_char;
+}
+
+/* Scratch space for the device modules to save into */
+static void *snap_scratch(size_t len)
+{
+	static void *buf;
+	static size_t size;
+
+	if (len > size) {
+		free(buf);
+		buf = malloc(len);
+		if (buf == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		size = len;
+	}
+	return buf;
+}
+
+#define SNAP_SAVE(s, tag, fn, dev) do {			\
+		size_t n_ = fn(dev, NULL);		\
+		void *b_ = snap_scratch(n_);		\
+		fn(dev, b_);				\
+		snapshot_put(s, tag, b_, n_);		\
+	} while (0)
+
+#define SNAP_LOAD(s, path, tag, fn, dev) do {		\
+		size_t n_;				\
+		const void *p_ = snapshot_find(s, tag, &n_);	\
+		if (p_ == NULL || fn(dev, p_, n_))	\
+			snap_mismatch(path, tag);	\
+	} while (0)
+
+static void snap_mismatch(const char *path, const char *tag)
+{
+	fprintf(stderr, "rc2014: snapshot '%s' does not match this machine (%.4s).\n",
+		path, tag);
+	exit(1);
+}
+
+static void snap_get(struct snapshot *s, const char *path, const char *tag, void *data, size_t len)
+{
+	if (snapshot_get(s, tag, data, len))
+		snap_mismatch(path, tag);
+}
+
+/* Tells a chained snapshot it has the right one under it */
+static uint64_t snap_newid(void)
+{
+	static uint64_t n;
+
+	return ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 12) ^ ++n;
+}
+
+/* Everything but the memory */
+static void machine_save_state(struct snapshot *s, uint64_t id)
+{
+	struct snap_config c;
+	struct snap_board b;
+
+	/* Bring the counters up to date */
+	ctc_sync(event_now(evq));
+	snap_get_config(&c);
+	snap_get_board(&b);
+	snapshot_put(s, "SNID", &id, sizeof(id));
+	snapshot_put(s, "CONF", &c, sizeof(c));
+	snapshot_put(s, "Z80 ", &cpu_z80, sizeof(cpu_z80));
+	snapshot_put(s, "BORD", &b, sizeof(b));
+	if (cpuboard == CPUBOARD_MICRO80 || cpuboard == CPUBOARD_TINYZ80)
+		snapshot_put(s, "Z84C", &z84c15, sizeof(z84c15));
+	if (acia)
+		SNAP_SAVE(s, "ACIA", acia_save, acia);
+	if (sio2)
+		snapshot_put(s, "SIO ", sio, sizeof(sio));
+	if (have_16x50)
+		SNAP_SAVE(s, "UART", uart16x50_save, uart);
+	snapshot_put(s, "CTC ", ctc, sizeof(ctc));
+	snapshot_put(s, "PIO ", pio, sizeof(pio));
+	if (rtc)
+		SNAP_SAVE(s, "RTC ", rtc_save, rtc);
+	if (ide0)
+		SNAP_SAVE(s, "IDE ", ide_save, ide0);
+	if (ppide) {
+		snapshot_put(s, "PPIO", ppide->pioreg, sizeof(ppide->pioreg));
+		SNAP_SAVE(s, "PPID", ide_save, ppide->ide);
+	}
+	if (pvdisk)
+		snapshot_put(s, "PVD ", pvdisk->reg, sizeof(pvdisk->reg));
+	if (vdp)
+		SNAP_SAVE(s, "TMS ", tms9918a_save, vdp);
+	if (wiz)
+		SNAP_SAVE(s, "W51 ", w5100_save, wiz);
+}
+
+/* Start tracking writes from here for the next checkpoint */
+static void ck_restart(const char *path, uint64_t id)
+{
+	if (ck_secs == 0)
+		return;
+	free(ck_parent);
+	ck_parent = strdup(path);
+	if (ck_parent == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	ck_id = id;
+	memset(mem_dirty, 0, sizeof(mem_dirty));
+	mem_track = 1;
+	mem_remap();
+}
+
+static void machine_save(const char *path)
+{
+	struct snapshot *s = snapshot_create(path);
+	uint64_t id = snap_newid();
+
+	if (s == NULL)
+		return;
+	machine_save_state(s, id);
+	snapshot_put_pages(s, "MEM ", ramrom, RAMROM_SIZE);
+	if (snapshot_close(s) == 0) {
+		fprintf(stderr, "[snapshot saved to %s]\n", path);
+		ck_seq = 0;
+		ck_restart(path, id);
+	}
+}
+
+/* An incremental checkpoint holding the pages written since the last */
+static void machine_checkpoint(void)
+{
+	struct snapshot *s;
+	uint64_t id = snap_newid();
+	uint8_t *base, *pages, *p;
+	size_t blen = sizeof(id) + strlen(ck_parent) + 1;
+	unsigned int i, n = 0;
+	char *path;
+
+	/* Start again now and then so a restore never has far to go */
+	if (ck_seq == CK_CHAIN) {
+		machine_save(snap_path);
+		return;
+	}
+	path = malloc(strlen(snap_path) + 12);
+	if (path == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	sprintf(path, "%s.%u", snap_path, ck_seq + 1);
+	s = snapshot_create(path);
+	if (s == NULL) {
+		free(path);
+		return;
+	}
+	machine_save_state(s, id);
+	base = snap_scratch(blen);
+	memcpy(base, &ck_id, sizeof(ck_id));
+	strcpy((char *)base + sizeof(ck_id), ck_parent);
+	snapshot_put(s, "BASE", base, blen);
+	snapshot_put(s, "DIRT", mem_dirty, sizeof(mem_dirty));
+	for (i = 0; i < sizeof(mem_dirty); i++)
+		n += mem_dirty[i];
+	pages = p = snap_scratch(n << MEM_PAGE_SHIFT);
+	for (i = 0; i < sizeof(mem_dirty); i++) {
+		if (mem_dirty[i]) {
+			memcpy(p, ramrom + (i << MEM_PAGE_SHIFT), 1 << MEM_PAGE_SHIFT);
+			p += 1 << MEM_PAGE_SHIFT;
+		}
+	}
+	snapshot_put(s, "PAGE", pages, n << MEM_PAGE_SHIFT);
+	/* If it failed the pages stay dirty and go in the next one */
+	if (snapshot_close(s)) {
+		free(path);
+		return;
+	}
+	ck_seq++;
+	ck_restart(path, id);
+	free(path);
+}
+
+/* Memory is the full snapshot at the bottom of a chain with the pages of
+   each incremental laid over it, oldest first */
+static void snap_load_mem(struct snapshot *s, const char *path)
+{
+	struct snapshot *bs;
+	const uint8_t *base, *dirt, *page;
+	const char *bpath;
+	uint64_t id, bid;
+	size_t n, blen;
+	unsigned int i, count = 0;
+
+	base = snapshot_find(s, "BASE", &blen);
+	if (base == NULL) {
+		if (snapshot_map(s, "MEM ", ramrom, RAMROM_SIZE))
+			snap_mismatch(path, "MEM ");
+		return;
+	}
+	if (blen <= sizeof(id) || base[blen - 1])
+		snap_mismatch(path, "BASE");
+	memcpy(&id, base, sizeof(id));
+	bpath = (const char *)base + sizeof(id);
+	bs = snapshot_open(bpath);
+	if (bs == NULL)
+		exit(1);
+	if (snapshot_get(bs, "SNID", &bid, sizeof(bid)) || bid != id) {
+		fprintf(stderr, "rc2014: snapshot '%s' is not the one '%s' follows.\n",
+			bpath, path);
+		exit(1);
+	}
+	snap_load_mem(bs, bpath);
+	snapshot_free(bs);
+
+	dirt = snapshot_find(s, "DIRT", &n);
+	if (dirt == NULL || n != sizeof(mem_dirty))
+		snap_mismatch(path, "DIRT");
+	for (i = 0; i < n; i++)
+		count += dirt[i];
+	page = snapshot_find(s, "PAGE", &n);
+	if (page == NULL || n != (size_t)count << MEM_PAGE_SHIFT)
+		snap_mismatch(path, "PAGE");
+	for (i = 0; i < sizeof(mem_dirty); i++) {
+		if (dirt[i]) {
+			memcpy(ramrom + (i << MEM_PAGE_SHIFT), page, 1 << MEM_PAGE_SHIFT);
+			page += 1 << MEM_PAGE_SHIFT;
+		}
+	}
+}
+
+static void machine_load(const char *path)
+{
+	struct snapshot *s = snapshot_open(path);
+	struct snap_config c, want;
+	struct snap_board b;
+	void *code = cpu_z80.code_cache;
+
+	if (s == NULL)
+		exit(1);
+	snap_get_config(&want);
+	snap_get(s, path, "CONF", &c, sizeof(c));
+	if (memcmp(&c, &want, sizeof(c)))
+		snap_mismatch(path, "CONF");
+	snap_get(s, path, "Z80 ", &cpu_z80, sizeof(cpu_z80));
+	/* The callbacks belong to this run not the one that saved */
+	cpu_z80.ioRead = io_read;
+	cpu_z80.ioWrite = io_write;
+	cpu_z80.memRead = mem_read;
+	cpu_z80.memWrite = mem_write;
+	cpu_z80.reti = reti_event;
+	cpu_z80.trace = z80_trace;
+	cpu_z80.profile = NULL;
+	cpu_z80.coverage = cov;
+	cpu_z80.codePage = mem_code_page;
+	cpu_z80.code_cache = code;
+	io_block_init();
+	snap_load_mem(s, path);
+	/* All of memory has just changed under any cached code */
+	Z80CodeFlush(&cpu_z80);
+	snap_get(s, path, "BORD", &b, sizeof(b));
+	snap_set_board(&b);
+	if (cpuboard == CPUBOARD_MICRO80 || cpuboard == CPUBOARD_TINYZ80)
+		snap_get(s, path, "Z84C", &z84c15, sizeof(z84c15));
+	if (acia)
+		SNAP_LOAD(s, path, "ACIA", acia_load, acia);
+	if (sio2)
+		snap_get(s, path, "SIO ", sio, sizeof(sio));
+	if (have_16x50)
+		SNAP_LOAD(s, path, "UART", uart16x50_load, uart);
+	snap_get(s, path, "CTC ", ctc, sizeof(ctc));
+	snap_get(s, path, "PIO ", pio, sizeof(pio));
+	irq_resync();
+	if (rtc)
+		SNAP_LOAD(s, path, "RTC ", rtc_load, rtc);
+	if (ide0)
+		SNAP_LOAD(s, path, "IDE ", ide_load, ide0);
+	if (ppide) {
+		snap_get(s, path, "PPIO", ppide->pioreg, sizeof(ppide->pioreg));
+		SNAP_LOAD(s, path, "PPID", ide_load, ppide->ide);
+	}
+	if (pvdisk)
+		snap_get(s, path, "PVD ", pvdisk->reg, sizeof(pvdisk->reg));
+	if (vdp)
+		SNAP_LOAD(s, path, "TMS ", tms9918a_load, vdp);
+	if (wiz)
+		SNAP_LOAD(s, path, "W51 ", w5100_load, wiz);
+	snapshot_free(s);
+}
+
+static void snap_signal(int sig)
+{
+	snap_request = 1;
+}
+
+/*
+ *	Opcode profile. -Q writes a report at exit and on SIGUSR2. The
+ *	counts are only kept when libz80 is built with PROFILE=1.
+ */
+
+static char *prof_path;
+
+static void prof_write(void)
+{
+	FILE *fp = fopen(prof_path, "w");
+	if (fp == NULL) {
+		perror(prof_path);
+		return;
+	}
+	z80prof_report(fp, prof->count, prof->tstates, prof->page);
+	if (fclose(fp))
+		perror(prof_path);
+}
+
+/* SIGUSR2 writes the profile and trace without stopping */
+static volatile sig_atomic_t diag_request;
+
+static void diag_signal(int sig)
+{
+	diag_request = 1;
+}
+
+static struct termios saved_term, term;
+
+static void cleanup(int sig)
+{
+	tcsetattr(0, TCSADRAIN, &saved_term);
+	emulator_done = 1;
+}
+
+static void exit_cleanup(void)
+{
+	tcsetattr(0, TCSADRAIN, &saved_term);
+}
+
+/*
+ *	Keep the emulation in step with the host clock. Each frame is 20ms of
+ *	emulated time. We sleep until the absolute deadline for the next frame
+ *	so that time spent emulating is not added on top of the delay. If the
+ *	host stalled we run frames back to back until we catch up, but if we
+ *	fall too far behind we resynchronize rather than run flat out for ages.
+ */
+
+#define FRAME_NSEC	20000000L
+#define FRAME_SLIP	(5 * FRAME_NSEC)
+
+static struct timespec next_frame;
+static uint64_t sleep_ns;		/* Host time spent waiting */
+static uint64_t resyncs;		/* Gave up catching up */
+static unsigned int speed = 1;		/* Multiple of real time */
+static volatile int paused;
+static uint8_t auto_turbo;		/* Pick fast or real time by frame */
+
+static int64_t timespec_diff(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+static void frame_sync_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &next_frame);
+}
+
+/* Sleep until the next frame but service the network the moment it has
+   something for us, rather than leaving it for the next frame */
+static void frame_wait_net(void)
+{
+	struct pollfd pfd[W5100_POLLFDS];
+	struct timespec now;
+	int64_t left;
+
+	while (!emulator_done) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = timespec_diff(&next_frame, &now);
+		/* poll only does milliseconds so finish off with a sleep */
+		if (left < 1000000L)
+			break;
+		w5100_pollfds(wiz, pfd);
+		if (poll(pfd, W5100_POLLFDS, left / 1000000L) > 0)
+			w5100_process(wiz);
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_frame, NULL) == EINTR && !emulator_done);
+}
+
+static void frame_sync(void)
+{
+	struct timespec now, woke;
+
+	next_frame.tv_nsec += FRAME_NSEC / speed;
+	if (next_frame.tv_nsec >= 1000000000L) {
+		next_frame.tv_nsec -= 1000000000L;
+		next_frame.tv_sec++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* Behind: run the next frame at once, or give up and resync */
+	if (timespec_diff(&now, &next_frame) >= 0) {
+		if (timespec_diff(&now, &next_frame) > FRAME_SLIP) {
+			next_frame = now;
+			resyncs++;
+		}
+		return;
+	}
+	if (have_wiznet)
+		frame_wait_net();
+	else
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_frame, NULL) == EINTR && !emulator_done);
+	clock_gettime(CLOCK_MONOTONIC, &woke);
+	sleep_ns += timespec_diff(&woke, &now);
+}
+
+/* Stopped from the control socket: keep the sockets and console served
+   until told to go again */
+static void pause_wait(void)
+{
+	struct timespec ts = { 0, FRAME_NSEC };
+
+	while (paused && !emulator_done) {
+		nanosleep(&ts, NULL);
+		if (have_wiznet)
+			w5100_process(wiz);
+		metrics_poll();
+		console_flush();
+	}
+	/* Carry on from now rather than racing to catch up */
+	frame_sync_init();
+}
+
+/* Change speed from the control socket. Leaving flat out or a pause
+   restarts the frame clock so the time away isn't made up */
+static void speed_set(int n)
+{
+	paused = n == METRICS_SPEED_PAUSE;
+	if (paused)
+		return;
+	auto_turbo = n == METRICS_SPEED_AUTO;
+	if (auto_turbo)
+		return;
+	if (n == METRICS_SPEED_MAX) {
+		fast = 1;
+		return;
+	}
+	if (fast)
+		frame_sync_init();
+	fast = 0;
+	speed = n;
+}
+
+/* In fast mode an idle guest would spin the host flat out. Instead block
+   for up to a frame waiting for console, serial or network input */
+static void idle_wait(void)
+{
+	struct pollfd pfd[1 + CHARDEV_POLLFDS + W5100_POLLFDS];
+	struct timespec before, after;
+	int n = 1 + CHARDEV_POLLFDS;
+
+	/* If there is input the guest is ignoring don't wait on it */
+	pfd[0].fd = -1;
+	pfd[0].events = POLLIN;
+	if (!(check_chario() & 1) && !console_eof())
+		pfd[0].fd = 0;
+	chardev_pollfds(pfd + 1);
+	if (have_wiznet) {
+		w5100_pollfds(wiz, pfd + n);
+		n += W5100_POLLFDS;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	n = poll(pfd, n, FRAME_NSEC / 1000000L);
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	sleep_ns += timespec_diff(&after, &before);
+	if (n == -1 && errno != EINTR) {
+		perror("poll");
+		exit(1);
+	}
+	/* Hand over whatever woke us now, not a frame later */
+	if (n > 0) {
+		chardev_poll();
+		if (have_wiznet)
+			w5100_process(wiz);
+	}
+}
+
+/*
+ *	Device timing. Each source of periodic work is an event on the
+ *	T-state clock so devices that are not fitted cost nothing.
+ */
+
+static struct event step_ev, serial_ev, fdc_ev, ui_ev, frame_ev, fdd_ev;
+static struct event rtc_ev;
+static unsigned int poll_tstates;
+
+/*
+ *	Batch runs. -B takes console input from a script and runs flat out
+ *	with no host waits, so a run depends only on its inputs. -E, -t and
+ *	-H end a run when the text is printed, after that many T-states or
+ *	when the CPU halts with interrupts off.
+ */
+
+#define WATCH_FORK	1
+#define WATCH_EXIT	2
+
+static uint8_t batch;
+static char *batch_exit;
+static uint64_t batch_tstates;
+static uint8_t batch_halt;
+static int exit_status;
+static struct timespec batch_start;
+
+/* Speed figures for bench/run.sh */
+static void batch_stats(void)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - batch_start.tv_sec +
+		(now.tv_nsec - batch_start.tv_nsec) / 1E9;
+	fprintf(stderr, "[batch: %llu T-states, %llu instructions, %.3f seconds]\n",
+		(unsigned long long)event_now(evq), cpu_z80.instructions, secs);
+}
+
+static void batch_check(void)
+{
+	if (batch_exit && console_seen(WATCH_EXIT))
+		emulator_done = 1;
+	else if (batch_halt && cpu_z80.halted && !cpu_z80.IFF1) {
+		fprintf(stderr, "[halted at %04X]\n", cpu_z80.PC);
+		emulator_done = 1;
+	} else if (batch_tstates && event_now(evq) >= batch_tstates) {
+		fprintf(stderr, "[T-state limit reached]\n");
+		exit_status = 2;
+		emulator_done = 1;
+	}
+}
+
+/*
+ *	Watchpoints. -l takes [r][w][x]addr[-end] and may be given more
+ *	than once; with no letters it is an execute breakpoint. A hit is
+ *	reported and ends the run, so a snapshot (-O) or trace ring (-x) is
+ *	written as at any other exit. The access itself still happens.
+ */
+
+static void watch_add(const char *spec)
+{
+	struct watch *w = &watch[watches];
+	unsigned long start, end;
+	unsigned int i;
+	char *p;
+
+	if (watches == WATCH_MAX) {
+		fprintf(stderr, "rc2014: too many watchpoints.\n");
+		exit(1);
+	}
+	w->how = 0;
+	for (; *spec && strchr("rwx", *spec); spec++)
+		w->how |= *spec == 'r' ? WATCH_READ : *spec == 'w' ? WATCH_WRITE : WATCH_EXEC;
+	if (w->how == 0)
+		w->how = WATCH_EXEC;
+	start = strtoul(spec, &p, 16);
+	end = start;
+	if (*p == '-')
+		end = strtoul(p + 1, &p, 16);
+	if (p == spec || *p || end < start || end > 0xFFFF) {
+		fprintf(stderr, "rc2014: bad watchpoint '%s'.\n", spec);
+		exit(1);
+	}
+	w->start = start;
+	w->end = end;
+	for (i = start >> MEM_PAGE_SHIFT; i <= end >> MEM_PAGE_SHIFT; i++)
+		watch_page[i] |= w->how;
+	watches++;
+}
+
+static void watch_hit(uint16_t addr, unsigned int how, uint8_t val)
+{
+	struct watch *w = watch;
+	unsigned int i;
+
+	/* Already stopping, so one report per instruction is plenty */
+	if (emulator_done)
+		return;
+	for (i = 0; i < watches; i++, w++) {
+		if (!(w->how & how) || addr < w->start || addr > w->end)
+			continue;
+		if (how == WATCH_EXEC)
+			fprintf(stderr, "[breakpoint at %04X]\n", addr);
+		else
+			fprintf(stderr, "[watchpoint: %c %04X = %02X at PC %04X]\n",
+				how == WATCH_WRITE ? 'W' : 'R', addr, val,
+				cpu_z80.M1PC);
+		exit_status = 3;
+		emulator_done = 1;
+		cpu_stop = 1;
+		return;
+	}
+}
+
+/*
+ *	-x keeps the last CPUTRACE_RECORDS instructions and writes them out
+ *	at exit, on SIGUSR2 and if we crash. tracedump decodes the file.
+ */
+
+static char *ring_path;
+
+static void ring_record(void)
+{
+	struct cputrace_rec *r = cputrace_next(ring);
+	uint16_t pc = cpu_z80.M1PC;
+	unsigned int i;
+
+	r->tstate = event_now(evq) + cpu_z80.tstates;
+	r->pc = pc;
+	r->len = 4;
+	for (i = 0; i < 4; i++)
+		r->op[i] = do_mem_read(pc + i, 1);
+	r->reg[0] = cpu_z80.R1.wr.AF;
+	r->reg[1] = cpu_z80.R1.wr.BC;
+	r->reg[2] = cpu_z80.R1.wr.DE;
+	r->reg[3] = cpu_z80.R1.wr.HL;
+	r->reg[4] = cpu_z80.R1.wr.IX;
+	r->reg[5] = cpu_z80.R1.wr.IY;
+	r->reg[6] = cpu_z80.R1.wr.SP;
+}
+
+/* A guest marker from the performance counters, as a record with no
+   opcode bytes holding the marker number */
+static void ring_mark(unsigned int n)
+{
+	struct cputrace_rec *r;
+
+	if (ring == NULL)
+		return;
+	r = cputrace_next(ring);
+	memset(r, 0, sizeof(*r));
+	r->tstate = event_now(evq) + cpu_z80.tstates;
+	r->pc = cpu_z80.M1PC;
+	r->op[0] = n;
+}
+
+/* For -6. Emulated time as the trace ring counts it */
+static uint64_t perf_tstates(void)
+{
+	return event_now(evq) + cpu_z80.tstates;
+}
+
+static uint64_t perf_insns(void)
+{
+	return cpu_z80.instructions;
+}
+
+static void ring_write(void)
+{
+	if (cputrace_dump(ring, ring_path))
+		perror(ring_path);
+}
+
+/* Write what we have and then die the way we would have */
+static void ring_crash(int sig)
+{
+	cputrace_dump(ring, ring_path);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/*
+ *	-G samples PC every so many T-states (10000 unless given after a
+ *	colon) and writes a report by function, plus the call chains in the
+ *	folded form flamegraph.pl reads to the same name with .folded added.
+ *	Both are written at exit and on SIGUSR2. -g loads a symbol map.
+ */
+
+static char *samp_path;
+static char *samp_map;
+static unsigned int samp_period = 10000;
+static struct z80samp *samp;
+static struct event samp_ev;
+
+static void samp_parse(char *spec)
+{
+	char *p = strchr(spec, ':');
+
+	if (p) {
+		*p++ = 0;
+		samp_period = atoi(p);
+		if (samp_period == 0) {
+			fprintf(stderr, "rc2014: bad sample interval '%s'.\n", p);
+			exit(1);
+		}
+	}
+	samp_path = spec;
+}
+
+static void samp_event(void *unused)
+{
+	z80samp_sample(samp, cpu_z80.PC, cpu_z80.R1.wr.SP);
+}
+
+static void samp_write(void)
+{
+	char *name = malloc(strlen(samp_path) + 8);
+	FILE *fp;
+
+	if (name == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	fp = fopen(samp_path, "w");
+	if (fp == NULL)
+		perror(samp_path);
+	else {
+		z80samp_report(samp, fp, samp_period);
+		if (fclose(fp))
+			perror(samp_path);
+	}
+	sprintf(name, "%s.folded", samp_path);
+	fp = fopen(name, "w");
+	if (fp == NULL)
+		perror(name);
+	else {
+		z80samp_folded(samp, fp);
+		if (fclose(fp))
+			perror(name);
+	}
+	free(name);
+}
+
+/* Devices that are clocked in small steps alongside the CPU */
+static void step_event(void *unused)
+{
+	if (copro)
+		z80copro_run(copro);
+}
+
+/* Host side console and device I/O */
+static void serial_event(void *unused)
+{
+	/* Script delays run on emulated time */
+	if (batch)
+		console_clock(event_now(evq) * 1000 / cpu_hz);
+	console_tick();
+	if (have_cpld_serial)
+		sbc64_cpld_timer();
+}
+
+/*
+ *	Each UART looks at the line once per character time at its
+ *	programmed rate and format, so input and output run at the real
+ *	baud rate. The console and host devices buffer so several bytes
+ *	can go each way between host polls. The ACIA and SIO have their
+ *	own 7.3728MHz clock and the 16x50 a 1.8432MHz one.
+ */
+
+struct serial_line {
+	struct event ev;
+	uint64_t due;
+};
+
+static struct serial_line acia_line, sio_line[2], uart_line;
+
+static void serial_next(struct serial_line *l, unsigned int clocks)
+{
+	uint64_t t = (uint64_t)clocks * tstate_steps / 365;
+
+	/* A part left at x1 after reset would otherwise look at the line
+	   every few clocks */
+	l->due += t > 100 ? t : 100;
+	event_schedule(evq, &l->ev, l->due);
+}
+
+static void acia_line_event(void *unused)
+{
+	acia_timer(acia);
+	serial_next(&acia_line, acia_char_clocks(acia));
+}
+
+static void sio_line_event(void *priv)
+{
+	struct serial_line *l = priv;
+	unsigned int ab = l - sio_line;
+
+	sio2_channel_timer(sio + ab, ab);
+	serial_next(l, sio2_char_clocks(sio + ab));
+}
+
+static void uart_line_event(void *unused)
+{
+	uart16x50_event(uart);
+	uart_irq_update();
+	serial_next(&uart_line, 4 * uart16x50_char_clocks(uart));
+}
+
+static void serial_line_init(struct serial_line *l, void (*fn)(void *))
+{
+	event_init(&l->ev, fn, l);
+	l->ev.group = HOSTPERF_SERIAL;
+	l->due = event_now(evq);
+	serial_next(l, 1);
+}
+
+static void fdc_event(void *unused)
+{
+	fdc_tick(fdc);
+}
+
+/* Write back held DSK tracks about once a second */
+static void fdd_flush_event(void *unused)
+{
+	fdd_flush(drive_a);
+	fdd_flush(drive_b);
+}
+
+/* We want to run UI events regularly it seems */
+static void ui_poll_event(void *unused)
+{
+	/* Keys may be queued so the keyboard needs to be up to date */
+	if (ps2)
+		ps2_sync(event_now(evq));
+	ui_event();
+	if (ps2)
+		ps2_arm();
+}
+
+/*
+ *	Fork server. With -X path[,frames=N][,jobs=N][,wait=text] the machine
+ *	boots until the text is printed, or N frames have run, and then serves
+ *	forked copies of itself from a unix socket at path. Each child gets
+ *	its own overlay on top of the disks so the base images and what the
+ *	boot wrote are shared by everyone. The first disk uses the overlay
+ *	path given, any others that path with .1 or .2 added.
+ */
+
+static char *fork_path;
+static char *fork_wait;
+static unsigned int fork_frames;
+static unsigned int fork_jobs;
+static int fork_disk[3];
+static unsigned int fork_ndisk;
+
+static void fork_parse(char *spec)
+{
+	char *p = strchr(spec, ',');
+
+	fork_path = spec;
+	while (p) {
+		*p++ = 0;
+		if (strncmp(p, "wait=", 5) == 0) {
+			/* Text runs to the end so it can hold commas */
+			fork_wait = p + 5;
+			return;
+		}
+		if (strncmp(p, "frames=", 7) == 0)
+			fork_frames = atoi(p + 7);
+		else if (strncmp(p, "jobs=", 5) == 0)
+			fork_jobs = atoi(p + 5);
+		else {
+			fprintf(stderr, "rc2014: unknown fork server option '%s'.\n", p);
+			exit(1);
+		}
+		p = strchr(p, ',');
+	}
+}
+
+static void fork_add_disk(int fd)
+{
+	if (fork_ndisk < 3)
+		fork_disk[fork_ndisk++] = fd;
+}
+
+static void fork_serve(void)
+{
+	char overlay[FORKSERVER_PATH];
+	char name[FORKSERVER_PATH + 4];
+	unsigned int i;
+
+	console_flush();
+	/* No reads may be in flight on the I/O thread across the fork */
+	if (ide0)
+		ide_sync(ide0);
+	if (ppide)
+		ide_sync(ppide->ide);
+	if (forkserver_run(fork_path, overlay, fork_jobs))
+		exit(1);
+	/* From here on we are a child with a new stdin and stdout */
+	fork_path = NULL;
+	metrics_close();
+	console_watch(WATCH_FORK, NULL);
+	console_reset();
+	if (fork_ndisk && *overlay == 0) {
+		fprintf(stderr, "rc2014: no overlay given for the disks.\n");
+		exit(1);
+	}
+	for (i = 0; i < fork_ndisk; i++) {
+		if (i)
+			snprintf(name, sizeof(name), "%s.%u", overlay, i);
+		else
+			strcpy(name, overlay);
+		if (cow_redirect(fork_disk[i], name) == -1) {
+			perror(name);
+			exit(1);
+		}
+	}
+	frame_sync_init();
+}
+
+/* Once an emulated second so the RTC registers are ready to shift out */
+static void rtc_event(void *unused)
+{
+	rtc_tick(rtc);
+}
+
+/* Emulated time for the RTC when it is not following the host clock */
+static uint64_t rtc_cycles(void)
+{
+	return event_now(evq);
+}
+
+/* The VDP beam stepped off the scheduler, TMS9918A_LINES per frame */
+static void tms_line_event(void *unused)
+{
+	if (tms9918a_raster_line(vdp, tms_line))
+		tms9918a_render(vdprend);
+	if (++tms_line == TMS9918A_LINES)
+		tms_line = 0;
+}
+
+/* What -h serves: the clock and then whatever I/O is fitted */
+/* Host hardware counts by subsystem, in HOSTPERF builds */
+static void metrics_hostperf(FILE *fp)
+{
+	char name[64], help[80];
+	int g, n;
+
+	for (g = 0; g < HOSTPERF_GROUPS; g++) {
+		if (hostperf_count(g, HOSTPERF_CYCLES) == 0)
+			continue;
+		for (n = 0; n < HOSTPERF_COUNTERS; n++) {
+			snprintf(name, sizeof(name), "hostperf_%s_%s_total",
+				hostperf_group_name(g), hostperf_counter_name(n));
+			snprintf(help, sizeof(help), "Host %s spent on %s",
+				hostperf_counter_name(n), hostperf_group_name(g));
+			metrics_counter(fp, name, help, hostperf_count(g, n));
+		}
+	}
+}
+
+static void metrics_report(FILE *fp)
 {
-	if ((addr & 0xFB) == 0x78) {	/* 78 or 7C */
-		if (cpuboard == CPUBOARD_PDOG512)
-			val &= 0x8F;
-		pick_bank = val;
+	struct metrics_clock c;
+
+	c.cycles = event_now(evq);
+	c.hz = cpu_hz;
+	c.sleep_ns = sleep_ns;
+	c.resyncs = resyncs;
+	c.irqs = cpu_z80.interrupts;
+	metrics_clock(fp, &c);
+	if (ide0)
+		metrics_counter(fp, "ide_sectors_total", "CF sectors read and written", ide_sectors(ide0));
+	if (ppide)
+		metrics_counter(fp, "ppide_sectors_total", "PPIDE sectors read and written", ide_sectors(ppide->ide));
+	if (hostfs)
+		metrics_counter(fp, "hostfs_bytes_total", "Host directory bytes read and written", hostfs->moved);
+	if (sdcard)
+		metrics_counter(fp, "sd_blocks_total", "SD card blocks read and written", sd_blocks(sdcard));
+	if (acia)
+		metrics_counter(fp, "acia_bytes_total", "6850 ACIA bytes received and sent", acia_bytes(acia));
+	if (sio2)
+		metrics_counter(fp, "sio_bytes_total", "SIO bytes received and sent", sio_bytes);
+	if (uart)
+		metrics_counter(fp, "uart_bytes_total", "16x50 UART bytes received and sent", uart16x50_bytes(uart));
+	if (have_wiznet)
+		metrics_counter(fp, "w5100_packets_total", "W5100 datagrams, frames and TCP reads and writes", nic_w5100_packets(wiz));
+	if (vdp)
+		metrics_counter(fp, "tms9918a_frames_total", "TMS9918A frames", tms9918a_frames(vdp));
+	metrics_hostperf(fp);
+}
+
+/*
+ *	Auto turbo. A frame that moved disk blocks, or that did nothing a
+ *	person could see, runs flat out. Serial or network traffic, reading
+ *	the clock or polling the video status puts it back to real time,
+ *	and it stays there a while so typing and games keep their pace.
+ */
+
+#define AUTO_HOLD	25		/* Frames of real time after activity */
+
+static uint64_t auto_disk;
+static uint64_t auto_io;
+static unsigned int auto_hold;
+
+static void auto_speed(void)
+{
+	uint64_t disk = auto_fdc;
+	uint64_t io = auto_rtc + auto_vdp;
+	uint8_t was = fast;
+
+	if (ide0)
+		disk += ide_sectors(ide0);
+	if (ppide)
+		disk += ide_sectors(ppide->ide);
+	if (sdcard)
+		disk += sd_blocks(sdcard);
+	if (acia)
+		io += acia_bytes(acia);
+	if (sio2)
+		io += sio_bytes;
+	if (uart)
+		io += uart16x50_bytes(uart);
+	if (have_wiznet)
+		io += nic_w5100_packets(wiz);
+
+	if (disk != auto_disk)
+		fast = 1;
+	else if (io != auto_io) {
+		fast = 0;
+		auto_hold = AUTO_HOLD;
+	} else if (auto_hold) {
+		fast = 0;
+		auto_hold--;
 	} else
-		io_write_2014(addr, val, 0);
+		fast = 1;
+	auto_disk = disk;
+	auto_io = io;
+	/* Pick up real time from here, not from when we went fast */
+	if (was && !fast)
+		frame_sync_init();
 }
 
+/* Frames are a 50th of cpu_hz, with the odd clocks carried over */
+static struct cpuclock frame_clock;
+static uint64_t frame_due;
 
-void io_write(int unused, uint16_t addr, uint8_t val)
+static void frame_arm(void)
 {
-	switch (cpuboard) {
-	case CPUBOARD_Z80:
-		io_write_2014(addr, val, 0);
-		break;
-	case CPUBOARD_SC108:
-		io_write_1(addr, val);
-		break;
-	case CPUBOARD_SC114:
-	case CPUBOARD_SC121:
-		io_write_2(addr, val);
-		break;
-	case CPUBOARD_Z80SBC64:
-	case CPUBOARD_ZRCC:
-		io_write_3(addr, val);
-		break;
-	case CPUBOARD_EASYZ80:
-		io_write_4(addr, val);
-		break;
-	case CPUBOARD_MICRO80:
-		io_write_micro80(addr, val);
-		break;
-	case CPUBOARD_TINYZ80:
-		io_write_5(addr, val);
-		break;
-	case CPUBOARD_PDOG128:
-	case CPUBOARD_PDOG512:
-		io_write_pdog(addr, val);
-		break;
-	default:
-		fprintf(stderr, "bad cpuboard\n");
-		exit(1);
-	}
+	frame_due += cpuclock_slice(&frame_clock);
+	event_schedule(evq, &frame_ev, frame_due);
 }
 
-uint8_t io_read(int unused, uint16_t addr)
+static void frame_event(void *unused)
 {
-	switch (cpuboard) {
-	case CPUBOARD_Z80:
-	case CPUBOARD_SC108:
-	case CPUBOARD_PDOG128:
-	case CPUBOARD_PDOG512:
-		return io_read_2014(addr);
-	case CPUBOARD_SC114:
-	case CPUBOARD_SC121:
-		return io_read_2(addr);
-	case CPUBOARD_Z80SBC64:
-	case CPUBOARD_ZRCC:
-		return io_read_3(addr);
-	case CPUBOARD_EASYZ80:
-		return io_read_4(addr);
-	case CPUBOARD_MICRO80:
-		return io_read_micro80(addr);
-	case CPUBOARD_TINYZ80:
-		return io_read_5(addr);
-	default:
-		fprintf(stderr, "bad cpuboard\n");
-		exit(1);
+	frame_arm();
+	if (is_z512 && (z512_control & 0x20)) {
+		if (z512_wdog <= 5) {
+			fprintf(stderr, "Watchdog reset.\n");
+			emulator_done = 1;
+			return;
+		}
+		z512_wdog -= 5;
+	}
+	if (ck_secs && ++ck_frames == ck_secs * 50) {
+		ck_frames = 0;
+		ck_request = 1;
 	}
+	/* TODO: coprocessor int to main if we implement it */
+
+	/* 50Hz which is near enough */
+	if (vdp && !tms_lines) {
+		hostperf_switch(HOSTPERF_VIDEO);
+		tms9918a_sync(vdp, event_now(evq));
+		if (tms9918a_visible(vdprend)) {
+			tms9918a_rasterize(vdp);
+			tms9918a_render(vdprend);
+		} else
+			tms9918a_vblank(vdp);
+		hostperf_switch(HOSTPERF_RUNNER);
+	}
+	if (have_wiznet) {
+		hostperf_switch(HOSTPERF_NET);
+		w5100_process(wiz);
+		hostperf_switch(HOSTPERF_RUNNER);
+	}
+	metrics_poll();
+	/* Partial lines and output from boards with no serial tick */
+	console_flush();
+	/* Between instructions so the CPU state is consistent */
+	if (snap_request) {
+		snap_request = 0;
+		machine_save(snap_path);
+	}
+	if (ck_request) {
+		ck_request = 0;
+		if (ck_parent)
+			machine_checkpoint();
+		else
+			machine_save(snap_path);
+	}
+	if (diag_request) {
+		diag_request = 0;
+		if (prof_path)
+			prof_write();
+		if (ring_path)
+			ring_write();
+		if (samp_path)
+			samp_write();
+		if (cov_path && coverage_write())
+			perror(cov_path);
+	}
+	/* Booted far enough to start serving */
+	if (fork_path && (fork_wait ? console_seen(WATCH_FORK) : fork_frames-- == 0))
+		fork_serve();
+	if (auto_turbo)
+		auto_speed();
+	/* Do 20ms of I/O and delays */
+	if (!fast)
+		frame_sync();
+	else if (!batch && cpu_idle() && !idle_output)
+		idle_wait();
+	idle_output = 0;
+	if (paused)
+		pause_wait();
 }
 
-static void poll_irq_event(void)
+static void irq_recalc(void)
 {
-	if (have_im2) {
-		if (acia)
-			acia_check_irq(acia);
-		uart_check_irq(&uart[0]);
-		if (!live_irq) {
-			if (!sio2_check_im2(sio))
-			        if (!sio2_check_im2(sio + 1))
-					ctc_check_im2();
+	/* If there is no pending Z80 vector IRQ but we think
+	   there now might be one we use the same logic as for
+	   reti */
+	if (!z80irq_live(irq) || !have_im2)
+		poll_irq_event();
+	/* Clear this after because reti_event may set the
+	   flags to indicate there is more happening. We will
+	   pick up the next state changes on the reti if so */
+	if (!(cpu_z80.IFF1|cpu_z80.IFF2))
+		int_recalc = 0;
+}
+
+/* Host devices for the serial ports, by name from -U */
+static const char *serial_names[] = { "acia", "sioa", "siob", "uart", NULL };
+static char *serial_spec[4];
+
+static void serial_option(char *arg)
+{
+	char *p = strchr(arg, '=');
+	unsigned int i;
+
+	if (p) {
+		*p++ = 0;
+		for (i = 0; serial_names[i]; i++) {
+			if (strcmp(arg, serial_names[i]) == 0) {
+				serial_spec[i] = p;
+				return;
+			}
 		}
-		/* TMS9918A no IM2 handling */
-	} else {
-		if (acia)
-			acia_check_irq(acia);
-		uart_check_irq(&uart[0]);
-		if (!sio2_check_im2(sio))
-		      sio2_check_im2(sio + 1);
-		ctc_check_im2();
-		if (vdp && tms9918a_irq_pending(vdp))
-			Z80INT(&cpu_z80, 0xFF);
 	}
+	fprintf(stderr, "rc2014: -U takes acia, sioa, siob or uart=device.\n");
+	exit(1);
 }
 
-static void reti_event(void)
+static struct chardev *serial_device(unsigned int n, int present)
 {
-	if (live_irq && (trace & TRACE_IRQ))
-		fprintf(stderr, "RETI\n");
-	if (have_im2) {
-		switch(live_irq) {
-		case IRQ_SIOA:
-			sio2_reti(sio);
-			break;
-		case IRQ_SIOB:
-			sio2_reti(sio + 1);
-			break;
-		case IRQ_CTC:
-		case IRQ_CTC + 1:
-		case IRQ_CTC + 2:
-		case IRQ_CTC + 3:
-			ctc_reti(live_irq - IRQ_CTC);
-			break;
-		}
-	} else {
-		/* If IM2 is not wired then all the things respond at the same
-		   time. I think they can also fight over the vector but ignore
-		   that */
-		if (sio2) {
-			sio2_reti(sio);
-			sio2_reti(sio + 1);
-		}
-		if (have_ctc || have_kio) {
-			ctc_reti(0);
-			ctc_reti(1);
-			ctc_reti(2);
-			ctc_reti(3);
-		}
+	if (serial_spec[n] == NULL)
+		return NULL;
+	if (!present) {
+		fprintf(stderr, "rc2014: no %s on this system.\n", serial_names[n]);
+		exit(1);
 	}
-	live_irq = 0;
-	poll_irq_event();
+	return chardev_create(serial_spec[n]);
 }
 
-static struct termios saved_term, term;
+static void usage(void)
+{
+	fprintf(stderr, "rc2014: [-a] [-A] [-b] [-c] [-D] [-f] [-0] [-2 MHz] [-3 clocks] [-4 hostdir] [-5 tracefilter] [-6] [-i idepath] [-I ppidepath] [-M] [-Y] [-K blocks] [-R] [-m mainboard] [-L snapshot] [-O snapshot] [-J seconds] [-y record:log|replay:log] [-l [rwx]addr[-end]] [-Q profile] [-G samples[:tstates]] [-g mapfile] [-x tracefile] [-q coverage] [-X forkserver] [-h metrics] [-B script] [-o output] [-E text] [-t tstates] [-H] [-r rompath] [-e rombank] [-s] [-T] [-v] [-V] [-w] [-n tapdev] [-W] [-j fdcpercent] [-N] [-U port=device] [-d debug]\n");
+	exit(EXIT_FAILURE);
+}
 
-static void cleanup(int sig)
+static void board_set(uint8_t board)
 {
-	tcsetattr(0, TCSADRAIN, &saved_term);
-	emulator_done = 1;
+#ifdef RC2014_BOARD
+	if (board != RC2014_BOARD) {
+		fprintf(stderr, "rc2014: this build only emulates the %s.\n", RC2014_BOARD_NAME);
+		exit(EXIT_FAILURE);
+	}
+#else
+	cpuboard = board;
+#endif
 }
 
-static void exit_cleanup(void)
+static void board_select(const char *name, int *rom, int *have_acia)
 {
-	tcsetattr(0, TCSADRAIN, &saved_term);
+	/* Default Z80 board */
+	if (strcmp(name, "z80") == 0)
+		board_set(CPUBOARD_Z80);
+	else if (strcmp(name, "sc108") == 0) {
+		switchrom = 0;
+		bank512 = 0;
+		board_set(CPUBOARD_SC108);
+	} else if (strcmp(name, "sc114") == 0) {
+		switchrom = 0;
+		bank512 = 0;
+		board_set(CPUBOARD_SC114);
+	} else if (strcmp(name, "z80sbc64") == 0) {
+		switchrom = 0;
+		bank512 = 0;
+		board_set(CPUBOARD_Z80SBC64);
+		bankreg[0] = 3;
+	} else if (strcmp(name, "z80mb64") == 0) {
+		switchrom = 0;
+		bank512 = 0;
+		board_set(CPUBOARD_Z80SBC64);
+		bankreg[0] = 3;
+		/* Triple RC2014 rate */
+		tstate_steps *= 3;
+	} else if (strcmp(name, "easyz80") == 0) {
+		bank512 = 1;
+		board_set(CPUBOARD_EASYZ80);
+		switchrom = 0;
+		*rom = 0;
+		*have_acia = 0;
+		have_ctc = 1;
+		sio2 = 1;
+		sio2_input = 1;
+		have_im2 = 1;
+		tstate_steps = 400;
+	} else if (strcmp(name, "sc121") == 0) {
+		switchrom = 0;
+		bank512 = 0;
+		board_set(CPUBOARD_SC121);
+		sio2 = 1;
+		sio2_input = 1;
+		have_ctc = 1;
+		*rom = 0;
+		*have_acia = 0;
+		have_im2 = 1;
+		/* FIXME: SC122 is four ports */
+	} else if (strcmp(name, "micro80") == 0) {
+		board_set(CPUBOARD_MICRO80);
+		have_ctc = 1;
+		sio2 = 1;
+		sio2_input = 1;
+		have_im2 = 1;
+		*have_acia = 0;
+		*rom = 1;
+		switchrom = 0;
+		tstate_steps = 800;	/* 16MHz */
+	} else if (strcmp(name, "zrcc") == 0) {
+		switchrom = 0;
+		bank512 = 0;
+		board_set(CPUBOARD_ZRCC);
+		bankreg[0] = 3;
+		/* 22MHz CPU */
+		tstate_steps *= 3;
+	} else if (strcmp(name, "tinyz80") == 0) {
+		bank512 = 1;
+		board_set(CPUBOARD_TINYZ80);
+		switchrom = 0;
+		*rom = 0;
+		*have_acia = 0;
+		have_ctc = 1;
+		sio2 = 1;
+		sio2_input = 1;
+		have_im2 = 1;
+		tstate_steps = 500;
+	} else if (strcmp(name, "pdog128") == 0) {
+		board_set(CPUBOARD_PDOG128);
+		switchrom = 0;
+		bank512 = 0;
+		romsize = 131072;
+		*rom = 1;
+	} else if (strcmp(name, "pdog512") == 0) {
+		board_set(CPUBOARD_PDOG512);
+		switchrom = 0;
+		bank512 = 0;
+		romsize = 524288;
+		*rom = 1;
+	} else {
+		fputs("rc2014: supported cpu types z80, easyz80, sc108, sc114, sc121, z80sbc64, z80mb64.\n",
+				stderr);
+		exit(EXIT_FAILURE);
+	}
 }
 
-static void usage(void)
+/* Startup takes a while with several devices. Show where it goes */
+static struct timespec start_ts;
+static uint64_t start_last;
+
+static void start_phase(const char *what)
 {
-	fprintf(stderr, "rc2014: [-a] [-A] [-b] [-c] [-f] [- idepath] [-R] [-m mainboard] [-r rompath] [-e rombank] [-s] [-w] [-d debug]\n");
-	exit(EXIT_FAILURE);
+	struct timespec ts;
+	uint64_t us;
+
+	if (!TRACE_ON(trace & TRACE_START))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	us = (ts.tv_sec - start_ts.tv_sec) * 1000000ULL +
+		(ts.tv_nsec - start_ts.tv_nsec) / 1000;
+	fprintf(stderr, "[start %-8s +%6lluus %7lluus]\n", what,
+		(unsigned long long)(us - start_last), (unsigned long long)us);
+	start_last = us;
 }
 
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
 	int opt;
 	int fd;
 	int rom = 1;
@@ -2706,11 +4876,23 @@ int main(int argc, char *argv[])
 	char *rompath = "rc2014.rom";
 	char *sdpath = NULL;
 	char *idepath = NULL;
+	int idemap = 0;
+	int ideasync = 0;
+	unsigned int cache_blocks = 0;
 	char *copro_rom;
 	int save = 0;
 	int have_acia = 0;
 	int indev;
 	char *patha = NULL, *pathb = NULL;
+	char *snap_load = NULL;
+	char *batch_script = NULL;
+	char *hostfs_path = NULL;
+	int want_perfctr = 0;
+	char *tfilt_spec = NULL;
+	unsigned int mask;
+	char *replay_spec = NULL;
+	char *outpath = NULL;
+	char *metrics_spec = NULL;
 
 #define INDEV_ACIA	1
 #define INDEV_SIO	2
@@ -2718,11 +4900,12 @@ int main(int argc, char *argv[])
 #define INDEV_16C550A	4
 #define INDEV_KIO	5
 
-	uint8_t *p = ramrom;
-	while (p < ramrom + sizeof(ramrom))
-		*p++= rand();
+#ifdef RC2014_BOARD
+	board_select(RC2014_BOARD_NAME, &rom, &have_acia);
+#endif
 
-	while ((opt = getopt(argc, argv, "19Aabcd:e:fF:i:I:km:pPr:sRS:Tuw8C:Zz")) != -1) {
+	clock_gettime(CLOCK_MONOTONIC, &start_ts);
+	while ((opt = getopt(argc, argv, "012:3:4:5:69AaB:bcDd:E:e:fF:g:G:h:Hi:I:j:J:kK:l:L:m:Mn:No:O:pPq:Q:r:sRS:t:TuU:vVwWx:8X:y:YC:Zz")) != -1) {
 		switch (opt) {
 		case 'a':
 			have_acia = 1;
@@ -2778,6 +4961,15 @@ int main(int argc, char *argv[])
 			ide = 2;
 			idepath = optarg;
 			break;
+		case 'M':
+			idemap = 1;
+			break;
+		case 'Y':
+			ideasync = 1;
+			break;
+		case 'K':
+			cache_blocks = atoi(optarg);
+			break;
 		case 'c':
 			have_ctc = 1;
 			break;
@@ -2790,96 +4982,11 @@ int main(int argc, char *argv[])
 			have_kio = 1;
 			break;
 		case 'm':
-			/* Default Z80 board */
-			if (strcmp(optarg, "z80") == 0)
-				cpuboard = CPUBOARD_Z80;
-			else if (strcmp(optarg, "sc108") == 0) {
-				switchrom = 0;
-				bank512 = 0;
-				cpuboard = CPUBOARD_SC108;
-			} else if (strcmp(optarg, "sc114") == 0) {
-				switchrom = 0;
-				bank512 = 0;
-				cpuboard = CPUBOARD_SC114;
-			} else if (strcmp(optarg, "z80sbc64") == 0) {
-				switchrom = 0;
-				bank512 = 0;
-				cpuboard = CPUBOARD_Z80SBC64;
-				bankreg[0] = 3;
-			} else if (strcmp(optarg, "z80mb64") == 0) {
-				switchrom = 0;
-				bank512 = 0;
-				cpuboard = CPUBOARD_Z80SBC64;
-				bankreg[0] = 3;
-				/* Triple RC2014 rate */
-				tstate_steps *= 3;
-			} else if (strcmp(optarg, "easyz80") == 0) {
-				bank512 = 1;
-				cpuboard = CPUBOARD_EASYZ80;
-				switchrom = 0;
-				rom = 0;
-				have_acia = 0;
-				have_ctc = 1;
-				sio2 = 1;
-				sio2_input = 1;
-				have_im2 = 1;
-				tstate_steps = 400;
-			} else if (strcmp(optarg, "sc121") == 0) {
-				switchrom = 0;
-				bank512 = 0;
-				cpuboard = CPUBOARD_SC121;
-				sio2 = 1;
-				sio2_input = 1;
-				have_ctc = 1;
-				rom = 0;
-				have_acia = 0;
-				have_im2 = 1;
-				/* FIXME: SC122 is four ports */
-			} else if (strcmp(optarg, "micro80") == 0) {
-				cpuboard = CPUBOARD_MICRO80;
-				have_ctc = 1;
-				sio2 = 1;
-				sio2_input = 1;
-				have_im2 = 1;
-				have_acia = 0;
-				rom = 1;
-				switchrom = 0;
-				tstate_steps = 800;	/* 16MHz */
-			} else if (strcmp(optarg, "zrcc") == 0) {
-				switchrom = 0;
-				bank512 = 0;
-				cpuboard = CPUBOARD_ZRCC;
-				bankreg[0] = 3;
-				/* 22MHz CPU */
-				tstate_steps *= 3;
-			} else if (strcmp(optarg, "tinyz80") == 0) {
-				bank512 = 1;
-				cpuboard = CPUBOARD_TINYZ80;
-				switchrom = 0;
-				rom = 0;
-				have_acia = 0;
-				have_ctc = 1;
-				sio2 = 1;
-				sio2_input = 1;
-				have_im2 = 1;
-				tstate_steps = 500;
-			} else if (strcmp(optarg, "pdog128") == 0) {
-				cpuboard = CPUBOARD_PDOG128;
-				switchrom = 0;
-				bank512 = 0;
-				romsize = 131072;
-				rom = 1;
-			} else if (strcmp(optarg, "pdog512") == 0) {
-				cpuboard = CPUBOARD_PDOG512;
-				switchrom = 0;
-				bank512 = 0;
-				romsize = 524288;
-				rom = 1;
-			} else {
-				fputs("rc2014: supported cpu types z80, easyz80, sc108, sc114, sc121, z80sbc64, z80mb64.\n",
-						stderr);
-				exit(EXIT_FAILURE);
-			}
+#ifdef RC2014_BOARD
+			if (strcmp(optarg, RC2014_BOARD_NAME) == 0)
+				break;
+#endif
+			board_select(optarg, &rom, &have_acia);
 			break;
 		case 'd':
 			trace = atoi(optarg);
@@ -2887,16 +4994,34 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case '0':
+			auto_turbo = 1;
+			break;
 		case 'R':
 			rtc = rtc_create();
 			break;
 		case 'w':
-			have_wiznet = 1;
+			/* Twice for the eight socket part */
+			have_wiznet++;
+			break;
+		case 'n':
+			wiz_tap = optarg;
+			if (!have_wiznet)
+				have_wiznet = 1;
 			break;
 		case 'C':
 			have_copro = 1;
 			copro_rom = optarg;
 			break;
+		case 'D':
+			dma = z80dma_create();
+			break;
+		case 'W':
+			fdd_hold = 1;
+			break;
+		case 'j':
+			fdc_timing = atoi(optarg);
+			break;
 		case 'F':
 			if (pathb) {
 				fprintf(stderr, "rc2014: too many floppy disks specified.\n");
@@ -2916,6 +5041,92 @@ int main(int argc, char *argv[])
 		case 'T':
 			have_tms = 1;
 			break;
+		case 'V':
+			have_tms = 1;
+			tms_timed = 1;
+			break;
+		case 'v':
+			have_tms = 1;
+			tms_lines = 1;
+			break;
+		case 'L':
+			snap_load = optarg;
+			break;
+		case 'O':
+			snap_path = optarg;
+			break;
+		case 'J':
+			ck_secs = atoi(optarg);
+			break;
+		case 'y':
+			replay_spec = optarg;
+			break;
+		case 'l':
+			watch_add(optarg);
+			break;
+		case 'Q':
+			prof_path = optarg;
+			break;
+		case 'x':
+			ring_path = optarg;
+			break;
+		case 'q':
+			cov_path = optarg;
+			break;
+		case 'G':
+			samp_parse(optarg);
+			break;
+		case 'g':
+			samp_map = optarg;
+			break;
+		case 'X':
+			fork_parse(optarg);
+			break;
+		case '2':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
+		case '4':
+			hostfs_path = optarg;
+			break;
+		case '5':
+			tfilt_spec = optarg;
+			break;
+		case '6':
+			want_perfctr = 1;
+			break;
+		case '3':
+			pvdisk_cost = atoi(optarg);
+			if (pvdisk_cost < 0) {
+				fprintf(stderr, "rc2014: -3 wants clocks per sector.\n");
+				exit(1);
+			}
+			break;
+		case 'U':
+			serial_option(optarg);
+			break;
+		case 'N':
+			serial_unthrottled = 1;
+			break;
+		case 'h':
+			metrics_spec = optarg;
+			break;
+		case 'B':
+			batch_script = optarg;
+			batch = 1;
+			fast = 1;
+			break;
+		case 'o':
+			outpath = optarg;
+			break;
+		case 'E':
+			batch_exit = optarg;
+			break;
+		case 't':
+			batch_tstates = strtoull(optarg, NULL, 0);
+			break;
+		case 'H':
+			batch_halt = 1;
+			break;
 		case '9':
 			if (amd9511 == NULL)
 				amd9511 = amd9511_create();
@@ -2926,6 +5137,31 @@ int main(int argc, char *argv[])
 	}
 	if (optind < argc)
 		usage();
+	if (tfilt_spec) {
+		mask = trace;
+		tfilt = tracefilt_create(tfilt_spec, trace_classes, &mask);
+		trace = mask;
+	}
+	trace_want = trace;
+	start_phase("options");
+	/* The board's own clock unless one was given */
+	if (cpu_hz)
+		tstate_steps = (cpu_hz + 10000) / 20000;
+	else
+		cpu_hz = tstate_steps * 20000UL;
+	if (ck_secs && snap_path == NULL) {
+		fprintf(stderr, "rc2014: checkpoints need a snapshot path (-O).\n");
+		exit(1);
+	}
+
+	ramrom = ram_alloc(RAMROM_SIZE);
+	/* A snapshot brings its own memory so don't touch every page, and
+	   the 512K ROM is mapped over the bottom half */
+	if (snap_load == NULL) {
+		uint32_t from = bank512 && ramrom_extent() > 524288 ? 524288 : 0;
+		ram_scramble(ramrom + from, ramrom_extent() - from);
+	}
+	start_phase("memory");
 
 	if (have_kio) {
 		sio2 = 1;
@@ -2944,12 +5180,20 @@ int main(int argc, char *argv[])
 			indev = INDEV_ACIA;
 		}
 	}
+	if (fork_path && idemap) {
+		fprintf(stderr, "rc2014: mapped IDE images can't be shared by a fork server.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fork_wait)
+		console_watch(WATCH_FORK, fork_wait);
+	if (batch_exit)
+		console_watch(WATCH_EXIT, batch_exit);
 	if (rom == 0 && bank512 == 0) {
 		fprintf(stderr, "rc2014: no ROM\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if (rom && cpuboard != CPUBOARD_Z80SBC64 && cpuboard != CPUBOARD_ZRCC) {
+	if (rom && !snap_load && cpuboard != CPUBOARD_Z80SBC64 && cpuboard != CPUBOARD_ZRCC) {
 		fd = open(rompath, O_RDONLY);
 		if (fd == -1) {
 			perror(rompath);
@@ -2963,7 +5207,7 @@ int main(int argc, char *argv[])
 			perror("lseek");
 			exit(1);
 		}
-		if (read(fd, ramrom, romsize) < 8192) {
+		if (ram_load(fd, ramrom, romsize) < 8192) {
 			fprintf(stderr, "rc2014: short rom '%s'.\n", rompath);
 			exit(EXIT_FAILURE);
 		}
@@ -2984,7 +5228,7 @@ int main(int argc, char *argv[])
 
 	   Mark states read only with chmod and it won't save back */
 
-	if (cpuboard == CPUBOARD_Z80SBC64) {
+	if (cpuboard == CPUBOARD_Z80SBC64 && !snap_load) {
 		int len;
 		save = 1;
 		fd = open(rompath, O_RDWR);
@@ -2998,7 +5242,7 @@ int main(int argc, char *argv[])
 		}
 		/* Could be a short bank 3 save for bootstrapping or a full
 		   save from the emulator exit */
-		len = read(fd, ramrom, 4 * 0x8000);
+		len = ram_load(fd, ramrom, 4 * 0x8000);
 		if (len < 4 * 0x8000) {
 			if (len < 255) {
 				fprintf(stderr, "rc2014:short ram '%s'.\n", rompath);
@@ -3012,30 +5256,45 @@ int main(int argc, char *argv[])
 	if (cpuboard == CPUBOARD_MICRO80 || cpuboard == CPUBOARD_TINYZ80)
 		z84c15_init();
 
-	if (bank512) {
+	if (bank512 && !snap_load) {
 		fd = open(rompath, O_RDONLY);
 		if (fd == -1) {
 			perror(rompath);
 			exit(EXIT_FAILURE);
 		}
-		if (read(fd, ramrom, 524288) != 524288) {
+		if (ram_load(fd, ramrom, 524288) != 524288) {
 			fprintf(stderr, "rc2014: banked rom image should be 512K.\n");
 			exit(EXIT_FAILURE);
 		}
 		bankenable = 1;
 		close(fd);
 	}
+	start_phase("rom");
+
+	/* Before any disk is attached. Cached writes only reach the disk
+	   on a clean exit so make sure the usual signals give us one */
+	if (cache_blocks)
+		blkcache_init(cache_blocks);
+	if (cache_blocks || fdd_hold) {
+		signal(SIGINT, cleanup);
+		signal(SIGTERM, cleanup);
+	}
 
 	if (ide == 1 ) {
 		ide0 = ide_allocate("cf");
 		if (ide0) {
-			int ide_fd = open(idepath, O_RDWR);
+			int ide_fd = cow_open(idepath, O_RDWR);
 			if (ide_fd == -1) {
 				perror(idepath);
 				ide = 0;
 			}
 			if (ide_attach(ide0, 0, ide_fd) == 0) {
 				ide = 1;
+				fork_add_disk(ide_fd);
+				if (idemap)
+					ide_map(ide0, 0);
+				if (ideasync)
+					ide_set_async(ide0, 1);
 				ide_reset_begin(ide0);
 			}
 		} else
@@ -3045,15 +5304,35 @@ int main(int argc, char *argv[])
 	/* FIXME: merge IDE handling once cf is a driver */
 	if (ide == 2) {
 		ppide = ppide_create("ppide");
-		int ide_fd = open(idepath, O_RDWR);
+		int ide_fd = cow_open(idepath, O_RDWR);
 		if (ide_fd == -1) {
 			perror(idepath);
 			ide = 0;
-		} else
-			ppide_attach(ppide, 0, ide_fd);
-		if (trace & TRACE_PPIDE)
+		} else if (ppide_attach(ppide, 0, ide_fd) == 0) {
+			fork_add_disk(ide_fd);
+			if (idemap)
+				ide_map(ppide->ide, 0);
+			if (ideasync)
+				ide_set_async(ppide->ide, 1);
+		}
+		if (TRACE_ON(trace & TRACE_PPIDE))
 			ppide_trace(ppide, 1);
 	}
+	if (pvdisk_cost >= 0) {
+		struct ide_controller *c = ide == 1 ? ide0 : ide == 2 ? ppide->ide : NULL;
+		if (c == NULL || ide_capacity(c, 0) == 0) {
+			fprintf(stderr, "rc2014: the paravirtual disk needs a disk from -i or -I.\n");
+			exit(1);
+		}
+		pvdisk = pvdisk_create(c, pvdisk_cost, mem_read, mem_write);
+		if (TRACE_ON(trace & TRACE_IDE))
+			pvdisk_trace(pvdisk, 1);
+	}
+	if (hostfs_path) {
+		hostfs = hostfs_create(hostfs_path, mem_read, mem_write);
+		if (TRACE_ON(trace & TRACE_IO))
+			hostfs_trace(hostfs, 1);
+	}
 	/* SD mapping */
 	if (cpuboard == CPUBOARD_MICRO80) {
 		sd_clock = 0x04;
@@ -3063,23 +5342,27 @@ int main(int argc, char *argv[])
 	}
 	if (sdpath) {
 		sdcard = sd_create("sd0");
-		fd = open(sdpath, O_RDWR);
+		fd = cow_open(sdpath, O_RDWR);
 		if (fd == -1) {
 			perror(sdpath);
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		fork_add_disk(fd);
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
+	start_phase("disks");
 
 	if (have_acia) {
 		acia = acia_create();
-		if (trace & TRACE_ACIA)
+		acia_unthrottle(acia, serial_unthrottled);
+		if (TRACE_ON(trace & TRACE_ACIA))
 			acia_trace(acia, 1);
 	}
-	if (rtc && (trace & TRACE_RTC))
+	if (rtc && TRACE_ON(trace & TRACE_RTC))
 		rtc_trace(rtc, 1);
+	irq_init();
 	if (sio2)
 		sio_reset();
 	if (have_ctc)
@@ -3091,26 +5374,42 @@ int main(int argc, char *argv[])
 		ctc_init();
 		pio_reset();
 	}
-	if (have_16x50)
-		uart_init(&uart[0], indev == INDEV_16C550A ? 1: 0);
+	if (have_16x50) {
+		uart = uart16x50_create();
+		uart16x50_trace(uart, TRACE_ON(trace & TRACE_UART));
+		uart16x50_set_input(uart, indev == INDEV_16C550A);
+		uart16x50_unthrottle(uart, serial_unthrottled);
+	}
+	if (serial_spec[0])
+		acia_attach(acia, serial_device(0, acia != NULL));
+	sio_dev[0] = serial_device(1, sio2);
+	sio_dev[1] = serial_device(2, sio2);
+	if (serial_spec[3])
+		uart16x50_attach(uart, serial_device(3, have_16x50));
 	if (have_tms) {
 		vdp = tms9918a_create();
-		tms9918a_trace(vdp, !!(trace & TRACE_TMS9918A));
+		tms9918a_trace(vdp, !!TRACE_ON(trace & TRACE_TMS9918A));
 		vdprend = tms9918a_renderer_create(vdp);
+		if (tms_timed)
+			tms9918a_set_timing(vdp, tstate_steps * 20);
 	}
 	if (have_ps2) {
 		ps2 = ps2_create(7);
-		ps2_trace(ps2, trace & TRACE_PS2);
+		ps2_trace(ps2, TRACE_ON(trace & TRACE_PS2));
 	}
 
 	if (have_wiznet) {
-		wiz = nic_w5100_alloc();
+		wiz = nic_w5100_alloc_sockets(have_wiznet > 1 ? 8 : 4);
 		nic_w5100_reset(wiz);
+		if (wiz_tap)
+			nic_w5100_set_tap(wiz, wiz_tap);
 	}
 
 	fdc = fdc_new();
 
 	lib765_register_error_function(fdc_log);
+	/* Disk paths may be base:delta overlays */
+	fdd_setopen(cow_fopen);
 
 	if (patha) {
 		drive_a = fd_newdsk();
@@ -3118,6 +5417,7 @@ int main(int argc, char *argv[])
 		fd_setheads(drive_a, 2);
 		fd_setcyls(drive_a, 80);
 		fdd_setfilename(drive_a, patha);
+		fdd_setwriteback(drive_a, fdd_hold);
 	} else
 		drive_a = fd_new();
 
@@ -3127,11 +5427,15 @@ int main(int argc, char *argv[])
 		fd_setheads(drive_a, 2);
 		fd_setcyls(drive_a, 80);
 		fdd_setfilename(drive_a, pathb);
+		fdd_setwriteback(drive_a, fdd_hold);
 	} else
 		drive_b = fd_new();
 
 	fdc_reset(fdc);
 	fdc_setisr(fdc, NULL);
+	fdc_set_timing(fdc, fdc_timing);
+	event_init(&fdc_time_ev, fdc_time_event, NULL);
+	fdc_time_ev.group = HOSTPERF_DISK;
 
 	fdc_setdrive(fdc, 0, drive_a);
 	fdc_setdrive(fdc, 1, drive_b);
@@ -3144,7 +5448,7 @@ int main(int argc, char *argv[])
 			perror(copro_rom);
 			exit(1);
 		}
-		if (read(eprom_fd, z80copro_eprom(copro), 32768) != 32768) {
+		if (read(eprom_fd, z80copro_eprom(copro), COPRO_EPROM) != COPRO_EPROM) {
 			fprintf(stderr, "%s: should be 32K.\n", copro_rom);
 			exit(1);
 		}
@@ -3154,6 +5458,8 @@ int main(int argc, char *argv[])
 		z80copro_trace(copro, (trace >> 17) & 3);
 	}
 
+	start_phase("devices");
+
 	switch(indev) {
 	case INDEV_ACIA:
 		acia_set_input(acia, 1);
@@ -3171,11 +5477,6 @@ int main(int argc, char *argv[])
 
 	pio_reset();
 
-	/* 2.5ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 20000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -3191,98 +5492,204 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
+	console_init();
+	if (batch_script)
+		console_script(batch_script);
+	if (outpath) {
+		fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd == -1 || dup2(fd, 1) == -1) {
+			perror(outpath);
+			exit(1);
+		}
+		close(fd);
+	}
+	start_phase("console");
+
 	Z80RESET(&cpu_z80);
 	cpu_z80.ioRead = io_read;
 	cpu_z80.ioWrite = io_write;
 	cpu_z80.memRead = mem_read;
 	cpu_z80.memWrite = mem_write;
+	cpu_z80.reti = reti_event;
 	cpu_z80.trace = z80_trace;
-
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	/* We run 7372000 t-states per second */
-	/* We run 365 cycles per I/O check, do that 50 times then poll the
-	   slow stuff and nap for 20ms to get 50Hz on the TMS99xx */
-	while (!emulator_done) {
-		int i;
-		/* 36400 T states for base RC2014 - varies for others */
-		for (i = 0; i < 50; i++) {
-			int j;
-			for (j = 0; j < 100; j++) {
-				Z80ExecuteTStates(&cpu_z80, (tstate_steps + 5)/ 10);
-				if (copro)
-					z80copro_run(copro);
-				if (ps2)
-					ps2_event(ps2, (tstate_steps + 5) / 10);
-			}
-			if (acia)
-				acia_timer(acia);
-			if (sio2)
-				sio2_timer();
-			if (have_16x50)
-				uart_event(&uart[0]);
-			if (have_cpld_serial)
-				sbc64_cpld_timer();
-			if (have_ctc || have_kio) {
-				if (cpuboard != CPUBOARD_MICRO80)
-					ctc_tick(tstate_steps);
-				else	/* Micro80 it's not off the CPU clock */
-					ctc_tick(184);
-			}
-			if (cpuboard == CPUBOARD_EASYZ80 || cpuboard == CPUBOARD_TINYZ80) {
-				/* Feed the uart clock into the CTC */
-				int c;
-				/* 10Mhz so calculate for 500 tstates.
-				   CTC 2 runs at half uart clock */
-				for (c = 0; c < 46; c++) {
-					ctc_receive_pulse(0);
-					ctc_receive_pulse(1);
-					ctc_receive_pulse(2);
-					ctc_receive_pulse(0);
-					ctc_receive_pulse(1);
-				}
-			}
-			fdc_tick(fdc);
-			/* We want to run UI events regularly it seems */
-			ui_event();
+	cpu_z80.codePage = mem_code_page;
+
+	if (snap_load)
+		machine_load(snap_load);
+	/* Save on request as well as at the end */
+	if (snap_path)
+		signal(SIGUSR1, snap_signal);
+	if (prof_path) {
+		prof = calloc(1, sizeof(Z80Profile));
+		if (prof == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		cpu_z80.profile = prof;
+	}
+	if (ring_path) {
+		ring = cputrace_create(CPUTRACE_Z80, CPUTRACE_RECORDS);
+		signal(SIGSEGV, ring_crash);
+		signal(SIGBUS, ring_crash);
+		signal(SIGFPE, ring_crash);
+		signal(SIGABRT, ring_crash);
+	}
+	/* Logical addresses, as the banking differs board by board */
+	if (metrics_spec)
+		metrics_listen(metrics_spec, "rc2014", metrics_report, speed_set);
+	if (cov_path) {
+		cov = coverage_create(0x10000, cov_path);
+		cpu_z80.coverage = cov;
+	}
+	if (samp_path) {
+		samp = z80samp_create(z80dis_byte_quiet);
+		if (samp_map && z80samp_load_map(samp, samp_map)) {
+			perror(samp_map);
+			exit(1);
 		}
+	}
+	if (prof_path || ring_path || samp_path || cov_path)
+		signal(SIGUSR2, diag_signal);
+
+	if (want_perfctr)
+		perfctr = perfctr_create(perf_tstates, perf_insns, ring_mark);
+	mem_remap();
+	io_map_init();
+	io_block_init();
+
+	/* We run cpu_hz t-states per second */
+	/* The CPU runs up to the next device event. The serial, CTC, FDC and
+	   UI polls happen every 10 * tstate_steps clocks and every 50th of a
+	   second of CPU clock we do the slow stuff and wait for the next 20ms
+	   frame to get 50Hz on the TMS99xx */
+	evq = event_queue_create();
+	if (replay_spec) {
+		replay_open(replay_spec);
+		replay_clock(rtc_cycles);
+	}
+	/* The APU runs at 3.6864MHz, half the standard clock */
+	if (amd9511)
+		amd9511_set_clock(amd9511, 2 * tstate_steps, 365);
+	poll_tstates = 100 * ((tstate_steps + 5) / 10);
+
+	if (copro) {
+		event_init(&step_ev, step_event, NULL);
+		event_periodic(evq, &step_ev, (tstate_steps + 5) / 10);
+	}
+	if (ps2) {
+		ps2_step = (tstate_steps + 5) / 10;
+		event_init(&ps2_ev, ps2_step_event, NULL);
+		ps2_ev.group = HOSTPERF_SERIAL;
+		ps2_arm();
+	}
+	if (acia || sio2 || have_16x50 || have_cpld_serial) {
+		event_init(&serial_ev, serial_event, NULL);
+		serial_ev.group = HOSTPERF_SERIAL;
+		event_periodic(evq, &serial_ev, poll_tstates);
+	}
+	if (acia)
+		serial_line_init(&acia_line, acia_line_event);
+	if (sio2) {
+		serial_line_init(&sio_line[0], sio_line_event);
+		serial_line_init(&sio_line[1], sio_line_event);
+	}
+	if (have_16x50)
+		serial_line_init(&uart_line, uart_line_event);
+	if (have_ctc || have_kio) {
+		/* Micro80 it's not off the CPU clock */
+		ctc_clocks = cpuboard == CPUBOARD_MICRO80 ? 184 : tstate_steps;
+		ctc_period = poll_tstates;
+		event_init(&ctc_ev, ctc_event, NULL);
+		ctc_ev.group = HOSTPERF_TIMER;
+		ctc_arm();
+	}
+	event_init(&fdc_ev, fdc_event, NULL);
+	fdc_ev.group = HOSTPERF_DISK;
+	event_periodic(evq, &fdc_ev, poll_tstates);
+	if (fdd_hold) {
+		event_init(&fdd_ev, fdd_flush_event, NULL);
+		fdd_ev.group = HOSTPERF_DISK;
+		event_periodic(evq, &fdd_ev, 2500 * poll_tstates);
+	}
+	event_init(&ui_ev, ui_poll_event, NULL);
+	ui_ev.group = HOSTPERF_VIDEO;
+	event_periodic(evq, &ui_ev, poll_tstates);
+	event_init(&frame_ev, frame_event, NULL);
+	cpuclock_init(&frame_clock, cpu_hz, 50);
+	frame_arm();
+	if (rtc) {
+		/* Batch runs want the same answers every time, and -f wants
+		   the guest clock to keep up with the guest */
+		vclock_set_source(rtc_cycles, cpu_hz,
+			batch ? VCLOCK_VIRTUAL : fast ? VCLOCK_ANCHORED : VCLOCK_WALL);
+		event_init(&rtc_ev, rtc_event, NULL);
+		rtc_ev.group = HOSTPERF_TIMER;
+		event_periodic(evq, &rtc_ev, cpu_hz);
+	}
+	if (vdp && tms_lines && !tms_timed) {
+		event_init(&tms_line_ev, tms_line_event, NULL);
+		tms_line_ev.group = HOSTPERF_VIDEO;
+		event_periodic(evq, &tms_line_ev, cpu_hz / 50 / TMS9918A_LINES);
+	} else
+		tms_lines = 0;
+	if (samp) {
+		event_init(&samp_ev, samp_event, NULL);
+		event_periodic(evq, &samp_ev, samp_period);
+	}
 
-		if (is_z512 && (z512_control & 0x20)) {
-			if (z512_wdog <= 5) {
-				fprintf(stderr, "Watchdog reset.\n");
-				emulator_done = 1;
-				break;
+	/* A device raising an interrupt ends the slice early so the IRQ
+	   is seen at the next instruction rather than the next event */
+	frame_sync_init();
+	hostperf_open();
+	start_phase("ready");
+	clock_gettime(CLOCK_MONOTONIC, &batch_start);
+	while (!emulator_done) {
+		cpu_stop = 0;
+		if (dma && z80dma_active(dma)) {
+			/* The DMA takes the bus first, the CPU gets the rest */
+			unsigned int budget = event_budget(evq);
+			unsigned int spare = z80_dma_run(dma, budget);
+			unsigned int ran = 0;
+
+			if (spare) {
+				hostperf_switch(HOSTPERF_CPU);
+				ran = Z80ExecuteTStatesStop(&cpu_z80, spare, &cpu_stop);
+				hostperf_switch(HOSTPERF_RUNNER);
 			}
-			z512_wdog -= 5;
-		}
-		/* TODO: coprocessor int to main if we implement it */
+			event_advance(evq, budget - spare + ran);
+		} else if (cpu_idle()) {
+			/* Skip the wait. Leave the poll detector primed so the
+			   guest gets one look at the device after each event */
+			event_advance(evq, event_budget(evq));
+			if (!cpu_z80.halted)
+				idle_polls = IDLE_POLLS - 1;
+		} else {
+			unsigned int ran;
 
-		/* 50Hz which is near enough */
-		if (vdp) {
-			tms9918a_rasterize(vdp);
-			tms9918a_render(vdprend);
-		}
-		if (have_wiznet)
-			w5100_process(wiz);
-		/* Do 20ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
-		if (int_recalc) {
-			/* If there is no pending Z80 vector IRQ but we think
-			   there now might be one we use the same logic as for
-			   reti */
-			if (!live_irq || !have_im2)
-				poll_irq_event();
-			/* Clear this after because reti_event may set the
-			   flags to indicate there is more happening. We will
-			   pick up the next state changes on the reti if so */
-			if (!(cpu_z80.IFF1|cpu_z80.IFF2))
-				int_recalc = 0;
+			hostperf_switch(HOSTPERF_CPU);
+			ran = Z80ExecuteTStatesStop(&cpu_z80, event_budget(evq), &cpu_stop);
+			hostperf_switch(HOSTPERF_RUNNER);
+			event_advance(evq, ran);
 		}
+		if (int_recalc)
+			irq_recalc();
+		batch_check();
 	}
+
+	if (batch)
+		batch_stats();
+	if (snap_path)
+		machine_save(snap_path);
+	if (prof_path)
+		prof_write();
+	if (ring_path)
+		ring_write();
+	if (samp_path)
+		samp_write();
+
+	hostperf_report(stderr, event_now(evq));
+	hostperf_close();
+
 	if (cpuboard == 3 && save) {
 		lseek(fd, 0L, SEEK_SET);
 		if (write(fd, ramrom, 0x8000 * 4) != 0x8000 * 4) {
@@ -3291,10 +5698,31 @@ int main(int argc, char *argv[])
 		}
 		close(fd);
 	}
+	/* Also flushes any mapped disk images */
+	if (ide0)
+		ide_free(ide0);
+	if (ppide)
+		ppide_free(ppide);
+	if (pvdisk)
+		pvdisk_free(pvdisk);
+	if (hostfs)
+		hostfs_free(hostfs);
+	if (perfctr)
+		perfctr_free(perfctr);
+	if (tfilt)
+		tracefilt_free(tfilt);
+	if (sdcard)
+		sd_free(sdcard);
+	if (cache_blocks) {
+		struct blkcache_stats bs;
+		blkcache_stats(&bs);
+		fprintf(stderr, "blkcache: %lu hits, %lu misses, %lu write backs.\n",
+			bs.hits, bs.misses, bs.writebacks);
+	}
 	fd_eject(drive_a);
 	fd_eject(drive_b);
 	fdc_destroy(&fdc);
 	fd_destroy(&drive_a);
 	fd_destroy(&drive_b);
-	exit(0);
+	exit(exit_status);
 }
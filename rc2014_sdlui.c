@@ -8,6 +8,7 @@
 #include "system.h"
 #include "zxkey.h"
 #include "ps2.h"
+#include "sdl2_texture.h"
 
 extern struct zxkey *zxkey;
 extern struct ps2 *ps2;
@@ -41,7 +42,7 @@ static void make_ps2_code(SDL_Event *ev)
 void ui_event(void)
 {
 	SDL_Event ev;
-	while (SDL_PollEvent(&ev)) {
+	while (sdltex_poll_event(&ev)) {
 		switch(ev.type) {
 		case SDL_QUIT:
 			emulator_done = 1;
@@ -0,0 +1,213 @@
+/*
+ *	Input record and replay
+ *
+ *	The log is "RCRL" and a version byte, then one record per input: the
+ *	cycles since the record before, the source and the length as base
+ *	128 varints, then the data. Records are only ever appended and each
+ *	one is flushed as it is written, so recording can be left on and a
+ *	log cut short by a crash is good up to its last whole record.
+ *
+ *	Inputs that turn up on their own, such as console bytes, are handed
+ *	out when the replay reaches the cycle they came at. Inputs that are
+ *	the answer to a question, such as the result of a socket call, must
+ *	be the next thing in the log or the replay has gone wrong.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+
+#define REPLAY_MAGIC	"RCRL"
+#define REPLAY_VERSION	1
+
+static int recording;
+static int playing;
+static FILE *log_fp;
+static const char *log_path;
+static uint64_t (*clock_source)(void);
+static uint64_t last_cycles;
+
+/* The record replay has read ahead */
+static int next_valid;
+static uint64_t next_cycles;
+static unsigned int next_src;
+static size_t next_len;
+static uint8_t *next_data;
+static size_t next_size;
+
+static uint64_t replay_now(void)
+{
+	return clock_source ? clock_source() : 0;
+}
+
+static void put_varint(uint64_t v)
+{
+	uint8_t buf[10];
+	unsigned int n = 0;
+
+	do {
+		buf[n] = v & 0x7F;
+		v >>= 7;
+		if (v)
+			buf[n] |= 0x80;
+		n++;
+	} while (v);
+	fwrite(buf, n, 1, log_fp);
+}
+
+static int get_varint(uint64_t *v)
+{
+	unsigned int shift = 0;
+	int c;
+
+	*v = 0;
+	do {
+		c = getc(log_fp);
+		if (c == EOF || shift > 63)
+			return -1;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+/* Read ahead the next record. The end of the log, or a record cut off
+   part way, means no more input */
+static void replay_read(void)
+{
+	uint64_t delta, src, len;
+
+	next_valid = 0;
+	if (log_fp == NULL)
+		return;
+	if (get_varint(&delta) || get_varint(&src) || get_varint(&len))
+		goto done;
+	if (len > next_size) {
+		next_data = realloc(next_data, len);
+		if (next_data == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		next_size = len;
+	}
+	if (len && fread(next_data, len, 1, log_fp) != 1)
+		goto done;
+	next_cycles += delta;
+	next_src = src;
+	next_len = len;
+	next_valid = 1;
+	return;
+done:
+	fclose(log_fp);
+	log_fp = NULL;
+}
+
+/* "record:path" or "replay:path" */
+void replay_open(const char *spec)
+{
+	char magic[5];
+	const char *p = strchr(spec, ':');
+
+	if (p == NULL || p[1] == 0) {
+		fprintf(stderr, "replay: use record:file or replay:file.\n");
+		exit(1);
+	}
+	log_path = p + 1;
+	if (strncmp(spec, "record", p - spec) == 0 && p - spec == 6) {
+		log_fp = fopen(log_path, "w");
+		if (log_fp == NULL) {
+			perror(log_path);
+			exit(1);
+		}
+		fwrite(REPLAY_MAGIC, 4, 1, log_fp);
+		putc(REPLAY_VERSION, log_fp);
+		fflush(log_fp);
+		recording = 1;
+	} else if (strncmp(spec, "replay", p - spec) == 0 && p - spec == 6) {
+		log_fp = fopen(log_path, "r");
+		if (log_fp == NULL) {
+			perror(log_path);
+			exit(1);
+		}
+		if (fread(magic, 5, 1, log_fp) != 1 ||
+		    memcmp(magic, REPLAY_MAGIC, 4)) {
+			fprintf(stderr, "%s: not an input log.\n", log_path);
+			exit(1);
+		}
+		if (magic[4] != REPLAY_VERSION) {
+			fprintf(stderr, "%s: input log version %u, wanted %u.\n",
+				log_path, (unsigned int)magic[4], REPLAY_VERSION);
+			exit(1);
+		}
+		playing = 1;
+		replay_read();
+	} else {
+		fprintf(stderr, "replay: use record:file or replay:file.\n");
+		exit(1);
+	}
+}
+
+/* The emulated cycle count the log is stamped with */
+void replay_clock(uint64_t (*cycles)(void))
+{
+	clock_source = cycles;
+}
+
+int replay_recording(void)
+{
+	return recording;
+}
+
+int replay_playing(void)
+{
+	return playing;
+}
+
+void replay_put(unsigned int src, const void *data, size_t len)
+{
+	uint64_t now;
+
+	if (!recording)
+		return;
+	now = replay_now();
+	put_varint(now - last_cycles);
+	put_varint(src);
+	put_varint(len);
+	if (len)
+		fwrite(data, len, 1, log_fp);
+	if (fflush(log_fp) || ferror(log_fp)) {
+		perror(log_path);
+		exit(1);
+	}
+	last_cycles = now;
+}
+
+/* Hand out the next record if it is from src and due. Returns its length,
+   of which up to len bytes are copied, or -1 if there is nothing yet */
+int replay_get(unsigned int src, void *data, size_t len)
+{
+	size_t n;
+
+	if (!next_valid || next_src != src || next_cycles > replay_now())
+		return -1;
+	n = next_len < len ? next_len : len;
+	memcpy(data, next_data, n);
+	n = next_len;
+	replay_read();
+	return n;
+}
+
+/* As replay_get for a reply that has to come next */
+int replay_need(unsigned int src, void *data, size_t len)
+{
+	int n = replay_get(src, data, len);
+
+	if (n == -1) {
+		fprintf(stderr, "replay: %s does not match this run at cycle %llu.\n",
+			log_path, (unsigned long long)replay_now());
+		exit(1);
+	}
+	return n;
+}
@@ -0,0 +1,29 @@
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *	Record and replay of everything that comes into the machine from
+ *	the host. While recording each input is logged with the emulated
+ *	cycle it arrived at. While replaying the modules take their input
+ *	from the log instead of the host at the same cycle, and as the rest
+ *	of the machine only follows the emulated clock the run repeats.
+ */
+
+#define REPLAY_CONSOLE	1	/* Console input, empty for end of file */
+#define REPLAY_NET	2	/* Results of W5100 host socket calls */
+#define REPLAY_NETPOLL	3	/* W5100 sockets found ready */
+#define REPLAY_RTC	4	/* Host time of day when it changed */
+#define REPLAY_KEY	5	/* SDL keyboard and window events */
+
+extern void replay_open(const char *spec);
+extern void replay_clock(uint64_t (*cycles)(void));
+extern int replay_recording(void);
+extern int replay_playing(void);
+extern void replay_put(unsigned int src, const void *data, size_t len);
+extern int replay_get(unsigned int src, void *data, size_t len);
+extern int replay_need(unsigned int src, void *data, size_t len);
+
+#endif
@@ -2,16 +2,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <time.h>
 #include "system.h"
+#include "vclock.h"
 #include "rtc_bitbang.h"
+#include "trace.h"
 
 
 /* Real time clock state machine and related state.
 
-   Give the host time and don't emulate time setting except for
-   the 24/12 hour setting.
-   
+   Give the host time, moved by however far the guest has set the
+   clock. The time registers are built once a second, from rtc_tick()
+   if the board calls it and otherwise when CE is raised in a new
+   second, so the bit banging itself is just shifts.
+
  */
 
 struct rtc {
@@ -26,96 +31,168 @@ struct rtc {
 	uint8_t clock24;
 	uint8_t bp;
 	uint8_t bc;
-	struct tm *tm;
+	int64_t offset;		/* Guest set time less host time */
+	/* Not saved, rebuilt from the host clock */
+	time_t latched;		/* Host second the image is for */
+	uint64_t image;		/* Registers 0-7, register 0 lowest */
+	uint64_t burst;		/* Image as it was when a burst began */
+	unsigned int ticked;
 	int trace;
 };
 
-uint8_t rtc_read(struct rtc *rtc)
+static uint8_t bcd(unsigned int v)
 {
-	if (rtc->st & 0x30)
-		return (rtc->r & 0x01) ? 1 : 0;
-	return 0xFF;
+	return (v % 10) | ((v / 10) << 4);
 }
 
-static uint16_t rtc_regread(struct rtc *rtc, uint8_t reg)
+static unsigned int unbcd(uint8_t v)
 {
-	uint8_t val, v;
+	return (v >> 4) * 10 + (v & 0x0F);
+}
 
+/* Build the register image for host time t */
+static void rtc_image(struct rtc *rtc, time_t t)
+{
+	time_t g = t + rtc->offset;
+	struct tm *tm = localtime(&g);
+	uint64_t img;
+	uint8_t v, hr;
+
+	rtc->latched = t;
+	if (tm == NULL)
+		return;
+	hr = tm->tm_hour;
+	if (!rtc->clock24) {
+		v = hr % 12;
+		if (v == 0)
+			v = 12;
+		v = bcd(v) | 0x80;
+		if (hr > 11)
+			v |= 0x20;
+	} else
+		v = bcd(hr);
+	img = rtc->wp ? 0x80 : 0x00;
+	img = (img << 8) | bcd(tm->tm_year % 100);
+	img = (img << 8) | (tm->tm_wday + 1);
+	img = (img << 8) | bcd(tm->tm_mon + 1);
+	img = (img << 8) | bcd(tm->tm_mday);
+	img = (img << 8) | v;
+	img = (img << 8) | bcd(tm->tm_min);
+	img = (img << 8) | bcd(tm->tm_sec);
+	rtc->image = img;
+}
+
+static void rtc_refresh(struct rtc *rtc)
+{
+	time_t t = vclock_time();
+	if (t != rtc->latched)
+		rtc_image(rtc, t);
+}
+
+/* Called once a second by boards with a scheduler */
+void rtc_tick(struct rtc *rtc)
+{
+	rtc->ticked = 1;
+	rtc_refresh(rtc);
+}
+
+/* The guest set a time register: keep it as a move of the offset */
+static void rtc_settime(struct rtc *rtc, uint8_t reg, uint8_t val)
+{
+	time_t g = rtc->latched + rtc->offset;
+	struct tm *tp = localtime(&g);
+	struct tm tm, old;
+	unsigned int v;
+
+	if (tp == NULL)
+		return;
+	tm = *tp;
+	old = tm;
 	switch (reg) {
 	case 0:
-		val = (rtc->tm->tm_sec % 10) + ((rtc->tm->tm_sec / 10) << 4);
+		tm.tm_sec = unbcd(val & 0x7F);
 		break;
 	case 1:
-		val = (rtc->tm->tm_min % 10) + ((rtc->tm->tm_min / 10) << 4);
+		tm.tm_min = unbcd(val & 0x7F);
 		break;
 	case 2:
-		v = rtc->tm->tm_hour;
-		if (!rtc->clock24) {
-			v %= 12;
-			v++;
-		}
-		val = (v % 10) + ((v / 10) << 4);
-		if (!rtc->clock24) {
-			if (rtc->tm->tm_hour > 11)
-				val |= 0x20;
-			val |= 0x80;
-		}
+		if (val & 0x80) {
+			v = unbcd(val & 0x1F) % 12;
+			if (val & 0x20)
+				v += 12;
+		} else
+			v = unbcd(val & 0x3F);
+		tm.tm_hour = v;
 		break;
 	case 3:
-		val = (rtc->tm->tm_mday % 10) + ((rtc->tm->tm_mday / 10) << 4);
+		tm.tm_mday = unbcd(val & 0x3F);
 		break;
 	case 4:
-		val = ((rtc->tm->tm_mon + 1) % 10) + (((rtc->tm->tm_mon + 1) / 10) << 4);
-		break;
-	case 5:
-		val = rtc->tm->tm_wday + 1;
+		tm.tm_mon = unbcd(val & 0x1F) - 1;
 		break;
 	case 6:
-		v = rtc->tm->tm_year % 100;
-		val = (v % 10) + ((v / 10) << 4);
-		break;
-	case 7:
-		val = rtc->wp ? 0x80 : 0x00;
-		break;
-	case 8:
-		val = 0;
+		tm.tm_year = 100 + unbcd(val);
 		break;
 	default:
-		val = 0xFF;
-		/* Check */
-		break;
+		/* The day of the week follows from the date */
+		return;
 	}
-	if (rtc->trace)
+	tm.tm_isdst = old.tm_isdst;
+	rtc->offset += (int64_t)(mktime(&tm) - mktime(&old));
+}
+
+uint8_t rtc_read(struct rtc *rtc)
+{
+	if (rtc->st & 0x30)
+		return (rtc->r & 0x01) ? 1 : 0;
+	return 0xFF;
+}
+
+static uint16_t rtc_regread(struct rtc *rtc, uint64_t img, uint8_t reg)
+{
+	uint8_t val;
+
+	if (reg < 8)
+		val = img >> (reg << 3);
+	else if (reg == 8)
+		val = 0;
+	else
+		val = 0xFF;
+	if (TRACE_ON(rtc->trace))
 		fprintf(stderr, "RTCreg %d = %02X\n", reg, val);
 	return val;
 }
 
 static void rtcop(struct rtc *rtc)
 {
-	if (rtc->trace)
+	if (TRACE_ON(rtc->trace))
 		fprintf(stderr, "rtcbyte %02X\n", rtc->w);
 	/* The emulated task asked us to write a byte, and has now provided
 	   the data byte to go with it */
 	if (rtc->state == 2) {
 		if ((!rtc->wp) || (rtc->reg == 7)) {
-			if (rtc->trace)
+			if (TRACE_ON(rtc->trace))
 				fprintf(stderr, "RTC write %d as %d\n", rtc->reg, rtc->w);
 			/* We did a real write! */
 			/* Not yet tackled burst mode */
 			if (rtc->reg != 0x3F && (rtc->reg & 0x20))	/* NVRAM */
 				rtc->ram[rtc->reg & 0x1F] = rtc->w;
-			else if (rtc->reg == 2)
-				rtc->clock24 = rtc->w & 0x80;
 			else if (rtc->reg == 7)
 				rtc->wp = rtc->w & 0x80;
+			else if (rtc->reg < 7) {
+				/* Bit 7 selects 12 hour mode */
+				if (rtc->reg == 2)
+					rtc->clock24 = !(rtc->w & 0x80);
+				rtc_settime(rtc, rtc->reg, rtc->w);
+			}
+			rtc_image(rtc, rtc->latched);
 		}
-		/* For now don't emulate writes to the time */
 		rtc->state = 0;
 		return;
 	}
 	/* Check for broken requests */
 	if (!(rtc->w & 0x80)) {
-		if (rtc->trace)
+		if (TRACE_ON(rtc->trace))
 			fprintf(stderr, "rtc->w makes no sense %d\n", rtc->w);
 		rtc->state = 0;
 		rtc->r = 0x1FF;
@@ -126,14 +203,15 @@ static void rtcop(struct rtc *rtc)
 		rtc->state = 3;
 		rtc->bp = 0;
 		rtc->bc = 0;
-		rtc->r = rtc_regread(rtc, rtc->bp++) << 1;
-		if (rtc->trace)
+		rtc->burst = rtc->image;
+		rtc->r = rtc_regread(rtc, rtc->burst, rtc->bp++) << 1;
+		if (TRACE_ON(rtc->trace))
 			fprintf(stderr, "rtc command BF: burst clock read.\n");
 		return;
 	}
 	/* A write request */
 	if (!(rtc->w & 0x01)) {
-		if (rtc->trace)
+		if (TRACE_ON(rtc->trace))
 			fprintf(stderr, "rtc write request, waiting byte 2.\n");
 		rtc->state = 2;
 		rtc->reg = (rtc->w >> 1) & 0x3F;
@@ -146,13 +224,13 @@ static void rtcop(struct rtc *rtc)
 		/* RAM */
 		if (rtc->w != 0xFE)
 			rtc->r = rtc->ram[(rtc->w >> 1) & 0x1F] << 1;
-		if (rtc->trace)
+		if (TRACE_ON(rtc->trace))
 			fprintf(stderr, "RTC RAM read %d, ready to clock out %d.\n", (rtc->w >> 1) & 0xFF, rtc->r);
 		return;
 	}
 	/* Register read */
-	rtc->r = rtc_regread(rtc, (rtc->w >> 1) & 0x1F) << 1;
-	if (rtc->trace)
+	rtc->r = rtc_regread(rtc, rtc->image, (rtc->w >> 1) & 0x1F) << 1;
+	if (TRACE_ON(rtc->trace))
 		fprintf(stderr, "RTC read of time register %d is %d\n", (rtc->w >> 1) & 0x1F, rtc->r);
 }
 
@@ -161,26 +239,26 @@ void rtc_write(struct rtc *rtc, uint8_t val)
 	uint8_t changed = val ^ rtc->st;
 	uint8_t is_read;
 	/* Direction */
-	if ((rtc->trace) && (changed & 0x20))
+	if (TRACE_ON(rtc->trace) && (changed & 0x20))
 		fprintf(stderr, "RTC direction now %s.\n", (val & 0x20) ? "read" : "write");
 	is_read = val & 0x20;
 	/* Clock */
 	if (changed & 0x40) {
 		/* The rising edge samples, the falling edge clocks receive */
-		if (rtc->trace)
+		if (TRACE_ON(rtc->trace))
 			fprintf(stderr, "RTC clock low.\n");
 		if (!(val & 0x40)) {
 			rtc->r >>= 1;
 			/* Burst read of time */
 			rtc->bc++;
 			if (rtc->bc == 8 && rtc->bp) {
-				rtc->r = rtc_regread(rtc, rtc->bp++) << 1;
+				rtc->r = rtc_regread(rtc, rtc->burst, rtc->bp++) << 1;
 				rtc->bc = 0;
 			}
-			if (rtc->trace)
+			if (TRACE_ON(rtc->trace))
 				fprintf(stderr, "rtc->r now %02X\n", rtc->r);
 		} else {
-			if (rtc->trace)
+			if (TRACE_ON(rtc->trace))
 				fprintf(stderr, "RTC clock high.\n");
 			rtc->w >>= 1;
 			if ((val & 0x30) == 0x10)
@@ -188,7 +266,7 @@ void rtc_write(struct rtc *rtc, uint8_t val)
 			else
 				rtc->w |= 0xFF;
 			rtc->cnt++;
-			if (rtc->trace)
+			if (TRACE_ON(rtc->trace))
 				fprintf(stderr, "rtc->w now %02x (%d)\n", rtc->w, rtc->cnt);
 			if (!(rtc->cnt % 8) && !is_read)
 				rtcop(rtc);
@@ -197,17 +275,17 @@ void rtc_write(struct rtc *rtc, uint8_t val)
 	/* CE */
 	if (changed & 0x10) {
 		if (rtc->st & 0x10) {
-			if (rtc->trace)
+			if (TRACE_ON(rtc->trace))
 				fprintf(stderr, "RTC CE dropped.\n");
 			rtc->cnt = 0;
 			rtc->r = 0;
 			rtc->w = 0;
 			rtc->state = 0;
 		} else {
-			/* Latch imaginary registers on rising edge */
-			time_t t = time(NULL);
-			rtc->tm = localtime(&t);
-			if (rtc->trace)
+			/* Without a tick from the board catch up here */
+			if (!rtc->ticked)
+				rtc_refresh(rtc);
+			if (TRACE_ON(rtc->trace))
 				fprintf(stderr, "RTC CE raised and latched time.\n");
 		}
 	}
@@ -216,9 +294,12 @@ void rtc_write(struct rtc *rtc, uint8_t val)
 
 void rtc_reset(struct rtc *rtc)
 {
+	unsigned int ticked = rtc->ticked;
 	memset(rtc, 0, sizeof(struct rtc));
 	rtc->wp = 0x80;
 	rtc->clock24 = 1;
+	rtc->ticked = ticked;
+	rtc_image(rtc, vclock_time());
 }
 
 struct rtc *rtc_create(void)
@@ -228,6 +309,7 @@ struct rtc *rtc_create(void)
 		fprintf(stderr, "Out of memory.\n");
 		exit(1);
 	}
+	rtc->ticked = 0;
 	rtc_reset(rtc);
 	return rtc;
 }
@@ -241,3 +323,22 @@ void rtc_trace(struct rtc *rtc, int onoff)
 {
 	rtc->trace = onoff;
 }
+
+/* Snapshot support. With buf NULL just report the size needed */
+size_t rtc_save(struct rtc *rtc, void *buf)
+{
+	size_t len = offsetof(struct rtc, latched);
+	if (buf)
+		memcpy(buf, rtc, len);
+	return len;
+}
+
+int rtc_load(struct rtc *rtc, const void *buf, size_t len)
+{
+	if (len != offsetof(struct rtc, latched))
+		return -1;
+	memcpy(rtc, buf, len);
+	/* The clock runs on host time so latch it afresh */
+	rtc_image(rtc, vclock_time());
+	return 0;
+}
@@ -5,4 +5,7 @@ void rtc_free(struct rtc *rtc);
 void rtc_reset(struct rtc *rtc);
 void rtc_write(struct rtc *rtc, uint8_t val);
 uint8_t rtc_read(struct rtc *rtc);
+void rtc_tick(struct rtc *rtc);
 void rtc_trace(struct rtc *rtc, int onoff);
+size_t rtc_save(struct rtc *rtc, void *buf);
+int rtc_load(struct rtc *rtc, const void *buf, size_t len);
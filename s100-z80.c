@@ -17,6 +17,9 @@
 #include <sys/select.h>
 #include "libz80/z80.h"
 #include "ppide.h"
+#include "trace.h"
+#include "cpuclock.h"
+#include "z80run.h"
 
 static uint8_t rom[2][4096];
 static uint8_t ram[1048576];
@@ -59,17 +62,17 @@ static uint8_t mem_read(int unused, uint16_t addr)
 {
 	uint8_t r;
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R");
 	r = *mem_map(addr, 0);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, " %04X <- %02X\n", addr, r);
 	return r;
 }
 
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04X -> %02X\n", addr, val);
 	*mem_map(addr,  1) = val;
 }
@@ -116,7 +119,7 @@ void recalc_interrupts(void)
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr == 0x00) {
@@ -130,14 +133,14 @@ static uint8_t io_read(int unused, uint16_t addr)
 		return next_char();
 	if (addr >= 0x30 && addr <= 0x33)
 		return ppide_read(ppide, addr & 3);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr == 0x01)
@@ -150,7 +153,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 		ppide_write(ppide, addr & 3, val);
 	else if (addr == 0xFD)
 		trace = val;
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr,
 			"Unknown write to port %04X of %02X\n", addr, val);
 }
@@ -170,20 +173,20 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "s100: [-f] [-i path] [-r path] [-d debug]\n");
+	fprintf(stderr, "s100: [-f] [-X MHz] [-i path] [-r path] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
+	static struct z80run run;
 	int opt;
 	int fd;
 	int l;
 	char *rompath = "s100.rom";
 	char *idepath = "s100.cf";
 
-	while ((opt = getopt(argc, argv, "d:i:r:ft")) != -1) {
+	while ((opt = getopt(argc, argv, "d:i:r:ftX:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -197,6 +200,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			run.hz = cpuclock_parse(optarg);
+			break;
 		default:
 			usage();
 		}
@@ -236,11 +242,6 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	/* 5ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 5000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -265,25 +266,15 @@ int main(int argc, char *argv[])
 	/* Cheap way to emulate the nop stuffer */
 	memset(ram, 0, 65536);
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!done) {
-		int l;
-		/* 50 Hz outer loop for a 4MHz CPU */
-		/* 40,000 T states a loop */
-		for (l = 0; l < 4; l++) {
-			int i;
-			/* We do 4000 tstates per ms */
-			for (i = 0; i < 5; i++) {
-				Z80ExecuteTStates(&cpu_z80, 4000);
-			}
-			/* Do 5ms of I/O and delays */
-			if (!fast)
-				nanosleep(&tc, NULL);
-		}
-	}
+	/* 50 Hz outer loop for a 4MHz CPU */
+	run.cpu = &cpu_z80;
+	if (run.hz == 0)
+		run.hz = 4000000;
+	run.rate = 1000;
+	run.steps = 5;
+	run.ticks = 4;
+	run.fast = fast;
+	run.done = &done;
+	z80run_loop(&run);
 	exit(0);
 }
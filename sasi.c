@@ -43,8 +43,11 @@
 #include <unistd.h>
 
 #include "sasi.h"
+#include "blkcache.h"
+#include "cow.h"
 
 #define NR_LUN	8
+#define MAX_XFER	256	/* Blocks in the largest READ/WRITE */
 
 #define CHECK_CONDITION	0x01
 
@@ -65,6 +68,14 @@ struct sasi_disk
     uint8_t dbuf[516];		/* Good enough for 512 bytes + ecc */
     uint8_t sensebuf[4];
 
+    /* Whole READ/WRITE transfers go through xbuf with one pread/pwrite */
+    uint8_t *xbuf;
+    unsigned int xblocks;	/* Blocks valid (read) or gathered (write) */
+    unsigned int xnext;		/* Next block to hand out */
+    uint32_t xlba;		/* Where the gathered writes go */
+    unsigned int bulk;		/* Current READ/WRITE uses xbuf */
+
+    uint8_t *data;		/* Data phase buffer, dbuf or in xbuf */
     unsigned int dptr;
     unsigned int dlen;
     unsigned int cmd_len;
@@ -91,18 +102,37 @@ struct sasi_bus {
  
 static int do_read(struct sasi_disk *sd)
 {
-    if (lseek(sd->fd, sd->lba * sd->sectorsize, SEEK_SET) < 0)
-        return -1;
-    if (read(sd->fd, sd->dbuf, sd->sectorsize) != sd->sectorsize)
+    off_t pos = (off_t)sd->lba * sd->sectorsize;
+    if (blkcache_pread(sd->fd, sd->dbuf, sd->sectorsize, pos) != sd->sectorsize)
         return -1;
     return 0;
 }
 
 static int do_write(struct sasi_disk *sd)
 {
-    if (lseek(sd->fd, sd->lba * sd->sectorsize, SEEK_SET) < 0)
+    off_t pos = (off_t)sd->lba * sd->sectorsize;
+    if (blkcache_pwrite(sd->fd, sd->dbuf, sd->sectorsize, pos) != sd->sectorsize)
         return -1;
-    if (write(sd->fd, sd->dbuf, sd->sectorsize) != sd->sectorsize)
+    return 0;
+}
+
+/* Fetch up to n blocks from lba into xbuf, returns the blocks read */
+static unsigned int do_read_multi(struct sasi_disk *sd, uint32_t lba, unsigned int n)
+{
+    off_t pos = (off_t)lba * sd->sectorsize;
+    ssize_t r = blkcache_pread(sd->fd, sd->xbuf, n * sd->sectorsize, pos);
+    if (r <= 0)
+        return 0;
+    return r / sd->sectorsize;
+}
+
+/* Write the blocks gathered in xbuf */
+static int do_write_multi(struct sasi_disk *sd)
+{
+    off_t pos = (off_t)sd->xlba * sd->sectorsize;
+    size_t len = sd->xblocks * sd->sectorsize;
+    sd->xblocks = 0;
+    if (len && blkcache_pwrite(sd->fd, sd->xbuf, len, pos) != len)
         return -1;
     return 0;
 }
@@ -120,6 +150,7 @@ static void sasi_done(struct sasi_disk *sd, uint8_t status)
 static void sasi_data_in(struct sasi_disk *sd, unsigned int length)
 {
     sd->bus->control &= ~(SASI_CD | SASI_IO);
+    sd->data = sd->dbuf;
     sd->dptr = 0;
     sd->dlen = length;
 }
@@ -128,6 +159,7 @@ static void sasi_data_out(struct sasi_disk *sd, unsigned int length)
 {
     sd->bus->control &= ~SASI_CD;
     sd->bus->control |= SASI_IO;
+    sd->data = sd->dbuf;
     sd->dptr = 0;
     sd->dlen = length;
 }
@@ -173,7 +205,7 @@ static void sasi_read_block(struct sasi_disk *sd)
         sasi_done(sd, 0);
         return;
     }
-    if (do_read(sd) < 0) {
+    if (sd->bulk ? sd->xnext == sd->xblocks : do_read(sd) < 0) {
         sasi_sense_with_lba(sd, 0x14);	/* Target sector not found */
         sasi_done(sd, CHECK_CONDITION);
         return;
@@ -181,6 +213,8 @@ static void sasi_read_block(struct sasi_disk *sd)
     sd->lba++;
     sd->count--;
     sasi_data_out(sd, sd->sectorsize + 4 * sd->ecc);
+    if (sd->bulk)
+        sd->data = sd->xbuf + sd->sectorsize * sd->xnext++;
 }
 
 static void sasi_read_command(struct sasi_disk *sd, uint32_t lba,
@@ -189,6 +223,17 @@ static void sasi_read_command(struct sasi_disk *sd, uint32_t lba,
     sd->lba = lba;
     sd->count = count;
     sd->ecc = ecc;
+    /* Without ECC bytes the blocks are contiguous so fetch them all now */
+    sd->bulk = !ecc;
+    if (sd->bulk) {
+        unsigned int n = count;
+        if (lba >= sd->blocks)
+            n = 0;
+        else if (n > sd->blocks - lba)
+            n = sd->blocks - lba;
+        sd->xblocks = n ? do_read_multi(sd, lba, n) : 0;
+        sd->xnext = 0;
+    }
     sasi_read_block(sd);
 }
 
@@ -196,12 +241,16 @@ static void sasi_read_command(struct sasi_disk *sd, uint32_t lba,
 static void sasi_write_block(struct sasi_disk *sd)
 {
     if (sd->lba == sd->blocks) {
+        if (sd->bulk)
+            do_write_multi(sd);
         sasi_sense_with_lba(sd, 0x21);
         sasi_done(sd, CHECK_CONDITION);
         return;
     }
-    /* Write the data received */
-    if (do_write(sd)) {
+    /* Write the data received, or just keep it until the end */
+    if (sd->bulk)
+        sd->xblocks++;
+    else if (do_write(sd)) {
         sasi_sense_with_lba(sd, 0x14);	/* Target sector not found */
         sasi_done(sd, CHECK_CONDITION);
         return;
@@ -210,11 +259,18 @@ static void sasi_write_block(struct sasi_disk *sd)
     sd->count--;
     /* And done */
     if (sd->count == 0) {
+        if (sd->bulk && do_write_multi(sd)) {
+            sasi_sense_with_lba(sd, 0x14);
+            sasi_done(sd, CHECK_CONDITION);
+            return;
+        }
         sasi_sense_clear(sd);
         sasi_done(sd, 0);
         return;
     }
     sasi_data_in(sd, sd->sectorsize + 4 * sd->ecc);
+    if (sd->bulk)
+        sd->data = sd->xbuf + sd->sectorsize * sd->xblocks;
 }
 
 /*
@@ -227,7 +283,12 @@ static void sasi_write_command(struct sasi_disk *sd, uint32_t lba,
     sd->lba = lba;
     sd->count = count;
     sd->ecc = ecc;
+    sd->bulk = !ecc;
+    sd->xlba = lba;
+    sd->xblocks = 0;
     sasi_data_in(sd, sd->sectorsize + 4 * sd->ecc);
+    if (sd->bulk)
+        sd->data = sd->xbuf;
 }
 
 /*
@@ -236,16 +297,27 @@ static void sasi_write_command(struct sasi_disk *sd, uint32_t lba,
  */
 static void sasi_format_disk(struct sasi_disk *sd)
 {
+    unsigned int n;
+
     if (sd->lba >= sd->blocks) {
         sasi_done(sd, CHECK_CONDITION);
         return;
     }
+    /* Fill the transfer buffer with the pattern and write it in runs */
+    for (n = 0; n < MAX_XFER; n++)
+        memcpy(sd->xbuf + n * sd->sectorsize, sd->dbuf, sd->sectorsize);
     while(sd->lba < sd->blocks) {
-        if (do_write(sd)) {
+        n = sd->blocks - sd->lba;
+        if (n > MAX_XFER)
+            n = MAX_XFER;
+        sd->xlba = sd->lba;
+        sd->xblocks = n;
+        if (do_write_multi(sd)) {
             sasi_sense_with_lba(sd, 0x1A);
             sasi_done(sd, CHECK_CONDITION);
+            return;
         }
-        sd->lba++;
+        sd->lba += n;
     }
     sasi_done(sd, 0);
 }
@@ -352,8 +424,8 @@ static void sasi_command_process(struct sasi_disk *sd)
 static void sasi_command_execute_in(struct sasi_disk *sd)
 {
     switch(sd->cmd[0]) {
-    case 0x08:
-        sasi_read_block(sd);
+    case 0x0A:
+        sasi_write_block(sd);
         break;
     case 0x0C:
         sasi_done(sd, 0);
@@ -364,8 +436,8 @@ static void sasi_command_execute_in(struct sasi_disk *sd)
     case 0x0F:
         sasi_done(sd, 0);
         break;
-    case 0xE5:
-        sasi_read_block(sd);
+    case 0xE6:
+        sasi_write_block(sd);
         break;
     default:
         fprintf(stderr, "sasi_command_execute: state error cmd %02x\n",
@@ -379,8 +451,8 @@ static void sasi_command_execute_out(struct sasi_disk *sd)
     case 0x03:
         sasi_done(sd, 0);
         break;
-    case 0x0A:
-        sasi_write_block(sd);
+    case 0x08:
+        sasi_read_block(sd);
         break;
     case 0x0D:
         sasi_done(sd, 0);
@@ -388,8 +460,8 @@ static void sasi_command_execute_out(struct sasi_disk *sd)
     case 0x10:
         sasi_done(sd, 0);
         break;
-    case 0xE6:
-        sasi_write_block(sd);
+    case 0xE5:
+        sasi_read_block(sd);
         break;
     case 0xE7:
         sasi_done(sd, 0);
@@ -409,6 +481,7 @@ static void sasi_device_select(struct sasi_disk *sd)
     sd->bus->selected = sd;
     sd->bus->state = BUS_TRANSFER;
     /* We expect a command */
+    sd->cmd_len = 0;
     sd->bus->control &= ~(SASI_IO | SASI_MSG);
     sd->bus->control |= SASI_CD | SASI_BSY;
 }
@@ -425,7 +498,7 @@ static void sasi_device_reset(struct sasi_disk *sd)
 static uint8_t sasi_disk_read(struct sasi_disk *sd)
 {
     uint8_t r;
-    r = sd->dbuf[sd->dptr++];
+    r = sd->data[sd->dptr++];
     if (sd->dptr == sd->dlen)
         sasi_command_execute_out(sd);
     return r;
@@ -441,15 +514,6 @@ static uint8_t sasi_disk_status(struct sasi_disk *sd)
     return sd->status;
 }
 
-/*
- *	Nessage phase byte - just return 0
- */
-static uint8_t sasi_disk_mesg(struct sasi_disk *sd)
-{
-    sd->bus->control &= ~(SASI_BSY|SASI_MSG|SASI_CD|SASI_IO);
-    return 0;
-}
-
 /*
  *	Put the SASI bus into free state
  */
@@ -460,6 +524,16 @@ static void sasi_bus_idle(struct sasi_bus *bus)
     bus->state = BUS_IDLE;
 }
 
+/*
+ *	Nessage phase byte - just return 0. That ends the command and
+ *	the target lets go of the bus
+ */
+static uint8_t sasi_disk_mesg(struct sasi_disk *sd)
+{
+    sasi_bus_idle(sd->bus);
+    return 0;
+}
+
 /*
  *	The disk is in data in phase, we accumulate data until the
  *	request is completed and thene execute the command. After this
@@ -467,7 +541,7 @@ static void sasi_bus_idle(struct sasi_bus *bus)
  */
 static void sasi_disk_write(struct sasi_disk *sd, uint8_t r)
 {
-    sd->dbuf[sd->dptr++] = r;
+    sd->data[sd->dptr++] = r;
     if (sd->dptr == sd->dlen)
         sasi_command_execute_in(sd);
 }
@@ -479,7 +553,8 @@ static void sasi_disk_write(struct sasi_disk *sd, uint8_t r)
  */
 static void sasi_disk_command(struct sasi_disk *sd, uint8_t val)
 {
-    sd->cmd[sd->dptr++] = val;
+    if (sd->cmd_len < sizeof(sd->cmd))
+        sd->cmd[sd->cmd_len++] = val;
     /* If this is a complete command now then this routine will drop SASI_CD
        and set any data direction needed or status info */
     sasi_command_process(sd);
@@ -547,6 +622,53 @@ void sasi_write_data(struct sasi_bus *bus, uint8_t data)
  *	selection as we don't support multi-master so won't respond
  */
 
+/*
+ *	Bulk data phase transfers for front ends that can move a block
+ *	at a time. They stop at the end of the data phase and return the
+ *	number of bytes moved.
+ */
+unsigned int sasi_read_bulk(struct sasi_bus *bus, uint8_t *buf, unsigned int len)
+{
+    struct sasi_disk *sd = bus->selected;
+    unsigned int done = 0;
+
+    while (done < len && bus->state == BUS_TRANSFER &&
+        (bus->control & (SASI_MSG | SASI_CD | SASI_IO)) == SASI_IO) {
+        unsigned int n = sd->dlen - sd->dptr;
+        if (n == 0)
+            break;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buf + done, sd->data + sd->dptr, n);
+        sd->dptr += n;
+        done += n;
+        if (sd->dptr == sd->dlen)
+            sasi_command_execute_out(sd);
+    }
+    return done;
+}
+
+unsigned int sasi_write_bulk(struct sasi_bus *bus, const uint8_t *buf, unsigned int len)
+{
+    struct sasi_disk *sd = bus->selected;
+    unsigned int done = 0;
+
+    while (done < len && bus->state == BUS_TRANSFER &&
+        (bus->control & (SASI_MSG | SASI_CD | SASI_IO)) == 0) {
+        unsigned int n = sd->dlen - sd->dptr;
+        if (n == 0)
+            break;
+        if (n > len - done)
+            n = len - done;
+        memcpy(sd->data + sd->dptr, buf + done, n);
+        sd->dptr += n;
+        done += n;
+        if (sd->dptr == sd->dlen)
+            sasi_command_execute_in(sd);
+    }
+    return done;
+}
+
 uint8_t sasi_read_data(struct sasi_bus *bus)
 {
     if (bus->state == BUS_IDLE || bus->state == BUS_RESET)
@@ -621,22 +743,22 @@ void sasi_disk_attach(struct sasi_bus *bus, unsigned int lun, const char *path,
     struct sasi_disk *sd = alloc(sizeof(struct sasi_disk));
     sd->bus = bus;
     sd->sectorsize = sectorsize;
-    sd->fd = open(path, O_RDWR);
-    if (sd->fd == -1) {
-        perror(path);
-        exit(1);
-    }
-    if (lseek(sd->fd, (off_t)0, 2) == -1) {
+    sd->xbuf = alloc(MAX_XFER * sectorsize);
+    sd->data = sd->dbuf;
+    /* Through the block cache and so any base:delta overlay */
+    sd->fd = cow_open(path, O_RDWR);
+    if (sd->fd == -1 || cow_size(sd->fd) == -1) {
         perror(path);
         exit(1);
     }
-    sd->blocks = lseek(sd->fd, (off_t)0, 1) / sd->sectorsize;
+    sd->blocks = cow_size(sd->fd) / sd->sectorsize;
     bus->device[lun] = sd;
 }
     
 static void sasi_disk_free(struct sasi_disk *sd)
 {
-    close(sd->fd);
+    blkcache_close(sd->fd);
+    free(sd->xbuf);
     free(sd);
 }
 
@@ -1,7 +1,7 @@
 struct sasi_bus;
 
 
-struct sasi_bus *sasi_bus_alloc(void);
+struct sasi_bus *sasi_bus_create(void);
 void sasi_bus_free(struct sasi_bus *bus);
 void sasi_bus_reset(struct sasi_bus *bus);
 
@@ -10,6 +10,8 @@ void sasi_disk_attach(struct sasi_bus *bus, unsigned int lun, const char *path,
 
 void sasi_write_data(struct sasi_bus *bus, uint8_t data);
 uint8_t sasi_read_data(struct sasi_bus *bus);
+unsigned int sasi_read_bulk(struct sasi_bus *bus, uint8_t *buf, unsigned int len);
+unsigned int sasi_write_bulk(struct sasi_bus *bus, const uint8_t *buf, unsigned int len);
 void sasi_bus_control(struct sasi_bus *bus, uint8_t val);
 uint8_t sasi_bus_state(struct sasi_bus *bus);
 
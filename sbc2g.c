@@ -37,6 +37,9 @@
 #include <sys/select.h>
 #include "libz80/z80.h"
 #include "ide.h"
+#include "trace.h"
+#include "cpuclock.h"
+#include "z80run.h"
 
 static uint8_t ram[512 * 1024];
 static uint8_t rom[16384];
@@ -67,14 +70,13 @@ static volatile int done;
 
 static int trace = 0;
 
-static void reti_event(void);
+static void reti_event(int unused);
 
 static uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate;
 	uint8_t r;
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R");
 	if (addr < 0x4000 && romen)
 		r = rom[addr];
@@ -82,44 +84,26 @@ static uint8_t mem_read(int unused, uint16_t addr)
 		r = ram[addr];	/* Bank 1 lands correctly */
 	else
 		r = ram[addr + 32768 * banknum];
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, " %04X <- %02X\n", addr, r);
 
-	/* Look for ED with M1, followed directly by 4D and if so trigger
-	   the interrupt chain */
-	if (cpu_z80.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r== 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1)
-		reti_event();
-	rstate = 0;
 	return r;
 }
 
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
 	if (addr < 0x4000 && romen) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "W %04X : ROM\n", addr);
 		return;
 	}
 	if (addr >= 0x8000) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "WH %04X -> %02X\n", addr, val);
 		ram[addr] = val;
 		return;
 	}
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04X -> %02X\n", addr, val);
 	ram[addr + banknum * 32768] = val;
 }
@@ -190,7 +174,7 @@ static struct z80_sio_chan sio[2];
 
 static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
 {
-	if (trace & TRACE_IRQ) {
+	if (TRACE_ON(trace & TRACE_IRQ)) {
 		fprintf(stderr, "Clear intbits %d %x\n",
 			(int)(chan - sio), m);
 	}
@@ -209,7 +193,7 @@ static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
 	uint8_t new = (chan->intbits ^ m) & m;
 	uint8_t vector;
 	chan->intbits |= m;
-	if ((trace & TRACE_SIO) && new)
+	if (TRACE_ON(trace & TRACE_SIO) && new)
 		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
 	if (new) {
 		if (!sio->irq) {
@@ -227,7 +211,7 @@ static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
 				else if (chan->intbits & INT_ERR)
 					vector |= 2;
 			}
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "SIO2 interrupt %02X\n", vector);
 			chan->vector = vector;
 			recalc_interrupts();
@@ -253,7 +237,7 @@ static int sio2_check_im2(struct z80_sio_chan *chan)
 			chan->vector += (sio[1].wr[2] & 0xF1);
 		else
 			chan->vector += sio[1].wr[2];
-		if (trace & (TRACE_IRQ|TRACE_SIO))
+		if (TRACE_ON(trace & (TRACE_IRQ|TRACE_SIO)))
 			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
 				(int)(chan - sio), chan->vector);
 		if (chan == sio)
@@ -273,7 +257,7 @@ static int sio2_check_im2(struct z80_sio_chan *chan)
  */
 static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 {
-	if (trace & TRACE_SIO)
+	if (TRACE_ON(trace & TRACE_SIO))
 		fprintf(stderr, "SIO %d queue %d: ",
 			(int) (chan - sio), c);
 	/* Receive disabled */
@@ -283,7 +267,7 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 	}
 	/* Overrun */
 	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Overrun.\n");
 		chan->data[2] = c;
 		chan->rr[1] |= 0x20;	/* Overrun flagged */
@@ -291,7 +275,7 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 		sio2_raise_int(chan, INT_ERR);
 	} else {
 		/* FIFO add */
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Queued %d (mode %d)\n",
 				chan->dptr, chan->wr[1] & 0x18);
 		chan->data[chan->dptr++] = c;
@@ -366,18 +350,18 @@ static uint8_t sio2_read(uint16_t addr)
 		if (chan == sio && (sio[0].intbits | sio[1].intbits))
 			chan->rr[0] |= 2;
 
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read reg %d = ",
 				(addr & 1) ? 'b' : 'a', r);
 		switch (r) {
 		case 0:
 		case 1:
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "%02X\n", chan->rr[r]);
 			return chan->rr[r];
 		case 2:
 			if (chan != sio) {
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr, "%02X\n",
 						chan->rr[2]);
 				return chan->rr[2];
@@ -399,7 +383,7 @@ static uint8_t sio2_read(uint16_t addr)
 		sio2_clear_int(chan, INT_RX);
 		chan->rr[0] &= 0x3F;
 		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read data %d\n",
 				(addr & 1) ? 'b' : 'a', c);
 		if (chan->dptr && (chan->wr[1] & 0x10))
@@ -414,7 +398,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 	struct z80_sio_chan *chan = (addr & 1) ? sio + 1 : sio;
 	uint8_t r;
 	if (addr & 2) {
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr,
 				"sio%c write reg %d with %02X\n",
 				(addr & 1) ? 'b' : 'a',
@@ -432,12 +416,12 @@ static void sio2_write(uint16_t addr, uint8_t val)
 			case 020:	/* Reset external/status interrupts */
 				sio2_clear_int(chan, INT_ERR);
 				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr,
 						"[extint reset]\n");
 				break;
 			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr,
 						"[channel reset]\n");
 				sio2_channel_reset(chan);
@@ -473,7 +457,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		case 6:
 		case 7:
 			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
 					(addr & 1) ? 'b' : 'a', r, val);
 			chan->wr[r] = val;
@@ -491,7 +475,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		chan->txint = 1;
 		/* Should check chan->wr[5] & 8 */
 		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c write data %d\n",
 				(addr & 1) ? 'b' : 'a', val);
 		write(1, &val, 1);
@@ -503,7 +487,7 @@ static void timer_pulse(void)
 {
     if (timerhack) {
 	sio[0].rr[0] ^= 0x08;
-	if (trace & TRACE_SIO)
+	if (TRACE_ON(trace & TRACE_SIO))
 	    fprintf(stderr, "DCD1 is now %s.\n", sio[0].rr[0]&0x08 ? "high" : "low");
 	if (sio[0].wr[1] & 1)
 	    sio2_raise_int(sio, INT_ERR);	/* External / status int */
@@ -533,7 +517,7 @@ static void my_ide_write(uint16_t addr, uint8_t val)
 static void control_rom(uint8_t val)
 {
 	romen = 0;
-	if (trace & TRACE_BANK)
+	if (TRACE_ON(trace & TRACE_BANK))
 		fprintf(stderr, "ROM paged out.\n");
 
 }
@@ -541,27 +525,27 @@ static void control_rom(uint8_t val)
 static void ram_select(uint8_t val)
 {
 	banknum = val & 0x0F;
-	if (trace & TRACE_BANK)
+	if (TRACE_ON(trace & TRACE_BANK))
 		fprintf(stderr, "RAM bank set to %d.\n", banknum);
 }
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x03)
 		return sio2_read(addr & 3);
 	if (addr >= 0x10 && addr <= 0x17)
 		return my_ide_read(addr & 7);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr >= 0x00 && addr <= 0x03)
@@ -572,7 +556,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 		ram_select(val);
 	else if (addr == 0x38)
 		control_rom(val);
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr,
 			"Unknown write to port %04X of %02X\n", addr, val);
 }
@@ -582,7 +566,7 @@ static void poll_irq_event(void)
 	sio2_check_im2(sio);
 }
 
-static void reti_event(void)
+static void reti_event(int unused)
 {
 	sio2_reti(sio);
 	live_irq = 0;
@@ -605,20 +589,35 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "sbc2g: [-f] [-b] [-t] [-i path] [-r path] [-d debug]\n");
+	fprintf(stderr, "sbc2g: [-f] [-X MHz] [-b] [-t] [-i path] [-r path] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
+static void sbc2g_tick(void)
+{
+	if (int_recalc) {
+		/* If there is no pending Z80 vector IRQ but we think
+		   there now might be one we use the same logic as for
+		   reti */
+		poll_irq_event();
+		/* Clear this after because reti_event may set the
+		   flags to indicate there is more happening. We will
+		   pick up the next state changes on the reti if so */
+		if (!(cpu_z80.IFF1|cpu_z80.IFF2))
+			int_recalc = 0;
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
+	static struct z80run run;
 	int opt;
 	int fd;
 	int l;
 	char *rompath = "sbc2g.rom";
 	char *idepath = "sbc2g.cf";
 
-	while ((opt = getopt(argc, argv, "d:i:r:ft")) != -1) {
+	while ((opt = getopt(argc, argv, "d:i:r:ftX:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -633,6 +632,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			run.hz = cpuclock_parse(optarg);
+			break;
 		case 't':
 			timerhack = 1;
 			break;
@@ -670,11 +672,6 @@ int main(int argc, char *argv[])
 
 	sio_reset();
 
-	/* 5ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 5000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -695,37 +692,19 @@ int main(int argc, char *argv[])
 	cpu_z80.ioWrite = io_write;
 	cpu_z80.memRead = mem_read;
 	cpu_z80.memWrite = mem_write;
-
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!done) {
-		int l;
-		for (l = 0; l < 10; l++) {
-			int i;
-			/* 36400 T states */
-			for (i = 0; i < 100; i++) {
-				Z80ExecuteTStates(&cpu_z80, 364);
-				sio2_timer();
-			}
-			/* Do 5ms of I/O and delays */
-			if (!fast)
-				nanosleep(&tc, NULL);
-			if (int_recalc) {
-				/* If there is no pending Z80 vector IRQ but we think
-				   there now might be one we use the same logic as for
-				   reti */
-				poll_irq_event();
-				/* Clear this after because reti_event may set the
-				   flags to indicate there is more happening. We will
-				   pick up the next state changes on the reti if so */
-				if (!(cpu_z80.IFF1|cpu_z80.IFF2))
-					int_recalc = 0;
-			}
-		}
-		timer_pulse();
-	}
+	cpu_z80.reti = reti_event;
+
+	run.cpu = &cpu_z80;
+	if (run.hz == 0)
+		run.hz = 7372800;
+	run.rate = 20000;
+	run.steps = 100;
+	run.ticks = 10;
+	run.step = sio2_timer;
+	run.tick = sbc2g_tick;
+	run.frame = timer_pulse;
+	run.fast = fast;
+	run.done = &done;
+	z80run_loop(&run);
 	exit(0);
 }
@@ -40,8 +40,8 @@
 #include "scopewriter.h"
 #include "scopewriter_render.h"
 #include "asciikbd.h"
-
-int sdl_live;
+#include "event.h"
+#include "pace.h"
 
 static struct i8008 *cpu;
 static struct dgvideo *dgvideo;
@@ -50,8 +50,11 @@ static struct scopewriter *sw;
 static struct scopewriter_renderer *swrender;
 static struct asciikbd *kbd;
 
-/* We need this outside the main loop for noise emulation */
-static unsigned int cycle = 0;
+static struct event_queue *evq;
+static struct event kbd_ev, frame_ev;
+static struct pace pace;
+/* Start of the current video frame, for noise emulation */
+static uint64_t frame_start;
 
 static uint8_t memory[16384];
 static uint8_t memflags[64];	/* Which pages can be read or written */
@@ -152,7 +155,7 @@ void io_write(struct i8008 *cpu, uint8_t port, uint8_t val)
 	if (port == 017) {
 		if (dgvideo) {
 			dgvideo_write(dgvideo, val);
-			dgvideo_noise(dgvideo, cycle * 2500 + i8008_get_cycles(cpu), val);
+			dgvideo_noise(dgvideo, event_now(evq) - frame_start + i8008_get_cycles(cpu), val);
 			return;
 		}
 	}
@@ -335,39 +338,61 @@ static void intr(int unused)
 	signal(SIGINT, intr);
 }
 
+/* 500KHz: the keyboard is polled every 5ms and the video is drawn every
+   20ms (50Hz), and on the video frame we also wait for the host to catch
+   up unless running flat out */
+#define CPU_HZ		500000
+#define KBD_TSTATES	2500
+#define FRAME_TSTATES	10000
+
+static void kbd_event(void *unused)
+{
+	asciikbd_event(kbd);
+}
+
+static void frame_event(void *unused)
+{
+	frame_start = frame_ev.when - FRAME_TSTATES;
+	if (dgrender)
+		dgvideo_render(dgrender);
+	if (swrender)
+		scopewriter_render(swrender);
+	if (dgvideo)
+		dgvideo_rasterize(dgvideo);
+	if (!fast) {
+		pace_run(&pace, FRAME_TSTATES);
+		pace_wait(&pace, -1);
+	}
+}
+
 static void run_system(void)
 {
-	static struct timespec tc;
+	int i;
+
 	/* Execute runs code until an interrupt interferes, we then
 	   drop into halted state and expect machine_halted to make our
-	   decisions and also to sleep when appropriate.
+	   decisions.
 
 	   Note that the 8008 starts halted */
-/* 5ms - it's a balance between nice behaviour and simulation
-   smoothness */
 	signal(SIGINT, intr);
-	tc.tv_sec = 0;
-	tc.tv_nsec = 5000000L;
 
 	cpu = i8008_create();
 	i8008_reset(cpu);
 	i8008_trace(cpu, 0);
+	/* The memory map is flat so the CPU can have it directly */
+	for (i = 0; i < 64; i++)
+		i8008_map(cpu, i, memflags[i] & MF_READ ? memory + (i << 8) : NULL,
+			memflags[i] & MF_WRITE ? memory + (i << 8) : NULL);
+
+	evq = event_queue_create();
+	event_init(&kbd_ev, kbd_event, NULL);
+	event_periodic(evq, &kbd_ev, KBD_TSTATES);
+	event_init(&frame_ev, frame_event, NULL);
+	event_periodic(evq, &frame_ev, FRAME_TSTATES);
+	pace_init(&pace, CPU_HZ);
+
 	while (1) {
-		i8008_execute(cpu, 2500);	/* 500Khz */
-		cycle++;
-		/* We do the video rendering every 20ms (50Hz) and the
-		   rest of our cycle runs faster so things like window
-		   resizing are not laggy */
-		if ((cycle & 3) == 3) {
-			cycle = 0;
-			if (dgrender)
-				dgvideo_render(dgrender);
-			if (swrender)
-				scopewriter_render(swrender);
-			dgvideo_rasterize(dgvideo);
-		}
-		asciikbd_event(kbd);
-		nanosleep(&tc, NULL);
+		event_advance(evq, i8008_execute(cpu, event_budget(evq)));
 		if (i8008_halted(cpu)) {
 			tcsetattr(0, TCSADRAIN, &saved_term);
 			do {
@@ -379,9 +404,6 @@ static void run_system(void)
 			} while (i8008_halted(cpu));
 			tcsetattr(0, TCSADRAIN, &term);
 		}
-		/* Do 5ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
 	}
 	i8008_free(cpu);
 }
@@ -21,6 +21,8 @@ struct scopewriter
     uint8_t ptr;
     uint8_t data;
     uint8_t switches;
+    /* What each position currently shows in the raster, 0xFF if unknown */
+    uint8_t shown[32];
     /* Fudged for now */
     uint32_t raster[256 * 32];
 };
@@ -266,7 +268,12 @@ uint32_t *scopewriter_get_raster(struct scopewriter *sw)
             byte = sw->mem[sw->ptr];
         else
             byte = sw->mem[i];
-        sw_raster(sw, i, byte & 0x3F);
+        /* Only positions that changed since last time need redrawing */
+        byte &= 0x3F;
+        if (sw->shown[i] != byte) {
+            sw_raster(sw, i, byte);
+            sw->shown[i] = byte;
+        }
     }
     return sw->raster;
 }
@@ -282,6 +289,7 @@ struct scopewriter *scopewriter_create(void)
     sw->ptr = 0;
     sw->data = 'A';
     sw->switches = SW_RD;
+    memset(sw->shown, 0xFF, sizeof(sw->shown));
     sw_data_update(sw);
     scopewriter_get_raster(sw);
     return sw;
@@ -9,18 +9,23 @@
 
 #include "scopewriter.h"
 #include "scopewriter_render.h"
+#include "framestream.h"
 
 struct scopewriter_renderer {
     struct scopewriter *sw;
+    struct framestream *stream;
 };
     
 
 void scopewriter_render(struct scopewriter_renderer *render)
 {
+    if (render->stream)
+        framestream_frame(render->stream, scopewriter_get_raster(render->sw));
 }
 
 void scopewriter_renderer_free(struct scopewriter_renderer *render)
 {
+    framestream_free(render->stream);
     free(render);
 }
 
@@ -36,5 +41,6 @@ struct scopewriter_renderer *scopewriter_renderer_create(struct scopewriter *sw)
     }
     memset(render, 0, sizeof(struct scopewriter_renderer));
     render->sw = sw;
+    render->stream = framestream_create("SCOPEWRITER_STREAM", 256, 32);
     return render;
 }
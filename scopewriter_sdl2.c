@@ -6,35 +6,28 @@
 
 #include "scopewriter.h"
 #include "scopewriter_render.h"
-
-extern int sdl_live;
+#include "sdl2_texture.h"
 
 struct scopewriter_renderer {
     struct scopewriter *sw;
-    SDL_Renderer *render;
-    SDL_Texture *texture;
-    SDL_Window *window;
+    struct sdltex *stream;
 };
 
 void scopewriter_render(struct scopewriter_renderer *render)
 {
-    SDL_Rect sr;
-
-    sr.x = 0;
-    sr.y = 0;
-    sr.w = 256;
-    sr.h = 32;
+    uint32_t *raster;
 
-    SDL_UpdateTexture(render->texture, NULL, scopewriter_get_raster(render->sw), 1024);
-    SDL_RenderClear(render->render);
-    SDL_RenderCopy(render->render, render->texture, NULL, &sr);
-    SDL_RenderPresent(render->render);
+    if (!sdltex_visible(render->stream))
+        return;
+    raster = scopewriter_get_raster(render->sw);
+    sdltex_compare(render->stream, raster);
+    sdltex_present(render->stream, raster);
 }
 
 void scopewriter_renderer_free(struct scopewriter_renderer *render)
 {
-    if (render->texture)
-        SDL_DestroyTexture(render->texture);
+    if (render->stream)
+        sdltex_free(render->stream);
     free(render);
 }
 
@@ -42,17 +35,6 @@ struct scopewriter_renderer *scopewriter_renderer_create(struct scopewriter *sw)
 {
     struct scopewriter_renderer *render;
 
-    /* We will need a nicer way to do this once we have multiple SDL using
-       devices */
-    if (sdl_live == 0) {
-        sdl_live = 1;
-        if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-            fprintf(stderr, "SDL init failed: %s.\n", SDL_GetError());
-            exit(1);
-        }
-        atexit(SDL_Quit);
-    }
-
     render = malloc(sizeof(struct scopewriter_renderer));
     if (render == NULL) {
         fprintf(stderr, "Out of memory.\n");
@@ -60,33 +42,6 @@ struct scopewriter_renderer *scopewriter_renderer_create(struct scopewriter *sw)
     }
     memset(render, 0, sizeof(struct scopewriter_renderer));
     render->sw = sw;
-    render->window = SDL_CreateWindow("Scopewriter",
-        SDL_WINDOWPOS_UNDEFINED,
-        SDL_WINDOWPOS_UNDEFINED,
-        768, 96,
-        SDL_WINDOW_RESIZABLE);
-    if (render->window == NULL) {
-        fprintf(stderr, "Unable to create window: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    render->render = SDL_CreateRenderer(render->window, -1, SDL_RENDERER_ACCELERATED);
-    if (render->render == NULL) {
-        fprintf(stderr, "Unable to create renderer: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-    SDL_RenderSetLogicalSize(render->render, 256, 32);
-
-    render->texture = SDL_CreateTexture(render->render,
-                        SDL_PIXELFORMAT_ARGB8888,
-                        SDL_TEXTUREACCESS_STREAMING,
-                        256, 32);
-    if (render->render == NULL) {
-        fprintf(stderr, "Unable to create renderer: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    SDL_SetRenderDrawColor(render->render, 0, 0, 0, 255);
-    SDL_RenderClear(render->render);
-    SDL_RenderPresent(render->render);
+    render->stream = sdltex_create("Scopewriter", 768, 96, 256, 32);
     return render;
 }
@@ -5,6 +5,11 @@
 #include <stdint.h>
 #include <string.h>
 #include "sdcard.h"
+#include "blkcache.h"
+#include "trace.h"
+
+/* Blocks fetched at a time for a multiple block read */
+#define SD_READAHEAD	32
 
 struct sdcard {
 	int sd_mode;
@@ -19,11 +24,16 @@ struct sdcard {
 	int sd_outp;
 	int sd_fd;
 	off_t sd_lba;
+	int sd_multi;		/* CMD25 in progress */
+	uint8_t sd_ra[SD_READAHEAD * 512];
+	off_t sd_ra_pos;
+	unsigned int sd_ra_len;
 	int sd_stuff;
 	uint8_t sd_poststuff;
 	int sd_cs;
 	const char *sd_name;
 	int debug;
+	unsigned long long blocks;	/* Read and written, for the metrics */
 };
 
 static const uint8_t sd_csd[17] = {
@@ -47,19 +57,58 @@ static const uint8_t sd_cid[] = {
 	0xFF	/* should be a checksum */
 };
 
+/* Next block of a CMD18 from the read ahead buffer, refilled with one
+   read when we run off the end of it */
+static int sd_readahead(struct sdcard *c, uint8_t *buf)
+{
+	ssize_t len;
+
+	if (c->sd_lba < c->sd_ra_pos || c->sd_lba + 512 > c->sd_ra_pos + c->sd_ra_len) {
+		c->sd_ra_pos = c->sd_lba;
+		c->sd_ra_len = 0;
+		len = blkcache_pread(c->sd_fd, c->sd_ra, sizeof(c->sd_ra), c->sd_lba);
+		if (len < 512)
+			return -1;
+		c->sd_ra_len = len & ~511;
+	}
+	memcpy(buf, c->sd_ra + (c->sd_lba - c->sd_ra_pos), 512);
+	return 0;
+}
+
+/* Queue up the next data token, block and CRC of a multiple block read */
+static int sd_next_block(struct sdcard *c)
+{
+	if (TRACE_ON(c->debug))
+		fprintf(stderr, "%s: Read multiple LBA %lx\n", c->sd_name, (long)c->sd_lba);
+	if (sd_readahead(c, c->sd_out + 2) < 0) {
+		if (TRACE_ON(c->debug))
+			fprintf(stderr, "%s: Read LBA failed.\n", c->sd_name);
+		return -1;
+	}
+	c->sd_out[0] = 0xFF;
+	c->sd_out[1] = 0xFE;
+	c->sd_out[514] = 0xFF;
+	c->sd_out[515] = 0xFF;
+	c->sd_outlen = 516;
+	c->sd_outp = 0;
+	c->sd_lba += 512;
+	c->blocks++;
+	return 0;
+}
+
 static uint8_t sd_process_command(struct sdcard *c)
 {
 	c->sd_stuff = 2 + (rand() & 7);
 	if (c->sd_ext) {
 		c->sd_ext = 0;
-		if (c->debug)
+		if (TRACE_ON(c->debug))
 			fprintf(stderr, "%s: Extended command %x\n", c->sd_name, c->sd_cmd[0]);
 		switch(c->sd_cmd[0]) {
 		default:
 			return 0x7F;
 		}
 	}
-	if (c->debug)
+	if (TRACE_ON(c->debug))
 		fprintf(stderr, "%s: Command received %x\n", c->sd_name, c->sd_cmd[0]);
 	switch(c->sd_cmd[0]) {
 	case 0x40+0:		/* CMD 0 */
@@ -78,6 +127,9 @@ static uint8_t sd_process_command(struct sdcard *c)
 		c->sd_outp = 0;
 		c->sd_mode = 2;
 		return 0x00;
+	case 0x40+12:		/* CMD 12 - stop transmission */
+		/* Any stream was ended when the command began */
+		return 0x00;
 	case 0x40+16:		/* CMD 16 - set block size */
 		/* Should check data is 512 !! FIXME */
 		return 0x00;	/* Sure */
@@ -89,24 +141,34 @@ static uint8_t sd_process_command(struct sdcard *c)
 		c->sd_out[1] = 0xFE;
 		c->sd_lba = c->sd_cmd[4] + 256 * c->sd_cmd[3] + 65536 * c->sd_cmd[2] +
 			16777216 * c->sd_cmd[1];
-		if (c->debug)
+		if (TRACE_ON(c->debug))
 			fprintf(stderr, "%s: Read LBA %lx\n", c->sd_name, (long)c->sd_lba);
-		if (lseek(c->sd_fd, c->sd_lba, SEEK_SET) < 0 || read(c->sd_fd, c->sd_out + 2, 512) != 512) {
-			if (c->debug)
+		if (blkcache_pread(c->sd_fd, c->sd_out + 2, 512, c->sd_lba) != 512) {
+			if (TRACE_ON(c->debug))
 				fprintf(stderr, "%s: Read LBA failed.\n", c->sd_name);
 			return 0x01;
 		}
+		c->blocks++;
 		c->sd_mode = 2;
 		/* Result */
 		return 0x00;
+	case 0x40+18:		/* Read multiple */
+		c->sd_lba = c->sd_cmd[4] + 256 * c->sd_cmd[3] + 65536 * c->sd_cmd[2] +
+			16777216 * c->sd_cmd[1];
+		if (sd_next_block(c) < 0)
+			return 0x40;	/* Parameter error */
+		c->sd_mode = 5;	/* Stream blocks until CMD12 */
+		return 0x00;
 	case 0x40+24:		/* Write */
-		/* Will send us FE data FF FF */
-		if (c->debug)
-			fprintf(stderr, "%s: Write LBA %lx\n", c->sd_name, (long)c->sd_lba);
-		c->sd_inlen = 515;	/* Data FF FF FF */
+	case 0x40+25:		/* Write multiple */
+		/* Will send us FE data FF FF, or FC data FF FF per block then FD */
 		c->sd_lba = c->sd_cmd[4] + 256 * c->sd_cmd[3] + 65536 * c->sd_cmd[2] +
 			16777216 * c->sd_cmd[1];
+		if (TRACE_ON(c->debug))
+			fprintf(stderr, "%s: Write LBA %lx\n", c->sd_name, (long)c->sd_lba);
+		c->sd_inlen = 515;	/* Data FF FF FF */
 		c->sd_inp = 0;
+		c->sd_multi = c->sd_cmd[0] == 0x40+25;
 		c->sd_mode = 4;	/* Send a pad then go to mode 3 */
 		return 0x00;	/* The expected OK */
 #if 0
@@ -124,13 +186,19 @@ static uint8_t sd_process_data(struct sdcard *c)
 {
 	switch(c->sd_cmd[0]) {
 	case 0x40+24:		/* Write */
-		c->sd_mode = 0;
-		if (lseek(c->sd_fd, c->sd_lba, SEEK_SET) < 0 ||
-			write(c->sd_fd, c->sd_in, 512) != 512) {
-			if (c->debug)
+	case 0x40+25:		/* Write multiple */
+		/* CMD25 goes back to wait for the next token */
+		c->sd_mode = c->sd_multi ? 4 : 0;
+		c->sd_inp = 0;
+		c->sd_ra_len = 0;
+		if (blkcache_pwrite(c->sd_fd, c->sd_in, 512, c->sd_lba) != 512) {
+			if (TRACE_ON(c->debug))
 				fprintf(stderr, "%s: Write failed.\n", c->sd_name);
+			c->sd_mode = 0;
 			return 0x1E;	/* Need to look up real values */
 		}
+		c->sd_lba += 512;
+		c->blocks++;
 		return 0x05;	/* Indicate it worked */
 	default:
 		c->sd_mode = 0;
@@ -189,10 +257,30 @@ static uint8_t sd_card_byte(struct sdcard *c, uint8_t in)
 	/* Sync up before data flow starts */
 	if (c->sd_mode == 4) {
 		/* Sync */
-		if (in == 0xFE)
+		if (in == (c->sd_multi ? 0xFC : 0xFE))
 			c->sd_mode = 3;
+		else if (in == 0xFD && c->sd_multi) {
+			/* Stop token for CMD25 */
+			c->sd_multi = 0;
+			c->sd_mode = 0;
+		}
 		return 0xFF;
 	}
+	/* Streaming CMD18 blocks */
+	if (c->sd_mode == 5) {
+		/* The host only sends a command (CMD12) to end it */
+		if (in != 0xFF) {
+			c->sd_mode = 1;
+			c->sd_cmdp = 1;
+			c->sd_cmd[0] = in;
+			return 0xFF;
+		}
+		if (c->sd_outp == c->sd_outlen && sd_next_block(c) < 0) {
+			c->sd_mode = 0;
+			return 0xFF;
+		}
+		return c->sd_out[c->sd_outp++];
+	}
 	return 0xFF;
 }
 
@@ -202,6 +290,7 @@ static uint8_t sd_card_byte(struct sdcard *c, uint8_t in)
 void sd_spi_raise_cs(struct sdcard *c)
 {
 	c->sd_mode = 0;
+	c->sd_multi = 0;
 	c->sd_cs = 1;
 }
 
@@ -217,10 +306,80 @@ uint8_t sd_spi_in(struct sdcard *c, uint8_t v)
 	return sd_card_byte(c, v);
 }
 
+/* How much of a burst can be handled as a plain copy in the current
+   state. The byte that ends a data phase always goes the slow way so
+   the state machine sees it */
+static unsigned int sd_block_run(struct sdcard *c, const uint8_t *in, unsigned int len)
+{
+	unsigned int n = 0;
+
+	if (c->sd_cs || c->sd_fd == -1 || c->sd_stuff)
+		return 0;
+	switch (c->sd_mode) {
+	case 2:
+	case 5:
+		n = c->sd_outlen - c->sd_outp;
+		if (c->sd_mode == 2)
+			n--;
+		break;
+	case 3:
+		n = c->sd_inlen - c->sd_inp - 1;
+		break;
+	default:
+		return 0;
+	}
+	if (n > len)
+		n = len;
+	/* The host ends a CMD18 stream by sending a command */
+	if (c->sd_mode == 5 && in) {
+		unsigned int i;
+		for (i = 0; i < n; i++)
+			if (in[i] != 0xFF)
+				break;
+		n = i;
+	}
+	return n;
+}
+
+/*
+ *	Transfer a burst of bytes. Block data is copied in one go rather
+ *	than stepping the card a byte at a time. in may be NULL to clock out
+ *	0xFF and out NULL to discard the replies.
+ */
+void sd_spi_in_block(struct sdcard *c, const uint8_t *in, uint8_t *out, unsigned int len)
+{
+	while (len) {
+		unsigned int n = sd_block_run(c, in, len);
+		if (n == 0) {
+			uint8_t r = sd_spi_in(c, in ? *in : 0xFF);
+			if (out)
+				*out = r;
+			n = 1;
+		} else if (c->sd_mode == 3) {
+			if (in)
+				memcpy(c->sd_in + c->sd_inp, in, n);
+			else
+				memset(c->sd_in + c->sd_inp, 0xFF, n);
+			c->sd_inp += n;
+			if (out)
+				memset(out, 0xFF, n);
+		} else {
+			if (out)
+				memcpy(out, c->sd_out + c->sd_outp, n);
+			c->sd_outp += n;
+		}
+		if (in)
+			in += n;
+		if (out)
+			out += n;
+		len -= n;
+	}
+}
+
 void sd_detach(struct sdcard *c)
 {
 	if (c->sd_fd != -1) {
-		close(c->sd_fd);
+		blkcache_close(c->sd_fd);
 		c->sd_fd = -1;
 	}
 }
@@ -231,6 +390,11 @@ void sd_attach(struct sdcard *c, int fd)
 	c->sd_fd = fd;
 }
 
+unsigned long long sd_blocks(struct sdcard *c)
+{
+	return c->blocks;
+}
+
 void sd_trace(struct sdcard *c, int onoff)
 {
 	c->debug = onoff;
@@ -10,8 +10,10 @@ extern void sd_free(struct sdcard *c);
 extern void sd_trace(struct sdcard *c, int onoff);
 extern void sd_attach(struct sdcard *c, int fd);
 extern void sd_detach(struct sdcard *c);
+extern unsigned long long sd_blocks(struct sdcard *c);
 
 extern uint8_t sd_spi_in(struct sdcard *c, uint8_t v);
+extern void sd_spi_in_block(struct sdcard *c, const uint8_t *in, uint8_t *out, unsigned int len);
 extern void sd_spi_raise_cs(struct sdcard *c);
 extern void sd_spi_lower_cs(struct sdcard *c);
 
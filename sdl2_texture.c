@@ -0,0 +1,530 @@
+/*
+ *	SDL2 display thread and streaming texture updates
+ *
+ *	All SDL calls are made from one display thread which owns the
+ *	windows, presents frames and pumps the SDL event queue. The
+ *	emulation never waits on it. Each emulated frame the changed rows
+ *	are copied into a spare buffer which is swapped in as the newest
+ *	frame. The display thread picks up the newest frame when the
+ *	display can next take one, uploads only the rows that are newer
+ *	than what the texture holds and presents. Frames the display
+ *	couldn't keep up with are simply replaced. Events go the other way
+ *	through a ring the emulation drains with sdltex_poll_event.
+ *
+ *	Nothing is uploaded or presented for an unchanged picture except
+ *	after a window resize and once a second in case something else drew
+ *	over us. The window events tell the emulation whether anyone can
+ *	see the window so it can skip drawing frames for a minimized one.
+ *
+ *	Each window can also be recorded by setting its title in capitals
+ *	followed by _RECORD (TMS9918A_RECORD, NC100_RECORD, ...) in the
+ *	environment to a vidrec spec, and streamed with _STREAM and a
+ *	framestream spec as the headless builds do. A window being recorded
+ *	or streamed counts as seen.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+
+#include "sdl2_texture.h"
+#include "replay.h"
+#include "vidrec.h"
+#include "framestream.h"
+
+#define MAX_SDLTEX	4
+#define EVENT_RING	256	/* Power of two */
+#define FRESH		4	/* Set in mid when it holds an unseen frame */
+
+struct sdltex {
+    /* Fixed at creation */
+    const char *title;
+    int init_w;
+    int init_h;
+    unsigned int width;
+    unsigned int height;
+    uint32_t *buf[3];
+    uint32_t bufseq[3];		/* Frame each buffer holds */
+    char recenv[32];
+    struct vidrec *rec;
+    char streamenv[32];
+    struct framestream *stream;
+    /* Shared */
+    atomic_uint mid;		/* Buffer handed over, plus FRESH */
+    atomic_uint *rowseq;	/* Frame each row last changed in */
+    atomic_int visible;		/* Window is shown and not minimized */
+    atomic_int focused;		/* Window has the keyboard */
+    /* Emulation side */
+    int opened;			/* Window made, at the first frame */
+    unsigned int back;
+    uint32_t seq;
+    uint8_t *pending;		/* Rows changed since the last frame */
+    unsigned int changed;
+    uint32_t *shadow;		/* Last raster seen by sdltex_compare */
+    /* Display side */
+    SDL_Renderer *render;
+    SDL_Texture *texture;
+    SDL_Window *window;
+    unsigned int front;
+    uint32_t *uploaded;		/* Frame each texture row came from */
+    Uint32 interval;		/* Display refresh in ms */
+    Uint32 last;		/* When we last presented */
+    int win_w;
+    int win_h;
+};
+
+static pthread_t sdl_thread;
+static pthread_mutex_t sdl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sdl_cv = PTHREAD_COND_INITIALIZER;
+static int sdl_live;
+static atomic_int sdl_stop;
+
+/* Work handed to the display thread, protected by sdl_lock */
+static void (*sdl_call_fn)(void *);
+static void *sdl_call_arg;
+
+/* Only touched by the display thread */
+static struct sdltex *sdl_tex[MAX_SDLTEX];
+
+static SDL_Event sdl_events[EVENT_RING];
+static atomic_uint ev_head;
+static atomic_uint ev_tail;
+
+static void sdl_queue_event(SDL_Event *ev)
+{
+    unsigned int h = atomic_load_explicit(&ev_head, memory_order_relaxed);
+
+    /* If the emulation is not reading them drop the newest */
+    if (h - atomic_load_explicit(&ev_tail, memory_order_acquire) == EVENT_RING)
+        return;
+    sdl_events[h & (EVENT_RING - 1)] = *ev;
+    atomic_store_explicit(&ev_head, h + 1, memory_order_release);
+}
+
+static int sdl_take_event(SDL_Event *ev)
+{
+    unsigned int t = atomic_load_explicit(&ev_tail, memory_order_relaxed);
+
+    if (t == atomic_load_explicit(&ev_head, memory_order_acquire))
+        return 0;
+    *ev = sdl_events[t & (EVENT_RING - 1)];
+    atomic_store_explicit(&ev_tail, t + 1, memory_order_release);
+    return 1;
+}
+
+/* Called from the emulation in place of SDL_PollEvent. Events go in the
+   replay log, and when replaying come from it with only a quit taken
+   from the window */
+int sdltex_poll_event(SDL_Event *ev)
+{
+    if (replay_playing()) {
+        while (sdl_take_event(ev))
+            if (ev->type == SDL_QUIT)
+                return 1;
+        return replay_get(REPLAY_KEY, ev, sizeof(*ev)) == sizeof(*ev);
+    }
+    if (!sdl_take_event(ev))
+        return 0;
+    replay_put(REPLAY_KEY, ev, sizeof(*ev));
+    return 1;
+}
+
+/* Upload the rows the newest frame has that the texture does not */
+static int sdltex_upload(struct sdltex *t)
+{
+    unsigned int first = t->height;
+    unsigned int last = 0;
+    uint32_t *raster;
+    uint32_t seq;
+    unsigned int i, r;
+    SDL_Rect rect;
+    void *pixels;
+    int pitch;
+
+    if (atomic_load(&t->mid) & FRESH)
+        t->front = atomic_exchange(&t->mid, t->front) & 3;
+    raster = t->buf[t->front];
+    seq = t->bufseq[t->front];
+
+    for (i = 0; i < t->height; i++) {
+        r = atomic_load_explicit(&t->rowseq[i], memory_order_relaxed);
+        /* Rows changed after this frame wait for a newer one */
+        if (r > t->uploaded[i] && r <= seq) {
+            if (first > i)
+                first = i;
+            last = i + 1;
+        }
+    }
+    if (first >= last)
+        return 0;
+
+    /* Every buffer is a whole frame so the span can be copied as is */
+    rect.x = 0;
+    rect.y = first;
+    rect.w = t->width;
+    rect.h = last - first;
+    if (SDL_LockTexture(t->texture, &rect, &pixels, &pitch) == 0) {
+        for (i = first; i < last; i++)
+            memcpy((uint8_t *)pixels + (i - first) * pitch,
+                raster + i * t->width, t->width * sizeof(uint32_t));
+        SDL_UnlockTexture(t->texture);
+    } else
+        SDL_UpdateTexture(t->texture, &rect, raster + first * t->width,
+            t->width * sizeof(uint32_t));
+    for (i = first; i < last; i++)
+        t->uploaded[i] = seq;
+    return 1;
+}
+
+static void sdltex_show(struct sdltex *t, Uint32 now)
+{
+    int w, h;
+    int resized = 0;
+
+    SDL_GetWindowSize(t->window, &w, &h);
+    if (w != t->win_w || h != t->win_h) {
+        t->win_w = w;
+        t->win_h = h;
+        resized = 1;
+    }
+    if (now - t->last < t->interval)
+        return;
+    if (SDL_GetWindowFlags(t->window) & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED))
+        return;
+    if (!sdltex_upload(t) && !resized && now - t->last < 1000)
+        return;
+    SDL_RenderClear(t->render);
+    SDL_RenderCopy(t->render, t->texture, NULL, NULL);
+    SDL_RenderPresent(t->render);
+    t->last = now;
+}
+
+/* Track the visibility and focus of our windows for the emulation */
+static void sdltex_window_event(SDL_WindowEvent *wev)
+{
+    struct sdltex *t = NULL;
+    unsigned int i;
+
+    for (i = 0; i < MAX_SDLTEX; i++)
+        if (sdl_tex[i] && SDL_GetWindowID(sdl_tex[i]->window) == wev->windowID)
+            t = sdl_tex[i];
+    if (t == NULL)
+        return;
+    switch (wev->event) {
+    case SDL_WINDOWEVENT_SHOWN:
+    case SDL_WINDOWEVENT_EXPOSED:
+    case SDL_WINDOWEVENT_RESTORED:
+    case SDL_WINDOWEVENT_MAXIMIZED:
+        atomic_store(&t->visible, 1);
+        break;
+    case SDL_WINDOWEVENT_HIDDEN:
+    case SDL_WINDOWEVENT_MINIMIZED:
+        atomic_store(&t->visible, 0);
+        break;
+    case SDL_WINDOWEVENT_FOCUS_GAINED:
+        atomic_store(&t->focused, 1);
+        break;
+    case SDL_WINDOWEVENT_FOCUS_LOST:
+        atomic_store(&t->focused, 0);
+        break;
+    }
+}
+
+static void sdltex_open(void *arg)
+{
+    struct sdltex *t = arg;
+    SDL_DisplayMode mode;
+    unsigned int i;
+
+    t->window = SDL_CreateWindow(t->title,
+        SDL_WINDOWPOS_UNDEFINED,
+        SDL_WINDOWPOS_UNDEFINED,
+        t->init_w, t->init_h,
+        SDL_WINDOW_RESIZABLE);
+    if (t->window == NULL) {
+        fprintf(stderr, "Unable to create window: %s.\n", SDL_GetError());
+        exit(1);
+    }
+    t->render = SDL_CreateRenderer(t->window, -1, 0);
+    if (t->render == NULL) {
+        fprintf(stderr, "Unable to create renderer: %s.\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    SDL_RenderSetLogicalSize(t->render, t->width, t->height);
+    t->texture = SDL_CreateTexture(t->render,
+                        SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_STREAMING,
+                        t->width, t->height);
+    if (t->texture == NULL) {
+        fprintf(stderr, "Unable to create texture: %s.\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_SetRenderDrawColor(t->render, 0, 0, 0, 255);
+    SDL_RenderClear(t->render);
+    SDL_RenderPresent(t->render);
+
+    t->interval = 1000 / 60;
+    if (SDL_GetWindowDisplayMode(t->window, &mode) == 0 && mode.refresh_rate > 0)
+        t->interval = 1000 / mode.refresh_rate;
+    t->last = SDL_GetTicks() - 1000;
+
+    for (i = 0; i < MAX_SDLTEX; i++) {
+        if (sdl_tex[i] == NULL) {
+            sdl_tex[i] = t;
+            return;
+        }
+    }
+    fprintf(stderr, "Too many SDL windows.\n");
+    exit(1);
+}
+
+static void sdltex_close(void *arg)
+{
+    struct sdltex *t = arg;
+    unsigned int i;
+
+    for (i = 0; i < MAX_SDLTEX; i++)
+        if (sdl_tex[i] == t)
+            sdl_tex[i] = NULL;
+    SDL_DestroyTexture(t->texture);
+    SDL_DestroyRenderer(t->render);
+    SDL_DestroyWindow(t->window);
+}
+
+static void *sdl_main(void *unused)
+{
+    SDL_Event ev;
+    Uint32 now;
+    unsigned int i;
+
+    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
+        fprintf(stderr, "SDL init failed: %s.\n", SDL_GetError());
+        exit(1);
+    }
+    pthread_mutex_lock(&sdl_lock);
+    sdl_live = 1;
+    pthread_cond_broadcast(&sdl_cv);
+    pthread_mutex_unlock(&sdl_lock);
+
+    while (!atomic_load(&sdl_stop)) {
+        pthread_mutex_lock(&sdl_lock);
+        if (sdl_call_fn) {
+            sdl_call_fn(sdl_call_arg);
+            sdl_call_fn = NULL;
+            pthread_cond_broadcast(&sdl_cv);
+        }
+        pthread_mutex_unlock(&sdl_lock);
+
+        /* Sleep until there is input or it is time for a frame */
+        if (SDL_WaitEventTimeout(&ev, 1000 / 120))
+            do {
+                if (ev.type == SDL_WINDOWEVENT)
+                    sdltex_window_event(&ev.window);
+                sdl_queue_event(&ev);
+            } while (SDL_PollEvent(&ev));
+
+        now = SDL_GetTicks();
+        for (i = 0; i < MAX_SDLTEX; i++)
+            if (sdl_tex[i])
+                sdltex_show(sdl_tex[i], now);
+    }
+    for (i = 0; i < MAX_SDLTEX; i++)
+        if (sdl_tex[i])
+            sdltex_close(sdl_tex[i]);
+    SDL_Quit();
+    return NULL;
+}
+
+static void sdl_shutdown(void)
+{
+    /* Whoever exits we mustn't wait for ourself */
+    if (pthread_equal(pthread_self(), sdl_thread))
+        return;
+    atomic_store(&sdl_stop, 1);
+    pthread_join(sdl_thread, NULL);
+}
+
+/* Run fn on the display thread and wait for it */
+static void sdl_call(void (*fn)(void *), void *arg)
+{
+    pthread_mutex_lock(&sdl_lock);
+    if (!sdl_live) {
+        if (pthread_create(&sdl_thread, NULL, sdl_main, NULL)) {
+            fprintf(stderr, "Unable to start display thread.\n");
+            exit(1);
+        }
+        atexit(sdl_shutdown);
+        while (!sdl_live)
+            pthread_cond_wait(&sdl_cv, &sdl_lock);
+    }
+    while (sdl_call_fn)
+        pthread_cond_wait(&sdl_cv, &sdl_lock);
+    sdl_call_fn = fn;
+    sdl_call_arg = arg;
+    while (sdl_call_fn == fn && sdl_call_arg == arg)
+        pthread_cond_wait(&sdl_cv, &sdl_lock);
+    pthread_mutex_unlock(&sdl_lock);
+}
+
+struct sdltex *sdltex_create(const char *title, int win_w, int win_h, unsigned int width, unsigned int height)
+{
+    struct sdltex *t = calloc(1, sizeof(struct sdltex));
+    unsigned int i;
+
+    if (t == NULL || (t->pending = malloc(height)) == NULL ||
+        (t->rowseq = calloc(height, sizeof(atomic_uint))) == NULL ||
+        (t->uploaded = calloc(height, sizeof(uint32_t))) == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for (i = 0; i < 3; i++) {
+        t->buf[i] = calloc(width * height, sizeof(uint32_t));
+        if (t->buf[i] == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    t->title = title;
+    t->init_w = win_w;
+    t->init_h = win_h;
+    t->width = width;
+    t->height = height;
+    t->back = 0;
+    t->front = 1;
+    atomic_init(&t->mid, 2);
+    for (i = 0; i < height; i++)
+        atomic_init(&t->rowseq[i], 0);
+    atomic_init(&t->visible, 1);
+    atomic_init(&t->focused, 0);
+    /* The texture starts undefined so the first frame is all of it */
+    memset(t->pending, 1, height);
+    t->changed = 1;
+    for (i = 0; title[i] && i < sizeof(t->recenv) - 8; i++)
+        t->recenv[i] = isalnum((unsigned char)title[i]) ? toupper((unsigned char)title[i]) : '_';
+    strcpy(t->recenv + i, "_RECORD");
+    t->rec = vidrec_create(t->recenv, width, height);
+    memcpy(t->streamenv, t->recenv, i);
+    strcpy(t->streamenv + i, "_STREAM");
+    t->stream = framestream_create(t->streamenv, width, height);
+    /* SDL and the window wait for the first frame so a run that ends
+       before it, such as a forked test, never starts them */
+    return t;
+}
+
+/* Can anyone see the window. When not the board can skip drawing its
+   frames as long as it catches up the changes once it can */
+int sdltex_visible(struct sdltex *t)
+{
+    return t->rec || t->stream || atomic_load_explicit(&t->visible, memory_order_relaxed);
+}
+
+/* Recorded or streamed windows want every frame presented, changed or not */
+int sdltex_recording(struct sdltex *t)
+{
+    return t->rec || t->stream;
+}
+
+int sdltex_focused(struct sdltex *t)
+{
+    return atomic_load_explicit(&t->focused, memory_order_relaxed);
+}
+
+/* Merge in the changed line flags from a device that tracks them */
+void sdltex_dirty(struct sdltex *t, const uint8_t *lines)
+{
+    unsigned int i;
+
+    for (i = 0; i < t->height; i++) {
+        if (lines[i]) {
+            t->pending[i] = 1;
+            t->changed = 1;
+        }
+    }
+}
+
+/* Or for a device that just knows a band of rows changed */
+void sdltex_dirty_span(struct sdltex *t, unsigned int first, unsigned int last)
+{
+    if (first >= last)
+        return;
+    memset(t->pending + first, 1, last - first);
+    t->changed = 1;
+}
+
+/* For devices that don't, find the changed rows against a copy */
+void sdltex_compare(struct sdltex *t, const uint32_t *raster)
+{
+    size_t row = t->width * sizeof(uint32_t);
+    unsigned int i;
+
+    if (t->shadow == NULL) {
+        t->shadow = malloc(row * t->height);
+        if (t->shadow == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memcpy(t->shadow, raster, row * t->height);
+        return;
+    }
+    for (i = 0; i < t->height; i++) {
+        if (memcmp(t->shadow + i * t->width, raster + i * t->width, row)) {
+            memcpy(t->shadow + i * t->width, raster + i * t->width, row);
+            t->pending[i] = 1;
+            t->changed = 1;
+        }
+    }
+}
+
+/* Call each emulated frame. Hands the raster to the display thread */
+void sdltex_present(struct sdltex *t, const uint32_t *raster)
+{
+    uint32_t *bp = t->buf[t->back];
+    uint32_t old = t->bufseq[t->back];
+    unsigned int i;
+
+    vidrec_frame(t->rec, raster);
+    framestream_frame(t->stream, raster);
+    if (!t->changed)
+        return;
+    if (!t->opened) {
+        sdl_call(sdltex_open, t);
+        t->opened = 1;
+    }
+    t->seq++;
+    for (i = 0; i < t->height; i++) {
+        if (t->pending[i]) {
+            atomic_store_explicit(&t->rowseq[i], t->seq, memory_order_relaxed);
+            t->pending[i] = 0;
+        }
+        /* Bring the spare buffer up to date from whenever it was last ours */
+        if (atomic_load_explicit(&t->rowseq[i], memory_order_relaxed) > old)
+            memcpy(bp + i * t->width, raster + i * t->width,
+                t->width * sizeof(uint32_t));
+    }
+    t->bufseq[t->back] = t->seq;
+    t->back = atomic_exchange(&t->mid, t->back | FRESH) & 3;
+    t->changed = 0;
+}
+
+void sdltex_free(struct sdltex *t)
+{
+    unsigned int i;
+
+    if (t->opened)
+        sdl_call(sdltex_close, t);
+    vidrec_free(t->rec);
+    framestream_free(t->stream);
+    for (i = 0; i < 3; i++)
+        free(t->buf[i]);
+    free(t->uploaded);
+    free(t->rowseq);
+    free(t->shadow);
+    free(t->pending);
+    free(t);
+}
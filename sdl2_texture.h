@@ -0,0 +1,33 @@
+#ifndef __SDL2_TEXTURE_H
+#define __SDL2_TEXTURE_H
+
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+/*
+ *	Streaming texture output shared by the SDL2 video backends. Changed
+ *	rows are collected each emulated frame and handed to a display
+ *	thread which owns the windows and shows the newest frame when the
+ *	display can next take one. SDL events are read with
+ *	sdltex_poll_event instead of SDL_PollEvent as only the display
+ *	thread may talk to SDL.
+ *
+ *	sdltex_visible says whether the window is shown and not minimized,
+ *	so that a board can stop drawing frames nobody can see. A window
+ *	can be recorded in the background, see vidrec.h.
+ */
+
+struct sdltex;
+
+extern struct sdltex *sdltex_create(const char *title, int win_w, int win_h, unsigned int width, unsigned int height);
+extern void sdltex_dirty(struct sdltex *t, const uint8_t *lines);
+extern void sdltex_dirty_span(struct sdltex *t, unsigned int first, unsigned int last);
+extern void sdltex_compare(struct sdltex *t, const uint32_t *raster);
+extern void sdltex_present(struct sdltex *t, const uint32_t *raster);
+extern void sdltex_free(struct sdltex *t);
+extern int sdltex_visible(struct sdltex *t);
+extern int sdltex_focused(struct sdltex *t);
+extern int sdltex_recording(struct sdltex *t);
+extern int sdltex_poll_event(SDL_Event *ev);
+
+#endif
@@ -47,6 +47,9 @@
 #include "z80dis.h"
 #include "ide.h"
 #include "rtc_bitbang.h"
+#include "trace.h"
+#include "cpuclock.h"
+#include "z80run.h"
 
 static uint8_t ram[512 * 1024];
 static uint8_t rom[65536];
@@ -88,7 +91,7 @@ static volatile int done;
 
 static int trace = 0;
 
-static void reti_event(void);
+static void reti_event(int unused);
 
 static uint8_t do_mem_read(uint16_t addr, bool debug)
 {
@@ -110,41 +113,22 @@ static uint8_t do_mem_read(uint16_t addr, bool debug)
 
 static uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate;
 	uint8_t r;
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R");
 
 	r = do_mem_read(addr, false);
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, " %04X <- %02X\n", addr, r);
 
-	/* Look for ED with M1, followed directly by 4D and if so trigger
-	   the interrupt chain */
-	if (cpu_z80.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r== 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1)
-		reti_event();
-	rstate = 0;
 	return r;
 }
 
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04X -> %02X\n", addr, val);
 	if (romen && val != rom[addr]) {
 		fprintf(stderr, "[PC = %04X: WHAZARD %04X %02x %02X]\n",
@@ -211,7 +195,7 @@ static void simple80_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -261,7 +245,7 @@ static struct z80_sio_chan sio[2];
 
 static void sio2_clear_int(struct z80_sio_chan *chan, uint8_t m)
 {
-	if (trace & TRACE_IRQ) {
+	if (TRACE_ON(trace & TRACE_IRQ)) {
 		fprintf(stderr, "Clear intbits %d %x\n",
 			(int)(chan - sio), m);
 	}
@@ -280,7 +264,7 @@ static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
 	uint8_t new = (chan->intbits ^ m) & m;
 	uint8_t vector;
 	chan->intbits |= m;
-	if ((trace & TRACE_SIO) && new)
+	if (TRACE_ON(trace & TRACE_SIO) && new)
 		fprintf(stderr, "SIO raise int %x new = %x\n", m, new);
 	if (new) {
 		if (!sio->irq) {
@@ -298,7 +282,7 @@ static void sio2_raise_int(struct z80_sio_chan *chan, uint8_t m)
 				else if (chan->intbits & INT_ERR)
 					vector |= 2;
 			}
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "SIO2 interrupt %02X\n", vector);
 			chan->vector = vector;
 			recalc_interrupts();
@@ -324,7 +308,7 @@ static int sio2_check_im2(struct z80_sio_chan *chan)
 			chan->vector += (sio[1].wr[2] & 0xF1);
 		else
 			chan->vector += sio[1].wr[2];
-		if (trace & (TRACE_IRQ|TRACE_SIO))
+		if (TRACE_ON(trace & (TRACE_IRQ|TRACE_SIO)))
 			fprintf(stderr, "New live interrupt pending is SIO (%d:%02X).\n",
 				(int)(chan - sio), chan->vector);
 		if (chan == sio)
@@ -344,7 +328,7 @@ static int sio2_check_im2(struct z80_sio_chan *chan)
  */
 static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 {
-	if (trace & TRACE_SIO)
+	if (TRACE_ON(trace & TRACE_SIO))
 		fprintf(stderr, "SIO %d queue %d: ",
 			(int) (chan - sio), c);
 	/* Receive disabled */
@@ -354,7 +338,7 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 	}
 	/* Overrun */
 	if (chan->dptr == 2) {
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Overrun.\n");
 		chan->data[2] = c;
 		chan->rr[1] |= 0x20;	/* Overrun flagged */
@@ -362,7 +346,7 @@ static void sio2_queue(struct z80_sio_chan *chan, uint8_t c)
 		sio2_raise_int(chan, INT_ERR);
 	} else {
 		/* FIFO add */
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "Queued %d (mode %d)\n",
 				chan->dptr, chan->wr[1] & 0x18);
 		chan->data[chan->dptr++] = c;
@@ -437,18 +421,18 @@ static uint8_t sio2_read(uint16_t addr)
 		if (chan == sio && (sio[0].intbits | sio[1].intbits))
 			chan->rr[0] |= 2;
 
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read reg %d = ",
 				(addr & 2) ? 'b' : 'a', r);
 		switch (r) {
 		case 0:
 		case 1:
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "%02X\n", chan->rr[r]);
 			return chan->rr[r];
 		case 2:
 			if (chan != sio) {
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr, "%02X\n",
 						chan->rr[2]);
 				return chan->rr[2];
@@ -470,7 +454,7 @@ static uint8_t sio2_read(uint16_t addr)
 		sio2_clear_int(chan, INT_RX);
 		chan->rr[0] &= 0x3F;
 		chan->rr[1] &= 0x3F;
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c read data %d\n",
 				(addr & 2) ? 'b' : 'a', c);
 		if (chan->dptr && (chan->wr[1] & 0x10))
@@ -485,7 +469,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 	struct z80_sio_chan *chan = (addr & 2) ? sio + 1 : sio;
 	uint8_t r;
 	if (addr & 1) {
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr,
 				"sio%c write reg %d with %02X\n",
 				(addr & 2) ? 'b' : 'a',
@@ -503,12 +487,12 @@ static void sio2_write(uint16_t addr, uint8_t val)
 			case 020:	/* Reset external/status interrupts */
 				sio2_clear_int(chan, INT_ERR);
 				chan->rr[1] &= 0xCF;	/* Clear status bits on rr0 */
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr,
 						"[extint reset]\n");
 				break;
 			case 030:	/* Channel reset */
-				if (trace & TRACE_SIO)
+				if (TRACE_ON(trace & TRACE_SIO))
 					fprintf(stderr,
 						"[channel reset]\n");
 				sio2_channel_reset(chan);
@@ -539,11 +523,11 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		case 1:
 			if (chan == sio) {
 				romen = (val & 0x40) ? 0 : 1;
-				if (trace & TRACE_BANK)
+				if (TRACE_ON(trace & TRACE_BANK))
 					fprintf(stderr, "[ROMen = %d.]\n", romen);
 			} else if (!r16bug && !boardmod) {
 				banknum = (val & 0x40) ? 0 : 1;
-				if (trace & TRACE_BANK)
+				if (TRACE_ON(trace & TRACE_BANK))
 					fprintf(stderr, "[RAM A16 = %d.]\n", banknum);
 			}
 			/* Fall through */
@@ -554,7 +538,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		case 6:
 		case 7:
 			r = chan->wr[0] & 7;
-			if (trace & TRACE_SIO)
+			if (TRACE_ON(trace & TRACE_SIO))
 				fprintf(stderr, "sio%c: wrote r%d to %02X\n",
 					(addr & 2) ? 'b' : 'a', r, val);
 			chan->wr[r] = val;
@@ -565,7 +549,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 				/* Setting DTRA high sets the pin low which turns on
 				   the RAM */
 				ramen = (val & 0x80) ? 1 : 0;
-				if (trace & TRACE_BANK)
+				if (TRACE_ON(trace & TRACE_BANK))
 					fprintf(stderr, "[RAMen = %d.]\n", ramen);
 			}
 			if (boardmod) {
@@ -574,7 +558,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 					banknum &= ~0x04;
 					/* RTSA is A18 */
 					banknum |= (val & 0x02) ? 0x00 : 0x04;
-					if (trace & TRACE_BANK)
+					if (TRACE_ON(trace & TRACE_BANK))
 						fprintf(stderr, "[banknum = %d.]\n", banknum);
 				}
 				/* DTRB is A17, RTSB is A16 */
@@ -595,7 +579,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 							ramen2 = 1;
 						banknum &= 1;
 					}
-					if (trace & TRACE_BANK)
+					if (TRACE_ON(trace & TRACE_BANK))
 						fprintf(stderr, "[banknum = %d, RAMen2 = %d.]\n", banknum, ramen2);
 				}
 			}
@@ -610,7 +594,7 @@ static void sio2_write(uint16_t addr, uint8_t val)
 		chan->txint = 1;
 		/* Should check chan->wr[5] & 8 */
 		sio2_clear_int(chan, INT_TX);
-		if (trace & TRACE_SIO)
+		if (TRACE_ON(trace & TRACE_SIO))
 			fprintf(stderr, "sio%c write data %d\n",
 				(addr & 2) ? 'b' : 'a', val);
 		write(1, &val, 1);
@@ -683,7 +667,7 @@ static void ctc_interrupt(struct z80_ctc *c)
 		if (!(ctc_irqmask & (1 << i))) {
 			ctc_irqmask |= 1 << i;
 			recalc_interrupts();
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d wants to interrupt.\n", i);
 		}
 	}
@@ -693,7 +677,7 @@ static void ctc_reti(int ctcnum)
 {
 	if (ctc_irqmask & (1 << ctcnum)) {
 		ctc_irqmask &= ~(1 << ctcnum);
-		if (trace & TRACE_IRQ)
+		if (TRACE_ON(trace & TRACE_IRQ))
 			fprintf(stderr, "Acked interrupt from CTC %d.\n", ctcnum);
 	}
 }
@@ -709,7 +693,7 @@ static int ctc_check_im2(void)
 			if (ctc_irqmask & (1 << i)) {
 				uint8_t vector = ctc[0].vector & 0xF8;
 				vector += 2 * i;
-				if (trace & TRACE_IRQ)
+				if (TRACE_ON(trace & TRACE_IRQ))
 					fprintf(stderr, "New live interrupt is from CTC %d vector %x.\n", i, vector);
 				live_irq = IRQ_CTC + i;
 				Z80INT(&cpu_z80, vector);
@@ -789,37 +773,37 @@ static void ctc_write(uint8_t channel, uint8_t val)
 {
 	struct z80_ctc *c = ctc + channel;
 	if (c->ctrl & CTC_TCONST) {
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d constant loaded with %02X\n", channel, val);
 		c->reload = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == (CTC_TCONST|CTC_RESET)) {
 			c->count = (c->reload - 1) << 8;
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
 		c->ctrl &= ~CTC_TCONST|CTC_RESET;
 	} else if (val & CTC_CONTROL) {
 		/* We don't yet model the weirdness around edge wanted
 		   toggling and clock starts */
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d control loaded with %02X\n", channel, val);
 		c->ctrl = val;
 		if ((c->ctrl & (CTC_TCONST|CTC_RESET)) == CTC_RESET) {
 			c->count = (c->reload - 1) << 8;
-			if (trace & TRACE_CTC)
+			if (TRACE_ON(trace & TRACE_CTC))
 				fprintf(stderr, "CTC %d constant reloaded with %02X\n", channel, val);
 		}
 		/* Undocumented */
 		if (!(c->ctrl & CTC_IRQ) && (ctc_irqmask & (1 << channel))) {
 			ctc_irqmask &= ~(1 << channel);
 			if (ctc_irqmask == 0) {
-				if (trace & TRACE_IRQ)
+				if (TRACE_ON(trace & TRACE_IRQ))
 					fprintf(stderr, "CTC %d irq reset.\n", channel);
 				recalc_interrupts();
 			}
 		}
 	} else {
-		if (trace & TRACE_CTC)
+		if (TRACE_ON(trace & TRACE_CTC))
 			fprintf(stderr, "CTC %d vector loaded with %02X\n", channel, val);
 		c->vector = val;
 	}
@@ -828,7 +812,7 @@ static void ctc_write(uint8_t channel, uint8_t val)
 static uint8_t ctc_read(uint8_t channel)
 {
 	uint8_t val = ctc[channel].count >> 8;
-	if (trace & TRACE_CTC)
+	if (TRACE_ON(trace & TRACE_CTC))
 		fprintf(stderr, "CTC %d reads %02x\n", channel, val);
 	return val;
 }
@@ -847,7 +831,7 @@ static uint8_t do_io_read(int unused, uint16_t addr)
 		return rtc_read(rtc);
 	if ((addr & 0xF0) == 0xD0)
 		return ctc_read(addr & 3);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
@@ -856,14 +840,14 @@ static uint8_t io_read(int unused, uint16_t addr)
 {
 	uint8_t r;
 	r = do_io_read(unused, addr);
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "I/O Read %04x -> %02X\n", addr, r);
 	return r;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "I/O Write %04x <- %02x\n", addr, val);
 	if (sioa15 && addr < 0x8000)
 		sio2_write(addr & 3, val);
@@ -878,7 +862,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 		ctc_write(addr & 3, val);
 	else if (addr == 0xFD)
 		trace = val;
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr,
 			"Unknown write to port %04X of %02X\n", addr, val);
 }
@@ -890,7 +874,7 @@ static void poll_irq_event(void)
 	ctc_check_im2();
 }
 
-static void reti_event(void)
+static void reti_event(int unused)
 {
 	sio2_reti(sio);
 	sio2_reti(sio + 1);
@@ -918,20 +902,42 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "simple80: [-f] [-t] [-i path] [-r path] [-d debug]\n");
+	fprintf(stderr, "simple80: [-f] [-X MHz] [-t] [-i path] [-r path] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
+/* Run between each slice of CPU time */
+static void simple80_step(void)
+{
+	sio2_timer();
+	ctc_tick(364);
+}
+
+static void simple80_tick(void)
+{
+	if (int_recalc) {
+		/* If there is no pending Z80 vector IRQ but we think
+		   there now might be one we use the same logic as for
+		   reti */
+		poll_irq_event();
+		/* Clear this after because reti_event may set the
+		   flags to indicate there is more happening. We will
+		   pick up the next state changes on the reti if so */
+		if (!(cpu_z80.IFF1|cpu_z80.IFF2))
+			int_recalc = 0;
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
+	static struct z80run run;
 	int opt;
 	int fd;
 	int l;
 	char *rompath = "simple80.rom";
 	char *idepath = "simple80.cf";
 
-	while ((opt = getopt(argc, argv, "d:i:r:ftb15S")) != -1) {
+	while ((opt = getopt(argc, argv, "d:i:r:ftb15SX:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -946,6 +952,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			run.hz = cpuclock_parse(optarg);
+			break;
 		case 'b':
 			r16bug = 1;
 			break;
@@ -995,16 +1004,11 @@ int main(int argc, char *argv[])
 		}
 	}
 	rtc = rtc_create();
-	rtc_trace(rtc, trace & TRACE_RTC);
+	rtc_trace(rtc, TRACE_ON(trace & TRACE_RTC));
 
 	sio_reset();
 	ctc_init();
 
-	/* 5ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 5000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -1025,38 +1029,19 @@ int main(int argc, char *argv[])
 	cpu_z80.ioWrite = io_write;
 	cpu_z80.memRead = mem_read;
 	cpu_z80.memWrite = mem_write;
+	cpu_z80.reti = reti_event;
 	cpu_z80.trace = simple80_trace;
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!done) {
-		int l;
-		for (l = 0; l < 10; l++) {
-			int i;
-			/* 36400 T states */
-			for (i = 0; i < 100; i++) {
-				Z80ExecuteTStates(&cpu_z80, 364);
-				sio2_timer();
-				ctc_tick(364);
-			}
-			/* Do 5ms of I/O and delays */
-			if (!fast)
-				nanosleep(&tc, NULL);
-			if (int_recalc) {
-				/* If there is no pending Z80 vector IRQ but we think
-				   there now might be one we use the same logic as for
-				   reti */
-				poll_irq_event();
-				/* Clear this after because reti_event may set the
-				   flags to indicate there is more happening. We will
-				   pick up the next state changes on the reti if so */
-				if (!(cpu_z80.IFF1|cpu_z80.IFF2))
-					int_recalc = 0;
-			}
-		}
-	}
+	run.cpu = &cpu_z80;
+	if (run.hz == 0)
+		run.hz = 7372800;
+	run.rate = 20000;
+	run.steps = 100;
+	run.ticks = 10;
+	run.step = simple80_step;
+	run.tick = simple80_tick;
+	run.fast = fast;
+	run.done = &done;
+	z80run_loop(&run);
 	exit(0);
 }
@@ -28,6 +28,9 @@
 #include <sys/mman.h>
 #include "libz80/z80.h"
 #include "ide.h"
+#include "trace.h"
+#include "cpuclock.h"
+#include "z80run.h"
 
 static uint8_t eeprom[32768];
 static uint8_t fixedram[32768];
@@ -56,27 +59,27 @@ static int trace = 0;
 static uint8_t mem_read(int unused, uint16_t addr)
 {
     uint8_t r;
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "R %04X: [", addr);
 
     if ((gpreg & 0x80) == 0 && addr < 0x8000) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "EE");
         r = eeprom[addr];
     } else if (addr < 0x4000) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "LF");
         r = fixedram[addr];
     } else if (addr >= 0xC000) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "HF");
         r = fixedram[addr - 0x8000];
     } else {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "%2d", gpreg & 0x0F);
         r = bankedram[gpreg&0x0F][addr - 0x4000];
     }
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "] -> %02X\n", r);
     return r;
 }
@@ -90,23 +93,23 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
         return;
     }
 
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "W %04X: [", addr);
     if (addr < 0x4000) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "LF");
         m = fixedram + addr;
     } else if (addr >= 0xC000) {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "HF");
         m = fixedram + addr - 0x8000;
     } else {
-        if (trace & TRACE_MEM)
+        if (TRACE_ON(trace & TRACE_MEM))
             fprintf(stderr, "%2d", gpreg&0x0F);
         m = &bankedram[gpreg&0x0F][addr - 0x4000];
     }
     *m = val;
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "] <- %02X\n", val);
 }
 
@@ -237,7 +240,7 @@ static void show_settings(struct uart16x50 *uptr)
 {
     uint32_t baud;
 
-    if (!(trace & TRACE_UART))
+    if (!TRACE_ON(trace & TRACE_UART))
         return;
 
     baud = uptr->ls + (uptr->ms << 8);
@@ -454,14 +457,14 @@ uint8_t do_rtc_read(uint8_t addr)
 uint8_t rtc_read(uint8_t addr)
 {
     uint8_t v = do_rtc_read(addr);
-    if (trace & TRACE_RTC)
+    if (TRACE_ON(trace & TRACE_RTC))
         fprintf(stderr, "[RTC read %x of %X[\n", addr, v);
     return v;
 }
 
 void rtc_write(uint8_t addr, uint8_t val)
 {
-    if (trace & TRACE_RTC)
+    if (TRACE_ON(trace & TRACE_RTC))
         fprintf(stderr, "[RTC write %X to %X]\n", addr, val);
     switch(addr) {
         case 13:
@@ -512,14 +515,14 @@ static uint8_t gide_read(uint16_t addr)
         return gide_latch;
 
     }
-    if (trace & TRACE_IDE)
+    if (TRACE_ON(trace & TRACE_IDE))
         fprintf(stderr, "IDE read %d = %02X\n", addr, r);
     return r;
 }
 
 static void gide_write(uint16_t addr, uint8_t val)
 {
-    if (trace & TRACE_IDE)
+    if (TRACE_ON(trace & TRACE_IDE))
         fprintf(stderr, "IDE write %d = %02X\n", addr, val);
     if (addr == 6)
         ide_write16(ide0, ide_devctrl_w, val);
@@ -547,11 +550,11 @@ void gp_write(uint8_t val)
 {
     uint8_t delta = val ^ gpreg;
 
-    if (trace & TRACE_BANK) {
+    if (TRACE_ON(trace & TRACE_BANK)) {
         if (delta & 0x0F)
             fprintf(stderr, "[Bank set to %d].\n", val & 0x0F);
     }
-    if (trace & TRACE_LED) {
+    if (TRACE_ON(trace & TRACE_LED)) {
         if (delta & 0x10)
             ledmod("Red", val & 0x10);
         if (delta & 0x20)
@@ -564,7 +567,7 @@ void gp_write(uint8_t val)
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "read %02x\n", addr);
     addr &= 0xFF;
     if (addr >= 0x10 && addr <= 0x17)
@@ -583,14 +586,14 @@ static uint8_t io_read(int unused, uint16_t addr)
         return fdc_read(addr & 0x07);
     if (addr == 0xF8)
         return gpreg;
-    if (trace & TRACE_UNK)
+    if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown read from port %04X\n", addr);
     return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "write %02x <- %02x\n", addr & 0xFF, val);
     addr &= 0xFF;
     if (addr >= 0x10 && addr <= 0x17)
@@ -613,7 +616,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
         printf("trace set to %d\n", val);
         trace = val;
     }
-    else if (trace & TRACE_UNK)
+    else if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown write to port %02X of %02X\n",
             addr & 0xFF, val);
 }
@@ -633,19 +636,34 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-    fprintf(stderr, "smallz80: [-f] [-r rompath] [-i idepath] [-d tracemask]\n");
+    fprintf(stderr, "smallz80: [-f] [-X MHz] [-r rompath] [-i idepath] [-d tracemask]\n");
     exit(EXIT_FAILURE);
 }
 
+/* Run the uart each slice and raise the RTC interrupt if it is due */
+static void smallz80_step(void)
+{
+    uart_event(&uart[0]);
+    if (!(rtc_ce & 1) && (rtc_status & 4))
+        Z80INT(&cpu_z80, 0xFF);
+}
+
+static void smallz80_frame(void)
+{
+    rtc_status |= 4;
+    if (!(rtc_ce & 1))
+        Z80INT(&cpu_z80, 0xFF);
+}
+
 int main(int argc, char *argv[])
 {
-    static struct timespec tc;
+    static struct z80run run;
     int opt;
     int fd;
     char *rompath = "smallz80.rom";
     char *idepath[2] = { NULL, NULL };
 
-    while((opt = getopt(argc, argv, "r:i:d:f")) != -1) {
+    while((opt = getopt(argc, argv, "r:i:d:fX:")) != -1) {
         switch(opt) {
             case 'r':
                 rompath = optarg;
@@ -662,6 +680,9 @@ int main(int argc, char *argv[])
             case 'f':
                 fast = 1;
                 break;
+            case 'X':
+                run.hz = cpuclock_parse(optarg);
+                break;
             default:
                 usage();
         }
@@ -706,10 +727,6 @@ int main(int argc, char *argv[])
     uart_init(&uart[2]);
     uart_init(&uart[3]);
 
-    /* 1/64th of a second */
-    tc.tv_sec = 0;
-    tc.tv_nsec = 15625000L;
-
     if (tcgetattr(0, &term) == 0) {
 	saved_term = term;
 	atexit(exit_cleanup);
@@ -731,26 +748,18 @@ int main(int argc, char *argv[])
     cpu_z80.memRead = mem_read;
     cpu_z80.memWrite = mem_write;
 
-    /* This is the wrong way to do it but it's easier for the moment. We
-       should track how much real time has occurred and try to keep cycle
-       matched with that. The scheme here works fine except when the host
-       is loaded though */
-
     /* 20MHz Z80 - 20,000,000 tstates / second */
     /* 312500 tstates per RTC interrupt */
-    while (!done) {
-	int i;
-	/* Run the CPU and uart until the next tick */
-	for (i = 0; i < 10; i++) {
-	    if (!(rtc_ce & 1) && (rtc_status & 4))
-                Z80INT(&cpu_z80, 0xFF);
-	    Z80ExecuteTStates(&cpu_z80, 31250);
-	    uart_event(&uart[0]);
-	}
-        rtc_status |= 4;
-        /* Do 1/64th of a second of I/O and delays */
-	if (!fast)
-		nanosleep(&tc, NULL);
-    }
+    run.cpu = &cpu_z80;
+    if (run.hz == 0)
+        run.hz = 20000000;
+    run.rate = 640;
+    run.steps = 10;
+    run.ticks = 1;
+    run.step = smallz80_step;
+    run.frame = smallz80_frame;
+    run.fast = fast;
+    run.done = &done;
+    z80run_loop(&run);
     exit(0);
 }
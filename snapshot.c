@@ -0,0 +1,261 @@
+/*
+ *	Machine snapshot files
+ *
+ *	An 8 byte header of "RCSN" and the format version, then chunks of a
+ *	four character tag, a 32bit length and the data padded to 8 bytes.
+ *	Everything is in host byte order. A snapshot is written to a
+ *	temporary name and renamed into place so a reader never sees half
+ *	of one.
+ *
+ *	Reading maps the file and indexes the chunks so only the parts that
+ *	are used get paged in. Big memory images are page aligned in the file
+ *	so they can be mapped privately straight into the machine: pages the
+ *	guest never writes, such as the ROM, stay shared in the page cache
+ *	between every instance started from the same snapshot.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "snapshot.h"
+
+#define SNAP_MAGIC	"RCSN"
+#define SNAP_ALIGN	8
+#define SNAP_CHUNKS	64
+/* Covers the largest page size we are likely to meet */
+#define SNAP_PAGE	65536
+
+struct snap_header {
+	uint8_t magic[4];
+	uint32_t version;
+};
+
+struct snap_chunk {
+	uint8_t tag[4];
+	uint32_t len;
+};
+
+struct snapshot {
+	/* Writing */
+	FILE *fp;
+	char *path;
+	char *tmp;
+	int err;
+	size_t pos;
+	/* Reading */
+	int fd;
+	uint8_t *data;
+	size_t size;
+	unsigned int chunks;
+	struct snap_chunk *chunk[SNAP_CHUNKS];
+};
+
+static struct snapshot *snap_alloc(void)
+{
+	struct snapshot *s = calloc(1, sizeof(struct snapshot));
+	if (s == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	s->fd = -1;
+	return s;
+}
+
+struct snapshot *snapshot_create(const char *path)
+{
+	struct snapshot *s = snap_alloc();
+	struct snap_header h;
+
+	s->path = strdup(path);
+	s->tmp = malloc(strlen(path) + 5);
+	if (s->path == NULL || s->tmp == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	sprintf(s->tmp, "%s.tmp", path);
+	s->fp = fopen(s->tmp, "w");
+	if (s->fp == NULL) {
+		perror(s->tmp);
+		snapshot_free(s);
+		return NULL;
+	}
+	memcpy(h.magic, SNAP_MAGIC, 4);
+	h.version = SNAPSHOT_VERSION;
+	if (fwrite(&h, sizeof(h), 1, s->fp) != 1)
+		s->err = 1;
+	s->pos = sizeof(h);
+	return s;
+}
+
+void snapshot_put(struct snapshot *s, const char *tag, const void *data, size_t len)
+{
+	static const uint8_t pad[SNAP_ALIGN];
+	struct snap_chunk c;
+	size_t padlen = -len & (SNAP_ALIGN - 1);
+
+	memcpy(c.tag, tag, 4);
+	c.len = len;
+	if (fwrite(&c, sizeof(c), 1, s->fp) != 1 ||
+	    (len && fwrite(data, len, 1, s->fp) != 1) ||
+	    (padlen && fwrite(pad, padlen, 1, s->fp) != 1))
+		s->err = 1;
+	s->pos += sizeof(c) + len + padlen;
+}
+
+/* As snapshot_put but the data starts on a page boundary in the file so
+   that snapshot_map can map it. A filler chunk takes up the gap */
+void snapshot_put_pages(struct snapshot *s, const char *tag, const void *data, size_t len)
+{
+	size_t gap = -(s->pos + 2 * sizeof(struct snap_chunk)) & (SNAP_PAGE - 1);
+	uint8_t *fill = calloc(1, gap + 1);
+
+	if (fill == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	snapshot_put(s, "PAD ", fill, gap);
+	free(fill);
+	snapshot_put(s, tag, data, len);
+}
+
+/* Finish a snapshot being written. Returns -1 and leaves any older
+   snapshot of the same name alone if it could not all be written */
+int snapshot_close(struct snapshot *s)
+{
+	int r = 0;
+
+	if (fclose(s->fp) || s->err) {
+		perror(s->tmp);
+		unlink(s->tmp);
+		r = -1;
+	} else if (rename(s->tmp, s->path) == -1) {
+		perror(s->path);
+		r = -1;
+	}
+	s->fp = NULL;
+	snapshot_free(s);
+	return r;
+}
+
+struct snapshot *snapshot_open(const char *path)
+{
+	struct snapshot *s;
+	struct snap_header *h;
+	struct stat st;
+	size_t pos;
+
+	s = snap_alloc();
+	s->fd = open(path, O_RDONLY);
+	if (s->fd == -1 || fstat(s->fd, &st) == -1) {
+		perror(path);
+		goto bad;
+	}
+	if (st.st_size < (off_t)sizeof(*h)) {
+		fprintf(stderr, "%s: short snapshot.\n", path);
+		goto bad;
+	}
+	s->size = st.st_size;
+	s->data = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+	if (s->data == MAP_FAILED) {
+		s->data = NULL;
+		perror(path);
+		goto bad;
+	}
+
+	h = (struct snap_header *)s->data;
+	if (memcmp(h->magic, SNAP_MAGIC, 4)) {
+		fprintf(stderr, "%s: not a snapshot.\n", path);
+		goto bad;
+	}
+	if (h->version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "%s: snapshot version %u, wanted %u.\n",
+			path, (unsigned int)h->version, SNAPSHOT_VERSION);
+		goto bad;
+	}
+	pos = sizeof(*h);
+	while (pos < s->size) {
+		struct snap_chunk *c = (struct snap_chunk *)(s->data + pos);
+		if (pos + sizeof(*c) > s->size ||
+		    c->len > s->size - pos - sizeof(*c)) {
+			fprintf(stderr, "%s: corrupt snapshot.\n", path);
+			goto bad;
+		}
+		if (memcmp(c->tag, "PAD ", 4)) {
+			if (s->chunks == SNAP_CHUNKS) {
+				fprintf(stderr, "%s: too many chunks.\n", path);
+				goto bad;
+			}
+			s->chunk[s->chunks++] = c;
+		}
+		pos += sizeof(*c) + ((c->len + SNAP_ALIGN - 1) & ~(SNAP_ALIGN - 1));
+	}
+	return s;
+bad:
+	snapshot_free(s);
+	return NULL;
+}
+
+/* Look up a chunk. The data is only valid until snapshot_free */
+const void *snapshot_find(struct snapshot *s, const char *tag, size_t *len)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->chunks; i++) {
+		if (memcmp(s->chunk[i]->tag, tag, 4) == 0) {
+			*len = s->chunk[i]->len;
+			return s->chunk[i] + 1;
+		}
+	}
+	return NULL;
+}
+
+/* Copy out a chunk that must be exactly len bytes */
+int snapshot_get(struct snapshot *s, const char *tag, void *data, size_t len)
+{
+	size_t clen;
+	const void *p = snapshot_find(s, tag, &clen);
+
+	if (p == NULL || clen != len)
+		return -1;
+	memcpy(data, p, len);
+	return 0;
+}
+
+/* Put a chunk of exactly len bytes at addr, which must be page aligned
+   memory we own. It is mapped copy on write when the file layout allows
+   and read in otherwise. The mapping outlives snapshot_free */
+int snapshot_map(struct snapshot *s, const char *tag, void *addr, size_t len)
+{
+	size_t clen;
+	const uint8_t *p = snapshot_find(s, tag, &clen);
+	long page = sysconf(_SC_PAGESIZE);
+	off_t off;
+
+	if (p == NULL || clen != len)
+		return -1;
+	off = p - s->data;
+	if (page > 0 && off % page == 0 && (uintptr_t)addr % page == 0 &&
+	    mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+		s->fd, off) != MAP_FAILED)
+		return 0;
+	memcpy(addr, p, len);
+	return 0;
+}
+
+void snapshot_free(struct snapshot *s)
+{
+	if (s->fp)
+		fclose(s->fp);
+	if (s->data)
+		munmap(s->data, s->size);
+	if (s->fd != -1)
+		close(s->fd);
+	free(s->path);
+	free(s->tmp);
+	free(s);
+}
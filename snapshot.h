@@ -0,0 +1,30 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *	Machine snapshots. A snapshot is a header followed by chunks tagged
+ *	with four characters. Each emulator decides what goes in which chunk
+ *	and the device modules provide save and load helpers for their own
+ *	state. The layout follows the host and the build, so a snapshot is
+ *	only good for the same binary on the same kind of machine.
+ */
+
+#define SNAPSHOT_VERSION	1
+
+struct snapshot;
+
+extern struct snapshot *snapshot_create(const char *path);
+extern void snapshot_put(struct snapshot *s, const char *tag, const void *data, size_t len);
+extern void snapshot_put_pages(struct snapshot *s, const char *tag, const void *data, size_t len);
+extern int snapshot_close(struct snapshot *s);
+
+extern struct snapshot *snapshot_open(const char *path);
+extern const void *snapshot_find(struct snapshot *s, const char *tag, size_t *len);
+extern int snapshot_get(struct snapshot *s, const char *tag, void *data, size_t len);
+extern int snapshot_map(struct snapshot *s, const char *tag, void *addr, size_t len);
+extern void snapshot_free(struct snapshot *s);
+
+#endif
@@ -8,32 +8,64 @@
 #include <string.h>
 
 #include "sram_mmu8.h"
+#include "ramalloc.h"
+
+/* Cached translations for the current latch, one per 8K page and super bit */
+struct sram_tlb {
+    uint8_t *base;		/* NULL if not cached */
+    unsigned int write;		/* Writable */
+};
 
 struct sram_mmu {
-    uint8_t ram[512 * 1024];
+    uint8_t *ram;
     uint8_t map[32768];
     uint8_t map_valid[32768];	/* Not present in real hw just a debug aid */
     uint8_t latch;
+    struct sram_tlb tlb[128];
 
     unsigned int trace;
 };
 
 #define MAP_UNINIT	0xFFFF
 
+static void sram_mmu_flush(struct sram_mmu *mmu)
+{
+    memset(mmu->tlb, 0, sizeof(mmu->tlb));
+}
+
 void sram_mmu_set_latch(struct sram_mmu *mmu, uint8_t latch)
 {
+    if (mmu->latch != latch)
+        sram_mmu_flush(mmu);
     mmu->latch = latch;
 }
 
+/* Only ever answers for mapped RAM that was translated before. Anything
+   else returns NULL and must go through sram_mmu_translate */
+uint8_t *sram_mmu_cached(struct sram_mmu *mmu, uint32_t addr, unsigned int wr,
+                         unsigned int super)
+{
+    struct sram_tlb *t = mmu->tlb + (((addr >> 13) & 0x3F) | (super ? 0x40 : 0));
+
+    if (t->base == NULL || (wr && !t->write))
+        return NULL;
+    return t->base + (addr & 0x1FFF);
+}
+
 uint8_t *sram_mmu_translate(struct sram_mmu *mmu, uint32_t addr, unsigned int wr,
                             unsigned int silent, unsigned int super, unsigned int *berr)
 {
     unsigned int  page;
     uint16_t map;
+    struct sram_tlb *t;
+    uint8_t *p;
 
     *berr = 0;
 
     addr &= 0x7FFFF;
+    p = sram_mmu_cached(mmu, addr, wr, super);
+    if (p)
+        return p;
     page = addr >> 13;
     page |= (mmu->latch & 0x7F) << 8;
     if (super)
@@ -43,6 +75,7 @@ uint8_t *sram_mmu_translate(struct sram_mmu *mmu, uint32_t addr, unsigned int wr
         if (wr) {
             /* Remember maps we've written to at least once */
             mmu->map_valid[page] = 1;
+            sram_mmu_flush(mmu);
             return mmu->map + page;
         }
         return NULL;
@@ -69,7 +102,10 @@ uint8_t *sram_mmu_translate(struct sram_mmu *mmu, uint32_t addr, unsigned int wr
             return NULL;
         }
     }
-    return mmu->ram + ((map & 0x3F) << 13) + (addr & 0x1FFF);
+    t = mmu->tlb + (((addr >> 13) & 0x3F) | (super ? 0x40 : 0));
+    t->base = mmu->ram + ((map & 0x3F) << 13);
+    t->write = !(map & 0x40);
+    return t->base + (addr & 0x1FFF);
 }            
     
 struct sram_mmu *sram_mmu_create(void)
@@ -80,11 +116,13 @@ struct sram_mmu *sram_mmu_create(void)
         exit(1);
     }
     memset(mmu, 0, sizeof(struct sram_mmu));
+    mmu->ram = ram_alloc(512 * 1024);
     return mmu;
 }
 
 void sram_mmu_free(struct sram_mmu *mmu)
 {
+    ram_free(mmu->ram, 512 * 1024);
     free(mmu);
 }
 
@@ -4,7 +4,6 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
-#include <sys/select.h>
 #include <signal.h>
 #include <termios.h>
 #include <sys/ioctl.h>
@@ -14,6 +13,11 @@
 #include <arpa/inet.h>
 #include "ide.h"
 #include "duart.h"
+#include "console.h"
+#include "chardev.h"
+#include "pace.h"
+#include "trace.h"
+#include "coverage.h"
 
 /* 16MB RAM except for the top 32K which is I/O */
 
@@ -52,40 +56,22 @@ uint8_t fc;
 
 unsigned int check_chario(void)
 {
-	fd_set i, o;
-	struct timeval tv;
-	unsigned int r = 0;
-
-	FD_ZERO(&i);
-	FD_SET(0, &i);
-	FD_ZERO(&o);
-	FD_SET(1, &o);
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-
-	if (select(2, &i, NULL, NULL, &tv) == -1) {
-		perror("select");
-		exit(1);
-	}
-	if (FD_ISSET(0, &i))
-		r |= 1;
-	if (FD_ISSET(1, &o))
-		r |= 2;
-	return r;
+	return console_status();
 }
 
 unsigned int next_char(void)
 {
-	char c;
-	if (read(0, &c, 1) != 1) {
-		printf("(tty read without ready byte)\n");
-		return 0xFF;
-	}
-	return c;
+	return console_getc();
 }
 
 static unsigned int irq_pending;
 
+/* 68000 clock and the DUART X1 crystal */
+#define CPU_HZ		10000000UL
+#define X1_HZ		1843200UL
+/* Slice between console ticks and pacing checks: 1ms */
+#define SLICE		(CPU_HZ / 1000)
+
 void recalc_interrupts(void)
 {
 	int i;
@@ -190,7 +176,7 @@ unsigned int do_cpu_read_byte(unsigned int address)
 unsigned int cpu_read_byte(unsigned int address)
 {
 	unsigned int v = do_cpu_read_byte(address);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "RB %06X -> %02X\n", address, v);
 	return v;
 }
@@ -219,7 +205,7 @@ unsigned int do_cpu_read_word(unsigned int address)
 unsigned int cpu_read_word(unsigned int address)
 {
 	unsigned int v = do_cpu_read_word(address);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "RW %06X -> %04X\n", address, v);
 	return v;
 }
@@ -232,11 +218,40 @@ unsigned int cpu_read_word_dasm(unsigned int address)
 		return 0xFFFF;
 }
 
+/* Is a long at address all in RAM, and if so where */
+static uint8_t *ram_long(unsigned int address)
+{
+	address &= 0xFFFFFF;
+	if (TRACE_ON(trace & TRACE_MEM))
+		return NULL;
+	if (rc2014) {
+		if (address >= 0x800000 || (address & 0x1FFFFF) > 0x1FFFFC)
+			return NULL;
+		return ram + (address & 0x1FFFFF);
+	}
+	if (address < sizeof(ram) - 3)
+		return ram + address;
+	return NULL;
+}
+
 unsigned int cpu_read_long(unsigned int address)
 {
+	uint8_t *p = ram_long(address);
+	if (p)
+		return READ_LONG(p, 0);
 	return (cpu_read_word(address) << 16) | cpu_read_word(address + 2);
 }
 
+unsigned int cpu_read_imm_word(unsigned int address)
+{
+	return cpu_read_word(address);
+}
+
+unsigned int cpu_read_imm_long(unsigned int address)
+{
+	return cpu_read_long(address);
+}
+
 unsigned int cpu_read_long_dasm(unsigned int address)
 {
 	return (cpu_read_word_dasm(address) << 16) | cpu_read_word_dasm(address + 2);
@@ -246,7 +261,7 @@ void cpu_write_byte(unsigned int address, unsigned int value)
 {
 	address &= 0xFFFFFF;
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "WB %06X <- %02X\n", address, value);
 
 	if (rc2014) {
@@ -267,7 +282,7 @@ void cpu_write_word(unsigned int address, unsigned int value)
 {
 	address &= 0xFFFFFF;
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "WW %06X <- %04X\n", address, value);
 
 	if (rc2014) {
@@ -291,6 +306,12 @@ void cpu_write_word(unsigned int address, unsigned int value)
 
 void cpu_write_long(unsigned int address, unsigned int value)
 {
+	uint8_t *p = ram_long(address);
+
+	if (p) {
+		WRITE_LONG(p, 0, value);
+		return;
+	}
 	address &= 0xFFFFFF;
 
 	cpu_write_word(address, value >> 16);
@@ -305,9 +326,14 @@ void cpu_write_pd(unsigned int address, unsigned int value)
 	cpu_write_word(address, value >> 16);
 }
 
+/* Instruction addresses run, see -q. Release builds have no hook */
+static uint8_t *cov;
+
 void cpu_instr_callback(void)
 {
-	if (trace & TRACE_CPU) {
+	if (cov)
+		coverage_mark(cov, m68k_get_reg(NULL, M68K_REG_PC) & 0xFFFFFF);
+	if (TRACE_ON(trace & TRACE_CPU)) {
 		char buf[128];
 		unsigned int pc = m68k_get_reg(NULL, M68K_REG_PC);
 		m68k_disassemble(buf, pc, M68K_CPU_TYPE_68000);
@@ -337,15 +363,6 @@ static void exit_cleanup(void)
 }
 
 
-static void take_a_nap(void)
-{
-	struct timespec t;
-	t.tv_sec = 0;
-	t.tv_nsec = 100000;
-	if (nanosleep(&t, NULL))
-		perror("nanosleep");
-}
-
 void cpu_pulse_reset(void)
 {
 	device_init();
@@ -357,7 +374,7 @@ void cpu_set_fc(int fc)
 
 void usage(void)
 {
-	fprintf(stderr, "tiny68k [-0][-1][-2][-e][-R][-r rompath][-i idepath][-d debug].\n");
+	fprintf(stderr, "tiny68k [-0][-1][-2][-e][-N][-R][-r rompath][-i idepath][-d debug][-q coverage][-U a|b=device].\n");
 	exit(1);
 }
 
@@ -366,11 +383,16 @@ int main(int argc, char *argv[])
 	int fd;
 	int cputype = M68K_CPU_TYPE_68000;
 	int fast = 0;
+	int unthrottled = 0;
 	int opt;
 	const char *romname = "tiny68k.rom";
 	const char *diskname = "tiny68k.ide";
+	const char *devname[2] = { NULL, NULL };
+	unsigned int slice = 0;
+	uint64_t x1frac = 0;
+	struct pace pace;
 
-	while((opt = getopt(argc, argv, "012eRfd:i:r:")) != -1) {
+	while((opt = getopt(argc, argv, "012eNRfd:i:q:r:U:")) != -1) {
 		switch(opt) {
 		case '0':
 			cputype = M68K_CPU_TYPE_68000;
@@ -384,6 +406,9 @@ int main(int argc, char *argv[])
 		case 'e':
 			cputype = M68K_CPU_TYPE_68EC020;
 			break;
+		case 'N':
+			unthrottled = 1;
+			break;
 		case 'R':
 			rc2014 = 1;
 			break;
@@ -399,6 +424,14 @@ int main(int argc, char *argv[])
 		case 'r':
 			romname = optarg;
 			break;
+		case 'q':
+			cov = coverage_create(1 << 24, optarg);
+			break;
+		case 'U':
+			if ((*optarg != 'a' && *optarg != 'b') || optarg[1] != '=')
+				usage();
+			devname[*optarg - 'a'] = optarg + 2;
+			break;
 		default:
 			usage();
 		}
@@ -449,7 +482,11 @@ int main(int argc, char *argv[])
 		exit(1);
 
 	duart = duart_create();
-	if (trace & TRACE_DUART)
+	duart_unthrottle(duart, unthrottled);
+	for (opt = 0; opt < 2; opt++)
+		if (devname[opt])
+			duart_attach(duart, opt, chardev_create(devname[opt]));
+	if (TRACE_ON(trace & TRACE_DUART))
 		duart_trace(duart, 1);
 
 	m68k_init();
@@ -459,14 +496,31 @@ int main(int argc, char *argv[])
 	/* Init devices */
 	device_init();
 
+	console_init();
+
+	pace_init(&pace, CPU_HZ);
+
 	while (1) {
-		/* A 10MHz 68000 should do 1000 cycles per 1/10000th of a
-		   second. We do a blind 0.01 second sleep so we are actually
-		   emulating a bit under 10Mhz - which will do fine for
-		   testing this stuff */
-		m68k_execute(1000);
-		duart_tick(duart);
-		if (!fast)
-			take_a_nap();
+		/* Run to the next DUART deadline, at most a slice at a time.
+		   Each slice of emulated time the console is serviced and we
+		   sleep off any lead over the host clock, waking early for
+		   console input */
+		unsigned int cycles = SLICE - slice;
+		uint64_t due = duart_deadline(duart);
+
+		if (due * CPU_HZ < (uint64_t)cycles * X1_HZ)
+			cycles = (due * CPU_HZ + X1_HZ - 1) / X1_HZ + 1;
+		cycles = m68k_execute(cycles);
+		x1frac += (uint64_t)cycles * X1_HZ;
+		duart_run(duart, x1frac / CPU_HZ);
+		x1frac %= CPU_HZ;
+		slice += cycles;
+		if (slice >= SLICE) {
+			pace_run(&pace, slice);
+			slice = 0;
+			console_tick();
+			if (!fast)
+				pace_wait(&pace, (console_status() & 1) || console_eof() ? -1 : 0);
+		}
 	}
 }
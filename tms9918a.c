@@ -1,16 +1,27 @@
 /*
  *	TMS9918A emulation.
  *
- *	This could benefit from some optimization especially on the sprite side
- *	of things. There are also a lot of other optimizations that could be
- *	done to only recompute changed scan lines, although that need some
- *	trickery with sprite compositing.
- *
  *	We maintain a frame buffer and register as the real hardware sees them.
- *	Our code then rasterizes the framebuffer each frame. We don't do any
- *	clever tricks for unchanged lines/areas or when combining sprites.
- *	Our output is a 256 pixel x 192 pixel 32bit image that we then feed
- *	to SDL2 to scale and GPU render.
+ *	Our code then rasterizes the framebuffer each frame. VRAM writes are
+ *	tracked in 8 byte granules, which is one name table group, one
+ *	pattern or one G2 colour entry, so that each frame only the character
+ *	cells whose name, pattern or colour changed are redrawn. Any register
+ *	change redraws the lot. Sprites are composited on top afterwards and
+ *	when they change the character rows under their old and new positions
+ *	are redrawn to clean up.
+ *
+ *	Our output is a 256 pixel x 192 pixel image of colour indices, a byte
+ *	a pixel. Renderers that want 32bit pixels get it expanded through the
+ *	colour map, only for the lines changed since they last asked, and
+ *	then feed it to SDL2 to scale and GPU render. The lines that changed
+ *	in the last frame are available so the renderer can skip unchanged
+ *	work.
+ *
+ *	Optionally the board can give us its CPU clock and keep us synced
+ *	to it. We then draw each scan line as the beam passes it and hold
+ *	VRAM accesses to the slots the real chip gives the CPU, dropping
+ *	those that come too fast during active display. This is slower and
+ *	only wanted for checking software that depends on such things.
  *
  *	The renderer and the emulation are intentionally isolated. The
  *	renderer provides the colour mapping table, and displays the resulting
@@ -23,139 +34,234 @@
 #include <string.h>
 
 #include "tms9918a.h"
+#include "trace.h"
 
 struct tms9918a {
     uint8_t reg[8];	/* We just ignore invalid bits, you can't read them
                            back so who cares */
     uint8_t status;
     uint8_t framebuffer[16384];	/* The memory behind the VDP */
-    uint32_t rasterbuffer[256 * 192]; /* Our output texture */
+    uint8_t rasterbuffer[256 * 192]; /* Our output texture, colour indices */
     uint32_t *colourmap;
-    uint8_t colbuf[256 + 64];	/* For off edge collisions */
+    uint32_t argb[256 * 192];	/* The same through the colour map */
+    uint8_t argbdirty[192];	/* Lines argb is behind on */
     unsigned int latch;		/* The toggling latch for low/hi */
     unsigned int read;		/* Mode */
     uint16_t addr;		/* Address */
     uint16_t memmask;		/* Address range */
 
+    /* Change tracking */
+    uint8_t vdirty[2048];	/* VRAM written, per 8 bytes */
+    unsigned int written;	/* Any VRAM changed since last frame */
+    unsigned int full;		/* Redraw everything next frame */
+    unsigned int stale;		/* Frames went by without being drawn */
+    uint8_t rowforce[24];	/* Character rows to redraw this frame */
+    uint8_t sprline[192];	/* Lines sprites covered last frame */
+    uint8_t sprstatus;		/* Status bits from the last sprite pass */
+    uint8_t spcount[192];	/* Sprites drawn on each line, at most 4 */
+    uint8_t splist[192][4];	/* Their numbers in priority order */
+    uint8_t spfifth[192];	/* 5th sprite status for the line or 0 */
+    uint8_t linedirty[192];	/* Lines changed by the last frame */
+
+    /* Timed mode, off when line_clocks is 0 */
+    unsigned int line_clocks;	/* CPU clocks per scan line */
+    unsigned int gap_active[8];	/* Clocks between accesses by mode */
+    unsigned int gap_blank;	/* and during blanking */
+    uint64_t now;		/* CPU clock at the last sync */
+    uint64_t frame;		/* Clock at which this frame's vblank began */
+    uint64_t next_slot;		/* Earliest clock for the next VRAM access */
+    unsigned int beam;		/* Next display line to draw */
+    uint8_t rdlatch;		/* Last byte fetched for the CPU */
+    unsigned long long frames;	/* Frames completed, for the metrics */
+
     int trace;
 };
 
+/* Was the 8 byte block holding this VRAM offset written this frame */
+#define VDIRTY(v, a)	((v)->vdirty[((a) & 0x3FFF) >> 3])
+
+/*
+ *	Pattern expansion. Each pattern byte becomes eight pixels picked from
+ *	the foreground and background by a per bit mask from the table. With
+ *	a byte a pixel that is one 64bit word and no per bit branches.
+ */
+
+#define BYTES8	0x0101010101010101ULL
+
+static uint8_t expand_mask[256][8];
+static uint16_t double_bits[256];	/* Each bit doubled for magnified sprites */
+
+static void tms9918a_expand_init(void)
+{
+    unsigned int i, x;
+
+    if (expand_mask[255][0])
+        return;
+    for (i = 0; i < 256; i++) {
+        for (x = 0; x < 8; x++) {
+            expand_mask[i][x] = (i & (0x80 >> x)) ? 0xFF : 0;
+            if (i & (0x80 >> x))
+                double_bits[i] |= 0xC000 >> (2 * x);
+        }
+    }
+}
+
+static uint64_t tms9918a_pixels8(uint8_t bits, uint8_t fg, uint8_t bg)
+{
+    uint64_t m;
+
+    memcpy(&m, expand_mask[bits], 8);
+    return (bg * BYTES8) ^ ((fg ^ bg) * BYTES8 & m);
+}
+
+static void tms9918a_expand8(uint8_t *out, uint8_t bits, uint8_t fg, uint8_t bg)
+{
+    uint64_t px = tms9918a_pixels8(bits, fg, bg);
+    memcpy(out, &px, 8);
+}
+
+/* Text mode uses the left six, the next cell overlaps the rest */
+static void tms9918a_expand6(uint8_t *out, uint8_t bits, uint8_t fg, uint8_t bg)
+{
+    uint64_t px = tms9918a_pixels8(bits, fg, bg);
+    memcpy(out, &px, 6);
+}
+
 /*
  *	Sprites
  */
  
 /*
- *	Draw a horizontal slice of a sprite into the render buffer. If it
- *	needs magnifying then do the magnification as we render. We use a
- *	simple line buffer to detect collisions
+ *	Draw a horizontal slice of a sprite into the render buffer. bits is
+ *	the slice left aligned, already magnified if need be. Collisions use
+ *	a line bitmap with 32 pixels of margin each side so that off edge
+ *	sprites still collide: the slice covers at most two words of it.
  */
-static void tms9918a_render_slice(struct tms9918a *vdp, int y, uint8_t *sprat, uint16_t bits, unsigned int width)
+static void tms9918a_render_slice(struct tms9918a *vdp, int y, uint8_t *sprat, uint32_t bits, unsigned int width, uint32_t *colmask)
 {
     int x = sprat[1];
-    uint32_t *pixptr = vdp->rasterbuffer + 256 * y;
-    uint8_t *colptr = vdp->colbuf + 32;
-    uint32_t foreground = vdp->colourmap[sprat[3] & 0x0F];
-    int mag = vdp->reg[1] & 0x01;
-    int step = 1;
-    int i;
+    uint8_t *pixptr = vdp->rasterbuffer + 256 * y;
+    uint8_t foreground = sprat[3] & 0x0F;
+    unsigned int p, sh;
+    uint32_t hi, lo;
+    int i, end;
 
     if (sprat[3] & 0x80)
         x -= 32;
-    pixptr += x;
-    colptr += x;
-
-    /* Walk across the sprite doing rendering and collisions. Collisions apply
-       to offscreen objects. Colbuf is sized to cover this */
-    for (i = x; i < x + width; i++) {
-        if (i >= 0 && i <= 255) {
-            if (bits & 0x8000U)
-                *pixptr++ = foreground;
-        }
-        /* This pixel was already sprite written - collision */
-        if (*colptr) {
-            vdp->status |= 0x20;
-            *colptr++ = 1;
-        } else {
-            pixptr++;
-            colptr++;
-        }
-        /* For magnified sprites write each pixel twice */
-        step ^= mag;
-        if (step == 1)
-            bits >>= 1;
-    }
+
+    p = x + 32;
+    sh = p & 31;
+    hi = bits >> sh;
+    lo = sh ? bits << (32 - sh) : 0;
+    colmask += p >> 5;
+    if ((colmask[0] & hi) | (colmask[1] & lo))
+        vdp->status |= 0x20;
+    colmask[0] |= hi;
+    colmask[1] |= lo;
+
+    /* Clip the pixels to the raster line */
+    i = x < 0 ? -x : 0;
+    end = x + (int)width > 256 ? 256 - x : (int)width;
+    for (; i < end; i++)
+        if (bits & (0x80000000U >> i))
+            pixptr[x + i] = foreground;
 }
 
 /*
  *	Calculate the slice of a sprite to render and feed it to the actual
  *	bit renderer.
  */
-static void tms9918a_render_sprite(struct tms9918a *vdp, int y, uint8_t *sprat, uint8_t *spdat)
+static void tms9918a_render_sprite(struct tms9918a *vdp, int y, uint8_t *sprat, uint8_t *spdat, uint32_t *colmask)
 {
     int row = *sprat;
-    uint16_t bits;
-    unsigned int width = 8;
+    uint32_t bits;
+    unsigned int width;
 
     /* Figure out the right data row */
     if (row >= 0xE1)
         row -= 0x100;	/* Signed top border */
-    row = y - row;
+    /* The sprite starts on the line after its Y value */
+    row = y - row - 1;
+    row >>= vdp->reg[1] & 0x01;
+    spdat += row;
     /* Get the data and expand it if needed */
     if ((vdp->reg[1] & 0x02) == 0) {
-        spdat += row;
         width = 8;
-        bits = *spdat << 24;
+        if (vdp->reg[1] & 0x01)
+            bits = double_bits[*spdat] << 16;
+        else
+            bits = *spdat << 24;
     } else {
-        spdat += 2 * row;
-        bits = *spdat++ << 8;
-        bits |= spdat[16];
+        /* Left half then right half, 16 bytes each */
         width = 16;
+        if (vdp->reg[1] & 0x01)
+            bits = (double_bits[*spdat] << 16) | double_bits[spdat[16]];
+        else
+            bits = (*spdat << 24) | (spdat[16] << 16);
     }
-    tms9918a_render_slice(vdp, y, sprat, bits, width);
+    if (vdp->reg[1] & 0x01)
+        width <<= 1;
+    tms9918a_render_slice(vdp, y, sprat, bits, width, colmask);
 }
 
 /*
- *	Composite the sprites for a given scan line
+ *	Sort the sprites into the lines first to last they cover, once per
+ *	frame rather than walking the attribute table for every line. Each
+ *	line keeps the first four, the hardware limit, and the 5th sprite
+ *	status.
  */
-static void tms9918a_sprite_line(struct tms9918a *vdp, int y)
+static void tms9918a_sprite_bin(struct tms9918a *vdp, int first, int last)
 {
-    uint8_t *sphead[4];
-    uint8_t **spqueue = sphead;
     uint8_t *sprat = vdp->framebuffer + ((vdp->reg[5] & 0x7F) << 7);
-    uint8_t *spdat = vdp->framebuffer + ((vdp->reg[6] & 0x07) << 11);
-    int i;
-    unsigned int spheight = vdp->reg[1]& 0x02 ? 16 : 8;
-    unsigned int mag = vdp->reg[1] & 0x01;
-    unsigned int ns = 0;
-    unsigned int spshft = (spheight == 8) ? 3 : 5;
+    unsigned int spheight = vdp->reg[1] & 0x02 ? 16 : 8;
+    unsigned int i;
+    int l, end;
 
-    if (mag)
+    if (vdp->reg[1] & 0x01)
         spheight <<= 1;
 
-    /* Clear the collision buffer for the line */
-    memset(vdp->colbuf, 0, sizeof(vdp->colbuf));
-
-    /* Walk the sprite table and queue any sprite on this line */
-    for(i = 0; i < 32; i++) {
-        if (*sprat == 0xD0)
-            return;
-        if (*sprat <= y && *sprat + spheight >= y) {
-            ns++;
-            /* Too many sprites: only 4 get handled */
-            /* Q: do the full 32 get collision detected ? */
-            if (ns > 4) {
-                vdp->status |= 0x40 | i;	/* Too many sprites */
-                break;
-            }
-            *spqueue++ = sprat;
+    memset(vdp->spcount + first, 0, last - first + 1);
+    memset(vdp->spfifth + first, 0, last - first + 1);
+    for (i = 0; i < 32; i++) {
+        int top = *sprat;
+        if (top == 0xD0)
+            break;
+        if (top >= 0xE1)
+            top -= 0x100;
+        l = top + 1;
+        if (l < first)
+            l = first;
+        end = top + (int)spheight;
+        if (end > last)
+            end = last;
+        for (; l <= end; l++) {
+            if (vdp->spcount[l] < 4)
+                vdp->splist[l][vdp->spcount[l]++] = i;
+            else if (vdp->spfifth[l] == 0)
+                vdp->spfifth[l] = 0x40 | i;	/* Too many sprites */
         }
         sprat += 4;
     }
+}
+
+/*
+ *	Composite the sprites for a given scan line
+ */
+static void tms9918a_sprite_line(struct tms9918a *vdp, int y)
+{
+    uint8_t *sprat = vdp->framebuffer + ((vdp->reg[5] & 0x7F) << 7);
+    uint8_t *spdat = vdp->framebuffer + ((vdp->reg[6] & 0x07) << 11);
+    unsigned int spmask = vdp->reg[1] & 0x02 ? 0xFC : 0xFF;
+    uint32_t colmask[10] = { 0 };
+    unsigned int n = vdp->spcount[y];
+    uint8_t *sp;
+
+    vdp->status |= vdp->spfifth[y];
     /* We need to render the ones we got in reverse order to get right
        pixel priority */
-    while(spqueue > sphead) {
-        sprat = *--spqueue; 
-        tms9918a_render_sprite(vdp, y, sprat, spdat + (sprat[2] << spshft));
+    while (n) {
+        sp = sprat + 4 * vdp->splist[y][--n];
+        tms9918a_render_sprite(vdp, y, sp, spdat + ((sp[2] & spmask) << 3), colmask);
     }
 }
 
@@ -172,30 +278,89 @@ static void tms9918a_raster_sprites(struct tms9918a *vdp)
         tms9918a_sprite_line(vdp, i);
 }
 
+/*
+ *	Work out what the sprites need redrawing. If the sprite tables have
+ *	not changed then the collision state can't have either, so the old
+ *	status is reused and only the lines we redrew underneath need their
+ *	sprites putting back. Otherwise the rows under both the old and new
+ *	sprite positions get redrawn.
+ */
+static unsigned int tms9918a_sprites_changed(struct tms9918a *vdp)
+{
+    uint16_t sat = (vdp->reg[5] & 0x7F) << 7;
+    uint16_t spt = (vdp->reg[6] & 0x07) << 11;
+    uint8_t now[192];
+    unsigned int i, y;
+
+    if (!vdp->full) {
+        for (i = 0; i < 128; i += 8)
+            if (VDIRTY(vdp, sat + i))
+                break;
+        if (i == 128) {
+            for (i = 0; i < 2048; i += 8)
+                if (VDIRTY(vdp, spt + i))
+                    break;
+            if (i == 2048)
+                return 0;
+        }
+    }
+    tms9918a_sprite_bin(vdp, 0, 191);
+    for (y = 0; y < 192; y++)
+        now[y] = vdp->spcount[y] != 0;
+    for (y = 0; y < 192; y++)
+        if (now[y] || vdp->sprline[y])
+            vdp->rowforce[y >> 3] = 1;
+    memcpy(vdp->sprline, now, sizeof(now));
+    return 1;
+}
+
+static void tms9918a_update_sprites(struct tms9918a *vdp, unsigned int changed)
+{
+    uint8_t status = vdp->status;
+    unsigned int i;
+
+    vdp->status = 0;
+    if (changed) {
+        tms9918a_raster_sprites(vdp);
+        vdp->sprstatus = vdp->status;
+    } else {
+        for (i = 0; i < 192; i++)
+            if (vdp->linedirty[i] && vdp->sprline[i])
+                tms9918a_sprite_line(vdp, i);
+    }
+    vdp->status = status | vdp->sprstatus;
+}
+
+/* Mark a character row as changed in the output */
+static void tms9918a_row_dirty(struct tms9918a *vdp, unsigned int y)
+{
+    memset(vdp->linedirty + 8 * y, 1, 8);
+    memset(vdp->argbdirty + 8 * y, 1, 8);
+}
+
+/* The whole picture went blank or was redrawn */
+static void tms9918a_all_dirty(struct tms9918a *vdp)
+{
+    memset(vdp->linedirty, 1, sizeof(vdp->linedirty));
+    memset(vdp->argbdirty, 1, sizeof(vdp->argbdirty));
+}
+
 /*
  *	G1 - colour data from a character tied colour map
  */
-static void tms9918a_raster_pattern_g1(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint8_t *colour, uint32_t *out)
+static void tms9918a_raster_pattern_g1(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint8_t *colour, uint8_t *out)
 {
-    unsigned int x,y;
-    uint32_t foreground, background;
-    uint8_t bits;
+    unsigned int y;
+    uint8_t foreground, background;
 
     pattern += code << 3;
     colour += code >> 3;
-    foreground = vdp->colourmap[*colour >> 4];
-    background = vdp->colourmap[*colour & 0x0F];
+    foreground = *colour >> 4;
+    background = *colour & 0x0F;
 
     for (y = 0; y < 8; y++) {
-        bits = *pattern++;
-        for (x = 0; x < 8; x++) {
-            if (bits & 0x80)
-                *out++ = foreground;
-            else
-                *out++ = background;
-            bits <<= 1;
-        }
-        out += 248;
+        tms9918a_expand8(out, *pattern++, foreground, background);
+        out += 256;
     }
 }
 
@@ -206,61 +371,48 @@ static void tms9918a_raster_pattern_g1(struct tms9918a *vdp, uint8_t code, uint8
 static void tms9918a_rasterize_g1(struct tms9918a *vdp)
 {
     unsigned int x,y;
-    uint8_t *p = vdp->framebuffer + ((vdp->reg[2] & 0x0F) << 10);
-    uint8_t *pattern = vdp->framebuffer + ((vdp->reg[4] & 0x07) << 11);
-    uint8_t *colour = vdp->framebuffer + (vdp->reg[3] << 6);
-    uint32_t *fp = vdp->rasterbuffer;
-
-    for (y = 0; y < 8; y++) {
-        for (x = 0; x < 32; x++) {
-            tms9918a_raster_pattern_g1(vdp, *p++, pattern, colour, fp);
-            fp += 8;
-        }
-        fp += 7 * 256;
-    }
-
-    for (; y < 16; y++) {
-        for (x = 0; x < 32; x++) {
-            tms9918a_raster_pattern_g1(vdp, *p++, pattern, colour, fp);
-            fp += 8;
-        }
-        fp += 7 * 256;
-    }
+    uint16_t name = (vdp->reg[2] & 0x0F) << 10;
+    uint16_t pat = (vdp->reg[4] & 0x07) << 11;
+    uint16_t col = vdp->reg[3] << 6;
+    uint8_t *p = vdp->framebuffer + name;
+    uint8_t *pattern = vdp->framebuffer + pat;
+    uint8_t *colour = vdp->framebuffer + col;
+    uint8_t *fp = vdp->rasterbuffer;
+    unsigned int sprites = tms9918a_sprites_changed(vdp);
 
-    for (; y < 24; y++) {
+    for (y = 0; y < 24; y++) {
+        unsigned int all = vdp->full | vdp->rowforce[y];
         for (x = 0; x < 32; x++) {
-            tms9918a_raster_pattern_g1(vdp, *p++, pattern, colour, fp);
+            uint8_t code = *p++;
+            if (all || VDIRTY(vdp, name) || VDIRTY(vdp, pat + (code << 3)) ||
+                VDIRTY(vdp, col + (code >> 3))) {
+                tms9918a_raster_pattern_g1(vdp, code, pattern, colour, fp);
+                tms9918a_row_dirty(vdp, y);
+            }
+            name++;
             fp += 8;
         }
         fp += 7 * 256;
     }
-    tms9918a_raster_sprites(vdp);
+    tms9918a_update_sprites(vdp, sprites);
 }
 
 /*
  *	In G2 mode we have two colours per row of the pattern
  */
-static void tms9918a_raster_pattern_g2(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint8_t *colour, uint32_t *out)
+static void tms9918a_raster_pattern_g2(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint8_t *colour, uint8_t *out)
 {
-    unsigned int x,y;
-    uint32_t foreground, background;
-    uint8_t bits;
+    unsigned int y;
+    uint8_t foreground, background;
 
     pattern += code << 3;
     colour += code << 3;
 
     for (y = 0; y < 8; y++) {
-        bits = *pattern++;
-        foreground = vdp->colourmap[*colour >> 4];
-        background = vdp->colourmap[*colour++ & 0x0F];
-        for (x = 0; x < 8; x++) {
-            if (bits & 0x80)
-                *out++ = foreground;
-            else
-                *out++ = background;
-            bits <<= 1;
-        }
-        out += 248;
+        foreground = *colour >> 4;
+        background = *colour++ & 0x0F;
+        tms9918a_expand8(out, *pattern++, foreground, background);
+        out += 256;
     }
 }
 
@@ -271,45 +423,39 @@ static void tms9918a_raster_pattern_g2(struct tms9918a *vdp, uint8_t code, uint8
 static void tms9918a_rasterize_g2(struct tms9918a *vdp)
 {
     unsigned int x,y;
-    uint8_t *p = vdp->framebuffer + ((vdp->reg[2] & 0x0F) << 10);
-    uint8_t *pattern = vdp->framebuffer + ((vdp->reg[4] & 0x04) << 11);
-    uint8_t *colour = vdp->framebuffer + ((vdp->reg[3] & 0x80) << 6);
-    uint32_t *fp = vdp->rasterbuffer;
-
-    uint8_t *pattern0 = pattern;
-    uint8_t *colour0 = colour;
+    uint16_t name = (vdp->reg[2] & 0x0F) << 10;
+    uint16_t pat0 = (vdp->reg[4] & 0x04) << 11;
+    uint16_t col0 = (vdp->reg[3] & 0x80) << 6;
+    uint16_t pat = pat0;
+    uint16_t col = col0;
+    uint8_t *p = vdp->framebuffer + name;
+    uint8_t *fp = vdp->rasterbuffer;
 
-    for (y = 0; y < 8; y++) {
-        for (x = 0; x < 32; x++) {
-            tms9918a_raster_pattern_g2(vdp, *p++, pattern, colour, fp);
-            fp += 8;
+    for (y = 0; y < 24; y++) {
+        if (y == 8) {
+            if (vdp->reg[4] & 0x01)
+                pat += 0x0800;
+            if (vdp->reg[3] & 0x20)
+                col += 0x0800;
         }
-        fp += 7 * 256;
-    }
-
-    if (vdp->reg[4] & 0x01)
-        pattern += 0x0800;
-    if (vdp->reg[3] & 0x20)
-        colour += 0x0800;
-
-    for (; y < 16; y++) {
-        for (x = 0; x < 32; x++) {
-            tms9918a_raster_pattern_g2(vdp, *p++, pattern, colour, fp);
-            fp += 8;
+        /* Oddly these don't appear to be incremental but each chunk is
+           relative to base. I guess it makes more sense in logic to mask
+           in the bits */
+        if (y == 16) {
+            if (vdp->reg[4] & 0x02)
+                pat = pat0 + 0x1000;
+            if (vdp->reg[3] & 0x40)
+                col = col0 + 0x1000;
         }
-        fp += 7 * 256;
-    }
-
-    /* Oddly these don't appear to be incremental but each chunk is relative
-       to base. I guess it makes more sense in logic to mask in the bits */
-    if (vdp->reg[4] & 0x02)
-        pattern = pattern0 + 0x1000;
-    if (vdp->reg[3] & 0x40)
-        colour = colour0 + 0x1000;
-
-    for (; y < 24; y++) {
         for (x = 0; x < 32; x++) {
-            tms9918a_raster_pattern_g2(vdp, *p++, pattern, colour, fp);
+            uint8_t code = *p++;
+            if (vdp->full || VDIRTY(vdp, name) || VDIRTY(vdp, pat + (code << 3)) ||
+                VDIRTY(vdp, col + (code << 3))) {
+                tms9918a_raster_pattern_g2(vdp, code, vdp->framebuffer + pat,
+                    vdp->framebuffer + col, fp);
+                tms9918a_row_dirty(vdp, y);
+            }
+            name++;
             fp += 8;
         }
         fp += 7 * 256;
@@ -318,40 +464,25 @@ static void tms9918a_rasterize_g2(struct tms9918a *vdp)
 }
 
 /* Rasterize a 4 x 4 pixel block */
-static void quad(uint32_t *p, uint32_t code)
-{
-    *p++ = code;
-    *p++ = code;
-    *p++ = code;
-    *p = code;
-    p += 253;
-    *p++ = code;
-    *p++ = code;
-    *p++ = code;
-    *p = code;
-    p += 253;
-    *p++ = code;
-    *p++ = code;
-    *p++ = code;
-    *p = code;
-    p += 253;
-    *p++ = code;
-    *p++ = code;
-    *p++ = code;
-    *p++ = code;
+static void quad(uint8_t *p, uint8_t code)
+{
+    memset(p, code, 4);
+    memset(p + 256, code, 4);
+    memset(p + 512, code, 4);
+    memset(p + 768, code, 4);
 }    
 
-static void tms9918a_raster_multi(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint32_t *out)
+static void tms9918a_raster_multi(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint8_t *out)
 {
     uint8_t px;
     pattern += code << 3;
     px = *pattern++;
-    quad(out, vdp->colourmap[px >> 4]);
-    quad(out + 4, vdp->colourmap[px & 15]);
+    quad(out, px >> 4);
+    quad(out + 4, px & 15);
     out += 4 * 256;
     px = *pattern;
-    quad(out, vdp->colourmap[px >> 4]);
-    quad(out + 4, vdp->colourmap[px & 15]);
+    quad(out, px >> 4);
+    quad(out + 4, px & 15);
 }    
     
 /* Aka semi-graphics - this mode is almost never used. Each character
@@ -361,43 +492,44 @@ static void tms9918a_raster_multi(struct tms9918a *vdp, uint8_t code, uint8_t *p
 static void tms9918a_rasterize_mc(struct tms9918a *vdp)
 {
     unsigned int x,y;
-    uint8_t *p = vdp->framebuffer + ((vdp->reg[2] & 0x0F) << 10);
-    uint8_t *pattern = vdp->framebuffer + ((vdp->reg[4] & 0x07) << 11);
-    uint32_t *fp = vdp->rasterbuffer;
+    uint16_t name = (vdp->reg[2] & 0x0F) << 10;
+    uint16_t pat = (vdp->reg[4] & 0x07) << 11;
+    uint8_t *p = vdp->framebuffer + name;
+    uint8_t *pattern = vdp->framebuffer + pat;
+    uint8_t *fp = vdp->rasterbuffer;
+    unsigned int sprites = tms9918a_sprites_changed(vdp);
 
     for (y = 0; y < 24; y++) {
+        unsigned int all = vdp->full | vdp->rowforce[y];
         for (x = 0; x < 32; x++) {
-            tms9918a_raster_multi(vdp, *p++, pattern + ((y & 3) << 1), fp);
+            uint8_t code = *p++;
+            if (all || VDIRTY(vdp, name) || VDIRTY(vdp, pat + (code << 3))) {
+                tms9918a_raster_multi(vdp, code, pattern + ((y & 3) << 1), fp);
+                tms9918a_row_dirty(vdp, y);
+            }
+            name++;
             fp += 8;
         }
         fp += 7 * 256;
     }    
-    tms9918a_raster_sprites(vdp);
+    tms9918a_update_sprites(vdp, sprites);
 }
 
 /*
  *	Rasterise a text symbol
  */
-static void tms9918a_raster_pattern6(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint32_t *out)
+static void tms9918a_raster_pattern6(struct tms9918a *vdp, uint8_t code, uint8_t *pattern, uint8_t *out)
 {
-    unsigned int x,y;
-    uint8_t bits;
-    uint32_t background = vdp->colourmap[vdp->reg[7] & 0x0F];
-    uint32_t foreground = vdp->colourmap[vdp->reg[7] >> 4];
+    uint8_t background = vdp->reg[7] & 0x0F;
+    uint8_t foreground = vdp->reg[7] >> 4;
+    unsigned int y;
 
+    /* 8 rows, left 6 columns (highest bits) used. 256 bytes per row even
+       when working in 240 pixel */
     pattern += code << 3;
-
-    /* 8 rows, left 6 columns (highest bits) used */
     for (y = 0; y < 8; y++) {
-        bits = *pattern++;
-        for (x = 0; x < 6; x++) {
-            if (bits & 0x80)
-                *out++ = foreground;
-            else
-                *out++ = background;
-            bits <<= 1;
-        }
-        out += 250;	/* 256 bytes per row even when working in 240 pixel */
+        tms9918a_expand6(out, *pattern++, foreground, background);
+        out += 256;
     }
 }
 
@@ -407,80 +539,366 @@ static void tms9918a_raster_pattern6(struct tms9918a *vdp, uint8_t code, uint8_t
  */
 static void tms9918a_rasterize_text(struct tms9918a *vdp)
 {
-    uint8_t *p = vdp->framebuffer + ((vdp->reg[2] & 0x0F) << 10);
-    uint8_t *pattern = vdp->framebuffer + ((vdp->reg[4] & 0x07) << 11);
-    uint32_t *fp = vdp->rasterbuffer;
+    uint16_t name = (vdp->reg[2] & 0x0F) << 10;
+    uint16_t pat = (vdp->reg[4] & 0x07) << 11;
+    uint8_t *p = vdp->framebuffer + name;
+    uint8_t *pattern = vdp->framebuffer + pat;
+    uint8_t *fp = vdp->rasterbuffer;
     unsigned int x, y;
-    uint32_t background = vdp->colourmap[vdp->reg[7] & 0x0F];
+    uint8_t background = vdp->reg[7] & 0x0F;
 
     /* Everything really happens in screen thirds but for this mode it
        does not actually matter */
     for (y = 0; y < 24; y++) {
-        /* Weird 6bit wide mode */
-        for (x = 0; x < 8; x++) {
-            fp[256] = background;
-            fp[512] = background;
-            fp[768] = background;
-            fp[1024] = background;
-            fp[1280] = background;
-            fp[1536] = background;
-            fp[1792] = background;
-            *fp++ = background;
-        }
+        /* Weird 6bit wide mode. The border only changes with register 7 */
+        if (vdp->full) {
+            for (x = 0; x < 8; x++) {
+                fp[256] = background;
+                fp[512] = background;
+                fp[768] = background;
+                fp[1024] = background;
+                fp[1280] = background;
+                fp[1536] = background;
+                fp[1792] = background;
+                fp[248] = background;
+                fp[248 + 256] = background;
+                fp[248 + 512] = background;
+                fp[248 + 768] = background;
+                fp[248 + 1024] = background;
+                fp[248 + 1280] = background;
+                fp[248 + 1536] = background;
+                fp[248 + 1792] = background;
+                *fp++ = background;
+            }
+        } else
+            fp += 8;
         for (x = 0 ; x < 40; x++) { 
-            tms9918a_raster_pattern6(vdp, *p++, pattern, fp);
+            uint8_t code = *p++;
+            if (vdp->full || VDIRTY(vdp, name) || VDIRTY(vdp, pat + (code << 3))) {
+                tms9918a_raster_pattern6(vdp, code, pattern, fp);
+                tms9918a_row_dirty(vdp, y);
+            }
+            name++;
             fp += 6;
         }
-        for (x = 0; x < 8; x++) {
-            fp[256] = background;
-            fp[512] = background;
-            fp[768] = background;
-            fp[1024] = background;
-            fp[1280] = background;
-            fp[1536] = background;
-            fp[1792] = background;
-            *fp++ = background;
-        }
         /* Our rows are 256 pixels but for text we use the middle 240 */
-        fp += 7 * 256;
+        fp += 8 + 7 * 256;
     }
     /* No sprites in text mode */
 }
 
 /*
- *	Rasterize the frame buffer for the current settings. Generates a
- *	32bit frame buffer image in 256x192 pixels ready for SDL2 or similar
- *	to scale and render onto the actual framebuffer. Call this every
- *	vblank frame.
+ *	Timed mode draws one scan line at a time with whatever VRAM and
+ *	registers hold when the beam gets there. Same modes, same output.
+ */
+static void tms9918a_draw_line(struct tms9918a *vdp, unsigned int y)
+{
+    unsigned int mode = (vdp->reg[1] >> 2) & 0x06;
+    uint8_t *name = vdp->framebuffer + ((vdp->reg[2] & 0x0F) << 10);
+    uint8_t *pattern = vdp->framebuffer + ((vdp->reg[4] & 0x07) << 11);
+    uint8_t *colour = vdp->framebuffer + (vdp->reg[3] << 6);
+    uint8_t *out = vdp->rasterbuffer + 256 * y;
+    unsigned int row = y & 7;
+    unsigned int x;
+
+    mode |= (vdp->reg[0] & 0x02) >> 1;
+    vdp->linedirty[y] = 1;
+    vdp->argbdirty[y] = 1;
+
+    if ((vdp->reg[1] & 0x40) == 0) {
+        memset(out, 0, 256);
+        return;
+    }
+    switch(mode) {
+    case 0:
+        name += (y >> 3) << 5;
+        for (x = 0; x < 32; x++) {
+            uint8_t code = *name++;
+            uint8_t c = colour[code >> 3];
+            tms9918a_expand8(out, pattern[(code << 3) + row], c >> 4, c & 0x0F);
+            out += 8;
+        }
+        break;
+    case 1:
+    {
+        uint16_t pat0 = (vdp->reg[4] & 0x04) << 11;
+        uint16_t col0 = (vdp->reg[3] & 0x80) << 6;
+        uint16_t pat = pat0;
+        uint16_t col = col0;
+        /* As tms9918a_rasterize_g2 */
+        if (y >= 64) {
+            if (vdp->reg[4] & 0x01)
+                pat += 0x0800;
+            if (vdp->reg[3] & 0x20)
+                col += 0x0800;
+        }
+        if (y >= 128) {
+            if (vdp->reg[4] & 0x02)
+                pat = pat0 + 0x1000;
+            if (vdp->reg[3] & 0x40)
+                col = col0 + 0x1000;
+        }
+        name += (y >> 3) << 5;
+        for (x = 0; x < 32; x++) {
+            uint16_t code = (*name++ << 3) + row;
+            uint8_t c = vdp->framebuffer[col + code];
+            tms9918a_expand8(out, vdp->framebuffer[pat + code], c >> 4, c & 0x0F);
+            out += 8;
+        }
+        /* No sprites in G2 here either */
+        return;
+    }
+    case 2:
+        pattern += (((y >> 3) & 3) << 1) + (row >> 2);
+        name += (y >> 3) << 5;
+        for (x = 0; x < 32; x++) {
+            uint8_t px = pattern[*name++ << 3];
+            memset(out, px >> 4, 4);
+            memset(out + 4, px & 0x0F, 4);
+            out += 8;
+        }
+        break;
+    case 4:
+    {
+        uint8_t background = vdp->reg[7] & 0x0F;
+        uint8_t foreground = vdp->reg[7] >> 4;
+        name += (y >> 3) * 40;
+        memset(out, background, 8);
+        memset(out + 248, background, 8);
+        out += 8;
+        for (x = 0; x < 40; x++) {
+            tms9918a_expand6(out, pattern[(*name++ << 3) + row], foreground, background);
+            out += 6;
+        }
+        return;
+    }
+    default:
+        memset(out, 0, 256);
+        return;
+    }
+    tms9918a_sprite_bin(vdp, y, y);
+    tms9918a_sprite_line(vdp, y);
+}
+
+/* Timed mode: the display line the beam is on, or -1 in the blanking */
+#define TMS_LINES_BLANK	(TMS9918A_LINES - 192)	/* vblank starts the frame */
+
+static int tms9918a_beam(struct tms9918a *vdp)
+{
+    uint64_t l = (vdp->now - vdp->frame) / vdp->line_clocks;
+    if (l < TMS_LINES_BLANK || l >= TMS_LINES_BLANK + 192)
+        return -1;
+    return l - TMS_LINES_BLANK;
+}
+
+/* Draw the lines the beam has finished with up to but not including y */
+static void tms9918a_draw_to(struct tms9918a *vdp, unsigned int y)
+{
+    if (vdp->beam == 0 && y)
+        memset(vdp->linedirty, 0, sizeof(vdp->linedirty));
+    while (vdp->beam < y)
+        tms9918a_draw_line(vdp, vdp->beam++);
+}
+
+/*
+ *	Draw scan line y of TMS9918A_LINES, for a board that steps the beam
+ *	off its own scheduler instead of rasterizing each frame in one go
+ *	or using timed mode. Lines 0-191 are the picture; line 192 begins
+ *	vblank, raises the frame interrupt and returns 1 to say the picture
+ *	is complete and can be presented.
+ */
+int tms9918a_raster_line(struct tms9918a *vdp, unsigned int y)
+{
+    if (y < 192) {
+        if (y == 0)
+            memset(vdp->linedirty, 0, sizeof(vdp->linedirty));
+        tms9918a_draw_line(vdp, y);
+        return 0;
+    }
+    if (y != 192)
+        return 0;
+    memset(vdp->vdirty, 0, sizeof(vdp->vdirty));
+    vdp->written = 0;
+    vdp->full = 1;	/* The frame renderer has to start afresh */
+    vdp->status |= 0x80;
+    return 1;
+}
+
+/*
+ *	Tell the VDP where the CPU clock is. In timed mode the board calls
+ *	this before every access so that lines the beam has passed are
+ *	drawn with the state from before it.
+ */
+void tms9918a_sync(struct tms9918a *vdp, uint64_t clock)
+{
+    uint64_t l;
+
+    vdp->now = clock;
+    if (vdp->line_clocks == 0 || clock < vdp->frame)
+        return;
+    l = (clock - vdp->frame) / vdp->line_clocks;
+    if (l <= TMS_LINES_BLANK)
+        return;
+    l -= TMS_LINES_BLANK;
+    tms9918a_draw_to(vdp, l > 192 ? 192 : l);
+}
+
+/*
+ *	Does a VRAM access now get a slot. During active display the CPU
+ *	only gets one every few microseconds depending on the mode; an
+ *	access that comes sooner is lost.
+ */
+static int tms9918a_slot(struct tms9918a *vdp)
+{
+    unsigned int mode = (vdp->reg[1] >> 2) & 0x06;
+    unsigned int gap = vdp->gap_blank;
+
+    if (vdp->line_clocks == 0)
+        return 1;
+    mode |= (vdp->reg[0] & 0x02) >> 1;
+    if ((vdp->reg[1] & 0x40) && tms9918a_beam(vdp) != -1)
+        gap = vdp->gap_active[mode];
+    if (vdp->now < vdp->next_slot) {
+        if (TRACE_ON(vdp->trace))
+            fprintf(stderr, "vdp: access too fast, lost.\n");
+        return 0;
+    }
+    vdp->next_slot = vdp->now + gap;
+    return 1;
+}
+
+/*
+ *	Turn timed mode on for a CPU clocked at khz, or off with 0. Access
+ *	gaps are the worst case datasheet figures in tenths of a microsecond.
+ */
+void tms9918a_set_timing(struct tms9918a *vdp, unsigned int khz)
+{
+    static const unsigned int gap[8] = { 80, 80, 35, 20, 60, 20, 20, 20 };
+    unsigned int i;
+
+    /* 342 pixel clocks at 5.37MHz */
+    vdp->line_clocks = khz * 637 / 10000;
+    for (i = 0; i < 8; i++)
+        vdp->gap_active[i] = (khz * gap[i] + 9999) / 10000;
+    vdp->gap_blank = (khz * 20 + 9999) / 10000;
+    vdp->frame = vdp->now;
+    vdp->next_slot = 0;
+    vdp->beam = 192;
+    vdp->full = 1;
+}
+
+/*
+ *	End a frame without drawing it, for when nobody can see the picture.
+ *	The status and frame interrupt carry on as if it had been drawn and
+ *	the next tms9918a_rasterize redraws everything.
+ */
+void tms9918a_vblank(struct tms9918a *vdp)
+{
+    unsigned int mode = (vdp->reg[1] >> 2) & 0x06;
+    uint8_t status = vdp->status;
+    mode |= (vdp->reg[0] & 0x02) >> 1;
+
+    /* Timed mode draws as the beam goes */
+    if (vdp->line_clocks) {
+        tms9918a_rasterize(vdp);
+        return;
+    }
+    vdp->frames++;
+    if (vdp->full || vdp->written) {
+        /* Only the sprite modes we draw sprites for have a sprite status.
+           They go over the old picture, which is going to be redrawn */
+        if ((vdp->reg[1] & 0x40) == 0 || (mode != 0 && mode != 2))
+            vdp->sprstatus = 0;
+        else if (tms9918a_sprites_changed(vdp)) {
+            vdp->status = 0;
+            tms9918a_raster_sprites(vdp);
+            vdp->sprstatus = vdp->status;
+            vdp->status = status;
+        }
+        memset(vdp->vdirty, 0, sizeof(vdp->vdirty));
+        vdp->written = 0;
+        vdp->full = 0;
+        vdp->stale = 1;
+    }
+    vdp->status |= vdp->sprstatus | 0x80;
+}
+
+/*
+ *	Rasterize the frame buffer for the current settings. Generates an
+ *	indexed image in 256x192 pixels for the renderer to expand, or have
+ *	tms9918a_get_raster expand, scale and render onto the actual
+ *	framebuffer. Call this every vblank frame.
  */
 void tms9918a_rasterize(struct tms9918a *vdp)
 {
     unsigned int mode = (vdp->reg[1] >> 2) & 0x06;
     mode |= (vdp->reg[0] & 0x02) >> 1;
 
-    if ((vdp->reg[1] & 0x40) == 0)
-        memset(vdp->rasterbuffer, 0, sizeof(vdp->rasterbuffer));
-    else {
+    vdp->frames++;
+
+    /* Timed mode: finish the picture and start the next frame's clock */
+    if (vdp->line_clocks) {
+        tms9918a_draw_to(vdp, 192);
+        vdp->frame = vdp->now;
+        vdp->beam = 0;
+        memset(vdp->vdirty, 0, sizeof(vdp->vdirty));
+        vdp->written = 0;
+        vdp->full = 1;	/* In case timing is turned back off */
+        vdp->status |= 0x80;
+        return;
+    }
+
+    memset(vdp->linedirty, 0, sizeof(vdp->linedirty));
+
+    /* The picture is however out of date tms9918a_vblank left it */
+    if (vdp->stale) {
+        vdp->full = 1;
+        vdp->stale = 0;
+    }
+
+    /* Nothing was written so the picture and collisions are unchanged */
+    if (!vdp->full && !vdp->written) {
+        vdp->status |= vdp->sprstatus | 0x80;
+        return;
+    }
+
+    if ((vdp->reg[1] & 0x40) == 0) {
+        if (vdp->full) {
+            memset(vdp->rasterbuffer, 0, sizeof(vdp->rasterbuffer));
+            tms9918a_all_dirty(vdp);
+        }
+        vdp->sprstatus = 0;
+    } else {
+        memset(vdp->rowforce, 0, sizeof(vdp->rowforce));
         switch(mode) {
         case 0:
             tms9918a_rasterize_g1(vdp);
             break;
         case 1:
             tms9918a_rasterize_g2(vdp);
+            vdp->sprstatus = 0;
             break;
         case 2:
             tms9918a_rasterize_mc(vdp);
             break;
         case 4:
             tms9918a_rasterize_text(vdp);
+            vdp->sprstatus = 0;
             break;
         default:
             /* There are things that happen for the invalid cases but address
                them later maybe */
+            if (vdp->full) {
                memset(vdp->rasterbuffer, 0, sizeof(vdp->rasterbuffer));
+               tms9918a_all_dirty(vdp);
+            }
+            vdp->sprstatus = 0;
         }
     }
-    if (vdp->trace)
+    memset(vdp->vdirty, 0, sizeof(vdp->vdirty));
+    vdp->written = 0;
+    vdp->full = 0;
+    if (TRACE_ON(vdp->trace))
         fprintf(stderr, "vdp: frame done.\n");
     vdp->status |= 0x80;
 }
@@ -502,9 +920,14 @@ void tms9918a_write(struct tms9918a *vdp, uint8_t addr, uint8_t val)
 {
     switch(addr & 1) {
     case 0:
-        if (vdp->trace)
+        if (TRACE_ON(vdp->trace))
             fprintf(stderr, "vdp: write fb %04x<-%02X\n", vdp->addr, val);
-        vdp->framebuffer[vdp->addr] = val;
+        /* In timed mode a write that misses its slot is lost */
+        if (tms9918a_slot(vdp) && vdp->framebuffer[vdp->addr] != val) {
+            vdp->framebuffer[vdp->addr] = val;
+            vdp->vdirty[vdp->addr >> 3] = 1;
+            vdp->written = 1;
+        }
         vdp->addr++;
         vdp->addr &= vdp->memmask;
         /* A data write clears the latch, this means you can write the low
@@ -531,7 +954,7 @@ void tms9918a_write(struct tms9918a *vdp, uint8_t addr, uint8_t val)
                 /* Strictly speaking this makes a request, the result turns
                    up in a bit. We might want to model a downcounter to trap
                    errors in this */
-                if (vdp->trace)
+                if (TRACE_ON(vdp->trace))
                     fprintf(stderr, "vdp: set up to read %04x\n", vdp->addr);
                 break;
             /* Memory write set up */
@@ -540,14 +963,17 @@ void tms9918a_write(struct tms9918a *vdp, uint8_t addr, uint8_t val)
                 vdp->addr |= val << 8;
                 vdp->addr &= vdp->memmask;
                 vdp->read = 0;
-                if (vdp->trace)
+                if (TRACE_ON(vdp->trace))
                     fprintf(stderr, "vdp: set up to write %04x\n", vdp->addr);
                 break;
             /* Write to a register. Not clear if the low part of the address
                and latched data are one but they seem to be */
             case 0x80:
-                vdp->reg[val & 7] = vdp->addr & 0xFF;
-                if (vdp->trace)
+                if (vdp->reg[val & 7] != (vdp->addr & 0xFF)) {
+                    vdp->reg[val & 7] = vdp->addr & 0xFF;
+                    vdp->full = 1;
+                }
+                if (TRACE_ON(vdp->trace))
                     fprintf(stderr, "vdp: write reg %02X <- %02x\n", val, vdp->addr & 0xFF);
                 break;
             /* Unused on the VDP1 */
@@ -562,16 +988,20 @@ uint8_t tms9918a_read(struct tms9918a *vdp, uint8_t addr)
     uint8_t r;
     switch(addr & 1) {
     case 0:
-        r = vdp->framebuffer[vdp->addr++ & vdp->memmask];
-        if (vdp->trace)
+        /* Too soon and the CPU gets whatever was fetched last */
+        if (tms9918a_slot(vdp))
+            vdp->rdlatch = vdp->framebuffer[vdp->addr & vdp->memmask];
+        r = vdp->rdlatch;
+        vdp->addr++;
+        if (TRACE_ON(vdp->trace))
             fprintf(stderr, "vdp: read data %02x\n", r);
         break;
     case 1:
         r = tms9918a_status(vdp);
         /* Nasty if we have data latched it just went poof! */
-        if (vdp->latch && vdp->trace)
+        if (vdp->latch && TRACE_ON(vdp->trace))
             fprintf(stderr, "vdp: status read cleared latch.\n");
-        if (vdp->trace)
+        if (TRACE_ON(vdp->trace))
             fprintf(stderr, "vdp: read status %02x\n", r);
         break;
     }
@@ -586,6 +1016,13 @@ void tms9918a_reset(struct tms9918a *vdp)
     vdp->latch = 0;
     vdp->read = 0;
     vdp->memmask = 0x3FFF;	/* 16K */
+    vdp->full = 1;
+    vdp->stale = 0;
+    vdp->sprstatus = 0;
+    vdp->next_slot = 0;
+    memset(vdp->sprline, 0, sizeof(vdp->sprline));
+    memset(vdp->spcount, 0, sizeof(vdp->spcount));
+    memset(vdp->spfifth, 0, sizeof(vdp->spfifth));
 }
 
 struct tms9918a *tms9918a_create(void)
@@ -595,10 +1032,21 @@ struct tms9918a *tms9918a_create(void)
         fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
+    tms9918a_expand_init();
+    memset(vdp->argbdirty, 1, sizeof(vdp->argbdirty));
+    vdp->line_clocks = 0;
+    vdp->now = 0;
+    vdp->frame = 0;
+    vdp->beam = 192;
     tms9918a_reset(vdp);
     return vdp;
 }
 
+void tms9918a_free(struct tms9918a *vdp)
+{
+    free(vdp);
+}
+
 void tms9918a_trace(struct tms9918a *vdp, int onoff)
 {
     vdp->trace = onoff;
@@ -611,12 +1059,89 @@ int tms9918a_irq_pending(struct tms9918a *vdp)
     return 0;
 }
 
-uint32_t *tms9918a_get_raster(struct tms9918a *vdp)
+/* The picture as colour indices 0-15, a byte a pixel */
+const uint8_t *tms9918a_get_indexed(struct tms9918a *vdp)
 {
     return vdp->rasterbuffer;
 }
 
+/* The picture through the colour map, catching up the lines changed */
+uint32_t *tms9918a_get_raster(struct tms9918a *vdp)
+{
+    const uint32_t *map = vdp->colourmap;
+    unsigned int y, x;
+
+    for (y = 0; y < 192; y++) {
+        const uint8_t *in = vdp->rasterbuffer + 256 * y;
+        uint32_t *out = vdp->argb + 256 * y;
+        if (!vdp->argbdirty[y])
+            continue;
+        for (x = 0; x < 256; x++)
+            out[x] = map[in[x]];
+        vdp->argbdirty[y] = 0;
+    }
+    return vdp->argb;
+}
+
+/* The indexed picture does not change, only what it expands to */
 void tms9918a_set_colourmap(struct tms9918a *vdp, uint32_t *ctab)
 {
     vdp->colourmap = ctab;
+    memset(vdp->argbdirty, 1, sizeof(vdp->argbdirty));
+}
+
+/* Which of the 192 raster lines changed in the last frame */
+const uint8_t *tms9918a_get_dirty(struct tms9918a *vdp)
+{
+    return vdp->linedirty;
+}
+
+/* Snapshot support. The raster is rebuilt from VRAM on the next frame */
+struct tms9918a_state {
+    uint8_t reg[8];
+    uint8_t status;
+    uint8_t latch;
+    uint8_t read;
+    uint8_t unused;
+    uint16_t addr;
+    uint8_t framebuffer[16384];
+};
+
+unsigned long long tms9918a_frames(struct tms9918a *vdp)
+{
+    return vdp->frames;
+}
+
+size_t tms9918a_save(struct tms9918a *vdp, void *buf)
+{
+    struct tms9918a_state st;
+
+    if (buf == NULL)
+        return sizeof(st);
+    memcpy(st.reg, vdp->reg, 8);
+    st.status = vdp->status;
+    st.latch = vdp->latch;
+    st.read = vdp->read;
+    st.unused = 0;
+    st.addr = vdp->addr;
+    memcpy(st.framebuffer, vdp->framebuffer, sizeof(st.framebuffer));
+    memcpy(buf, &st, sizeof(st));
+    return sizeof(st);
+}
+
+int tms9918a_load(struct tms9918a *vdp, const void *buf, size_t len)
+{
+    struct tms9918a_state st;
+
+    if (len != sizeof(st))
+        return -1;
+    memcpy(&st, buf, sizeof(st));
+    memcpy(vdp->reg, st.reg, 8);
+    vdp->status = st.status;
+    vdp->latch = st.latch;
+    vdp->read = st.read;
+    vdp->addr = st.addr;
+    memcpy(vdp->framebuffer, st.framebuffer, sizeof(vdp->framebuffer));
+    vdp->full = 1;
+    return 0;
 }
@@ -1,6 +1,7 @@
 struct tms9918a;
 
 extern void tms9918a_rasterize(struct tms9918a *vdp);
+extern void tms9918a_vblank(struct tms9918a *vdp);
 extern void tms9918a_write(struct tms9918a *vdp, uint8_t addr, uint8_t val);
 extern uint8_t tms9918a_read(struct tms9918a *vdp, uint8_t addr);
 extern struct tms9918a *tms9918a_create(void);
@@ -9,4 +10,20 @@ extern void tms9918a_reset(struct tms9918a *vdp);
 extern void tms9918a_trace(struct tms9918a *vdp, int onoff);
 extern int tms9918a_irq_pending(struct tms9918a *vdp);
 extern uint32_t *tms9918a_get_raster(struct tms9918a *vdp);
+extern const uint8_t *tms9918a_get_indexed(struct tms9918a *vdp);
+extern const uint8_t *tms9918a_get_dirty(struct tms9918a *vdp);
+extern void tms9918a_set_timing(struct tms9918a *vdp, unsigned int khz);
+extern unsigned long long tms9918a_frames(struct tms9918a *vdp);
+/*
+ *	Video devices that can be drawn a line at a time offer
+ *	<dev>_raster_line(dev, line) and <DEV>_LINES, the scan lines in a
+ *	frame with blanking. The board calls it every 1/<DEV>_LINES frame
+ *	and presents the picture when it returns 1.
+ */
+#define TMS9918A_LINES	262
+
+extern int tms9918a_raster_line(struct tms9918a *vdp, unsigned int line);
+extern void tms9918a_sync(struct tms9918a *vdp, uint64_t clock);
 extern void tms9918a_set_colourmap(struct tms9918a *vdp, uint32_t *ctab);
+extern size_t tms9918a_save(struct tms9918a *vdp, void *buf);
+extern int tms9918a_load(struct tms9918a *vdp, const void *buf, size_t len);
@@ -9,6 +9,7 @@
 
 #include "tms9918a.h"
 #include "tms9918a_render.h"
+#include "framestream.h"
 
 static uint32_t vdp_ctab[16] = {
     0x000000FF,		/* transparent (we render as black) */
@@ -34,15 +35,26 @@ static uint32_t vdp_ctab[16] = {
 
 struct tms9918a_renderer {
     struct tms9918a *vdp;
+    struct framestream *stream;
 };
     
 
 void tms9918a_render(struct tms9918a_renderer *render)
 {
+    /* The stream expands the indices itself unless it wants them */
+    if (render->stream)
+        framestream_frame8(render->stream, tms9918a_get_indexed(render->vdp), vdp_ctab, 16);
+}
+
+/* Frames may be streamed so always draw them */
+int tms9918a_visible(struct tms9918a_renderer *render)
+{
+    return 1;
 }
 
 void tms9918a_renderer_free(struct tms9918a_renderer *render)
 {
+    framestream_free(render->stream);
     free(render);
 }
 
@@ -58,6 +70,7 @@ struct tms9918a_renderer *tms9918a_renderer_create(struct tms9918a *vdp)
     }
     memset(render, 0, sizeof(struct tms9918a_renderer));
     render->vdp = vdp;
+    render->stream = framestream_create("TMS9918A_STREAM", 256, 192);
     tms9918a_set_colourmap(vdp, vdp_ctab);
     return render;
 }
@@ -10,8 +10,7 @@
 
 #include "tms9918a.h"
 #include "tms9918a_render.h"
-
-static int sdl_live;
+#include "sdl2_texture.h"
 
 static uint32_t vdp_ctab[16] = {
     0xFF000000,		/* transparent (we render as black) */
@@ -37,30 +36,28 @@ static uint32_t vdp_ctab[16] = {
 
 struct tms9918a_renderer {
     struct tms9918a *vdp;
-    SDL_Renderer *render;
-    SDL_Texture *texture;
-    SDL_Window *window;
+    struct sdltex *stream;
 };
     
 
 void tms9918a_render(struct tms9918a_renderer *render)
 {
-    SDL_Rect sr;
+    uint32_t *raster = tms9918a_get_raster(render->vdp);
+
+    sdltex_dirty(render->stream, tms9918a_get_dirty(render->vdp));
+    sdltex_present(render->stream, raster);
+}
 
-    sr.x = 0;
-    sr.y = 0;
-    sr.w = 256;
-    sr.h = 192;
-    SDL_UpdateTexture(render->texture, NULL, tms9918a_get_raster(render->vdp), 1024);
-    SDL_RenderClear(render->render);
-    SDL_RenderCopy(render->render, render->texture, NULL, &sr);
-    SDL_RenderPresent(render->render);
+/* Minimized or hidden windows need not be drawn */
+int tms9918a_visible(struct tms9918a_renderer *render)
+{
+    return sdltex_visible(render->stream);
 }
 
 void tms9918a_renderer_free(struct tms9918a_renderer *render)
 {
-    if (render->texture)
-        SDL_DestroyTexture(render->texture);
+    if (render->stream)
+        sdltex_free(render->stream);
     free(render);
 }
 
@@ -69,17 +66,6 @@ struct tms9918a_renderer *tms9918a_renderer_create(struct tms9918a *vdp)
 {
     struct tms9918a_renderer *render;
 
-    /* We will need a nicer way to do this once we have multiple SDL using
-       devices */
-    if (sdl_live == 0) {
-        sdl_live = 1;
-        if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-            fprintf(stderr, "SDL init failed: %s.\n", SDL_GetError());
-            exit(1);
-        }
-        atexit(SDL_Quit);
-    }
-
     render = malloc(sizeof(struct tms9918a_renderer));
     if (render == NULL) {
         fprintf(stderr, "Out of memory.\n");
@@ -88,33 +74,6 @@ struct tms9918a_renderer *tms9918a_renderer_create(struct tms9918a *vdp)
     memset(render, 0, sizeof(struct tms9918a_renderer));
     render->vdp = vdp;
     tms9918a_set_colourmap(vdp, vdp_ctab);
-    render->window = SDL_CreateWindow("TMS9918A",
-        SDL_WINDOWPOS_UNDEFINED,
-        SDL_WINDOWPOS_UNDEFINED,
-        512, 384,
-        SDL_WINDOW_RESIZABLE);
-    if (render->window == NULL) {
-        fprintf(stderr, "Unable to create window: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    render->render = SDL_CreateRenderer(render->window, -1, SDL_RENDERER_ACCELERATED);
-    if (render->render == NULL) {
-        fprintf(stderr, "Unable to create renderer: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-    SDL_RenderSetLogicalSize(render->render, 256, 192);
-
-    render->texture = SDL_CreateTexture(render->render,
-                        SDL_PIXELFORMAT_ARGB8888,
-                        SDL_TEXTUREACCESS_STREAMING,
-                        256, 192);
-    if (render->render == NULL) {
-        fprintf(stderr, "Unable to create renderer: %s.\n", SDL_GetError());
-        exit(1);
-    }
-    SDL_SetRenderDrawColor(render->render, 0, 0, 0, 255);
-    SDL_RenderClear(render->render);
-    SDL_RenderPresent(render->render);
+    render->stream = sdltex_create("TMS9918A", 512, 384, 256, 192);
     return render;
 }
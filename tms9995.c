@@ -99,6 +99,7 @@
 #include <string.h>
 
 #include "tms9995.h"
+#include "trace.h"
 
 #define NOPRG -1
 
@@ -136,7 +137,9 @@ static void tms9995_decode(struct tms9995 *tms, uint16_t inst);
 static void tms9995_word_read(struct tms9995 *tms);
 static void tms9995_command_completed(struct tms9995 *tms);
 static void tms9995_trigger_decrementer(struct tms9995 *tms);
+static void tms9995_dec_update(struct tms9995 *tms);
 static void tms9995_build_command_lookup_table(struct tms9995 *tms);
+static void tms9995_build_handlers(void);
 static void tms9995_disassemble(struct tms9995 *tms);
 
 /****************************************************************************
@@ -144,15 +147,17 @@ static void tms9995_disassemble(struct tms9995 *tms);
 ****************************************************************************/
 
 
-/* FIXME: 9537 rule ?? */
-static bool is_onchip(struct tms9995 *tms, uint16_t addr)
+/* F000-F0FB and FFFC-FFFF. The decrementer at FFFA is checked for
+   separately. FIXME: 9537 rule ?? */
+static inline bool is_onchip(struct tms9995 *tms, uint16_t addr)
 {
-	if ((addr & 0xFF00) == 0xF000 && addr < 0xF0FC)
-		return true;
-	if ((addr & 0xFFFC) == 0xFFFC)
-		return true;
-	/* FIXME: decrementer */
-	return false;
+	return (uint16_t)(addr - 0xF000) < 0xFC || addr >= 0xFFFC;
+}
+
+/* Word holding an on-chip address, FFFC-FFFF fold back onto F0FC-F0FF */
+static inline uint16_t *onchip_word(struct tms9995 *tms, uint16_t addr)
+{
+	return &tms->onchip_memory[(addr & 0xFE) >> 1];
 }
 
 /****************************************************************************
@@ -172,6 +177,7 @@ struct tms9995 *tms9995_create(bool is_mp9537, bool bstep)
 		tms->holda_line(*this)
 #endif		
 	tms->check_overflow = !bstep;
+	tms->dec_deadline = UINT64_MAX;
 	// Set up the lookup table for command decoding
 	tms9995_build_command_lookup_table(tms); return tms;
 }
@@ -238,7 +244,7 @@ uint16_t tms9995_read_workspace_register_debug(struct tms9995 *tms, int reg)
 
 	if (is_onchip(tms, addrb))
 	{
-		value = (tms->onchip_memory[addrb & 0x00fe]<<8) | tms->onchip_memory[(addrb & 0x00fe) + 1];
+		value = *onchip_word(tms, addrb);
 	}
 	else
 	{
@@ -872,6 +878,14 @@ const tms9995_instruction s_command[] =
 	{ 0x0000, OPAD, 1, operand_address_derivation }
 };
 
+#define NCOMMAND	(sizeof(s_command) / sizeof(s_command[0]))
+
+/*
+    The microprograms as tables of handlers, so the fast loop can call the
+    next step without looking it up through s_microoperation.
+*/
+static ophandler *s_handlers[NCOMMAND];
+
 /*
     Create a B-tree for looking up the commands. Each node can carry up to
     16 entries, indexed by 4 consecutive bits in the opcode.
@@ -884,6 +898,9 @@ const tms9995_instruction s_command[] =
 
 static struct tms_decode *decode_root;
 
+/* The tree flattened out to one entry per instruction word */
+static int16_t decode_index[65536];
+
 /*
  *	Make a new empty tree node
  */
@@ -936,6 +953,50 @@ static void insert_decode(const tms9995_instruction *inst, unsigned int inum)
 	
 }		
 
+/*
+ *	Find the program for an instruction word in the decode tree
+ */
+static int tms9995_lookup_tree(uint16_t opcode)
+{
+	struct tms_decode *table = decode_root;
+	int ix;
+
+	while (1)
+	{
+		ix = (opcode >> 12) & 0x000f;
+		if (table->next_digit[ix] == NULL)
+			return table->index[ix];
+		table = table->next_digit[ix];
+		opcode = opcode << 4;
+	}
+}
+
+/*
+ *	Turn each microprogram into a handler table. The address derivation
+ *	program is entered part way through so has no END of its own.
+ */
+static void tms9995_build_handlers(void)
+{
+	const uint8_t *prog;
+	unsigned int i;
+	unsigned int n;
+
+	for (i = 0; i < NCOMMAND; i++) {
+		prog = s_command[i].prog;
+		if (prog == operand_address_derivation)
+			n = sizeof(operand_address_derivation);
+		else
+			for (n = 0; prog[n++] != END; );
+		s_handlers[i] = malloc(n * sizeof(ophandler));
+		if (s_handlers[i] == NULL) {
+			fprintf(stderr, "tms9995: out of memory.\n");
+			exit(1);
+		}
+		while (n--)
+			s_handlers[i][n] = s_microoperation[prog[n]];
+	}
+}
+
 /*
  *	Build the decode tree
  */
@@ -943,23 +1004,49 @@ static void tms9995_build_command_lookup_table(struct tms9995 *tms)
 {
 	int inum = 0;
 	const tms9995_instruction *inst = s_command;
+	unsigned int i;
 	
 	/* Built already ? */
 	if (decode_root)
 		return;
 
 	decode_root = new_decode();
+	tms9995_build_handlers();
 	
 	while(inst->opcode != 0) {
 		insert_decode(inst, inum);
 		inst++;
 		inum++;
 	}
+	for (i = 0; i < 65536; i++)
+		decode_index[i] = tms9995_lookup_tree(i);
 	// Save the index to these two special microprograms
 	tms->interrupt_mp_index = inum++;
 	tms->operand_address_derivation_index = inum;
 }
 
+/*
+    Main loop for when nothing is driving READY or HOLD and we are not
+    tracing the microcode. The lines only change between calls, so the
+    wait and hold checks can be left out and every step is a microprogram
+    handler. Cycles are still only counted in tms9995_pulse_clock.
+*/
+static void tms9995_execute_fast(struct tms9995 *tms)
+{
+	tms9995_set_hold_state(tms, false);
+	do
+	{
+		tms->check_ready = false;
+		s_handlers[tms->index][tms->MPC](tms);
+		tms->pass--;
+		if (tms->pass<=0)
+		{
+			tms->pass = 1;
+			tms->MPC++;
+		}
+	} while (tms->icount>0 && !tms->reset);
+}
+
 /*
     Main execution loop
 
@@ -976,6 +1063,15 @@ void tms9995_execute_run(struct tms9995 *tms, unsigned int cycles)
 	if (tms->reset) tms9995_service_interrupt(tms);
 
 	if (tms->itrace) fprintf(stderr, "calling execute_run for %d cycles\n", tms->icount);
+
+	/* With READY and HOLD idle there are no wait or hold states to check */
+	if (!tms->itrace && tms->ready_bufd && !tms->auto_wait &&
+		!tms->hold_requested && (tms->ready || !tms->check_ready))
+	{
+		tms9995_execute_fast(tms);
+		return;
+	}
+
 	do
 	{
 		// Normal operation
@@ -1104,7 +1200,9 @@ void tms9995_reset_line(struct tms9995 *tms, bool state)
 		tms->log_interrupt = false;   // only for debugging
 		tms->request_auto_wait_state = false;
 		tms->hold_requested = false;
+		tms9995_dec_update(tms);
 		memset(tms->flag, 0, sizeof(tms->flag));
+		tms9995_dec_update(tms);
 	}
 }
 
@@ -1114,27 +1212,32 @@ void tms9995_reset_line(struct tms9995 *tms, bool state)
 static void tms9995_pulse_clock(struct tms9995 *tms, int count)
 {
 	int i;
-	for (i = 0; i < count; i++)
-	{
-		tms->ready = tms->ready_bufd && !tms->request_auto_wait_state;                // get the latched READY state
-		tms->icount--;                         // This is the only location where we count down the cycles.
 
-		if (tms->itrace) {
+	if (count <= 0)
+		return;
+
+	if (tms->itrace) {
+		for (i = 0; i < count; i++) {
 			if (tms->check_ready)
 				fprintf(stderr, "tms9995_pulse_clock, READY=%d, auto_wait=%d\n", tms->ready_bufd? 1:0, tms->auto_wait? 1:0);
 			else
 				fprintf(stderr, "tms9995_pulse_clock\n");
 		}
-
-		tms->request_auto_wait_state = false;
-		if (tms->flag[0] == false && tms->flag[1] == true)
-		{
-			// Section 2.3.1.2.2: "by decreasing the count in the Decrementing
-			// Register by one for each fourth CLKOUT cycle"
-			tms->decrementer_clkdiv = (tms->decrementer_clkdiv+1)%4;
-			if (tms->decrementer_clkdiv==0) tms9995_trigger_decrementer(tms);
-		}
 	}
+
+	// get the latched READY state. An auto wait request only covers the
+	// first of the clocks.
+	tms->ready = tms->ready_bufd && (count > 1 || !tms->request_auto_wait_state);
+	tms->request_auto_wait_state = false;
+	// This is the only location where we count down the cycles.
+	tms->icount -= count;
+
+	// Section 2.3.1.2.2: "by decreasing the count in the Decrementing
+	// Register by one for each fourth CLKOUT cycle". Rather than count
+	// each one down we only look at it when it is due to reach zero.
+	tms->clocks += count;
+	if (tms->clocks >= tms->dec_deadline)
+		tms9995_dec_update(tms);
 }
 
 /*
@@ -1192,31 +1295,13 @@ void tms9995_set_hold_state(struct tms9995 *tms, bool state)
 */
 static void tms9995_decode(struct tms9995 *tms, uint16_t inst)
 {
-	int ix = 0;
-	struct tms_decode *table = decode_root;
-	uint16_t opcode = inst;
-	bool complete = false;
-	int program_index;
+	int program_index = decode_index[inst];
 
 	tms->mid_active = false;
-
-	while (!complete)
-	{
-		ix = (opcode >> 12) & 0x000f;
-		if (tms->itrace) fprintf(stderr, "Check next hex digit of instruction %x\n", ix);
-		if (table->next_digit[ix] != NULL)
-		{
-			table = table->next_digit[ix];
-			opcode = opcode << 4;
-		}
-		else complete = true;
-	}
-
-	program_index = table->index[ix];
 	if (program_index == NOPRG)
 	{
 		// not found
-		if (tms->trace) fprintf(stderr, "Undefined opcode %04x at logical address %04x, will trigger MID\n", inst, tms->PC);
+		if (TRACE_ON(tms->trace)) fprintf(stderr, "Undefined opcode %04x at logical address %04x, will trigger MID\n", inst, tms->PC);
 		tms->pre_IR = 0;
 		tms->pre_command = MID;
 	}
@@ -1370,7 +1455,7 @@ static void tms9995_next_command(struct tms9995 *tms)
 		}
 
 		tms->PC_debug = tms->PC - 2;
-		if (tms->trace)
+		if (TRACE_ON(tms->trace))
 			tms9995_disassemble(tms);
 		tms->first_cycle = tms->icount;
 	}
@@ -1431,6 +1516,7 @@ static void tms9995_service_interrupt(struct tms9995 *tms)
 		tms->pass = 0;
 
 		memset(tms->flag, 0, sizeof(tms->flag));
+		tms9995_dec_update(tms);
 
 		tms->ST = 0;
 
@@ -1561,6 +1647,7 @@ void tms9995_mem_read(struct tms9995 *tms)
 
 	if ((tms->address & 0xfffe)==0xfffa && !tms->mp9537)
 	{
+		tms9995_dec_update(tms);
 		if (tms->itrace) fprintf(stderr, "read dec=%04x\n", tms->decrementer_value);
 		// Decrementer mapped into the address space
 		tms->current_value = tms->decrementer_value;
@@ -1576,8 +1663,6 @@ void tms9995_mem_read(struct tms9995 *tms)
 
 	if (is_onchip(tms, tms->address))
 	{
-		uint16_t intaddr;
-
 		// If we have a word access, we have to align the address
 		// This is the case for word operations and for certain phases of
 		// byte operations (e.g. when retrieving the index register)
@@ -1589,14 +1674,11 @@ void tms9995_mem_read(struct tms9995 *tms)
 		// Ignore the READY state
 		tms->check_ready = false;
 
-		// We put fffc-ffff back into the f000-f0ff area
-		intaddr = tms->address & 0x00fe;
-
 		// An on-chip memory access is also visible to the outside world ([1], 2.3.1.2)
 		// but only on word boundary, as only full words are read.
 
 		// Always read a word from internal memory
-		tms->current_value = (tms->onchip_memory[intaddr] << 8) | tms->onchip_memory[intaddr + 1];
+		tms->current_value = *onchip_word(tms, tms->address);
 
 		if (!tms->word_access && tms->byteop)
 		{
@@ -1699,6 +1781,7 @@ static void tms9995_mem_write(struct tms9995 *tms)
 {
 	if ((tms->address & 0xfffe)==0xfffa && !tms->mp9537)
 	{
+		tms9995_dec_update(tms);
 		if (tms->byteop)
 		{
 			// According to [1], section 2.3.1.2.2:
@@ -1718,6 +1801,7 @@ static void tms9995_mem_write(struct tms9995 *tms)
 			tms->starting_count_storage_register = tms->decrementer_value = tms->current_value;
 		}
 		if (tms->itrace) fprintf(stderr, "Setting dec=%04x [tms->PC=%04x]\n", tms->current_value, tms->PC);
+		tms9995_dec_update(tms);
 		tms9995_pulse_clock(tms, 1);
 		return;
 	}
@@ -1737,11 +1821,13 @@ static void tms9995_mem_write(struct tms9995 *tms)
 		// This would normally be a no-op as no actual write is done
 
 		tms->check_ready = false;
-		tms->onchip_memory[tms->address & 0x00ff] = (tms->current_value >> 8) & 0xff;
+		uint16_t *w = onchip_word(tms, tms->address);
 		if (tms->word_access || !tms->byteop)
-		{
-			tms->onchip_memory[(tms->address & 0x00ff)+1] = tms->current_value & 0xff;
-		}
+			*w = tms->current_value;
+		else if (tms->address & 1)
+			*w = (*w & 0xff00) | (tms->current_value >> 8);
+		else
+			*w = (*w & 0x00ff) | (tms->current_value & 0xff00);
 		tms9995_pulse_clock(tms, 1);
 	}
 	else
@@ -1886,7 +1972,12 @@ static void tms9995_cru_output_operation(struct tms9995 *tms)
 			// FLAG2, FLAG3, and FLAG4 are read-only
 			if (tms->itrace) fprintf(stderr, "set CRU address %04x to %d\n", tms->cru_address, tms->cru_value&1);
 			if ((tms->cru_address != 0x1ee4) && (tms->cru_address != 0x1ee6) && (tms->cru_address != 0x1ee8))
+			{
+				// FLAG0 and FLAG1 start and stop the timer
+				tms9995_dec_update(tms);
 				tms->flag[(tms->cru_address>>1)&0x000f] = (tms->cru_value & 0x01);
+				tms9995_dec_update(tms);
+			}
 		}
 		else
 		{
@@ -1993,6 +2084,43 @@ static void tms9995_trigger_decrementer(struct tms9995 *tms)
 	}
 }
 
+/*
+    Bring the timer up to date with the clock and work out when it next
+    reaches zero. Called before and after anything that changes its
+    count or starts or stops it. In event counter mode (FLAG0) it is
+    stepped by tms9995_trigger_decrementer instead.
+*/
+static void tms9995_dec_update(struct tms9995 *tms)
+{
+	uint16_t start = tms->starting_count_storage_register;
+	bool timer = tms->flag[0] == false && tms->flag[1] == true;
+	uint64_t ticks;
+
+	if (timer)
+	{
+		ticks = tms->decrementer_clkdiv + (tms->clocks - tms->dec_clock);
+		tms->decrementer_clkdiv = ticks % 4;
+		ticks /= 4;
+		// null will turn off the decrementer
+		if (start > 0)
+		{
+			if (ticks >= tms->decrementer_value)
+			{
+				ticks = (ticks - tms->decrementer_value) % start;
+				tms->decrementer_value = start;
+				if (tms->itrace) fprintf(stderr, "decrementer flags interrupt\n");
+				tms->flag[3] = true;
+			}
+			tms->decrementer_value -= ticks;
+		}
+	}
+	tms->dec_clock = tms->clocks;
+	if (timer && start > 0)
+		tms->dec_deadline = tms->clocks + 4 * (uint64_t)tms->decrementer_value - tms->decrementer_clkdiv;
+	else
+		tms->dec_deadline = UINT64_MAX;
+}
+
 /*
     This is a switch to a subprogram. In terms of cycles
     it does not take any time; execution continues with the first instruction
@@ -3245,8 +3373,10 @@ static void tms9995_alu_int(struct tms9995 *tms)
 				tms->mid_flag = false;
 				tms->mid_active = false;
 				// FLAG0 and FLAG1 are also set to zero after RESET ([1], sect. 2.3.1.2.2)
+				tms9995_dec_update(tms);
 				for (int i=0; i < 5; i++)
 					tms->flag[i] = false;
+				tms9995_dec_update(tms);
 				tms->check_hold = true;
 			}
 		}
@@ -3547,8 +3677,7 @@ static char *decode_op(struct opset *op, uint16_t ip)
 static uint16_t tms9995_debug_read(struct tms9995 *tms, uint16_t addr)
 {
     if (is_onchip(tms, addr))
-        return (tms->onchip_memory[addr & 0xFE] << 8) |
-                tms->onchip_memory[(addr & 0xFE) | 1];
+        return *onchip_word(tms, addr);
     return (tms9995_readb_debug(tms, addr & 0xFFFE) << 8) |
                 tms9995_readb_debug(tms, addr | 1);
 }
@@ -55,8 +55,9 @@ struct tms9995 {
 	// Indicates the instruction acquisition phase
 	bool    iaq;
 
-	// 256 bytes of onchip memory
-	uint8_t   onchip_memory[256];
+	// 256 bytes of onchip memory, as host order words so that the
+	// workspace registers in it are a single load or store
+	uint16_t  onchip_memory[128];
 
 	// Processor states
 	bool    idle_state;
@@ -162,8 +163,14 @@ struct tms9995 {
 	// Start value
 	uint16_t  starting_count_storage_register;
 
-	// Current decrementer value.
+	// Current decrementer value. While it runs as a timer this is the
+	// value at dec_clock and dec_deadline is the clock it reaches zero.
 	uint16_t  decrementer_value;
+	uint64_t  dec_clock;
+	uint64_t  dec_deadline;
+
+	// Clocks since the CPU was created
+	uint64_t  clocks;
 
 	// ============== CRU support ======================
 
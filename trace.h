@@ -0,0 +1,20 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+/*
+ *	Debug trace tests. Wrap the flag check, as in
+ *
+ *		if (TRACE_ON(trace & TRACE_MEM))
+ *
+ *	A debug build tests the flag as before. A RELEASE build makes every
+ *	test a constant false so the compiler drops the branch and the print
+ *	behind it from the hot paths. -d is still accepted but does nothing.
+ */
+
+#ifdef RELEASE
+#define TRACE_ON(x)	0
+#else
+#define TRACE_ON(x)	(x)
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ *	Decode an execution trace written by -x
+ *
+ *	tracedump [-n count] tracefile
+ *
+ *	Prints the instructions oldest first in much the same layout as the
+ *	live CPU trace, with the T-state count in front. Records with no
+ *	opcode bytes are markers the guest left with the performance
+ *	counters.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cputrace.h"
+#include "z80dis.h"
+#define _6502_PRIVATE
+#include "6502.h"
+
+/* Records read and decoded at a time */
+#define TRACE_CHUNK	4096
+
+struct cputrace_header {
+	uint8_t magic[4];
+	uint32_t cpu;
+	uint32_t size;
+	uint32_t count;
+};
+
+/* The Z80 disassembler wants this even though we hand it the bytes */
+uint8_t z80dis_byte(uint16_t addr)
+{
+	return 0;
+}
+
+static void dump_z80(struct cputrace_rec *r, const char *text, unsigned int len)
+{
+	unsigned int i;
+
+	printf("%12llu %04X: ", (unsigned long long)r->tstate, r->pc);
+	for (i = 0; i < 4; i++) {
+		if (i < len)
+			printf("%02X ", r->op[i]);
+		else
+			printf("   ");
+	}
+	printf("%-16s [ %02X:%02X %04X %04X %04X %04X %04X %04X ]\n",
+		text, r->reg[0] >> 8, r->reg[0] & 0xFF, r->reg[1], r->reg[2],
+		r->reg[3], r->reg[4], r->reg[5], r->reg[6]);
+}
+
+static void dump_6502(struct cputrace_rec *r)
+{
+	printf("%12llu %02X %02X %02X %02X %02X | %04X %s\n",
+		(unsigned long long)r->tstate, r->reg[0], r->reg[1],
+		r->reg[2], r->reg[3], r->reg[4], r->pc, dis6502(r->pc, r->op));
+}
+
+static void dump_mark(struct cputrace_rec *r)
+{
+	printf("%12llu %04X: ---- marker %u ----\n",
+		(unsigned long long)r->tstate, r->pc, r->op[0]);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "tracedump: [-n count] tracefile\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct cputrace_header h;
+	static struct cputrace_rec r[TRACE_CHUNK];
+	static char text[TRACE_CHUNK][Z80DIS_TEXT];
+	static uint8_t len[TRACE_CHUNK];
+	unsigned long skip = 0, last = 0;
+	size_t i, n;
+	FILE *fp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			last = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	fp = fopen(argv[optind], "r");
+	if (fp == NULL) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, "RCTR", 4)) {
+		fprintf(stderr, "%s: not a trace file.\n", argv[optind]);
+		exit(1);
+	}
+	if (h.size != sizeof(r[0])) {
+		fprintf(stderr, "%s: trace from a different build.\n", argv[optind]);
+		exit(1);
+	}
+	if (h.cpu == CPUTRACE_6502)
+		disassembler_init();
+	else if (h.cpu != CPUTRACE_Z80) {
+		fprintf(stderr, "%s: unknown CPU type %u.\n", argv[optind],
+			(unsigned int)h.cpu);
+		exit(1);
+	}
+	/* -n shows only the most recent instructions */
+	if (last && last < h.count)
+		skip = h.count - last;
+	if (skip && fseek(fp, skip * sizeof(r[0]), SEEK_CUR)) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	while ((n = fread(r, sizeof(r[0]), TRACE_CHUNK, fp)) > 0) {
+		if (h.cpu == CPUTRACE_Z80) {
+			z80_disasm_batch(text[0], len, r[0].op, &r[0].pc,
+				sizeof(r[0]), n);
+			for (i = 0; i < n; i++) {
+				if (r[i].len == 0)
+					dump_mark(r + i);
+				else
+					dump_z80(r + i, text[i], len[i]);
+			}
+		} else {
+			for (i = 0; i < n; i++) {
+				if (r[i].len == 0)
+					dump_mark(r + i);
+				else
+					dump_6502(r + i);
+			}
+		}
+	}
+	fclose(fp);
+	return 0;
+}
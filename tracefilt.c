@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tracefilt.h"
+
+static void tracefilt_bad(const char *term)
+{
+    fprintf(stderr, "Bad trace filter '%s'.\n", term);
+    exit(1);
+}
+
+static void tracefilt_range(uint8_t *map, const char *term, const char *spec)
+{
+    unsigned long start, end, a;
+    char *p;
+
+    start = strtoul(spec, &p, 16);
+    end = start;
+    if (*p == '-')
+        end = strtoul(p + 1, &p, 16);
+    if (p == spec || *p || end < start || end > 0xFFFF)
+        tracefilt_bad(term);
+    for (a = start; a <= end; a++)
+        map[a >> 3] |= 1 << (a & 7);
+}
+
+/* Parse a filter. The classes named are added to *mask */
+struct tracefilt *tracefilt_create(const char *spec,
+    const struct tracefilt_class *classes, unsigned int *mask)
+{
+    struct tracefilt *f = calloc(1, sizeof(struct tracefilt));
+    const struct tracefilt_class *c;
+    char *copy = strdup(spec);
+    char *term, *save;
+
+    if (f == NULL || copy == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for (term = strtok_r(copy, ",", &save); term; term = strtok_r(NULL, ",", &save)) {
+        if (strncmp(term, "pc=", 3) == 0) {
+            tracefilt_range(f->pc, term, term + 3);
+            f->given |= TRACEFILT_PC;
+        } else if (strncmp(term, "mem=", 4) == 0) {
+            tracefilt_range(f->mem, term, term + 4);
+            f->given |= TRACEFILT_MEM;
+        } else if (strncmp(term, "io=", 3) == 0) {
+            tracefilt_range(f->io, term, term + 3);
+            f->given |= TRACEFILT_IO;
+        } else {
+            for (c = classes; c->name; c++)
+                if (strcmp(c->name, term) == 0)
+                    break;
+            if (c->name == NULL)
+                tracefilt_bad(term);
+            *mask |= c->mask;
+        }
+    }
+    free(copy);
+    return f;
+}
+
+void tracefilt_free(struct tracefilt *f)
+{
+    free(f);
+}
@@ -0,0 +1,45 @@
+#ifndef __TRACEFILT_H
+#define __TRACEFILT_H
+
+#include <stdint.h>
+
+/*
+ *	Narrowing of the -d debug trace. A filter is a comma separated list
+ *	of terms, each one of
+ *
+ *	pc=start[-end]	only trace while the CPU runs from these addresses
+ *	mem=start[-end]	only trace memory accesses to these addresses
+ *	io=start[-end]	only trace I/O to these ports
+ *	name		also trace this class, as the board names them
+ *
+ *	Numbers are hex. Several ranges of one kind add up. The ranges are
+ *	turned into bitmaps when parsed so the test on each event is a
+ *	single lookup.
+ */
+
+#define TRACEFILT_PC	1
+#define TRACEFILT_MEM	2
+#define TRACEFILT_IO	4
+
+struct tracefilt {
+    unsigned int given;		/* TRACEFILT_ kinds with ranges */
+    uint8_t pc[8192];
+    uint8_t mem[8192];
+    uint8_t io[8192];
+};
+
+/* Board trace classes by name */
+struct tracefilt_class {
+    const char *name;
+    unsigned int mask;
+};
+
+/* If no range of the kind was given everything matches */
+#define TRACEFILT_HIT(f, kind, map, a) \
+    (!((f)->given & (kind)) || ((f)->map[(uint16_t)(a) >> 3] & (1 << ((a) & 7))))
+
+extern struct tracefilt *tracefilt_create(const char *spec,
+    const struct tracefilt_class *classes, unsigned int *mask);
+extern void tracefilt_free(struct tracefilt *f);
+
+#endif
@@ -17,16 +17,17 @@
 
 #include <SDL2/SDL.h>
 
+#include "sdl2_texture.h"
 #include "6502.h"
 #include "acia.h"
 #include "keymatrix.h"
+#include "trace.h"
+#include "glyphcache.h"
 
 #define CWIDTH 8
 #define CHEIGHT 16
 
-static SDL_Window *window;
-static SDL_Renderer *render;
-static SDL_Texture *texture;
+static struct sdltex *screen;
 static uint32_t texturebits[48 * CWIDTH * 16 * CHEIGHT];
 
 struct keymatrix *matrix;
@@ -34,8 +35,13 @@ struct acia *acia;
 
 static uint8_t mem[65536];
 static uint8_t font[2048];
+static struct glyphcache *glyphs;
+static struct glyphcache *glyphs_vu;
 
 static unsigned int video_upgrade;
+static uint8_t vid_dirty[2048];		/* Video bytes written since the last frame */
+static unsigned int vid_changed;	/* Any vid_dirty set */
+static unsigned int vid_all = 1;	/* Redraw the whole screen */
 
 static uint8_t fast;
 volatile int emulator_done;
@@ -49,6 +55,8 @@ volatile int emulator_done;
 
 static int trace = 0;
 
+static struct m6502 cpu;
+
 static uint8_t keylatch;
 
 /* We handle page memory specially as writes are multi-bank and read
@@ -64,20 +72,20 @@ uint8_t do_read_6502(uint16_t addr, unsigned debug)
 	return mem[addr];
 }
 
-uint8_t read6502(uint16_t addr)
+uint8_t read6502(struct m6502 *cpu, uint16_t addr)
 {
 	uint8_t r = do_read_6502(addr, 0);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "%04X -> %02X\n", addr, r);
 	return r;
 }
 
-uint8_t read6502_debug(uint16_t addr)
+uint8_t read6502_debug(struct m6502 *cpu, uint16_t addr)
 {
 	return do_read_6502(addr, 1);
 }
 
-void write6502(uint16_t addr, uint8_t val)
+void write6502(struct m6502 *cpu, uint16_t addr, uint8_t val)
 {
 	int is_ram = 0;
 	if (addr >= 0xDF00 && addr <= 0xDFFF) {
@@ -91,11 +99,15 @@ void write6502(uint16_t addr, uint8_t val)
 	if (addr < 0x8000 || (addr >= 0xD000 && addr < 0xD800))
 		is_ram = 1;
 	if (is_ram) {
-		if (trace & TRACE_MEM)
+		if (TRACE_ON(trace & TRACE_MEM))
 			fprintf(stderr, "%04X <- %02X\n", addr, val);
 		mem[addr] = val;
+		if (addr >= 0xD000 && addr < 0xD800) {
+			vid_dirty[addr - 0xD000] = 1;
+			vid_changed = 1;
+		}
 	} else {
-		if (trace & (TRACE_MEM|TRACE_CPU))
+		if (TRACE_ON(trace & (TRACE_MEM|TRACE_CPU)))
 			fprintf(stderr, "%04X ROM (write %02X fail)\n", addr, val);
 	}
 }
@@ -164,78 +176,66 @@ static SDL_Keycode keyboard[] = {
 
 static void raster_char(unsigned int y, unsigned int x, uint8_t c)
 {
-	uint8_t *fp = &font[8 * c];
-	uint32_t *pixp;
-	unsigned int rows, pixels;
-
-	pixp = texturebits + x * CWIDTH + 48 * CWIDTH * y * CHEIGHT;
-	for (rows = 0; rows < CHEIGHT; rows++) {
-		uint8_t bits = *fp;
-		if (rows & 1)
-			fp++;
-		for (pixels = 0; pixels < CWIDTH; pixels++) {
-			if (bits & 0x80)
-				*pixp++ = 0xFFD0D0D0;
-			else
-				*pixp++ = 0xFF000000;
-			bits <<= 1;
-		}
-		/* We moved on one char, move on the other 47 */
-		pixp += 47 * CWIDTH;
-	}
+	glyphcache_draw(glyphs, c,
+		texturebits + x * CWIDTH + 48 * CWIDTH * y * CHEIGHT,
+		48 * CWIDTH);
 }
-		
+
 static void raster_char_vu(unsigned int y, unsigned int x, uint8_t c)
 {
-	uint8_t *fp = &font[8 * c];
-	uint32_t *pixp;
-	unsigned int rows, pixels;
-
-	pixp = texturebits + x * CWIDTH + 48 * CWIDTH * y * CHEIGHT / 2;
-	for (rows = 0; rows < CHEIGHT / 2; rows++) {
-		uint8_t bits = *fp++;
-		for (pixels = 0; pixels < CWIDTH; pixels++) {
-			if (bits & 0x80)
-				*pixp++ = 0xFFD0D0D0;
-			else
-				*pixp++ = 0xFF000000;
-			bits <<= 1;
-		}
-		/* We moved on one char, move on the other 47 */
-		pixp += 47 * CWIDTH;
-	}
+	glyphcache_draw(glyphs_vu, c,
+		texturebits + x * CWIDTH + 48 * CWIDTH * y * CHEIGHT / 2,
+		48 * CWIDTH);
 }
-		
-static void uk101_rasterize(void)
+
+/* The standard display shows each font row twice */
+static void glyphs_init(void)
+{
+	static uint8_t tall[256 * CHEIGHT];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(tall); i++)
+		tall[i] = font[i / 2];
+	glyphs = glyphcache_create(256, CWIDTH, CHEIGHT);
+	glyphcache_load(glyphs, tall, CHEIGHT, 0xFFD0D0D0, 0xFF000000);
+	glyphs_vu = glyphcache_create(256, CWIDTH, CHEIGHT / 2);
+	glyphcache_load(glyphs_vu, font, 8, 0xFFD0D0D0, 0xFF000000);
+}
+
+/* Redraw the characters written since the last frame. Returns 0 if the
+   screen has not changed */
+static int uk101_rasterize(void)
 {
 	unsigned int lptr = 0xD00C;
 	unsigned int lines, cols;
 	uint8_t *ptr;
 	unsigned int nlines = video_upgrade ? 32 : 16;
+
+	if (!vid_changed && !vid_all)
+		return 0;
 	for (lines = 0; lines < nlines; lines ++) {
 		ptr = mem + lptr;
 		for (cols = 0; cols < 48; cols ++) {
-			if(video_upgrade)
-				raster_char_vu(lines, cols, *ptr++);
-			else
-				raster_char(lines, cols, *ptr++);
+			if (vid_all || vid_dirty[lptr + cols - 0xD000]) {
+				if(video_upgrade)
+					raster_char_vu(lines, cols, *ptr);
+				else
+					raster_char(lines, cols, *ptr);
+			}
+			ptr++;
 		}
 		lptr += 0x40;
 	}
+	memset(vid_dirty, 0, sizeof(vid_dirty));
+	vid_changed = 0;
+	vid_all = 0;
+	return 1;
 }
 
 static void uk101_render(void)
 {
-	SDL_Rect rect;
-	
-	rect.x = rect.y = 0;
-	rect.w = 48 * CWIDTH;
-	rect.h = 16 * CHEIGHT;
-
-	SDL_UpdateTexture(texture, NULL, texturebits, 48 * CWIDTH * 4);
-	SDL_RenderClear(render);
-	SDL_RenderCopy(render, texture, NULL, &rect);
-	SDL_RenderPresent(render);
+	sdltex_compare(screen, texturebits);
+	sdltex_present(screen, texturebits);
 }
 
 /* Most PC layouts don't have a colon key so use # */
@@ -253,7 +253,7 @@ static void keytranslate(SDL_Event *ev)
 static void ui_event(void)
 {
 	SDL_Event ev;
-	while (SDL_PollEvent(&ev)) {
+	while (sdltex_poll_event(&ev)) {
 		switch(ev.type) {
 		case SDL_QUIT:
 			emulator_done = 1;
@@ -263,6 +263,9 @@ static void ui_event(void)
 			keytranslate(&ev);
 			keymatrix_SDL2event(matrix, &ev);
 			break;
+		case SDL_WINDOWEVENT:
+			vid_all = 1;
+			break;
 		}
 	}
 }
@@ -347,7 +350,7 @@ int main(int argc, char *argv[])
 
 	acia = acia_create();
 	acia_set_input(acia, 1);
-	acia_trace(acia, trace & TRACE_ACIA);
+	acia_trace(acia, TRACE_ON(trace & TRACE_ACIA));
 
 	romsize = romload(rom_path, mem + 0xF800, 0x0800);
 	if (romsize != 0x0800) {
@@ -360,44 +363,11 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 	romload(font_path, font, 2048);
+	glyphs_init();
 
 	matrix = keymatrix_create(8, 8, keyboard);
-	keymatrix_trace(matrix, trace & TRACE_KEY);
-	atexit(SDL_Quit);
-	if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-		fprintf(stderr, "uk101: unable to initialize SDL: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	window = SDL_CreateWindow("UK101",
-			SDL_WINDOWPOS_UNDEFINED,
-			SDL_WINDOWPOS_UNDEFINED,
-			48 * CWIDTH, 16 * CHEIGHT,
-			SDL_WINDOW_RESIZABLE);
-	if (window == NULL) {
-		fprintf(stderr, "uk101: unable to open window: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	render = SDL_CreateRenderer(window, -1, 0);
-	if (render == NULL) {
-		fprintf(stderr, "uk101: unable to create renderer: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	texture = SDL_CreateTexture(render, SDL_PIXELFORMAT_ARGB8888,
-		SDL_TEXTUREACCESS_STREAMING,
-		48 * CWIDTH, 16 * CHEIGHT);
-	if (texture == NULL) {
-		fprintf(stderr, "uk101: unable to create texture: %s\n",
-			SDL_GetError());
-		exit(1);
-	}
-	SDL_SetRenderDrawColor(render, 0, 0, 0, 255);
-	SDL_RenderClear(render);
-	SDL_RenderPresent(render);
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-	SDL_RenderSetLogicalSize(render, 48 * CWIDTH,  16 * CHEIGHT);
+	keymatrix_trace(matrix, TRACE_ON(trace & TRACE_KEY));
+	screen = sdltex_create("UK101", 48 * CWIDTH, 16 * CHEIGHT, 48 * CWIDTH, 16 * CHEIGHT);
 
 	/* 10ms - it's a balance between nice behaviour and simulation
 	   smoothness */
@@ -420,11 +390,11 @@ int main(int argc, char *argv[])
 		tcsetattr(0, TCSADRAIN, &term);
 	}
 
-	if (trace & TRACE_CPU)
-		log_6502 = 1;
+	if (TRACE_ON(trace & TRACE_CPU))
+		cpu.log = 1;
 
 	init6502();
-	reset6502();
+	reset6502(&cpu);
 	
 	/* This is the wrong way to do it but it's easier for the moment. We
 	   should track how much real time has occurred and try to keep cycle
@@ -434,12 +404,13 @@ int main(int argc, char *argv[])
 	while (!emulator_done) {
 		int i;
 		for (i = 0; i < 100; i++) {
-			exec6502(tstates);
+			exec6502(&cpu, tstates);
 		}
 		/* We want to run UI events before we rasterize */
 		ui_event();
-		uk101_rasterize();
-		uk101_render();
+		if (sdltex_visible(screen) &&
+		    (uk101_rasterize() || sdltex_recording(screen)))
+			uk101_render();
 		acia_timer(acia);
 		/* Do 10ms of I/O and delays */
 		if (!fast)
@@ -0,0 +1,76 @@
+/*
+ *	Guest time of day for the RTC models
+ *
+ *	Virtual time is the board's cycle count over its clock rate, added
+ *	to an epoch. VCLOCK_VIRTUAL uses a fixed epoch so runs are repeatable,
+ *	VCLOCK_ANCHORED the host time when the source was set so the date
+ *	looks right but still moves at the emulated rate.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vclock.h"
+#include "replay.h"
+
+#define VCLOCK_EPOCH	946684800	/* 2000-01-01 00:00:00 UTC */
+
+static int policy = VCLOCK_WALL;
+static uint64_t (*source)(void);
+static uint64_t rate;
+static time_t epoch;
+
+void vclock_set_source(uint64_t (*cycles)(void), uint64_t hz, int how)
+{
+    const char *p = getenv("RTC_CLOCK");
+
+    if (p) {
+        if (strcmp(p, "wall") == 0)
+            how = VCLOCK_WALL;
+        else if (strcmp(p, "virtual") == 0)
+            how = VCLOCK_VIRTUAL;
+        else if (strcmp(p, "anchored") == 0)
+            how = VCLOCK_ANCHORED;
+        else {
+            fprintf(stderr, "RTC_CLOCK must be wall, virtual or anchored.\n");
+            exit(1);
+        }
+    }
+    policy = how;
+    source = cycles;
+    rate = hz;
+    if (policy == VCLOCK_VIRTUAL)
+        epoch = VCLOCK_EPOCH;
+    else
+        epoch = time(NULL) - cycles() / hz;
+}
+
+/* Host time is logged when it changes so a replay sees the same dates */
+static time_t vclock_host(time_t t)
+{
+    static int64_t last;
+    int64_t v;
+
+    if (replay_playing()) {
+        if (replay_get(REPLAY_RTC, &v, sizeof(v)) == sizeof(v))
+            last = v;
+        return last;
+    }
+    if (replay_recording() && t != last) {
+        v = t;
+        replay_put(REPLAY_RTC, &v, sizeof(v));
+    }
+    last = t;
+    return t;
+}
+
+time_t vclock_time(void)
+{
+    if (policy == VCLOCK_WALL || source == NULL)
+        return vclock_host(time(NULL));
+    if (policy == VCLOCK_VIRTUAL)
+        return epoch + source() / rate;
+    return vclock_host(epoch + source() / rate);
+}
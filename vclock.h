@@ -0,0 +1,22 @@
+#ifndef __VCLOCK_H
+#define __VCLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ *	Time of day for the emulated RTCs. By default this is the host
+ *	clock. A board that hands over its cycle counter can instead run
+ *	the guest's clock off emulated time, so fast and batch runs see
+ *	time pass at the emulated rate. RTC_CLOCK in the environment
+ *	overrides the board's choice.
+ */
+
+#define VCLOCK_WALL	0	/* Host time */
+#define VCLOCK_VIRTUAL	1	/* Emulated time from a fixed epoch */
+#define VCLOCK_ANCHORED	2	/* Emulated time from the host time at start */
+
+extern void vclock_set_source(uint64_t (*cycles)(void), uint64_t hz, int policy);
+extern time_t vclock_time(void);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ *	Record a display to a YUV4MPEG2 file or pipe
+ *
+ *	The emulation copies each finished frame into a free slot of a
+ *	single producer, single consumer ring and moves on. A writer thread
+ *	turns the slots into 4:4:4 planes and writes them out. When the ring
+ *	is full the frame is dropped and counted so a slow disk or encoder
+ *	never stalls the emulation, and the count is reported at the end.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "vidrec.h"
+
+struct vidrec {
+	/* Fixed at creation */
+	const char *env;
+	int fd;
+	unsigned int width;
+	unsigned int height;
+	unsigned int fps;
+	unsigned int slots;
+	uint32_t **slot;
+	pthread_t thread;
+	/* Shared */
+	atomic_uint head;	/* Frames queued */
+	atomic_uint tail;	/* Frames taken by the writer */
+	atomic_int stop;
+	sem_t ready;
+	/* Emulation side */
+	unsigned long dropped;
+	/* Writer side */
+	uint8_t *planes;	/* "FRAME\n" then Y, U and V */
+	int failed;
+};
+
+static int vr_write(struct vidrec *vr, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(vr->fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int vr_parse(struct vidrec *vr, const char *env, char *spec)
+{
+	char *p = strtok(spec, ",");
+
+	if (p == NULL)
+		return -1;
+	if (strncmp(p, "fd:", 3) == 0)
+		vr->fd = atoi(p + 3);
+	else {
+		vr->fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (vr->fd == -1) {
+			perror(p);
+			return -1;
+		}
+	}
+	while ((p = strtok(NULL, ",")) != NULL) {
+		if (strncmp(p, "fps=", 4) == 0)
+			vr->fps = atoi(p + 4);
+		else if (strncmp(p, "queue=", 6) == 0)
+			vr->slots = atoi(p + 6);
+		else {
+			fprintf(stderr, "%s: unknown option '%s'.\n", env, p);
+			return -1;
+		}
+	}
+	if (vr->fps == 0 || vr->slots == 0)
+		return -1;
+	return 0;
+}
+
+/* BT.601 full range, which is what the Y4M C444 planes are taken as */
+static void vr_encode(struct vidrec *vr, const uint32_t *raster)
+{
+	unsigned int n = vr->width * vr->height;
+	uint8_t *y = vr->planes + 6;
+	uint8_t *u = y + n;
+	uint8_t *v = u + n;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		int r = (raster[i] >> 16) & 0xFF;
+		int g = (raster[i] >> 8) & 0xFF;
+		int b = raster[i] & 0xFF;
+		y[i] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+		u[i] = (-43 * r - 85 * g + 128 * b + 128 * 256 + 128) >> 8;
+		v[i] = (128 * r - 107 * g - 21 * b + 128 * 256 + 128) >> 8;
+	}
+}
+
+static void *vr_main(void *arg)
+{
+	struct vidrec *vr = arg;
+	size_t len = 6 + 3 * vr->width * vr->height;
+	unsigned int t;
+
+	for (;;) {
+		while (sem_wait(&vr->ready) == -1 && errno == EINTR);
+		t = atomic_load_explicit(&vr->tail, memory_order_relaxed);
+		if (t == atomic_load_explicit(&vr->head, memory_order_acquire)) {
+			if (atomic_load(&vr->stop))
+				break;
+			continue;
+		}
+		/* Encode straight out of the slot and hand it back first so
+		   the emulation gets it again while we are writing */
+		if (!vr->failed)
+			vr_encode(vr, vr->slot[t % vr->slots]);
+		atomic_store_explicit(&vr->tail, t + 1, memory_order_release);
+		if (!vr->failed && vr_write(vr, vr->planes, len)) {
+			/* Reader went away. Carry on running without video */
+			perror(vr->env);
+			vr->failed = 1;
+		}
+	}
+	return NULL;
+}
+
+/* Create a recorder if the environment variable env is set */
+struct vidrec *vidrec_create(const char *env, unsigned int width, unsigned int height)
+{
+	struct vidrec *vr;
+	const char *val = getenv(env);
+	char *spec;
+	char hdr[80];
+	unsigned int i;
+
+	if (val == NULL || *val == 0)
+		return NULL;
+	vr = calloc(1, sizeof(struct vidrec));
+	spec = strdup(val);
+	if (vr == NULL || spec == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	vr->fd = -1;
+	vr->fps = 50;
+	vr->slots = 8;
+	if (vr_parse(vr, env, spec) == -1) {
+		fprintf(stderr, "%s: bad recording '%s'.\n", env, val);
+		exit(1);
+	}
+	free(spec);
+	/* A reader that exits should stop the recording, not the emulator */
+	signal(SIGPIPE, SIG_IGN);
+	vr->env = env;
+	vr->width = width;
+	vr->height = height;
+	vr->slot = calloc(vr->slots, sizeof(uint32_t *));
+	vr->planes = malloc(6 + 3 * width * height);
+	if (vr->slot == NULL || vr->planes == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (i = 0; i < vr->slots; i++) {
+		vr->slot[i] = malloc(width * height * sizeof(uint32_t));
+		if (vr->slot[i] == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	memcpy(vr->planes, "FRAME\n", 6);
+	snprintf(hdr, sizeof(hdr), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444 XCOLORRANGE=FULL\n",
+		width, height, vr->fps);
+	if (vr_write(vr, hdr, strlen(hdr))) {
+		perror(env);
+		exit(1);
+	}
+	atomic_init(&vr->head, 0);
+	atomic_init(&vr->tail, 0);
+	atomic_init(&vr->stop, 0);
+	sem_init(&vr->ready, 0, 0);
+	if (pthread_create(&vr->thread, NULL, vr_main, vr)) {
+		fprintf(stderr, "%s: unable to start the writer.\n", env);
+		exit(1);
+	}
+	return vr;
+}
+
+/* Call once per emulated frame with the finished raster */
+void vidrec_frame(struct vidrec *vr, const uint32_t *raster)
+{
+	unsigned int h;
+
+	if (vr == NULL)
+		return;
+	h = atomic_load_explicit(&vr->head, memory_order_relaxed);
+	if (h - atomic_load_explicit(&vr->tail, memory_order_acquire) == vr->slots) {
+		vr->dropped++;
+		return;
+	}
+	memcpy(vr->slot[h % vr->slots], raster, vr->width * vr->height * sizeof(uint32_t));
+	atomic_store_explicit(&vr->head, h + 1, memory_order_release);
+	sem_post(&vr->ready);
+}
+
+/* Writes out what is queued and closes the recording */
+void vidrec_free(struct vidrec *vr)
+{
+	unsigned int i;
+
+	if (vr == NULL)
+		return;
+	atomic_store(&vr->stop, 1);
+	sem_post(&vr->ready);
+	pthread_join(vr->thread, NULL);
+	sem_destroy(&vr->ready);
+	if (vr->dropped)
+		fprintf(stderr, "%s: %lu frames dropped.\n", vr->env, vr->dropped);
+	if (vr->fd > 2)
+		close(vr->fd);
+	for (i = 0; i < vr->slots; i++)
+		free(vr->slot[i]);
+	free(vr->slot);
+	free(vr->planes);
+	free(vr);
+}
@@ -0,0 +1,25 @@
+#ifndef __VIDREC_H
+#define __VIDREC_H
+
+#include <stdint.h>
+
+/*
+ *	Background video recording of a display as a YUV4MPEG2 stream that
+ *	ffmpeg and most players read directly. Each display looks for its
+ *	spec in an environment variable, as the headless frame streams do.
+ *	The spec is
+ *
+ *	path|fd:N[,fps=N][,queue=N]
+ *
+ *	Frames are ARGB8888. They are queued to a writer thread that encodes
+ *	and writes them, and dropped if it falls more than queue frames
+ *	behind rather than holding up the emulation.
+ */
+
+struct vidrec;
+
+extern struct vidrec *vidrec_create(const char *env, unsigned int width, unsigned int height);
+extern void vidrec_frame(struct vidrec *vr, const uint32_t *raster);
+extern void vidrec_free(struct vidrec *vr);
+
+#endif
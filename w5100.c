@@ -28,6 +28,9 @@
    E-mail: philip-fuse@shadowmagic.org.uk
  
 */
+/* For recvmmsg and sendmmsg */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -40,9 +43,16 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#endif
 
 #include "w5100.h"
+#include "replay.h"
 
 typedef enum w5100_socket_mode {
   W5100_SOCKET_MODE_CLOSED = 0x00,
@@ -64,6 +74,7 @@ typedef enum w5100_socket_state {
   W5100_SOCKET_STATE_CLOSE_WAIT = 0x1c,
 
   W5100_SOCKET_STATE_UDP = 0x22,
+  W5100_SOCKET_STATE_MACRAW = 0x42,
 } w5100_socket_state;
 
 enum w5100_socket_registers {
@@ -96,6 +107,18 @@ enum w5100_socket_registers {
   W5100_SOCKET_RX_RD1,
 };
 
+/* Largest Ethernet frame without the FCS */
+#define W5100_FRAME_MAX 1514
+
+/* UDP datagrams fetched from the host per call */
+#define W5100_UDP_BATCH 8
+
+struct w5100_datagram {
+  struct sockaddr_in sa;
+  int len;
+  uint8_t data[0x800];
+};
+
 typedef struct nic_w5100_socket_t {
 
   int id; /* For debug use only */
@@ -139,8 +162,20 @@ typedef struct nic_w5100_socket_t {
   int datagram_lengths[0x20]; /* The lengths of datagrams to be sent */
   int datagram_count;
 
+  /* Datagrams, frames or TCP reads and writes moved, for the metrics */
+  unsigned long long packets;
+
+  /* UDP datagrams read from the host that haven't gone in the ring yet */
+  struct w5100_datagram held[W5100_UDP_BATCH];
+  int held_count;
+  int held_next;
+
+  /* MACRAW frame read from the host that didn't fit in the ring yet */
+  uint8_t frame[W5100_FRAME_MAX];
+  int frame_len;
+
   /* Flag used to indicate that a socket has been closed since we started
-     waiting for it in a select() call and therefore the socket should no
+     waiting for it in a poll() call and therefore the socket should no
      longer be used */
   int ok_for_io;
 
@@ -153,7 +188,13 @@ struct nic_w5100_t {
   uint8_t sip[4];  /* Our IP address */
   uint8_t mr;
   uint16_t ar;
-  nic_w5100_socket_t socket[4];
+  int sockets;
+  uint16_t sock_end;   /* End of the socket registers */
+  uint16_t tx_base;    /* Transmit then receive buffers, 2K a socket */
+  uint16_t rx_base;
+  uint16_t rx_end;
+  const char *tap;     /* Host TAP device for MACRAW, or NULL */
+  nic_w5100_socket_t socket[W5100_SOCKETS_MAX];
 };
 
 /* Define this to spew debugging info to stdout */
@@ -241,6 +282,84 @@ enum w5100_socket_command {
   W5100_SOCKET_COMMAND_RECV = 1 << 6,
 };
 
+/* Record and replay. While recording the result of each host socket call
+   and anything it read goes in the log. While replaying the calls are not
+   made and the results come from the log, so the guest sees the network
+   exactly as it was */
+struct w5100_result {
+  int32_t ret;
+  int32_t err;
+};
+
+#define W5100_LOG_MAX ( sizeof( struct w5100_result ) + W5100_UDP_BATCH * \
+  ( sizeof( struct sockaddr_in ) + 4 + 0x800 ) )
+
+static uint8_t w5100_log[W5100_LOG_MAX];
+
+/* Copy between a buffer and an iovec */
+static void
+w5100_iov_copy( struct iovec *iov, int n, uint8_t *buf, size_t len, int to_iov )
+{
+  int i;
+
+  for( i = 0; i < n && len; i++ ) {
+    size_t l = iov[i].iov_len < len ? iov[i].iov_len : len;
+    if( to_iov )
+      memcpy( iov[i].iov_base, buf, l );
+    else
+      memcpy( buf, iov[i].iov_base, l );
+    buf += l;
+    len -= l;
+  }
+}
+
+/* Log a call that read nothing, or the head of one that did */
+static ssize_t
+w5100_logged( ssize_t ret, const void *data, size_t len )
+{
+  struct w5100_result r;
+
+  if( replay_recording() ) {
+    r.ret = ret;
+    r.err = errno;
+    memcpy( w5100_log, &r, sizeof( r ) );
+    if( len )
+      memmove( w5100_log + sizeof( r ), data, len );
+    replay_put( REPLAY_NET, w5100_log, sizeof( r ) + len );
+    errno = r.err;
+  }
+  return ret;
+}
+
+/* The result of a call we are not making. Anything it read is left in
+   w5100_log after the result */
+static ssize_t
+w5100_replayed( void )
+{
+  struct w5100_result r;
+
+  if( replay_need( REPLAY_NET, w5100_log, W5100_LOG_MAX ) <
+      (int)sizeof( r ) ) {
+    fprintf( stderr, "w5100: bad replay record.\n" );
+    exit(1);
+  }
+  memcpy( &r, w5100_log, sizeof( r ) );
+  errno = r.err;
+  return r.ret;
+}
+
+/* A call whose only result is its return value */
+#define W5100_HOST( call ) \
+  ( replay_playing() ? w5100_replayed() : w5100_logged( (call), NULL, 0 ) )
+
+static int
+w5100_close_fd( int fd )
+{
+  if( replay_playing() )
+    return 0;
+  return close( fd );
+}
+
 static void w5100_socket_init_common( nic_w5100_socket_t *socket )
 {
   socket->fd = -1;
@@ -268,9 +387,11 @@ static void w5100_socket_clean( nic_w5100_socket_t *socket )
 
   socket->last_send = 0;
   socket->datagram_count = 0;
+  socket->frame_len = 0;
+  socket->held_count = socket->held_next = 0;
 
   if( socket->fd != -1) {
-    close( socket->fd );
+    w5100_close_fd( socket->fd );
     w5100_socket_init_common( socket );
   }
 }
@@ -315,8 +436,14 @@ w5100_write_socket_mr( nic_w5100_socket_t *socket, uint8_t b )
         flags = 0;
       }
       break;
-    case W5100_SOCKET_MODE_IPRAW:
     case W5100_SOCKET_MODE_MACRAW:
+      /* Only socket 0 has it, and we don't do MAC filtering */
+      if( socket->id == 0 ) {
+        flags = 0;
+        break;
+      }
+      /* Fall through */
+    case W5100_SOCKET_MODE_IPRAW:
     case W5100_SOCKET_MODE_PPPOE:
     default:
       fprintf( stderr, "w5100: unsupported mode 0x%02x set on socket %d\n", b, socket->id );
@@ -328,9 +455,56 @@ w5100_write_socket_mr( nic_w5100_socket_t *socket, uint8_t b )
   socket->flags = flags;
 }
 
+/* Attach to a host TAP device, which carries whole Ethernet frames */
+static int
+w5100_tap_open( const char *name )
+{
+#ifdef __linux__
+  struct ifreq ifr;
+  int fd = open( "/dev/net/tun", O_RDWR | O_NONBLOCK );
+
+  if( fd == -1 )
+    return -1;
+  memset( &ifr, 0, sizeof( ifr ) );
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy( ifr.ifr_name, name, IFNAMSIZ - 1 );
+  if( ioctl( fd, TUNSETIFF, &ifr ) == -1 ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void
+w5100_socket_open_macraw( nic_w5100_t *self, nic_w5100_socket_t *socket )
+{
+  w5100_socket_clean( socket );
+  if( self->tap == NULL ) {
+    fprintf( stderr, "w5100: MACRAW needs a TAP device.\n" );
+    return;
+  }
+  socket->fd = W5100_HOST( w5100_tap_open( self->tap ) );
+  if( socket->fd == -1 ) {
+    fprintf( stderr, "w5100: failed to open TAP device %s; errno %d: %s\n",
+      self->tap, errno, strerror(errno) );
+    return;
+  }
+  socket->state = W5100_SOCKET_STATE_MACRAW;
+  nic_w5100_debug( "w5100: opened TAP %s fd %d for socket %d\n", self->tap, socket->fd, socket->id );
+}
+
 static void
-w5100_socket_open( nic_w5100_socket_t *socket_obj )
+w5100_socket_open( nic_w5100_t *self, nic_w5100_socket_t *socket_obj )
 {
+  if( socket_obj->mode == W5100_SOCKET_MODE_MACRAW &&
+    socket_obj->state == W5100_SOCKET_STATE_CLOSED ) {
+    w5100_socket_open_macraw( self, socket_obj );
+    return;
+  }
   if( ( socket_obj->mode == W5100_SOCKET_MODE_UDP ||
       socket_obj->mode == W5100_SOCKET_MODE_TCP ) &&
     socket_obj->state == W5100_SOCKET_STATE_CLOSED ) {
@@ -346,16 +520,18 @@ w5100_socket_open( nic_w5100_socket_t *socket_obj )
 
     w5100_socket_clean( socket_obj );
 
-    socket_obj->fd = socket( AF_INET, type, protocol );
+    socket_obj->fd = W5100_HOST( socket( AF_INET, type, protocol ) );
     if( socket_obj->fd == -1) {
       fprintf(stderr,
         "w5100: failed to open %s socket for socket %d; errno %d: %s\n",
         description, socket_obj->id, errno, strerror(errno) );
       return;
     }
-    fcntl(socket_obj->fd, F_SETFL, FNDELAY);
+    if( !replay_playing() )
+      fcntl(socket_obj->fd, F_SETFL, FNDELAY);
 
-    if( setsockopt( socket_obj->fd, SOL_SOCKET, SO_REUSEADDR, &one,
+    if( !replay_playing() &&
+      setsockopt( socket_obj->fd, SOL_SOCKET, SO_REUSEADDR, &one,
       sizeof(one) ) == -1 ) {
       fprintf(stderr,
         "w5100: failed to set SO_REUSEADDR on socket %d; errno %d: %s\n",
@@ -379,7 +555,7 @@ w5100_socket_bind_port( nic_w5100_t *self, nic_w5100_socket_t *socket )
   memcpy( &sa.sin_addr.s_addr, self->sip, 4 );
 
   nic_w5100_debug( "w5100: attempting to bind socket %d to %s:%d\n", socket->id, inet_ntoa(sa.sin_addr), ntohs(sa.sin_port) );
-  if( bind( socket->fd, (struct sockaddr*)&sa, sizeof(sa) ) == -1 ) {
+  if( W5100_HOST( bind( socket->fd, (struct sockaddr*)&sa, sizeof(sa) ) ) == -1 ) {
     fprintf(stderr, "w5100: failed to bind socket %d; errno %d: %s\n",
                      socket->id, errno, strerror(errno));
 
@@ -403,7 +579,7 @@ w5100_socket_listen( nic_w5100_t *self, nic_w5100_socket_t *socket )
       if( w5100_socket_bind_port( self, socket ) )
         return;
 
-    if( listen( socket->fd, 1 ) == -1 ) {
+    if( W5100_HOST( listen( socket->fd, 1 ) ) == -1 ) {
       fprintf(stderr, "w5100: failed to listen on socket %d; errno %d: %s\n",
                        socket->id, errno, strerror(errno));
       return;
@@ -430,7 +606,7 @@ w5100_socket_connect( nic_w5100_t *self, nic_w5100_socket_t *socket )
     memcpy( &sa.sin_port, socket->dport, 2 );
     memcpy( &sa.sin_addr.s_addr, socket->dip, 4 );
 
-    if( connect( socket->fd, (struct sockaddr*)&sa, sizeof(sa) ) == -1 ) {
+    if( W5100_HOST( connect( socket->fd, (struct sockaddr*)&sa, sizeof(sa) ) ) == -1 ) {
       if (errno != EINPROGRESS) {
         fprintf(stderr,
           "w5100: failed to connect socket %d to 0x%08x:0x%04x; errno %d: %s\n",
@@ -456,7 +632,7 @@ static void
 w5100_socket_close( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   if( socket->fd != -1 ) {
-    close( socket->fd );
+    w5100_close_fd( socket->fd );
     socket->fd = -1;
     socket->socket_bound = 0;
     socket->ok_for_io = 0;
@@ -480,14 +656,19 @@ w5100_socket_discon( nic_w5100_t *self, nic_w5100_socket_t *socket )
 static void
 w5100_socket_send( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
-  if( socket->state == W5100_SOCKET_STATE_UDP ) {
+  if( socket->state == W5100_SOCKET_STATE_UDP ||
+      socket->state == W5100_SOCKET_STATE_MACRAW ) {
 
-    if( !socket->socket_bound )
+    if( socket->state == W5100_SOCKET_STATE_UDP && !socket->socket_bound )
       if( w5100_socket_bind_port( self, socket ) )
         return;
 
+    /* The queue is full, so this one is lost */
+    if( socket->datagram_count == 0x20 )
+      return;
+    /* Sn_TX_WR wraps at 64K */
     socket->datagram_lengths[socket->datagram_count++] =
-      socket->tx_wr - socket->last_send;
+      (uint16_t)( socket->tx_wr - socket->last_send );
     socket->last_send = socket->tx_wr;
     socket->write_pending = 1;
   }
@@ -496,14 +677,23 @@ w5100_socket_send( nic_w5100_t *self, nic_w5100_socket_t *socket )
   }
 }
 
+static int w5100_macraw_queue( nic_w5100_socket_t *socket );
+static int w5100_udp_queue( nic_w5100_socket_t *socket );
+
 static void
 w5100_socket_recv( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   if( socket->state == W5100_SOCKET_STATE_UDP ||
+    socket->state == W5100_SOCKET_STATE_MACRAW ||
     socket->state == W5100_SOCKET_STATE_ESTABLISHED ||
     socket->state == W5100_SOCKET_STATE_CLOSE_WAIT ) {
     socket->rx_rsr -= socket->rx_rd - socket->old_rx_rd;
     socket->old_rx_rd = socket->rx_rd;
+    /* A frame held back for room may fit now */
+    if( socket->state == W5100_SOCKET_STATE_MACRAW )
+      w5100_macraw_queue( socket );
+    else if( socket->state == W5100_SOCKET_STATE_UDP )
+      w5100_udp_queue( socket );
     if( socket->rx_rsr != 0 )
       socket->ir |= 1 << 2;
   }
@@ -516,7 +706,7 @@ w5100_write_socket_cr( nic_w5100_t *self, nic_w5100_socket_t *socket, uint8_t b
 
   switch( b ) {
     case W5100_SOCKET_COMMAND_OPEN:
-      w5100_socket_open( socket );
+      w5100_socket_open( self, socket );
       break;
     case W5100_SOCKET_COMMAND_LISTEN:
       w5100_socket_listen( self, socket );
@@ -680,7 +870,7 @@ nic_w5100_socket_write( nic_w5100_t *self, uint16_t reg, uint8_t b )
 uint8_t
 nic_w5100_socket_read_rx_buffer( nic_w5100_t *self, uint16_t reg )
 {
-  nic_w5100_socket_t *socket = &self->socket[(reg - 0x6000) / 0x0800];
+  nic_w5100_socket_t *socket = &self->socket[(reg - self->rx_base) / 0x0800];
   int offset = reg & 0x7ff;
   uint8_t b = socket->rx_buffer[offset];
   nic_w5100_debug( "w5100: reading 0x%02x from socket %d rx buffer offset 0x%03x\n", b, socket->id, offset );
@@ -690,45 +880,47 @@ nic_w5100_socket_read_rx_buffer( nic_w5100_t *self, uint16_t reg )
 void
 nic_w5100_socket_write_tx_buffer( nic_w5100_t *self, uint16_t reg, uint8_t b )
 {
-  nic_w5100_socket_t *socket = &self->socket[(reg - 0x4000) / 0x0800];
+  nic_w5100_socket_t *socket = &self->socket[(reg - self->tx_base) / 0x0800];
   int offset = reg & 0x7ff;
   nic_w5100_debug( "w5100: writing 0x%02x to socket %d tx buffer offset 0x%03x\n", b, socket->id, offset );
   socket->tx_buffer[offset] = b;
 }
 
-void
-nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
-  fd_set *writefds, int *max_fd )
+/* Work out what we want to wait for on a socket */
+static short
+nic_w5100_socket_events( nic_w5100_socket_t *socket )
 {
+  short events = 0;
+
   if( socket->fd != -1 ) {
     /* We can process a UDP read if we're in a UDP state and there are at least
        9 bytes free in our buffer (8 byte UDP header and 1 byte of actual
        data). */
     int udp_read = socket->state == W5100_SOCKET_STATE_UDP &&
-      0x800 - socket->rx_rsr >= 9;
+      socket->held_count == 0 && 0x800 - socket->rx_rsr >= 9;
     /* We can process a TCP read if we're in the established state and have
        any room in our buffer (no header necessary for TCP). */
     int tcp_read = socket->state == W5100_SOCKET_STATE_ESTABLISHED &&
       0x800 - socket->rx_rsr >= 1;
 
     int tcp_listen = socket->state == W5100_SOCKET_STATE_LISTEN;
+    /* MACRAW reads only once any held back frame has gone in */
+    int macraw_read = socket->state == W5100_SOCKET_STATE_MACRAW &&
+      socket->frame_len == 0;
 
     socket->ok_for_io = 1;
 
-    if( udp_read || tcp_read || tcp_listen ) {
-      FD_SET( socket->fd, readfds );
-      if( socket->fd > *max_fd )
-        *max_fd = socket->fd;
-      nic_w5100_debug( "w5100: checking for read on socket %d with fd %d; max fd %d\n", socket->id, socket->fd, *max_fd );
+    if( udp_read || tcp_read || tcp_listen || macraw_read ) {
+      events |= POLLIN;
+      nic_w5100_debug( "w5100: checking for read on socket %d with fd %d\n", socket->id, socket->fd );
     }
 
     if( socket->write_pending || socket->state == W5100_SOCKET_STATE_CONNECTING) {
-      FD_SET( socket->fd, writefds );
-      if( socket->fd > *max_fd )
-        *max_fd = socket->fd;
-      nic_w5100_debug( "w5100: write pending on socket %d with fd %d; max fd %d\n", socket->id, socket->fd, *max_fd );
+      events |= POLLOUT;
+      nic_w5100_debug( "w5100: write pending on socket %d with fd %d\n", socket->id, socket->fd );
     }
   }
+  return events;
 }
 
 static void
@@ -738,7 +930,8 @@ w5100_socket_process_accept( nic_w5100_socket_t *socket )
   socklen_t sa_length = sizeof(sa);
   int new_fd;
 
-  new_fd = accept( socket->fd, (struct sockaddr*)&sa, &sa_length );
+  memset( &sa, 0, sizeof(sa) );
+  new_fd = W5100_HOST( accept( socket->fd, (struct sockaddr*)&sa, &sa_length ) );
   if( new_fd == -1 ) {
     nic_w5100_debug( "w5100: error from accept on socket %d; errno %d: %s\n",
                      socket->id, errno, strerror(errno));
@@ -747,19 +940,239 @@ w5100_socket_process_accept( nic_w5100_socket_t *socket )
 
   nic_w5100_debug( "w5100: accepted connection from %s:%d on socket %d\n", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port), socket->id );
 
-  if( close( socket->fd ) == -1 )
+  if( w5100_close_fd( socket->fd ) == -1 )
     nic_w5100_debug( "w5100: error attempting to close fd %d for socket %d\n", socket->fd, socket->id );
   socket->fd = new_fd;
   socket->state = W5100_SOCKET_STATE_ESTABLISHED;
 }
 
+/* Describe len bytes of a 2K socket ring starting at offset, split at the
+   wrap point, so the host can transfer straight to or from it */
+static int
+w5100_ring_iov( uint8_t *ring, int offset, int len, struct iovec *iov )
+{
+  offset &= 0x7ff;
+  iov[0].iov_base = ring + offset;
+  if( offset + len <= 0x800 ) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = 0x800 - offset;
+  iov[1].iov_base = ring;
+  iov[1].iov_len = len - iov[0].iov_len;
+  return 2;
+}
+
+/* Put a byte string into the ring, wrapping as needed */
+static void
+w5100_ring_put( uint8_t *ring, int offset, const uint8_t *data, int len )
+{
+  while( len-- )
+    ring[offset++ & 0x7ff] = *data++;
+}
+
+/* Move the held back frame into the ring if there is room, with the
+   two byte length (including itself) the W5100 puts in front */
+static int
+w5100_macraw_queue( nic_w5100_socket_t *socket )
+{
+  int len = socket->frame_len + 2;
+  uint8_t header[2];
+
+  if( socket->frame_len == 0 || len > 0x800 - socket->rx_rsr )
+    return 0;
+  header[0] = len >> 8;
+  header[1] = len;
+  w5100_ring_put( socket->rx_buffer, socket->old_rx_rd + socket->rx_rsr,
+    header, 2 );
+  w5100_ring_put( socket->rx_buffer, socket->old_rx_rd + socket->rx_rsr + 2,
+    socket->frame, socket->frame_len );
+  socket->rx_rsr += len;
+  socket->frame_len = 0;
+  return 1;
+}
+
+/* Take every frame the TAP has waiting that fits, raising the interrupt
+   once for the batch. The first that doesn't fit is held back */
+static void
+w5100_socket_process_macraw_read( nic_w5100_socket_t *socket )
+{
+  ssize_t bytes_read;
+  int queued = 0;
+
+  while( socket->frame_len == 0 ) {
+    if( replay_playing() ) {
+      bytes_read = w5100_replayed();
+      if( bytes_read > 0 )
+        memcpy( socket->frame, w5100_log + sizeof( struct w5100_result ),
+          bytes_read );
+    } else {
+      bytes_read = read( socket->fd, socket->frame, W5100_FRAME_MAX );
+      w5100_logged( bytes_read, socket->frame, bytes_read > 0 ? bytes_read : 0 );
+    }
+    if( bytes_read <= 0 ) {
+      if( bytes_read == -1 && errno != EAGAIN && errno != EINTR )
+        nic_w5100_debug( "w5100: error %d reading from TAP: %s\n",
+                         errno, strerror(errno));
+      break;
+    }
+    socket->frame_len = bytes_read;
+    socket->packets++;
+    queued += w5100_macraw_queue( socket );
+  }
+  if( queued )
+    socket->ir |= 1 << 2;
+}
+
+/* Each SEND is one frame, gathered from the ring if it wraps */
+static void
+w5100_socket_process_macraw_write( nic_w5100_socket_t *socket )
+{
+  struct iovec iov[2];
+  ssize_t bytes_sent;
+
+  while( socket->datagram_count ) {
+    uint16_t length = socket->datagram_lengths[0];
+
+    bytes_sent = W5100_HOST( writev( socket->fd, iov,
+      w5100_ring_iov( socket->tx_buffer, socket->tx_rr, length, iov ) ) );
+    if( bytes_sent == -1 && ( errno == EAGAIN || errno == EINTR ) )
+      break;
+    /* Anything else is a frame the host won't take, so drop it */
+    if( bytes_sent != length )
+      nic_w5100_debug( "w5100: TAP write of 0x%03x failed\n", length );
+    else
+      socket->packets++;
+    if( --socket->datagram_count )
+      memmove( socket->datagram_lengths, &socket->datagram_lengths[1],
+        0x1f * sizeof(int) );
+    socket->tx_rr += length;
+  }
+  if( socket->datagram_count == 0 ) {
+    socket->write_pending = 0;
+    socket->ir |= 1 << 4;
+  }
+}
+
+/* Datagrams go into the ring behind the W5100's 8 byte header of source
+   address, port and length. Any waiting for room are held in order, and
+   one that could never fit is cut short once the ring is empty */
+static int
+w5100_udp_queue( nic_w5100_socket_t *socket )
+{
+  int queued = 0;
+
+  while( socket->held_next < socket->held_count ) {
+    struct w5100_datagram *d = &socket->held[socket->held_next];
+    int bytes_free = 0x800 - socket->rx_rsr;
+    int offset = socket->old_rx_rd + socket->rx_rsr;
+    uint8_t header[8];
+
+    if( d->len + 8 > bytes_free ) {
+      if( socket->rx_rsr )
+        break;
+      d->len = bytes_free - 8;
+    }
+    memcpy( header, &d->sa.sin_addr.s_addr, 4 );
+    memcpy( header + 4, &d->sa.sin_port, 2 );
+    header[6] = (d->len >> 8) & 0xff;
+    header[7] = d->len & 0xff;
+    w5100_ring_put( socket->rx_buffer, offset, header, 8 );
+    w5100_ring_put( socket->rx_buffer, offset + 8, d->data, d->len );
+    socket->rx_rsr += d->len + 8;
+    socket->held_next++;
+    queued = 1;
+  }
+  if( socket->held_next == socket->held_count )
+    socket->held_next = socket->held_count = 0;
+  return queued;
+}
+
+/* Fetch up to a batch of datagrams in one call. The log holds the count
+   and then the address, length and data of each */
+static int
+w5100_udp_recv_batch( nic_w5100_socket_t *socket )
+{
+  struct mmsghdr msgs[W5100_UDP_BATCH];
+  struct iovec iov[W5100_UDP_BATCH];
+  uint8_t *log = w5100_log + sizeof( struct w5100_result );
+  uint8_t *p = log;
+  int32_t len;
+  int i, n;
+
+  if( replay_playing() ) {
+    n = w5100_replayed();
+    for( i = 0; i < n; i++ ) {
+      struct w5100_datagram *d = &socket->held[i];
+      memcpy( &d->sa, p, sizeof( d->sa ) );
+      memcpy( &len, p + sizeof( d->sa ), 4 );
+      p += sizeof( d->sa ) + 4;
+      d->len = len;
+      memcpy( d->data, p, len );
+      p += len;
+    }
+    return n;
+  }
+
+  memset( msgs, 0, sizeof( msgs ) );
+  for( i = 0; i < W5100_UDP_BATCH; i++ ) {
+    iov[i].iov_base = socket->held[i].data;
+    iov[i].iov_len = sizeof( socket->held[i].data );
+    msgs[i].msg_hdr.msg_name = &socket->held[i].sa;
+    msgs[i].msg_hdr.msg_namelen = sizeof( socket->held[i].sa );
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg( socket->fd, msgs, W5100_UDP_BATCH, MSG_DONTWAIT, NULL );
+  for( i = 0; i < n; i++ ) {
+    struct w5100_datagram *d = &socket->held[i];
+    d->len = msgs[i].msg_len;
+    if( replay_recording() ) {
+      len = d->len;
+      memcpy( p, &d->sa, sizeof( d->sa ) );
+      memcpy( p + sizeof( d->sa ), &len, 4 );
+      p += sizeof( d->sa ) + 4;
+      memcpy( p, d->data, len );
+      p += len;
+    }
+  }
+  w5100_logged( n, log, p - log );
+  return n;
+}
+
+/* Take every datagram that is waiting and fits, a batch per call, and
+   raise the interrupt once for the lot */
+static void
+w5100_socket_process_udp_read( nic_w5100_socket_t *socket )
+{
+  int queued = 0;
+  int n;
+
+  while( socket->held_count == 0 && 0x800 - socket->rx_rsr >= 9 ) {
+    n = w5100_udp_recv_batch( socket );
+    if( n <= 0 ) {
+      if( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+        nic_w5100_debug( "w5100: error %d reading from UDP socket %d: %s\n",
+                         errno, socket->id, strerror(errno));
+      break;
+    }
+    nic_w5100_debug( "w5100: read %d datagrams from UDP socket %d\n", n, socket->id );
+    socket->held_count = n;
+    socket->packets += n;
+    queued |= w5100_udp_queue( socket );
+  }
+  if( queued )
+    socket->ir |= 1 << 2;
+}
+
 static void
 w5100_socket_process_read( nic_w5100_socket_t *socket , nic_w5100_t *self)
 {
-  uint8_t buffer[0x800];
+  struct iovec iov[2];
   int bytes_free = 0x800 - socket->rx_rsr;
+  int offset = (socket->old_rx_rd + socket->rx_rsr) & 0x7ff;
   ssize_t bytes_read;
-  struct sockaddr_in sa;
+  int n;
 
   int udp = socket->state == W5100_SOCKET_STATE_UDP;
   const char *description = udp ? "UDP" : "TCP";
@@ -767,39 +1180,32 @@ w5100_socket_process_read( nic_w5100_socket_t *socket , nic_w5100_t *self)
   nic_w5100_debug( "w5100: reading from socket %d\n", socket->id );
 
   if( udp ) {
-    socklen_t sa_length = sizeof(sa);
-    bytes_read = recvfrom( socket->fd, (char*)buffer + 8, bytes_free - 8, 0,
-      (struct sockaddr*)&sa, &sa_length );
+    w5100_socket_process_udp_read( socket );
+    return;
   }
-  else
-    bytes_read = recv( socket->fd, (char*)buffer, bytes_free, 0 );
 
-  nic_w5100_debug( "w5100: read 0x%03x bytes from %s socket %d\n", (int)bytes_read, description, socket->id );
+  n = w5100_ring_iov( socket->rx_buffer, offset, bytes_free, iov );
+  if( replay_playing() ) {
+    bytes_read = w5100_replayed();
+    if( bytes_read > 0 )
+      w5100_iov_copy( iov, n, w5100_log + sizeof( struct w5100_result ),
+        bytes_read, 1 );
+  } else {
+    bytes_read = readv( socket->fd, iov, n );
+    if( replay_recording() && bytes_read > 0 ) {
+      uint8_t *p = w5100_log + sizeof( struct w5100_result );
+      w5100_iov_copy( iov, n, p, bytes_read, 0 );
+      w5100_logged( bytes_read, p, bytes_read );
+    } else
+      w5100_logged( bytes_read, NULL, 0 );
+  }
 
-  if( bytes_read > 0 || (udp && bytes_read == 0) ) {
-    int offset = (socket->old_rx_rd + socket->rx_rsr) & 0x7ff;
-    uint8_t *dest = &socket->rx_buffer[offset];
-
-    if( udp ) {
-      /* Add the W5100's UDP header */
-      memcpy( buffer, &sa.sin_addr.s_addr, 4 );
-      memcpy( buffer + 4, &sa.sin_port, 2 );
-      buffer[6] = (bytes_read >> 8) & 0xff;
-      buffer[7] = bytes_read & 0xff;
-      bytes_read += 8;
-    }
+  nic_w5100_debug( "w5100: read 0x%03x bytes from %s socket %d\n", (int)bytes_read, description, socket->id );
 
+  if( bytes_read > 0 ) {
     socket->rx_rsr += bytes_read;
+    socket->packets++;
     socket->ir |= 1 << 2;
-
-    if( offset + bytes_read <= 0x800 ) {
-      memcpy( dest, buffer, bytes_read );
-    }
-    else {
-      int first_chunk = 0x800 - offset;
-      memcpy( dest, buffer, first_chunk );
-      memcpy( socket->rx_buffer, buffer + first_chunk, bytes_read - first_chunk );
-    }
   }
   else if( bytes_read == 0 ) {  /* TCP */
     if (socket->state == W5100_SOCKET_STATE_CLOSE_WAIT) {
@@ -814,77 +1220,79 @@ w5100_socket_process_read( nic_w5100_socket_t *socket , nic_w5100_t *self)
   else {
     nic_w5100_debug( "w5100: error %d reading from %s socket %d: %s\n",
                      errno, description, socket->id, strerror(errno));
+    /* A reset connection would otherwise report ready forever */
+    if( errno != EAGAIN && errno != EINTR )
+      socket->state = W5100_SOCKET_STATE_CLOSE_WAIT;
   }
 }
 
+/* Send every queued datagram the host will take in one call. Each one is
+   gathered from the ring even if it wraps */
 static void
 w5100_socket_process_udp_write( nic_w5100_socket_t *socket )
 {
-  ssize_t bytes_sent;
-  int offset = socket->tx_rr & 0x7ff;
-  uint16_t length = socket->datagram_lengths[0];
-  uint8_t *data = &socket->tx_buffer[ offset ];
+  struct mmsghdr msgs[0x20];
+  struct iovec iov[0x20][2];
   struct sockaddr_in sa;
-  uint8_t buffer[0x800];
+  uint16_t offset = socket->tx_rr;
+  int i, n;
 
   nic_w5100_debug( "w5100: writing to UDP socket %d\n", socket->id );
 
-  /* If the data wraps round the write buffer, we need to coalesce it into
-     one chunk for the call to sendto() */
-  if( offset + length > 0x800 ) {
-    int first_chunk = 0x800 - offset;
-    memcpy( buffer, data, first_chunk );
-    memcpy( buffer + first_chunk, socket->tx_buffer, length - first_chunk );
-    data = buffer;
-  }
-
   memset( &sa, 0, sizeof(sa) );
   sa.sin_family = AF_INET;
   memcpy( &sa.sin_port, socket->dport, 2 );
   memcpy( &sa.sin_addr.s_addr, socket->dip, 4 );
 
-  bytes_sent = sendto( socket->fd, (const char*)data, length, 0, (struct sockaddr*)&sa, sizeof(sa) );
-  nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to UDP socket %d\n",
-                   (int)bytes_sent, length, socket->id );
-
-  if( bytes_sent == length ) {
-    if( --socket->datagram_count )
-      memmove( socket->datagram_lengths, &socket->datagram_lengths[1],
-        0x1f * sizeof(int) );
-
-    socket->tx_rr += bytes_sent;
-    if( socket->datagram_count == 0 ) {
-      socket->write_pending = 0;
-      socket->ir |= 1 << 4;
-    }
+  memset( msgs, 0, sizeof( msgs ) );
+  for( i = 0; i < socket->datagram_count; i++ ) {
+    msgs[i].msg_hdr.msg_name = &sa;
+    msgs[i].msg_hdr.msg_namelen = sizeof(sa);
+    msgs[i].msg_hdr.msg_iov = iov[i];
+    msgs[i].msg_hdr.msg_iovlen = w5100_ring_iov( socket->tx_buffer, offset,
+      socket->datagram_lengths[i], iov[i] );
+    offset += socket->datagram_lengths[i];
   }
-  else if( bytes_sent != -1 )
-    nic_w5100_debug( "w5100: didn't manage to send full datagram to UDP socket %d?\n", socket->id );
-  else
+
+  n = W5100_HOST( sendmmsg( socket->fd, msgs, socket->datagram_count, 0 ) );
+  if( n == -1 ) {
     nic_w5100_debug( "w5100: error %d writing to UDP socket %d: %s\n",
                      errno, socket->id, strerror(errno));
+    return;
+  }
+  nic_w5100_debug( "w5100: sent %d datagrams of %d to UDP socket %d\n",
+                   n, socket->datagram_count, socket->id );
+
+  socket->packets += n;
+  for( i = 0; i < n; i++ )
+    socket->tx_rr += socket->datagram_lengths[i];
+  socket->datagram_count -= n;
+  memmove( socket->datagram_lengths, &socket->datagram_lengths[n],
+    socket->datagram_count * sizeof(int) );
+  if( socket->datagram_count == 0 ) {
+    socket->write_pending = 0;
+    socket->ir |= 1 << 4;
+  }
 }
 
 static void
 w5100_socket_process_tcp_write( nic_w5100_socket_t *socket )
 {
   ssize_t bytes_sent;
-  int offset = socket->tx_rr & 0x7ff;
   uint16_t length = socket->tx_wr - socket->tx_rr;
-  uint8_t *data = &socket->tx_buffer[ offset ];
+  struct iovec iov[2];
 
   nic_w5100_debug( "w5100: writing to TCP socket %d\n", socket->id );
 
-  /* If the data wraps round the write buffer, write it in two chunks */
-  if( offset + length > 0x800 )
-    length = 0x800 - offset;
-
-  bytes_sent = send( socket->fd, (const char*)data, length, 0 );
+  /* Both halves go in one call if the data wraps round the ring */
+  bytes_sent = W5100_HOST( writev( socket->fd, iov,
+    w5100_ring_iov( socket->tx_buffer, socket->tx_rr, length, iov ) ) );
   nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to TCP socket %d\n",
                    (int)bytes_sent, length, socket->id );
 
   if( bytes_sent != -1 ) {
     socket->tx_rr += bytes_sent;
+    socket->packets++;
     if( socket->tx_rr == socket->tx_wr ) {
       socket->write_pending = 0;
       socket->ir |= 1 << 4;
@@ -902,7 +1310,7 @@ void w5100_socket_process_connect(nic_w5100_socket_t *socket)
     sa.sin_family = AF_INET;
     memcpy( &sa.sin_port, socket->dport, 2 );
     memcpy( &sa.sin_addr.s_addr, socket->dip, 4 );
-    if (connect(socket->fd,  (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+    if (W5100_HOST(connect(socket->fd,  (struct sockaddr *)&sa, sizeof(sa))) == 0) {
       socket->state = W5100_SOCKET_STATE_ESTABLISHED;
       socket->ir |= (1 << 0);
       nic_w5100_debug( "w5100: socket %d moves to established.\n", socket->id);
@@ -914,26 +1322,31 @@ void w5100_socket_process_connect(nic_w5100_socket_t *socket)
 }
 
 void
-nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
-  fd_set writefds, nic_w5100_t *self )
+nic_w5100_socket_process_io( nic_w5100_socket_t *socket, short revents,
+  nic_w5100_t *self )
 {
   /* Process only if we're an open socket, and we haven't been closed and
-     re-opened since the select() started */
+     re-opened since the poll() started. An error or hangup is handed to
+     whichever of read or write we were waiting for so that the call
+     reports it */
   if( socket->fd != -1 && socket->ok_for_io ) {
-//    printf("Socket %d scan\n", socket->id);
-    if( FD_ISSET( socket->fd, &readfds ) ) {
-//      printf("Read ready on socket %d\n", socket->id);
+    if( revents & (POLLIN | POLLERR | POLLHUP) ) {
       if( socket->state == W5100_SOCKET_STATE_LISTEN )
         w5100_socket_process_accept( socket );
-      else
+      else if( socket->state == W5100_SOCKET_STATE_MACRAW )
+        w5100_socket_process_macraw_read( socket );
+      else if( socket->state == W5100_SOCKET_STATE_UDP ||
+               socket->state == W5100_SOCKET_STATE_ESTABLISHED )
         w5100_socket_process_read( socket , self);
     }
 
-    if( FD_ISSET( socket->fd, &writefds ) ) {
-//      fprintf(stderr, "Write ready on socket %d\n", socket->id);
+    if( socket->fd != -1 && (revents & (POLLOUT | POLLERR | POLLHUP)) ) {
       if( socket->state == W5100_SOCKET_STATE_UDP ) {
         w5100_socket_process_udp_write( socket );
       }
+      else if( socket->state == W5100_SOCKET_STATE_MACRAW ) {
+        w5100_socket_process_macraw_write( socket );
+      }
       else if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ) {
         w5100_socket_process_tcp_write( socket );
       }
@@ -956,52 +1369,181 @@ nic_w5100_reset( nic_w5100_t *self )
   memset( self->sha, 0, sizeof( self->sha ) );
   memset( self->sip, 0, sizeof( self->sip ) );
 
-  for( i = 0; i < 4; i++ )
+  for( i = 0; i < self->sockets; i++ )
     nic_w5100_socket_reset( &self->socket[i] );
 }
 
-void w5100_process(nic_w5100_t *self)
+/* Fill in one poll entry per socket for what we are waiting on. Sockets
+   we want nothing from get an fd of -1 so poll() skips them rather than
+   waking us for a hangup we can't act on yet. A caller can add these to
+   its own wait to wake as soon as there is network work. All
+   W5100_POLLFDS entries are filled in, those past the last socket with
+   -1. Returns the number of sockets being waited on */
+int w5100_pollfds(nic_w5100_t *self, struct pollfd *pfd)
 {
   int i;
-  fd_set readfds, writefds;
-  int active;
-  int max_fd = 0;
-  static struct timeval nowait = { 0, 0 };
-
-  FD_ZERO( &readfds );
-  FD_ZERO( &writefds );
+  int n = 0;
+
+  for( i = 0; i < W5100_POLLFDS; i++ ) {
+    nic_w5100_socket_t *socket = &self->socket[i];
+    pfd[i].events = i < self->sockets ? nic_w5100_socket_events( socket ) : 0;
+    pfd[i].fd = pfd[i].events ? socket->fd : -1;
+    pfd[i].revents = 0;
+    if( pfd[i].events )
+      n++;
+  }
+  return n;
+}
 
-  for( i = 0; i < 4; i++ ) {
-    nic_w5100_socket_add_to_sets( &self->socket[i], &readfds, &writefds,
-      &max_fd );
+/* Service all the sockets with a single poll() */
+/* Everything moved to or from the host on any socket */
+unsigned long long
+nic_w5100_packets( nic_w5100_t *self )
+{
+  unsigned long long n = 0;
+  int i;
 
-    /* Note that if a socket is closed between when we added it to the sets
-       above and when we call select() below, it will cause the select to fail
-       with EBADF. We catch this and just run around the loop again - the
-       offending socket will not be added to the sets again as it's now been
-       closed */
+  for( i = 0; i < self->sockets; i++ )
+    n += self->socket[i].packets;
+  return n;
+}
 
-//    nic_w5100_debug( "w5100: io thread select\n" );
+void w5100_process(nic_w5100_t *self)
+{
+  struct pollfd pfd[W5100_POLLFDS];
+  int i;
 
-    active = select( max_fd + 1, &readfds, &writefds, NULL, &nowait );
+  short revents[W5100_POLLFDS];
+  int n;
 
-//    nic_w5100_debug( "w5100: io thread wake; %d active\n", active );
+  if( w5100_pollfds( self, pfd ) == 0 )
+    return;
 
-    if( active != -1 ) {
-      for( i = 0; i < 4; i++ )
-        nic_w5100_socket_process_io( &self->socket[i], readfds, writefds , self);
-    }
-    else if( errno == EBADF ) {
-      /* Do nothing - just loop again */
+  /* Only polls that found something are logged, one entry a socket */
+  if( replay_playing() ) {
+    if( replay_get( REPLAY_NETPOLL, revents, self->sockets * sizeof( short ) ) !=
+        (int)( self->sockets * sizeof( short ) ) )
+      return;
+    for( i = 0; i < self->sockets; i++ )
+      pfd[i].revents = revents[i];
+  } else {
+    n = poll( pfd, self->sockets, 0 );
+    if( n == -1 ) {
+      if( errno != EINTR )
+        nic_w5100_debug( "w5100: poll returned unexpected errno %d: %s\n",
+                         errno, strerror(errno));
+      return;
     }
-    else {
-      nic_w5100_debug( "w5100: select returned unexpected errno %d: %s\n",
-                       errno, strerror(errno));
+    if( n && replay_recording() ) {
+      for( i = 0; i < self->sockets; i++ )
+        revents[i] = pfd[i].revents;
+      replay_put( REPLAY_NETPOLL, revents, self->sockets * sizeof( short ) );
     }
   }
+  for( i = 0; i < self->sockets; i++ )
+    if( pfd[i].revents )
+      nic_w5100_socket_process_io( &self->socket[i], pfd[i].revents, self );
 }
 
-nic_w5100_t *nic_w5100_alloc( void )
+/* Snapshot support. The registers and transmit buffers are kept but the
+   host sockets can't be, so every socket comes back closed with its
+   setup intact for the guest to open again. The chip state is followed
+   by one socket state for each socket the part has */
+struct w5100_sock_state {
+  uint8_t mr;
+  uint8_t ir;
+  uint8_t port[2];
+  uint8_t dip[4];
+  uint8_t dport[2];
+  uint16_t tx_rr;
+  uint16_t tx_wr;
+  uint16_t rx_rd;
+  uint8_t tx_buffer[0x800];
+};
+
+struct w5100_state {
+  uint8_t gw[4];
+  uint8_t sub[4];
+  uint8_t sha[6];
+  uint8_t sip[4];
+  uint8_t mr;
+  uint16_t ar;
+};
+
+size_t w5100_save( nic_w5100_t *self, void *buf )
+{
+  struct w5100_state st;
+  struct w5100_sock_state sst[W5100_SOCKETS_MAX];
+  size_t len = sizeof( st ) + self->sockets * sizeof( sst[0] );
+  int i;
+
+  if( buf == NULL )
+    return len;
+  memset( &st, 0, sizeof( st ) );
+  memset( sst, 0, sizeof( sst ) );
+  memcpy( st.gw, self->gw, 4 );
+  memcpy( st.sub, self->sub, 4 );
+  memcpy( st.sha, self->sha, 6 );
+  memcpy( st.sip, self->sip, 4 );
+  st.mr = self->mr;
+  st.ar = self->ar;
+  for( i = 0; i < self->sockets; i++ ) {
+    nic_w5100_socket_t *socket = &self->socket[i];
+    struct w5100_sock_state *ss = &sst[i];
+    ss->mr = socket->mode | socket->flags;
+    ss->ir = socket->ir;
+    memcpy( ss->port, socket->port, 2 );
+    memcpy( ss->dip, socket->dip, 4 );
+    memcpy( ss->dport, socket->dport, 2 );
+    ss->tx_rr = socket->tx_rr;
+    ss->tx_wr = socket->tx_wr;
+    ss->rx_rd = socket->rx_rd;
+    memcpy( ss->tx_buffer, socket->tx_buffer, 0x800 );
+  }
+  memcpy( buf, &st, sizeof( st ) );
+  memcpy( (uint8_t *)buf + sizeof( st ), sst, len - sizeof( st ) );
+  return len;
+}
+
+int w5100_load( nic_w5100_t *self, const void *buf, size_t len )
+{
+  struct w5100_state st;
+  struct w5100_sock_state sst[W5100_SOCKETS_MAX];
+  int i;
+
+  if( len != sizeof( st ) + self->sockets * sizeof( sst[0] ) )
+    return -1;
+  memcpy( &st, buf, sizeof( st ) );
+  memcpy( sst, (const uint8_t *)buf + sizeof( st ), len - sizeof( st ) );
+  nic_w5100_reset( self );
+  memcpy( self->gw, st.gw, 4 );
+  memcpy( self->sub, st.sub, 4 );
+  memcpy( self->sha, st.sha, 6 );
+  memcpy( self->sip, st.sip, 4 );
+  self->mr = st.mr;
+  self->ar = st.ar;
+  for( i = 0; i < self->sockets; i++ ) {
+    nic_w5100_socket_t *socket = &self->socket[i];
+    struct w5100_sock_state *ss = &sst[i];
+    socket->mode = ss->mr & 0x0f;
+    socket->flags = ss->mr & 0xf0;
+    socket->ir = ss->ir;
+    memcpy( socket->port, ss->port, 2 );
+    memcpy( socket->dip, ss->dip, 4 );
+    memcpy( socket->dport, ss->dport, 2 );
+    socket->tx_rr = ss->tx_rr;
+    socket->tx_wr = ss->tx_wr;
+    socket->old_rx_rd = socket->rx_rd = ss->rx_rd;
+    memcpy( socket->tx_buffer, ss->tx_buffer, 0x800 );
+  }
+  return 0;
+}
+
+/* The W5100 has four sockets. Asking for more lays the register and
+   buffer map out the same way, with 2K each way a socket, so eight
+   sockets is a 32K part with the socket registers to 0xBFF, transmit
+   buffers from 0x4000 and receive buffers from 0x8000 */
+nic_w5100_t *nic_w5100_alloc_sockets( int sockets )
 {
   int i;
   
@@ -1010,19 +1552,40 @@ nic_w5100_t *nic_w5100_alloc( void )
     fprintf(stderr, "%s:%d out of memory", __FILE__, __LINE__ );
     exit(1);
   }
-  for( i = 0; i < 4; i++ )
+  if( sockets != 4 && sockets != 8 ) {
+    fprintf( stderr, "w5100: %d sockets not supported.\n", sockets );
+    exit(1);
+  }
+  self->sockets = sockets;
+  self->sock_end = 0x400 + sockets * 0x100;
+  self->tx_base = 0x4000;
+  self->rx_base = self->tx_base + sockets * 0x800;
+  self->rx_end = self->rx_base + sockets * 0x800;
+  for( i = 0; i < sockets; i++ )
     nic_w5100_socket_init( &self->socket[i], i );
   nic_w5100_reset( self );
   return self;
 }
 
+nic_w5100_t *nic_w5100_alloc( void )
+{
+  return nic_w5100_alloc_sockets( 4 );
+}
+
+/* Give socket 0 MACRAW mode, carried by the named host TAP device */
+void
+nic_w5100_set_tap( nic_w5100_t *self, const char *name )
+{
+  self->tap = name;
+}
+
 void
 nic_w5100_free( nic_w5100_t *self )
 {
   int i;
 
   if( self ) {
-    for( i = 0; i < 4; i++ )
+    for( i = 0; i < self->sockets; i++ )
       nic_w5100_socket_end( &self->socket[i] );
     free(self);
   }
@@ -1032,15 +1595,74 @@ static uint8_t nic_w5100_compute_ir(nic_w5100_t *self)
 {
   uint8_t r = 0x00;
   int i;
-  for (i = 0; i < 4; i++)
+  for (i = 0; i < self->sockets; i++)
     if (self->socket[i].ir)
       r |= (1 << i);
   return r;
 }
 
+/* In indirect mode with auto increment the data register walks through
+   memory, so while the address is inside a socket buffer we can go to
+   the buffer directly. Returns where and how much is left of it */
+static uint8_t *
+w5100_idm_buffer( nic_w5100_t *self, int tx, size_t *len )
+{
+  uint16_t base = tx ? self->tx_base : self->rx_base;
+  nic_w5100_socket_t *socket;
+  int offset;
+
+  if( ( self->mr & 0x03 ) != 0x03 || self->ar < base ||
+      self->ar >= base + self->sockets * 0x800 )
+    return NULL;
+  socket = &self->socket[( self->ar - base ) >> 11];
+  offset = self->ar & 0x7ff;
+  *len = 0x800 - offset;
+  return ( tx ? socket->tx_buffer : socket->rx_buffer ) + offset;
+}
+
+/* Move a run of bytes through the data register, for INIR and OTIR.
+   Returns how many were moved, stopping at the end of a buffer */
+size_t
+nic_w5100_read_block( nic_w5100_t *self, uint8_t *buf, size_t len )
+{
+  size_t n;
+  uint8_t *p = w5100_idm_buffer( self, 0, &n );
+
+  if( p == NULL )
+    return 0;
+  if( n > len )
+    n = len;
+  memcpy( buf, p, n );
+  self->ar += n;
+  return n;
+}
+
+size_t
+nic_w5100_write_block( nic_w5100_t *self, const uint8_t *buf, size_t len )
+{
+  size_t n;
+  uint8_t *p = w5100_idm_buffer( self, 1, &n );
+
+  if( p == NULL )
+    return 0;
+  if( n > len )
+    n = len;
+  memcpy( p, buf, n );
+  self->ar += n;
+  return n;
+}
+
 uint8_t nic_w5100_read( nic_w5100_t *self, uint16_t reg )
 {
   uint8_t b;
+  uint8_t *p;
+  size_t n;
+
+  /* Streaming out of a receive buffer */
+  if( reg == W5100_IDM_DR && ( p = w5100_idm_buffer( self, 0, &n ) ) ) {
+    self->ar++;
+    return *p;
+  }
 
   if (self->mr & 0x01) {
     switch(reg) {
@@ -1104,10 +1726,10 @@ uint8_t nic_w5100_read( nic_w5100_t *self, uint16_t reg )
         break;
     }
   }
-  else if( reg >= 0x400 && reg < 0x800 ) {
+  else if( reg >= 0x400 && reg < self->sock_end ) {
     b = nic_w5100_socket_read( self, reg );
   }
-  else if( reg >= 0x6000 && reg < 0x8000 ) {
+  else if( reg >= self->rx_base && reg < self->rx_end ) {
     b = nic_w5100_socket_read_rx_buffer( self, reg );
   }
   else {
@@ -1160,6 +1782,16 @@ w5100_write__msr( nic_w5100_t *self, uint16_t reg, uint8_t b )
 void
 nic_w5100_write( nic_w5100_t *self, uint16_t reg, uint8_t b )
 {
+  uint8_t *p;
+  size_t n;
+
+  /* Streaming into a transmit buffer */
+  if( reg == W5100_IDM_DR && ( p = w5100_idm_buffer( self, 1, &n ) ) ) {
+    self->ar++;
+    *p = b;
+    return;
+  }
+
   if (self->mr & 0x01) {
     switch(reg) {
       case W5100_MR:
@@ -1218,10 +1850,10 @@ nic_w5100_write( nic_w5100_t *self, uint16_t reg, uint8_t b )
         break;
     }
   }
-  else if( reg >= 0x400 && reg < 0x800 ) {
+  else if( reg >= 0x400 && reg < self->sock_end ) {
     nic_w5100_socket_write( self, reg, b );
   }
-  else if( reg >= 0x4000 && reg < 0x6000 ) {
+  else if( reg >= self->tx_base && reg < self->rx_base ) {
     nic_w5100_socket_write_tx_buffer( self, reg, b );
   }
   else
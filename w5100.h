@@ -28,14 +28,31 @@
    
 */
 
+#include <poll.h>
+
+/* Up to eight sockets, see nic_w5100_alloc_sockets() */
+#define W5100_SOCKETS_MAX	8
+
+/* One poll entry per hardware socket */
+#define W5100_POLLFDS	W5100_SOCKETS_MAX
+
 typedef struct nic_w5100_t nic_w5100_t;
 
 nic_w5100_t* nic_w5100_alloc( void );
+nic_w5100_t* nic_w5100_alloc_sockets( int sockets );
+void nic_w5100_set_tap( nic_w5100_t *self, const char *name );
 void nic_w5100_free( nic_w5100_t *self );
 
 void nic_w5100_reset( nic_w5100_t *self );
 
 uint8_t nic_w5100_read( nic_w5100_t *self, uint16_t reg);
 void nic_w5100_write( nic_w5100_t *self, uint16_t reg, uint8_t b );
+size_t nic_w5100_read_block( nic_w5100_t *self, uint8_t *buf, size_t len );
+size_t nic_w5100_write_block( nic_w5100_t *self, const uint8_t *buf, size_t len );
 void w5100_process(nic_w5100_t *self);
+int w5100_pollfds(nic_w5100_t *self, struct pollfd *pfd);
+unsigned long long nic_w5100_packets( nic_w5100_t *self );
+
+size_t w5100_save( nic_w5100_t *self, void *buf );
+int w5100_load( nic_w5100_t *self, const void *buf, size_t len );
 
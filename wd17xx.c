@@ -6,6 +6,9 @@
 #include <fcntl.h>
 #include "system.h"
 #include "wd17xx.h"
+#include "blkcache.h"
+#include "cow.h"
+#include "trace.h"
 
 /*
  *	A very primitive WD17xx simulation
@@ -17,6 +20,11 @@ struct wd17xx {
 	unsigned int spt[4];
 	unsigned int secsize[4];
 	unsigned int sides[4];
+	/* Whole disk held in memory, written back a track at a time */
+	uint8_t *image[4];
+	off_t imagelen[4];
+	uint8_t *dirty[4];
+	unsigned int inram;
 	unsigned int drive;
 	uint8_t buf[512];
 	unsigned int pos;
@@ -29,6 +37,13 @@ struct wd17xx {
 	uint8_t side;
 	unsigned int intrq;
 
+	/* Mechanical timing as a percentage of the real drive, 0 for none.
+	   While delay runs the command shows BUSY and nothing else */
+	unsigned int timing;
+	unsigned long delay;		/* Microseconds */
+	uint64_t clock;			/* Microseconds, for rotation */
+	unsigned int type1;		/* Last command was a type I */
+
 	unsigned int trace;
 };
 
@@ -46,36 +61,70 @@ struct wd17xx {
 
 #define NO_DRIVE	0xFF
 
-static void wd17xx_diskseek(struct wd17xx *fdc)
+/* A 300rpm drive on a 1MHz 179x */
+#define REV_US		200000UL
+#define INDEX_US	4000UL
+#define SETTLE_US	15000UL
+
+static const unsigned long steprate[4] = { 6000, 12000, 20000, 30000 };
+
+static off_t wd17xx_diskpos(struct wd17xx *fdc)
 {
 	off_t pos = fdc->track * fdc->spt[fdc->drive] * fdc->sides[fdc->drive];
 	pos += fdc->sector - 1;
 	if (fdc->sides[fdc->drive] == 2 && fdc->side)
 		pos += fdc->spt[fdc->drive];
 	pos *= fdc->secsize[fdc->drive];
-	if (lseek(fdc->fd[fdc->drive], pos, SEEK_SET) < 0) {
-		perror("lseek");
-		exit(1);
-	}
-	if (fdc->trace) {
+	if (TRACE_ON(fdc->trace)) {
 		fprintf(stderr, "fdc%d: seek to %d,%d,%d = %lx\n",
 			fdc->drive, fdc->side, fdc->track, fdc->sector,
 			(long)pos);
 	}
+	return pos;
+}
+
+static unsigned int wd17xx_trackbytes(struct wd17xx *fdc, int dev)
+{
+	return fdc->spt[dev] * fdc->secsize[dev];
+}
+
+static ssize_t wd17xx_pread(struct wd17xx *fdc, int dev, uint8_t *buf,
+	unsigned int size, off_t pos)
+{
+	if (fdc->image[dev] == NULL)
+		return blkcache_pread(fdc->fd[dev], buf, size, pos);
+	if (pos + size > fdc->imagelen[dev])
+		return 0;
+	memcpy(buf, fdc->image[dev] + pos, size);
+	return size;
+}
+
+static ssize_t wd17xx_pwrite(struct wd17xx *fdc, int dev, uint8_t *buf,
+	unsigned int size, off_t pos)
+{
+	if (fdc->image[dev] == NULL)
+		return blkcache_pwrite(fdc->fd[dev], buf, size, pos);
+	memcpy(fdc->image[dev] + pos, buf, size);
+	fdc->dirty[dev][pos / wd17xx_trackbytes(fdc, dev)] = 1;
+	if (pos + size > fdc->imagelen[dev])
+		fdc->imagelen[dev] = pos + size;
+	return size;
 }
 
 uint8_t wd17xx_read_data(struct wd17xx *fdc)
 {
 	unsigned int end = fdc->rdsize - 1;
+	if (fdc->delay)
+		return fdc->buf[0];
 	/* No data ??? */
 	if (fdc->rd == 0) {
-		if (fdc->trace)
+		if (TRACE_ON(fdc->trace))
 			fprintf(stderr, "fdc%d: read without data ready.\n", fdc->drive);
 		return fdc->buf[0];
 	}
 	/* Data end, status follows. On the data end we drop BUSY */
 	if (fdc->pos == end) {
-		if (fdc->trace)
+		if (TRACE_ON(fdc->trace))
 			fprintf(stderr, "fdc%d: last byte read dropping DRQ.\n", fdc->drive);
 		fdc->status &= ~(DRQ|BUSY);
 		fdc->intrq = 1;
@@ -85,7 +134,7 @@ uint8_t wd17xx_read_data(struct wd17xx *fdc)
 	/* Hand out data */
 	if (fdc->pos < end)
 		return fdc->buf[fdc->pos++];
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: read beyond data end.\n", fdc->drive);
 	return fdc->buf[end];
 }
@@ -93,23 +142,24 @@ uint8_t wd17xx_read_data(struct wd17xx *fdc)
 void wd17xx_write_data(struct wd17xx *fdc, uint8_t v)
 {
 	unsigned int size = fdc->secsize[fdc->drive];
+	if (fdc->delay)
+		return;
 	if (fdc->wr == 0) {
-		if (fdc->trace)
+		if (TRACE_ON(fdc->trace))
 			fprintf(stderr, "fdc%d: write %d without data ready.\n", fdc->drive, v);
 		fdc->buf[0] = v;
 		return;
 	}
 	if (fdc->pos >= size) {
-		if (fdc->trace)
+		if (TRACE_ON(fdc->trace))
 			fprintf(stderr, "fdc%d: write beyond size.\n", fdc->drive);
 		return;
 	}
 	fdc->buf[fdc->pos++] = v;
 	if (fdc->pos == size) {
-		if (fdc->trace)
+		if (TRACE_ON(fdc->trace))
 			fprintf(stderr, "fdc%d: write final byte, dropping BUSY and DRQ.\n", fdc->drive);
-		wd17xx_diskseek(fdc);
-		if (write(fdc->fd[fdc->drive], fdc->buf, size) != size) {
+		if (wd17xx_pwrite(fdc, fdc->drive, fdc->buf, size, wd17xx_diskpos(fdc)) != size) {
 			perror("wd17xx: write: ");
 			fprintf(stderr, "wd17xx: I/O error.\n");
 		}
@@ -121,28 +171,28 @@ void wd17xx_write_data(struct wd17xx *fdc, uint8_t v)
 
 uint8_t wd17xx_read_sector(struct wd17xx *fdc)
 {
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: read sector reg = %d.\n", fdc->drive, fdc->sector);
 	return fdc->sector;
 }
 
 void wd17xx_write_sector(struct wd17xx *fdc, uint8_t v)
 {
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: write sector reg = %d.\n", fdc->drive, v);
 	fdc->sector = v;
 }
 
 uint8_t wd17xx_read_track(struct wd17xx *fdc)
 {
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: read track reg = %d.\n", fdc->drive, fdc->track);
 	return fdc->track;
 }
 
 void wd17xx_write_track(struct wd17xx *fdc, uint8_t v)
 {
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: write track reg = %d.\n", fdc->drive, v);
 	fdc->track = v;
 }
@@ -150,13 +200,14 @@ void wd17xx_write_track(struct wd17xx *fdc, uint8_t v)
 void wd17xx_command(struct wd17xx *fdc, uint8_t v)
 {
 	unsigned int size = fdc->secsize[fdc->drive];
+	uint8_t oldtrack = fdc->track;
 	if (fdc->drive == NO_DRIVE || fdc->fd[fdc->drive] == -1) {
-		if (fdc->trace)
+		if (TRACE_ON(fdc->trace))
 			fprintf(stderr, "fdc%d: command to empty drive.\n", fdc->drive);
 		fdc->status = NOTREADY;
 		return;
 	}
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: command %x.\n", fdc->drive, v);
 
 	/* Special case */
@@ -164,6 +215,7 @@ void wd17xx_command(struct wd17xx *fdc, uint8_t v)
 		fdc->rd = 0;
 		fdc->wr = 0;
 		fdc->pos = 0;
+		fdc->delay = 0;
 		if (fdc->status & BUSY)
 			fdc->status &= ~BUSY;
 		else {
@@ -175,10 +227,11 @@ void wd17xx_command(struct wd17xx *fdc, uint8_t v)
 			fdc->intrq = 1;
 		return;
 	}
-	if (fdc->status & BUSY)
+	if ((fdc->status & BUSY) || fdc->delay)
 		return;
 
 	fdc->status = BUSY;
+	fdc->type1 = !(v & 0x80);
 
 	fdc->rd = 0;
 	fdc->wr = 0;
@@ -247,9 +300,8 @@ void wd17xx_command(struct wd17xx *fdc, uint8_t v)
 			fdc->status = INDEX | RECNFERR;
 			return;
 		}
-		wd17xx_diskseek(fdc);
 		fdc->rd = 1;
-		if (read(fdc->fd[fdc->drive], fdc->buf, size) != size) {
+		if (wd17xx_pread(fdc, fdc->drive, fdc->buf, size, wd17xx_diskpos(fdc)) != size) {
 			perror("wd17xx: read: ");
 			fprintf(stderr, "wd17xx: I/O error.\n");
 			fdc->status = INDEX | RECNFERR;
@@ -314,19 +366,45 @@ void wd17xx_command(struct wd17xx *fdc, uint8_t v)
 		fdc->intrq = 1;
 		break;
 	}
+	if (fdc->timing == 0)
+		return;
+	/* Type I commands step and optionally verify, the others load the
+	   head and wait for the sector to come round */
+	if (fdc->type1)
+		fdc->delay = abs(fdc->track - oldtrack) * steprate[v & 3];
+	else if (fdc->status & BUSY)
+		fdc->delay = REV_US - fdc->clock % REV_US;
+	if (v & 0x04)
+		fdc->delay += SETTLE_US;
+	fdc->delay = fdc->delay * fdc->timing / 100;
+}
+
+/* What the host sees. Busy while a delay runs, and after a type I command
+   the index bit follows the hole going past */
+static uint8_t wd17xx_view(struct wd17xx *fdc)
+{
+	uint8_t s = fdc->status;
+	if (fdc->delay)
+		return BUSY;
+	if (fdc->timing && fdc->type1) {
+		s &= ~INDEX;
+		if (fdc->clock % REV_US < INDEX_US)
+			s |= INDEX;
+	}
+	return s;
 }
 
 uint8_t wd17xx_status(struct wd17xx *fdc)
 {
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: status %x.\n", fdc->drive, fdc->status);
 	fdc->intrq = 0;
-	return fdc->status;
+	return wd17xx_view(fdc);
 }
 
 uint8_t wd17xx_status_noclear(struct wd17xx *fdc)
 {
-	return fdc->status;
+	return wd17xx_view(fdc);
 }
 
 struct wd17xx *wd17xx_create(void)
@@ -340,26 +418,98 @@ struct wd17xx *wd17xx_create(void)
 	return fdc;
 }
 
+/* Write the changed tracks of an in memory disk back to the file */
+static int wd17xx_flush_drive(struct wd17xx *fdc, int dev)
+{
+	unsigned int t, tb = wd17xx_trackbytes(fdc, dev);
+	unsigned int ntracks = fdc->tracks[dev] * fdc->sides[dev];
+	int err = 0;
+
+	for (t = 0; t < ntracks; t++) {
+		off_t pos = (off_t)t * tb;
+		unsigned int len = tb;
+		if (!fdc->dirty[dev][t])
+			continue;
+		if (pos + len > fdc->imagelen[dev])
+			len = fdc->imagelen[dev] - pos;
+		if (blkcache_pwrite(fdc->fd[dev], fdc->image[dev] + pos, len, pos) != len) {
+			perror("wd17xx: write back");
+			err = -1;
+			continue;
+		}
+		fdc->dirty[dev][t] = 0;
+	}
+	return err;
+}
+
+int wd17xx_flush(struct wd17xx *fdc)
+{
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < 4; i++)
+		if (fdc->image[i] && wd17xx_flush_drive(fdc, i))
+			err = -1;
+	return err;
+}
+
 void wd17xx_detach(struct wd17xx *fdc, int dev)
 {
+	if (fdc->image[dev]) {
+		wd17xx_flush_drive(fdc, dev);
+		free(fdc->image[dev]);
+		free(fdc->dirty[dev]);
+		fdc->image[dev] = NULL;
+		fdc->dirty[dev] = NULL;
+	}
 	if (fdc->fd[dev] != -1)
-		close(fdc->fd[dev]);
+		blkcache_close(fdc->fd[dev]);
 	fdc->fd[dev] = -1;
 }
 
+/* Load the whole disk into memory on the next attach. Small enough for
+   it not to matter and it saves a system call per sector */
+void wd17xx_set_inram(struct wd17xx *fdc, unsigned int onoff)
+{
+	fdc->inram = onoff;
+}
+
+static void wd17xx_load(struct wd17xx *fdc, int dev)
+{
+	unsigned int ntracks = fdc->tracks[dev] * fdc->sides[dev];
+	off_t size = (off_t)ntracks * wd17xx_trackbytes(fdc, dev);
+	ssize_t len;
+
+	if (size == 0)
+		return;
+	fdc->image[dev] = calloc(1, size);
+	fdc->dirty[dev] = calloc(1, ntracks);
+	if (fdc->image[dev] == NULL || fdc->dirty[dev] == NULL) {
+		fprintf(stderr, "wd17xx: out of memory.\n");
+		exit(1);
+	}
+	len = blkcache_pread(fdc->fd[dev], fdc->image[dev], size, 0);
+	if (len < 0) {
+		perror("wd17xx: load");
+		len = 0;
+	}
+	fdc->imagelen[dev] = len;
+}
+
 int wd17xx_attach(struct wd17xx *fdc, int dev, const char *path,
 	unsigned int sides, unsigned int tracks,
 	unsigned int sectors, unsigned int secsize)
 {
-	if (fdc->fd[dev])
-		close(fdc->fd[dev]);
-	fdc->fd[dev] = open(path, O_RDWR);
+	wd17xx_detach(fdc, dev);
+	fdc->fd[dev] = cow_open(path, O_RDWR);
 	if (fdc->fd[dev] == -1)
 		perror(path);
 	fdc->spt[dev] = sectors;
 	fdc->tracks[dev] = tracks;
 	fdc->sides[dev] = sides;
 	fdc->secsize[dev] = secsize;
+	if (fdc->inram && fdc->fd[dev] != -1)
+		wd17xx_load(fdc, dev);
 	return fdc->fd[dev];
 }
 
@@ -374,7 +524,7 @@ void wd17xx_free(struct wd17xx *fdc)
 void wd17xx_set_drive(struct wd17xx *fdc, unsigned int drive)
 {
 	fdc->drive = drive;
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: drive %d selected.\n",  fdc->drive, drive);
 }
 
@@ -386,7 +536,7 @@ void wd17xx_no_drive(struct wd17xx *fdc)
 void wd17xx_set_side(struct wd17xx *fdc, unsigned int side)
 {
 	fdc->side = side;
-	if (fdc->trace)
+	if (TRACE_ON(fdc->trace))
 		fprintf(stderr, "fdc%d: side %d selected.\n",  fdc->drive, side);
 }
 
@@ -397,5 +547,28 @@ void wd17xx_trace(struct wd17xx *fdc, unsigned int onoff)
 
 uint8_t wd17xx_intrq(struct wd17xx *fdc)
 {
+	if (fdc->delay)
+		return 0;
 	return fdc->intrq;
 }
+
+void wd17xx_set_timing(struct wd17xx *fdc, unsigned int percent)
+{
+	fdc->timing = percent;
+	if (percent == 0)
+		fdc->delay = 0;
+}
+
+void wd17xx_tick(struct wd17xx *fdc, unsigned int usec)
+{
+	fdc->clock += usec;
+	if (usec >= fdc->delay)
+		fdc->delay = 0;
+	else
+		fdc->delay -= usec;
+}
+
+unsigned long wd17xx_busy(struct wd17xx *fdc)
+{
+	return fdc->delay;
+}
@@ -15,6 +15,11 @@ extern void wd17xx_set_side(struct wd17xx *fdc, unsigned int side);
 extern struct wd17xx *wd17xx_create(void);
 extern void wd17xx_free(struct wd17xx *fdc);
 extern void wd17xx_detach(struct wd17xx *fdc, int dev);
+extern void wd17xx_set_inram(struct wd17xx *fdc, unsigned int onoff);
+extern int wd17xx_flush(struct wd17xx *fdc);
 extern int wd17xx_attach(struct wd17xx *fdc, int dev, const char *path, unsigned int sides, unsigned int tracks, unsigned int sectors, unsigned int secsize);
 extern void wd17xx_trace(struct wd17xx *fdc, unsigned int onoff);
 extern uint8_t wd17xx_intrq(struct wd17xx *fdc);
+extern void wd17xx_set_timing(struct wd17xx *fdc, unsigned int percent);
+extern void wd17xx_tick(struct wd17xx *fdc, unsigned int usec);
+extern unsigned long wd17xx_busy(struct wd17xx *fdc);
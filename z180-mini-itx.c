@@ -62,6 +62,8 @@
 #include "libz180/z180.h"
 #include "lib765/include/765.h"
 #include "z180_io.h"
+#include "cpuclock.h"
+#include "z180run.h"
 
 #include "i82c55a.h"
 #include "ps2.h"
@@ -71,9 +73,11 @@
 #include "zxkey.h"
 
 #include "ide.h"
+#include "trace.h"
+#include "ramalloc.h"
 
-static uint8_t ram[1024 * 1024];	/* 1MB RAM */
-static uint8_t rom[512 * 1024];		/* 512K ROM */
+static uint8_t *ram;	/* 1MB RAM */
+static uint8_t *rom;		/* 512K ROM */
 static uint8_t port_a;
 static uint8_t port_b;
 static uint8_t port_c;
@@ -93,10 +97,11 @@ struct i82c55a *ppi;
 static uint8_t ide = 0;
 static struct ide_controller *ide0;
 
-static uint16_t tstate_steps = 737;	/* 18.432MHz */
+static unsigned long cpu_hz = 18432000;
 
 /* IRQ source that is live in IM2 */
 static uint8_t live_irq;
+static struct z180run run;
 
 static Z180Context cpu_z180;
 
@@ -117,7 +122,7 @@ volatile int emulator_done;
 
 static int trace = 0;
 
-static void reti_event(void);
+static void reti_event(int unused);
 
 /*
  *	Model the physical bus interface including wrapping and
@@ -159,7 +164,7 @@ static uint8_t do_mem_read0(uint16_t addr, int quiet)
 	uint32_t pa = z180_mmu_translate(io, addr);
 	uint8_t r;
 	r = z180_phys_read(0, pa);
-	if (!quiet && (trace & TRACE_MEM))
+	if (!quiet && TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R %04X[%06X] -> %02X\n", addr, pa, r);
 	return r;
 }
@@ -167,33 +172,14 @@ static uint8_t do_mem_read0(uint16_t addr, int quiet)
 static void mem_write0(uint16_t addr, uint8_t val)
 {
 	uint32_t pa = z180_mmu_translate(io, addr);
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W: %04X[%06X] <- %02X\n", addr, pa, val);
 	z180_phys_write(0, pa, val);
 }
 
 uint8_t mem_read(int unused, uint16_t addr)
 {
-	static uint8_t rstate = 0;
-	uint8_t r = do_mem_read0(addr, 0);
-
-	if (cpu_z180.M1) {
-		/* DD FD CB see the Z80 interrupt manual */
-		if (r == 0xDD || r == 0xFD || r == 0xCB) {
-			rstate = 2;
-			return r;
-		}
-		/* Look for ED with M1, followed directly by 4D and if so trigger
-		   the interrupt chain */
-		if (r == 0xED && rstate == 0) {
-			rstate = 1;
-			return r;
-		}
-	}
-	if (r == 0x4D && rstate == 1)
-		reti_event();
-	rstate = 0;
-	return r;
+	return do_mem_read0(addr, 0);
 }
 
 void mem_write(int unused, uint16_t addr, uint8_t val)
@@ -221,7 +207,7 @@ static void rc2014_trace(unsigned unused)
 	static uint32_t lastpc = -1;
 	char buf[256];
 
-	if ((trace & TRACE_CPU) == 0)
+	if (TRACE_ON(trace & TRACE_CPU) == 0)
 		return;
 	nbytes = 0;
 	/* Spot XXXR repeating instructions and squash the trace */
@@ -296,14 +282,14 @@ uint8_t z180_csio_write(struct z180_io *io, uint8_t bits)
 		return 0xFF;
 
 	r = bitrev[sd_spi_in(sdcard, bitrev[bits])];
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 		fprintf(stderr,	"[SPI %02X:%02X]\n", bitrev[bits], bitrev[r]);
 	return r;
 }
 
 static void fdc_log(int debuglevel, char *fmt, va_list ap)
 {
-	if ((trace & TRACE_FDC) || debuglevel == 0)
+	if (TRACE_ON(trace & TRACE_FDC) || debuglevel == 0)
 		vfprintf(stderr, "fdc: ", ap);
 }
 
@@ -445,7 +431,7 @@ void i82c55a_output(struct i82c55a *ppi, int port, uint8_t data)
 		port_c = data;
 		break;
 	}
-	if (trace & TRACE_PPI)
+	if (TRACE_ON(trace & TRACE_PPI))
 		fprintf(stderr,"[PPI %02X %02X %02X]\n", port_a, port_b, port_c);
 	ppi_recalc();
 }
@@ -469,14 +455,14 @@ uint8_t i82c55a_input(struct i82c55a *ppi, int port)
 static uint8_t my_ide_read(uint16_t addr)
 {
 	uint8_t r =  ide_read8(ide0, addr);
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide read %d = %02X\n", addr, r);
 	return r;
 }
 
 static void my_ide_write(uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IDE)
+	if (TRACE_ON(trace & TRACE_IDE))
 		fprintf(stderr, "ide write %d = %02X\n", addr, val);
 	ide_write8(ide0, addr, val);
 }
@@ -484,7 +470,7 @@ static void my_ide_write(uint16_t addr, uint8_t val)
 
 uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	if (z180_iospace(io, addr))
 		return z180_read(io, addr);
@@ -495,18 +481,19 @@ uint8_t io_read(int unused, uint16_t addr)
 		return fdc_read(addr & 7);
 	if (addr >= 0x40 && addr <= 0x47)
 		return i82c55a_read(ppi, addr & 3);
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 void io_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 
 	if (z180_iospace(io, addr)) {
 		z180_write(io, addr, val);
+		run.dma_live = z180_dma_live(io);
 		return;
 	}
 
@@ -528,7 +515,7 @@ void io_write(int unused, uint16_t addr, uint8_t val)
 		trace &= 0xFF;
 		trace |= val << 8;
 		printf("trace set to %d\n", trace);
-	} else if (trace & TRACE_UNK)
+	} else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
@@ -537,9 +524,9 @@ static void poll_irq_event(void)
 	z180_interrupt(io, 0, 0, 0);
 }
 
-static void reti_event(void)
+static void reti_event(int unused)
 {
-	if (live_irq && (trace & TRACE_IRQ))
+	if (live_irq && TRACE_ON(trace & TRACE_IRQ))
 		fprintf(stderr, "RETI\n");
 	live_irq = 0;
 	poll_irq_event();
@@ -560,24 +547,48 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-	fprintf(stderr, "z180-mini-itx: [-f] [-R] [-r rompath] [-w] [-i idepath] [-S sdpath] [-d debug]\n");
+	fprintf(stderr, "z180-mini-itx: [-f] [-X MHz] [-R] [-r rompath] [-w] [-i idepath] [-S sdpath] [-d debug]\n");
 	exit(EXIT_FAILURE);
 }
 
+/* Every ten slices */
+static void z180_mini_itx_tick(void)
+{
+	fdc_tick(fdc);
+	/* We want to run UI events regularly it seems */
+	ui_event();
+}
+
+/* Every frame (20ms) */
+static void z180_mini_itx_frame(void)
+{
+	if (int_recalc) {
+		/* If there is no pending Z180 vector IRQ but we think
+		   there now might be one we use the same logic as for
+		   reti */
+		if (!live_irq)
+			poll_irq_event();
+		/* Clear this after because reti_event may set the
+		   flags to indicate there is more happening. We will
+		   pick up the next state changes on the reti if so */
+		if (!(cpu_z180.IFF1|cpu_z180.IFF2))
+			int_recalc = 0;
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
 	int opt;
 	int fd;
 	char *rompath = "z180-mini-itx.rom";
 	char *sdpath = NULL, *idepath = NULL;
 	char *patha = NULL, *pathb = NULL;
 
-	uint8_t *p = ram;
-	while (p < ram + sizeof(ram))
-		*p++= rand();
+	ram = ram_alloc(1024 * 1024);
+	ram_scramble(ram, 1024 * 1024);
+	rom = ram_alloc(512 * 1024);
 
-	while ((opt = getopt(argc, argv, "A:B:d:fF:lr:RS:i:")) != -1) {
+	while ((opt = getopt(argc, argv, "A:B:d:fF:lr:RS:i:X:")) != -1) {
 		switch (opt) {
 		case 'r':
 			rompath = optarg;
@@ -594,6 +605,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			fast = 1;
 			break;
+		case 'X':
+			cpu_hz = cpuclock_parse(optarg);
+			break;
 		case 'F':
 			if (pathb) {
 				fprintf(stderr, "z180-mini-itx: too many floppy disks specified.\n");
@@ -626,7 +640,7 @@ int main(int argc, char *argv[])
 		perror(rompath);
 		exit(EXIT_FAILURE);
 	}
-	if (read(fd, rom, 512 * 1024) != 512 * 1024) {
+	if (ram_load(fd, rom, 512 * 1024) != 512 * 1024) {
 		fprintf(stderr, "z180-mini-itx: ROM image should be 512K.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -640,7 +654,7 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		sd_attach(sdcard, fd);
-		if (trace & TRACE_SD)
+		if (TRACE_ON(trace & TRACE_SD))
 			sd_trace(sdcard, 1);
 	}
 
@@ -661,7 +675,7 @@ int main(int argc, char *argv[])
 	}
 
 	io = z180_create(&cpu_z180);
-	z180_trace(io, trace & TRACE_CPU_IO);
+	z180_trace(io, TRACE_ON(trace & TRACE_CPU_IO));
 	z180_set_input(io, 0, 1);
 
 	fdc = fdc_new();
@@ -693,19 +707,14 @@ int main(int argc, char *argv[])
 	fdc_setdrive(fdc, 1, drive_b);
 
 	ps2 = ps2_create(18);
-	ps2_trace(ps2, trace & TRACE_PS2);
+	ps2_trace(ps2, TRACE_ON(trace & TRACE_PS2));
 
 	ppi = i82c55a_create();
-	i82c55a_trace(ppi, trace & TRACE_PPI);
+	i82c55a_trace(ppi, TRACE_ON(trace & TRACE_PPI));
 
 	zxkey = zxkey_create();
 
 
-	/* 20ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 20000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -726,53 +735,20 @@ int main(int argc, char *argv[])
 	cpu_z180.ioWrite = io_write;
 	cpu_z180.memRead = mem_read;
 	cpu_z180.memWrite = mem_write;
+	cpu_z180.reti = reti_event;
 	cpu_z180.trace = rc2014_trace;
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	while (!emulator_done) {
-		int states = 0;
-		unsigned int i, j;
-		/* We have to run the DMA engine and Z180 in step per
-		   instruction otherwise we will mess up on stalling DMA */
-
-		/* Do an emulated 20ms of work (368640 clocks) */
-		for (i = 0; i < 50; i++) {
-			for (j = 0; j < 10; j++) {
-				while (states < tstate_steps) {
-					unsigned int used;
-					used = z180_dma(io);
-					if (used == 0)
-						used = Z180Execute(&cpu_z180);
-					states += used;
-				}
-				z180_event(io, states);
-				states -= tstate_steps;
-			}
-			fdc_tick(fdc);
-			/* We want to run UI events regularly it seems */
-			ui_event();
-		}
-
-		/* Do 20ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
-		if (int_recalc) {
-			/* If there is no pending Z180 vector IRQ but we think
-			   there now might be one we use the same logic as for
-			   reti */
-			if (!live_irq)
-				poll_irq_event();
-			/* Clear this after because reti_event may set the
-			   flags to indicate there is more happening. We will
-			   pick up the next state changes on the reti if so */
-			if (!(cpu_z180.IFF1|cpu_z180.IFF2))
-				int_recalc = 0;
-		}
-	}
+	run.cpu = &cpu_z180;
+	run.io = io;
+	run.hz = cpu_hz;
+	run.rate = 25000;
+	run.steps = 10;
+	run.ticks = 50;
+	run.tick = z180_mini_itx_tick;
+	run.frame = z180_mini_itx_frame;
+	run.fast = fast;
+	run.done = &emulator_done;
+	z180run_loop(&run);
 	fd_eject(drive_a);
 	fd_eject(drive_b);
 	fdc_destroy(&fdc);
@@ -10,6 +10,9 @@
 #include <unistd.h>
 #include "libz180/z180.h"
 #include "z180_io.h"
+#include "console.h"
+#include "chardev.h"
+#include "trace.h"
 
 struct z180_asci {
     uint8_t tdr;
@@ -21,14 +24,22 @@ struct z180_asci {
     uint8_t ecr;
     bool input;
     bool irq;
+    uint64_t due;		/* Next character time or Z180_NEVER */
+    struct chardev *dev;	/* Host device if attached */
+    bool unthrottled;
+    unsigned long long bytes;	/* Moved either way, for the metrics */
 };
 
 struct z180_prt {
     uint16_t tmdr;
     uint16_t rldr;
     uint8_t latch;
+    uint64_t base;		/* Clock at which tmdr was last brought up to date */
+    uint64_t due;		/* When tmdr reaches zero or Z180_NEVER */
 };
 
+#define Z180_NEVER	UINT64_MAX
+
 struct z180_io {
     /* CSIO */
     uint8_t cntr;
@@ -40,6 +51,8 @@ struct z180_io {
     uint8_t cbar;
     uint8_t cbr;
     uint8_t bbr;
+    /* Offset to add for each 4K logical page, rebuilt on MMU writes */
+    uint32_t mmu[16];
     /* I/O base etc */
     uint8_t icr;
     uint8_t itc;
@@ -49,9 +62,9 @@ struct z180_io {
     /* Programmable timer */
     struct z180_prt prt[2];
     uint8_t tcr;
-    uint8_t frc;
-    /* Internal state used for clock divide by 20 */
-    unsigned int clockmod;
+    /* Clocks since reset and the earliest timer or ASCI deadline */
+    uint64_t clock;
+    uint64_t next;
 
     /* DMA engine */
     uint32_t sar0;
@@ -222,6 +235,51 @@ void z180_interrupt(struct z180_io *io, uint8_t pin, uint8_t vec, bool on)
     z180_next_interrupt(io);
 }
     
+/* Clocks to send one character at the current format and rate */
+static unsigned int z180_asci_chartime(struct z180_asci *asci)
+{
+    unsigned int bits = 1 + 7 + 1;
+    unsigned int clocks;
+
+    if (asci->cntla & 0x04)
+        bits++;
+    if (asci->cntla & 0x02)
+        bits++;
+    if (asci->cntla & 0x01)
+        bits++;
+    if (asci->ecr & 0x08)		/* Z8S180 baud rate generator */
+        clocks = 2 * (asci->tc + 2);
+    else if ((asci->cntlb & 0x07) == 0x07)
+        return 1600;			/* External clock, assume 115200 */
+    else
+        clocks = ((asci->cntlb & 0x20) ? 30 : 10) << (asci->cntlb & 0x07);
+    clocks *= (asci->cntlb & 0x08) ? 64 : 16;
+    return bits * clocks;
+}
+
+/* Work out the earliest deadline after one of them changed */
+static void z180_next_deadline(struct z180_io *io)
+{
+    io->next = io->prt[0].due;
+    if (io->prt[1].due < io->next)
+        io->next = io->prt[1].due;
+    if (io->asci[0].due < io->next)
+        io->next = io->asci[0].due;
+    if (io->asci[1].due < io->next)
+        io->next = io->asci[1].due;
+}
+
+/* A channel needs a look each character time while it is sending or can
+   receive. An idle transmit only channel costs nothing */
+static void z180_asci_schedule(struct z180_io *io, struct z180_asci *asci)
+{
+    if (asci->input || !(asci->stat & 0x02))
+        asci->due = io->clock + z180_asci_chartime(asci);
+    else
+        asci->due = Z180_NEVER;
+    z180_next_deadline(io);
+}
+
 static void z180_asci_recalc(struct z180_io *io, struct z180_asci *asci)
 {
     asci->irq = 0;
@@ -233,22 +291,41 @@ static void z180_asci_recalc(struct z180_io *io, struct z180_asci *asci)
     z180_next_interrupt(io);
 }
 
+static void z180_asci_event(struct z180_io *io, struct z180_asci *asci);
+
 static uint8_t z180_asci_read(struct z180_io *io, uint8_t addr)
 {
     struct z180_asci *asci = &io->asci[addr & 1];
+    uint8_t r;
     switch(addr & 0xFE) {
     case 0x00:
         return asci->cntla;
     case 0x02:
+        /* Bit 5 reads as /CTS on channel 0 */
+        if (asci->dev && asci == io->asci) {
+            if (chardev_cts(asci->dev))
+                return asci->cntlb & ~0x20;
+            return asci->cntlb | 0x20;
+        }
         return asci->cntlb;
     case 0x04:
+        /* Bit 2 is /DCD on channel 0 */
+        if (asci->dev && asci == io->asci) {
+            if (chardev_connected(asci->dev))
+                return asci->stat & ~0x04;
+            return asci->stat | 0x04;
+        }
         return asci->stat;
     case 0x06:
         return asci->tdr;
     case 0x08:
         asci->stat &= 0x7F;		/* Clear RDRF */
         z180_asci_recalc(io, asci);
-        return asci->rdr;
+        r = asci->rdr;
+        /* Unthrottled the next byte arrives as soon as there is room */
+        if (asci->unthrottled)
+            z180_asci_event(io, asci);
+        return r;
     default:	/* Can't happen */
         return 0xFF;
     }
@@ -275,8 +352,13 @@ static void z180_asci_write(struct z180_io *io, uint8_t addr, uint8_t val)
     case 0x06:
         /* TDRE was high and tx was enabled */
         if ((asci->cntla & 0x20) && (asci->stat & 0x02)) {
-            write(1, &val, 1);
+            if (asci->dev)
+                chardev_putc(asci->dev, val);
+            else
+                console_putc(val);
+            asci->bytes++;
             asci->stat &= ~0x02;
+            z180_asci_schedule(io, asci);
         }
         z180_asci_recalc(io, asci);
         break;
@@ -286,16 +368,32 @@ static void z180_asci_write(struct z180_io *io, uint8_t addr, uint8_t val)
     }
 }
 
+/* An attached channel leaves input with the host while the last byte
+   is unread or channel 0 has RTS off, so the sender is held off */
+static unsigned int z180_asci_dev(struct z180_io *io, struct z180_asci *asci)
+{
+    unsigned int r = chardev_status(asci->dev);
+
+    if (asci->stat & 0x80)
+        r &= ~1;
+    if (asci == io->asci && (asci->cntla & 0x10))
+        r &= ~1;
+    return r;
+}
+
 static void z180_asci_event(struct z180_io *io, struct z180_asci *asci)
 {
-    unsigned int r = check_chario();
+    unsigned int r = asci->dev ? z180_asci_dev(io, asci) : check_chario();
     if (r & 2)
         asci->stat |= 0x02;
-    if (asci->input && (r & 1)) {
+    /* Console input waits for RDRF to clear so a paste isn't lost */
+    if (asci->input && (r & 1) && !(asci->stat & 0x80)) {
         asci->stat |= 0x80;
-        asci->rdr = next_char();
+        asci->rdr = asci->dev ? chardev_getc(asci->dev) : next_char();
+        asci->bytes++;
     }
     z180_asci_recalc(io, asci);
+    z180_asci_schedule(io, asci);
 }
 
 static void z180_csio_begin(struct z180_io *io, uint8_t val)
@@ -307,20 +405,32 @@ static void z180_csio_begin(struct z180_io *io, uint8_t val)
     z180_next_interrupt(io);
 }
 
-static void z180_prt_event(struct z180_io *io, struct z180_prt *prt, unsigned int clocks, unsigned int shift)
+/* Bring a timer up to the current clock and work out when it next
+   reaches zero. The timers count at a twentieth of the CPU clock */
+static void z180_prt_sync(struct z180_io *io, unsigned int shift)
 {
+    struct z180_prt *prt = &io->prt[shift];
+    uint64_t clocks = (io->clock - prt->base) / 20;
+
+    prt->base += clocks * 20;
     /* Disabled */
-    if (!(io->tcr & (1 << shift)))
+    if (!(io->tcr & (1 << shift))) {
+        prt->base = io->clock;
+        prt->due = Z180_NEVER;
+        z180_next_deadline(io);
         return;
-
+    }
     /* Not yet overflowed */
-    if (prt->tmdr > clocks) {
+    if (prt->tmdr > clocks)
         prt->tmdr -= clocks;
-        return;
+    else {
+        clocks -= prt->tmdr;	/* Cycles after the overflow */
+        prt->tmdr = prt->rldr - clocks;	/* Set up with what is left */
+        io->tcr |= 0x40 << shift;
+        z180_next_interrupt(io);
     }
-    clocks -= prt->tmdr;	/* Cycles after the overflow */
-    prt->tmdr = prt->rldr - clocks;	/* Set up with what is left */
-    io->tcr |= 0x40 << shift;    
+    prt->due = prt->base + prt->tmdr * 20ULL;
+    z180_next_deadline(io);
 }
 
 bool z180_iospace(struct z180_io *io, uint16_t addr)
@@ -357,6 +467,7 @@ static uint8_t z180_do_read(struct z180_io *io, uint8_t addr)
         return io->trdr_r;
     /* Timers */
     case 0x0C:
+        z180_prt_sync(io, 0);
         io->prt[0].latch = io->prt[0].tmdr >> 8;
         io->tcr &= ~0x40;
         z180_next_interrupt(io);
@@ -370,12 +481,15 @@ static uint8_t z180_do_read(struct z180_io *io, uint8_t addr)
     case 0x0F:
         return io->prt[0].rldr >> 8;
     case 0x10:
+        z180_prt_sync(io, 0);
+        z180_prt_sync(io, 1);
         return io->tcr;
     case 0x12:
         return io->asci[0].ecr;
     case 0x13:
         return io->asci[1].ecr;
     case 0x14:
+        z180_prt_sync(io, 1);
         io->prt[1].latch = io->prt[1].tmdr >> 8;
         io->tcr &= ~0x80;
         z180_next_interrupt(io);
@@ -389,7 +503,7 @@ static uint8_t z180_do_read(struct z180_io *io, uint8_t addr)
     case 0x17:
         return io->prt[1].rldr >> 8;
     case 0x18:
-        return io->frc;
+        return io->clock / 20;
     case 0x1A:
         return io->asci[0].tc;
     case 0x1B:
@@ -476,18 +590,45 @@ static uint8_t z180_do_read(struct z180_io *io, uint8_t addr)
 uint8_t z180_read(struct z180_io *io, uint8_t addr)
 {
     uint8_t r = z180_do_read(io, addr);
-    if (io->trace)
+    if (TRACE_ON(io->trace))
         fprintf(stderr, "R %s -> %02X\n", regnames[addr & 0x3F], r);
     return r;
 }
 
+/* DCNTL MWI and IWI give the wait states on each memory and I/O cycle.
+   The CPU adds them to its fixed costs so no wait states costs nothing */
+static void z180_waits(struct z180_io *io)
+{
+    static const uint8_t iwi[4] = { 0, 2, 3, 4 };
+    io->cpu->memWait = io->dcntl >> 6;
+    io->cpu->ioWait = iwi[(io->dcntl >> 4) & 3];
+}
+
+/* Work out the offset for each 4K page from CBAR, CBR and BBR */
+static void z180_mmu_recalc(struct z180_io *io)
+{
+    unsigned int i;
+
+    for (i = 0; i < 16; i++) {
+        /* Common area 0: direct mapped */
+        if (i < (io->cbar & 0x0F))
+            io->mmu[i] = 0;
+        /* Common area 1 */
+        else if (i >= (io->cbar >> 4))
+            io->mmu[i] = io->cbr << 12;
+        /* Bank area */
+        else
+            io->mmu[i] = io->bbr << 12;
+    }
+}
+
 void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
 {
     uint8_t delta;
 
     addr &= 0x3F;
 
-    if (io->trace)
+    if (TRACE_ON(io->trace))
         fprintf(stderr, "W %s <- %02X\n", regnames[addr], val);
 
     switch(addr) {
@@ -518,12 +659,16 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
         break;
     /* Timers */
     case 0x0C:
+        z180_prt_sync(io, 0);
         io->prt[0].tmdr &= 0xFF00;
         io->prt[0].tmdr |= val;
+        z180_prt_sync(io, 0);
         break;
     case 0x0D:
+        z180_prt_sync(io, 0);
         io->prt[0].tmdr &= 0x00FF;
         io->prt[0].tmdr |= val << 8;
+        z180_prt_sync(io, 0);
         break;
     case 0x0E:
         io->prt[0].rldr &= 0xFF00;
@@ -534,7 +679,11 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
         io->prt[0].rldr |= val << 8;
         break;
     case 0x10:
+        z180_prt_sync(io, 0);
+        z180_prt_sync(io, 1);
         io->tcr = val;
+        z180_prt_sync(io, 0);
+        z180_prt_sync(io, 1);
         break;
     case 0x12:
         io->asci[0].ecr = val;
@@ -543,12 +692,16 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
         io->asci[1].ecr = val;
         break;
     case 0x14:
+        z180_prt_sync(io, 1);
         io->prt[1].tmdr &= 0xFF00;
         io->prt[1].tmdr |= val;
+        z180_prt_sync(io, 1);
         break;
     case 0x15:
+        z180_prt_sync(io, 1);
         io->prt[1].tmdr &= 0x00FF;
         io->prt[1].tmdr |= val << 8;
+        z180_prt_sync(io, 1);
         break;
     case 0x16:
         io->prt[1].rldr &= 0xFF00;
@@ -653,7 +806,7 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
             io->dstat |= 0x81;
         if ((val & 0x50) == 0x40) {
             io->dstat |= 0x41;
-            if (io->trace)
+            if (TRACE_ON(io->trace))
                 fprintf(stderr, "DMA0 begin mode %02X from %X to %X for %X\n",
                     io->dmode, io->sar0, io->dar0, io->bcr0);
         }
@@ -669,6 +822,7 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
         break;
     case 0x32:
         io->dcntl = val;
+        z180_waits(io);
         break;
     /* IL */
     case 0x33:
@@ -690,13 +844,16 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
     /* MMU */
     case 0x38:
         io->cbr = val;
+        z180_mmu_recalc(io);
         break;
     case 0x39:
         io->bbr = val;
+        z180_mmu_recalc(io);
         break;
     case 0x3A:
         /* Should we check for BA < CA ? */
         io->cbar = val;
+        z180_mmu_recalc(io);
         break;
     /* IO Control */
     case 0x3F:	/* ICR */
@@ -711,37 +868,36 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val)
 
 uint32_t z180_mmu_translate(struct z180_io *io, uint16_t addr)
 {
-    /* Common area 0: direct mapped */
-    if ((addr >> 12) < (io->cbar & 0x0F))
-        return addr;
-    /* Common area 1 */
-    if ((addr >> 12) >= (io->cbar >> 4))
-        return addr + (io->cbr << 12);
-    /* Bank area */
-    return addr + (io->bbr << 12);
+    return addr + io->mmu[addr >> 12];
 }
 
+/*
+ *	Advance the clock. Timers and serial ports keep the time they next
+ *	need attention so most calls are just the compare.
+ */
 void z180_event(struct z180_io *io, unsigned int clocks)
 {
-    z180_asci_event(io, io->asci);
-    z180_asci_event(io, io->asci + 1);
+    io->clock += clocks;
+    if (io->clock < io->next)
+        return;
 
-    /* Divide by 20 */
-    io->clockmod += clocks;
-    if (io->clockmod > 20) {
-        io->frc += io->clockmod / 20;
-        z180_prt_event(io, io->prt, io->clockmod / 20, 0);
-        z180_prt_event(io, io->prt + 1, io->clockmod / 20, 1);
-        io->clockmod %= 20;
-    }
+    if (io->prt[0].due <= io->clock)
+        z180_prt_sync(io, 0);
+    if (io->prt[1].due <= io->clock)
+        z180_prt_sync(io, 1);
+    if (io->asci[0].due <= io->clock)
+        z180_asci_event(io, io->asci);
+    if (io->asci[1].due <= io->clock)
+        z180_asci_event(io, io->asci + 1);
+    z180_next_deadline(io);
 }
 
 /*
  *	DMA engine
- *	We model transfers between memory and I/O space
+ *	We model transfers between memory and I/O space, and channel 0
+ *	paced by the ASCI. The CSIO has no DMA request on the Z180.
  *
  *	We do yet not model
- *	DMA driven internal I/O (ASCI, CSIO etc)
  *	DMA toggles
  *	DREQ0/1 being high
  *	NMI halting DMA
@@ -749,20 +905,37 @@ void z180_event(struct z180_io *io, unsigned int clocks)
  *	Our cycle stealing isn't quite correct
  */
 
-static unsigned int z180_dma_0(struct z180_io *io)
+/* In I/O mode bits 17-16 of SAR0 or DAR0 pick the request: 0 is DREQ0
+   and 1 or 2 are RDRF or TDRE of ASCI 0 or 1 */
+static unsigned int z180_dma_0_asci(uint32_t addr)
 {
-    unsigned int cost = 6;	/* Cost of each transfer */
-    uint8_t byte;
+    unsigned int sel = (addr >> 16) & 3;
+    return sel == 3 ? 0 : sel;
+}
 
-    /* TODO: model wait states */
+/* Channel 0 may move a byte. DREQ0 is taken as always asserted */
+static bool z180_dma_0_ready(struct z180_io *io)
+{
+    unsigned int n;
 
-    /* We do a DMA then the CPU gets a go. Really we interleave with each
-       machine cycle but this will do for now */
-    if (!(io->dmode & 2)) {
-        io->dma_state0++;
-        if (io->dma_state0 & 1)
+    if ((io->dmode & 0x0C) == 0x0C) {
+        n = z180_dma_0_asci(io->sar0);
+        if (n && !(io->asci[n - 1].stat & 0x80))
+            return 0;
+    }
+    if ((io->dmode & 0x30) == 0x30) {
+        n = z180_dma_0_asci(io->dar0);
+        if (n && !(io->asci[n - 1].stat & 0x02))
             return 0;
     }
+    return 1;
+}
+
+/* Move one byte on channel 0 and stop the channel if it was the last */
+static void z180_dma_0_byte(struct z180_io *io)
+{
+    uint8_t byte;
+    unsigned int n;
 
     /* Fetch a byte */
     /* TODO: when sar0/dar0 crosses a 64K boundary add 4 clocks */
@@ -779,7 +952,11 @@ static unsigned int z180_dma_0(struct z180_io *io)
         byte = z180_phys_read(io->cpu->ioParam, io->sar0);
         break;
     case 0x0C:
-        byte = io->cpu->ioRead(io->cpu->ioParam, io->sar0);
+        n = z180_dma_0_asci(io->sar0);
+        if (n)
+            byte = z180_asci_read(io, 0x07 + n);	/* RDR0/1 */
+        else
+            byte = io->cpu->ioRead(io->cpu->ioParam, io->sar0);
         break;
     }
     /* Store the byte */
@@ -796,24 +973,58 @@ static unsigned int z180_dma_0(struct z180_io *io)
         z180_phys_write(io->cpu->ioParam, io->dar0, byte);
         break;
     case 0x30:
-        io->cpu->ioWrite(io->cpu->ioParam, io->dar0, byte);
+        n = z180_dma_0_asci(io->dar0);
+        if (n)
+            z180_asci_write(io, 0x05 + n, byte);	/* TDR0/1 */
+        else
+            io->cpu->ioWrite(io->cpu->ioParam, io->dar0, byte);
     }
 
     if (--io->bcr0)
-        return cost;
+        return;
     /* DMA finished - stop engine and flag */
     io->dstat &= ~0x40;
-    if (io->trace)
+    if (TRACE_ON(io->trace))
         fprintf(stderr, "DMA0 complete.\n");
-    return cost;
 }
 
-static unsigned int z180_dma_1(struct z180_io *io)
+static unsigned int z180_dma_0(struct z180_io *io, unsigned int budget)
 {
     unsigned int cost = 6;	/* Cost of each transfer */
-    uint8_t byte;
+    unsigned int used = 0;
+
+    /* Each side waits as memory or I/O */
+    cost += (io->dmode & 0x0C) == 0x0C ? io->cpu->ioWait : io->cpu->memWait;
+    cost += (io->dmode & 0x30) == 0x30 ? io->cpu->ioWait : io->cpu->memWait;
+
+    /* Waiting on the ASCI, so the CPU runs */
+    if (!z180_dma_0_ready(io))
+        return 0;
+    /* We do a DMA then the CPU gets a go. Really we interleave with each
+       machine cycle but this will do for now */
+    if (!(io->dmode & 2)) {
+        io->dma_state0++;
+        if (io->dma_state0 & 1)
+            return 0;
+        z180_dma_0_byte(io);
+        return cost;
+    }
+    /* Burst mode keeps the bus until the count runs out or the request
+       drops, so move as much as fits in the time we were given in one go.
+       An unthrottled ASCI refills RDR as it is read so a whole buffer
+       arrives here */
+    do {
+        z180_dma_0_byte(io);
+        used += cost;
+    } while ((io->dstat & 0x40) && used < budget && z180_dma_0_ready(io));
+    return used;
+}
 
-    /* TODO: model wait states */
+static unsigned int z180_dma_1(struct z180_io *io)
+{
+    /* Cost of each transfer, always one memory and one I/O cycle */
+    unsigned int cost = 6 + io->cpu->memWait + io->cpu->ioWait;
+    uint8_t byte;
 
 
     /* TODO: when mar1 crosses a 64K boundary add 4 clocks */
@@ -850,13 +1061,16 @@ static unsigned int z180_dma_1(struct z180_io *io)
     if (--io->bcr1)
         return cost;
     io->dstat &= ~0x80;
-    if (io->trace)
+    if (TRACE_ON(io->trace))
         fprintf(stderr, "DMA1 complete.\n");
     return cost;
 }
 
-/* Run the DMA engines */
-unsigned int z180_dma(struct z180_io *io)
+/*
+ *	Run the DMA engines for at most about budget clocks and return the
+ *	clocks used. Zero means the CPU should run an instruction.
+ */
+unsigned int z180_dma(struct z180_io *io, unsigned int budget)
 {
     /* Engines off */
     if (!(io->dstat & 1))
@@ -864,12 +1078,19 @@ unsigned int z180_dma(struct z180_io *io)
 
     /* Channel enables */
     if (io->dstat & 0x40)
-        return z180_dma_0(io);
+        return z180_dma_0(io, budget);
     if (io->dstat & 0x80)
         return z180_dma_1(io);
     return 0;
 }
 
+/* True if a channel is running. This only changes on a DSTAT write or
+   when a transfer finishes so the caller can skip z180_dma otherwise */
+bool z180_dma_live(struct z180_io *io)
+{
+    return (io->dstat & 1) && (io->dstat & 0xC0);
+}
+
 struct z180_io *z180_create(Z180Context *cpu)
 {
     struct z180_io *io = malloc(sizeof(struct z180_io));
@@ -881,6 +1102,7 @@ struct z180_io *z180_create(Z180Context *cpu)
     io->cbar = 0xF0;
     io->cbr = 0;
     io->bbr = 0;
+    z180_mmu_recalc(io);
     io->icr = 0;
     io->itc = 1;
     io->cntr = 7;
@@ -889,6 +1111,12 @@ struct z180_io *z180_create(Z180Context *cpu)
     io->dstat = 0x30;
     io->dcntl = 0xF0;	/* Manual disagrees with itself here */
     io->cpu = cpu;
+    z180_waits(io);
+    io->prt[0].due = Z180_NEVER;
+    io->prt[1].due = Z180_NEVER;
+    io->asci[0].due = Z180_NEVER;
+    io->asci[1].due = Z180_NEVER;
+    io->next = Z180_NEVER;
     return io;
 }
 
@@ -905,4 +1133,24 @@ void z180_trace(struct z180_io *io, int trace)
 void z180_set_input(struct z180_io *io, int port, int onoff)
 {
     io->asci[port].input = onoff;
+    z180_asci_schedule(io, &io->asci[port]);
+}
+
+/* Give a channel a host device of its own */
+void z180_attach(struct z180_io *io, int port, struct chardev *dev)
+{
+    io->asci[port].dev = dev;
+    io->asci[port].input = 1;
+    z180_asci_schedule(io, &io->asci[port]);
+}
+
+/* Feed input as fast as the guest reads it rather than at the baud rate */
+void z180_unthrottle(struct z180_io *io, int port, int onoff)
+{
+    io->asci[port].unthrottled = onoff;
+}
+
+unsigned long long z180_asci_bytes(struct z180_io *io, int port)
+{
+    return io->asci[port].bytes;
 }
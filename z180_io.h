@@ -1,4 +1,5 @@
 struct z180_io;
+struct chardev;
 
 bool z180_iospace(struct z180_io *io, uint16_t addr);
 uint8_t z180_read(struct z180_io *io, uint8_t addr);
@@ -6,11 +7,15 @@ void z180_write(struct z180_io *io, uint8_t addr, uint8_t val);
 uint32_t z180_mmu_translate(struct z180_io *io, uint16_t addr);
 void z180_event(struct z180_io *io, unsigned int clocks);
 void z180_interrupt(struct z180_io *io, uint8_t pin, uint8_t vec, bool on);
-unsigned int z180_dma(struct z180_io *io);
+unsigned int z180_dma(struct z180_io *io, unsigned int budget);
+bool z180_dma_live(struct z180_io *io);
 struct z180_io *z180_create(Z180Context *cpu);
 void z180_free(struct z180_io *io);
 void z180_trace(struct z180_io *io, int trace);
 void z180_set_input(struct z180_io *io, int port, int onoff);
+void z180_attach(struct z180_io *io, int port, struct chardev *dev);
+void z180_unthrottle(struct z180_io *io, int port, int onoff);
+unsigned long long z180_asci_bytes(struct z180_io *io, int port);
 
 /* Caller proviced */
 extern unsigned int next_char(void);
@@ -0,0 +1,92 @@
+/*
+ *	Z180 board main loop
+ *
+ *	Each frame sleeps until its deadline on the host clock so the time
+ *	spent emulating counts, and a host that falls a long way behind
+ *	starts afresh rather than running flat out to catch up.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include "cpuclock.h"
+#include "z180run.h"
+#include "z180_io.h"
+
+static int64_t z180run_diff(struct timespec *a, struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+/* Sleep until ns after the last frame */
+static void z180run_sync(struct z180run *r, struct timespec *next,
+                         unsigned long long ns)
+{
+    struct timespec now, woke;
+
+    next->tv_nsec += ns % 1000000000ULL;
+    next->tv_sec += ns / 1000000000ULL + next->tv_nsec / 1000000000L;
+    next->tv_nsec %= 1000000000L;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (z180run_diff(&now, next) >= 0) {
+        /* Five frames behind is too far to make up */
+        if (z180run_diff(&now, next) > 5 * (int64_t)ns)
+            *next = now;
+        return;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR
+           && (r->done == NULL || !*r->done));
+    clock_gettime(CLOCK_MONOTONIC, &woke);
+    r->sleep_ns += z180run_diff(&woke, &now);
+}
+
+void z180run_loop(struct z180run *r)
+{
+    struct timespec next;
+    struct cpuclock clk;
+    unsigned long long ns;
+    unsigned int states = 0;
+    unsigned int i, j, slice;
+    int was_fast = 1;
+
+    /* Overruns are carried in states rather than by the clock */
+    cpuclock_init(&clk, r->hz, r->rate);
+    /* The real time one frame takes */
+    ns = 1000000000ULL * r->steps * r->ticks / r->rate;
+
+    while (r->done == NULL || !*r->done) {
+        for (i = 0; i < r->ticks; i++) {
+            for (j = 0; j < r->steps; j++) {
+                slice = cpuclock_slice(&clk);
+                while (states < slice) {
+                    unsigned int used = 0;
+                    if (r->dma_live) {
+                        used = z180_dma(r->io, slice - states);
+                        r->dma_live = z180_dma_live(r->io);
+                    }
+                    if (used == 0) {
+                        r->states = states;
+                        used = Z180Execute(r->cpu);
+                    }
+                    states += used;
+                }
+                z180_event(r->io, states);
+                r->cycles += slice;
+                states -= slice;
+            }
+            if (r->tick)
+                r->tick();
+        }
+        if (!r->fast) {
+            /* Coming back from flat out starts the clock from now */
+            if (was_fast)
+                clock_gettime(CLOCK_MONOTONIC, &next);
+            z180run_sync(r, &next, r->speed > 1 ? ns / r->speed : ns);
+        }
+        was_fast = r->fast;
+        if (r->frame)
+            r->frame();
+    }
+}
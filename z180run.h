@@ -0,0 +1,42 @@
+#ifndef __Z180RUN_H
+#define __Z180RUN_H
+
+#include "libz180/z180.h"
+
+struct z180_io;
+
+/*
+ *	Main loop shared by the Z180 boards. The CPU and the on chip DMA
+ *	engine are run in step an instruction or DMA burst at a time, as a
+ *	stalled DMA would otherwise go wrong, and every slice of clocks the
+ *	internal timers and ASCI are given their time. The board gets a
+ *	tick every so many slices and a frame, after the host sleep, every
+ *	so many ticks. The clocks in each slice come from the clock rate,
+ *	see cpuclock.h.
+ *
+ *	DMA only starts from an I/O write so the board keeps dma_live set
+ *	from z180_dma_live() after each write to the internal registers
+ *	and the DMA engine is skipped entirely otherwise.
+ */
+
+struct z180run {
+    Z180Context *cpu;
+    struct z180_io *io;
+    unsigned long hz;		/* CPU clock */
+    unsigned int rate;		/* z180_event slices per second */
+    unsigned int steps;		/* Slices per tick */
+    unsigned int ticks;		/* Ticks per frame */
+    void (*tick)(void);		/* After each tick, or NULL */
+    void (*frame)(void);	/* After each frame, or NULL */
+    int fast;			/* Don't sleep */
+    unsigned int speed;		/* Multiple of real time, 0 for 1 */
+    volatile int *done;		/* Stop when set, or NULL for never */
+    int dma_live;		/* DMA may be running */
+    uint64_t cycles;		/* Clocks run, kept by the loop */
+    unsigned int states;	/* Into this slice as of the instruction running */
+    uint64_t sleep_ns;		/* Host time spent sleeping */
+};
+
+extern void z180run_loop(struct z180run *r);
+
+#endif
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <unistd.h>
 #include "z8.h"
+#include "trace.h"
 
 static char *fline[] = {
 	NULL, NULL, NULL, NULL,
@@ -371,7 +372,154 @@ static void z8_flag_string(struct z8 *z8, char *buf)
 	*buf = 0;
 }
 
-static uint8_t getreg_internal(struct z8 *z8, uint8_t reg)
+/*
+ *	Emulate timers.
+ *	TODO: emulate external clocks
+ *
+ *	The timers are only brought up to date when they are read, when
+ *	their control registers change and when the next end of count is
+ *	due, so a running timer costs one compare per instruction.
+ */
+
+/* CPU clocks per count */
+static unsigned int z8_t0_ps(struct z8 *z8)
+{
+	unsigned int ps = z8->reg[R_PRE0] >> 2;
+	if (ps == 0)
+		ps = 64;
+	return ps;
+}
+
+/* T1 runs at CPU clk / 4 if it runs off the clock, so count
+   four times the prescalar */
+static unsigned int z8_t1_ps(struct z8 *z8)
+{
+	unsigned int ps = z8->reg[R_PRE1] & 0xFC;
+	if (ps == 0)
+		ps = 64;
+	return ps;
+}
+
+/* Count a timer down n times. Returns 1 if it reached zero. In single
+   pass mode it stops at zero unless it was reloaded with a count */
+static int z8_timer_count(uint8_t *t, uint64_t n, uint8_t reload,
+	int cont, int autoreload)
+{
+	unsigned int p;
+
+	if (n == 0 || (*t == 0 && !cont))
+		return 0;
+	p = *t ? *t : 256;
+	if (n < p) {
+		*t -= n;
+		return 0;
+	}
+	n -= p;
+	*t = autoreload ? reload : 0;
+	if (*t == 0 && !cont)
+		return 1;
+	p = *t ? *t : 256;
+	*t = (p - n % p) & 0xFF;
+	return 1;
+}
+
+/* CPU clocks until a timer next reaches zero */
+static uint64_t z8_timer_due(uint8_t t, unsigned int ps, uint8_t psc, int cont)
+{
+	uint64_t n = (uint64_t)(t ? t : 256) * ps;
+
+	if (t == 0 && !cont)
+		return UINT64_MAX;
+	/* A smaller prescale can leave psc past the count */
+	if (n <= psc)
+		return 0;
+	return n - psc;
+}
+
+static void z8_timer_next(struct z8 *z8)
+{
+	uint64_t due;
+
+	z8->timer_next = UINT64_MAX;
+	if (z8->reg[R_TMR] & 0x02) {
+		due = z8_timer_due(z8->t0, z8_t0_ps(z8), z8->psc0,
+			z8->reg[R_PRE0] & 1);
+		if (due != UINT64_MAX)
+			z8->timer_next = z8->clock + due;
+	}
+	if (z8->reg[R_TMR] & 0x08) {
+		due = z8_timer_due(z8->t1, z8_t1_ps(z8), z8->psc1,
+			z8->reg[R_PRE1] & 1);
+		if (due != UINT64_MAX && z8->clock + due < z8->timer_next)
+			z8->timer_next = z8->clock + due;
+	}
+}
+
+static void z8_timer_sync(struct z8 *z8)
+{
+	uint64_t elapsed = z8->clock - z8->timer_last;
+	uint64_t n;
+	unsigned int ps;
+
+	/* Counts happen as clocks go by, not when the prescale changes */
+	if (elapsed == 0) {
+		z8_timer_next(z8);
+		return;
+	}
+	z8->timer_last = z8->clock;
+
+	ps = z8_t0_ps(z8);
+	n = z8->psc0 + elapsed;
+	z8->psc0 = n % ps;
+	/* Don't raise the IRQ if the serial port is enabled */
+	/* TODO: chaining */
+	if ((z8->reg[R_TMR] & 0x02) &&
+	    z8_timer_count(&z8->t0, n / ps, z8->reg[R_T0],
+		z8->reg[R_PRE0] & 1, z8->reg[R_TMR] & 0x01) &&
+	    !(z8->reg[R_P3M] & 0x40))
+		z8_raise_irq(z8, 4);
+
+	ps = z8_t1_ps(z8);
+	n = z8->psc1 + elapsed;
+	z8->psc1 = n % ps;
+	if ((z8->reg[R_TMR] & 0x08) &&
+	    z8_timer_count(&z8->t1, n / ps, z8->reg[R_T1],
+		z8->reg[R_PRE1] & 1, z8->reg[R_TMR] & 0x04))
+		z8_raise_irq(z8, 5);
+
+	z8_timer_next(z8);
+}
+
+/* Registers that are not plain RAM go through the slow paths */
+static void z8_regio_init(struct z8 *z8)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++) {
+		z8->regio[i] = 0;
+		if (i > z8->regmax && i < R_SIO)
+			z8->regio[i] = RIO_READ | RIO_WRITE;
+	}
+	z8->regio[2] = RIO_READ | RIO_WRITE;
+	z8->regio[3] = RIO_READ | RIO_WRITE;
+	z8->regio[R_PRE0] |= RIO_READ;
+	z8->regio[R_PRE1] |= RIO_READ;
+	z8->regio[R_P01M] |= RIO_READ;
+	z8->regio[R_P2M] |= RIO_READ;
+	z8->regio[R_P3M] |= RIO_READ;
+	z8->regio[R_IPR] |= RIO_READ;
+	z8->regio[R_T0] |= RIO_READ;
+	z8->regio[R_T1] |= RIO_READ;
+	z8->regio[R_SIO] |= RIO_READ | RIO_WRITE;
+	z8->regio[R_IRR] |= RIO_WRITE;
+	z8->regio[R_TMR] |= RIO_WRITE;
+	z8->regio[R_PRE0] |= RIO_WRITE;
+	z8->regio[R_PRE1] |= RIO_WRITE;
+	z8->regio[R_T0] |= RIO_WRITE;
+	z8->regio[R_T1] |= RIO_WRITE;
+}
+
+static uint8_t getreg_io(struct z8 *z8, uint8_t reg)
 {
 	if (reg > z8->regmax && reg < R_SIO) {
 		fprintf(stderr, "[Read non existent register %d (max %d) ]\n", reg, z8->regmax);
@@ -390,8 +538,10 @@ static uint8_t getreg_internal(struct z8 *z8, uint8_t reg)
 		fprintf(stderr, "[Read R%d: Invalid.]\n", reg);
 		return 0xFF;
 	case R_T0:
+		z8_timer_sync(z8);
 		return z8->t0;
 	case R_T1:
+		z8_timer_sync(z8);
 		return z8->t1;
 	case R_SIO:
 		z8->reg[R_IRR] &= ~0x08;
@@ -401,6 +551,13 @@ static uint8_t getreg_internal(struct z8 *z8, uint8_t reg)
 	}
 }
 
+static uint8_t getreg_internal(struct z8 *z8, uint8_t reg)
+{
+	if (z8->regio[reg] & RIO_READ)
+		return getreg_io(z8, reg);
+	return z8->reg[reg];
+}
+
 uint8_t makereg(struct z8 *z8, uint8_t reg)
 {
 	return (z8->reg[R_RP] & 0xF0) | (reg & 0x0F);
@@ -413,7 +570,7 @@ static uint8_t getreg(struct z8 *z8, uint8_t reg)
 	return getreg_internal(z8, reg);
 }
 
-static void setreg_internal(struct z8 *z8, uint8_t reg, uint8_t val)
+static void setreg_io(struct z8 *z8, uint8_t reg, uint8_t val)
 {
 	if (reg > z8->regmax && reg < R_SIO) {
 		fprintf(stderr, "[Wrote non existent register %d (max %d) with %d]\n", reg, z8->regmax, val);
@@ -429,6 +586,15 @@ static void setreg_internal(struct z8 *z8, uint8_t reg, uint8_t val)
 		/* IRR is unwritable until an EI !! */
 		if (z8->done_ei == 0)
 			break;
+	case R_TMR:
+	case R_PRE0:
+	case R_PRE1:
+	case R_T0:
+	case R_T1:
+		z8_timer_sync(z8);
+		z8->reg[reg] = val;
+		z8_timer_next(z8);
+		break;
 	case R_SIO:
 		if (z8->reg[R_P3M] & 0x40) {
 			z8_tx(z8, val);
@@ -439,6 +605,14 @@ static void setreg_internal(struct z8 *z8, uint8_t reg, uint8_t val)
 	}
 }
 
+static void setreg_internal(struct z8 *z8, uint8_t reg, uint8_t val)
+{
+	if (z8->regio[reg] & RIO_WRITE)
+		setreg_io(z8, reg, val);
+	else
+		z8->reg[reg] = val;
+}
+
 static void setreg(struct z8 *z8, uint8_t reg, uint8_t val)
 {
 	if ((reg & 0xF0) == 0xE0)
@@ -1238,74 +1412,6 @@ static void z8_execute_one(struct z8 *z8)
 	}
 }
 
-/*
- *	Emulate timers.
- *	TODO: emulate external clocks
- */
-static void z8_clock_t0(struct z8 *z8)
-{
-	/* Stop at zero ? */
-	if (!z8->t0 && !(z8->reg[R_PRE0] & 1))
-		return;
-	/* Not running */
-	if (!(z8->reg[R_TMR] & 0x02))
-		return;
-	z8->t0--;
-	if (z8->t0)
-		return;
-	if (z8->reg[R_TMR] & 0x01)
-		z8->t0 = z8->reg[R_T0];
-	/* Don't raise the IRQ if the serial port is enabled */
-	if (z8->reg[R_P3M] & 0x40)
-		return;
-	/* TODO: chaining */
-	z8_raise_irq(z8, 4);
-}
-
-static void z8_clock_t1(struct z8 *z8)
-{
-	/* Stop at zero ? */
-	if (!z8->t1 && !(z8->reg[R_PRE1] & 1))
-		return;
-	/* Not running */
-	if (!(z8->reg[R_TMR] & 0x08))
-		return;
-	z8->t1--;
-	if (z8->t1)
-		return;
-	if (z8->reg[R_TMR] & 0x04)
-		z8->t1 = z8->reg[R_T1];
-	z8_raise_irq(z8, 5);
-}
-
-void z8_clocks(struct z8 *z8, int cycles)
-{
-	int n = cycles;
-	/* Emulate the clock pre-scalers */
-	int ps = z8->reg[R_PRE0] >> 2;
-	if (ps == 0)
-		ps = 64;
-	while(z8->psc0 + n >= ps) {
-		z8_clock_t0(z8);
-		n -= ps;
-	}
-	z8->psc0 += n;
-
-	/* FIXME: emulate counter chaining */
-
-	n = cycles;
-	/* T1 runs at CPU clk / 4 if it runs off the clock, so count
-	   four times the prescalar */
-	ps = z8->reg[R_PRE1] & 0xFC;
-	if (ps == 0)
-		ps = 64;
-	while(z8->psc1 + n >= ps) {
-		z8_clock_t1(z8);
-		n -= ps;
-	}
-	z8->psc1 += n;
-}
-
 static uint16_t z8_irqpri(struct z8 *z8)
 {
 	/* TODO: correctly handle priorities */
@@ -1314,7 +1420,7 @@ static uint16_t z8_irqpri(struct z8 *z8)
 		if (z8->reg[R_IRR] & (1 << i))
 			break;
 	}
-	if (z8->trace)
+	if (TRACE_ON(z8->trace))
 		fprintf(stderr, "Interrupt %d: %02X %02X\n", i, z8->reg[R_IMR], z8->reg[R_IRR]);
 
 	i += i;	/* 2 bytes per vector */
@@ -1328,6 +1434,8 @@ static uint16_t z8_irqpri(struct z8 *z8)
 /* Run an instruction */
 void z8_execute(struct z8 *z8)
 {
+	unsigned long start = z8->cycles;
+
 	/* EI state is visible in IMR top bit but it is just a copy
 	   and if changed directly is meaningless */
 	if (z8->ei_state) {
@@ -1338,7 +1446,7 @@ void z8_execute(struct z8 *z8)
 			z8->cycles += 24;
 		}
 	}
-	if (z8->trace) {
+	if (TRACE_ON(z8->trace)) {
 		char buf[32];
 		char fbuf[9];
 		int i;
@@ -1350,7 +1458,9 @@ void z8_execute(struct z8 *z8)
 		fprintf(stderr, "%s : %s\n", fbuf, buf);
 	}
 	z8_execute_one(z8);
-	z8_clocks(z8, z8->cycles);
+	z8->clock += z8->cycles - start;
+	if (z8->clock >= z8->timer_next)
+		z8_timer_sync(z8);
 }
 
 void z8_reset(struct z8 *z8)
@@ -1370,6 +1480,7 @@ struct z8 *z8_create(void)
 	}
 	memset(z8, 0, sizeof(*z8));
 	z8->regmax = 240;
+	z8_regio_init(z8);
 	z8_reset(z8);
 	return z8;
 }
@@ -4,11 +4,15 @@ struct z8
     uint8_t reg[256];
     uint16_t pc;
     uint8_t regmax;	/* Highest non special register present */
+    uint8_t regio[256];	/* RIO_ flags for registers that are not RAM */
     /* Internal emulation state */
     uint8_t arg0, arg1, dreg; uint8_t opl;
     /* Counter states */
     uint8_t psc0, psc1;	/* Prescalers */
     uint8_t t0, t1;	/* Timers */
+    uint64_t clock;	/* CPU clocks since reset */
+    uint64_t timer_last;	/* Clock the timers were last brought up to */
+    uint64_t timer_next;	/* Clock of the next end of count */
     /* Instruction timing */
     unsigned long cycles;
     int done_ei;	/* Has done an EI (weirdness with IRR register) */
@@ -17,6 +21,9 @@ struct z8
 };
 
 
+#define RIO_READ	0x01
+#define RIO_WRITE	0x02
+
 #define R_SIO		240
 #define R_TMR		241
 #define R_T1		242
@@ -1,5 +1,9 @@
 /*
  *	Z80 co-processor card model - only one for now
+ *
+ *	Each card runs on its own host thread through qsync. The main CPU
+ *	waits for it to catch up before touching the latches or the CPU, so
+ *	the card sees exactly the same timing as if it was run in line.
  */
 
 #include <stdio.h>
@@ -14,6 +18,9 @@
 #include <errno.h>
 #include "libz80/z80.h"
 #include "z80copro.h"
+#include "qsync.h"
+#include "ramalloc.h"
+#include "trace.h"
 
 /*
  *	Coprocessor internal memory and I/O model
@@ -22,8 +29,13 @@
 #define TRACE_IO	1
 #define TRACE_MEM	2
 
+#define COPRO_QUANTUM	100	/* Slices handed over at a time */
+#define COPRO_BACKLOG	400	/* Most slices a card may fall behind */
+
 static struct z80copro *copro[MAX_COPRO];
 static int copro_next;
+static int copro_cards;
+static uint8_t *copro_eprom;
 
 static struct z80copro *get_copro(int n)
 {
@@ -37,35 +49,63 @@ static struct z80copro *get_copro(int n)
 static uint8_t sec_ior(int unit, uint16_t addr)
 {
 	struct z80copro *c = get_copro(unit);
-	if (c->trace & TRACE_IO)
+	if (TRACE_ON(c->trace & TRACE_IO))
 		fprintf(stderr,"C[%X] copro reads %02X\n", unit, (unsigned int)(c->masterbits & 0xFF));
 	return c->masterbits & 0xFF;
 }
 
+/*
+ *	Rebuild the page tables after the latches change. A bank is only
+ *	allocated once something selects it, and the EPROM pages have no
+ *	write pointer so writes reach sec_memw and get reported.
+ */
+static void copro_map(struct z80copro *c)
+{
+	unsigned int i;
+	uint8_t *ram;
+
+	if (c->bank[c->rambank] == NULL)
+		c->bank[c->rambank] = ram_alloc(65536);
+	ram = c->bank[c->rambank];
+	for (i = 0; i < 16; i++) {
+		if (i < 8 && (c->latches & ROMEN) == 0) {
+			c->rpage[i] = copro_eprom + (i << 12);
+			c->wpage[i] = NULL;
+		} else
+			c->rpage[i] = c->wpage[i] = ram + (i << 12);
+	}
+	/* Memory tracing has to see every access */
+	if (TRACE_ON(c->trace & TRACE_MEM))
+		c->cpu.memPageRead = c->cpu.memPageWrite = NULL;
+	else {
+		c->cpu.memPageRead = c->rpage;
+		c->cpu.memPageWrite = c->wpage;
+	}
+}
+
 static void sec_iow(int unit, uint16_t addr, uint8_t data)
 {
 	struct z80copro *c = get_copro(unit);
 	c->latches = (addr & 0xFF00) | data;
 	c->rambank = (c->latches >> 11) & 0x07;
-	if (c->trace & TRACE_IO)
+	copro_map(c);
+	if (TRACE_ON(c->trace & TRACE_IO))
 		fprintf(stderr,"C[%X] latches to %04X\n", unit, (unsigned int)(c->latches));
 }
 
 static uint8_t *mdecode(struct z80copro *c, uint16_t addr, uint8_t wr)
 {
-	if (addr < 0x8000 && (c->latches & ROMEN) == 0) {
-		if (wr)
-			return NULL;
-		return &c->eprom[addr];
-	}
-	return &c->ram[c->rambank][addr];
+	uint8_t *p = wr ? c->wpage[addr >> 12] : c->rpage[addr >> 12];
+	if (p == NULL)
+		return NULL;
+	return p + (addr & 0x0FFF);
 }
 
 static uint8_t sec_memr(int unit, uint16_t addr)
 {
 	struct z80copro *c = get_copro(unit);
 	uint8_t *p = mdecode(c, addr, 0);
-	if (c->trace & TRACE_MEM)
+	if (TRACE_ON(c->trace & TRACE_MEM))
 		fprintf(stderr, "R[%X] %04X = %02X\n", unit, addr, *p);
 	return *p;
 }
@@ -79,17 +119,36 @@ static void sec_memw(int unit, uint16_t addr, uint8_t val)
 			addr);
 		return;
 	}
-	if (c->trace & TRACE_MEM)
+	if (TRACE_ON(c->trace & TRACE_MEM))
 		fprintf(stderr, "W[%X] %04X <- %02X\n", unit, addr, val);
 	*p = val;
 }
 
+/*
+ *	Run one slice of the co-processor.
+ */
+static void copro_slice(void *priv)
+{
+	struct z80copro *c = priv;
+
+	/* CPU is held in reset */
+	if (!(c->masterbits & CORESET))
+		return;
+	if (c->irq_pending)
+		Z80INT(&c->cpu, 0xFF);	/* Vector really not defined */
+	/* FIXME: edge triggered ? so should catch on latch writes only */
+	if (c->nmi_pending)
+		Z80NMI(&c->cpu);
+	Z80ExecuteTStates(&c->cpu, c->tstates);
+}
+
 /*
  *	Reset the device, as on power up. Unlike a pure CPU reset this
  *	also clears all the latches
  */
 void z80copro_reset(struct z80copro *c)
 {
+	qsync_sync(c->sync);
 	Z80RESET(&c->cpu);
 	c->cpu.ioRead = sec_ior;
 	c->cpu.ioWrite = sec_iow;
@@ -103,30 +162,24 @@ void z80copro_reset(struct z80copro *c)
 	c->rambank = 0;
 	c->irq_pending = 1;
 	c->nmi_pending = 1;
+	copro_map(c);
 }
 
 /*
- *	Return the EPROM image base
+ *	Return the EPROM image base. All the cards run the same COPRO_EPROM
+ *	bytes so it only needs loading once.
  */
 uint8_t *z80copro_eprom(struct z80copro *c)
 {
-	return c->eprom;
+	return copro_eprom;
 }
 
 /*
- *	Briefly run the co-processor.
+ *	Briefly run the co-processor. The slice is queued for its thread.
  */
 void z80copro_run(struct z80copro *c)
 {
-	/* CPU is held in reset */
-	if (!(c->masterbits & CORESET))
-		return;
-	if (c->irq_pending)
-		Z80INT(&c->cpu, 0xFF);	/* Vector really not defined */
-	/* FIXME: edge triggered ? so should catch on latch writes only */
-	if (c->nmi_pending)
-		Z80NMI(&c->cpu);
-	Z80ExecuteTStates(&c->cpu, c->tstates);
+	qsync_tick(c->sync);
 }
 
 /*
@@ -135,24 +188,27 @@ void z80copro_run(struct z80copro *c)
  */
 void z80copro_iowrite(struct z80copro *c, uint16_t addr, uint8_t bits)
 {
+	qsync_sync(c->sync);
 	c->masterbits = (addr & 0xFF00) | bits;
 	if (!(c->masterbits & CORESET))
 		Z80RESET(&c->cpu);
 	c->nmi_pending = (c->masterbits & CONMI) ? 0 : 1;
 	c->irq_pending = (c->masterbits & COIRQ) ? 0 : 1;
-	if (c->trace & TRACE_IO)
+	if (TRACE_ON(c->trace & TRACE_IO))
 		fprintf(stderr,"C[%X] host writes %04X\n", c->unit, (unsigned int)c->masterbits);
 }
 
 uint8_t z80copro_ioread(struct z80copro *c, uint16_t addr)
 {
-	if (c->trace & TRACE_IO)
+	qsync_sync(c->sync);
+	if (TRACE_ON(c->trace & TRACE_IO))
 		fprintf(stderr,"C[%X] host reads %02X\n", c->unit, (unsigned int)(c->latches & 0xFF));
 	return c->latches & 0xFF;
 }
 
 int z80copro_intraised(struct z80copro *c)
 {
+	qsync_sync(c->sync);
 	return (c->latches & MAINT) ? 0 : 1;
 }
 
@@ -173,7 +229,10 @@ struct z80copro *z80copro_create(void)
 		exit(1);
 	}
 	memset(c, 0, sizeof(struct z80copro));
+	if (copro_cards++ == 0)
+		copro_eprom = ram_alloc(COPRO_EPROM);
 	c->unit = copro_next++;
+	c->sync = qsync_create(copro_slice, c, COPRO_QUANTUM, COPRO_BACKLOG);
 	copro[c->unit] = c;
 	z80copro_reset(c);
 	return c;
@@ -181,12 +240,24 @@ struct z80copro *z80copro_create(void)
 
 void z80copro_free(struct z80copro *c)
 {
+	unsigned int i;
+
+	qsync_free(c->sync);
 	/* FIXME: we don't reuse slots */
 	copro[c->unit] = NULL;
+	for (i = 0; i < 8; i++)
+		if (c->bank[i])
+			ram_free(c->bank[i], 65536);
+	if (--copro_cards == 0) {
+		ram_free(copro_eprom, COPRO_EPROM);
+		copro_eprom = NULL;
+	}
 	free(c);
 }
 
 void z80copro_trace(struct z80copro *c, int onoff)
 {
+	qsync_sync(c->sync);
 	c->trace = onoff;
+	copro_map(c);
 }
@@ -1,8 +1,12 @@
+struct qsync;
+
 struct z80copro {
     Z80Context cpu;
+    struct qsync *sync;	/* Runs the card on its own thread */
     int unit;
-    uint8_t eprom[16384];
-    uint8_t ram[8][65536];
+    uint8_t *bank[8];		/* Allocated when first selected */
+    uint8_t *rpage[16];		/* Host pointer per 4K page, or NULL */
+    uint8_t *wpage[16];
     uint16_t latches;
 #define MAINT	0x8000
 #define ROMEN	0x4000
@@ -18,6 +22,7 @@ struct z80copro {
 };
 
 #define MAX_COPRO	4
+#define COPRO_EPROM	32768	/* One image shared by every card */
 
 extern void z80copro_reset(struct z80copro *c);
 extern uint8_t *z80copro_eprom(struct z80copro *c);
@@ -5,16 +5,18 @@
  *	LD R, RL (ix+d) type CB ops
  */
 
-#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 
 #include "z80dis.h" 
  
 static uint8_t prefix;
 static const char *hlname;
 static uint16_t pc;
+static const uint8_t *code;
+static uint16_t codebase;	/* Address of code[0] */
 
 /*
  *	Glue to caller. Caller provides a single helper that returns
@@ -22,24 +24,105 @@ static uint16_t pc;
  *	it needs to avoid the side effect)
  */
 
-static int8_t offs8(void)
+static uint8_t next_byte(void)
 {
+    if (code)
+        return code[(uint16_t)(pc++ - codebase)];
     return z80dis_byte(pc++);
 }
 
+static int8_t offs8(void)
+{
+    return next_byte();
+}
+
 static uint8_t imm8(void)
 {
-    return z80dis_byte(pc++);
+    return next_byte();
 }
 
 static uint16_t imm16(void)
 {
-    uint16_t r = z80dis_byte(pc++);
-    r |= z80dis_byte(pc++) << 8;
+    uint16_t r = next_byte();
+    r |= next_byte() << 8;
     return r;
 }
 
 
+/*
+ *	Output without stdio. Only the conversions the tables use: %s, %c,
+ *	%d and %X with an optional zero padded width.
+ */
+
+static char *put_hex(char *p, unsigned int v, unsigned int width)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned int n = 1;
+
+    while (n < 8 && (v >> (4 * n)))
+        n++;
+    if (width < n)
+        width = n;
+    for (n = width; n--; v >>= 4)
+        p[n] = hex[v & 15];
+    return p + width;
+}
+
+static char *put_dec(char *p, int v)
+{
+    char tmp[12];
+    unsigned int n = 0;
+    unsigned int u = v < 0 ? -(unsigned int)v : (unsigned int)v;
+
+    if (v < 0)
+        *p++ = '-';
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+static void put(char *buf, const char *fmt, ...)
+{
+    va_list ap;
+    const char *s;
+    unsigned int width;
+
+    va_start(ap, fmt);
+    while (*fmt) {
+        if (*fmt != '%') {
+            *buf++ = *fmt++;
+            continue;
+        }
+        fmt++;
+        width = 0;
+        if (*fmt == '0')
+            fmt++;
+        while (*fmt >= '0' && *fmt <= '9')
+            width = width * 10 + *fmt++ - '0';
+        switch (*fmt++) {
+        case 's':
+            for (s = va_arg(ap, const char *); *s; s++)
+                *buf++ = *s;
+            break;
+        case 'c':
+            *buf++ = va_arg(ap, int);
+            break;
+        case 'd':
+            buf = put_dec(buf, va_arg(ap, int));
+            break;
+        case 'X':
+            buf = put_hex(buf, va_arg(ap, unsigned int), width);
+            break;
+        }
+    }
+    *buf = 0;
+    va_end(ap);
+}
+
 static const char *rname[8] = {
     "B", "C", "D", "E", "H", "L", "M", "A"
 };
@@ -100,13 +183,13 @@ static const char *reg8_str(uint8_t r, uint8_t ro, int8_t offs)
     if (r == 6) {
         if (prefix) {
             if (offs < 0)
-                snprintf(tmpbuf, 16, "(%s%d)", hlname, offs);
+                put(tmpbuf, "(%s%d)", hlname, offs);
             else if (offs > 1)
-                snprintf(tmpbuf, 16, "(%s+%d)", hlname, offs);
+                put(tmpbuf, "(%s+%d)", hlname, offs);
             else
-                sprintf(tmpbuf, "(%s)", hlname);
+                put(tmpbuf, "(%s)", hlname);
         } else
-            sprintf(tmpbuf, "(%s)", hlname);
+            put(tmpbuf, "(%s)", hlname);
         return tmpbuf;
     }
     if ((r == 4  || r == 5) && ro != 6) {
@@ -189,16 +272,16 @@ restart:
         int8_t offs;
         /* IX and IY illegals are weird so bother to decode them so we
            don't get in a mess. Don't bother decoding them specially though */
-        if (prefix && y == 6)
+        if (prefix)
             offs = offs8();
         opcode = imm8();
         y = (opcode >> 3) & 7;
         z = opcode & 7;
         if (opcode < 0x40) {
-            sprintf(buf, "%s %s", rotshift[y], reg8_offs(z, offs));
+            put(buf, "%s %s", rotshift[y], reg8_offs(z, offs));
             return;
         }
-        sprintf(buf, "%s %d, %s", bitop[opcode >> 6], y, reg8_offs(z, offs));
+        put(buf, "%s %d, %s", bitop[opcode >> 6], y, reg8_offs(z, offs));
         return;
     }
     case 0xED:
@@ -213,63 +296,63 @@ restart:
         switch(opcode & 0xC0) {
         case 0:
         case 0xC0:
-            sprintf(buf, "NONI NOP");
+            put(buf, "NONI NOP");
             return;
         case 0x40:	/* Mixed */
             switch(z) {
             case 0:
                 if (y == 6)
-                    strcpy(buf, "IN (C)");
+                    put(buf, "IN (C)");
                 else
-                    sprintf(buf, "IN %s, (C)", reg8(y));
+                    put(buf, "IN %s, (C)", reg8(y));
                 return;
             case 1:
                 if (y == 6)
-                    strcpy(buf, "OUT (C),255/0");
+                    put(buf, "OUT (C),255/0");
                 else
-                    sprintf(buf, "OUT (C), %s", reg8(y));
+                    put(buf, "OUT (C), %s", reg8(y));
                 return;
             case 2:
-                sprintf(buf, "%sC HL, %s", q?"AD":"SB", rpair(p));
+                put(buf, "%sC HL, %s", q?"AD":"SB", rpair(p));
                 return;
             case 3:
                 if (q == 0)
-                    sprintf(buf, "LD (0x%04X), %s", imm16(), rpair(p));
+                    put(buf, "LD (0x%04X), %s", imm16(), rpair(p));
                 else
-                    sprintf(buf, "LD %s, (0x%04X)", rpair(p), imm16());
+                    put(buf, "LD %s, (0x%04X)", rpair(p), imm16());
                 return;
             case 4:
-                strcpy(buf, "NEG");
+                put(buf, "NEG");
                 return;
             case 5:
                 if (y == 1)
-                    strcpy(buf, "RETI");
+                    put(buf, "RETI");
                 else
-                    strcpy(buf, "RETN");
+                    put(buf, "RETN");
                 return;
             case 6:
                 /* The ilegal IM 0/1 we don't care about */
                 y &= 3;
                 if (y)
                     y--;
-                sprintf(buf, "IM %d", y);
+                put(buf, "IM %d", y);
                 return;
             case 7:
-                strcpy(buf, opgrouped17[y]);
+                put(buf, opgrouped17[y]);
                 return;
             }
             return;
         case 0x80:	/* Block ops */
             if (z < 4) {
-                sprintf(buf, "%s%c%s",
+                put(buf, "%s%c%s",
                     opgrouped2[z], "ID"[y & 1], y & 2 ? "R": "");
             } else
-                strcpy(buf, "NONI NOP");
+                put(buf, "NONI NOP");
             return;                
         }
         break;
     case 0x76:
-        sprintf(buf, "HALT");
+        put(buf, "HALT");
         return;
     }
     switch(opcode & 0xC0) {
@@ -277,95 +360,137 @@ restart:
         switch(z) {
         case 0x00:
             if (y > 1)
-                sprintf(buf, opgroup00[y], relbase + offs8());
+                put(buf, opgroup00[y], (uint16_t)(relbase + offs8()));
             else
-                strcpy(buf, opgroup00[y]);
+                put(buf, opgroup00[y]);
             return;
         case 0x01:
             if (q == 0)
-                sprintf(buf, "LD %s,0x%04X", rpair(p), imm16());
+                put(buf, "LD %s,0x%04X", rpair(p), imm16());
             else
-                sprintf(buf, "ADD %s,%s", hlname, rpair(p));
+                put(buf, "ADD %s,%s", hlname, rpair(p));
             return;
         case 0x02:
             /* Ugly .. needs work */
             if (p > 1) {
                 if (q == 0)
-                    sprintf(buf, opgroup02[y], imm16(), hlname);
+                    put(buf, opgroup02[y], imm16(), hlname);
                 else if (p != 3)
-                    sprintf(buf, opgroup02[y], hlname, imm16());
+                    put(buf, opgroup02[y], hlname, imm16());
                 else
-                    sprintf(buf, opgroup02[y], imm16());
+                    put(buf, opgroup02[y], imm16());
             } else
-                strcpy(buf, opgroup02[y]);
+                put(buf, opgroup02[y]);
             return;
         case 0x03:
             if (q == 0)
-                sprintf(buf, "INC %s", rpair(p));
+                put(buf, "INC %s", rpair(p));
             else
-                sprintf(buf, "DEC %s", rpair(p));
+                put(buf, "DEC %s", rpair(p));
             return;
         case 0x04:
-            sprintf(buf, "INC %s", reg8(y));
+            put(buf, "INC %s", reg8(y));
             return;
         case 0x05:
-            sprintf(buf, "DEC %s", reg8(y));
+            put(buf, "DEC %s", reg8(y));
             return;
         case 0x06:
             /* Force evaluation order so we get
                 LD (IX+d),n correct */
             tp = reg8(y);
-            sprintf(buf, "LD %s,0x%02X", tp, imm8());
+            put(buf, "LD %s,0x%02X", tp, imm8());
             return;
         case 0x07:
-            strcpy(buf, opgroup07[y]);
+            put(buf, opgroup07[y]);
             return;
         }
         break;
     case 0x40:
-        sprintf(buf, "LD %s,%s", reg8pair(y,z), reg8pair(z,y));
+        put(buf, "LD %s,%s", reg8pair(y,z), reg8pair(z,y));
         return;
     case 0x80:
-        sprintf(buf, "%s A,%s", logic8[y], reg8(z));
+        put(buf, "%s A,%s", logic8[y], reg8(z));
         return;
     case 0xC0:
         switch(z) {
         case 0x00:
-            sprintf(buf, "RET %s", ccode[y]);
+            put(buf, "RET %s", ccode[y]);
             return;
         case 0x01:
             if (q == 0)
-                sprintf(buf, "POP %s", rpairstack(p));
+                put(buf, "POP %s", rpairstack(p));
             else
-                sprintf(buf, opgroup31[p], hlname);
+                put(buf, opgroup31[p], hlname);
             return;
         case 0x02:
-            sprintf(buf, "JP %s,0x%04X", ccode[y], imm16());
+            put(buf, "JP %s,0x%04X", ccode[y], imm16());
             return;
         case 0x03:	/* This one is a right mix .. */
             if (y == 0)
-                sprintf(buf, "JP 0x%04X", imm16());
+                put(buf, "JP 0x%04X", imm16());
             else if (y < 4)
-                sprintf(buf, opgroup33[y], imm8());
+                put(buf, opgroup33[y], imm8());
             else
-                sprintf(buf, opgroup33[y], hlname);
+                put(buf, opgroup33[y], hlname);
             return;
         case 0x04:
-            sprintf(buf, "CALL %s,%04X", ccode[y], imm16());
+            put(buf, "CALL %s,%04X", ccode[y], imm16());
             return;
         case 0x05:
             if (q == 0)
-                sprintf(buf, "PUSH %s", rpairstack(p));
+                put(buf, "PUSH %s", rpairstack(p));
             else	/* Other 3 forms are prefixes grabbed earlier */
-                sprintf(buf, "CALL 0x%04X", imm16());
+                put(buf, "CALL 0x%04X", imm16());
             return;
         case 0x06:
-            sprintf(buf, "%s A,0x%02X", logic8[y], imm8());
+            put(buf, "%s A,0x%02X", logic8[y], imm8());
             return;
         case 0x07:
-            sprintf(buf, "RST %02X", y);
+            put(buf, "RST %02X", y);
             return;
         }
         break;
     }
 }
+
+/*
+ *	Disassemble from a buffer rather than the machine. The buffer
+ *	must hold the longest instruction (4 bytes). Returns the length.
+ */
+int z80_disasm_code(char *buf, const uint8_t *bytes)
+{
+    return z80_disasm_code_at(buf, bytes, 0);
+}
+
+/* As above for bytes that were at addr, so branch targets come out right */
+int z80_disasm_code_at(char *buf, const uint8_t *bytes, uint16_t addr)
+{
+    code = bytes;
+    codebase = addr;
+    z80_disasm(buf, addr);
+    code = NULL;
+    return (uint16_t)(pc - addr);
+}
+
+/*
+ *	Disassemble count captured instructions at once, such as a trace
+ *	ring. The bytes of each (and its address if pcs is not NULL) are
+ *	stride bytes on from the last. Each text goes in its own
+ *	Z80DIS_TEXT slot of out and the lengths in len if that is wanted.
+ */
+void z80_disasm_batch(char *out, uint8_t *len, const uint8_t *ops,
+                      const uint16_t *pcs, size_t stride, unsigned int count)
+{
+    const uint8_t *pc = (const uint8_t *)pcs;
+    int n;
+
+    while (count--) {
+        n = z80_disasm_code_at(out, ops, pc ? *(const uint16_t *)pc : 0);
+        if (len)
+            *len++ = n;
+        out += Z80DIS_TEXT;
+        ops += stride;
+        if (pc)
+            pc += stride;
+    }
+}
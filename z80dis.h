@@ -1,6 +1,13 @@
 
 /* Entry point */
 extern void z80_disasm(char *buf, uint16_t pc);
+extern int z80_disasm_code(char *buf, const uint8_t *bytes);
+extern int z80_disasm_code_at(char *buf, const uint8_t *bytes, uint16_t addr);
+extern void z80_disasm_batch(char *out, uint8_t *len, const uint8_t *ops,
+                             const uint16_t *pcs, size_t stride, unsigned int count);
+
+/* Room for the longest text z80_disasm writes */
+#define Z80DIS_TEXT	32
 
 /* Caller provided */
 extern uint8_t z80dis_byte(uint16_t addr);
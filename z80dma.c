@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "system.h"
 #include "z80dma.h"
@@ -21,6 +22,9 @@ struct z80dma {
 	uint8_t enabled;
 	uint8_t trace;
 	uint8_t idle;
+	uint8_t **rpage;	/* Host memory map, see z80dma_set_pages */
+	uint8_t **wpage;
+	unsigned int shift;
 };
 
 #define	RR0		0
@@ -99,7 +103,9 @@ static void z80dma_wr(struct z80dma *dma, uint8_t val)
 
 void z80dma_reset(struct z80dma *dma)
 {
-	memset(dma, 0, sizeof(struct z80dma));
+	/* The memory map belongs to the board not the chip */
+	memset(dma, 0, offsetof(struct z80dma, rpage));
+	dma->reg[RR0] = 0x30;
 	/* TODO */
 }
 
@@ -117,7 +123,7 @@ static void z80dma_command(struct z80dma *dma)
 		dma->reg[WR_TIMING_B] = 2;
 		break;
 	case 0xCF:
-		dma->reg[RR0] = 0;
+		dma->reg[RR0] = 0x30;	/* No match, not at the end */
 		dma->reg[RR1] = 0;
 		dma->reg[RR2] = 0;
 		dma->reg[RR3] = dma->reg[WR_A_L];
@@ -146,11 +152,12 @@ static void z80dma_command(struct z80dma *dma)
 		dma->enabled = 2;		/* Enable after reti */
 		break;
 	case 0xBF:
-		dma->rregmask = RR0;
+		dma->rrcount = 0;
+		dma->rregmask = 1 << RR0;
 		break;
 	case 0x8B:
-		/* Reinit status: TODO */
-		/* DMA must be disabled first */
+		/* Reinit status. DMA must be disabled first */
+		dma->reg[RR0] |= 0x30;
 		break;
 	case 0xBB:
 		dma->wregmask = R_RRMASK;
@@ -245,11 +252,72 @@ void z80dma_write(struct z80dma *dma, uint8_t val)
 	}
 }
 
+/* Weird rules about register B */
+static uint16_t z80dma_addr_b(struct z80dma *dma)
+{
+	if (dma->reg[WR2] & 0x20)
+		return dma->reg[WR_B_L] | (dma->reg[WR_B_H] << 8);
+	if ((dma->reg[RR1] | dma->reg[RR2]) == 0) {
+		dma->reg[RR5] = dma->reg[WR_B_L];
+		dma->reg[RR6] = dma->reg[WR_B_H];
+	}
+	return dma->reg[RR5] | (dma->reg[RR6] << 8);
+}
+
+/* Address step for a port from WR1 or WR2 */
+static int z80dma_step(uint8_t wr)
+{
+	if (wr & 0x20)
+		return 0;
+	return (wr & 0x10) ? 1 : -1;
+}
+
+static int z80dma_match(struct z80dma *dma, uint8_t byte)
+{
+	return ((byte ^ dma->reg[WR_MATCH]) & ~dma->reg[WR_MASK]) == 0;
+}
+
+/* Move the counter and addresses on by n bytes and deal with the end
+   of the block or a match */
+static void z80dma_advance(struct z80dma *dma, unsigned int n, int matched)
+{
+	uint16_t v;
+
+	v = (dma->reg[RR1] | (dma->reg[RR2] << 8)) + n;
+	dma->reg[RR1] = v;
+	dma->reg[RR2] = v >> 8;
+	v = (dma->reg[RR3] | (dma->reg[RR4] << 8)) +
+		z80dma_step(dma->reg[WR1]) * (int)n;
+	dma->reg[RR3] = v;
+	dma->reg[RR4] = v >> 8;
+	if (!(dma->reg[WR2] & 0x20)) {
+		v = (dma->reg[RR5] | (dma->reg[RR6] << 8)) +
+			z80dma_step(dma->reg[WR2]) * (int)n;
+		dma->reg[RR5] = v;
+		dma->reg[RR6] = v >> 8;
+	}
+	dma->reg[RR0] |= 1;
+	if (matched) {
+		dma->reg[RR0] &= ~0x10;
+		if (dma->reg[WR3] & 0x04)
+			dma->enabled = 0;
+	}
+	if (dma->reg[RR1] == dma->reg[WR_LEN_L] &&
+	    dma->reg[RR2] == dma->reg[WR_LEN_H]) {
+		/* Completed */
+		dma->enabled = 0;
+		dma->forcerdy = 0;
+		dma->reg[RR0] &= ~0x20;
+		/* TODO: interrupt emulation */
+	}
+}
+
 static uint8_t z80_dma_one_cycle(struct z80dma *dma)
 {
 	uint16_t addr_a, addr_b;
 	int port_a, port_b;
 	uint8_t byte;
+	uint8_t op = dma->reg[WR0] & 3;
 
 	if (!dma->enabled)
 		return 0;
@@ -258,28 +326,19 @@ static uint8_t z80_dma_one_cycle(struct z80dma *dma)
 
 	addr_a = dma->reg[RR3] | (dma->reg[RR4] << 8);
 	port_a = dma->reg[WR1] & 0x08;
-
-	/* Weird rules about register B */
-	if (dma->reg[WR2] & 0x20) 
-		addr_b = dma->reg[WR_B_L] | (dma->reg[WR_B_H] << 8);
-	else {
-		if ((dma->reg[RR1] | dma->reg[RR2]) == 0) {
-			dma->reg[RR5] = dma->reg[WR_B_L];
-			dma->reg[RR6] = dma->reg[WR_B_H];
-		}
-		addr_b = dma->reg[RR5] | (dma->reg[RR6] << 8);
-	}
+	addr_b = z80dma_addr_b(dma);
 	port_b = dma->reg[WR2] & 0x08;
 
-	/* FIXME: add match/mask to this loop */
-
+	/* Op 2 is search only, 1 transfer and 3 both */
 	if (dma->reg[WR0] & 4) {
 		/* A->B */
 		if (port_a)
 			byte = io_read(0, addr_a);
 		else
 			byte = mem_read(0, addr_a);
-		if (port_b)
+		if (op == 2)
+			;
+		else if (port_b)
 			io_write(0, addr_b, byte);
 		else
 			mem_write(0, addr_b, byte);
@@ -288,47 +347,156 @@ static uint8_t z80_dma_one_cycle(struct z80dma *dma)
 			byte = io_read(0, addr_b);
 		else
 			byte = mem_read(0, addr_b);
-		if (port_a)
+		if (op == 2)
+			;
+		else if (port_a)
 			io_write(0, addr_a, byte);
 		else
 			mem_write(0, addr_a, byte);
 	}
+	z80dma_advance(dma, 1, (op & 2) && z80dma_match(dma, byte));
+	return 2;	/* 2 tstates per simple bus hog */
+}
 
-	/* Adjust addresses and counters */
-	dma->reg[RR1]++;
-	if (dma->reg[RR1] == 0)
-		dma->reg[RR2]++;
-	if (!(dma->reg[WR1] & 0x20)) {
-		if (dma->reg[WR1] & 0x10) {
-			dma->reg[RR3]++;
-			if (dma->reg[RR3] == 0)
-				dma->reg[RR4]++;
-		} else {
-			dma->reg[RR3]--;
-			if (dma->reg[RR3] == 255)
-				dma->reg[RR4]--;
-		}
+/* Find the first byte that matches going in the given direction */
+static unsigned int z80dma_scan(struct z80dma *dma, uint8_t *p, unsigned int n,
+	int step)
+{
+	unsigned int i;
+	uint8_t *m;
+
+	if (step > 0 && dma->reg[WR_MASK] == 0) {
+		m = memchr(p, dma->reg[WR_MATCH], n);
+		return m ? m - p : n;
 	}
-	if (!(dma->reg[WR2] & 0x20)) {
-		if (dma->reg[WR2] & 0x10) {
-			dma->reg[RR5]++;
-			if (dma->reg[RR5] == 0)
-				dma->reg[RR6]++;
-		} else {
-			dma->reg[RR5]--;
-			if (dma->reg[RR5] == 255)
-				dma->reg[RR6]--;
-		}
+	for (i = 0; i < n; i++) {
+		if (z80dma_match(dma, *p))
+			return i;
+		p += step;
 	}
-	if (dma->reg[RR1] == dma->reg[WR_LEN_L] &&
-	    dma->reg[RR2] == dma->reg[WR_LEN_H]) {
-		/* Completed */
-		dma->enabled = 0;
-		dma->forcerdy = 0;
-		dma->reg[RR0] |= 1;
-		/* TODO: interrupt emulation */
+	return n;
+}
+
+/*
+ *	Memory to memory in a burst or continuous mode. Rather than one byte
+ *	at a time through mem_read/mem_write, copy or search as much as lies
+ *	within one host page at both ends in one go. Returns the bytes done
+ *	or 0 if this transfer must go the slow way.
+ */
+static unsigned int z80dma_bulk(struct z80dma *dma, unsigned int max)
+{
+	unsigned int psize = 1 << dma->shift;
+	unsigned int pmask = psize - 1;
+	uint8_t op = dma->reg[WR0] & 3;
+	uint16_t src, dst;
+	int sstep, dstep;
+	uint8_t *sp, *dp = NULL;
+	unsigned int n, left, hit, i;
+	uint16_t gap;
+
+	if (dma->rpage == NULL || op == 0 || ((dma->reg[WR1] | dma->reg[WR2]) & 0x08))
+		return 0;
+	left = ((dma->reg[WR_LEN_L] | (dma->reg[WR_LEN_H] << 8)) -
+		(dma->reg[RR1] | (dma->reg[RR2] << 8)) - 1) & 0xFFFF;
+	n = left + 1;
+	if (n > max)
+		n = max;
+
+	if (dma->reg[WR0] & 4) {
+		src = dma->reg[RR3] | (dma->reg[RR4] << 8);
+		dst = z80dma_addr_b(dma);
+		sstep = z80dma_step(dma->reg[WR1]);
+		dstep = z80dma_step(dma->reg[WR2]);
+	} else {
+		src = z80dma_addr_b(dma);
+		dst = dma->reg[RR3] | (dma->reg[RR4] << 8);
+		sstep = z80dma_step(dma->reg[WR2]);
+		dstep = z80dma_step(dma->reg[WR1]);
 	}
-	return 2;	/* 2 tstates per simple bus hog */
+	/* Both ends must move together, or a search just the source */
+	if (sstep == 0 || (op != 2 && dstep != sstep))
+		return 0;
+	sp = dma->rpage[src >> dma->shift];
+	if (sp == NULL)
+		return 0;
+	if (op != 2) {
+		dp = dma->wpage[dst >> dma->shift];
+		if (dp == NULL)
+			return 0;
+	}
+
+	/* Stay inside the pages. Going up the first byte is at the offset,
+	   going down it is the last */
+	if (sstep > 0) {
+		if (n > psize - (src & pmask))
+			n = psize - (src & pmask);
+		if (dp && n > psize - (dst & pmask))
+			n = psize - (dst & pmask);
+		/* A destination just above the source copies bytes it has
+		   already written, as used to fill memory */
+		gap = dst - src;
+	} else {
+		if (n > (src & pmask) + 1U)
+			n = (src & pmask) + 1;
+		if (dp && n > (dst & pmask) + 1U)
+			n = (dst & pmask) + 1;
+		gap = src - dst;
+	}
+	/* Searching has to look at what the copy has written */
+	if (dp && (op & 2) && gap && gap < n)
+		n = gap;
+
+	sp += src & pmask;
+	hit = n;
+	if (op & 2) {
+		hit = z80dma_scan(dma, sp, n, sstep);
+		if (hit < n)
+			n = hit + 1;
+	}
+	if (dp) {
+		dp += dst & pmask;
+		if (gap && gap < n) {
+			for (i = 0; i < n; i++) {
+				*dp = *sp;
+				dp += sstep;
+				sp += sstep;
+			}
+		} else if (sstep > 0)
+			memmove(dp, sp, n);
+		else
+			memmove(dp - n + 1, sp - n + 1, n);
+	}
+	z80dma_advance(dma, n, hit < n);
+	return n;
+}
+
+/* Bus cycle length of a port from its timing byte */
+static unsigned int z80dma_cycle_len(uint8_t timing)
+{
+	return 4 - (timing & 3);
+}
+
+/* Burst and continuous modes keep the bus until the block is done, so
+   the CPU only gets what is left over */
+static int z80_dma_block(struct z80dma *dma, int cycles)
+{
+	unsigned int cost = z80dma_cycle_len(dma->reg[WR_TIMING_A]);
+	unsigned int n;
+
+	if ((dma->reg[WR0] & 3) != 2)
+		cost += z80dma_cycle_len(dma->reg[WR_TIMING_B]);
+	while (dma->enabled && cycles >= (int)cost) {
+		n = z80dma_bulk(dma, cycles / cost);
+		if (n == 0) {
+			z80_dma_one_cycle(dma);
+			n = 1;
+		}
+		cycles -= n * cost;
+	}
+	/* Part of a byte still holds the bus */
+	if (dma->enabled)
+		return 0;
+	return cycles;
 }
 
 static uint8_t z80_dma_calc_idle(struct z80dma *dma)
@@ -362,12 +530,15 @@ static uint8_t z80_dma_do_run(struct z80dma *dma)
 int z80_dma_run(struct z80dma *dma, int cycles)
 {
 	int spare = 0;
+	uint8_t mode = dma->reg[WR4] & 0x60;
 
 	if (!dma->enabled)
 		return cycles;
+	if (mode == 0x20 || mode == 0x40)
+		return z80_dma_block(dma, cycles);
 
-	while(cycles) {
-		int n = z80_dma_do_run(dma);
+	while(cycles > 0) {
+		int n = dma->enabled ? z80_dma_do_run(dma) : 0;
 		if (n == 0) {
 			/* CPU time */
 			spare++;
@@ -378,6 +549,20 @@ int z80_dma_run(struct z80dma *dma, int cycles)
 	return spare;
 }
 
+/* Host pages the memory map resolves to, NULL entries and a NULL table
+   send the transfer through mem_read and mem_write */
+void z80dma_set_pages(struct z80dma *dma, uint8_t **rpage, uint8_t **wpage,
+	unsigned int shift)
+{
+	dma->rpage = rpage;
+	dma->wpage = wpage;
+	dma->shift = shift;
+}
+
+int z80dma_active(struct z80dma *dma)
+{
+	return dma->enabled;
+}
 
 struct z80dma *z80dma_create(void)
 {
@@ -0,0 +1,151 @@
+/*
+ *	Z80 interrupt router
+ *
+ *	With the daisy chain wired only one vectored source is serviced at
+ *	a time: the highest priority pending line is handed to the CPU and
+ *	becomes live, and nothing else on the chain is offered until its
+ *	RETI. Boards without the chain wired take the same sources as a
+ *	plain wired-or and RETI clears them all.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "z80irq.h"
+
+struct z80irq_line {
+    uint8_t (*vector)(void *priv);
+    void (*reti)(void *priv);
+    void *priv;
+};
+
+struct z80irq {
+    uint32_t pending;		/* Lines raised */
+    uint32_t chain;		/* Lines that are vectored chain sources */
+    unsigned int live;		/* Chain line being serviced or 0 */
+    struct z80irq_line line[Z80IRQ_LINES];
+};
+
+struct z80irq *z80irq_create(void)
+{
+    struct z80irq *r = malloc(sizeof(struct z80irq));
+    if (r == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memset(r, 0, sizeof(struct z80irq));
+    return r;
+}
+
+void z80irq_free(struct z80irq *r)
+{
+    free(r);
+}
+
+void z80irq_source(struct z80irq *r, unsigned int line,
+    uint8_t (*vector)(void *priv), void (*reti)(void *priv), void *priv)
+{
+    struct z80irq_line *l = r->line + line;
+
+    if (line == 0 || line >= Z80IRQ_LINES) {
+        fprintf(stderr, "z80irq: bad line %u.\n", line);
+        exit(1);
+    }
+    l->vector = vector;
+    l->reti = reti;
+    l->priv = priv;
+    if (vector)
+        r->chain |= 1U << line;
+    else
+        r->chain &= ~(1U << line);
+}
+
+void z80irq_set(struct z80irq *r, unsigned int line, int on)
+{
+    if (on)
+        r->pending |= 1U << line;
+    else
+        r->pending &= ~(1U << line);
+}
+
+/* Any plain level source asserting /INT */
+int z80irq_level(struct z80irq *r)
+{
+    return (r->pending & ~r->chain) != 0;
+}
+
+/* With the chain wired: if nothing is in service offer the highest
+   priority pending line, which then becomes live */
+int z80irq_next(struct z80irq *r, uint8_t *vector)
+{
+    struct z80irq_line *l;
+    uint32_t m;
+
+    if (r->live)
+        return 0;
+    m = r->pending & r->chain;
+    if (m == 0)
+        return 0;
+    r->live = ffs(m) - 1;
+    l = r->line + r->live;
+    *vector = l->vector(l->priv);
+    return 1;
+}
+
+/* Without the chain: any pending line interrupts, the vector being that
+   of the highest priority one for what it is worth */
+int z80irq_any(struct z80irq *r, uint8_t *vector)
+{
+    struct z80irq_line *l;
+    uint32_t m = r->pending & r->chain;
+
+    if (m == 0) {
+        *vector = 0xFF;
+        return r->pending != 0;
+    }
+    r->live = ffs(m) - 1;
+    l = r->line + r->live;
+    *vector = l->vector(l->priv);
+    return 1;
+}
+
+/* RETI seen: the live source is done */
+void z80irq_reti(struct z80irq *r)
+{
+    struct z80irq_line *l = r->line + r->live;
+
+    if (r->live && l->reti)
+        l->reti(l->priv);
+    r->live = 0;
+}
+
+/* RETI with no chain wired: every source sees it */
+void z80irq_reti_all(struct z80irq *r)
+{
+    unsigned int i;
+
+    for (i = 1; i < Z80IRQ_LINES; i++)
+        if (r->line[i].reti)
+            r->line[i].reti(r->line[i].priv);
+    r->live = 0;
+}
+
+unsigned int z80irq_live(struct z80irq *r)
+{
+    return r->live;
+}
+
+/* For snapshot restore */
+void z80irq_set_live(struct z80irq *r, unsigned int line)
+{
+    r->live = line;
+}
+
+/* A source that was reset while live stops blocking the chain */
+void z80irq_cancel(struct z80irq *r, unsigned int line)
+{
+    if (r->live == line)
+        r->live = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __Z80IRQ_H
+#define __Z80IRQ_H
+
+#include <stdint.h>
+
+/*
+ *	Interrupt routing for Z80 boards. Each source has a line numbered
+ *	1-31, lower numbers nearer the head of the IEI/IEO daisy chain.
+ *	Devices raise and lower their line as their state changes and the
+ *	router keeps the pending set as a mask, so finding who to service
+ *	next is a bit scan instead of asking every device.
+ *
+ *	Lines added without a vector function are plain level sources such
+ *	as an ACIA on /INT that are not part of the chain and only ever give
+ *	0xFF.
+ */
+
+#define Z80IRQ_LINES	32
+
+struct z80irq;
+
+extern struct z80irq *z80irq_create(void);
+extern void z80irq_free(struct z80irq *r);
+extern void z80irq_source(struct z80irq *r, unsigned int line,
+    uint8_t (*vector)(void *priv), void (*reti)(void *priv), void *priv);
+extern void z80irq_set(struct z80irq *r, unsigned int line, int on);
+extern int z80irq_level(struct z80irq *r);
+extern int z80irq_next(struct z80irq *r, uint8_t *vector);
+extern int z80irq_any(struct z80irq *r, uint8_t *vector);
+extern void z80irq_reti(struct z80irq *r);
+extern void z80irq_reti_all(struct z80irq *r);
+extern unsigned int z80irq_live(struct z80irq *r);
+extern void z80irq_set_live(struct z80irq *r, unsigned int line);
+extern void z80irq_cancel(struct z80irq *r, unsigned int line);
+
+#endif
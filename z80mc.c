@@ -34,6 +34,9 @@
 #include <sys/mman.h>
 #include "libz80/z80.h"
 #include "sdcard.h"
+#include "trace.h"
+#include "cpuclock.h"
+#include "z80run.h"
 
 static uint8_t bankram[16][32768];
 static uint8_t eprom[32768];
@@ -68,7 +71,7 @@ static uint8_t mem_read(int unused, uint16_t addr)
 {
     uint8_t r;
 
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "R %04X: ", addr);
     if (addr >= 0x8000) {
         r = ram[addr & 0x7FFF];
@@ -77,14 +80,14 @@ static uint8_t mem_read(int unused, uint16_t addr)
     else
         r = bankram[bankreg][addr];
 
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "<- %02X\n", r);
     return r;
 }
 
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
-    if (trace & TRACE_MEM)
+    if (TRACE_ON(trace & TRACE_MEM))
         fprintf(stderr, "W %04X: -> %02X\n", addr, val);
     if (addr >= 0x8000)
         ram[addr & 0x7FFF] = val;
@@ -103,7 +106,7 @@ static uint8_t spi_byte_sent(uint8_t val)
 	uint8_t r = 0xFF;
 	if (sdcard)
 	    r  = sd_spi_in(sdcard, val);
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 		fprintf(stderr,	"[SPI %02X:%02X]\n", val, r);
 	fflush(stdout);
 	return r;
@@ -112,7 +115,7 @@ static uint8_t spi_byte_sent(uint8_t val)
 static void spi_select(uint8_t val)
 {
     if (val) {
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 	    fprintf(stderr,	"[Raised \\CS]\n");
 	sd_bits = 0;
 	sd_bitct = 0;
@@ -120,7 +123,7 @@ static void spi_select(uint8_t val)
 	    sd_spi_raise_cs(sdcard);
 	return;
     } else {
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 	    fprintf(stderr,	"[Lowered \\CS]\n");
         if (sdcard)
             sd_spi_lower_cs(sdcard);
@@ -136,7 +139,7 @@ static void spi_clock(void)
 	    return;
         }
 
-        if (trace & TRACE_SPI)
+        if (TRACE_ON(trace & TRACE_SPI))
             fprintf(stderr, "[SPI clock - txbit = %d ", qreg[5]);
 	sd_bits <<= 1;
 	sd_bits |= qreg[5];
@@ -149,7 +152,7 @@ static void spi_clock(void)
 	sd_miso = (rxbits & 0x80) ? 0x01 : 0x00;
 	rxbits <<= 1;
 	rxbits |= 0x01;
-	if (trace & TRACE_SPI)
+	if (TRACE_ON(trace & TRACE_SPI))
 	    fprintf(stderr, "rxbit = %d]\n", sd_miso);
 }
 
@@ -279,7 +282,7 @@ static void show_settings(struct uart16x50 *uptr)
 {
     uint32_t baud;
 
-    if (!(trace & TRACE_UART))
+    if (!TRACE_ON(trace & TRACE_UART))
         return;
 
     baud = uptr->ls + (uptr->ms << 8);
@@ -364,7 +367,7 @@ static void uart_write(struct uart16x50 *uptr, uint8_t addr, uint8_t val)
     case 4:	/* MCR */
         uptr->mcr = val & 0x3F;
         bankreg = uptr->mcr & 0x0F;
-        if (trace & TRACE_BANK)
+        if (TRACE_ON(trace & TRACE_BANK))
             fprintf(stderr, "[Bank %d selected.\n]", bankreg);
         break;
     case 5:	/* LSR (r/o) */
@@ -441,13 +444,13 @@ static void fpreg_write(uint8_t val)
     fpcol++;
     fpcol &=7;
     fpreg |= fpcol;
-    if (trace & TRACE_FPREG)
+    if (TRACE_ON(trace & TRACE_FPREG))
         fprintf(stderr, "fpreg write %02x now %02x\n", val, fpreg);
 }
 
 static uint8_t qreg_read(uint8_t addr)
 {
-    if (trace & TRACE_QREG)
+    if (TRACE_ON(trace & TRACE_QREG))
         fprintf(stderr, "Q%d Read\n", addr);
     spi_clock();
     return 0xFF;
@@ -455,16 +458,16 @@ static uint8_t qreg_read(uint8_t addr)
 
 static void qreg_write(uint8_t reg, uint8_t v)
 {
-    if (trace & TRACE_QREG)
+    if (TRACE_ON(trace & TRACE_QREG))
         fprintf(stderr, "Q%d -> %d.\n", reg, v);
     qreg[reg] = v;
 
     if (qreg[reg] == v)
         return;
 
-    if ((trace & TRACE_LED) && reg == 2)
+    if (TRACE_ON(trace & TRACE_LED) && reg == 2)
         fprintf(stderr, "Yellow LED to %d.\n", v);
-    if ((trace & TRACE_LED) && reg == 6)
+    if (TRACE_ON(trace & TRACE_LED) && reg == 6)
         fprintf(stderr, "Green LED to %d.\n", v);
     /* FIXME: model UART reset */
     if (reg == 4)
@@ -473,7 +476,7 @@ static void qreg_write(uint8_t reg, uint8_t v)
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "read %02x\n", addr);
     addr &= 0xFF;
     if (addr >= 0x40 && addr <= 0x4F)
@@ -482,14 +485,14 @@ static uint8_t io_read(int unused, uint16_t addr)
         qreg_read(addr & 7);
     if (addr >= 0xC8 && addr <= 0xCF)
         return uart_read(&uart[0], addr & 7);
-    if (trace & TRACE_UNK)
+    if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown read from port %04X\n", addr);
     return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-    if (trace & TRACE_IO)
+    if (TRACE_ON(trace & TRACE_IO))
         fprintf(stderr, "write %02x <- %02x\n", addr & 0xFF, val);
     addr &= 0xFF;
     if (addr >= 0x40 && addr <= 0x4F)
@@ -502,7 +505,7 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
         printf("trace set to %d\n", val);
         trace = val;
     }
-    else if (trace & TRACE_UNK)
+    else if (TRACE_ON(trace & TRACE_UNK))
         fprintf(stderr, "Unknown write to port %02X of %02X\n",
             addr & 0xFF, val);
 }
@@ -522,19 +525,27 @@ static void exit_cleanup(void)
 
 static void usage(void)
 {
-    fprintf(stderr, "z80mc: [-f] [-r rompath] [-s sdcardpath] [-d tracemask]\n");
+    fprintf(stderr, "z80mc: [-f] [-X MHz] [-r rompath] [-s sdcardpath] [-d tracemask]\n");
     exit(EXIT_FAILURE);
 }
 
+/* Every ms: poll the uart and take the timer interrupt */
+static void z80mc_tick(void)
+{
+    uart_event(uart);
+    fpreg |= 0x40;
+    Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
+}
+
 int main(int argc, char *argv[])
 {
-    static struct timespec tc;
+    static struct z80run run;
     int opt;
     int fd;
     char *rompath = "z80mc.rom";
     char *sdpath = NULL;
 
-    while((opt = getopt(argc, argv, "r:s:d:f")) != -1) {
+    while((opt = getopt(argc, argv, "r:s:d:fX:")) != -1) {
         switch(opt) {
             case 'r':
                 rompath = optarg;
@@ -548,6 +559,9 @@ int main(int argc, char *argv[])
             case 'f':
                 fast = 1;
                 break;
+            case 'X':
+                run.hz = cpuclock_parse(optarg);
+                break;
             default:
                 usage();
         }
@@ -574,17 +588,12 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	sd_attach(sdcard, fd);
-	if (trace & TRACE_SD)
+	if (TRACE_ON(trace & TRACE_SD))
 	    sd_trace(sdcard, 1);
     }
 
     uart_init(&uart[0]);
 
-    /* No real need for interrupt accuracy so just go with the timer. If we
-       ever do the UART as timer hack it'll need addressing! */
-    tc.tv_sec = 0;
-    tc.tv_nsec = 1000000L;
-
     if (tcgetattr(0, &term) == 0) {
 	saved_term = term;
 	atexit(exit_cleanup);
@@ -607,20 +616,18 @@ int main(int argc, char *argv[])
     cpu_z80.memWrite = mem_write;
 
     qreg[5] = 1;
-    /* This is the wrong way to do it but it's easier for the moment. We
-       should track how much real time has occurred and try to keep cycle
-       matched with that. The scheme here works fine except when the host
-       is loaded though */
-
-    /* 4MHz Z80 - 4,000,000 tstates / second, and 1000 inits/sec */
-    while (!done) {
-        Z80ExecuteTStates(&cpu_z80, 4000);
-	/* Do 1ms of I/O and delays */
-	if (!fast)
-	    nanosleep(&tc, NULL);
-	uart_event(uart);
-	fpreg |= 0x40;
-        Z80INT(&cpu_z80, 0xFF);	/* actually undefined */
-    }
+    /* 4MHz Z80 - 4,000,000 tstates / second, and 1000 ints/sec. No real
+       need for interrupt accuracy so just go with the timer. If we ever
+       do the UART as timer hack it'll need addressing! */
+    run.cpu = &cpu_z80;
+    if (run.hz == 0)
+        run.hz = 4000000;
+    run.rate = 1000;
+    run.steps = 1;
+    run.ticks = 1;
+    run.tick = z80mc_tick;
+    run.fast = fast;
+    run.done = &done;
+    z80run_loop(&run);
     exit(0);
 }
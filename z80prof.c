@@ -0,0 +1,128 @@
+/*
+ *	Opcode profile report
+ *
+ *	Lists every opcode that ran, most used first, with its share of
+ *	the instructions and T-states, and then the busiest 256 byte pages
+ *	of the address space. Operands show as zero.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "z80dis.h"
+#include "z80prof.h"
+
+struct prof_entry {
+	unsigned int group;
+	unsigned int op;
+	unsigned long long count;
+	unsigned long long tstates;
+};
+
+/* The bytes before the opcode for each group */
+static const uint8_t prof_prefix[Z80PROF_GROUPS][3] = {
+	{ 0 },
+	{ 1, 0xCB },
+	{ 1, 0xED },
+	{ 1, 0xDD },
+	{ 1, 0xFD },
+	{ 2, 0xDD, 0xCB },
+	{ 2, 0xFD, 0xCB }
+};
+
+static int prof_compare(const void *a, const void *b)
+{
+	const struct prof_entry *x = a, *y = b;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return 0;
+}
+
+static void prof_name(char *hex, char *mnemonic, unsigned int group, unsigned int op)
+{
+	const uint8_t *pre = prof_prefix[group];
+	uint8_t code[8];
+	unsigned int n = 0;
+
+	memset(code, 0, sizeof(code));
+	while (n < pre[0]) {
+		code[n] = pre[n + 1];
+		n++;
+	}
+	/* DDCB and FDCB have the displacement before the opcode */
+	if (group >= 5) {
+		code[3] = op;
+		sprintf(hex, "%02X %02X dd %02X", code[0], code[1], op);
+	} else {
+		code[n] = op;
+		if (n)
+			sprintf(hex, "%02X %02X", code[0], op);
+		else
+			sprintf(hex, "%02X", op);
+	}
+	z80_disasm_code(mnemonic, code);
+}
+
+void z80prof_report(FILE *fp, unsigned long long count[][256],
+	unsigned long long tstates[][256], unsigned long long *page)
+{
+	struct prof_entry *e, *ep;
+	unsigned long long total = 0, ttotal = 0;
+	unsigned int g, i, n;
+	char hex[16], mnemonic[64];
+
+	e = calloc(Z80PROF_GROUPS * 256, sizeof(*e));
+	if (e == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	ep = e;
+	for (g = 0; g < Z80PROF_GROUPS; g++) {
+		for (i = 0; i < 256; i++) {
+			if (count[g][i] == 0)
+				continue;
+			ep->group = g;
+			ep->op = i;
+			ep->count = count[g][i];
+			ep->tstates = tstates[g][i];
+			total += ep->count;
+			ttotal += ep->tstates;
+			ep++;
+		}
+	}
+	n = ep - e;
+	if (n == 0) {
+		fprintf(fp, "No profile data: build with make PROFILE=1.\n");
+		free(e);
+		return;
+	}
+	qsort(e, n, sizeof(*e), prof_compare);
+
+	fprintf(fp, "%llu instructions, %llu T-states\n\n", total, ttotal);
+	fprintf(fp, "%14s %6s %14s %6s %6s  %-12s %s\n",
+		"count", "%", "T-states", "%", "avg", "opcode", "instruction");
+	for (ep = e; ep < e + n; ep++) {
+		prof_name(hex, mnemonic, ep->group, ep->op);
+		fprintf(fp, "%14llu %6.2f %14llu %6.2f %6.2f  %-12s %s\n",
+			ep->count, 100.0 * ep->count / total,
+			ep->tstates, 100.0 * ep->tstates / (ttotal ? ttotal : 1),
+			(double)ep->tstates / ep->count, hex, mnemonic);
+	}
+
+	/* Reuse the table for the pages */
+	n = 0;
+	for (i = 0; i < 256; i++) {
+		if (page[i] == 0)
+			continue;
+		e[n].op = i;
+		e[n].count = page[i];
+		n++;
+	}
+	qsort(e, n, sizeof(*e), prof_compare);
+	fprintf(fp, "\n%-6s %14s %6s\n", "page", "count", "%");
+	for (ep = e; ep < e + n; ep++)
+		fprintf(fp, "%02Xxx   %14llu %6.2f\n", ep->op, ep->count,
+			100.0 * ep->count / total);
+	free(e);
+}
@@ -0,0 +1,15 @@
+#ifndef __Z80PROF_H
+#define __Z80PROF_H
+
+/*
+ *	Reports for the libz80 and libz180 opcode profiles. The arrays
+ *	are the count, tstates and page members of a Z80Profile or
+ *	Z180Profile, which share a layout.
+ */
+
+#define Z80PROF_GROUPS	7
+
+extern void z80prof_report(FILE *fp, unsigned long long count[][256],
+	unsigned long long tstates[][256], unsigned long long *page);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ *	Z80 board main loop
+ *
+ *	Each tick sleeps until its deadline on the host clock so the time
+ *	spent emulating counts, and a host that falls a long way behind
+ *	starts afresh rather than running flat out to catch up.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include "cpuclock.h"
+#include "z80run.h"
+
+static int64_t z80run_diff(struct timespec *a, struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+/* Sleep until ns after the last tick */
+static void z80run_sync(const struct z80run *r, struct timespec *next,
+                        unsigned long long ns)
+{
+    struct timespec now;
+
+    next->tv_nsec += ns % 1000000000ULL;
+    next->tv_sec += ns / 1000000000ULL + next->tv_nsec / 1000000000L;
+    next->tv_nsec %= 1000000000L;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (z80run_diff(&now, next) >= 0) {
+        /* Fifty ticks behind is too far to make up */
+        if (z80run_diff(&now, next) > 50 * (int64_t)ns)
+            *next = now;
+        return;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR
+           && (r->done == NULL || !*r->done));
+}
+
+void z80run_loop(const struct z80run *r)
+{
+    struct timespec next;
+    struct cpuclock clk;
+    unsigned long long ns;
+    unsigned int i, t, n;
+
+    cpuclock_init(&clk, r->hz, r->rate);
+    /* The real time one tick of slices takes */
+    ns = 1000000000ULL * r->steps / r->rate;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (r->done == NULL || !*r->done) {
+        for (t = 0; t < r->ticks; t++) {
+            for (i = 0; i < r->steps; i++) {
+                n = cpuclock_slice(&clk);
+                cpuclock_ran(&clk, n, Z80ExecuteTStates(r->cpu, n));
+                if (r->step)
+                    r->step();
+            }
+            if (!r->fast)
+                z80run_sync(r, &next, ns);
+            if (r->tick)
+                r->tick();
+        }
+        if (r->frame)
+            r->frame();
+    }
+}
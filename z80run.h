@@ -0,0 +1,30 @@
+#ifndef __Z80RUN_H
+#define __Z80RUN_H
+
+#include "libz80/z80.h"
+
+/*
+ *	Main loop shared by the simpler Z80 boards. The CPU is run in
+ *	slices, rate of them a second, with a device step after each, then
+ *	every so many slices the host sleeps off the real time the slices
+ *	took and the board gets a tick. A frame is a fixed number of ticks,
+ *	for boards with a slower timer to drive. The T-states for each slice
+ *	come from the clock rate, see cpuclock.h.
+ */
+
+struct z80run {
+    Z80Context *cpu;
+    unsigned long hz;		/* CPU clock */
+    unsigned int rate;		/* Slices per second */
+    unsigned int steps;		/* Slices per tick */
+    unsigned int ticks;		/* Ticks per frame */
+    void (*step)(void);		/* After each slice, or NULL */
+    void (*tick)(void);		/* After each tick, or NULL */
+    void (*frame)(void);	/* After each frame, or NULL */
+    int fast;			/* Don't sleep */
+    volatile int *done;		/* Stop when set, or NULL for never */
+};
+
+extern void z80run_loop(const struct z80run *r);
+
+#endif
@@ -0,0 +1,416 @@
+/*
+ *	Sampling profiler
+ *
+ *	Each sample bumps a count for PC and for the call chain it was in.
+ *	The chain is found by scanning up the stack for words that sit just
+ *	after a CALL or RST. With symbols loaded a word only counts when the
+ *	call went to the function we think we are in, which weeds out most
+ *	of the data that happens to look like a return address. Chains are
+ *	kept by function rather than by address so they stay few.
+ *
+ *	Symbol maps are read a line at a time and may be SDCC (value then
+ *	name), z88dk (name = $value ...), a NoICE style DEF name value, or
+ *	just "address name" in hex.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include "z80dis.h"
+#include "z80samp.h"
+
+#define SAMP_HASH	4096
+#define SAMP_CHAINS	65536	/* After this new chains are just counted */
+#define SAMP_SCAN	32	/* Stack words looked at */
+#define SAMP_TOP	32	/* Busiest addresses listed */
+
+struct samp_sym {
+	uint16_t addr;
+	char *name;
+};
+
+struct samp_chain {
+	struct samp_chain *next;
+	unsigned int depth;
+	uint32_t frame[Z80SAMP_DEPTH + 1];	/* Leaf first */
+	unsigned long long count;
+};
+
+struct z80samp {
+	uint8_t (*peek)(uint16_t addr);
+	unsigned long long hits[65536];
+	unsigned long long total;
+	unsigned long long lost;
+	struct samp_chain *hash[SAMP_HASH];
+	unsigned int nchain;
+	struct samp_sym *sym;
+	unsigned int nsym;
+};
+
+struct z80samp *z80samp_create(uint8_t (*peek)(uint16_t addr))
+{
+	struct z80samp *s = calloc(1, sizeof(struct z80samp));
+	if (s == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	s->peek = peek;
+	return s;
+}
+
+/*
+ *	Symbols
+ */
+
+static int sym_compare(const void *a, const void *b)
+{
+	const struct samp_sym *x = a, *y = b;
+	return x->addr - y->addr;
+}
+
+/* A hex value, optionally with a 0x, $ or bank: prefix */
+static int map_value(const char *p, unsigned long *v)
+{
+	const char *c = strchr(p, ':');
+	char *e;
+
+	if (c)
+		p = c + 1;
+	if (*p == '$')
+		p++;
+	if (!isxdigit((unsigned char)*p))
+		return -1;
+	*v = strtoul(p, &e, 16);
+	if (*e && *e != 'h' && *e != 'H')
+		return -1;
+	return *v > 0xFFFF ? -1 : 0;
+}
+
+static int map_name(const char *p)
+{
+	if (!isalpha((unsigned char)*p) && *p != '_' && *p != '.')
+		return 0;
+	/* SDCC area starts and lengths are not code */
+	if (strncmp(p, "s__", 3) == 0 || strncmp(p, "l__", 3) == 0)
+		return 0;
+	if (strncmp(p, ".__.", 4) == 0)
+		return 0;
+	return 1;
+}
+
+static int map_line(char *l, unsigned long *v, char **name)
+{
+	char *tok[4];
+	unsigned int n = 0;
+	char *p = strtok(l, " \t\r\n");
+
+	while (p && n < 4) {
+		tok[n++] = p;
+		p = strtok(NULL, " \t\r\n");
+	}
+	if (n < 2)
+		return -1;
+	/* z88dk: name = $value ; ... */
+	if (n >= 3 && strcmp(tok[1], "=") == 0) {
+		*name = tok[0];
+		return map_value(tok[2], v) || !map_name(*name) ? -1 : 0;
+	}
+	/* NoICE: DEF name value */
+	if (n >= 3 && strcasecmp(tok[0], "DEF") == 0) {
+		*name = tok[1];
+		return map_value(tok[2], v) || !map_name(*name) ? -1 : 0;
+	}
+	/* SDCC and plain lists: value name */
+	*name = tok[1];
+	return map_value(tok[0], v) || !map_name(*name) ? -1 : 0;
+}
+
+int z80samp_load_map(struct z80samp *s, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char buf[512];
+	unsigned int size = s->nsym;
+	unsigned long v;
+	char *name;
+
+	if (fp == NULL)
+		return -1;
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (map_line(buf, &v, &name))
+			continue;
+		if (s->nsym == size) {
+			size = size ? 2 * size : 256;
+			s->sym = realloc(s->sym, size * sizeof(struct samp_sym));
+			if (s->sym == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
+			}
+		}
+		s->sym[s->nsym].addr = v;
+		s->sym[s->nsym].name = strdup(name);
+		if (s->sym[s->nsym].name == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		s->nsym++;
+	}
+	fclose(fp);
+	qsort(s->sym, s->nsym, sizeof(struct samp_sym), sym_compare);
+	return 0;
+}
+
+/* The symbol at or below an address, or -1 */
+static int sym_find(struct z80samp *s, uint16_t addr)
+{
+	int lo = 0, hi = s->nsym - 1, r = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (s->sym[mid].addr <= addr) {
+			r = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return r;
+}
+
+/* Chains are kept by function start when we know it. Addresses with no
+   symbol are kept as they are with bit 16 set to tell them apart */
+static uint32_t sym_key(struct z80samp *s, uint16_t addr)
+{
+	int n = sym_find(s, addr);
+	if (n == -1)
+		return 0x10000 | addr;
+	return s->sym[n].addr;
+}
+
+static const char *key_name(struct z80samp *s, uint32_t key, char *buf)
+{
+	int n;
+
+	if (!(key & 0x10000)) {
+		n = sym_find(s, key);
+		if (n != -1)
+			return s->sym[n].name;
+	}
+	sprintf(buf, "0x%04X", key & 0xFFFF);
+	return buf;
+}
+
+/*
+ *	Sampling
+ */
+
+/* If the word could be a return address give the call target, or -1 */
+static int32_t call_target(struct z80samp *s, uint16_t ret)
+{
+	uint8_t op = s->peek(ret - 3);
+
+	if (op == 0xCD || (op & 0xC7) == 0xC4)
+		return s->peek(ret - 2) | (s->peek(ret - 1) << 8);
+	op = s->peek(ret - 1);
+	if ((op & 0xC7) == 0xC7)
+		return op & 0x38;
+	return -1;
+}
+
+static unsigned int chain_hash(struct samp_chain *c)
+{
+	unsigned int h = c->depth;
+	unsigned int i;
+
+	for (i = 0; i <= c->depth; i++)
+		h = h * 31 + c->frame[i];
+	return h & (SAMP_HASH - 1);
+}
+
+void z80samp_sample(struct z80samp *s, uint16_t pc, uint16_t sp)
+{
+	struct samp_chain c, *p;
+	unsigned int i, h;
+	int32_t t;
+	uint16_t w;
+
+	s->hits[pc]++;
+	s->total++;
+
+	c.depth = 0;
+	c.frame[0] = sym_key(s, pc);
+	for (i = 0; i < SAMP_SCAN && c.depth < Z80SAMP_DEPTH; i++) {
+		w = s->peek(sp + 2 * i) | (s->peek(sp + 2 * i + 1) << 8);
+		t = call_target(s, w);
+		if (t == -1)
+			continue;
+		if (s->nsym && sym_key(s, t) != c.frame[c.depth])
+			continue;
+		c.frame[++c.depth] = sym_key(s, w - 1);
+	}
+
+	h = chain_hash(&c);
+	for (p = s->hash[h]; p; p = p->next) {
+		if (p->depth == c.depth &&
+		    memcmp(p->frame, c.frame, (c.depth + 1) * sizeof(uint32_t)) == 0) {
+			p->count++;
+			return;
+		}
+	}
+	if (s->nchain == SAMP_CHAINS) {
+		s->lost++;
+		return;
+	}
+	p = malloc(sizeof(struct samp_chain));
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	*p = c;
+	p->count = 1;
+	p->next = s->hash[h];
+	s->hash[h] = p;
+	s->nchain++;
+}
+
+/*
+ *	Reports
+ */
+
+struct samp_entry {
+	uint32_t key;
+	unsigned long long self;
+	unsigned long long total;
+};
+
+static int entry_compare(const void *a, const void *b)
+{
+	const struct samp_entry *x = a, *y = b;
+	if (x->self != y->self)
+		return x->self < y->self ? 1 : -1;
+	if (x->total != y->total)
+		return x->total < y->total ? 1 : -1;
+	return 0;
+}
+
+static void samp_disasm(struct z80samp *s, char *buf, uint16_t addr)
+{
+	uint8_t code[6];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(code); i++)
+		code[i] = s->peek(addr + i);
+	z80_disasm_code_at(buf, code, addr);
+}
+
+void z80samp_report(struct z80samp *s, FILE *fp, unsigned int period)
+{
+	struct samp_entry *e, top[SAMP_TOP];
+	struct samp_chain *c;
+	unsigned int n = 0, i, j, k;
+	unsigned long long total = s->total ? s->total : 1;
+	char hex[8], where[80], mnemonic[64];
+	int sym;
+
+	/* Keys are function starts or addresses with bit 16 set */
+	e = calloc(0x20000, sizeof(*e));
+	if (e == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (i = 0; i < SAMP_HASH; i++) {
+		for (c = s->hash[i]; c; c = c->next) {
+			e[c->frame[0]].self += c->count;
+			/* Recursion only counts once towards the total */
+			for (j = 0; j <= c->depth; j++) {
+				for (k = 0; k < j; k++)
+					if (c->frame[k] == c->frame[j])
+						break;
+				if (k == j)
+					e[c->frame[j]].total += c->count;
+			}
+		}
+	}
+	for (i = 0; i < 0x20000; i++) {
+		if (e[i].total == 0)
+			continue;
+		e[n] = e[i];
+		e[n++].key = i;
+	}
+	qsort(e, n, sizeof(*e), entry_compare);
+
+	fprintf(fp, "%llu samples, one every %u T-states", s->total, period);
+	if (s->lost)
+		fprintf(fp, ", %llu not given a call chain", s->lost);
+	fprintf(fp, "\n\n%10s %6s %10s %6s  %s\n", "self", "%", "total", "%", "function");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%10llu %6.2f %10llu %6.2f  %s\n",
+			e[i].self, 100.0 * e[i].self / total,
+			e[i].total, 100.0 * e[i].total / total,
+			key_name(s, e[i].key, hex));
+	free(e);
+
+	/* Then the busiest single addresses */
+	n = 0;
+	for (i = 0; i < 65536; i++) {
+		if (s->hits[i] == 0)
+			continue;
+		if (n == SAMP_TOP && top[n - 1].self >= s->hits[i])
+			continue;
+		j = n < SAMP_TOP ? n++ : SAMP_TOP - 1;
+		while (j > 0 && top[j - 1].self < s->hits[i]) {
+			top[j] = top[j - 1];
+			j--;
+		}
+		top[j].key = i;
+		top[j].self = s->hits[i];
+	}
+	fprintf(fp, "\n%10s %6s  %-4s  %-28s %s\n", "samples", "%", "addr", "where", "instruction");
+	for (i = 0; i < n; i++) {
+		sym = sym_find(s, top[i].key);
+		if (sym == -1)
+			where[0] = 0;
+		else
+			snprintf(where, sizeof(where), "%s+0x%X", s->sym[sym].name,
+				top[i].key - s->sym[sym].addr);
+		samp_disasm(s, mnemonic, top[i].key);
+		fprintf(fp, "%10llu %6.2f  %04X  %-28s %s\n", top[i].self,
+			100.0 * top[i].self / total, top[i].key, where, mnemonic);
+	}
+}
+
+/* One line per chain, outermost caller first, as flamegraph.pl wants */
+void z80samp_folded(struct z80samp *s, FILE *fp)
+{
+	struct samp_chain *c;
+	unsigned int i;
+	int j;
+	char hex[8];
+
+	for (i = 0; i < SAMP_HASH; i++) {
+		for (c = s->hash[i]; c; c = c->next) {
+			for (j = c->depth; j >= 0; j--)
+				fprintf(fp, "%s%s", key_name(s, c->frame[j], hex),
+					j ? ";" : "");
+			fprintf(fp, " %llu\n", c->count);
+		}
+	}
+}
+
+void z80samp_free(struct z80samp *s)
+{
+	struct samp_chain *c, *n;
+	unsigned int i;
+
+	for (i = 0; i < SAMP_HASH; i++) {
+		for (c = s->hash[i]; c; c = n) {
+			n = c->next;
+			free(c);
+		}
+	}
+	for (i = 0; i < s->nsym; i++)
+		free(s->sym[i].name);
+	free(s->sym);
+	free(s);
+}
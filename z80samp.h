@@ -0,0 +1,26 @@
+#ifndef __Z80SAMP_H
+#define __Z80SAMP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ *	Sampling profiler for Z80 family guests. The board takes a sample
+ *	of PC and SP every so often, typically off an event, so nothing is
+ *	paid per instruction. Call chains are guessed by looking up the
+ *	stack for words that follow a CALL or RST. Addresses are named
+ *	from a symbol map when one is loaded and disassembled otherwise.
+ */
+
+#define Z80SAMP_DEPTH	8	/* Most callers kept per sample */
+
+struct z80samp;
+
+extern struct z80samp *z80samp_create(uint8_t (*peek)(uint16_t addr));
+extern int z80samp_load_map(struct z80samp *s, const char *path);
+extern void z80samp_sample(struct z80samp *s, uint16_t pc, uint16_t sp);
+extern void z80samp_report(struct z80samp *s, FILE *fp, unsigned int period);
+extern void z80samp_folded(struct z80samp *s, FILE *fp);
+extern void z80samp_free(struct z80samp *s);
+
+#endif
@@ -19,6 +19,7 @@
 #include "libz80/z80.h"
 #include "acia.h"
 #include "ide.h"
+#include "trace.h"
 
 static uint8_t baseram[49152];
 static uint8_t bankram[16][16384];
@@ -47,7 +48,7 @@ static uint8_t mem_read(int unused, uint16_t addr)
 {
 	uint8_t r;
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "R");
 	if (addr < 16384) {
 		if (romen)
@@ -57,14 +58,14 @@ static uint8_t mem_read(int unused, uint16_t addr)
 	} else
 		r = baseram[addr - 16384];
 
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, " %04X <- %02X\n", addr, r);
 	return r;
 }
 
 static void mem_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_MEM)
+	if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "W %04X -> %02X\n", addr, val);
 	if (addr <16384) {
 		if (romen)
@@ -79,7 +80,7 @@ static void mem_write(int unused, uint16_t addr, uint8_t val)
 		}
 	} else if (addr >= 23296)
 		baseram[addr - 16384] = val;
-	else if (trace & TRACE_MEM)
+	else if (TRACE_ON(trace & TRACE_MEM))
 		fprintf(stderr, "[PC = %04X: LORAM write %04X %02x]\n",
 			cpu_z80.PC, addr, val);
 }
@@ -144,7 +145,7 @@ static uint8_t timer_int;
 
 static uint8_t io_read(int unused, uint16_t addr)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "read %02x\n", addr);
 	addr &= 0xFF;
 	if (addr < 0x10)
@@ -156,14 +157,14 @@ static uint8_t io_read(int unused, uint16_t addr)
 		timer_int = 0;
 		return r;
 	}
-	if (trace & TRACE_UNK)
+	if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr, "Unknown read from port %04X\n", addr);
 	return 0xFF;
 }
 
 static void io_write(int unused, uint16_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
+	if (TRACE_ON(trace & TRACE_IO))
 		fprintf(stderr, "write %02x <- %02x\n", addr, val);
 	addr &= 0xFF;
 	if (addr < 0x10)
@@ -173,16 +174,16 @@ static void io_write(int unused, uint16_t addr, uint8_t val)
 	else if (addr == 0x10) {
 		banknum = val & 0x0F;
 		romen = val & 0x80;
-		if (trace & TRACE_BANK)
+		if (TRACE_ON(trace & TRACE_BANK))
 			fprintf(stderr, "Bank set to %d, ROMEN %d.\n",
 				banknum, romen);
 	 } else if (addr == 0x11) {
 	 	wprotect = val;
-		if (trace & TRACE_BANK)
+		if (TRACE_ON(trace & TRACE_BANK))
 			fprintf(stderr, "Wprotect set to %X\n", wprotect);
 	} else if (addr == 0xFD)
 		trace = val;
-	else if (trace & TRACE_UNK)
+	else if (TRACE_ON(trace & TRACE_UNK))
 		fprintf(stderr,
 			"Unknown write to port %04X of %02X\n", addr, val);
 }
@@ -16,6 +16,7 @@
 
 struct zxkey {
  struct keymatrix *matrix;
+ uint8_t scan[256];	/* Result for each high address byte */
 };
 
 static SDL_Keycode zxkeys[] = {
@@ -32,17 +33,28 @@ static SDL_Keycode zxkeys[] = {
   SDLK_5, SDLK_t, SDLK_6, SDLK_g, SDLK_y, SDLK_v, SDLK_h, SDLK_b
 };
 
-/* The ZXKey feeds the low 8bits of the address into the decode and returns
-   data based upon the keys active. It's all pulled up so invert everything */
+/* The ZXKey feeds the high 8bits of the address into the decode and returns
+   data based upon the keys active. It's all pulled up so invert everything.
+   Drivers scan all the time, so the answer for every address is worked
+   out when a key changes rather than on each read */
+
+static void zxkey_update(struct zxkey *zx)
+{
+    unsigned int n;
+
+    for (n = 0; n < 256; n++)
+        zx->scan[n] = ~keymatrix_input(zx->matrix, ~n & 0xFF);
+}
 
 uint8_t zxkey_scan(struct zxkey *zx, uint16_t addr)
 {
-    return ~keymatrix_input(zx->matrix, ~(addr >> 8));
+    return zx->scan[addr >> 8];
 }
 
 void zxkey_reset(struct zxkey *zx)
 {
     keymatrix_reset(zx->matrix);
+    zxkey_update(zx);
 }
 
 struct zxkey *zxkey_create(void)
@@ -53,6 +65,7 @@ struct zxkey *zxkey_create(void)
         exit(1);
     }
     zx->matrix = keymatrix_create(5, 8, zxkeys);
+    zxkey_update(zx);
     return zx;
 }
 
@@ -63,5 +76,8 @@ void zxkey_trace(struct zxkey *zx, int onoff)
 
 bool zxkey_SDL2event(struct zxkey *zx, SDL_Event *ev)
 {
-   return keymatrix_SDL2event(zx->matrix, ev);
+   if (!keymatrix_SDL2event(zx->matrix, ev))
+       return false;
+   zxkey_update(zx);
+   return true;
 }